@@ -31,6 +31,30 @@
 #include <unistd.h>
 #include "icc.h"
 
+/* Use POSIX threads for parallel helpers, unless disabled. */
+/* Counters shared between threads use the gcc/clang atomic builtins. */
+/* Updates release and reads acquire, so that a thread that sees a */
+/* reference count fall also sees the releasing thread's use of the */
+/* object, before deleting it. */
+#if !defined(ICM_NO_THREADS) && !defined(_WIN32) && defined(__GNUC__)
+# define ICM_THREADS
+# include <pthread.h>
+# define ICM_ATOMIC_ADD(xx, vv) __atomic_add_fetch(&(xx), (vv), __ATOMIC_ACQ_REL)
+# define ICM_ATOMIC_SUB(xx, vv) __atomic_sub_fetch(&(xx), (vv), __ATOMIC_ACQ_REL)
+# define ICM_ATOMIC_GET(xx) __atomic_load_n(&(xx), __ATOMIC_ACQUIRE)
+#else
+# define ICM_ATOMIC_ADD(xx, vv) ((xx) += (vv))
+# define ICM_ATOMIC_SUB(xx, vv) ((xx) -= (vv))
+# define ICM_ATOMIC_GET(xx) (xx)
+#endif
+
+/* Use the F16C half float conversion instructions if the compiler */
+/* has been told they are available (e.g. -mf16c or -march=native) */
+#if defined(__F16C__) && !defined(ICM_NO_F16C)
+# define ICM_F16C
+# include <immintrin.h>
+#endif
+
 /* Forced byte alignment for tag table and tags */
 #define ALIGN_SIZE 4
 
@@ -177,6 +201,176 @@ static size_t ssat_mul(size_t a, size_t b) {
         return a * b;
 }
 
+/* ------------------------------------------------- */
+/* Memory accounting. Each icc allocates through an icmAllocAcct */
+/* wrapped around its allocator, that notes the size and category */
+/* of each block, and keeps totals for the icc and for all of them. */
+
+#ifdef ICM_THREADS
+static pthread_mutex_t icmMemLock = PTHREAD_MUTEX_INITIALIZER;    /* List and unloading */
+# define ICM_LOCK(xx) pthread_mutex_lock(&xx)
+# define ICM_UNLOCK(xx) pthread_mutex_unlock(&xx)
+#else
+# define ICM_LOCK(xx)
+# define ICM_UNLOCK(xx)
+#endif
+
+/* Memory accounting state of all the icc objects */
+static struct {
+    icc *head;                    /* List of icc objects */
+    unsigned int nicc;            /* Number in list */
+    size_t budget;                /* Budget, 0 if none */
+    size_t bytes[icmMemN];        /* Total allocated */
+    unsigned long clock;        /* Tag read clock */
+    unsigned long reads, rereads, evictions;
+} icmMem;
+
+/* Header of each accounted block */
+typedef union {
+    struct {
+        size_t size;            /* Size of the block */
+        int cat;                /* icmMemCat it was allocated in */
+    } h;
+    double align_d;                /* Alignment of the block that follows */
+    void *align_p;
+} icmAcctHdr;
+
+/* Accounting allocator */
+struct _icmAllocAcct {
+    ICM_ALLOC_BASE
+
+    /* Private: */
+    icmAlloc *base;                /* Allocator being accounted */
+    icmMemCat cat;                /* Category of new blocks */
+    size_t bytes[icmMemN];        /* Bytes allocated now */
+    unsigned long reads, rereads, evictions;
+}; typedef struct _icmAllocAcct icmAllocAcct;
+
+#ifdef ICC_DEBUG_MALLOC
+# define ACCT_DARGS , char *file, int line
+#else
+# define ACCT_DARGS
+#endif
+
+/* Add a (possibly negative) size to a category. The counts are */
+/* updated atomically, so that allocating doesn't take a lock. */
+static void icmAllocAcct_count(icmAllocAcct *p, int cat, size_t size, int add) {
+    if (add) {
+        ICM_ATOMIC_ADD(p->bytes[cat], size);
+        ICM_ATOMIC_ADD(icmMem.bytes[cat], size);
+    } else {
+        ICM_ATOMIC_SUB(p->bytes[cat], size);
+        ICM_ATOMIC_SUB(icmMem.bytes[cat], size);
+    }
+}
+
+static void *icmAllocAcct_malloc(icmAlloc *pp, size_t size ACCT_DARGS) {
+    icmAllocAcct *p = (icmAllocAcct *)pp;
+    icmAcctHdr *hp;
+
+    if (size > (SIZE_MAX - sizeof(icmAcctHdr)))
+        return NULL;
+    if ((hp = (icmAcctHdr *)p->base->malloc(p->base, sizeof(icmAcctHdr) + size)) == NULL)
+        return NULL;
+    hp->h.size = size;
+    hp->h.cat = p->cat;
+    icmAllocAcct_count(p, hp->h.cat, size, 1);
+    return (void *)(hp + 1);
+}
+
+static void *icmAllocAcct_calloc(icmAlloc *pp, size_t num, size_t size ACCT_DARGS) {
+    icmAllocAcct *p = (icmAllocAcct *)pp;
+    icmAcctHdr *hp;
+
+    if ((size = ssat_mul(num, size)) == SIZE_MAX || size > (SIZE_MAX - sizeof(icmAcctHdr)))
+        return NULL;
+    if ((hp = (icmAcctHdr *)p->base->calloc(p->base, 1, sizeof(icmAcctHdr) + size)) == NULL)
+        return NULL;
+    hp->h.size = size;
+    hp->h.cat = p->cat;
+    icmAllocAcct_count(p, hp->h.cat, size, 1);
+    return (void *)(hp + 1);
+}
+
+static void *icmAllocAcct_realloc(icmAlloc *pp, void *ptr, size_t size ACCT_DARGS) {
+    icmAllocAcct *p = (icmAllocAcct *)pp;
+    icmAcctHdr *hp;
+    size_t osize;
+
+    if (ptr == NULL)
+        return icmAllocAcct_malloc(pp, size
+#ifdef ICC_DEBUG_MALLOC
+                                   , file, line
+#endif
+                                   );
+    if (size > (SIZE_MAX - sizeof(icmAcctHdr)))
+        return NULL;
+    hp = (icmAcctHdr *)ptr - 1;
+    osize = hp->h.size;
+    if ((hp = (icmAcctHdr *)p->base->realloc(p->base, (void *)hp,
+                                              sizeof(icmAcctHdr) + size)) == NULL)
+        return NULL;
+    hp->h.size = size;
+    if (size >= osize)
+        icmAllocAcct_count(p, hp->h.cat, size - osize, 1);
+    else
+        icmAllocAcct_count(p, hp->h.cat, osize - size, 0);
+    return (void *)(hp + 1);
+}
+
+static void icmAllocAcct_free(icmAlloc *pp, void *ptr ACCT_DARGS) {
+    icmAllocAcct *p = (icmAllocAcct *)pp;
+    icmAcctHdr *hp;
+
+    if (ptr == NULL)
+        return;
+    hp = (icmAcctHdr *)ptr - 1;
+    icmAllocAcct_count(p, hp->h.cat, hp->h.size, 0);
+    p->base->free(p->base, (void *)hp);
+}
+
+/* The icc deletes the base allocator itself, if it owns it */
+static void icmAllocAcct_delete(icmAlloc *pp) {
+    icmAllocAcct *p = (icmAllocAcct *)pp;
+    icmAlloc *base = p->base;
+
+    base->free(base, (void *)p);
+}
+
+/* Create an accounting allocator around base */
+static icmAlloc *new_icmAllocAcct(icmAlloc *base) {
+    icmAllocAcct *p;
+
+    if ((p = (icmAllocAcct *) base->calloc(base, 1, sizeof(icmAllocAcct))) == NULL)
+        return NULL;
+#ifdef ICC_DEBUG_MALLOC
+    p->dmalloc  = icmAllocAcct_malloc;
+    p->dcalloc  = icmAllocAcct_calloc;
+    p->drealloc = icmAllocAcct_realloc;
+    p->dfree    = icmAllocAcct_free;
+#else
+    p->malloc   = icmAllocAcct_malloc;
+    p->calloc   = icmAllocAcct_calloc;
+    p->realloc  = icmAllocAcct_realloc;
+    p->free     = icmAllocAcct_free;
+#endif
+    p->del      = icmAllocAcct_delete;
+    p->base     = base;
+    p->cat      = icmMemOther;
+
+    return (icmAlloc *)p;
+}
+
+/* Set the category of the memory an icc allocates next, */
+/* returning the previous one. */
+static icmMemCat icc_memcat(icc *p, icmMemCat cat) {
+    icmAllocAcct *ap = (icmAllocAcct *)p->al;
+    icmMemCat ocat = ap->cat;
+
+    ap->cat = cat;
+    return ocat;
+}
+
 /* ------------------------------------------------- */
 /* Memory image icmFile compatible class */
 /* Buffer is assumed to be a fixed size, and externally allocated */
@@ -1373,10 +1567,16 @@ static const char *string_TypeSignature(icTagTypeSignature sig) {
             return "Lut16";
         case icSigLut8Type:
             return "Lut8";
+        case icSigLutAtoBType:
+            return "LutAtoB";
+        case icSigLutBtoAType:
+            return "LutBtoA";
         case icSigMeasurementType:
             return "Measurement";
         case icSigNamedColorType:
             return "Named Color";
+        case icSigParametricCurveType:
+            return "Parametric Curve";
         case icSigProfileSequenceDescType:
             return "Profile Sequence Desc";
         case icSigS15Fixed16ArrayType:
@@ -1700,6 +1900,8 @@ static const char *string_LuAlg(icmLuAlgType alg) {
             return "MatrixBwd";
         case icmLutType:
             return "Lut";
+        case icmLutABType:
+            return "LutAB";
     default:
         sprintf(buf,"Unrecognized - %d",alg);
         return buf;
@@ -1752,6 +1954,41 @@ const char *icm2str(icmEnumType etype, int enumval) {
 
 /* ========================================================== */
 /* Object I/O routines                                        */
+/* ========================================================== */
+/* Tag write buffers */
+
+/* Return a buffer to encode len bytes of tag data destined for file */
+/* offset of. When write_mem() is writing into a single memory buffer */
+/* this points directly into it, otherwise it is allocated. */
+/* Return NULL on failure. */
+static char *icc_wbuf_get(icc *icp, unsigned int of, unsigned int len) {
+    if (icp->wbase != NULL) {
+        if (of > icp->wsize || len > (icp->wsize - of))
+            return NULL;
+        return icp->wbase + of;
+    }
+    return (char *) icp->al->malloc(icp->al, len);
+}
+
+/* Write an encoded buffer to the file, leaving the file positioned after it. */
+/* Return nz on failure. */
+static int icc_wbuf_put(icc *icp, char *buf, unsigned int of, unsigned int len) {
+    if (icp->wbase != NULL) {        /* Already in place */
+        ((icmFileMem *)icp->fp)->cur = (unsigned char *)buf + len;
+        return 0;
+    }
+    if (icp->fp->seek(icp->fp, of) != 0
+     || icp->fp->write(icp->fp, buf, 1, len) != len)
+        return 1;
+    return 0;
+}
+
+/* Release a buffer from icc_wbuf_get() */
+static void icc_wbuf_free(icc *icp, char *buf) {
+    if (icp->wbase == NULL)
+        icp->al->free(icp->al, buf);
+}
+
 /* ========================================================== */
 /* icmUnknown object */
 
@@ -1833,7 +2070,7 @@ static int icmUnknown_write(
         sprintf(icp->err,"icmUnknown_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmUnknown_write malloc() failed");
         return icp->errc = 2;
     }
@@ -1842,7 +2079,7 @@ static int icmUnknown_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->uttype,bp)) != 0) {
         sprintf(icp->err,"icmUnknown_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -1852,19 +2089,18 @@ static int icmUnknown_write(
     for (i = 0; i < p->size; i++, bp += 1) {
         if ((rv = write_UInt8Number(p->data[i],bp)) != 0) {
             sprintf(icp->err,"icmUnknown_write: write_UInt8umber() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmUnknown_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -2073,7 +2309,7 @@ static int icmUInt8Array_write(
         sprintf(icp->err,"icmUInt8Array_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmUInt8Array_write malloc() failed");
         return icp->errc = 2;
     }
@@ -2082,7 +2318,7 @@ static int icmUInt8Array_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmUInt8Array_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -2092,19 +2328,18 @@ static int icmUInt8Array_write(
     for (i = 0; i < p->size; i++, bp += 1) {
         if ((rv = write_UInt8Number(p->data[i],bp)) != 0) {
             sprintf(icp->err,"icmUInt8Array_write: write_UInt8umber() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmUInt8Array_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -2268,7 +2503,7 @@ static int icmUInt16Array_write(
         sprintf(icp->err,"icmUInt16Array_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmUInt16Array_write malloc() failed");
         return icp->errc = 2;
     }
@@ -2277,7 +2512,7 @@ static int icmUInt16Array_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmUInt16Array_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -2287,19 +2522,18 @@ static int icmUInt16Array_write(
     for (i = 0; i < p->size; i++, bp += 2) {
         if ((rv = write_UInt16Number(p->data[i],bp)) != 0) {
             sprintf(icp->err,"icmUInt16Array_write: write_UInt16umber() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmUInt16Array_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -2463,7 +2697,7 @@ static int icmUInt32Array_write(
         sprintf(icp->err,"icmUInt32Array_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmUInt32Array_write malloc() failed");
         return icp->errc = 2;
     }
@@ -2472,7 +2706,7 @@ static int icmUInt32Array_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmUInt32Array_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -2482,19 +2716,18 @@ static int icmUInt32Array_write(
     for (i = 0; i < p->size; i++, bp += 4) {
         if ((rv = write_UInt32Number(p->data[i],bp)) != 0) {
             sprintf(icp->err,"icmUInt32Array_write: write_UInt32umber() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmUInt32Array_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -2658,7 +2891,7 @@ static int icmUInt64Array_write(
         sprintf(icp->err,"icmUInt64Array_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmUInt64Array_write malloc() failed");
         return icp->errc = 2;
     }
@@ -2667,7 +2900,7 @@ static int icmUInt64Array_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmUInt64Array_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -2677,19 +2910,18 @@ static int icmUInt64Array_write(
     for (i = 0; i < p->size; i++, bp += 8) {
         if ((rv = write_UInt64Number(&p->data[i],bp)) != 0) {
             sprintf(icp->err,"icmUInt64Array_write: write_UInt64umber() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmUInt64Array_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -2853,7 +3085,7 @@ static int icmU16Fixed16Array_write(
         sprintf(icp->err,"icmU16Fixed16Array_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmU16Fixed16Array_write malloc() failed");
         return icp->errc = 2;
     }
@@ -2862,7 +3094,7 @@ static int icmU16Fixed16Array_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmU16Fixed16Array_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -2872,19 +3104,18 @@ static int icmU16Fixed16Array_write(
     for (i = 0; i < p->size; i++, bp += 4) {
         if ((rv = write_U16Fixed16Number(p->data[i],bp)) != 0) {
             sprintf(icp->err,"icmU16Fixed16Array_write: write_U16Fixed16umber() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmU16Fixed16Array_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -3047,7 +3278,7 @@ static int icmS15Fixed16Array_write(
         sprintf(icp->err,"icmS15Fixed16Array_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmS15Fixed16Array_write malloc() failed");
         return icp->errc = 2;
     }
@@ -3056,7 +3287,7 @@ static int icmS15Fixed16Array_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmS15Fixed16Array_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -3066,19 +3297,18 @@ static int icmS15Fixed16Array_write(
     for (i = 0; i < p->size; i++, bp += 4) {
         if ((rv = write_S15Fixed16Number(p->data[i],bp)) != 0) {
             sprintf(icp->err,"icmS15Fixed16Array_write: write_S15Fixed16umber() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmS15Fixed16Array_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -3283,7 +3513,7 @@ static int icmXYZArray_write(
         sprintf(icp->err,"icmXYZArray_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmXYZArray_write malloc() failed");
         return icp->errc = 2;
     }
@@ -3292,7 +3522,7 @@ static int icmXYZArray_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmXYZArray_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -3302,19 +3532,18 @@ static int icmXYZArray_write(
     for (i = 0; i < p->size; i++, bp += 12) {
         if ((rv = write_XYZNumber(&p->data[i],bp)) != 0) {
             sprintf(icp->err,"icmXYZArray_write: write_XYZumber() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmXYZArray_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -3397,6 +3626,150 @@ static icmBase *new_icmXYZArray(
 /* ---------------------------------------------------------- */
 /* icmCurve object */
 
+/* Return the number of parameters of a parametric curve function type, */
+/* 0 if the type is not known. */
+static unsigned int icmCurve_para_nparams(icParametricCurveFunctionType ctype) {
+    switch (ctype) {
+        case icCurveFunction1:
+            return 1;
+        case icCurveFunction3:
+            return 3;
+        case icCurveFunction4:
+            return 4;
+        case icCurveFunction5:
+            return 5;
+        case icCurveFunction7:
+            return 7;
+        default:
+            return 0;
+    }
+}
+
+/* Power function that is zero for a non-positive base */
+static double icmCurve_ppow(double x, double g) {
+    if (x <= 0.0)
+        return 0.0;
+    return pow(x, g);
+}
+
+/* Evaluate a parametric curve in closed form. */
+/* Return 0 on success, 1 if clipping occured */
+static int icmCurve_para_fwd(
+    icmCurve *p,
+    double *out,
+    double *in
+) {
+    double *pp = p->data;        /* g, a, b, c, d, e, f */
+    double x = *in, y;
+    int rv = 0;
+
+    if (x < 0.0) {
+        x = 0.0;
+        rv |= 1;
+    } else if (x > 1.0) {
+        x = 1.0;
+        rv |= 1;
+    }
+
+    switch (p->ctype) {
+        case icCurveFunction1:        /* Y = X ^ g */
+            y = icmCurve_ppow(x, pp[0]);
+            break;
+        case icCurveFunction3:        /* Y = (aX + b) ^ g, X >= -b/a, 0 otherwise */
+            y = icmCurve_ppow(pp[1] * x + pp[2], pp[0]);
+            break;
+        case icCurveFunction4:        /* Y = (aX + b) ^ g + c, X >= -b/a, c otherwise */
+            y = icmCurve_ppow(pp[1] * x + pp[2], pp[0]) + pp[3];
+            break;
+        case icCurveFunction5:        /* Y = (aX + b) ^ g, X >= d, cX otherwise */
+            if (x >= pp[4])
+                y = icmCurve_ppow(pp[1] * x + pp[2], pp[0]);
+            else
+                y = pp[3] * x;
+            break;
+        case icCurveFunction7:        /* Y = (aX + b) ^ g + e, X >= d, cX + f otherwise */
+            if (x >= pp[4])
+                y = icmCurve_ppow(pp[1] * x + pp[2], pp[0]) + pp[5];
+            else
+                y = pp[3] * x + pp[6];
+            break;
+        default:
+            y = x;
+            break;
+    }
+
+    /* The function value is clipped to its range */
+    if (y < 0.0)
+        y = 0.0;
+    else if (y > 1.0)
+        y = 1.0;
+    *out = y;
+    return rv;
+}
+
+/* Invert a parametric curve in closed form. */
+/* Return 0 on success, 1 if clipping occured */
+static int icmCurve_para_bwd(
+    icmCurve *p,
+    double *out,
+    double *in
+) {
+    double *pp = p->data;        /* g, a, b, c, d, e, f */
+    double y = *in, x, ig;
+    int rv = 0;
+
+    ig = pp[0] != 0.0 ? 1.0/pp[0] : 0.0;
+
+    switch (p->ctype) {
+        case icCurveFunction1:
+            x = icmCurve_ppow(y, ig);
+            break;
+        case icCurveFunction3:
+        case icCurveFunction4:
+            if (p->ctype == icCurveFunction4)
+                y -= pp[3];
+            if (pp[1] == 0.0) {
+                x = 0.0;
+                rv |= 1;
+            } else if (y <= 0.0) {
+                x = -pp[2]/pp[1];
+            } else {
+                x = (icmCurve_ppow(y, ig) - pp[2])/pp[1];
+            }
+            break;
+        case icCurveFunction5:
+        case icCurveFunction7: {
+            double f = 0.0, e = 0.0;
+            if (p->ctype == icCurveFunction7) {
+                e = pp[5];
+                f = pp[6];
+            }
+            if (pp[3] != 0.0 && y < (pp[3] * pp[4] + f)) {    /* Linear segment */
+                x = (y - f)/pp[3];
+            } else if (pp[1] == 0.0) {
+                x = pp[4];
+                rv |= 1;
+            } else {
+                x = (icmCurve_ppow(y - e, ig) - pp[2])/pp[1];
+            }
+            break;
+        }
+        default:
+            x = y;
+            break;
+    }
+
+    if (x < 0.0) {
+        x = 0.0;
+        rv |= 1;
+    } else if (x > 1.0) {
+        x = 1.0;
+        rv |= 1;
+    }
+    *out = x;
+    return rv;
+}
+
 /* Do a forward lookup through the curve */
 /* Return 0 on success, 1 if clipping occured, 2 on other error */
 static int icmCurve_lookup_fwd(
@@ -3413,6 +3786,8 @@ static int icmCurve_lookup_fwd(
             *out = 0.0;
         else
             *out = pow(val, p->data[0]);
+    } else if (p->flag == icmCurvePara) {
+        rv = icmCurve_para_fwd(p, out, in);
     } else if (p->size == 0) { /* Table of 0 size */
         *out = *in;
     } else { /* Use linear interpolation */
@@ -3443,7 +3818,7 @@ static int icmCurve_lookup_fwd(
 
 /* Create a reverse curve lookup acceleration table */
 /* return non-zero on error, 2 = malloc error. */
-static int icmTable_setup_bwd(
+static int icmTable_build_bwd(
     icc          *icp,            /* Base icc object */
     icmRevTable  *rt,            /* Reverse table data to setup */
     unsigned int size,            /* Size of fwd table */
@@ -3524,6 +3899,23 @@ static int icmTable_setup_bwd(
     return 0;
 }
 
+/* Create a reverse curve lookup acceleration table, */
+/* accounting for its memory as reverse lookup memory. */
+/* return non-zero on error, 2 = malloc error. */
+static int icmTable_setup_bwd(
+    icc          *icp,            /* Base icc object */
+    icmRevTable  *rt,            /* Reverse table data to setup */
+    unsigned int size,            /* Size of fwd table */
+    double       *data            /* Table */
+) {
+    icmMemCat ocat = icc_memcat(icp, icmMemRev);
+    int rv;
+
+    rv = icmTable_build_bwd(icp, rt, size, data);
+    icc_memcat(icp, ocat);
+    return rv;
+}
+
 /* Free up any data */
 static void icmTable_delete_bwd(
     icc          *icp,            /* Base icc */
@@ -3538,6 +3930,10 @@ static void icmTable_delete_bwd(
     }
 }
 
+/* Number of lookup objects with ICM_LU_TRACE_COUNT set. Reverse */
+/* table scans are only counted while there are some. */
+static int icmLuNCount = 0;
+
 /* Do a reverse lookup through the curve */
 /* Return 0 on success, 1 if clipping occured, 2 on other error */
 static int icmTable_lookup_bwd(
@@ -3595,6 +3991,8 @@ static int icmTable_lookup_bwd(
         }
     }
     *out = k/(rt->size-1.0);
+    if (ICM_ATOMIC_GET(icmLuNCount) > 0)    /* Some lookup is counting */
+        ICM_ATOMIC_ADD(rt->nscan, 1);
     rv |= 1;
     return rv;
 }
@@ -3619,6 +4017,8 @@ static int icmCurve_lookup_bwd(
             *out = 0.0;
         else
             *out = pow(val, 1.0/p->data[0]);
+    } else if (p->flag == icmCurvePara) {
+        rv = icmCurve_para_bwd(p, out, in);
     } else if (p->size == 0) { /* Table of 0 size */
         *out = *in;
     } else { /* Use linear interpolation */
@@ -3640,6 +4040,11 @@ static unsigned int icmCurve_get_size(
 ) {
     icmCurve *p = (icmCurve *)pp;
     unsigned int len = 0;
+    if (p->ttype == icSigParametricCurveType) {
+        len = sat_add(len, 12);                /* 12 bytes for tag, padding and function type */
+        len = sat_addmul(len, p->size, 4);    /* 4 bytes for each S15Fixed16 */
+        return len;
+    }
     len = sat_add(len, 12);                /* 12 bytes for tag, padding and count */
     len = sat_addmul(len, p->size, 2);    /* 2 bytes for each UInt16 */
     return len;
@@ -3679,12 +4084,36 @@ static int icmCurve_read(
     }
 
     /* Read type descriptor from the buffer */
-    if (((icTagTypeSignature)read_SInt32Number(bp)) != p->ttype) {
+    p->ttype = (icTagTypeSignature)read_SInt32Number(bp);
+    if (p->ttype != icSigCurveType && p->ttype != icSigParametricCurveType) {
         sprintf(icp->err,"icmCurve_read: Wrong tag type for icmCurve");
         icp->al->free(icp->al, buf);
         return icp->errc = 1;
     }
 
+    if (p->ttype == icSigParametricCurveType) {
+        p->ctype = (icParametricCurveFunctionType)read_UInt16Number(bp+8);
+        if ((p->size = icmCurve_para_nparams(p->ctype)) == 0) {
+            sprintf(icp->err,"icmCurve_read: Unknown parametric function type %d",p->ctype);
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
+        if (p->size > (len - 12)/4) {
+            sprintf(icp->err,"icmCurve_read: Data too short for curve parameters");
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
+        p->flag = icmCurvePara;
+        if ((rv = p->allocate((icmBase *)p)) != 0) {
+            icp->al->free(icp->al, buf);
+            return rv;
+        }
+        for (bp += 12, i = 0; i < p->size; i++, bp += 4)
+            p->data[i] = read_S15Fixed16Number(bp);
+        icp->al->free(icp->al, buf);
+        return 0;
+    }
+
     p->size = read_UInt32Number(bp+8);
     bp = bp + 12;
 
@@ -3746,7 +4175,7 @@ static int icmCurve_write(
         sprintf(icp->err,"icmCurve_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmCurve_write malloc() failed");
         return icp->errc = 2;
     }
@@ -3755,16 +4184,39 @@ static int icmCurve_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmCurve_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
 
-    /* Write count */
-    if ((rv = write_UInt32Number(p->size,bp+8)) != 0) {
-        sprintf(icp->err,"icmCurve_write: write_UInt32Number() failed");
-        icp->al->free(icp->al, buf);
-        return icp->errc = rv;
+    if ((p->ttype == icSigParametricCurveType) != (p->flag == icmCurvePara)) {
+        sprintf(icp->err,"icmCurve_write: Parametric curve must be icSigParametricCurveType");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = 1;
+    }
+
+    if (p->flag == icmCurvePara) {
+        if (p->size != icmCurve_para_nparams(p->ctype)) {
+            sprintf(icp->err,"icmCurve_write: Wrong number of parameters for function type");
+            icc_wbuf_free(icp, buf);
+            return icp->errc = 1;
+        }
+        write_UInt16Number((unsigned int)p->ctype,bp+8);
+        write_UInt16Number(0,bp+10);    /* Set padding to 0 */
+        for (i = 0; i < p->size; i++) {
+            if ((rv = write_S15Fixed16Number(p->data[i],bp + 12 + i * 4)) != 0) {
+                sprintf(icp->err,"icmCurve_write: write_S15Fixed16Number(%f) failed",p->data[i]);
+                icc_wbuf_free(icp, buf);
+                return icp->errc = rv;
+            }
+        }
+    } else {
+        /* Write count */
+        if ((rv = write_UInt32Number(p->size,bp+8)) != 0) {
+            sprintf(icp->err,"icmCurve_write: write_UInt32Number() failed");
+            icc_wbuf_free(icp, buf);
+            return icp->errc = rv;
+        }
     }
 
     /* Write all the data to the buffer */
@@ -3772,43 +4224,42 @@ static int icmCurve_write(
     if (p->flag == icmCurveLin) {
         if (p->size != 0) {
             sprintf(icp->err,"icmCurve_write: Must be exactly 0 entry for Linear");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = 1;
         }
     } else if (p->flag == icmCurveGamma) {
         if (p->size != 1) {
             sprintf(icp->err,"icmCurve_write: Must be exactly 1 entry for Gamma");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = 1;
         }
         if ((rv = write_U8Fixed8Number(p->data[0],bp)) != 0) {
             sprintf(icp->err,"icmCurve_write: write_U8Fixed8umber(%f) failed",p->data[0]);
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     } else if (p->flag == icmCurveSpec) {
         if (p->size < 2) {
             sprintf(icp->err,"icmCurve_write: Must be 2 or more entries for Specified curve");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = 1;
         }
         for (i = 0; i < p->size; i++, bp += 2) {
             if ((rv = write_DCS16Number(p->data[i],bp)) != 0) {
                 sprintf(icp->err,"icmCurve_write: write_UInt16umber(%f) failed",p->data[i]);
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmCurve_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -3828,6 +4279,12 @@ static void icmCurve_dump(
         op->gprintf(op,"  Curve is linear\n");
     } else if (p->flag == icmCurveGamma) {
         op->gprintf(op,"  Curve is gamma of %f\n",p->data[0]);
+    } else if (p->flag == icmCurvePara) {
+        unsigned int i;
+        static const char *pnames = "gabcdef";
+        op->gprintf(op,"  Curve is parametric function type %d\n",p->ctype);
+        for (i = 0; i < p->size; i++)
+            op->gprintf(op,"    %c = %f\n",pnames[i],p->data[i]);
     } else {
         op->gprintf(op,"  No. elements = %lu\n",p->size);
         if (verb >= 2) {
@@ -3852,6 +4309,11 @@ static int icmCurve_allocate(
         p->size = 0;
     } else if (p->flag == icmCurveGamma) {
         p->size = 1;
+    } else if (p->flag == icmCurvePara) {
+        if ((p->size = icmCurve_para_nparams(p->ctype)) == 0) {
+            sprintf(icp->err,"icmCurve_alloc: Unknown parametric function type %d",p->ctype);
+            return icp->errc = 1;
+        }
     }
     if (p->size != p->_size) {
         if (ovr_mul(p->size, sizeof(double))) {
@@ -4013,7 +4475,7 @@ static int icmData_write(
         sprintf(icp->err,"icmData_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmData_write malloc() failed");
         return icp->errc = 2;
     }
@@ -4022,7 +4484,7 @@ static int icmData_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmData_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -4035,13 +4497,13 @@ static int icmData_write(
             break;
         default:
             sprintf(icp->err,"icmData_write: Unknown Data Flag value");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = 1;
     }
     /* Write data flag descriptor to the buffer */
     if ((rv = write_UInt32Number(f,bp+8)) != 0) {
         sprintf(icp->err,"icmData_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     bp += 12;    /* Skip padding */
@@ -4050,7 +4512,7 @@ static int icmData_write(
         if (p->flag == icmDataASCII) {
             if ((rv = check_null_string((char *)p->data, p->size)) != 0) {
                 sprintf(icp->err,"icmData_write: ASCII is not null terminated");
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = 1;
             }
         }
@@ -4058,13 +4520,12 @@ static int icmData_write(
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmData_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -4292,7 +4753,7 @@ static int icmText_write(
         sprintf(icp->err,"icmText_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmText_write malloc() failed");
         return icp->errc = 2;
     }
@@ -4301,7 +4762,7 @@ static int icmText_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmText_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -4310,20 +4771,19 @@ static int icmText_write(
     if (p->data != NULL) {
         if ((rv = check_null_string(p->data, p->size)) != 0) {
             sprintf(icp->err,"icmText_write: text is not null terminated");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = 1;
         }
         memmove((void *)bp, (void *)p->data, p->size);
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmText_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -4636,7 +5096,7 @@ static int icmDateTimeNumber_write(
         sprintf(icp->err,"icmDateTimeNumber_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmDateTimeNumber_write malloc() failed");
         return icp->errc = 2;
     }
@@ -4645,7 +5105,7 @@ static int icmDateTimeNumber_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmDateTimeNumber_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -4654,18 +5114,17 @@ static int icmDateTimeNumber_write(
     bp += 8;    /* Skip padding */
     if ((rv = write_DateTimeNumber(p, bp)) != 0) {
         sprintf(icp->err,"icmDateTimeNumber_write: write_DateTimeNumber() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmDateTimeNumber_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -4844,6 +5303,87 @@ double *in        /* Input array[inputChan] */
     return rv;
 }
 
+/* Multi-linearly interpolate the outn values of the grid cell at gp, */
+/* given the offsets co[] within the cell. Rather than tabulating all */
+/* 2^inn corner weights, the weight of each corner is formed from a */
+/* running product over the dimensions, only re-doing the dimensions */
+/* whose bit changed from the previous corner. This needs no scratch */
+/* memory, and costs about two multiplies per corner. */
+static void icmClut_interp_nl(
+    double *out,
+    double *gp,                    /* Pointer to grid cube base */
+    double *co,                    /* Coordinate offsets within the cell [inn] */
+    int *dcube,                    /* Hyper cube corner offsets [1 << inn] */
+    unsigned int inn,
+    unsigned int outn
+) {
+    double pw[MAX_CHAN + 1];    /* Product of the weights of dimensions e .. inn-1 */
+    double ico[MAX_CHAN];        /* 1.0 - co[] */
+    unsigned int i, k, f, nc = 1 << inn;
+    int e;
+
+    pw[inn] = 1.0;
+    for (e = inn-1; e >= 0; e--) {
+        ico[e] = 1.0 - co[e];
+        pw[e] = pw[e+1] * ico[e];
+    }
+
+/* Advance the weights to corner i, whose lowest set bit is k. Bits */
+/* above k are unchanged, bit k is now set and the bits below are clear */
+#define NL_NEXT_CORNER(i)                           \
+        for (k = 0; ((i) & (1 << k)) == 0; k++)     \
+            ;                                       \
+        pw[k] = pw[k+1] * co[k];                    \
+        for (e = k-1; e >= 0; e--)                  \
+            pw[e] = pw[e+1] * ico[e];
+
+    if (outn == 3) {            /* Common case, accumulate in registers */
+        double *d = gp + dcube[0], w = pw[0];
+        double o0 = w * d[0], o1 = w * d[1], o2 = w * d[2];
+        for (i = 1; i < nc; i++) {
+            NL_NEXT_CORNER(i)
+            w = pw[0];
+            d = gp + dcube[i];
+            o0 += w * d[0];
+            o1 += w * d[1];
+            o2 += w * d[2];
+        }
+        out[0] = o0;
+        out[1] = o1;
+        out[2] = o2;
+    } else if (outn == 4) {
+        double *d = gp + dcube[0], w = pw[0];
+        double o0 = w * d[0], o1 = w * d[1], o2 = w * d[2], o3 = w * d[3];
+        for (i = 1; i < nc; i++) {
+            NL_NEXT_CORNER(i)
+            w = pw[0];
+            d = gp + dcube[i];
+            o0 += w * d[0];
+            o1 += w * d[1];
+            o2 += w * d[2];
+            o3 += w * d[3];
+        }
+        out[0] = o0;
+        out[1] = o1;
+        out[2] = o2;
+        out[3] = o3;
+    } else {
+        double acc[MAX_CHAN], *d = gp + dcube[0], w = pw[0];
+        for (f = 0; f < outn; f++)
+            acc[f] = w * d[f];
+        for (i = 1; i < nc; i++) {
+            NL_NEXT_CORNER(i)
+            w = pw[0];
+            d = gp + dcube[i];
+            for (f = 0; f < outn; f++)
+                acc[f] += w * d[f];
+        }
+        for (f = 0; f < outn; f++)
+            out[f] = acc[f];
+    }
+#undef NL_NEXT_CORNER
+}
+
 /* Convert normalized numbers though this Luts multi-dimensional table. */
 /* using multi-linear interpolation. */
 static int icmLut_lookup_clut_nl(
@@ -4852,20 +5392,9 @@ icmLut *p,        /* Pointer to Lut object */
 double *out,    /* Output array[inputChan] */
 double *in        /* Input array[outputChan] */
 ) {
-    icc *icp = p->icp;
     int rv = 0;
     double *gp;                    /* Pointer to grid cube base */
     double co[MAX_CHAN];        /* Coordinate offset with the grid cell */
-    double *gw, GW[1 << 8];        /* weight for each grid cube corner */
-
-    if (p->inputChan <= 8) {
-        gw = GW;                /* Use stack allocation */
-    } else {
-        if ((gw = (double *) icp->al->malloc(icp->al, sat_mul((1 << p->inputChan), sizeof(double)))) == NULL) {
-            sprintf(icp->err,"icmLut_lookup_clut: malloc() failed");
-            return icp->errc = 2;
-        }
-    }
 
     /* We are using an multi-linear (ie. Trilinear for 3D input) interpolation. */
     /* The implementation here uses more multiplies that some other schemes, */
@@ -4900,66 +5429,33 @@ double *in        /* Input array[outputChan] */
             gp += x * p->dinc[e];        /* Add index offset for base of cube */
         }
     }
-    /* Compute corner weights needed for interpolation */
-    {
-        unsigned int e;
-        int i, g = 1;
-        gw[0] = 1.0;
-        for (e = 0; e < p->inputChan; e++) {
-            for (i = 0; i < g; i++) {
-                gw[g+i] = gw[i] * co[e];
-                gw[i] *= (1.0 - co[e]);
-            }
-            g *= 2;
-        }
-    }
-    /* Now compute the output values */
-    {
-        int i;
-        unsigned int f;
-        double w = gw[0];
-        double *d = gp + p->dcube[0];
-        for (f = 0; f < p->outputChan; f++)            /* Base of cube */
-            out[f] = w * d[f];
-        for (i = 1; i < (1 << p->inputChan); i++) {    /* For all other corners of cube */
-            w = gw[i];                /* Strength reduce */
-            d = gp + p->dcube[i];
-            for (f = 0; f < p->outputChan; f++)
-                out[f] += w * d[f];
-        }
-    }
-    if (gw != GW)
-        icp->al->free(icp->al, (void *)gw);
+    icmClut_interp_nl(out, gp, co, p->dcube, p->inputChan, p->outputChan);
     return rv;
 }
 
-/* Convert normalized numbers though this Luts multi-dimensional table */
-/* using simplex interpolation. */
-static int icmLut_lookup_clut_sx(
+/* Convert n normalized input vectors packed in in[n * inputChan] */
+/* through the multi-dimensional table, to out[n * outputChan], */
+/* using multi-linear interpolation. */
+static int icmLut_lookup_clut_nl_n(
 /* Return 0 on success, 1 if clipping occured, 2 on other error */
 icmLut *p,        /* Pointer to Lut object */
-double *out,    /* Output array[inputChan] */
-double *in        /* Input array[outputChan] */
+double *out,    /* Output array[n * outputChan] */
+double *in,        /* Input array[n * inputChan] */
+unsigned int n    /* Number of vectors */
 ) {
     int rv = 0;
-    double *gp;                    /* Pointer to grid cube base */
-    double co[MAX_CHAN];        /* Coordinate offset with the grid cell */
-    int    si[MAX_CHAN];        /* co[] Sort index, [0] = smalest */
+    unsigned int inn = p->inputChan, outn = p->outputChan;
+    double clutPoints_1 = (double)(p->clutPoints-1);
+    unsigned int clutPoints_2 = p->clutPoints-2;
 
-    /* We are using a simplex (ie. tetrahedral for 3D input) interpolation. */
-    /* This method is more appropriate for XYZ/RGB/CMYK input spaces, */
-
-    /* Compute base index into grid and coordinate offsets */
-    {
+    for (; n > 0; n--, in += inn, out += outn) {
+        double *gp = p->clutTable;
+        double co[MAX_CHAN];
         unsigned int e;
-        double clutPoints_1 = (double)(p->clutPoints-1);
-        int    clutPoints_2 = p->clutPoints-2;
-        gp = p->clutTable;        /* Base of grid array */
 
-        for (e = 0; e < p->inputChan; e++) {
+        for (e = 0; e < inn; e++) {
             unsigned int x;
-            double val;
-            val = in[e] * clutPoints_1;
+            double val = in[e] * clutPoints_1;
             if (val < 0.0) {
                 val = 0.0;
                 rv |= 1;
@@ -4967,23 +5463,41 @@ double *in        /* Input array[outputChan] */
                 val = clutPoints_1;
                 rv |= 1;
             }
-            x = (unsigned int)floor(val);        /* Grid coordinate */
+            x = (unsigned int)floor(val);
             if (x > clutPoints_2)
                 x = clutPoints_2;
-            co[e] = val - (double)x;    /* 1.0 - weight */
-            gp += x * p->dinc[e];        /* Add index offset for base of cube */
+            co[e] = val - (double)x;
+            gp += x * p->dinc[e];
         }
+        icmClut_interp_nl(out, gp, co, p->dcube, inn, outn);
     }
+    return rv;
+}
+
+/* Simplex interpolate the outn values of the grid cell at gp, given */
+/* the offsets co[] within the cell. The cell is split into inn! simplexes */
+/* that share the diagonal from the base corner to the far corner, and */
+/* the one containing co[] is found by sorting the offsets. */
+static void icmClut_interp_sx(
+    double *out,
+    double *gp,                    /* Pointer to grid cube base */
+    double *co,                    /* Coordinate offsets within the cell [inn] */
+    int *dinc,                    /* Grid index increment for each dimension [inn] */
+    unsigned int inn,
+    unsigned int outn
+) {
+    int    si[MAX_CHAN];        /* co[] Sort index, [0] = smalest */
+
 #ifdef NEVER
     /* Do selection sort on coordinates, smallest to largest. */
     {
         int e, f;
-        for (e = 0; e < p->inputChan; e++)
+        for (e = 0; e < inn; e++)
             si[e] = e;                        /* Initial unsorted indexes */
-        for (e = 0; e < (p->inputChan-1); e++) {
+        for (e = 0; e < (inn-1); e++) {
             double cosn;
             cosn = co[si[e]];                /* Current smallest value */
-            for (f = e+1; f < p->inputChan; f++) {    /* Check against rest */
+            for (f = e+1; f < inn; f++) {    /* Check against rest */
                 int tt;
                 tt = si[f];
                 if (cosn > co[tt]) {
@@ -5000,10 +5514,10 @@ double *in        /* Input array[outputChan] */
         int f, vf;
         unsigned int e;
         double v;
-        for (e = 0; e < p->inputChan; e++)
+        for (e = 0; e < inn; e++)
             si[e] = e;                        /* Initial unsorted indexes */
 
-        for (e = 1; e < p->inputChan; e++) {
+        for (e = 1; e < inn; e++) {
             f = e;
             v = co[si[f]];
             vf = f;
@@ -5020,32 +5534,27 @@ double *in        /* Input array[outputChan] */
         unsigned int e, f;
         double w;        /* Current vertex weight */
 
-        w = 1.0 - co[si[p->inputChan-1]];        /* Vertex at base of cell */
-        for (f = 0; f < p->outputChan; f++)
+        w = 1.0 - co[si[inn-1]];        /* Vertex at base of cell */
+        for (f = 0; f < outn; f++)
             out[f] = w * gp[f];
 
-        for (e = p->inputChan-1; e > 0; e--) {    /* Middle verticies */
+        for (e = inn-1; e > 0; e--) {    /* Middle verticies */
             w = co[si[e]] - co[si[e-1]];
-            gp += p->dinc[si[e]];                /* Move to top of cell in next largest dimension */
-            for (f = 0; f < p->outputChan; f++)
+            gp += dinc[si[e]];                /* Move to top of cell in next largest dimension */
+            for (f = 0; f < outn; f++)
                 out[f] += w * gp[f];
         }
 
         w = co[si[0]];
-        gp += p->dinc[si[0]];        /* Far corner from base of cell */
-        for (f = 0; f < p->outputChan; f++)
+        gp += dinc[si[0]];        /* Far corner from base of cell */
+        for (f = 0; f < outn; f++)
             out[f] += w * gp[f];
     }
-    return rv;
 }
 
-#ifdef NEVER        // ~~~99 development code
-
 /* Convert normalized numbers though this Luts multi-dimensional table */
-/* using optimised simplex interpolation. */
-/* This version optimses the simplex split axis depending on the input */
-/* colorspace. */
-static int icmLut_lookup_clut_osx(
+/* using simplex interpolation. */
+static int icmLut_lookup_clut_sx(
 /* Return 0 on success, 1 if clipping occured, 2 on other error */
 icmLut *p,        /* Pointer to Lut object */
 double *out,    /* Output array[inputChan] */
@@ -5054,8 +5563,9 @@ double *in        /* Input array[outputChan] */
     int rv = 0;
     double *gp;                    /* Pointer to grid cube base */
     double co[MAX_CHAN];        /* Coordinate offset with the grid cell */
-    int    si[MAX_CHAN];        /* co[] Sort index, [0] = smalest */
-    char xflip[MAX_CHAN];        /* Optimised simplex axis flip flags */
+
+    /* We are using a simplex (ie. tetrahedral for 3D input) interpolation. */
+    /* This method is more appropriate for XYZ/RGB/CMYK input spaces, */
 
     /* Compute base index into grid and coordinate offsets */
     {
@@ -5067,17 +5577,6 @@ double *in        /* Input array[outputChan] */
         for (e = 0; e < p->inputChan; e++) {
             unsigned int x;
             double val;
-// ~~~999
-#ifdef NEVER
-            xflip[e] = p->finfo[e].bthff;
-            if (in[e] >= p->finfo[e].fth)
-                xflip[e] = p->finfo[e].athff;
-#else
-
-            xflip[e] =     0;
-            if (e == 0)
-                xflip[e] = 1;
-#endif
             val = in[e] * clutPoints_1;
             if (val < 0.0) {
                 val = 0.0;
@@ -5091,86 +5590,218 @@ double *in        /* Input array[outputChan] */
                 x = clutPoints_2;
             co[e] = val - (double)x;    /* 1.0 - weight */
             gp += x * p->dinc[e];        /* Add index offset for base of cube */
-            if (xflip[e]) {                /* Reverse sense of direction for this axis */
-                co[e] = 1.0 - co[e];
-                gp += p->dinc[e];
-            }
         }
     }
-//printf("*");fflush(stdout);
-#ifdef NEVER
-    /* Do selection sort on coordinates, smallest to largest. */
-    {
-        int e, f;
-        for (e = 0; e < p->inputChan; e++)
-            si[e] = e;                        /* Initial unsorted indexes */
-        for (e = 0; e < (p->inputChan-1); e++) {
-            double cosn;
-            cosn = co[si[e]];                /* Current smallest value */
-            for (f = e+1; f < p->inputChan; f++) {    /* Check against rest */
-                int tt;
-                tt = si[f];
-                if (cosn > co[tt]) {
-                    si[f] = si[e];             /* Exchange */
-                    si[e] = tt;
-                    cosn = co[tt];
+    icmClut_interp_sx(out, gp, co, p->dinc, p->inputChan, p->outputChan);
+    return rv;
+}
+
+/* Discard the optimised simplex orientation table */
+static void icmLut_free_osx(icmLut *p) {
+    if (p->oso_ffa != NULL) {
+        p->icp->al->free(p->icp->al, p->oso_ffa);
+        p->oso_ffa = NULL;
+    }
+}
+
+#define OSX_MAXCHAN 4        /* Maximum inputs the orientation is optimised for */
+#define OSX_MAXEDGES 120    /* Maximum cell edges, (2^n * (2^n - 1))/2 */
+
+/* Create the optimised simplex orientation table. */
+/* Simplex interpolation splits each grid cell into n! simplexes that all */
+/* share the diagonal from the base corner to the far corner, and is only */
+/* exact along the simplex edges where the function is linear. For each */
+/* cell we choose which of the 2^(n-1) diagonals to split around, by */
+/* flipping axes so that the chosen diagonal runs from corner m to */
+/* corner ~m. The orientation chosen is the one whose simplex edges have */
+/* the least total curvature, estimated from the second differences of */
+/* the grid points along each edge extended into the neighbouring cells. */
+/* Cells of Luts with more than OSX_MAXCHAN inputs are not flipped. */
+/* Return 0 on success, 1 if the Lut has no cells, 2 on malloc failure */
+static int icmLut_build_osx(icmLut *p) {
+    icc *icp = p->icp;
+    unsigned int inn = p->inputChan, outn = p->outputChan;
+    unsigned int ncorn = 1 << inn, nmask = ncorn >> 1;
+    unsigned int cp_1 = p->clutPoints - 1;
+    unsigned int ncells, nedges, c, e, f, k, m, u, v;
+    unsigned int x[MAX_CHAN];
+    unsigned char eu[OSX_MAXEDGES], ev[OSX_MAXEDGES];    /* Edge corners */
+    unsigned char inm[1 << (OSX_MAXCHAN-1)][OSX_MAXEDGES];    /* Edge used by mask */
+    double cvk[OSX_MAXEDGES];            /* Curvature along edge */
+    icmMemCat ocat;
+
+    if (p->oso_ffa != NULL)
+        return 0;
+
+    if (inn < 1 || p->clutPoints < 2) {
+        sprintf(icp->err,"icmLut_build_osx: Lut has no cells");
+        return icp->errc = 1;
+    }
+
+    /* Since the table is (cp-1)^n and the clut is cp^n * outn doubles, */
+    /* this can't overflow */
+    ncells = 1;
+    for (e = inn; e-- > 0;) {
+        p->odinc[e] = ncells;
+        ncells *= cp_1;
+    }
+    ocat = icc_memcat(icp, icmMemRev);
+    p->oso_ffa = (unsigned short *) icp->al->calloc(icp->al, ncells, sizeof(unsigned short));
+    icc_memcat(icp, ocat);
+    if (p->oso_ffa == NULL) {
+        sprintf(icp->err,"icmLut_build_osx: calloc() failed");
+        return icp->errc = 2;
+    }
+    if (inn < 2 || inn > OSX_MAXCHAN || cp_1 < 2)
+        return 0;        /* Leave all cells unflipped */
+
+    /* The cell edges that aren't along an axis, and the ones that are */
+    /* part of the simplexes for each orientation. u -> v is an edge of */
+    /* orientation m if u ^ m is a subset of v ^ m, or vice versa. */
+    for (nedges = u = 0; u < ncorn; u++) {
+        for (v = u+1; v < ncorn; v++) {
+            unsigned int d = u ^ v;
+            if ((d & (d-1)) == 0)
+                continue;                /* One axis */
+            eu[nedges] = u;
+            ev[nedges] = v;
+            for (m = 0; m < nmask; m++)
+                inm[m][nedges] = ((u ^ m) & ~(v ^ m)) == 0 || ((v ^ m) & ~(u ^ m)) == 0;
+            nedges++;
+        }
+    }
+
+    for (e = 0; e < inn; e++)
+        x[e] = 0;
+    for (c = 0; c < ncells; c++) {
+        double *gp = p->clutTable, best = 1e300;
+        unsigned short bm = 0;
+
+        for (e = 0; e < inn; e++)
+            gp += x[e] * p->dinc[e];
+
+        /* Estimate the curvature along each edge a-[b-c]-d */
+        for (k = 0; k < nedges; k++) {
+            double *gb = gp + p->dcube[eu[k]], *gc = gp + p->dcube[ev[k]];
+            double *ga, *gd;
+            int dd = p->dcube[ev[k]] - p->dcube[eu[k]];
+            int bef = 1, aft = 1;
+
+            for (e = 0; e < inn; e++) {
+                if (!((eu[k] ^ ev[k]) & (1 << e)))
+                    continue;
+                if (ev[k] & (1 << e)) {        /* b -> c is +ve along e */
+                    if (x[e] < 1)
+                        bef = 0;
+                    if ((x[e] + 2) > cp_1)
+                        aft = 0;
+                } else {
+                    if ((x[e] + 2) > cp_1)
+                        bef = 0;
+                    if (x[e] < 1)
+                        aft = 0;
                 }
             }
+            ga = gb - dd;
+            gd = gc + dd;
+
+            cvk[k] = 0.0;
+            for (f = 0; f < outn; f++) {
+                double cv = 0.0;
+                if (bef && aft)
+                    cv = 0.5 * (ga[f] - gb[f] - gc[f] + gd[f]);
+                else if (bef)
+                    cv = ga[f] - 2.0 * gb[f] + gc[f];
+                else if (aft)
+                    cv = gb[f] - 2.0 * gc[f] + gd[f];
+                cvk[k] += fabs(cv);
+            }
         }
-    }
-#else
-    /* Do insertion sort on coordinates, smallest to largest. */
-    {
-        int f, vf;
-        unsigned int e;
-        double v;
-        for (e = 0; e < p->inputChan; e++)
-            si[e] = e;                        /* Initial unsorted indexes */
 
-        for (e = 1; e < p->inputChan; e++) {
-            f = e;
-            v = co[si[f]];
-            vf = f;
-            while (f > 0 && co[si[f-1]] > v) {
-                si[f] = si[f-1];
-                f--;
+        /* Keep the unflipped orientation unless another is better */
+        for (m = 0; m < nmask; m++) {
+            double err = 0.0;
+            for (k = 0; k < nedges; k++) {
+                if (inm[m][k])
+                    err += cvk[k];
             }
-            si[f] = vf;
+            if (err < best * (1.0 - 1e-9)) {
+                best = err;
+                bm = (unsigned short)m;
+            }
+        }
+        p->oso_ffa[c] = bm;
+
+        /* Increment the cell index, last channel fastest */
+        for (e = inn; e-- > 0;) {
+            if (++x[e] < cp_1)
+                break;
+            x[e] = 0;
         }
     }
-#endif
-    /* Now compute the weightings, simplex vertices and output values */
-    {
-        unsigned int e, f;
-        double w;        /* Current vertex weight */
+    return 0;
+}
 
-        w = 1.0 - co[si[p->inputChan-1]];        /* Vertex at base of cell */
-        for (f = 0; f < p->outputChan; f++)
-            out[f] = w * gp[f];
+/* Convert normalized numbers though this Luts multi-dimensional table */
+/* using optimised simplex interpolation. */
+/* This is simplex interpolation with the split diagonal of each cell */
+/* chosen by icmLut_build_osx(). */
+static int icmLut_lookup_clut_osx(
+/* Return 0 on success, 1 if clipping occured, 2 on other error */
+icmLut *p,        /* Pointer to Lut object */
+double *out,    /* Output array[inputChan] */
+double *in        /* Input array[outputChan] */
+) {
+    int rv = 0;
+    double *gp;                    /* Pointer to grid cube base */
+    double co[MAX_CHAN];        /* Coordinate offset with the grid cell */
+    int    sd[MAX_CHAN];        /* Signed dimensional increment */
 
-        for (e = p->inputChan-1; e > 0; e--) {    /* Middle verticies */
-            w = co[si[e]] - co[si[e-1]];
-            if (xflip[e])
-                gp -= p->dinc[si[e]];            /* Move to top of cell in next largest dimension */
-            else
-                gp += p->dinc[si[e]];            /* Move to top of cell in next largest dimension */
-            for (f = 0; f < p->outputChan; f++)
-                out[f] += w * gp[f];
+    if (p->oso_ffa == NULL && icmLut_build_osx(p) != 0)
+        return 2;
+
+    /* Compute base index into grid and coordinate offsets */
+    {
+        unsigned int e, xflip, oix = 0;
+        double clutPoints_1 = (double)(p->clutPoints-1);
+        int    clutPoints_2 = p->clutPoints-2;
+        gp = p->clutTable;        /* Base of grid array */
+
+        for (e = 0; e < p->inputChan; e++) {
+            unsigned int x;
+            double val;
+            val = in[e] * clutPoints_1;
+            if (val < 0.0) {
+                val = 0.0;
+                rv |= 1;
+            } else if (val > clutPoints_1) {
+                val = clutPoints_1;
+                rv |= 1;
+            }
+            x = (unsigned int)floor(val);        /* Grid coordinate */
+            if (x > clutPoints_2)
+                x = clutPoints_2;
+            co[e] = val - (double)x;    /* 1.0 - weight */
+            gp += x * p->dinc[e];        /* Add index offset for base of cube */
+            oix += x * p->odinc[e];
         }
 
-        w = co[si[0]];
-        if (xflip[0])
-            gp -= p->dinc[si[0]];        /* Far corner from base of cell */
-        else
-            gp += p->dinc[si[0]];        /* Far corner from base of cell */
-        for (f = 0; f < p->outputChan; f++)
-            out[f] += w * gp[f];
+        /* Reverse the sense of direction of the flipped axes */
+        xflip = p->oso_ffa[oix];
+        for (e = 0; e < p->inputChan; e++) {
+            if (xflip & (1 << e)) {
+                co[e] = 1.0 - co[e];
+                gp += p->dinc[e];
+                sd[e] = -p->dinc[e];
+            } else {
+                sd[e] = p->dinc[e];
+            }
+        }
     }
+    icmClut_interp_sx(out, gp, co, sd, p->inputChan, p->outputChan);
     return rv;
 }
 
-#endif /* NEVER */        // ~~~99 development code
-
 
 /* Convert normalized numbers though this Luts output tables. */
 /* Return 0 on success, 1 if clipping occured, 2 on other error */
@@ -5319,6 +5950,136 @@ int co[]        /* Coordinates to return */
     return (p->ix == 0);
 }
 
+/* ----------------------------------------------- */
+/* Parallel job execution helper */
+
+/* Jobs are handed out in increasing order to a set of threads, */
+/* the calling thread being thread 0. If ICM_THREADS isn't defined, */
+/* the jobs are simply executed in order by the calling thread. */
+
+#define ICM_MAX_THREADS 64        /* Maximum threads icmParallel() will use */
+
+/* Return the number of threads worth using on this machine */
+int icmNumThreads(void) {
+#if defined(ICM_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long n;
+
+    if ((n = sysconf(_SC_NPROCESSORS_ONLN)) > ICM_MAX_THREADS)
+        n = ICM_MAX_THREADS;
+    if (n >= 1)
+        return (int)n;
+#endif
+    return 1;
+}
+
+#ifdef ICM_THREADS
+
+/* Shared state of an icmParallel() call */
+typedef struct {
+    pthread_mutex_t lock;
+    int njobs;                /* Total number of jobs */
+    int next;                /* Next job to hand out */
+    int rv;                    /* Return value of lowest failed job, 0 if none */
+    int rvjix;                /* Index of lowest failed job */
+    void *cntx;
+    int (*func)(void *cntx, int thix, int jix);
+} icmParCtx;
+
+/* Per thread state */
+typedef struct {
+    icmParCtx *pc;
+    int thix;                /* Thread index */
+} icmParThread;
+
+static void *icmParallel_thread(void *arg) {
+    icmParThread *pt = (icmParThread *)arg;
+    icmParCtx *pc = pt->pc;
+    int jix, rv;
+
+    for (;;) {
+        pthread_mutex_lock(&pc->lock);
+        jix = pc->next++;
+        pthread_mutex_unlock(&pc->lock);
+
+        if (jix >= pc->njobs)
+            break;
+
+        if ((rv = pc->func(pc->cntx, pt->thix, jix)) != 0) {
+            pthread_mutex_lock(&pc->lock);
+            if (pc->rv == 0 || jix < pc->rvjix) {
+                pc->rv = rv;
+                pc->rvjix = jix;
+            }
+            pc->next = pc->njobs;    /* Don't start any more jobs */
+            pthread_mutex_unlock(&pc->lock);
+        }
+    }
+    return NULL;
+}
+#endif /* ICM_THREADS */
+
+/* Execute func(cntx, thix, jix) for jix = 0 .. njobs-1, using up to */
+/* nthreads threads (0 = icmNumThreads()). thix is the 0 .. nthreads-1 */
+/* index of the thread executing the job, and can be used to select */
+/* per thread state. Return the non-zero value returned by the lowest */
+/* failing job, or 0 if all jobs succeeded. */
+int icmParallel(
+    int nthreads,
+    int njobs,
+    void *cntx,
+    int (*func)(void *cntx, int thix, int jix)
+) {
+    int jix, rv;
+
+    if (nthreads <= 0)
+        nthreads = icmNumThreads();
+    if (nthreads > ICM_MAX_THREADS)
+        nthreads = ICM_MAX_THREADS;
+    if (nthreads > njobs)
+        nthreads = njobs;
+
+#ifdef ICM_THREADS
+    if (nthreads > 1) {
+        icmParCtx pc;
+        icmParThread pt[ICM_MAX_THREADS];
+        pthread_t th[ICM_MAX_THREADS];
+        int i, nstarted;
+
+        pthread_mutex_init(&pc.lock, NULL);
+        pc.njobs = njobs;
+        pc.next = 0;
+        pc.rv = 0;
+        pc.rvjix = 0;
+        pc.cntx = cntx;
+        pc.func = func;
+
+        for (i = 0; i < nthreads; i++) {
+            pt[i].pc = &pc;
+            pt[i].thix = i;
+        }
+
+        /* If a thread can't be started, the others just do more of the jobs */
+        for (nstarted = 1; nstarted < nthreads; nstarted++) {
+            if (pthread_create(&th[nstarted], NULL, icmParallel_thread, &pt[nstarted]) != 0)
+                break;
+        }
+        icmParallel_thread(&pt[0]);
+
+        for (i = 1; i < nstarted; i++)
+            pthread_join(th[i], NULL);
+        pthread_mutex_destroy(&pc.lock);
+
+        return pc.rv;
+    }
+#endif /* ICM_THREADS */
+
+    for (jix = 0; jix < njobs; jix++) {
+        if ((rv = func(cntx, 0, jix)) != 0)
+            return rv;
+    }
+    return 0;
+}
+
 /* ------------------------------------------------------- */
 /* Parameter to getNormFunc function */
 typedef enum {
@@ -5341,45 +6102,235 @@ static int getNormFunc(
 
 #define CLIP_MARGIN 0.005        /* Margine to allow before reporting clipping = 0.5% */
 
-/* Helper function to set multiple Lut tables simultaneously. */
-/* Note that these tables all have to be compatible in */
-/* having the same configuration and resolution. */
-/* Set errc and return error number in underlying icc */
-/* Set warnc if there is clipping in the output values */
-/* 1 = input table, 2 = main clut, 3 = clut midpoin, 4 = midpoint interp, 5 = output table */
-int icmSetMultiLutTables(
-    int ntables,                            /* Number of tables to be set, 1..n */
-    icmLut **pp,                            /* Pointer to array of Lut objects */
-    int     flags,                            /* Setting flags */
-    void   *cbctx,                            /* Opaque callback context pointer value */
-    icColorSpaceSignature insig,             /* Input color space */
-    icColorSpaceSignature outsig,             /* Output color space */
-    void (*infunc)(void *cbctx, double *out, double *in),
-                            /* Input transfer function, inspace->inspace' (NULL = default) */
-                            /* Will be called ntables times for each input grid value */
-    double *inmin, double *inmax,            /* Maximum range of inspace' values */
-                                            /* (NULL = default) */
-    void (*clutfunc)(void *cbntx, double *out, double *in),
-                            /* inspace' -> outspace[ntables]' transfer function */
-                            /* will be called once for each input' grid value, and */
-                            /* ntables output values should be written consecutively */
-                            /* to out[]. */
-    double *clutmin, double *clutmax,        /* Maximum range of outspace' values */
-                                            /* (NULL = default) */
-    void (*outfunc)(void *cbntx, double *out, double *in))
-                                /* Output transfer function, outspace'->outspace (NULL = deflt) */
-                                /* Will be called ntables times on each output value */
-{
-    icmLut *p, *pn;                /* Pointer to 0'th nd tn'th Lut object */
-    icc *icp;                    /* Pointer to common icc */
-    int tn;
-    unsigned int e, f, i, n;
-    double **clutTable2 = NULL;        /* Cell center values for ICM_CLUT_SET_APXLS */ 
+/* Number of grid chunks per thread when setting clut values in parallel */
+#define SETLUT_CHUNKS_PER_THREAD 16
+
+/* Context for setting the clut values of one chunk of the */
+/* pseudo-hilbert grid sequence. */
+typedef struct {
+    int ntables;                /* Number of tables being set */
+    icmLut **pp;                /* Pointer to array of Lut objects */
+    int maxchan;                /* Actual max of input and output */
+    double *_iv;                /* Per thread real index value/table value buffers */
+    void *cbctx;                /* Shared callback context */
+    void **thcbctx;                /* Per thread callback contexts, NULL if shared */
+    void (*clutfunc)(void *cbntx, double *out, double *in);
+    double *imin, *imax;
+    double *omin, *omax;
+    void (*ifromentry)(double *out, double *in);
+    void (*otoentry)(double *out, double *in);
+    double **clutTable2;        /* Cell center values for ICM_CLUT_SET_APXLS */
+    psh *cpsh;                    /* Counter state at the start of each chunk */
+    int *cii;                    /* Index value at the start of each chunk [MAX_CHAN] */
+    unsigned int *ccount;        /* Number of grid points in each chunk */
+    int *cclip;                    /* Last clip status in each chunk */
+} icmSetLutChunk;
+
+/* Set the clut values for chunk jix. Called by icmParallel() */
+static int icmSetMultiLutTables_chunk(void *cntx, int thix, int jix) {
+    icmSetLutChunk *cx = (icmSetLutChunk *)cntx;
+    icmLut *p = cx->pp[0], *pn;
+    int ntables = cx->ntables;
+    void *cbctx = cx->thcbctx != NULL ? cx->thcbctx[thix] : cx->cbctx;
+    double *imin = cx->imin, *imax = cx->imax;
+    double *omin = cx->omin, *omax = cx->omax;
+    double **clutTable2 = cx->clutTable2;
     int ii[MAX_CHAN];        /* Index value */
     psh counter;            /* Pseudo-Hilbert counter */
+    double *iv, *ivn;        /* Real index value/table value */
+    unsigned int e, f, k;
+    int tn;
+    int clip = 0;
+
+    iv = cx->_iv + thix * cx->maxchan * (ntables+1) + cx->maxchan;    /* Allow for "index under" */
+
+    counter = cx->cpsh[jix];
+    for (e = 0; e < p->inputChan; e++)
+        ii[e] = cx->cii[jix * MAX_CHAN + e];
+
+    /* Itterate through the verticies in this chunk */
+    for (k = 0;;) {
+        int ti;            /* Table index */
+
+        for (ti = e = 0; e < p->inputChan; e++) {     /* Input tables */
+            ti += ii[e] * p->dinc[e];                /* Clut index */
+            iv[e] = ii[e]/(p->clutPoints-1.0);        /* Vertex coordinates */
+            iv[e] = iv[e] * (imax[e] - imin[e]) + imin[e]; /* Undo expansion to 0.0 - 1.0 */
+            *((int *)&iv[-((int)e)-1]) = ii[e];    /* Trick to supply grid index in iv[] */
+        }
+
+        DBGSL(("\nix %s\n",icmPiv(p->inputChan, ii)));
+        DBGSL(("raw itv %s to iv'",icmPdv(p->inputChan, iv)));
+        cx->ifromentry(iv,iv);        /* Convert from table value to input color space */
+        DBGSL((" %s\n",icmPdv(p->inputChan, iv)));
+
+        /* Apply incolor -> outcolor function we want to represent */
+        DBGSL(("iv: %s to ov'",icmPdv(p->inputChan, iv)));
+        cx->clutfunc(cbctx, iv, iv);
+        DBGSL((" %s\n",icmPdv(p->outputChan, iv)));
+
+        /* Disperse the results */
+        for (tn = 0, ivn = iv; tn < ntables; ivn += p->outputChan, tn++) {
+            pn = cx->pp[tn];
+
+            DBGSL(("tn %d, ov' %s -> otv",tn,icmPdv(p->outputChan, ivn)));
+            cx->otoentry(ivn,ivn);        /* Convert from output color space value to table value */
+            DBGSL((" %s\n  -> oval",icmPdv(p->outputChan, ivn)));
+
+            /* Expand used range to 0.0 - 1.0, and clip to legal values */
+            for (f = 0; f < pn->outputChan; f++) {
+                double tt;
+                tt = (ivn[f] - omin[f])/(omax[f] - omin[f]);
+                if (tt < 0.0) {
+                    DBGSLC(("lclip: tt = %f, ivn= %f, omin = %f, omax = %f\n",tt,ivn[f],omin[f],omax[f]));
+                    if (tt < -CLIP_MARGIN)
+                        clip = 2;
+                    tt = 0.0;
+                } else if (tt > 1.0) {
+                    DBGSLC(("lclip: tt = %f, ivn= %f, omin = %f, omax = %f\n",tt,ivn[f],omin[f],omax[f]));
+                    if (tt > (1.0 + CLIP_MARGIN))
+                        clip = 2;
+                    tt = 1.0;
+                }
+                ivn[f] = tt;
+            }
+
+            for (f = 0; f < pn->outputChan; f++)     /* Output chans */
+                pn->clutTable[ti + f] = ivn[f];
+            DBGSL((" %s\n",icmPdv(pn->outputChan, ivn)));
+        }
+
+        /* Lookup cell center value if ICM_CLUT_SET_APXLS */
+        if (clutTable2 != NULL) {
+
+            for (e = 0; e < p->inputChan; e++) {
+                if (ii[e] >= (p->clutPoints-1))
+                    break;                                        /* Don't lookup last */
+                iv[e] = (ii[e] + 0.5)/(p->clutPoints-1.0);        /* Vertex coordinates + 0.5 */
+                iv[e] = iv[e] * (imax[e] - imin[e]) + imin[e]; /* Undo expansion to 0.0 - 1.0 */
+                *((int *)&iv[-((int)e)-1]) = ii[e];    /* Trick to supply grid index in iv[] */
+                                                    /* (Not this is only the base for +0.5) */
+            }
+
+            if (e >= p->inputChan) {    /* We're not on the last row */
+
+                cx->ifromentry(iv,iv);        /* Convert from table value to input color space */
+
+                /* Apply incolor -> outcolor function we want to represent */
+                cx->clutfunc(cbctx, iv, iv);
+
+                /* Disperse the results */
+                for (tn = 0, ivn = iv; tn < ntables; ivn += p->outputChan, tn++) {
+                    pn = cx->pp[tn];
+
+                    cx->otoentry(ivn,ivn);    /* Convert from output color space value to table value */
+
+                    /* Expand used range to 0.0 - 1.0, and clip to legal values */
+                    for (f = 0; f < pn->outputChan; f++) {
+                        double tt;
+                        tt = (ivn[f] - omin[f])/(omax[f] - omin[f]);
+                        if (tt < 0.0) {
+                            DBGSLC(("lclip: tt = %f, ivn= %f, omin = %f, omax = %f\n",tt,ivn[f],omin[f],omax[f]));
+                            if (tt < -CLIP_MARGIN)
+                                clip = 3;
+                            tt = 0.0;
+                        } else if (tt > 1.0) {
+                            DBGSLC(("lclip: tt = %f, ivn= %f, omin = %f, omax = %f\n",tt,ivn[f],omin[f],omax[f]));
+                            if (tt > (1.0 + CLIP_MARGIN))
+                                clip = 3;
+                            tt = 1.0;
+                        }
+                        ivn[f] = tt;
+                    }
+
+                    for (f = 0; f < pn->outputChan; f++)     /* Output chans */
+                        clutTable2[tn][ti + f] = ivn[f];
+                }
+            }
+        }
+
+        if (++k >= cx->ccount[jix])
+            break;
+
+        /* Increment index within block (Reverse index significancd) */
+        psh_inc(&counter, ii);
+    }
+
+    cx->cclip[jix] = clip;
+
+    return 0;
+}
+
+/* Helper function to set multiple Lut tables simultaneously. */
+/* Note that these tables all have to be compatible in */
+/* having the same configuration and resolution. */
+/* Set errc and return error number in underlying icc */
+/* Set warnc if there is clipping in the output values */
+/* 1 = input table, 2 = main clut, 3 = clut midpoin, 4 = midpoint interp, 5 = output table */
+int icmSetMultiLutTables(
+    int ntables,                            /* Number of tables to be set, 1..n */
+    icmLut **pp,                            /* Pointer to array of Lut objects */
+    int     flags,                            /* Setting flags */
+    void   *cbctx,                            /* Opaque callback context pointer value */
+    icColorSpaceSignature insig,             /* Input color space */
+    icColorSpaceSignature outsig,             /* Output color space */
+    void (*infunc)(void *cbctx, double *out, double *in),
+    double *inmin, double *inmax,
+    void (*clutfunc)(void *cbntx, double *out, double *in),
+    double *clutmin, double *clutmax,
+    void (*outfunc)(void *cbntx, double *out, double *in))
+{
+    return icmSetMultiLutTables_x(ntables, pp, flags, cbctx, insig, outsig,
+                                  infunc, inmin, inmax,
+                                  clutfunc, clutmin, clutmax,
+                                  outfunc, 0, NULL);
+}
+
+/* Extended version of icmSetMultiLutTables(), that allows the */
+/* number of threads and per thread callback contexts to be specified. */
+/* The clut grid is divided into chunks of consecutive pseudo-hilbert */
+/* count, that are evaluated in parallel if the ICM_CLUT_SET_MT flag */
+/* is set or thcbctx is not NULL. The result is identical to evaluating */
+/* the grid serially. */
+int icmSetMultiLutTables_x(
+    int ntables,                            /* Number of tables to be set, 1..n */
+    icmLut **pp,                            /* Pointer to array of Lut objects */
+    int     flags,                            /* Setting flags */
+    void   *cbctx,                            /* Opaque callback context pointer value */
+    icColorSpaceSignature insig,             /* Input color space */
+    icColorSpaceSignature outsig,             /* Output color space */
+    void (*infunc)(void *cbctx, double *out, double *in),
+                            /* Input transfer function, inspace->inspace' (NULL = default) */
+                            /* Will be called ntables times for each input grid value */
+    double *inmin, double *inmax,            /* Maximum range of inspace' values */
+                                            /* (NULL = default) */
+    void (*clutfunc)(void *cbntx, double *out, double *in),
+                            /* inspace' -> outspace[ntables]' transfer function */
+                            /* will be called once for each input' grid value, and */
+                            /* ntables output values should be written consecutively */
+                            /* to out[]. */
+    double *clutmin, double *clutmax,        /* Maximum range of outspace' values */
+                                            /* (NULL = default) */
+    void (*outfunc)(void *cbntx, double *out, double *in),
+                                /* Output transfer function, outspace'->outspace (NULL = deflt) */
+                                /* Will be called ntables times on each output value */
+    int nthreads,                /* Number of threads to use, 0 = icmNumThreads() */
+    void **thcbctx)                /* Per thread clutfunc contexts [nthreads], NULL = use cbctx */
+{
+    icmLut *p, *pn;                /* Pointer to 0'th nd tn'th Lut object */
+    icc *icp;                    /* Pointer to common icc */
+    int tn;
+    unsigned int e, f, i, n;
+    double **clutTable2 = NULL;        /* Cell center values for ICM_CLUT_SET_APXLS */
+    int ii[MAX_CHAN];        /* Index value */
+    psh counter;            /* Pseudo-Hilbert counter */
+    unsigned int count;        /* Number of grid points */
+    unsigned int csize, k;    /* Grid points per chunk */
+    int nchunks, ch;        /* Number of chunks */
+    icmSetLutChunk cx;        /* Chunk evaluation context */
 //    double _iv[4 * MAX_CHAN], *iv = &_iv[MAX_CHAN], *ivn;    /* Real index value/table value */
     int maxchan;            /* Actual max of input and output */
-    double *_iv, *iv, *ivn;    /* Real index value/table value */
+    double *_iv, *iv;        /* Real index value/table value */
     double imin[MAX_CHAN], imax[MAX_CHAN];
     double omin[MAX_CHAN], omax[MAX_CHAN];
     void (*ifromindex)(double *out, double *in);    /* Index to input color space function */
@@ -5428,6 +6379,10 @@ int icmSetMultiLutTables(
         }
     }
 
+    /* The clut values are about to change */
+    for (tn = 0; tn < ntables; tn++)
+        icmLut_free_osx(pp[tn]);
+
     if (getNormFunc(icp, insig, p->ttype, icmFromLuti, &ifromindex) != 0) {
         sprintf(icp->err,"icmLut_set_tables index to input colorspace function lookup failed");
         return icp->errc = 1;
@@ -5450,10 +6405,21 @@ int icmSetMultiLutTables(
         return icp->errc = 1;
     }
 
-    /* Allocate an array to hold the input and output values */
+    /* Only use threads if clutfunc has been declared thread safe */
+    if ((flags & ICM_CLUT_SET_MT) == 0 && thcbctx == NULL) {
+        nthreads = 1;
+    } else if (nthreads <= 0) {
+        if (thcbctx != NULL) {
+            sprintf(icp->err,"icmSetMultiLutTables number of threads must be given with thcbctx");
+            return icp->errc = 1;
+        }
+        nthreads = icmNumThreads();
+    }
+
+    /* Allocate an array to hold the input and output values for each thread */
     maxchan = p->inputChan > p->outputChan ? p->inputChan : p->outputChan;
-    if ((_iv = (double *) icp->al->malloc(icp->al, sizeof(double) * maxchan * (ntables+1)))
-                                                                                  == NULL) {
+    if ((_iv = (double *) icp->al->malloc(icp->al, sizeof(double) * maxchan * (ntables+1)
+                                                                     * nthreads)) == NULL) {
         sprintf(icp->err,"icmLut_read: malloc() failed");
         return icp->errc = 2;
     }
@@ -5591,7 +6557,7 @@ int icmSetMultiLutTables(
     }
 
     /* Allocate space for cell center value lookup */
-    if (flags == ICM_CLUT_SET_APXLS) {
+    if (flags & ICM_CLUT_SET_APXLS) {
         if ((clutTable2 = (double **) icp->al->calloc(icp->al,sizeof(double *), ntables)) == NULL) {
             sprintf(icp->err,"icmLut_set_tables malloc of cube center array failed");
             icp->al->free(icp->al, _iv);
@@ -5619,114 +6585,81 @@ int icmSetMultiLutTables(
     /* gamut compressions for instance), and hence calling the clutfunc() with */
     /* close values will maximise reverse lookup cache hit rate. */
 
-    psh_init(&counter, p->inputChan, p->clutPoints, ii);    /* Initialise counter */
-
-    /* Itterate through all verticies in the grid */
-    for (;;) {
-        int ti;            /* Table index */
-    
-        for (ti = e = 0; e < p->inputChan; e++) {     /* Input tables */
-            ti += ii[e] * p->dinc[e];                /* Clut index */
-            iv[e] = ii[e]/(p->clutPoints-1.0);        /* Vertex coordinates */
-            iv[e] = iv[e] * (imax[e] - imin[e]) + imin[e]; /* Undo expansion to 0.0 - 1.0 */
-            *((int *)&iv[-((int)e)-1]) = ii[e];    /* Trick to supply grid index in iv[] */
-        }
-    
-        DBGSL(("\nix %s\n",icmPiv(p->inputChan, ii)));
-        DBGSL(("raw itv %s to iv'",icmPdv(p->inputChan, iv)));
-        ifromentry(iv,iv);            /* Convert from table value to input color space */
-        DBGSL((" %s\n",icmPdv(p->inputChan, iv)));
-    
-        /* Apply incolor -> outcolor function we want to represent */
-        DBGSL(("iv: %s to ov'",icmPdv(p->inputChan, iv)));
-        clutfunc(cbctx, iv, iv);
-        DBGSL((" %s\n",icmPdv(p->outputChan, iv)));
-    
-        /* Disperse the results */
-        for (tn = 0, ivn = iv; tn < ntables; ivn += p->outputChan, tn++) {
-            pn = pp[tn];
-        
-            DBGSL(("tn %d, ov' %s -> otv",tn,icmPdv(p->outputChan, ivn)));
-            otoentry(ivn,ivn);            /* Convert from output color space value to table value */
-            DBGSL((" %s\n  -> oval",icmPdv(p->outputChan, ivn)));
-    
-            /* Expand used range to 0.0 - 1.0, and clip to legal values */
-            for (f = 0; f < pn->outputChan; f++) {
-                double tt;
-                tt = (ivn[f] - omin[f])/(omax[f] - omin[f]);
-                if (tt < 0.0) {
-                    DBGSLC(("lclip: tt = %f, ivn= %f, omin = %f, omax = %f\n",tt,ivn[f],omin[f],omax[f]));
-                    if (tt < -CLIP_MARGIN)
-                        clip = 2;
-                    tt = 0.0;
-                } else if (tt > 1.0) {
-                    DBGSLC(("lclip: tt = %f, ivn= %f, omin = %f, omax = %f\n",tt,ivn[f],omin[f],omax[f]));
-                    if (tt > (1.0 + CLIP_MARGIN))
-                        clip = 2;
-                    tt = 1.0;
-                }
-                ivn[f] = tt;
-            }
-        
-            for (f = 0; f < pn->outputChan; f++)     /* Output chans */
-                pn->clutTable[ti + f] = ivn[f];
-            DBGSL((" %s\n",icmPdv(pn->outputChan, ivn)));
-        }
-    
-        /* Lookup cell center value if ICM_CLUT_SET_APXLS */
+    count = psh_init(&counter, p->inputChan, p->clutPoints, ii);    /* Initialise counter */
+    if (count < 1)
+        count = 1;            /* Always do at least one point */
+
+    /* Divide the sequence into chunks, and note the counter state at the */
+    /* start of each. Threads then evaluate whole chunks, so that each */
+    /* thread also benefits from the locality of the sequence. */
+    nchunks = nthreads > 1 ? nthreads * SETLUT_CHUNKS_PER_THREAD : 1;
+    if ((unsigned int)nchunks > count)
+        nchunks = count;
+    csize = (count + nchunks - 1)/nchunks;
+    nchunks = (count + csize - 1)/csize;
+
+    cx.cpsh = (psh *) icp->al->malloc(icp->al, sizeof(psh) * nchunks);
+    cx.cii = (int *) icp->al->malloc(icp->al, sizeof(int) * MAX_CHAN * nchunks);
+    cx.ccount = (unsigned int *) icp->al->malloc(icp->al, sizeof(unsigned int) * nchunks);
+    cx.cclip = (int *) icp->al->calloc(icp->al, sizeof(int), nchunks);
+    if (cx.cpsh == NULL || cx.cii == NULL || cx.ccount == NULL || cx.cclip == NULL) {
+        if (cx.cpsh != NULL) icp->al->free(icp->al, cx.cpsh);
+        if (cx.cii != NULL) icp->al->free(icp->al, cx.cii);
+        if (cx.ccount != NULL) icp->al->free(icp->al, cx.ccount);
+        if (cx.cclip != NULL) icp->al->free(icp->al, cx.cclip);
         if (clutTable2 != NULL) {
-
-            for (e = 0; e < p->inputChan; e++) {
-                if (ii[e] >= (p->clutPoints-1))
-                    break;                                        /* Don't lookup last */
-                iv[e] = (ii[e] + 0.5)/(p->clutPoints-1.0);        /* Vertex coordinates + 0.5 */
-                iv[e] = iv[e] * (imax[e] - imin[e]) + imin[e]; /* Undo expansion to 0.0 - 1.0 */
-                *((int *)&iv[-((int)e)-1]) = ii[e];    /* Trick to supply grid index in iv[] */
-                                                    /* (Not this is only the base for +0.5) */
-            }
-
-            if (e >= p->inputChan) {    /* We're not on the last row */
-        
-                ifromentry(iv,iv);            /* Convert from table value to input color space */
-            
-                /* Apply incolor -> outcolor function we want to represent */
-                clutfunc(cbctx, iv, iv);
-            
-                /* Disperse the results */
-                for (tn = 0, ivn = iv; tn < ntables; ivn += p->outputChan, tn++) {
-                    pn = pp[tn];
-                
-                    otoentry(ivn,ivn);            /* Convert from output color space value to table value */
-            
-                    /* Expand used range to 0.0 - 1.0, and clip to legal values */
-                    for (f = 0; f < pn->outputChan; f++) {
-                        double tt;
-                        tt = (ivn[f] - omin[f])/(omax[f] - omin[f]);
-                        if (tt < 0.0) {
-                            DBGSLC(("lclip: tt = %f, ivn= %f, omin = %f, omax = %f\n",tt,ivn[f],omin[f],omax[f]));
-                            if (tt < -CLIP_MARGIN)
-                                clip = 3;
-                            tt = 0.0;
-                        } else if (tt > 1.0) {
-                            DBGSLC(("lclip: tt = %f, ivn= %f, omin = %f, omax = %f\n",tt,ivn[f],omin[f],omax[f]));
-                            if (tt > (1.0 + CLIP_MARGIN))
-                                clip = 3;
-                            tt = 1.0;
-                        }
-                        ivn[f] = tt;
-                    }
-                
-                    for (f = 0; f < pn->outputChan; f++)     /* Output chans */
-                        clutTable2[tn][ti + f] = ivn[f];
-                }
-            }
+            for (tn = 0; tn < ntables; tn++)
+                icp->al->free(icp->al, clutTable2[tn]);
+            icp->al->free(icp->al, clutTable2);
         }
+        icp->al->free(icp->al, _iv);
+        sprintf(icp->err,"icmLut_set_tables malloc of grid chunk arrays failed");
+        return icp->errc = 2;
+    }
 
-        /* Increment index within block (Reverse index significancd) */
-        if (psh_inc(&counter, ii))
+    for (ch = 0; ch < nchunks; ch++) {
+        cx.cpsh[ch] = counter;
+        for (e = 0; e < p->inputChan; e++)
+            cx.cii[ch * MAX_CHAN + e] = ii[e];
+        if (ch == (nchunks-1)) {
+            cx.ccount[ch] = count - ch * csize;
             break;
+        }
+        cx.ccount[ch] = csize;
+        for (k = 0; k < csize; k++)
+            psh_inc(&counter, ii);
+    }
+
+    cx.ntables = ntables;
+    cx.pp = pp;
+    cx.maxchan = maxchan;
+    cx._iv = _iv;
+    cx.cbctx = cbctx;
+    cx.thcbctx = thcbctx;
+    cx.clutfunc = clutfunc;
+    cx.imin = imin;
+    cx.imax = imax;
+    cx.omin = omin;
+    cx.omax = omax;
+    cx.ifromentry = ifromentry;
+    cx.otoentry = otoentry;
+    cx.clutTable2 = clutTable2;
+
+    /* Itterate through all verticies in the grid */
+    icmParallel(nthreads, nchunks, (void *)&cx, icmSetMultiLutTables_chunk);
+
+    /* Merge the clip status in sequence order, so that the */
+    /* result is the same as a serial evaluation. */
+    for (ch = 0; ch < nchunks; ch++) {
+        if (cx.cclip[ch] != 0)
+            clip = cx.cclip[ch];
     }
 
+    icp->al->free(icp->al, cx.cpsh);
+    icp->al->free(icp->al, cx.cii);
+    icp->al->free(icp->al, cx.ccount);
+    icp->al->free(icp->al, cx.cclip);
+
     /* Deal with cell center value, aproximate least squares adjustment */
     if (clutTable2 != NULL) {
         int ti;                    /* Table index */
@@ -6104,7 +7037,7 @@ static int icmLut_write(
         sprintf(icp->err,"icmLut_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmLut_write malloc() failed");
         return icp->errc = 2;
     }
@@ -6113,7 +7046,7 @@ static int icmLut_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmLut_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -6121,17 +7054,17 @@ static int icmLut_write(
     /* Write the info common to 8 and 16 bit Lut */
     if ((rv = write_UInt8Number(p->inputChan, bp+8)) != 0) {
         sprintf(icp->err,"icmLut_write: write_UInt8Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     if ((rv = write_UInt8Number(p->outputChan, bp+9)) != 0) {
         sprintf(icp->err,"icmLut_write: write_UInt8Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     if ((rv = write_UInt8Number(p->clutPoints, bp+10)) != 0) {
         sprintf(icp->err,"icmLut_write: write_UInt8Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
 
@@ -6142,7 +7075,7 @@ static int icmLut_write(
         for (i = 0; i < 3; i++) {    /* Columns */
             if ((rv = write_S15Fixed16Number(p->e[j][i],bp + 12 + ((j * 3 + i) * 4))) != 0) {
                 sprintf(icp->err,"icmLut_write: write_S15Fixed16Number() failed");
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         }
@@ -6152,24 +7085,24 @@ static int icmLut_write(
     if (p->ttype == icSigLut8Type) {
         if (p->inputEnt != 256 || p->outputEnt != 256) {
             sprintf(icp->err,"icmLut_write: 8 bit Input and Output tables must be 256 entries");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = 1;
         }
         bp = buf+48;
     } else {
         if (p->inputEnt > 4096 || p->outputEnt > 4096) {
             sprintf(icp->err,"icmLut_write: 16 bit Input and Output tables must each be less than 4096 entries");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = 1;
         }
         if ((rv = write_UInt16Number(p->inputEnt, bp+48)) != 0) {
             sprintf(icp->err,"icmLut_write: write_UInt16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_UInt16Number(p->outputEnt, bp+50)) != 0) {
             sprintf(icp->err,"icmLut_write: write_UInt16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         bp = buf+52;
@@ -6181,7 +7114,7 @@ static int icmLut_write(
         for (i = 0; i < size; i++, bp += 1) {
             if ((rv = write_DCS8Number(p->inputTable[i], bp)) != 0) {
                 sprintf(icp->err,"icmLut_write: inputTable write_DCS8Number() failed");
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         }
@@ -6189,7 +7122,7 @@ static int icmLut_write(
         for (i = 0; i < size; i++, bp += 2) {
             if ((rv = write_DCS16Number(p->inputTable[i], bp)) != 0) {
                 sprintf(icp->err,"icmLut_write: inputTable write_DCS16Number(%f) failed",p->inputTable[i]);
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         }
@@ -6201,7 +7134,7 @@ static int icmLut_write(
         for (i = 0; i < size; i++, bp += 1) {
             if ((rv = write_DCS8Number(p->clutTable[i], bp)) != 0) {
                 sprintf(icp->err,"icmLut_write: clutTable write_DCS8Number() failed");
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         }
@@ -6209,7 +7142,7 @@ static int icmLut_write(
         for (i = 0; i < size; i++, bp += 2) {
             if ((rv = write_DCS16Number(p->clutTable[i], bp)) != 0) {
                 sprintf(icp->err,"icmLut_write: clutTable write_DCS16Number(%f) failed",p->clutTable[i]);
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         }
@@ -6221,7 +7154,7 @@ static int icmLut_write(
         for (i = 0; i < size; i++, bp += 1) {
             if ((rv = write_DCS8Number(p->outputTable[i], bp)) != 0) {
                 sprintf(icp->err,"icmLut_write: outputTable write_DCS8Number() failed");
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         }
@@ -6229,20 +7162,19 @@ static int icmLut_write(
         for (i = 0; i < size; i++, bp += 2) {
             if ((rv = write_DCS16Number(p->outputTable[i], bp)) != 0) {
                 sprintf(icp->err,"icmLut_write: outputTable write_DCS16Number(%f) failed",p->outputTable[i]);
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         }
     }
 
     /* Write buffer to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmLut_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -6329,6 +7261,9 @@ static int icmLut_allocate(
     icmLut *p = (icmLut *)pp;
     icc *icp = p->icp;
 
+    /* The clut is about to be (re)filled */
+    icmLut_free_osx(p);
+
     /* Sanity check */
     if (p->inputChan > MAX_CHAN) {
         sprintf(icp->err,"icmLut_alloc: Can't handle > %d input channels\n",MAX_CHAN);
@@ -6427,6 +7362,7 @@ static void icmLut_delete(
         icmTable_delete_bwd(icp, &p->rit[i]);
     for (i = 0; i < p->outputChan; i++)
         icmTable_delete_bwd(icp, &p->rot[i]);
+    icmLut_free_osx(p);
     icp->al->free(icp->al, p);
 }
 
@@ -6453,8 +7389,11 @@ static icmBase *new_icmLut(
     p->lookup_matrix  = icmLut_lookup_matrix;
     p->lookup_input   = icmLut_lookup_input;
     p->lookup_clut_nl = icmLut_lookup_clut_nl;
+    p->lookup_clut_nl_n = icmLut_lookup_clut_nl_n;
     p->lookup_clut_sx = icmLut_lookup_clut_sx;
+    p->lookup_clut_osx = icmLut_lookup_clut_osx;
     p->lookup_output  = icmLut_lookup_output;
+    p->build_osx      = icmLut_build_osx;
 
     /* Set method */
     p->set_tables = icmLut_set_tables;
@@ -6486,41 +7425,319 @@ static icmBase *new_icmLut(
 }
 
 /* ---------------------------------------------------------- */
-/* Measurement */
+/* icmLutAB object, V4 lutAtoB and lutBtoA */
+
+/* Number of A, M and B curves */
+#define LUTAB_NA(p) ((p)->ttype == icSigLutBtoAType ? (p)->outputChan : (p)->inputChan)
+#define LUTAB_NB(p) ((p)->ttype == icSigLutBtoAType ? (p)->inputChan : (p)->outputChan)
+
+/* Return the number of clut grid points, UINT_MAX on overflow */
+static unsigned int icmLutAB_clut_points(
+    icmLutAB *p
+) {
+    unsigned int i, n = 1;
+
+    for (i = 0; i < p->inputChan; i++)
+        n = sat_mul(n, p->clutPoints[i]);
+    return n;
+}
+
+/* Return the aligned size of a set of curves. */
+/* Element curves may be of either type, so the type follows the curve flag. */
+static unsigned int icmLutAB_curves_size(
+    icmCurve **cv,
+    unsigned int n
+) {
+    unsigned int i, len = 0;
+
+    for (i = 0; i < n; i++) {
+        cv[i]->ttype = cv[i]->flag == icmCurvePara ? icSigParametricCurveType : icSigCurveType;
+        len = sat_align(ALIGN_SIZE, sat_add(len, cv[i]->get_size((icmBase *)cv[i])));
+    }
+    return len;
+}
+
+/* Compute the offset of each element relative to the start of the tag, */
+/* in the order they are written, and return the total size. */
+/* Offsets are [B, matrix, M, clut, A], 0 if the element is absent. */
+static unsigned int icmLutAB_layout(
+    icmLutAB *p,
+    unsigned int off[5]
+) {
+    unsigned int len = 32;        /* tag and header */
+    int i, el[5];
+
+    /* lutAtoB is written in processing order A, clut, M, matrix, B */
+    /* lutBtoA is written in processing order B, matrix, M, clut, A */
+    if (p->ttype == icSigLutBtoAType) {
+        el[0] = 0; el[1] = 1; el[2] = 2; el[3] = 3; el[4] = 4;
+    } else {
+        el[0] = 4; el[1] = 3; el[2] = 2; el[3] = 1; el[4] = 0;
+    }
+
+    for (i = 0; i < 5; i++) {
+        off[el[i]] = 0;
+        switch (el[i]) {
+            case 0:
+                off[0] = len;
+                len = sat_add(len, icmLutAB_curves_size(p->bCurves, LUTAB_NB(p)));
+                break;
+            case 1:
+                if (p->mmatrix) {
+                    off[1] = len;
+                    len = sat_add(len, 48);
+                }
+                break;
+            case 2:
+                if (p->mmatrix) {
+                    off[2] = len;
+                    len = sat_add(len, icmLutAB_curves_size(p->mCurves, 3));
+                }
+                break;
+            case 3:
+                if (p->aclut) {
+                    off[3] = len;
+                    len = sat_align(ALIGN_SIZE, sat_add(len, sat_add(20,
+                          sat_mul3(p->clutPrec, p->outputChan, icmLutAB_clut_points(p)))));
+                }
+                break;
+            case 4:
+                if (p->aclut) {
+                    off[4] = len;
+                    len = sat_add(len, icmLutAB_curves_size(p->aCurves, LUTAB_NA(p)));
+                }
+                break;
+        }
+    }
+    return len;
+}
+
+/* Translate normalized values through a set of curves */
+static int icmLutAB_lookup_curves(
+    icmCurve **cv,
+    unsigned int n,
+    double *out,
+    double *in
+) {
+    unsigned int i;
+    int rv = 0;
+
+    for (i = 0; i < n; i++)
+        rv |= cv[i]->lookup_fwd(cv[i], &out[i], &in[i]);
+    return rv;
+}
+
+/* Translate normalized values through the matrix and offsets */
+/* Return 0 on success, 1 if clipping occured, 2 on other error */
+static int icmLutAB_lookup_matrix(
+icmLutAB *p,
+double *out,
+double *in
+) {
+    double t0,t1;    /* Take care if out == in */
+    t0     = p->e[0][0] * in[0] + p->e[0][1] * in[1] + p->e[0][2] * in[2] + p->off[0];
+    t1     = p->e[1][0] * in[0] + p->e[1][1] * in[1] + p->e[1][2] * in[2] + p->off[1];
+    out[2] = p->e[2][0] * in[0] + p->e[2][1] * in[1] + p->e[2][2] * in[2] + p->off[2];
+    out[0] = t0;
+    out[1] = t1;
+
+    return 0;
+}
+
+/* Convert normalized numbers though the multi-dimensional table */
+/* using multi-linear interpolation. */
+/* Return 0 on success, 1 if clipping occured, 2 on other error */
+static int icmLutAB_lookup_clut_nl(
+icmLutAB *p,
+double *out,    /* Output array[outputChan] */
+double *in        /* Input array[inputChan] */
+) {
+    int rv = 0;
+    double *gp;                    /* Pointer to grid cube base */
+    double co[MAX_CHAN];        /* Coordinate offset with the grid cell */
+
+    /* Compute base index into grid and coordinate offsets */
+    {
+        unsigned int e;
+        gp = p->clutTable;        /* Base of grid array */
+
+        for (e = 0; e < p->inputChan; e++) {
+            unsigned int x;
+            double val;
+            double clutPoints_1 = (double)(p->clutPoints[e]-1);
+            val = in[e] * clutPoints_1;
+            if (val < 0.0) {
+                val = 0.0;
+                rv |= 1;
+            } else if (val > clutPoints_1) {
+                val = clutPoints_1;
+                rv |= 1;
+            }
+            x = (unsigned int)floor(val);    /* Grid coordinate */
+            if (x > (p->clutPoints[e]-2))
+                x = p->clutPoints[e]-2;
+            co[e] = val - (double)x;    /* 1.0 - weight */
+            gp += x * p->dinc[e];        /* Add index offset for base of cube */
+        }
+    }
+    icmClut_interp_nl(out, gp, co, p->dcube, p->inputChan, p->outputChan);
+    return rv;
+}
+
+/* Convert normalized numbers though the multi-dimensional table */
+/* using simplex interpolation. */
+/* Return 0 on success, 1 if clipping occured, 2 on other error */
+static int icmLutAB_lookup_clut_sx(
+icmLutAB *p,
+double *out,    /* Output array[outputChan] */
+double *in        /* Input array[inputChan] */
+) {
+    int rv = 0;
+    double *gp;                    /* Pointer to grid cube base */
+    double co[MAX_CHAN];        /* Coordinate offset with the grid cell */
+
+    /* Compute base index into grid and coordinate offsets */
+    {
+        unsigned int e;
+        gp = p->clutTable;        /* Base of grid array */
+
+        for (e = 0; e < p->inputChan; e++) {
+            unsigned int x;
+            double val;
+            double clutPoints_1 = (double)(p->clutPoints[e]-1);
+            val = in[e] * clutPoints_1;
+            if (val < 0.0) {
+                val = 0.0;
+                rv |= 1;
+            } else if (val > clutPoints_1) {
+                val = clutPoints_1;
+                rv |= 1;
+            }
+            x = (unsigned int)floor(val);        /* Grid coordinate */
+            if (x > (p->clutPoints[e]-2))
+                x = p->clutPoints[e]-2;
+            co[e] = val - (double)x;    /* 1.0 - weight */
+            gp += x * p->dinc[e];        /* Add index offset for base of cube */
+        }
+    }
+    icmClut_interp_sx(out, gp, co, p->dinc, p->inputChan, p->outputChan);
+    return rv;
+}
+
+/* Translate normalized values through all the elements of the Lut */
+/* Return 0 on success, 1 if clipping occured, 2 on other error */
+static int icmLutAB_lookup_fwd(
+icmLutAB *p,
+double *out,    /* Output array[outputChan] */
+double *in        /* Input array[inputChan] */
+) {
+    double temp[MAX_CHAN];
+    unsigned int i;
+    int rv = 0;
+
+    if (p->ttype == icSigLutBtoAType) {
+        rv |= icmLutAB_lookup_curves(p->bCurves, p->inputChan, temp, in);
+        if (p->mmatrix) {
+            rv |= icmLutAB_lookup_matrix(p, temp, temp);
+            rv |= icmLutAB_lookup_curves(p->mCurves, 3, temp, temp);
+        }
+        if (p->aclut) {
+            rv |= icmLutAB_lookup_clut_nl(p, out, temp);
+            rv |= icmLutAB_lookup_curves(p->aCurves, p->outputChan, out, out);
+        } else {
+            for (i = 0; i < p->outputChan; i++)
+                out[i] = temp[i];
+        }
+    } else {
+        if (p->aclut) {
+            rv |= icmLutAB_lookup_curves(p->aCurves, p->inputChan, temp, in);
+            rv |= icmLutAB_lookup_clut_nl(p, out, temp);
+        } else {
+            for (i = 0; i < p->outputChan; i++)
+                out[i] = in[i];
+        }
+        if (p->mmatrix) {
+            rv |= icmLutAB_lookup_curves(p->mCurves, 3, out, out);
+            rv |= icmLutAB_lookup_matrix(p, out, out);
+        }
+        rv |= icmLutAB_lookup_curves(p->bCurves, p->outputChan, out, out);
+    }
+    return rv;
+}
 
 /* Return the number of bytes needed to write this tag */
-static unsigned int icmMeasurement_get_size(
+static unsigned int icmLutAB_get_size(
     icmBase *pp
 ) {
-    unsigned int len = 0;
-    len = sat_add(len, 8);        /* 8 bytes for tag and padding */
-    len = sat_add(len, 4);        /* 4 for standard observer */
-    len = sat_add(len, 12);        /* 12 for XYZ of measurement backing */
-    len = sat_add(len, 4);        /* 4 for measurement geometry */
-    len = sat_add(len, 4);        /* 4 for measurement flare */
-    len = sat_add(len, 4);        /* 4 for standard illuminant */
-    return len;
+    icmLutAB *p = (icmLutAB *)pp;
+    unsigned int off[5];
+
+    return icmLutAB_layout(p, off);
+}
+
+/* Return the offset of the element following the one at offset of, */
+/* or the tag length if it is the last one. */
+static unsigned int icmLutAB_next_off(
+    unsigned int off[5],
+    unsigned int of,
+    unsigned int len
+) {
+    unsigned int i, nx = len;
+
+    for (i = 0; i < 5; i++) {
+        if (off[i] > of && off[i] < nx)
+            nx = off[i];
+    }
+    return nx;
+}
+
+/* Read a set of curves at offset off within the tag */
+static int icmLutAB_read_curves(
+    icmLutAB *p,
+    icmCurve **cv,
+    unsigned int n,
+    unsigned int off[5],        /* Element offsets */
+    unsigned int ix,            /* Element index */
+    unsigned int len,            /* tag length */
+    unsigned int of                /* start offset of tag within file */
+) {
+    icc *icp = p->icp;
+    unsigned int i, co, end;
+    int rv;
+
+    end = icmLutAB_next_off(off, off[ix], len);
+    for (co = off[ix], i = 0; i < n; i++) {
+        if (co >= end || (end - co) < 12) {
+            sprintf(icp->err,"icmLutAB_read: Curve element is outside tag");
+            return icp->errc = 1;
+        }
+        if ((rv = cv[i]->read((icmBase *)cv[i], end - co, of + co)) != 0)
+            return rv;
+        co = sat_align(ALIGN_SIZE, sat_add(co, cv[i]->get_size((icmBase *)cv[i])));
+    }
+    return 0;
 }
 
 /* read the object, return 0 on success, error code on fail */
-static int icmMeasurement_read(
+static int icmLutAB_read(
     icmBase *pp,
     unsigned int len,        /* tag length */
     unsigned int of        /* start offset within file */
 ) {
-    icmMeasurement *p = (icmMeasurement *)pp;
+    icmLutAB *p = (icmLutAB *)pp;
     icc *icp = p->icp;
-    int rv;
+    int rv = 0;
+    unsigned int i, j, size, off[5];
     char *bp, *buf;
 
-    if (len < 36) {
-        sprintf(icp->err,"icmMeasurement_read: Tag too small to be legal");
+    if (len < 32) {
+        sprintf(icp->err,"icmLutAB_read: Tag too small to be legal");
         return icp->errc = 1;
     }
 
     /* Allocate a file read buffer */
     if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
-        sprintf(icp->err,"icmMeasurement_read: malloc() failed");
+        sprintf(icp->err,"icmLutAB_read: malloc() failed");
         return icp->errc = 2;
     }
     bp = buf;
@@ -6528,846 +7745,982 @@ static int icmMeasurement_read(
     /* Read portion of file into buffer */
     if (   icp->fp->seek(icp->fp, of) != 0
         || icp->fp->read(icp->fp, bp, 1, len) != len) {
-        sprintf(icp->err,"icmMeasurement_read: fseek() or fread() failed");
+        sprintf(icp->err,"icmLutAB_read: fseek() or fread() failed");
         icp->al->free(icp->al, buf);
         return icp->errc = 1;
     }
 
     /* Read type descriptor from the buffer */
-    if (((icTagTypeSignature)read_SInt32Number(bp)) != p->ttype) {
-        sprintf(icp->err,"icmMeasurement_read: Wrong tag type for icmMeasurement");
+    p->ttype = (icTagTypeSignature)read_SInt32Number(bp);
+    if (p->ttype != icSigLutAtoBType && p->ttype != icSigLutBtoAType) {
+        sprintf(icp->err,"icmLutAB_read: Wrong tag type for icmLutAB");
         icp->al->free(icp->al, buf);
         return icp->errc = 1;
     }
 
-    /* Read the encoded standard observer */
-    p->observer = (icStandardObserver)read_SInt32Number(bp + 8);
+    p->inputChan = read_UInt8Number(bp+8);
+    p->outputChan = read_UInt8Number(bp+9);
 
-    /* Read the XYZ values for measurement backing */
-    if ((rv = read_XYZNumber(&p->backing, bp+12)) != 0) {
-        sprintf(icp->err,"icmMeasurement: read_XYZNumber error");
+    /* Sanity check */
+    if (p->inputChan < 1 || p->inputChan > MAX_CHAN
+     || p->outputChan < 1 || p->outputChan > MAX_CHAN) {
+        sprintf(icp->err,"icmLutAB_read: Can't handle %u input or %u output channels",
+                                                             p->inputChan, p->outputChan);
         icp->al->free(icp->al, buf);
-        return icp->errc = rv;
+        return icp->errc = 1;
     }
 
-    /* Read the encoded measurement geometry */
-    p->geometry = (icMeasurementGeometry)read_SInt32Number(bp + 24);
-
-    /* Read the proportion of flare  */
-    p->flare = read_U16Fixed16Number(bp + 28);
-
-    /* Read the encoded standard illuminant */
-    p->illuminant = (icIlluminant)read_SInt32Number(bp + 32);
-
-    icp->al->free(icp->al, buf);
-    return 0;
-}
-
-/* Write the contents of the object. Return 0 on sucess, error code on failure */
-static int icmMeasurement_write(
-    icmBase *pp,
-    unsigned int of            /* File offset to write from */
-) {
-    icmMeasurement *p = (icmMeasurement *)pp;
-    icc *icp = p->icp;
-    unsigned int len;
-    char *bp, *buf;        /* Buffer to write from */
-    int rv = 0;
-
-    /* Allocate a file write buffer */
-    if ((len = p->get_size((icmBase *)p)) == UINT_MAX) {
-        sprintf(icp->err,"icmMeasurement_write get_size overflow");
-        return icp->errc = 1;
+    /* Element offsets */
+    for (i = 0; i < 5; i++) {
+        off[i] = read_UInt32Number(bp + 12 + 4 * i);
+        if (off[i] != 0 && (off[i] < 32 || off[i] >= len)) {
+            sprintf(icp->err,"icmLutAB_read: Element offset is outside tag");
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
-        sprintf(icp->err,"icmMeasurement_write malloc() failed");
-        return icp->errc = 2;
+    if (off[0] == 0) {
+        sprintf(icp->err,"icmLutAB_read: B curves are missing");
+        icp->al->free(icp->al, buf);
+        return icp->errc = 1;
     }
-    bp = buf;
-
-    /* Write type descriptor to the buffer */
-    if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
-        sprintf(icp->err,"icmMeasurement_write, type: write_SInt32Number() failed");
+    if ((off[1] == 0) != (off[2] == 0)
+     || (off[3] == 0) != (off[4] == 0)) {
+        sprintf(icp->err,"icmLutAB_read: Matrix and M curves or clut and A curves not paired");
         icp->al->free(icp->al, buf);
-        return icp->errc = rv;
+        return icp->errc = 1;
     }
-    write_SInt32Number(0,bp+4);            /* Set padding to 0 */
+    p->mmatrix = off[1] != 0;
+    p->aclut = off[3] != 0;
 
-    /* Write the encoded standard observer */
-    if ((rv = write_SInt32Number((int)p->observer, bp + 8)) != 0) {
-        sprintf(icp->err,"icmMeasurementa_write, observer: write_SInt32Number() failed");
+    if ((p->mmatrix && LUTAB_NB(p) != 3)
+     || (!p->aclut && p->inputChan != p->outputChan)) {
+        sprintf(icp->err,"icmLutAB_read: Wrong number of channels for elements");
         icp->al->free(icp->al, buf);
-        return icp->errc = rv;
+        return icp->errc = 1;
     }
 
-    /* Write the XYZ values for measurement backing */
-    if ((rv = write_XYZNumber(&p->backing, bp+12)) != 0) {
-        sprintf(icp->err,"icmMeasurement, backing: write_XYZNumber error");
-        icp->al->free(icp->al, buf);
-        return icp->errc = rv;
+    /* Read matrix */
+    if (p->mmatrix) {
+        if ((len - off[1]) < 48) {
+            sprintf(icp->err,"icmLutAB_read: Matrix is outside tag");
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
+        for (j = 0; j < 3; j++) {        /* Rows */
+            for (i = 0; i < 3; i++) {    /* Columns */
+                p->e[j][i] = read_S15Fixed16Number(bp + off[1] + ((j * 3 + i) * 4));
+            }
+        }
+        for (j = 0; j < 3; j++)
+            p->off[j] = read_S15Fixed16Number(bp + off[1] + 36 + j * 4);
     }
 
-    /* Write the encoded measurement geometry */
-    if ((rv = write_SInt32Number((int)p->geometry, bp + 24)) != 0) {
-        sprintf(icp->err,"icmMeasurementa_write, geometry: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
-        return icp->errc = rv;
-    }
+    /* Read clut dimensions */
+    if (p->aclut) {
+        if ((len - off[3]) < 20) {
+            sprintf(icp->err,"icmLutAB_read: Clut is outside tag");
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
+        for (i = 0; i < p->inputChan; i++) {
+            if ((p->clutPoints[i] = read_UInt8Number(bp + off[3] + i)) < 2) {
+                sprintf(icp->err,"icmLutAB_read: Clut must have at least 2 grid points");
+                icp->al->free(icp->al, buf);
+                return icp->errc = 1;
+            }
+        }
+        p->clutPrec = read_UInt8Number(bp + off[3] + 16);
+        if (p->clutPrec != 1 && p->clutPrec != 2) {
+            sprintf(icp->err,"icmLutAB_read: Illegal clut precision %u",p->clutPrec);
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
 
-    /* Write the proportion of flare */
-    if ((rv = write_U16Fixed16Number(p->flare, bp + 28)) != 0) {
-        sprintf(icp->err,"icmMeasurementa_write, flare: write_U16Fixed16Number() failed");
-        icp->al->free(icp->al, buf);
-        return icp->errc = rv;
+        /* Sanity check dimensions. This protects against */
+        /* subsequent integer overflows involving the dimensions. */
+        if ((size = sat_mul3(p->clutPrec, p->outputChan, icmLutAB_clut_points(p))) == UINT_MAX
+         || size > (len - off[3] - 20)) {
+            sprintf(icp->err,"icmLutAB_read: Tag wrong size for clut");
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
     }
 
-    /* Write the encoded standard illuminant */
-    if ((rv = write_SInt32Number((int)p->illuminant, bp + 32)) != 0) {
-        sprintf(icp->err,"icmMeasurementa_write, illuminant: write_SInt32Number() failed");
+    if ((rv = p->allocate((icmBase *)p)) != 0) {
         icp->al->free(icp->al, buf);
-        return icp->errc = rv;
+        return rv;
     }
 
-    /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
-        sprintf(icp->err,"icmMeasurement_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
-        return icp->errc = 2;
+    /* Read the clut table */
+    if (p->aclut) {
+        size = p->outputChan * icmLutAB_clut_points(p);
+        bp = buf + off[3] + 20;
+        if (p->clutPrec == 1) {
+            for (i = 0; i < size; i++, bp += 1)
+                p->clutTable[i] = read_DCS8Number(bp);
+        } else {
+            for (i = 0; i < size; i++, bp += 2)
+                p->clutTable[i] = read_DCS16Number(bp);
+        }
     }
     icp->al->free(icp->al, buf);
-    return 0;
-}
-
-/* Dump a text description of the object */
-static void icmMeasurement_dump(
-    icmBase *pp,
-    icmFile *op,    /* Output to dump to */
-    int   verb        /* Verbosity level */
-) {
-    icmMeasurement *p = (icmMeasurement *)pp;
-    if (verb <= 0)
-        return;
 
-    op->gprintf(op,"Measurement:\n");
-    op->gprintf(op,"  Standard Observer = %s\n", string_StandardObserver(p->observer));
-    op->gprintf(op,"  XYZ for Measurement Backing = %s\n", string_XYZNumber_and_Lab(&p->backing));
-    op->gprintf(op,"  Measurement Geometry = %s\n", string_MeasurementGeometry(p->geometry));
-    op->gprintf(op,"  Measurement Flare = %5.1f%%\n", p->flare * 100.0);
-    op->gprintf(op,"  Standard Illuminant = %s\n", string_Illuminant(p->illuminant));
-}
+    /* Read the curves */
+    if ((rv = icmLutAB_read_curves(p, p->bCurves, LUTAB_NB(p), off, 0, len, of)) != 0)
+        return rv;
+    if (p->mmatrix
+     && (rv = icmLutAB_read_curves(p, p->mCurves, 3, off, 2, len, of)) != 0)
+        return rv;
+    if (p->aclut
+     && (rv = icmLutAB_read_curves(p, p->aCurves, LUTAB_NA(p), off, 4, len, of)) != 0)
+        return rv;
 
-/* Allocate variable sized data elements */
-static int icmMeasurement_allocate(
-    icmBase *pp
-) {
-    /* Nothing to do */
     return 0;
 }
 
-/* Free all storage in the object */
-static void icmMeasurement_delete(
-    icmBase *pp
+/* Write zero padding */
+static int icmLutAB_write_pad(
+    icc *icp,
+    unsigned int of,
+    unsigned int pad
 ) {
-    icmMeasurement *p = (icmMeasurement *)pp;
-    icc *icp = p->icp;
+    char *buf;
 
-    icp->al->free(icp->al, p);
+    if (pad == 0)
+        return 0;
+    if ((buf = icc_wbuf_get(icp, of, pad)) == NULL) {
+        sprintf(icp->err,"icmLutAB_write malloc() failed");
+        return icp->errc = 2;
+    }
+    memset(buf, 0, pad);
+    if (icc_wbuf_put(icp, buf, of, pad) != 0) {
+        sprintf(icp->err,"icmLutAB_write fseek() or fwrite() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = 2;
+    }
+    icc_wbuf_free(icp, buf);
+    return 0;
 }
 
-/* Create an empty object. Return null on error */
-static icmBase *new_icmMeasurement(
-    icc *icp
+/* Write a set of curves, each padded to the alignment size */
+static int icmLutAB_write_curves(
+    icmLutAB *p,
+    icmCurve **cv,
+    unsigned int n,
+    unsigned int of            /* File offset to write from */
 ) {
-    icmMeasurement *p;
-    if ((p = (icmMeasurement *) icp->al->calloc(icp->al,1,sizeof(icmMeasurement))) == NULL)
-        return NULL;
-    p->ttype    = icSigMeasurementType;
-    p->refcount = 1;
-    p->get_size = icmMeasurement_get_size;
-    p->read     = icmMeasurement_read;
-    p->write    = icmMeasurement_write;
-    p->dump     = icmMeasurement_dump;
-    p->allocate = icmMeasurement_allocate;
-    p->del      = icmMeasurement_delete;
-    p->icp      = icp;
+    icc *icp = p->icp;
+    unsigned int i, len;
+    int rv;
 
-    return (icmBase *)p;
+    for (i = 0; i < n; i++) {
+        if ((rv = cv[i]->write((icmBase *)cv[i], of)) != 0)
+            return rv;
+        len = cv[i]->get_size((icmBase *)cv[i]);
+        if ((rv = icmLutAB_write_pad(icp, of + len, sat_align(ALIGN_SIZE, len) - len)) != 0)
+            return rv;
+        of += sat_align(ALIGN_SIZE, len);
+    }
+    return 0;
 }
 
-/* ---------------------------------------------------------- */
-
-/* Named color structure read/write support */
-static int read_NamedColorVal(
-    icmNamedColorVal *p,
-    char *bp,
-    char *end,
-    icColorSpaceSignature pcs,        /* Header Profile Connection Space */
-    unsigned int ndc                /* Number of device corrds */
+/* Write the contents of the object. Return 0 on sucess, error code on failure */
+/* The elements are written in file order, since the ID computation */
+/* requires sequential writes. */
+static int icmLutAB_write(
+    icmBase *pp,
+    unsigned int of            /* File offset to write from */
 ) {
+    icmLutAB *p = (icmLutAB *)pp;
     icc *icp = p->icp;
-    unsigned int i;
-    unsigned int mxl;    /* Max possible string length */
+    unsigned int i, j, k;
+    unsigned int len, size, off[5], ord[5];
+    char *bp, *buf;        /* Buffer to write from */
+    int rv = 0;
 
-    if (bp > end) {
-        sprintf(icp->err,"icmNamedColorVal_read: Data too short to read");
+    if ((p->mmatrix && LUTAB_NB(p) != 3)
+     || (!p->aclut && p->inputChan != p->outputChan)) {
+        sprintf(icp->err,"icmLutAB_write: Wrong number of channels for elements");
         return icp->errc = 1;
     }
-    mxl = (end - bp) < 32 ? (end - bp) : 32;
-    if (check_null_string(bp,mxl)) {
-        sprintf(icp->err,"icmNamedColorVal_read: Root name string not terminated");
+    if (p->aclut && p->clutPrec != 1 && p->clutPrec != 2) {
+        sprintf(icp->err,"icmLutAB_write: Illegal clut precision %u",p->clutPrec);
         return icp->errc = 1;
     }
-    strcpy(p->root, bp);
-    bp += strlen(p->root) + 1;
-    if (bp > end || ndc > (end - bp)) {
-        sprintf(icp->err,"icmNamedColorVal_read: Data too short to read device coords");
+
+    if ((len = icmLutAB_layout(p, off)) == UINT_MAX) {
+        sprintf(icp->err,"icmLutAB_write get_size overflow");
         return icp->errc = 1;
     }
-    for (i = 0; i < ndc; i++) {
-        p->deviceCoords[i] = read_DCS8Number(bp);
-        bp += 1;
+
+    /* Write the header */
+    if ((buf = icc_wbuf_get(icp, of, 32)) == NULL) {
+        sprintf(icp->err,"icmLutAB_write malloc() failed");
+        return icp->errc = 2;
     }
-    return 0;
-}
+    bp = buf;
+    memset(bp, 0, 32);
 
-static int read_NamedColorVal2(
-    icmNamedColorVal *p,
-    char *bp,
-    char *end,
-    icColorSpaceSignature pcs,        /* Header Profile Connection Space */
-    unsigned int ndc                /* Number of device coords */
-) {
-    icc *icp = p->icp;
-    unsigned int i;
-    if (bp > end
-     || (32 + 6) > (end - bp)
-     || ndc > (end - bp - 32 - 6)/2) {
-        sprintf(icp->err,"icmNamedColorVal2_read: Data too short to read");
-        return icp->errc = 1;
+    if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
+        sprintf(icp->err,"icmLutAB_write: write_SInt32Number() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = rv;
     }
-    if (check_null_string(bp,32)) {
-        sprintf(icp->err,"icmNamedColorVal2_read: Root name string not terminated");
-        return icp->errc = 1;
+    if ((rv = write_UInt8Number(p->inputChan, bp+8)) != 0
+     || (rv = write_UInt8Number(p->outputChan, bp+9)) != 0) {
+        sprintf(icp->err,"icmLutAB_write: write_UInt8Number() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = rv;
     }
-    memmove((void *)p->root,(void *)(bp + 0),32);
-    switch(pcs) {
-        case icSigXYZData:
-            read_PCSNumber(icp, icSigXYZData, p->pcsCoords, bp+32);
-            break;
-           case icSigLabData:
-            /* namedColor2Type retains legacy Lab encoding */
-            read_PCSNumber(icp, icmSigLabV2Data, p->pcsCoords, bp+32);
-            break;
-        default:
-            return 1;        /* Unknown PCS */
+    for (i = 0; i < 5; i++)
+        write_UInt32Number(off[i], bp + 12 + 4 * i);
+
+    if (icc_wbuf_put(icp, buf, of, 32) != 0) {
+        sprintf(icp->err,"icmLutAB_write fseek() or fwrite() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = 2;
+    }
+    icc_wbuf_free(icp, buf);
+
+    /* Sort the present elements into file order */
+    for (k = i = 0; i < 5; i++) {
+        if (off[i] == 0)
+            continue;
+        for (j = k++; j > 0 && off[ord[j-1]] > off[i]; j--)
+            ord[j] = ord[j-1];
+        ord[j] = i;
+    }
+
+    for (j = 0; j < k; j++) {
+        switch (ord[j]) {
+            case 0:
+                if ((rv = icmLutAB_write_curves(p, p->bCurves, LUTAB_NB(p), of + off[0])) != 0)
+                    return rv;
+                break;
+
+            case 1:
+                if ((buf = icc_wbuf_get(icp, of + off[1], 48)) == NULL) {
+                    sprintf(icp->err,"icmLutAB_write malloc() failed");
+                    return icp->errc = 2;
+                }
+                for (size = 0; size < 12; size++) {
+                    double v = size < 9 ? p->e[size / 3][size % 3] : p->off[size - 9];
+                    if ((rv = write_S15Fixed16Number(v, buf + size * 4)) != 0) {
+                        sprintf(icp->err,"icmLutAB_write: write_S15Fixed16Number() failed");
+                        icc_wbuf_free(icp, buf);
+                        return icp->errc = rv;
+                    }
+                }
+                if (icc_wbuf_put(icp, buf, of + off[1], 48) != 0) {
+                    sprintf(icp->err,"icmLutAB_write fseek() or fwrite() failed");
+                    icc_wbuf_free(icp, buf);
+                    return icp->errc = 2;
+                }
+                icc_wbuf_free(icp, buf);
+                break;
+
+            case 2:
+                if ((rv = icmLutAB_write_curves(p, p->mCurves, 3, of + off[2])) != 0)
+                    return rv;
+                break;
+
+            case 3:
+                size = p->outputChan * icmLutAB_clut_points(p);
+                len = sat_align(ALIGN_SIZE, 20 + p->clutPrec * size);
+                if ((buf = icc_wbuf_get(icp, of + off[3], len)) == NULL) {
+                    sprintf(icp->err,"icmLutAB_write malloc() failed");
+                    return icp->errc = 2;
+                }
+                memset(buf, 0, len);
+                for (i = 0; i < p->inputChan; i++)
+                    write_UInt8Number(p->clutPoints[i], buf + i);
+                write_UInt8Number(p->clutPrec, buf + 16);
+                bp = buf + 20;
+                for (i = 0; i < size; i++, bp += p->clutPrec) {
+                    if (p->clutPrec == 1)
+                        rv = write_DCS8Number(p->clutTable[i], bp);
+                    else
+                        rv = write_DCS16Number(p->clutTable[i], bp);
+                    if (rv != 0) {
+                        sprintf(icp->err,"icmLutAB_write: clutTable write_DCS%dNumber(%f) failed",
+                                                          p->clutPrec * 8, p->clutTable[i]);
+                        icc_wbuf_free(icp, buf);
+                        return icp->errc = rv;
+                    }
+                }
+                if (icc_wbuf_put(icp, buf, of + off[3], len) != 0) {
+                    sprintf(icp->err,"icmLutAB_write fseek() or fwrite() failed");
+                    icc_wbuf_free(icp, buf);
+                    return icp->errc = 2;
+                }
+                icc_wbuf_free(icp, buf);
+                break;
+
+            case 4:
+                if ((rv = icmLutAB_write_curves(p, p->aCurves, LUTAB_NA(p), of + off[4])) != 0)
+                    return rv;
+                break;
+        }
     }
-    for (i = 0; i < ndc; i++)
-        p->deviceCoords[i] = read_DCS16Number(bp + 32 + 6 + 2 * i);
     return 0;
 }
 
-static int write_NamedColorVal(
-    icmNamedColorVal *p,
-    char *d,
-    icColorSpaceSignature pcs,        /* Header Profile Connection Space */
-    unsigned int ndc                /* Number of device corrds */
+/* Dump a set of curves */
+static void icmLutAB_dump_curves(
+    icmCurve **cv,
+    unsigned int n,
+    char *name,
+    icmFile *op,
+    int verb
 ) {
-    icc *icp = p->icp;
     unsigned int i;
-    int rv = 0;
-    if (check_null_string(p->root,32) != 0) {
-        sprintf(icp->err,"icmNamedColorVal_write: Root string names is unterminated");
-        return icp->errc = 1;
-    }
-    strcpy(d, p->root);
-    d += strlen(p->root) + 1;
-    for (i = 0; i < ndc; i++) {
-        if ((rv = write_DCS8Number(p->deviceCoords[i], d)) != 0) {
-            sprintf(icp->err,"icmNamedColorVal_write: write of device coord failed");
-            return icp->errc = 1;
-        }
-        d += 1;
+
+    for (i = 0; i < n; i++) {
+        op->gprintf(op,"  %s curve %u: ",name,i);
+        cv[i]->dump((icmBase *)cv[i], op, verb);
     }
-    return 0;
 }
 
-static int write_NamedColorVal2(
-    icmNamedColorVal *p,
-    char *bp,
-    icColorSpaceSignature pcs,        /* Header Profile Connection Space */
-    unsigned int ndc                /* Number of device coords */
+/* Dump a text description of the object */
+static void icmLutAB_dump(
+    icmBase *pp,
+    icmFile *op,    /* Output to dump to */
+    int   verb        /* Verbosity level */
 ) {
-    icc *icp = p->icp;
+    icmLutAB *p = (icmLutAB *)pp;
     unsigned int i;
-    int rv = 0;
-    if (check_null_string(p->root,32)) {
-        sprintf(icp->err,"icmNamedColorVal2_write: Root string names is unterminated");
-        return icp->errc = 1;
+
+    if (verb <= 0)
+        return;
+
+    if (p->ttype == icSigLutBtoAType) {
+        op->gprintf(op,"LutBtoA:\n");
+    } else {
+        op->gprintf(op,"LutAtoB:\n");
     }
-    memmove((void *)(bp + 0),(void *)p->root,32);
-    switch(pcs) {
-        case icSigXYZData:
-            rv |= write_PCSNumber(icp, icSigXYZData, p->pcsCoords, bp+32);
-            break;
-           case icSigLabData:
-            /* namedColor2Type retains legacy Lab encoding */
-            rv |= write_PCSNumber(icp, icmSigLabV2Data, p->pcsCoords, bp+32);
-            break;
-        default:
-            sprintf(icp->err,"icmNamedColorVal2_write: Unknown PCS");
-            return icp->errc = 1;
+    op->gprintf(op,"  Input Channels = %u\n",p->inputChan);
+    op->gprintf(op,"  Output Channels = %u\n",p->outputChan);
+    if (p->mmatrix) {
+        op->gprintf(op,"  Matrix =  %f, %f, %f + %f\n",p->e[0][0],p->e[0][1],p->e[0][2],p->off[0]);
+        op->gprintf(op,"            %f, %f, %f + %f\n",p->e[1][0],p->e[1][1],p->e[1][2],p->off[1]);
+        op->gprintf(op,"            %f, %f, %f + %f\n",p->e[2][0],p->e[2][1],p->e[2][2],p->off[2]);
+    } else {
+        op->gprintf(op,"  No M curves or matrix\n");
     }
-    if (rv) {
-        sprintf(icp->err,"icmNamedColorVal2_write: write of PCS coord failed");
+    if (p->aclut) {
+        op->gprintf(op,"  CLUT resolution =");
+        for (i = 0; i < p->inputChan; i++)
+            op->gprintf(op," %u",p->clutPoints[i]);
+        op->gprintf(op,"\n");
+        op->gprintf(op,"  CLUT precision = %u bits\n",p->clutPrec * 8);
+    } else {
+        op->gprintf(op,"  No A curves or CLUT\n");
+    }
+
+    if (verb >= 2) {
+        icmLutAB_dump_curves(p->bCurves, LUTAB_NB(p), "B", op, verb);
+        if (p->mmatrix)
+            icmLutAB_dump_curves(p->mCurves, 3, "M", op, verb);
+        if (p->aclut) {
+            unsigned int j, size;
+            unsigned int ii[MAX_CHAN];
+
+            icmLutAB_dump_curves(p->aCurves, LUTAB_NA(p), "A", op, verb);
+
+            op->gprintf(op,"\n  CLUT table:\n");
+            size = p->outputChan * icmLutAB_clut_points(p);
+            for (j = 0; j < p->inputChan; j++)
+                ii[j] = 0;
+            for (i = 0; i < size;) {
+                unsigned int k;
+                /* Print table entry index */
+                op->gprintf(op,"   ");
+                for (j = 0; j < p->inputChan; j++)
+                    op->gprintf(op," %2u",ii[j]);
+                op->gprintf(op,":");
+                /* Print table entry contents */
+                for (k = 0; k < p->outputChan; k++, i++)
+                    op->gprintf(op," %1.10f",p->clutTable[i]);
+                op->gprintf(op,"\n");
+            
+                for (j = p->inputChan-1; j < p->inputChan; j--) { /* Increment index */
+                    ii[j]++;
+                    if (ii[j] < p->clutPoints[j])
+                        break;    /* No carry */
+                    ii[j] = 0;
+                }
+            }
+        }
+    }
+}
+
+/* Make sure that the n curves in a set exist, and delete any others */
+static int icmLutAB_alloc_curves(
+    icmLutAB *p,
+    icmCurve **cv,
+    unsigned int n
+) {
+    icc *icp = p->icp;
+    unsigned int i;
+    int rv;
+
+    for (i = 0; i < MAX_CHAN; i++) {
+        if (i < n) {
+            if (cv[i] != NULL)
+                continue;
+            if ((cv[i] = (icmCurve *)new_icmCurve(icp)) == NULL) {
+                sprintf(icp->err,"icmLutAB_alloc: new_icmCurve() failed");
+                return icp->errc = 2;
+            }
+            cv[i]->flag = icmCurveLin;
+            if ((rv = cv[i]->allocate((icmBase *)cv[i])) != 0)
+                return rv;
+        } else if (cv[i] != NULL) {
+            cv[i]->del((icmBase *)cv[i]);
+            cv[i] = NULL;
+        }
+    }
+    return 0;
+}
+
+/* Allocate variable sized data elements */
+static int icmLutAB_allocate(
+    icmBase *pp
+) {
+    unsigned int i, j, g, size;
+    icmLutAB *p = (icmLutAB *)pp;
+    icc *icp = p->icp;
+    int rv;
+
+    /* Sanity check */
+    if (p->inputChan < 1 || p->inputChan > MAX_CHAN) {
+        sprintf(icp->err,"icmLutAB_alloc: Can't handle %u input channels\n",p->inputChan);
         return icp->errc = 1;
     }
-    for (i = 0; i < ndc; i++) {
-        if ((rv = write_DCS16Number(p->deviceCoords[i], bp + 32 + 6 + 2 * i)) != 0) {
-            sprintf(icp->err,"icmNamedColorVal2_write: write of device coord failed");
+
+    if (p->outputChan < 1 || p->outputChan > MAX_CHAN) {
+        sprintf(icp->err,"icmLutAB_alloc: Can't handle %u output channels\n",p->outputChan);
+        return icp->errc = 1;
+    }
+
+    if (p->mmatrix && LUTAB_NB(p) != 3) {
+        sprintf(icp->err,"icmLutAB_alloc: Matrix needs 3 channels\n");
+        return icp->errc = 1;
+    }
+
+    if ((rv = icmLutAB_alloc_curves(p, p->bCurves, LUTAB_NB(p))) != 0
+     || (rv = icmLutAB_alloc_curves(p, p->mCurves, p->mmatrix ? 3 : 0)) != 0
+     || (rv = icmLutAB_alloc_curves(p, p->aCurves, p->aclut ? LUTAB_NA(p) : 0)) != 0)
+        return rv;
+
+    size = 0;
+    if (p->aclut) {
+        for (i = 0; i < p->inputChan; i++) {
+            if (p->clutPoints[i] < 2) {
+                sprintf(icp->err,"icmLutAB_alloc: Clut must have at least 2 grid points");
+                return icp->errc = 1;
+            }
+        }
+        if ((size = sat_mul(p->outputChan, icmLutAB_clut_points(p))) == UINT_MAX) {
+            sprintf(icp->err,"icmLutAB_alloc size overflow");
+            return icp->errc = 1;
+        }
+    }
+    if (size != p->clutTable_size) {
+        if (ovr_mul(size, sizeof(double))) {
+            sprintf(icp->err,"icmLutAB_alloc: size overflow");
             return icp->errc = 1;
         }
+        if (p->clutTable != NULL)
+            icp->al->free(icp->al, p->clutTable);
+        p->clutTable = NULL;
+        if (size > 0
+         && (p->clutTable = (double *) icp->al->calloc(icp->al,size, sizeof(double))) == NULL) {
+            sprintf(icp->err,"icmLutAB_alloc: calloc() of LutAB clutTable data failed");
+            return icp->errc = 2;
+        }
+        p->clutTable_size = size;
+    }
+
+    if (p->aclut) {
+        /* Private: compute dimensional increment though clut */
+        /* Note that first channel varies least rapidly. */
+        i = p->inputChan-1;
+        p->dinc[i--] = p->outputChan;
+        for (; i < p->inputChan; i--)
+            p->dinc[i] = p->dinc[i+1] * p->clutPoints[i+1];
+
+        /* Private: compute offsets from base of cube to other corners */
+        for (p->dcube[0] = 0, g = 1, j = 0; j < p->inputChan; j++) {
+            for (i = 0; i < g; i++)
+                p->dcube[g+i] = p->dcube[i] + p->dinc[j];
+            g *= 2;
+        }
     }
+    
     return 0;
 }
 
-/* - - - - - - - - - - - */
-/* icmNamedColor object */
+/* Free all storage in the object */
+static void icmLutAB_delete(
+    icmBase *pp
+) {
+    icmLutAB *p = (icmLutAB *)pp;
+    icc *icp = p->icp;
+    int i;
+
+    for (i = 0; i < MAX_CHAN; i++) {
+        if (p->aCurves[i] != NULL)
+            p->aCurves[i]->del((icmBase *)p->aCurves[i]);
+        if (p->mCurves[i] != NULL)
+            p->mCurves[i]->del((icmBase *)p->mCurves[i]);
+        if (p->bCurves[i] != NULL)
+            p->bCurves[i]->del((icmBase *)p->bCurves[i]);
+    }
+    if (p->clutTable != NULL)
+        icp->al->free(icp->al, p->clutTable);
+    icp->al->free(icp->al, p);
+}
+
+/* Create an empty object. Return null on error */
+static icmBase *new_icmLutAB(
+    icc *icp
+) {
+    int i,j;
+    icmLutAB *p;
+    if ((p = (icmLutAB *) icp->al->calloc(icp->al,1,sizeof(icmLutAB))) == NULL)
+        return NULL;
+    p->ttype    = icSigLutAtoBType;
+    p->refcount = 1;
+    p->get_size = icmLutAB_get_size;
+    p->read     = icmLutAB_read;
+    p->write    = icmLutAB_write;
+    p->dump     = icmLutAB_dump;
+    p->allocate = icmLutAB_allocate;
+    p->del      = icmLutAB_delete;
+
+    /* Lookup methods */
+    p->lookup_fwd     = icmLutAB_lookup_fwd;
+    p->lookup_matrix  = icmLutAB_lookup_matrix;
+    p->lookup_clut_nl = icmLutAB_lookup_clut_nl;
+    p->lookup_clut_sx = icmLutAB_lookup_clut_sx;
+
+    p->icp      = icp;
+
+    /* Set matrix to reasonable default */
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            if (i == j)
+                p->e[i][j] = 1.0;
+            else
+                p->e[i][j] = 0.0;
+        }
+        p->off[i] = 0.0;
+    }
+    p->clutPrec = 2;
+
+    return (icmBase *)p;
+}
+
+/* ---------------------------------------------------------- */
+/* Measurement */
 
 /* Return the number of bytes needed to write this tag */
-static unsigned int icmNamedColor_get_size(
+static unsigned int icmMeasurement_get_size(
     icmBase *pp
 ) {
-    icmNamedColor *p = (icmNamedColor *)pp;
     unsigned int len = 0;
-    if (p->ttype == icSigNamedColorType) {
-        unsigned int i;
-        len = sat_add(len, 8);            /* 8 bytes for tag and padding */
-        len = sat_add(len, 4);            /* 4 for vendor specific flags */
-        len = sat_add(len, 4);            /* 4 for count of named colors */
-        len = sat_add(len, strlen(p->prefix) + 1); /* prefix of color names */
-        len = sat_add(len, strlen(p->suffix) + 1); /* suffix of color names */
-        for (i = 0; i < p->count; i++) {
-            len = sat_add(len, strlen(p->data[i].root) + 1); /* color names */
-            len = sat_add(len, p->nDeviceCoords * 1);    /* bytes for each named color */
-        }
-    } else {    /* Named Color 2 */
-        len = sat_add(len, 8);            /* 8 bytes for tag and padding */
-        len = sat_add(len, 4);            /* 4 for vendor specific flags */
-        len = sat_add(len, 4);            /* 4 for count of named colors */
-        len = sat_add(len, 4);            /* 4 for number of device coords */
-        len = sat_add(len, 32);            /* 32 for prefix of color names */
-        len = sat_add(len, 32);            /* 32 for suffix of color names */
-        len = sat_add(len, sat_mul(p->count, (32 + 6 + p->nDeviceCoords * 2)));
-                                        /* bytes for each named color */
-    }
+    len = sat_add(len, 8);        /* 8 bytes for tag and padding */
+    len = sat_add(len, 4);        /* 4 for standard observer */
+    len = sat_add(len, 12);        /* 12 for XYZ of measurement backing */
+    len = sat_add(len, 4);        /* 4 for measurement geometry */
+    len = sat_add(len, 4);        /* 4 for measurement flare */
+    len = sat_add(len, 4);        /* 4 for standard illuminant */
     return len;
 }
 
 /* read the object, return 0 on success, error code on fail */
-static int icmNamedColor_read(
+static int icmMeasurement_read(
     icmBase *pp,
-    unsigned int len,    /* tag length */
+    unsigned int len,        /* tag length */
     unsigned int of        /* start offset within file */
 ) {
-    icmNamedColor *p = (icmNamedColor *)pp;
+    icmMeasurement *p = (icmMeasurement *)pp;
     icc *icp = p->icp;
-    unsigned int i;
-    char *bp, *buf, *end;
-    int rv = 0;
+    int rv;
+    char *bp, *buf;
 
-    if (len < 4) {
-        sprintf(icp->err,"icmNamedColor_read: Tag too small to be legal");
+    if (len < 36) {
+        sprintf(icp->err,"icmMeasurement_read: Tag too small to be legal");
         return icp->errc = 1;
     }
 
     /* Allocate a file read buffer */
     if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
-        sprintf(icp->err,"icmNamedColor_read: malloc() failed");
+        sprintf(icp->err,"icmMeasurement_read: malloc() failed");
         return icp->errc = 2;
     }
     bp = buf;
-    end = buf + len;
 
     /* Read portion of file into buffer */
     if (   icp->fp->seek(icp->fp, of) != 0
         || icp->fp->read(icp->fp, bp, 1, len) != len) {
-        sprintf(icp->err,"icmNamedColor_read: fseek() or fread() failed");
+        sprintf(icp->err,"icmMeasurement_read: fseek() or fread() failed");
         icp->al->free(icp->al, buf);
         return icp->errc = 1;
     }
 
     /* Read type descriptor from the buffer */
-    p->ttype = (icTagTypeSignature)read_SInt32Number(bp);
-    if (p->ttype != icSigNamedColorType && p->ttype != icSigNamedColor2Type) {
-        sprintf(icp->err,"icmNamedColor_read: Wrong tag type for icmNamedColor");
+    if (((icTagTypeSignature)read_SInt32Number(bp)) != p->ttype) {
+        sprintf(icp->err,"icmMeasurement_read: Wrong tag type for icmMeasurement");
         icp->al->free(icp->al, buf);
         return icp->errc = 1;
     }
 
-    if (p->ttype == icSigNamedColorType) {
-        if (len < 16) {
-            sprintf(icp->err,"icmNamedColor_read: Tag too small to be legal");
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
-        /* Make sure that the number of device coords in known */
-        p->nDeviceCoords = number_ColorSpaceSignature(icp->header->colorSpace);
-        if (p->nDeviceCoords > MAX_CHAN) {
-            sprintf(icp->err,"icmNamedColor_read: Can't handle more than %d device channels",MAX_CHAN);
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
+    /* Read the encoded standard observer */
+    p->observer = (icStandardObserver)read_SInt32Number(bp + 8);
 
-    } else {    /* icmNC2 */
-        if (len < 84) {
-            sprintf(icp->err,"icmNamedColor_read: Tag too small to be legal");
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
+    /* Read the XYZ values for measurement backing */
+    if ((rv = read_XYZNumber(&p->backing, bp+12)) != 0) {
+        sprintf(icp->err,"icmMeasurement: read_XYZNumber error");
+        icp->al->free(icp->al, buf);
+        return icp->errc = rv;
     }
 
-    /* Read vendor specific flag */
-    p->vendorFlag = read_UInt32Number(bp+8);
+    /* Read the encoded measurement geometry */
+    p->geometry = (icMeasurementGeometry)read_SInt32Number(bp + 24);
 
-    /* Read count of named colors */
-    p->count = read_UInt32Number(bp+12);
+    /* Read the proportion of flare  */
+    p->flare = read_U16Fixed16Number(bp + 28);
 
-    if (p->ttype == icSigNamedColorType) {
-        unsigned int mxl;    /* Max possible string length */
-        bp = bp + 16;
+    /* Read the encoded standard illuminant */
+    p->illuminant = (icIlluminant)read_SInt32Number(bp + 32);
 
-        /* Prefix for each color name */
-        if (bp > end) {
-            sprintf(icp->err,"icmNamedColor_read: Data too short to read");
-            return icp->errc = 1;
-        }
-        mxl = (end - bp) < 32 ? (end - bp) : 32;
-        if (check_null_string(bp,mxl) != 0) {
-            sprintf(icp->err,"icmNamedColor_read: Color prefix is not null terminated");
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
-        strcpy(p->prefix, bp);
-        bp += strlen(p->prefix) + 1;
-    
-        /* Suffix for each color name */
-        if (bp > end) {
-            sprintf(icp->err,"icmNamedColor_read: Data too short to read");
-            return icp->errc = 1;
-        }
-        mxl = (end - bp) < 32 ? (end - bp) : 32;
-        if (check_null_string(bp,mxl) != 0) {
-            sprintf(icp->err,"icmNamedColor_read: Color suffix is not null terminated");
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
-        strcpy(p->suffix, bp);
-        bp += strlen(p->suffix) + 1;
-    
-        if ((rv = p->allocate((icmBase *)p)) != 0) {
-            icp->al->free(icp->al, buf);
-            return rv;
-        }
-    
-        /* Read all the data from the buffer */
-        for (i = 0; i < p->count; i++) {
-            if ((rv = read_NamedColorVal(p->data+i, bp, end, icp->header->pcs, p->nDeviceCoords)) != 0) {
-                icp->al->free(icp->al, buf);
-                return rv;
-            }
-            bp += strlen(p->data[i].root) + 1;
-            bp += p->nDeviceCoords * 1;
-        }
-    } else {  /* icmNC2 */
-        /* Number of device coords per color */
-        p->nDeviceCoords = read_UInt32Number(bp+16);
-        if (p->nDeviceCoords > MAX_CHAN) {
-            sprintf(icp->err,"icmNamedColor_read: Can't handle more than %d device channels",MAX_CHAN);
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
-    
-        /* Prefix for each color name */
-        memmove((void *)p->prefix, (void *)(bp + 20), 32);
-        if (check_null_string(p->prefix,32) != 0) {
-            sprintf(icp->err,"icmNamedColor_read: Color prefix is not null terminated");
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
-    
-        /* Suffix for each color name */
-        memmove((void *)p->suffix, (void *)(bp + 52), 32);
-        if (check_null_string(p->suffix,32) != 0) {
-            sprintf(icp->err,"icmNamedColor_read: Color suffix is not null terminated");
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
-    
-        if ((rv = p->allocate((icmBase *)p)) != 0) {
-            icp->al->free(icp->al, buf);
-            return rv;
-        }
-    
-        /* Read all the data from the buffer */
-        bp = bp + 84;
-        for (i = 0; i < p->count; i++) {
-            if ((rv = read_NamedColorVal2(p->data+i, bp, end, icp->header->pcs, p->nDeviceCoords)) != 0) {
-                icp->al->free(icp->al, buf);
-                return rv;
-            }
-            bp += 32 + 6 + p->nDeviceCoords * 2;
-        }
-    }
     icp->al->free(icp->al, buf);
-    return rv;
+    return 0;
 }
 
 /* Write the contents of the object. Return 0 on sucess, error code on failure */
-static int icmNamedColor_write(
+static int icmMeasurement_write(
     icmBase *pp,
     unsigned int of            /* File offset to write from */
 ) {
-    icmNamedColor *p = (icmNamedColor *)pp;
+    icmMeasurement *p = (icmMeasurement *)pp;
     icc *icp = p->icp;
-    unsigned int i;
     unsigned int len;
     char *bp, *buf;        /* Buffer to write from */
     int rv = 0;
 
     /* Allocate a file write buffer */
     if ((len = p->get_size((icmBase *)p)) == UINT_MAX) {
-        sprintf(icp->err,"icmNamedColor_write get_size overflow");
+        sprintf(icp->err,"icmMeasurement_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
-        sprintf(icp->err,"icmNamedColor_write malloc() failed");
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
+        sprintf(icp->err,"icmMeasurement_write malloc() failed");
         return icp->errc = 2;
     }
     bp = buf;
 
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
-        sprintf(icp->err,"icmNamedColor_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        sprintf(icp->err,"icmMeasurement_write, type: write_SInt32Number() failed");
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
 
-    /* Write vendor specific flag */
-    if ((rv = write_UInt32Number(p->vendorFlag, bp+8)) != 0) {
-        sprintf(icp->err,"icmNamedColor_write: write_UInt32Number() failed");
-        icp->al->free(icp->al, buf);
+    /* Write the encoded standard observer */
+    if ((rv = write_SInt32Number((int)p->observer, bp + 8)) != 0) {
+        sprintf(icp->err,"icmMeasurementa_write, observer: write_SInt32Number() failed");
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
 
-    /* Write count of named colors */
-    if ((rv = write_UInt32Number(p->count, bp+12)) != 0) {
-        sprintf(icp->err,"icmNamedColor_write: write_UInt32Number() failed");
-        icp->al->free(icp->al, buf);
+    /* Write the XYZ values for measurement backing */
+    if ((rv = write_XYZNumber(&p->backing, bp+12)) != 0) {
+        sprintf(icp->err,"icmMeasurement, backing: write_XYZNumber error");
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
 
-    if (p->ttype == icSigNamedColorType) {
-        bp = bp + 16;
-    
-        /* Prefix for each color name */
-        if ((rv = check_null_string(p->prefix,32)) != 0) {
-            sprintf(icp->err,"icmNamedColor_write: Color prefix is not null terminated");
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
-        strcpy(bp, p->prefix);
-        bp += strlen(p->prefix) + 1;
-    
-        /* Suffix for each color name */
-        if (check_null_string(p->suffix,32)) {
-            sprintf(icp->err,"icmNamedColor_write: Color sufix is not null terminated");
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
-        strcpy(bp, p->suffix);
-        bp += strlen(p->suffix) + 1;
-    
-        /* Write all the data to the buffer */
+    /* Write the encoded measurement geometry */
+    if ((rv = write_SInt32Number((int)p->geometry, bp + 24)) != 0) {
+        sprintf(icp->err,"icmMeasurementa_write, geometry: write_SInt32Number() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = rv;
+    }
 
-        for (i = 0; i < p->count; i++) {
-            if ((rv = write_NamedColorVal(p->data+i, bp, icp->header->pcs, p->nDeviceCoords)) != 0) {
-                icp->al->free(icp->al, buf);
-                return rv;
-            }
-            bp += strlen(p->data[i].root) + 1;
-            bp += p->nDeviceCoords * 1;
-        }
-    } else {    /* icmNC2 */
-        /* Number of device coords per color */
-        if ((rv = write_UInt32Number(p->nDeviceCoords, bp+16)) != 0) {
-            sprintf(icp->err,"icmNamedColor_write: write_UInt32Number() failed");
-            icp->al->free(icp->al, buf);
-            return icp->errc = rv;
-        }
-    
-        /* Prefix for each color name */
-        if ((rv = check_null_string(p->prefix,32)) != 0) {
-            sprintf(icp->err,"icmNamedColor_write: Color prefix is not null terminated");
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
-        memmove((void *)(bp + 20), (void *)p->prefix, 32);
-    
-        /* Suffix for each color name */
-        if (check_null_string(p->suffix,32)) {
-            sprintf(icp->err,"icmNamedColor_write: Color sufix is not null terminated");
-            icp->al->free(icp->al, buf);
-            return icp->errc = 1;
-        }
-        memmove((void *)(bp + 52), (void *)p->suffix, 32);
-    
-        /* Write all the data to the buffer */
-        bp = bp + 84;
-        for (i = 0; i < p->count; i++, bp += (32 + 6 + p->nDeviceCoords * 2)) {
-            if ((rv = write_NamedColorVal2(p->data+i, bp, icp->header->pcs, p->nDeviceCoords)) != 0) {
-                icp->al->free(icp->al, buf);
-                return rv;
-            }
-        }
+    /* Write the proportion of flare */
+    if ((rv = write_U16Fixed16Number(p->flare, bp + 28)) != 0) {
+        sprintf(icp->err,"icmMeasurementa_write, flare: write_U16Fixed16Number() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = rv;
+    }
+
+    /* Write the encoded standard illuminant */
+    if ((rv = write_SInt32Number((int)p->illuminant, bp + 32)) != 0) {
+        sprintf(icp->err,"icmMeasurementa_write, illuminant: write_SInt32Number() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = rv;
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
-        sprintf(icp->err,"icmNamedColor_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
+        sprintf(icp->err,"icmMeasurement_write fseek() or fwrite() failed");
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
 /* Dump a text description of the object */
-static void icmNamedColor_dump(
+static void icmMeasurement_dump(
     icmBase *pp,
     icmFile *op,    /* Output to dump to */
     int   verb        /* Verbosity level */
 ) {
-    icmNamedColor *p = (icmNamedColor *)pp;
-    icc *icp = p->icp;
+    icmMeasurement *p = (icmMeasurement *)pp;
     if (verb <= 0)
         return;
 
-    if (p->ttype == icSigNamedColorType)
-        op->gprintf(op,"NamedColor:\n");
-    else
-        op->gprintf(op,"NamedColor2:\n");
-    op->gprintf(op,"  Vendor Flag = 0x%x\n",p->vendorFlag);
-    op->gprintf(op,"  No. colors  = %u\n",p->count);
-    op->gprintf(op,"  No. dev. coords = %u\n",p->nDeviceCoords);
-    op->gprintf(op,"  Name prefix = '%s'\n",p->prefix);
-    op->gprintf(op,"  Name suffix = '%s'\n",p->suffix);
-    if (verb >= 2) {
-        unsigned int i, n;
-        icmNamedColorVal *vp;
-        for (i = 0; i < p->count; i++) {
-            vp = p->data + i;
-            op->gprintf(op,"    Color %lu:\n",i);
-            op->gprintf(op,"      Name root = '%s'\n",vp->root);
-
-            if (p->ttype == icSigNamedColor2Type) {
-                switch(icp->header->pcs) {
-                    case icSigXYZData:
-                            op->gprintf(op,"      XYZ = %f, %f, %f\n",
-                                    vp->pcsCoords[0],vp->pcsCoords[1],vp->pcsCoords[2]);
-                        break;
-                    case icSigLabData:
-                            op->gprintf(op,"      Lab = %f, %f, %f\n",
-                                    vp->pcsCoords[0],vp->pcsCoords[1],vp->pcsCoords[2]);
-                        break;
-                    default:
-                            op->gprintf(op,"      Unexpected PCS\n");
-                        break;
-                }
-            }
-            if (p->nDeviceCoords > 0) {
-                op->gprintf(op,"      Device Coords = ");
-                for (n = 0; n < p->nDeviceCoords; n++) {
-                    if (n > 0)
-                        op->gprintf(op,", ");
-                    op->gprintf(op,"%f",vp->deviceCoords[n]);
-                }
-                op->gprintf(op,"\n");
-            }
-        }
-    }
+    op->gprintf(op,"Measurement:\n");
+    op->gprintf(op,"  Standard Observer = %s\n", string_StandardObserver(p->observer));
+    op->gprintf(op,"  XYZ for Measurement Backing = %s\n", string_XYZNumber_and_Lab(&p->backing));
+    op->gprintf(op,"  Measurement Geometry = %s\n", string_MeasurementGeometry(p->geometry));
+    op->gprintf(op,"  Measurement Flare = %5.1f%%\n", p->flare * 100.0);
+    op->gprintf(op,"  Standard Illuminant = %s\n", string_Illuminant(p->illuminant));
 }
 
 /* Allocate variable sized data elements */
-static int icmNamedColor_allocate(
+static int icmMeasurement_allocate(
     icmBase *pp
 ) {
-    icmNamedColor *p = (icmNamedColor *)pp;
-    icc *icp = p->icp;
-
-    if (p->count != p->_count) {
-        unsigned int i;
-        if (ovr_mul(p->count, sizeof(icmNamedColorVal))) {
-            sprintf(icp->err,"icmNamedColor_alloc: size overflow");
-            return icp->errc = 1;
-        }
-        if (p->data != NULL)
-            icp->al->free(icp->al, p->data);
-        if ((p->data = (icmNamedColorVal *) icp->al->calloc(icp->al,p->count, sizeof(icmNamedColorVal))) == NULL) {
-            sprintf(icp->err,"icmNamedColor_alloc: malloc() of icmNamedColor data failed");
-            return icp->errc = 2;
-        }
-        for (i = 0; i < p->count; i++) {
-            p->data[i].icp = icp;    /* Do init */
-        }
-        p->_count = p->count;
-    }
+    /* Nothing to do */
     return 0;
 }
 
 /* Free all storage in the object */
-static void icmNamedColor_delete(
+static void icmMeasurement_delete(
     icmBase *pp
 ) {
-    icmNamedColor *p = (icmNamedColor *)pp;
+    icmMeasurement *p = (icmMeasurement *)pp;
     icc *icp = p->icp;
 
-    if (p->data != NULL)
-        icp->al->free(icp->al, p->data);
     icp->al->free(icp->al, p);
 }
 
 /* Create an empty object. Return null on error */
-static icmBase *new_icmNamedColor(
+static icmBase *new_icmMeasurement(
     icc *icp
 ) {
-    icmNamedColor *p;
-    if ((p = (icmNamedColor *) icp->al->calloc(icp->al,1,sizeof(icmNamedColor))) == NULL)
+    icmMeasurement *p;
+    if ((p = (icmMeasurement *) icp->al->calloc(icp->al,1,sizeof(icmMeasurement))) == NULL)
         return NULL;
-    p->ttype    = icSigNamedColor2Type;
+    p->ttype    = icSigMeasurementType;
     p->refcount = 1;
-    p->get_size = icmNamedColor_get_size;
-    p->read     = icmNamedColor_read;
-    p->write    = icmNamedColor_write;
-    p->dump     = icmNamedColor_dump;
-    p->allocate = icmNamedColor_allocate;
-    p->del      = icmNamedColor_delete;
+    p->get_size = icmMeasurement_get_size;
+    p->read     = icmMeasurement_read;
+    p->write    = icmMeasurement_write;
+    p->dump     = icmMeasurement_dump;
+    p->allocate = icmMeasurement_allocate;
+    p->del      = icmMeasurement_delete;
     p->icp      = icp;
 
-    /* Default the the number of device coords appropriately for NamedColorType */
-    p->nDeviceCoords = number_ColorSpaceSignature(icp->header->colorSpace);
-
     return (icmBase *)p;
 }
 
 /* ---------------------------------------------------------- */
-/* Colorant table structure read/write support */
-/* (Contribution from Piet Vandenborre) */
 
-static int read_ColorantTableVal(
-    icmColorantTableVal *p,
+/* Named color structure read/write support */
+static int read_NamedColorVal(
+    icmNamedColorVal *p,
     char *bp,
     char *end,
-    icColorSpaceSignature pcs        /* Header Profile Connection Space */
+    icColorSpaceSignature pcs,        /* Header Profile Connection Space */
+    unsigned int ndc                /* Number of device corrds */
 ) {
     icc *icp = p->icp;
-    if (bp > end || (32 + 6) > (end - bp)) {
-        sprintf(icp->err,"icmColorantTableVal_read: Data too short to read");
+    unsigned int i;
+    unsigned int mxl;    /* Max possible string length */
+
+    if (bp > end) {
+        sprintf(icp->err,"icmNamedColorVal_read: Data too short to read");
+        return icp->errc = 1;
+    }
+    mxl = (end - bp) < 32 ? (end - bp) : 32;
+    if (check_null_string(bp,mxl)) {
+        sprintf(icp->err,"icmNamedColorVal_read: Root name string not terminated");
+        return icp->errc = 1;
+    }
+    strcpy(p->root, bp);
+    bp += strlen(p->root) + 1;
+    if (bp > end || ndc > (end - bp)) {
+        sprintf(icp->err,"icmNamedColorVal_read: Data too short to read device coords");
+        return icp->errc = 1;
+    }
+    for (i = 0; i < ndc; i++) {
+        p->deviceCoords[i] = read_DCS8Number(bp);
+        bp += 1;
+    }
+    return 0;
+}
+
+static int read_NamedColorVal2(
+    icmNamedColorVal *p,
+    char *bp,
+    char *end,
+    icColorSpaceSignature pcs,        /* Header Profile Connection Space */
+    unsigned int ndc                /* Number of device coords */
+) {
+    icc *icp = p->icp;
+    unsigned int i;
+    if (bp > end
+     || (32 + 6) > (end - bp)
+     || ndc > (end - bp - 32 - 6)/2) {
+        sprintf(icp->err,"icmNamedColorVal2_read: Data too short to read");
         return icp->errc = 1;
     }
     if (check_null_string(bp,32)) {
-        sprintf(icp->err,"icmColorantTableVal_read: Name string not terminated");
+        sprintf(icp->err,"icmNamedColorVal2_read: Root name string not terminated");
         return icp->errc = 1;
     }
-    memmove((void *)p->name,(void *)(bp + 0),32);
+    memmove((void *)p->root,(void *)(bp + 0),32);
     switch(pcs) {
         case icSigXYZData:
-        case icSigLabData:
-            read_PCSNumber(icp, pcs, p->pcsCoords, bp+32);
+            read_PCSNumber(icp, icSigXYZData, p->pcsCoords, bp+32);
+            break;
+           case icSigLabData:
+            /* namedColor2Type retains legacy Lab encoding */
+            read_PCSNumber(icp, icmSigLabV2Data, p->pcsCoords, bp+32);
             break;
         default:
             return 1;        /* Unknown PCS */
     }
+    for (i = 0; i < ndc; i++)
+        p->deviceCoords[i] = read_DCS16Number(bp + 32 + 6 + 2 * i);
     return 0;
 }
 
-static int write_ColorantTableVal(
-    icmColorantTableVal *p,
+static int write_NamedColorVal(
+    icmNamedColorVal *p,
+    char *d,
+    icColorSpaceSignature pcs,        /* Header Profile Connection Space */
+    unsigned int ndc                /* Number of device corrds */
+) {
+    icc *icp = p->icp;
+    unsigned int i;
+    int rv = 0;
+    if (check_null_string(p->root,32) != 0) {
+        sprintf(icp->err,"icmNamedColorVal_write: Root string names is unterminated");
+        return icp->errc = 1;
+    }
+    strcpy(d, p->root);
+    d += strlen(p->root) + 1;
+    for (i = 0; i < ndc; i++) {
+        if ((rv = write_DCS8Number(p->deviceCoords[i], d)) != 0) {
+            sprintf(icp->err,"icmNamedColorVal_write: write of device coord failed");
+            return icp->errc = 1;
+        }
+        d += 1;
+    }
+    return 0;
+}
+
+static int write_NamedColorVal2(
+    icmNamedColorVal *p,
     char *bp,
-    icColorSpaceSignature pcs        /* Header Profile Connection Space */
+    icColorSpaceSignature pcs,        /* Header Profile Connection Space */
+    unsigned int ndc                /* Number of device coords */
 ) {
     icc *icp = p->icp;
+    unsigned int i;
     int rv = 0;
-    if (check_null_string(p->name,32)) {
-        sprintf(icp->err,"icmColorantTableVal_write: Name string is unterminated");
+    if (check_null_string(p->root,32)) {
+        sprintf(icp->err,"icmNamedColorVal2_write: Root string names is unterminated");
         return icp->errc = 1;
     }
-    memmove((void *)(bp + 0),(void *)p->name,32);
+    memmove((void *)(bp + 0),(void *)p->root,32);
     switch(pcs) {
         case icSigXYZData:
-        case icSigLabData:
-            rv |= write_PCSNumber(icp, pcs, p->pcsCoords, bp+32);
+            rv |= write_PCSNumber(icp, icSigXYZData, p->pcsCoords, bp+32);
+            break;
+           case icSigLabData:
+            /* namedColor2Type retains legacy Lab encoding */
+            rv |= write_PCSNumber(icp, icmSigLabV2Data, p->pcsCoords, bp+32);
             break;
         default:
-            sprintf(icp->err,"icmColorantTableVal_write: Unknown PCS");
+            sprintf(icp->err,"icmNamedColorVal2_write: Unknown PCS");
             return icp->errc = 1;
     }
     if (rv) {
-        sprintf(icp->err,"icmColorantTableVal_write: write of PCS coord failed");
+        sprintf(icp->err,"icmNamedColorVal2_write: write of PCS coord failed");
         return icp->errc = 1;
     }
+    for (i = 0; i < ndc; i++) {
+        if ((rv = write_DCS16Number(p->deviceCoords[i], bp + 32 + 6 + 2 * i)) != 0) {
+            sprintf(icp->err,"icmNamedColorVal2_write: write of device coord failed");
+            return icp->errc = 1;
+        }
+    }
     return 0;
 }
 
 /* - - - - - - - - - - - */
-/* icmColorantTable object */
+/* icmNamedColor object */
 
 /* Return the number of bytes needed to write this tag */
-static unsigned int icmColorantTable_get_size(
+static unsigned int icmNamedColor_get_size(
     icmBase *pp
 ) {
-    icmColorantTable *p = (icmColorantTable *)pp;
+    icmNamedColor *p = (icmNamedColor *)pp;
     unsigned int len = 0;
-    if (p->ttype == icSigColorantTableType) {
+    if (p->ttype == icSigNamedColorType) {
         unsigned int i;
         len = sat_add(len, 8);            /* 8 bytes for tag and padding */
-        len = sat_add(len, 4);            /* 4 for count of colorants */
+        len = sat_add(len, 4);            /* 4 for vendor specific flags */
+        len = sat_add(len, 4);            /* 4 for count of named colors */
+        len = sat_add(len, strlen(p->prefix) + 1); /* prefix of color names */
+        len = sat_add(len, strlen(p->suffix) + 1); /* suffix of color names */
         for (i = 0; i < p->count; i++) {
-            len = sat_add(len, 32); /* colorant names - 32 bytes*/
-            len = sat_add(len, 6); /* colorant pcs value - 3 x 16bit number*/
+            len = sat_add(len, strlen(p->data[i].root) + 1); /* color names */
+            len = sat_add(len, p->nDeviceCoords * 1);    /* bytes for each named color */
         }
+    } else {    /* Named Color 2 */
+        len = sat_add(len, 8);            /* 8 bytes for tag and padding */
+        len = sat_add(len, 4);            /* 4 for vendor specific flags */
+        len = sat_add(len, 4);            /* 4 for count of named colors */
+        len = sat_add(len, 4);            /* 4 for number of device coords */
+        len = sat_add(len, 32);            /* 32 for prefix of color names */
+        len = sat_add(len, 32);            /* 32 for suffix of color names */
+        len = sat_add(len, sat_mul(p->count, (32 + 6 + p->nDeviceCoords * 2)));
+                                        /* bytes for each named color */
     }
     return len;
 }
 
 /* read the object, return 0 on success, error code on fail */
-static int icmColorantTable_read(
+static int icmNamedColor_read(
     icmBase *pp,
-    unsigned int len,        /* tag length */
+    unsigned int len,    /* tag length */
     unsigned int of        /* start offset within file */
 ) {
-    icmColorantTable *p = (icmColorantTable *)pp;
+    icmNamedColor *p = (icmNamedColor *)pp;
     icc *icp = p->icp;
-    icColorSpaceSignature pcs;
     unsigned int i;
     char *bp, *buf, *end;
     int rv = 0;
 
-    if (icp->header->deviceClass != icSigLinkClass)
-        pcs = icp->header->pcs;
-    else
-        pcs = icSigLabData;
-
     if (len < 4) {
-        sprintf(icp->err,"icmColorantTable_read: Tag too small to be legal");
+        sprintf(icp->err,"icmNamedColor_read: Tag too small to be legal");
         return icp->errc = 1;
     }
 
     /* Allocate a file read buffer */
     if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
-        sprintf(icp->err,"icmColorantTable_read: malloc() failed");
+        sprintf(icp->err,"icmNamedColor_read: malloc() failed");
         return icp->errc = 2;
     }
     bp = buf;
@@ -7376,149 +8729,287 @@ static int icmColorantTable_read(
     /* Read portion of file into buffer */
     if (   icp->fp->seek(icp->fp, of) != 0
         || icp->fp->read(icp->fp, bp, 1, len) != len) {
-        sprintf(icp->err,"icmColorantTable_read: fseek() or fread() failed");
+        sprintf(icp->err,"icmNamedColor_read: fseek() or fread() failed");
         icp->al->free(icp->al, buf);
         return icp->errc = 1;
     }
 
     /* Read type descriptor from the buffer */
     p->ttype = (icTagTypeSignature)read_SInt32Number(bp);
-    if (p->ttype != icSigColorantTableType) {
-        sprintf(icp->err,"icmColorantTable_read: Wrong tag type for icmColorantTable");
-        icp->al->free(icp->al, buf);
-        return icp->errc = 1;
-    }
-
-    if (len < 12) {
-        sprintf(icp->err,"icmColorantTable_read: Tag too small to be legal");
-        icp->al->free(icp->al, buf);
-        return icp->errc = 1;
-    }
-
-    /* Read count of colorants */
-    p->count = read_UInt32Number(bp+8);
-
-    if (p->count > ((len - 12) / (32 + 6))) {
-        sprintf(icp->err,"icmColorantTable_read count overflow");
+    if (p->ttype != icSigNamedColorType && p->ttype != icSigNamedColor2Type) {
+        sprintf(icp->err,"icmNamedColor_read: Wrong tag type for icmNamedColor");
         icp->al->free(icp->al, buf);
         return icp->errc = 1;
     }
 
-    bp = bp + 12;
-
-    if ((rv = p->allocate((icmBase *)p)) != 0) {
-        icp->al->free(icp->al, buf);
-        return rv;
-    }
+    if (p->ttype == icSigNamedColorType) {
+        if (len < 16) {
+            sprintf(icp->err,"icmNamedColor_read: Tag too small to be legal");
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
+        /* Make sure that the number of device coords in known */
+        p->nDeviceCoords = number_ColorSpaceSignature(icp->header->colorSpace);
+        if (p->nDeviceCoords > MAX_CHAN) {
+            sprintf(icp->err,"icmNamedColor_read: Can't handle more than %d device channels",MAX_CHAN);
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
 
-    /* Read all the data from the buffer */
-    for (i = 0; i < p->count; i++, bp += (32 + 6)) {
-        if ((rv = read_ColorantTableVal(p->data+i, bp, end, pcs)) != 0) {
+    } else {    /* icmNC2 */
+        if (len < 84) {
+            sprintf(icp->err,"icmNamedColor_read: Tag too small to be legal");
             icp->al->free(icp->al, buf);
-            return rv;
+            return icp->errc = 1;
         }
     }
 
-    icp->al->free(icp->al, buf);
-    return rv;
-}
+    /* Read vendor specific flag */
+    p->vendorFlag = read_UInt32Number(bp+8);
 
-/* Write the contents of the object. Return 0 on sucess, error code on failure */
-static int icmColorantTable_write(
-    icmBase *pp,
-    unsigned int of            /* File offset to write from */
-) {
-    icmColorantTable *p = (icmColorantTable *)pp;
-    icc *icp = p->icp;
-    icColorSpaceSignature pcs;
-    unsigned int i;
-    unsigned int len;
-    char *bp, *buf;        /* Buffer to write from */
-    int rv = 0;
+    /* Read count of named colors */
+    p->count = read_UInt32Number(bp+12);
 
-    if (icp->header->deviceClass != icSigLinkClass)
-        pcs = icp->header->pcs;
-    else
-        pcs = icSigLabData;
+    if (p->ttype == icSigNamedColorType) {
+        unsigned int mxl;    /* Max possible string length */
+        bp = bp + 16;
 
-    /* Allocate a file write buffer */
-    if ((len = p->get_size((icmBase *)p)) == UINT_MAX) {
-        sprintf(icp->err,"icmColorantTable_write get_size overflow");
-        return icp->errc = 1;
-    }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
-        sprintf(icp->err,"icmColorantTable_write malloc() failed");
+        /* Prefix for each color name */
+        if (bp > end) {
+            sprintf(icp->err,"icmNamedColor_read: Data too short to read");
+            return icp->errc = 1;
+        }
+        mxl = (end - bp) < 32 ? (end - bp) : 32;
+        if (check_null_string(bp,mxl) != 0) {
+            sprintf(icp->err,"icmNamedColor_read: Color prefix is not null terminated");
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
+        strcpy(p->prefix, bp);
+        bp += strlen(p->prefix) + 1;
+    
+        /* Suffix for each color name */
+        if (bp > end) {
+            sprintf(icp->err,"icmNamedColor_read: Data too short to read");
+            return icp->errc = 1;
+        }
+        mxl = (end - bp) < 32 ? (end - bp) : 32;
+        if (check_null_string(bp,mxl) != 0) {
+            sprintf(icp->err,"icmNamedColor_read: Color suffix is not null terminated");
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
+        strcpy(p->suffix, bp);
+        bp += strlen(p->suffix) + 1;
+    
+        if ((rv = p->allocate((icmBase *)p)) != 0) {
+            icp->al->free(icp->al, buf);
+            return rv;
+        }
+    
+        /* Read all the data from the buffer */
+        for (i = 0; i < p->count; i++) {
+            if ((rv = read_NamedColorVal(p->data+i, bp, end, icp->header->pcs, p->nDeviceCoords)) != 0) {
+                icp->al->free(icp->al, buf);
+                return rv;
+            }
+            bp += strlen(p->data[i].root) + 1;
+            bp += p->nDeviceCoords * 1;
+        }
+    } else {  /* icmNC2 */
+        /* Number of device coords per color */
+        p->nDeviceCoords = read_UInt32Number(bp+16);
+        if (p->nDeviceCoords > MAX_CHAN) {
+            sprintf(icp->err,"icmNamedColor_read: Can't handle more than %d device channels",MAX_CHAN);
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
+    
+        /* Prefix for each color name */
+        memmove((void *)p->prefix, (void *)(bp + 20), 32);
+        if (check_null_string(p->prefix,32) != 0) {
+            sprintf(icp->err,"icmNamedColor_read: Color prefix is not null terminated");
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
+    
+        /* Suffix for each color name */
+        memmove((void *)p->suffix, (void *)(bp + 52), 32);
+        if (check_null_string(p->suffix,32) != 0) {
+            sprintf(icp->err,"icmNamedColor_read: Color suffix is not null terminated");
+            icp->al->free(icp->al, buf);
+            return icp->errc = 1;
+        }
+    
+        if ((rv = p->allocate((icmBase *)p)) != 0) {
+            icp->al->free(icp->al, buf);
+            return rv;
+        }
+    
+        /* Read all the data from the buffer */
+        bp = bp + 84;
+        for (i = 0; i < p->count; i++) {
+            if ((rv = read_NamedColorVal2(p->data+i, bp, end, icp->header->pcs, p->nDeviceCoords)) != 0) {
+                icp->al->free(icp->al, buf);
+                return rv;
+            }
+            bp += 32 + 6 + p->nDeviceCoords * 2;
+        }
+    }
+    icp->al->free(icp->al, buf);
+    return rv;
+}
+
+/* Write the contents of the object. Return 0 on sucess, error code on failure */
+static int icmNamedColor_write(
+    icmBase *pp,
+    unsigned int of            /* File offset to write from */
+) {
+    icmNamedColor *p = (icmNamedColor *)pp;
+    icc *icp = p->icp;
+    unsigned int i;
+    unsigned int len;
+    char *bp, *buf;        /* Buffer to write from */
+    int rv = 0;
+
+    /* Allocate a file write buffer */
+    if ((len = p->get_size((icmBase *)p)) == UINT_MAX) {
+        sprintf(icp->err,"icmNamedColor_write get_size overflow");
+        return icp->errc = 1;
+    }
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
+        sprintf(icp->err,"icmNamedColor_write malloc() failed");
         return icp->errc = 2;
     }
     bp = buf;
 
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
-        sprintf(icp->err,"icmColorantTable_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        sprintf(icp->err,"icmNamedColor_write: write_SInt32Number() failed");
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
 
-    /* Write count of colorants */
-    if ((rv = write_UInt32Number(p->count, bp+8)) != 0) {
-        sprintf(icp->err,"icmColorantTable_write: write_UInt32Number() failed");
-        icp->al->free(icp->al, buf);
+    /* Write vendor specific flag */
+    if ((rv = write_UInt32Number(p->vendorFlag, bp+8)) != 0) {
+        sprintf(icp->err,"icmNamedColor_write: write_UInt32Number() failed");
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
 
-    bp = bp + 12;
+    /* Write count of named colors */
+    if ((rv = write_UInt32Number(p->count, bp+12)) != 0) {
+        sprintf(icp->err,"icmNamedColor_write: write_UInt32Number() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = rv;
+    }
+
+    if (p->ttype == icSigNamedColorType) {
+        bp = bp + 16;
     
-    /* Write all the data to the buffer */
-    for (i = 0; i < p->count; i++, bp += (32 + 6)) {
-        if ((rv = write_ColorantTableVal(p->data+i, bp, pcs)) != 0) {
-            icp->al->free(icp->al, buf);
-            return rv;
+        /* Prefix for each color name */
+        if ((rv = check_null_string(p->prefix,32)) != 0) {
+            sprintf(icp->err,"icmNamedColor_write: Color prefix is not null terminated");
+            icc_wbuf_free(icp, buf);
+            return icp->errc = 1;
+        }
+        strcpy(bp, p->prefix);
+        bp += strlen(p->prefix) + 1;
+    
+        /* Suffix for each color name */
+        if (check_null_string(p->suffix,32)) {
+            sprintf(icp->err,"icmNamedColor_write: Color sufix is not null terminated");
+            icc_wbuf_free(icp, buf);
+            return icp->errc = 1;
+        }
+        strcpy(bp, p->suffix);
+        bp += strlen(p->suffix) + 1;
+    
+        /* Write all the data to the buffer */
+
+        for (i = 0; i < p->count; i++) {
+            if ((rv = write_NamedColorVal(p->data+i, bp, icp->header->pcs, p->nDeviceCoords)) != 0) {
+                icc_wbuf_free(icp, buf);
+                return rv;
+            }
+            bp += strlen(p->data[i].root) + 1;
+            bp += p->nDeviceCoords * 1;
+        }
+    } else {    /* icmNC2 */
+        /* Number of device coords per color */
+        if ((rv = write_UInt32Number(p->nDeviceCoords, bp+16)) != 0) {
+            sprintf(icp->err,"icmNamedColor_write: write_UInt32Number() failed");
+            icc_wbuf_free(icp, buf);
+            return icp->errc = rv;
+        }
+    
+        /* Prefix for each color name */
+        if ((rv = check_null_string(p->prefix,32)) != 0) {
+            sprintf(icp->err,"icmNamedColor_write: Color prefix is not null terminated");
+            icc_wbuf_free(icp, buf);
+            return icp->errc = 1;
+        }
+        memmove((void *)(bp + 20), (void *)p->prefix, 32);
+    
+        /* Suffix for each color name */
+        if (check_null_string(p->suffix,32)) {
+            sprintf(icp->err,"icmNamedColor_write: Color sufix is not null terminated");
+            icc_wbuf_free(icp, buf);
+            return icp->errc = 1;
+        }
+        memmove((void *)(bp + 52), (void *)p->suffix, 32);
+    
+        /* Write all the data to the buffer */
+        bp = bp + 84;
+        for (i = 0; i < p->count; i++, bp += (32 + 6 + p->nDeviceCoords * 2)) {
+            if ((rv = write_NamedColorVal2(p->data+i, bp, icp->header->pcs, p->nDeviceCoords)) != 0) {
+                icc_wbuf_free(icp, buf);
+                return rv;
+            }
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
-        sprintf(icp->err,"icmColorantTable_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
+        sprintf(icp->err,"icmNamedColor_write fseek() or fwrite() failed");
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
 /* Dump a text description of the object */
-static void icmColorantTable_dump(
+static void icmNamedColor_dump(
     icmBase *pp,
     icmFile *op,    /* Output to dump to */
     int   verb        /* Verbosity level */
 ) {
-    icmColorantTable *p = (icmColorantTable *)pp;
+    icmNamedColor *p = (icmNamedColor *)pp;
     icc *icp = p->icp;
-    icColorSpaceSignature pcs;
-
-    if (icp->header->deviceClass != icSigLinkClass)
-        pcs = icp->header->pcs;
-    else
-        pcs = icSigLabData;
-
     if (verb <= 0)
         return;
 
-    if (p->ttype == icSigColorantTableType)
-        op->gprintf(op,"ColorantTable:\n");
-    op->gprintf(op,"  No. colorants  = %u\n",p->count);
+    if (p->ttype == icSigNamedColorType)
+        op->gprintf(op,"NamedColor:\n");
+    else
+        op->gprintf(op,"NamedColor2:\n");
+    op->gprintf(op,"  Vendor Flag = 0x%x\n",p->vendorFlag);
+    op->gprintf(op,"  No. colors  = %u\n",p->count);
+    op->gprintf(op,"  No. dev. coords = %u\n",p->nDeviceCoords);
+    op->gprintf(op,"  Name prefix = '%s'\n",p->prefix);
+    op->gprintf(op,"  Name suffix = '%s'\n",p->suffix);
     if (verb >= 2) {
-        unsigned int i;
-        icmColorantTableVal *vp;
+        unsigned int i, n;
+        icmNamedColorVal *vp;
         for (i = 0; i < p->count; i++) {
             vp = p->data + i;
-            op->gprintf(op,"    Colorant %lu:\n",i);
-            op->gprintf(op,"      Name = '%s'\n",vp->name);
+            op->gprintf(op,"    Color %lu:\n",i);
+            op->gprintf(op,"      Name root = '%s'\n",vp->root);
 
-            if (p->ttype == icSigColorantTableType) {
-                switch(pcs) {
+            if (p->ttype == icSigNamedColor2Type) {
+                switch(icp->header->pcs) {
                     case icSigXYZData:
                             op->gprintf(op,"      XYZ = %f, %f, %f\n",
                                     vp->pcsCoords[0],vp->pcsCoords[1],vp->pcsCoords[2]);
@@ -7532,27 +9023,36 @@ static void icmColorantTable_dump(
                         break;
                 }
             }
+            if (p->nDeviceCoords > 0) {
+                op->gprintf(op,"      Device Coords = ");
+                for (n = 0; n < p->nDeviceCoords; n++) {
+                    if (n > 0)
+                        op->gprintf(op,", ");
+                    op->gprintf(op,"%f",vp->deviceCoords[n]);
+                }
+                op->gprintf(op,"\n");
+            }
         }
     }
 }
 
 /* Allocate variable sized data elements */
-static int icmColorantTable_allocate(
+static int icmNamedColor_allocate(
     icmBase *pp
 ) {
-    icmColorantTable *p = (icmColorantTable *)pp;
+    icmNamedColor *p = (icmNamedColor *)pp;
     icc *icp = p->icp;
 
     if (p->count != p->_count) {
         unsigned int i;
-        if (ovr_mul(p->count, sizeof(icmColorantTableVal))) {
-            sprintf(icp->err,"icmColorantTable_alloc: count overflow");
+        if (ovr_mul(p->count, sizeof(icmNamedColorVal))) {
+            sprintf(icp->err,"icmNamedColor_alloc: size overflow");
             return icp->errc = 1;
         }
         if (p->data != NULL)
             icp->al->free(icp->al, p->data);
-        if ((p->data = (icmColorantTableVal *) icp->al->calloc(icp->al,p->count, sizeof(icmColorantTableVal))) == NULL) {
-            sprintf(icp->err,"icmColorantTable_alloc: malloc() of icmColorantTable data failed");
+        if ((p->data = (icmNamedColorVal *) icp->al->calloc(icp->al,p->count, sizeof(icmNamedColorVal))) == NULL) {
+            sprintf(icp->err,"icmNamedColor_alloc: malloc() of icmNamedColor data failed");
             return icp->errc = 2;
         }
         for (i = 0; i < p->count; i++) {
@@ -7564,10 +9064,10 @@ static int icmColorantTable_allocate(
 }
 
 /* Free all storage in the object */
-static void icmColorantTable_delete(
+static void icmNamedColor_delete(
     icmBase *pp
 ) {
-    icmColorantTable *p = (icmColorantTable *)pp;
+    icmNamedColor *p = (icmNamedColor *)pp;
     icc *icp = p->icp;
 
     if (p->data != NULL)
@@ -7576,64 +9076,134 @@ static void icmColorantTable_delete(
 }
 
 /* Create an empty object. Return null on error */
-static icmBase *new_icmColorantTable(
+static icmBase *new_icmNamedColor(
     icc *icp
 ) {
-    icmColorantTable *p;
-    if ((p = (icmColorantTable *) icp->al->calloc(icp->al,1,sizeof(icmColorantTable))) == NULL)
+    icmNamedColor *p;
+    if ((p = (icmNamedColor *) icp->al->calloc(icp->al,1,sizeof(icmNamedColor))) == NULL)
         return NULL;
-    p->ttype    = icSigColorantTableType;
+    p->ttype    = icSigNamedColor2Type;
     p->refcount = 1;
-    p->get_size = icmColorantTable_get_size;
-    p->read     = icmColorantTable_read;
-    p->write    = icmColorantTable_write;
-    p->dump     = icmColorantTable_dump;
-    p->allocate = icmColorantTable_allocate;
-    p->del      = icmColorantTable_delete;
+    p->get_size = icmNamedColor_get_size;
+    p->read     = icmNamedColor_read;
+    p->write    = icmNamedColor_write;
+    p->dump     = icmNamedColor_dump;
+    p->allocate = icmNamedColor_allocate;
+    p->del      = icmNamedColor_delete;
     p->icp      = icp;
 
+    /* Default the the number of device coords appropriately for NamedColorType */
+    p->nDeviceCoords = number_ColorSpaceSignature(icp->header->colorSpace);
+
     return (icmBase *)p;
 }
 
 /* ---------------------------------------------------------- */
-/* textDescription */
+/* Colorant table structure read/write support */
+/* (Contribution from Piet Vandenborre) */
+
+static int read_ColorantTableVal(
+    icmColorantTableVal *p,
+    char *bp,
+    char *end,
+    icColorSpaceSignature pcs        /* Header Profile Connection Space */
+) {
+    icc *icp = p->icp;
+    if (bp > end || (32 + 6) > (end - bp)) {
+        sprintf(icp->err,"icmColorantTableVal_read: Data too short to read");
+        return icp->errc = 1;
+    }
+    if (check_null_string(bp,32)) {
+        sprintf(icp->err,"icmColorantTableVal_read: Name string not terminated");
+        return icp->errc = 1;
+    }
+    memmove((void *)p->name,(void *)(bp + 0),32);
+    switch(pcs) {
+        case icSigXYZData:
+        case icSigLabData:
+            read_PCSNumber(icp, pcs, p->pcsCoords, bp+32);
+            break;
+        default:
+            return 1;        /* Unknown PCS */
+    }
+    return 0;
+}
+
+static int write_ColorantTableVal(
+    icmColorantTableVal *p,
+    char *bp,
+    icColorSpaceSignature pcs        /* Header Profile Connection Space */
+) {
+    icc *icp = p->icp;
+    int rv = 0;
+    if (check_null_string(p->name,32)) {
+        sprintf(icp->err,"icmColorantTableVal_write: Name string is unterminated");
+        return icp->errc = 1;
+    }
+    memmove((void *)(bp + 0),(void *)p->name,32);
+    switch(pcs) {
+        case icSigXYZData:
+        case icSigLabData:
+            rv |= write_PCSNumber(icp, pcs, p->pcsCoords, bp+32);
+            break;
+        default:
+            sprintf(icp->err,"icmColorantTableVal_write: Unknown PCS");
+            return icp->errc = 1;
+    }
+    if (rv) {
+        sprintf(icp->err,"icmColorantTableVal_write: write of PCS coord failed");
+        return icp->errc = 1;
+    }
+    return 0;
+}
+
+/* - - - - - - - - - - - */
+/* icmColorantTable object */
 
 /* Return the number of bytes needed to write this tag */
-static unsigned int icmTextDescription_get_size(
+static unsigned int icmColorantTable_get_size(
     icmBase *pp
 ) {
-    icmTextDescription *p = (icmTextDescription *)pp;
+    icmColorantTable *p = (icmColorantTable *)pp;
     unsigned int len = 0;
-    len = sat_add(len, 8);                        /* 8 bytes for tag and padding */
-    len = sat_addadd(len, 4, p->size);            /* Ascii string length + ascii string */
-    len = sat_addaddmul(len, 8, 2, p->ucSize);    /* Unicode language code + length + string */
-    len = sat_addadd(len, 3, 67);                /* ScriptCode code, length string */
+    if (p->ttype == icSigColorantTableType) {
+        unsigned int i;
+        len = sat_add(len, 8);            /* 8 bytes for tag and padding */
+        len = sat_add(len, 4);            /* 4 for count of colorants */
+        for (i = 0; i < p->count; i++) {
+            len = sat_add(len, 32); /* colorant names - 32 bytes*/
+            len = sat_add(len, 6); /* colorant pcs value - 3 x 16bit number*/
+        }
+    }
     return len;
 }
 
 /* read the object, return 0 on success, error code on fail */
-static int icmTextDescription_read(
+static int icmColorantTable_read(
     icmBase *pp,
     unsigned int len,        /* tag length */
     unsigned int of        /* start offset within file */
 ) {
-    icmTextDescription *p = (icmTextDescription *)pp;
+    icmColorantTable *p = (icmColorantTable *)pp;
     icc *icp = p->icp;
-    int rv;
+    icColorSpaceSignature pcs;
+    unsigned int i;
     char *bp, *buf, *end;
+    int rv = 0;
 
-#ifdef ICM_STRICT
-    if (len < (8 + 4 + 8 + 3 /* + 67 */)) {
-#else
-    if (len < (8 + 4 + 8 + 3)) {
-#endif
-        sprintf(icp->err,"icmTextDescription_read: Tag too small to be legal");
+    if (icp->header->deviceClass != icSigLinkClass)
+        pcs = icp->header->pcs;
+    else
+        pcs = icSigLabData;
+
+    if (len < 4) {
+        sprintf(icp->err,"icmColorantTable_read: Tag too small to be legal");
         return icp->errc = 1;
     }
 
     /* Allocate a file read buffer */
     if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
-        sprintf(icp->err,"icmTextDescription_read: malloc() failed");
+        sprintf(icp->err,"icmColorantTable_read: malloc() failed");
         return icp->errc = 2;
     }
     bp = buf;
@@ -7642,97 +9212,362 @@ static int icmTextDescription_read(
     /* Read portion of file into buffer */
     if (   icp->fp->seek(icp->fp, of) != 0
         || icp->fp->read(icp->fp, bp, 1, len) != len) {
-        sprintf(icp->err,"icmTextDescription_read: fseek() or fread() failed");
+        sprintf(icp->err,"icmColorantTable_read: fseek() or fread() failed");
         icp->al->free(icp->al, buf);
         return icp->errc = 1;
     }
 
-    /* Read from the buffer into the structure */
-    if ((rv = p->core_read(p, &bp, end)) != 0) {
+    /* Read type descriptor from the buffer */
+    p->ttype = (icTagTypeSignature)read_SInt32Number(bp);
+    if (p->ttype != icSigColorantTableType) {
+        sprintf(icp->err,"icmColorantTable_read: Wrong tag type for icmColorantTable");
+        icp->al->free(icp->al, buf);
+        return icp->errc = 1;
+    }
+
+    if (len < 12) {
+        sprintf(icp->err,"icmColorantTable_read: Tag too small to be legal");
+        icp->al->free(icp->al, buf);
+        return icp->errc = 1;
+    }
+
+    /* Read count of colorants */
+    p->count = read_UInt32Number(bp+8);
+
+    if (p->count > ((len - 12) / (32 + 6))) {
+        sprintf(icp->err,"icmColorantTable_read count overflow");
+        icp->al->free(icp->al, buf);
+        return icp->errc = 1;
+    }
+
+    bp = bp + 12;
+
+    if ((rv = p->allocate((icmBase *)p)) != 0) {
         icp->al->free(icp->al, buf);
         return rv;
     }
 
+    /* Read all the data from the buffer */
+    for (i = 0; i < p->count; i++, bp += (32 + 6)) {
+        if ((rv = read_ColorantTableVal(p->data+i, bp, end, pcs)) != 0) {
+            icp->al->free(icp->al, buf);
+            return rv;
+        }
+    }
+
     icp->al->free(icp->al, buf);
-    return 0;
+    return rv;
 }
 
-/* core read the object, return 0 on success, error code on fail */
-static int icmTextDescription_core_read(
-    icmTextDescription *p,
-    char **bpp,                /* Pointer to buffer pointer, returns next after read */
-    char *end                /* Pointer to past end of read buffer */
+/* Write the contents of the object. Return 0 on sucess, error code on failure */
+static int icmColorantTable_write(
+    icmBase *pp,
+    unsigned int of            /* File offset to write from */
 ) {
+    icmColorantTable *p = (icmColorantTable *)pp;
     icc *icp = p->icp;
+    icColorSpaceSignature pcs;
+    unsigned int i;
+    unsigned int len;
+    char *bp, *buf;        /* Buffer to write from */
     int rv = 0;
-    char *bp = *bpp;
 
-    if (bp > end || 8 > (end - bp)) {
-        sprintf(icp->err,"icmTextDescription_read: Data too short to type descriptor");
-        *bpp = bp;
+    if (icp->header->deviceClass != icSigLinkClass)
+        pcs = icp->header->pcs;
+    else
+        pcs = icSigLabData;
+
+    /* Allocate a file write buffer */
+    if ((len = p->get_size((icmBase *)p)) == UINT_MAX) {
+        sprintf(icp->err,"icmColorantTable_write get_size overflow");
         return icp->errc = 1;
     }
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
+        sprintf(icp->err,"icmColorantTable_write malloc() failed");
+        return icp->errc = 2;
+    }
+    bp = buf;
 
-    p->size = read_UInt32Number(bp);
-    /* Read type descriptor from the buffer */
-    if (((icTagTypeSignature)read_SInt32Number(bp)) != p->ttype) {
-        *bpp = bp;
-        sprintf(icp->err,"icmTextDescription_read: Wrong tag type ('%s') for icmTextDescription",
-                tag2str((icTagTypeSignature)read_SInt32Number(bp)));
-        return icp->errc = 1;
+    /* Write type descriptor to the buffer */
+    if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
+        sprintf(icp->err,"icmColorantTable_write: write_SInt32Number() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = rv;
     }
-    bp = bp + 8;
+    write_SInt32Number(0,bp+4);            /* Set padding to 0 */
 
-    /* Read the Ascii string */
-    if (bp > end || 4 > (end - bp)) {
-        *bpp = bp;
-        sprintf(icp->err,"icmTextDescription_read: Data too short to read Ascii header");
-        return icp->errc = 1;
+    /* Write count of colorants */
+    if ((rv = write_UInt32Number(p->count, bp+8)) != 0) {
+        sprintf(icp->err,"icmColorantTable_write: write_UInt32Number() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = rv;
     }
-    p->size = read_UInt32Number(bp);
-    bp += 4;
-    if (p->size > 0) {
-        if (bp > end || p->size > (end - bp)) {
-            *bpp = bp;
-            sprintf(icp->err,"icmTextDescription_read: Data too short to read Ascii string");
-            return icp->errc = 1;
-        }
-        if (check_null_string(bp,p->size)) {
-            *bpp = bp;
-            sprintf(icp->err,"icmTextDescription_read: ascii string is not terminated");
-            return icp->errc = 1;
-        }
-        if ((rv = p->allocate((icmBase *)p)) != 0) {
+
+    bp = bp + 12;
+    
+    /* Write all the data to the buffer */
+    for (i = 0; i < p->count; i++, bp += (32 + 6)) {
+        if ((rv = write_ColorantTableVal(p->data+i, bp, pcs)) != 0) {
+            icc_wbuf_free(icp, buf);
             return rv;
         }
-        strcpy(p->desc, bp);
-        bp += strlen(p->desc) + 1;
     }
-    
-    /* Read the Unicode string */
-    if (bp > end || 8 > (end - bp)) {
-        *bpp = bp;
-        sprintf(icp->err,"icmTextDescription_read: Data too short to read Unicode string");
-        return icp->errc = 1;
+
+    /* Write to the file */
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
+        sprintf(icp->err,"icmColorantTable_write fseek() or fwrite() failed");
+        icc_wbuf_free(icp, buf);
+        return icp->errc = 2;
     }
-    p->ucLangCode = read_UInt32Number(bp);
-    bp += 4;
-    p->ucSize = read_UInt32Number(bp);
-    bp += 4;
-    if (p->ucSize > 0) {
-        ORD16 *up;
-        if (bp > end || p->ucSize > (end - bp)/2) {
-            *bpp = bp;
-            sprintf(icp->err,"icmTextDescription_read: Data too short to read Unicode string");
-            return icp->errc = 1;
-        }
-        if (check_null_string16(bp,p->ucSize)) {
-            *bpp = bp;
-            sprintf(icp->err,"icmTextDescription_read: Unicode string is not terminated");
-            return icp->errc = 1;
-        }
-        if ((rv = p->allocate((icmBase *)p)) != 0) {
-            return rv;
+    icc_wbuf_free(icp, buf);
+    return 0;
+}
+
+/* Dump a text description of the object */
+static void icmColorantTable_dump(
+    icmBase *pp,
+    icmFile *op,    /* Output to dump to */
+    int   verb        /* Verbosity level */
+) {
+    icmColorantTable *p = (icmColorantTable *)pp;
+    icc *icp = p->icp;
+    icColorSpaceSignature pcs;
+
+    if (icp->header->deviceClass != icSigLinkClass)
+        pcs = icp->header->pcs;
+    else
+        pcs = icSigLabData;
+
+    if (verb <= 0)
+        return;
+
+    if (p->ttype == icSigColorantTableType)
+        op->gprintf(op,"ColorantTable:\n");
+    op->gprintf(op,"  No. colorants  = %u\n",p->count);
+    if (verb >= 2) {
+        unsigned int i;
+        icmColorantTableVal *vp;
+        for (i = 0; i < p->count; i++) {
+            vp = p->data + i;
+            op->gprintf(op,"    Colorant %lu:\n",i);
+            op->gprintf(op,"      Name = '%s'\n",vp->name);
+
+            if (p->ttype == icSigColorantTableType) {
+                switch(pcs) {
+                    case icSigXYZData:
+                            op->gprintf(op,"      XYZ = %f, %f, %f\n",
+                                    vp->pcsCoords[0],vp->pcsCoords[1],vp->pcsCoords[2]);
+                        break;
+                    case icSigLabData:
+                            op->gprintf(op,"      Lab = %f, %f, %f\n",
+                                    vp->pcsCoords[0],vp->pcsCoords[1],vp->pcsCoords[2]);
+                        break;
+                    default:
+                            op->gprintf(op,"      Unexpected PCS\n");
+                        break;
+                }
+            }
+        }
+    }
+}
+
+/* Allocate variable sized data elements */
+static int icmColorantTable_allocate(
+    icmBase *pp
+) {
+    icmColorantTable *p = (icmColorantTable *)pp;
+    icc *icp = p->icp;
+
+    if (p->count != p->_count) {
+        unsigned int i;
+        if (ovr_mul(p->count, sizeof(icmColorantTableVal))) {
+            sprintf(icp->err,"icmColorantTable_alloc: count overflow");
+            return icp->errc = 1;
+        }
+        if (p->data != NULL)
+            icp->al->free(icp->al, p->data);
+        if ((p->data = (icmColorantTableVal *) icp->al->calloc(icp->al,p->count, sizeof(icmColorantTableVal))) == NULL) {
+            sprintf(icp->err,"icmColorantTable_alloc: malloc() of icmColorantTable data failed");
+            return icp->errc = 2;
+        }
+        for (i = 0; i < p->count; i++) {
+            p->data[i].icp = icp;    /* Do init */
+        }
+        p->_count = p->count;
+    }
+    return 0;
+}
+
+/* Free all storage in the object */
+static void icmColorantTable_delete(
+    icmBase *pp
+) {
+    icmColorantTable *p = (icmColorantTable *)pp;
+    icc *icp = p->icp;
+
+    if (p->data != NULL)
+        icp->al->free(icp->al, p->data);
+    icp->al->free(icp->al, p);
+}
+
+/* Create an empty object. Return null on error */
+static icmBase *new_icmColorantTable(
+    icc *icp
+) {
+    icmColorantTable *p;
+    if ((p = (icmColorantTable *) icp->al->calloc(icp->al,1,sizeof(icmColorantTable))) == NULL)
+        return NULL;
+    p->ttype    = icSigColorantTableType;
+    p->refcount = 1;
+    p->get_size = icmColorantTable_get_size;
+    p->read     = icmColorantTable_read;
+    p->write    = icmColorantTable_write;
+    p->dump     = icmColorantTable_dump;
+    p->allocate = icmColorantTable_allocate;
+    p->del      = icmColorantTable_delete;
+    p->icp      = icp;
+
+    return (icmBase *)p;
+}
+
+/* ---------------------------------------------------------- */
+/* textDescription */
+
+/* Return the number of bytes needed to write this tag */
+static unsigned int icmTextDescription_get_size(
+    icmBase *pp
+) {
+    icmTextDescription *p = (icmTextDescription *)pp;
+    unsigned int len = 0;
+    len = sat_add(len, 8);                        /* 8 bytes for tag and padding */
+    len = sat_addadd(len, 4, p->size);            /* Ascii string length + ascii string */
+    len = sat_addaddmul(len, 8, 2, p->ucSize);    /* Unicode language code + length + string */
+    len = sat_addadd(len, 3, 67);                /* ScriptCode code, length string */
+    return len;
+}
+
+/* read the object, return 0 on success, error code on fail */
+static int icmTextDescription_read(
+    icmBase *pp,
+    unsigned int len,        /* tag length */
+    unsigned int of        /* start offset within file */
+) {
+    icmTextDescription *p = (icmTextDescription *)pp;
+    icc *icp = p->icp;
+    int rv;
+    char *bp, *buf, *end;
+
+#ifdef ICM_STRICT
+    if (len < (8 + 4 + 8 + 3 /* + 67 */)) {
+#else
+    if (len < (8 + 4 + 8 + 3)) {
+#endif
+        sprintf(icp->err,"icmTextDescription_read: Tag too small to be legal");
+        return icp->errc = 1;
+    }
+
+    /* Allocate a file read buffer */
+    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+        sprintf(icp->err,"icmTextDescription_read: malloc() failed");
+        return icp->errc = 2;
+    }
+    bp = buf;
+    end = buf + len;
+
+    /* Read portion of file into buffer */
+    if (   icp->fp->seek(icp->fp, of) != 0
+        || icp->fp->read(icp->fp, bp, 1, len) != len) {
+        sprintf(icp->err,"icmTextDescription_read: fseek() or fread() failed");
+        icp->al->free(icp->al, buf);
+        return icp->errc = 1;
+    }
+
+    /* Read from the buffer into the structure */
+    if ((rv = p->core_read(p, &bp, end)) != 0) {
+        icp->al->free(icp->al, buf);
+        return rv;
+    }
+
+    icp->al->free(icp->al, buf);
+    return 0;
+}
+
+/* core read the object, return 0 on success, error code on fail */
+static int icmTextDescription_core_read(
+    icmTextDescription *p,
+    char **bpp,                /* Pointer to buffer pointer, returns next after read */
+    char *end                /* Pointer to past end of read buffer */
+) {
+    icc *icp = p->icp;
+    int rv = 0;
+    char *bp = *bpp;
+
+    if (bp > end || 8 > (end - bp)) {
+        sprintf(icp->err,"icmTextDescription_read: Data too short to type descriptor");
+        *bpp = bp;
+        return icp->errc = 1;
+    }
+
+    p->size = read_UInt32Number(bp);
+    /* Read type descriptor from the buffer */
+    if (((icTagTypeSignature)read_SInt32Number(bp)) != p->ttype) {
+        *bpp = bp;
+        sprintf(icp->err,"icmTextDescription_read: Wrong tag type ('%s') for icmTextDescription",
+                tag2str((icTagTypeSignature)read_SInt32Number(bp)));
+        return icp->errc = 1;
+    }
+    bp = bp + 8;
+
+    /* Read the Ascii string */
+    if (bp > end || 4 > (end - bp)) {
+        *bpp = bp;
+        sprintf(icp->err,"icmTextDescription_read: Data too short to read Ascii header");
+        return icp->errc = 1;
+    }
+    p->size = read_UInt32Number(bp);
+    bp += 4;
+    if (p->size > 0) {
+        if (bp > end || p->size > (end - bp)) {
+            *bpp = bp;
+            sprintf(icp->err,"icmTextDescription_read: Data too short to read Ascii string");
+            return icp->errc = 1;
+        }
+        if (check_null_string(bp,p->size)) {
+            *bpp = bp;
+            sprintf(icp->err,"icmTextDescription_read: ascii string is not terminated");
+            return icp->errc = 1;
+        }
+        if ((rv = p->allocate((icmBase *)p)) != 0) {
+            return rv;
+        }
+        strcpy(p->desc, bp);
+        bp += strlen(p->desc) + 1;
+    }
+    
+    /* Read the Unicode string */
+    if (bp > end || 8 > (end - bp)) {
+        *bpp = bp;
+        sprintf(icp->err,"icmTextDescription_read: Data too short to read Unicode string");
+        return icp->errc = 1;
+    }
+    p->ucLangCode = read_UInt32Number(bp);
+    bp += 4;
+    p->ucSize = read_UInt32Number(bp);
+    bp += 4;
+    if (p->ucSize > 0) {
+        ORD16 *up;
+        if (bp > end || p->ucSize > (end - bp)/2) {
+            *bpp = bp;
+            sprintf(icp->err,"icmTextDescription_read: Data too short to read Unicode string");
+            return icp->errc = 1;
+        }
+        if (check_null_string16(bp,p->ucSize)) {
+            *bpp = bp;
+            sprintf(icp->err,"icmTextDescription_read: Unicode string is not terminated");
+            return icp->errc = 1;
+        }
+        if ((rv = p->allocate((icmBase *)p)) != 0) {
+            return rv;
         }
         for(up = p->ucDesc; bp[0] != 0 || bp[1] != 0; up++, bp += 2)
             *up = read_UInt16Number(bp);
@@ -7797,7 +9632,7 @@ static int icmTextDescription_write(
         sprintf(icp->err,"icmTextDescription_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmTextDescription_write malloc() failed");
         return icp->errc = 2;
     }
@@ -7805,18 +9640,17 @@ static int icmTextDescription_write(
 
     /* Write to the buffer from the structure */
     if ((rv = p->core_write(p, &bp)) != 0) {
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return rv;
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmTextDescription_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -8400,7 +10234,7 @@ static int icmProfileSequenceDesc_write(
         sprintf(icp->err,"icmProfileSequenceDesc_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmProfileSequenceDesc_write malloc() failed");
         return icp->errc = 2;
     }
@@ -8409,14 +10243,14 @@ static int icmProfileSequenceDesc_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmProfileSequenceDesc_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
 
     if ((rv = write_UInt32Number(p->count,bp+8)) != 0) {
         sprintf(icp->err,"icmProfileSequenceDesc_write: write_UInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     bp = bp + 12;
@@ -8424,19 +10258,18 @@ static int icmProfileSequenceDesc_write(
     /* Write all the description structures */
     for (i = 0; i < p->count; i++) {
         if ((rv = icmDescStruct_write(&p->data[i], &bp)) != 0) {
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return rv;
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmProfileSequenceDesc_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -8596,7 +10429,7 @@ static int icmSignature_write(
         sprintf(icp->err,"icmSignature_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmSignature_write malloc() failed");
         return icp->errc = 2;
     }
@@ -8605,7 +10438,7 @@ static int icmSignature_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmSignature_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -8613,18 +10446,17 @@ static int icmSignature_write(
     /* Write the signature */
     if ((rv = write_SInt32Number((int)p->sig, bp + 8)) != 0) {
         sprintf(icp->err,"icmSignaturea_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmSignature_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -8793,7 +10625,7 @@ static int icmScreening_write(
         sprintf(icp->err,"icmScreening_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmScreening_write malloc() failed");
         return icp->errc = 2;
     }
@@ -8802,19 +10634,19 @@ static int icmScreening_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmScreening_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
 
     if ((rv = write_UInt32Number(p->screeningFlag,bp+8)) != 0) {
             sprintf(icp->err,"icmScreening_write: write_UInt32Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     if ((rv = write_UInt32Number(p->channels,bp+12)) != 0) {
             sprintf(icp->err,"icmScreening_write: write_UInt32NumberXYZumber() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     bp = bp + 16;
@@ -8823,19 +10655,18 @@ static int icmScreening_write(
     for (i = 0; i < p->channels; i++, bp += 12) {
         if ((rv = write_ScreeningData(&p->data[i],bp)) != 0) {
             sprintf(icp->err,"icmScreening_write: write_ScreeningData() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmScreening_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -9063,7 +10894,7 @@ static int icmUcrBg_write(
         sprintf(icp->err,"icmUcrBg_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmUcrBg_write malloc() failed");
         return icp->errc = 2;
     }
@@ -9072,7 +10903,7 @@ static int icmUcrBg_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmUcrBg_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -9081,7 +10912,7 @@ static int icmUcrBg_write(
     /* Write UCR curve */
     if ((rv = write_UInt32Number(p->UCRcount,bp)) != 0) {
         sprintf(icp->err,"icmUcrBg_write: write_UInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     bp += 4;
@@ -9090,13 +10921,13 @@ static int icmUcrBg_write(
         if (p->UCRcount == 1) { /* % */
             if ((rv = write_UInt16Number((unsigned int)(p->UCRcurve[i]+0.5),bp)) != 0) {
                 sprintf(icp->err,"icmUcrBg_write: write_UInt16umber() failed");
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         } else {
             if ((rv = write_DCS16Number(p->UCRcurve[i],bp)) != 0) {
                 sprintf(icp->err,"icmUcrBg_write: write_DCS16umber(%f) failed",p->UCRcurve[i]);
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         }
@@ -9105,7 +10936,7 @@ static int icmUcrBg_write(
     /* Write BG curve */
     if ((rv = write_UInt32Number(p->BGcount,bp)) != 0) {
         sprintf(icp->err,"icmUcrBg_write: write_UInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     bp += 4;
@@ -9114,13 +10945,13 @@ static int icmUcrBg_write(
         if (p->BGcount == 1) { /* % */
             if ((rv = write_UInt16Number((unsigned int)(p->BGcurve[i]+0.5),bp)) != 0) {
                 sprintf(icp->err,"icmUcrBg_write: write_UInt16umber() failed");
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         } else {
             if ((rv = write_DCS16Number(p->BGcurve[i],bp)) != 0) {
                 sprintf(icp->err,"icmUcrBg_write: write_DCS16umber(%f) failed",p->BGcurve[i]);
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = rv;
             }
         }
@@ -9129,20 +10960,19 @@ static int icmUcrBg_write(
     if (p->string != NULL) {
         if ((rv = check_null_string(p->string,p->size)) != 0) {
             sprintf(icp->err,"icmUcrBg_write: text is not null terminated");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = 1;
         }
         memmove((void *)bp, (void *)p->string, p->size);
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmUcrBg_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -9345,6 +11175,8 @@ static int icmVideoCardGamma_read(
     ORD8 *pchar;
     ORD16 *pshort;
 
+    p->rbits = 0;        /* Ramps are now stale */
+
     if (len < 18) {
         sprintf(icp->err,"icmVideoCardGamma_read: Tag too small to be legal");
         return icp->errc = 1;
@@ -9452,7 +11284,7 @@ static int icmVideoCardGamma_write(
         sprintf(icp->err,"icmViewingConditions_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmViewingConditions_write malloc() failed");
         return icp->errc = 2;
     }
@@ -9461,7 +11293,7 @@ static int icmVideoCardGamma_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmVideoCardGamma_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -9469,7 +11301,7 @@ static int icmVideoCardGamma_write(
     /* Write gamma format (eg. table of formula) */
     if ((rv = write_UInt32Number(p->tagType,bp+8)) != 0) {
         sprintf(icp->err,"icmVideoCardGamma_write: write_UInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
 
@@ -9477,17 +11309,17 @@ static int icmVideoCardGamma_write(
     if (p->tagType == icmVideoCardGammaTableType) {
         if ((rv = write_UInt16Number(p->u.table.channels,bp+12)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_UInt16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_UInt16Number(p->u.table.entryCount,bp+14)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_UInt16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_UInt16Number(p->u.table.entrySize,bp+16)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_UInt16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         pchar = (ORD8 *)p->u.table.data;
@@ -9504,70 +11336,69 @@ static int icmVideoCardGamma_write(
                 break;
             default:
                 sprintf(icp->err,"icmVideoCardGamma_write: unsupported table entry size");
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = 1;
             }
         }
     } else if (p->tagType == icmVideoCardGammaFormulaType) {
         if ((rv = write_S15Fixed16Number(p->u.formula.redGamma,bp+12)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_S15Fixed16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_S15Fixed16Number(p->u.formula.redMin,bp+16)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_S15Fixed16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_S15Fixed16Number(p->u.formula.redMax,bp+20)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_S15Fixed16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_S15Fixed16Number(p->u.formula.greenGamma,bp+24)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_S15Fixed16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_S15Fixed16Number(p->u.formula.greenMin,bp+28)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_S15Fixed16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_S15Fixed16Number(p->u.formula.greenMax,bp+32)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_S15Fixed16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_S15Fixed16Number(p->u.formula.blueGamma,bp+36)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_S15Fixed16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_S15Fixed16Number(p->u.formula.blueMin,bp+40)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_S15Fixed16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         if ((rv = write_S15Fixed16Number(p->u.formula.blueMax,bp+44)) != 0) {
             sprintf(icp->err,"icmVideoCardGamma_write: write_S15Fixed16Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
     } else {
         sprintf(icp->err,"icmVideoCardGammaTable_write: Unknown gamma format for icmVideoCardGamma");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 1;
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmViewingConditions_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -9631,6 +11462,8 @@ static int icmVideoCardGamma_allocate(
      * fields must all be set prior to getting here
      */
 
+    p->rbits = 0;        /* Ramps are now stale */
+
     if (p->tagType == icmVideoCardGammaTableType) {
         size = sat_mul(p->u.table.channels, p->u.table.entryCount);
         switch (p->u.table.entrySize) {
@@ -9667,6 +11500,11 @@ static double icmVideoCardGamma_lookup(
 ) {
     double ov = 0.0;
 
+    /* A single channel table applies to all channels */
+    if (p->tagType == icmVideoCardGammaTableType && p->u.table.channels == 1
+     && chan >= 0 && chan <= 2)
+        chan = 0;
+
     if (chan < 0 || chan > (p->u.table.channels-1)
      || iv < 0.0 || iv > 1.0)
         return iv;
@@ -9703,11 +11541,11 @@ static double icmVideoCardGamma_lookup(
     } else if (p->tagType == icmVideoCardGammaFormulaType) {
         double min, max, gam;
 
-        if (iv == 0) {
+        if (chan == 0) {
             min = p->u.formula.redMin;
             max = p->u.formula.redMax;
             gam = p->u.formula.redGamma;
-        } else if (iv == 1) {
+        } else if (chan == 1) {
             min = p->u.formula.greenMin;
             max = p->u.formula.greenMax;
             gam = p->u.formula.greenGamma;
@@ -9723,6 +11561,127 @@ static double icmVideoCardGamma_lookup(
     return ov;
 }
 
+/* A calibration function for get_tac() or create_link_x(), that */
+/* applies the icmVideoCardGamma cntx to the first 3 channels of an */
+/* RGB device value. */
+void icmVideoCardGammaCal(void *cntx, double *out, double *in) {
+    icmVideoCardGamma *p = (icmVideoCardGamma *)cntx;
+    int i;
+
+    for (i = 0; i < 3; i++)
+        out[i] = p->lookup(p, i, in[i]);
+}
+
+/* Build the per channel ramps */
+static int icmVideoCardGamma_build_ramps(
+    icmVideoCardGamma *p,
+    int bits        /* 8, 10 or 16 */
+) {
+    icc *icp = p->icp;
+    unsigned int i, n, c;
+    double scale;
+
+    if (bits != 8 && bits != 10 && bits != 16) {
+        sprintf(icp->err,"icmVideoCardGamma_build_ramps: unsupported number of bits %d",bits);
+        return icp->errc = 1;
+    }
+    n = 1 << bits;
+    scale = (double)(n - 1);
+
+    if (p->ramps != NULL && p->rbits != bits) {
+        icp->al->free(icp->al, p->ramps);
+        p->ramps = NULL;
+    }
+    p->rbits = 0;
+    if (p->ramps == NULL) {
+        if ((p->ramps = icp->al->malloc(icp->al, 3 * n * (bits == 8 ? sizeof(ORD8)
+                                                                   : sizeof(ORD16)))) == NULL) {
+            sprintf(icp->err,"icmVideoCardGamma_build_ramps: malloc() failed");
+            return icp->errc = 2;
+        }
+    }
+
+    for (c = 0; c < 3; c++) {
+        for (i = 0; i < n; i++) {
+            double vv = p->lookup(p, c, i/scale);
+            if (vv < 0.0)
+                vv = 0.0;
+            else if (vv > 1.0)
+                vv = 1.0;
+            vv = vv * scale + 0.5;
+            if (bits == 8)
+                ((ORD8 *)p->ramps)[c * n + i] = (ORD8)vv;
+            else
+                ((ORD16 *)p->ramps)[c * n + i] = (ORD16)vv;
+        }
+    }
+    p->rbits = bits;
+
+    return 0;
+}
+
+/* Apply the ramps to a buffer of pixels */
+static int icmVideoCardGamma_apply(
+    icmVideoCardGamma *p,
+    void *buf,            /* Interleaved pixel values */
+    unsigned int npix,    /* Number of pixels */
+    int nchan,            /* Channels per pixel, 1 or >= 3 */
+    int bits            /* 8, 10 or 16 */
+) {
+    icc *icp = p->icp;
+    unsigned int i;
+    int rv;
+
+    if (nchan != 1 && nchan < 3) {
+        sprintf(icp->err,"icmVideoCardGamma_apply: unsupported number of channels %d",nchan);
+        return icp->errc = 1;
+    }
+    if (p->rbits != bits) {
+        if ((rv = p->build_ramps(p, bits)) != 0)
+            return rv;
+    }
+
+    if (bits == 8) {
+        ORD8 *r0 = (ORD8 *)p->ramps, *r1 = r0 + 256, *r2 = r1 + 256;
+        ORD8 *bp = (ORD8 *)buf;
+
+        if (nchan == 1) {
+            for (i = 0; i < npix; i++)
+                bp[i] = r0[bp[i]];
+        } else if (nchan == 3) {
+            for (i = 0; i < npix; i++, bp += 3) {
+                bp[0] = r0[bp[0]];
+                bp[1] = r1[bp[1]];
+                bp[2] = r2[bp[2]];
+            }
+        } else {
+            for (i = 0; i < npix; i++, bp += nchan) {
+                bp[0] = r0[bp[0]];
+                bp[1] = r1[bp[1]];
+                bp[2] = r2[bp[2]];
+            }
+        }
+    } else {
+        unsigned int n = 1 << bits, m = n - 1;
+        ORD16 *r0 = (ORD16 *)p->ramps, *r1 = r0 + n, *r2 = r1 + n;
+        ORD16 *bp = (ORD16 *)buf;
+
+        /* Mask so that out of range 10 bit values can't index beyond the ramps */
+        if (nchan == 1) {
+            for (i = 0; i < npix; i++)
+                bp[i] = r0[bp[i] & m];
+        } else {
+            for (i = 0; i < npix; i++, bp += nchan) {
+                bp[0] = r0[bp[0] & m];
+                bp[1] = r1[bp[1] & m];
+                bp[2] = r2[bp[2] & m];
+            }
+        }
+    }
+
+    return 0;
+}
+
 /* Free all storage in the object */
 static void icmVideoCardGamma_delete(
     icmBase *pp
@@ -9732,6 +11691,8 @@ static void icmVideoCardGamma_delete(
 
     if (p->tagType == icmVideoCardGammaTableType && p->u.table.data != NULL)
         icp->al->free(icp->al, p->u.table.data);
+    if (p->ramps != NULL)
+        icp->al->free(icp->al, p->ramps);
 
     icp->al->free(icp->al, p);
 }
@@ -9749,6 +11710,8 @@ static icmBase *new_icmVideoCardGamma(
     p->read     = icmVideoCardGamma_read;
     p->write    = icmVideoCardGamma_write;
     p->lookup   = icmVideoCardGamma_lookup;
+    p->build_ramps = icmVideoCardGamma_build_ramps;
+    p->apply    = icmVideoCardGamma_apply;
     p->dump     = icmVideoCardGamma_dump;
     p->allocate = icmVideoCardGamma_allocate;
     p->del      = icmVideoCardGamma_delete;
@@ -9847,7 +11810,7 @@ static int icmViewingConditions_write(
         sprintf(icp->err,"icmViewingConditions_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmViewingConditions_write malloc() failed");
         return icp->errc = 2;
     }
@@ -9856,7 +11819,7 @@ static int icmViewingConditions_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmViewingConditions_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -9864,32 +11827,31 @@ static int icmViewingConditions_write(
     /* Write the XYZ values for the illuminant */
     if ((rv = write_XYZNumber(&p->illuminant, bp+8)) != 0) {
         sprintf(icp->err,"icmViewingConditions: write_XYZNumber error");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
 
     /* Write the XYZ values for the surround */
     if ((rv = write_XYZNumber(&p->surround, bp+20)) != 0) {
         sprintf(icp->err,"icmViewingConditions: write_XYZNumber error");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
 
     /* Write the encoded standard illuminant */
     if ((rv = write_SInt32Number((int)p->stdIlluminant, bp + 32)) != 0) {
         sprintf(icp->err,"icmViewingConditionsa_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmViewingConditions_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -10082,7 +12044,7 @@ static int icmCrdInfo_write(
         sprintf(icp->err,"icmCrdInfo_write get_size overflow");
         return icp->errc = 1;
     }
-    if ((buf = (char *) icp->al->malloc(icp->al, len)) == NULL) {
+    if ((buf = icc_wbuf_get(icp, of, len)) == NULL) {
         sprintf(icp->err,"icmCrdInfo_write malloc() failed");
         return icp->errc = 2;
     }
@@ -10091,7 +12053,7 @@ static int icmCrdInfo_write(
     /* Write type descriptor to the buffer */
     if ((rv = write_SInt32Number((int)p->ttype,bp)) != 0) {
         sprintf(icp->err,"icmCrdInfo_write: write_SInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     write_SInt32Number(0,bp+4);            /* Set padding to 0 */
@@ -10100,14 +12062,14 @@ static int icmCrdInfo_write(
     /* Postscript product name */
     if ((rv = write_UInt32Number(p->ppsize,bp)) != 0) {
         sprintf(icp->err,"icmCrdInfo_write: write_UInt32Number() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = rv;
     }
     bp += 4;
     if (p->ppsize > 0) {
         if ((rv = check_null_string(p->ppname,p->ppsize)) != 0) {
             sprintf(icp->err,"icmCrdInfo_write: Postscript product name is not terminated");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = 1;
         }
         memmove((void *)bp, (void *)p->ppname, p->ppsize);
@@ -10118,14 +12080,14 @@ static int icmCrdInfo_write(
     for (t = 0; t < 4; t++) {    /* For all 4 intents */
         if ((rv = write_UInt32Number(p->crdsize[t],bp)) != 0) {
             sprintf(icp->err,"icmCrdInfo_write: write_UInt32Number() failed");
-            icp->al->free(icp->al, buf);
+            icc_wbuf_free(icp, buf);
             return icp->errc = rv;
         }
         bp += 4;
         if (p->ppsize > 0) {
             if ((rv = check_null_string(p->crdname[t],p->crdsize[t])) != 0) {
                 sprintf(icp->err,"icmCrdInfo_write: CRD%d name is not terminated",t);
-                icp->al->free(icp->al, buf);
+                icc_wbuf_free(icp, buf);
                 return icp->errc = 1;
             }
             memmove((void *)bp, (void *)p->crdname[t], p->crdsize[t]);
@@ -10134,13 +12096,12 @@ static int icmCrdInfo_write(
     }
 
     /* Write to the file */
-    if (   icp->fp->seek(icp->fp, of) != 0
-        || icp->fp->write(icp->fp, buf, 1, len) != len) {
+    if (icc_wbuf_put(icp, buf, of, len) != 0) {
         sprintf(icp->err,"icmCrdInfo_write fseek() or fwrite() failed");
-        icp->al->free(icp->al, buf);
+        icc_wbuf_free(icp, buf);
         return icp->errc = 2;
     }
-    icp->al->free(icp->al, buf);
+    icc_wbuf_free(icp, buf);
     return 0;
 }
 
@@ -10619,9 +12580,12 @@ static struct {
     {icSigDateTimeType,            new_icmDateTimeNumber},
     {icSigLut16Type,               new_icmLut},
     {icSigLut8Type,                new_icmLut},
+    {icSigLutAtoBType,             new_icmLutAB},
+    {icSigLutBtoAType,             new_icmLutAB},
     {icSigMeasurementType,         new_icmMeasurement},
     {icSigNamedColorType,          new_icmNamedColor},
     {icSigNamedColor2Type,         new_icmNamedColor},
+    {icSigParametricCurveType,     new_icmCurve},
     {icSigProfileSequenceDescType, new_icmProfileSequenceDesc},
     {icSigS15Fixed16ArrayType,     new_icmS15Fixed16Array},
     {icSigScreeningType,           new_icmScreening},
@@ -10645,14 +12609,14 @@ static struct {
     icTagSignature      sig;
     icTagTypeSignature  ttypes[4];            /* Arbitrary max of 4 */
 } sigtypetable[] = {
-    {icSigAToB0Tag,                    {icSigLut8Type,icSigLut16Type,icMaxEnumType}},
-    {icSigAToB1Tag,                    {icSigLut8Type,icSigLut16Type,icMaxEnumType}},
-    {icSigAToB2Tag,                    {icSigLut8Type,icSigLut16Type,icMaxEnumType}},
+    {icSigAToB0Tag,                    {icSigLut8Type,icSigLut16Type,icSigLutAtoBType,icMaxEnumType}},
+    {icSigAToB1Tag,                    {icSigLut8Type,icSigLut16Type,icSigLutAtoBType,icMaxEnumType}},
+    {icSigAToB2Tag,                    {icSigLut8Type,icSigLut16Type,icSigLutAtoBType,icMaxEnumType}},
     {icSigBlueColorantTag,            {icSigXYZType,icMaxEnumType}},
-    {icSigBlueTRCTag,                {icSigCurveType,icMaxEnumType}},
-    {icSigBToA0Tag,                    {icSigLut8Type,icSigLut16Type,icMaxEnumType}},
-    {icSigBToA1Tag,                    {icSigLut8Type,icSigLut16Type,icMaxEnumType}},
-    {icSigBToA2Tag,                    {icSigLut8Type,icSigLut16Type,icMaxEnumType}},
+    {icSigBlueTRCTag,                {icSigCurveType,icSigParametricCurveType,icMaxEnumType}},
+    {icSigBToA0Tag,                    {icSigLut8Type,icSigLut16Type,icSigLutBtoAType,icMaxEnumType}},
+    {icSigBToA1Tag,                    {icSigLut8Type,icSigLut16Type,icSigLutBtoAType,icMaxEnumType}},
+    {icSigBToA2Tag,                    {icSigLut8Type,icSigLut16Type,icSigLutBtoAType,icMaxEnumType}},
     {icSigCalibrationDateTimeTag,    {icSigDateTimeType,icMaxEnumType}},
     {icSigCharTargetTag,            {icSigTextType,icMaxEnumType}},
     {icSigColorantTableTag,         {icSigColorantTableType,icMaxEnumType}},
@@ -10661,19 +12625,19 @@ static struct {
     {icSigCrdInfoTag,                {icSigCrdInfoType,icMaxEnumType}},
     {icSigDeviceMfgDescTag,            {icSigTextDescriptionType,icMaxEnumType}},
     {icSigDeviceModelDescTag,        {icSigTextDescriptionType,icMaxEnumType}},
-    {icSigGamutTag,                    {icSigLut8Type,icSigLut16Type,icMaxEnumType}},
-    {icSigGrayTRCTag,                {icSigCurveType,icMaxEnumType}},
+    {icSigGamutTag,                    {icSigLut8Type,icSigLut16Type,icSigLutBtoAType,icMaxEnumType}},
+    {icSigGrayTRCTag,                {icSigCurveType,icSigParametricCurveType,icMaxEnumType}},
     {icSigGreenColorantTag,            {icSigXYZType,icMaxEnumType}},
-    {icSigGreenTRCTag,                {icSigCurveType,icMaxEnumType}},
+    {icSigGreenTRCTag,                {icSigCurveType,icSigParametricCurveType,icMaxEnumType}},
     {icSigLuminanceTag,                {icSigXYZType,icMaxEnumType}},
     {icSigMeasurementTag,            {icSigMeasurementType,icMaxEnumType}},
     {icSigMediaBlackPointTag,        {icSigXYZType,icMaxEnumType}},
     {icSigMediaWhitePointTag,        {icSigXYZType,icMaxEnumType}},
     {icSigNamedColorTag,            {icSigNamedColorType,icMaxEnumType}},
     {icSigNamedColor2Tag,            {icSigNamedColor2Type,icMaxEnumType}},
-    {icSigPreview0Tag,                {icSigLut8Type,icSigLut16Type,icMaxEnumType}},
-    {icSigPreview1Tag,                {icSigLut8Type,icSigLut16Type,icMaxEnumType}},
-    {icSigPreview2Tag,                {icSigLut8Type,icSigLut16Type,icMaxEnumType}},
+    {icSigPreview0Tag,                {icSigLut8Type,icSigLut16Type,icSigLutBtoAType,icMaxEnumType}},
+    {icSigPreview1Tag,                {icSigLut8Type,icSigLut16Type,icSigLutBtoAType,icMaxEnumType}},
+    {icSigPreview2Tag,                {icSigLut8Type,icSigLut16Type,icSigLutBtoAType,icMaxEnumType}},
     {icSigProfileDescriptionTag,    {icSigTextDescriptionType,icMaxEnumType}},
     {icSigProfileSequenceDescTag,    {icSigProfileSequenceDescType,icMaxEnumType}},
     {icSigPs2CRD0Tag,                {icSigDataType,icMaxEnumType}},
@@ -10683,7 +12647,7 @@ static struct {
     {icSigPs2CSATag,                {icSigDataType,icMaxEnumType}},
     {icSigPs2RenderingIntentTag,    {icSigDataType,icMaxEnumType}},
     {icSigRedColorantTag,            {icSigXYZType,icMaxEnumType}},
-    {icSigRedTRCTag,                {icSigCurveType,icMaxEnumType}},
+    {icSigRedTRCTag,                {icSigCurveType,icSigParametricCurveType,icMaxEnumType}},
     {icSigScreeningDescTag,            {icSigTextDescriptionType,icMaxEnumType}},
     {icSigScreeningTag,                {icSigScreeningType,icMaxEnumType}},
     {icSigTechnologyTag,            {icSigSignatureType,icMaxEnumType}},
@@ -10885,7 +12849,7 @@ static int icc_set_version(icc *p, icmICCVersion ver) {
             p->header->minv = 4;
             p->header->bfv  = 0;
             break;
-#ifdef ENABLE_V4
+#ifdef ENABLE_V4_CREATE
         case icmVersion4_1:
             p->header->majv = 4;
             p->header->minv = 1;
@@ -10896,6 +12860,7 @@ static int icc_set_version(icc *p, icmICCVersion ver) {
             sprintf(p->err,"icc_set_version: Unsupported version 0x%x",ver);
             return p->errc = 1;
     }
+    p->ver = p->header->majv > 3 ? 1 : 0;    /* Set major version flag, as read does */
     return 0;
 }
 
@@ -10969,6 +12934,35 @@ static int check_icc_legal(
 }
 
 
+/* Compute the MD5 profile ID of a profile image in memory, */
+/* with the header flags, rendering intent and ID treated as zero. */
+/* Return 0 on success, 2 on malloc failure. */
+static int icc_compute_id(
+    icc *p,
+    ORD8 *buf,            /* Profile image */
+    unsigned int size,    /* Profile size, >= 128 */
+    ORD8 id[16]            /* Return ID */
+) {
+    icmMD5 *md5;
+    ORD8 hbuf[128];
+
+    if ((md5 = new_icmMD5(p->al)) == NULL) {
+        sprintf(p->err,"icc_compute_id: new_icmMD5 failed");
+        return p->errc = 2;
+    }
+
+    memcpy(hbuf, buf, 128);
+    memset(hbuf + 44, 0, 4);
+    memset(hbuf + 64, 0, 4);
+    memset(hbuf + 84, 0, 16);
+    md5->add(md5, hbuf, 128);
+    md5->add(md5, buf + 128, size - 128);
+    md5->get(md5, id);
+    md5->del(md5);
+
+    return 0;
+}
+
 /* read the object, return 0 on success, error code on fail */
 /* NOTE: this doesn't read the tag types, they should be read on demand. */
 /* NOTE: fp ownership is taken even if the function fails. */
@@ -10987,6 +12981,7 @@ static int icc_read_x(
     if (take_fp)
         p->del_fp = 1;
     p->of = of;
+    p->cid_valid = 0;
     if (p->header == NULL) {
         sprintf(p->err,"icc_read: No header defined");
         return p->errc = 1;
@@ -11093,12 +13088,88 @@ static int icc_read(
     icmFile *fp,            /* File to read from */
     unsigned int of        /* File offset to read from */
 ) {
-    return icc_read_x(p, fp, of, 0);
+    return p->read_x(p, fp, of, 0);
+}
+
+/* Read the object after reading the whole profile into memory in one I/O, */
+/* so that subsequent tag reads are served from memory. */
+/* Return 0 on success, error code on fail */
+/* NOTE: fp ownership is taken even if the function fails. */
+static int icc_read_slurp(
+    icc *p,
+    icmFile *fp,            /* File to read from */
+    unsigned int of,        /* File offset to read from */
+    int take_fp                /* NZ if icc is to take ownership of fp */
+) {
+    char hbuf[128], *buf;
+    unsigned int i, size;
+    size_t fsize;
+    icmFile *mfp;
+    int rv;
+
+    /* Read the raw header to get the profile size */
+    if (   fp->seek(fp, of) != 0
+        || fp->read(fp, hbuf, 1, 128) != 128) {
+        sprintf(p->err,"icc_read_slurp: fseek() or fread() failed on header");
+        if (take_fp)
+            fp->del(fp);
+        return p->errc = 1;
+    }
+    size = read_UInt32Number(hbuf);
+    fsize = fp->get_size(fp);
+    if (size < (128 + 4)
+     || (fsize > 0 && (of > fsize || size > (fsize - of)))) {
+        sprintf(p->err,"icc_read_slurp: header size %u is not legal for file",size);
+        if (take_fp)
+            fp->del(fp);
+        return p->errc = 1;
+    }
+
+    /* Read the rest of the profile */
+    if ((buf = (char *) p->al->malloc(p->al, size)) == NULL) {
+        sprintf(p->err,"icc_read_slurp: malloc() failed");
+        if (take_fp)
+            fp->del(fp);
+        return p->errc = 2;
+    }
+    memcpy(buf, hbuf, 128);
+    if (fp->read(fp, buf + 128, 1, size - 128) != (size - 128)) {
+        sprintf(p->err,"icc_read_slurp: fread() failed on profile body");
+        p->al->free(p->al, buf);
+        if (take_fp)
+            fp->del(fp);
+        return p->errc = 1;
+    }
+    if (take_fp)
+        fp->del(fp);
+
+    if ((mfp = new_icmFileMem_ad(buf, size, p->al)) == NULL) {
+        sprintf(p->err,"icc_read_slurp: new_icmFileMem failed");
+        p->al->free(p->al, buf);
+        return p->errc = 2;
+    }
+
+    if ((rv = icc_read_x(p, mfp, 0, 1)) != 0)
+        return rv;
+
+    /* If there is an ID, compute the checksum now, while we have the image */
+    for (i = 0; i < 16; i++) {
+        if (p->header->id[i] != 0)
+            break;
+    }
+    if (i < 16) {
+        if ((rv = icc_compute_id(p, (ORD8 *)buf, size, p->cid)) != 0)
+            return rv;
+        p->cid_valid = 1;
+    }
+
+    return 0;
 }
 
 /* Check the profiles ID. We assume the file has already been read. */
 /* Return 0 if OK, 1 if no ID to check, 2 if doesn't match, 3 if some other error. */
-/* NOTE: this reads the whole file again, to compute the checksum. */
+/* NOTE: unless the profile was read with read_slurp(), which computes the */
+/* checksum while reading, this reads the whole file again. */
 static int icc_check_id(
     icc *p,
     ORD8 *rid        /* Optionaly return computed ID */
@@ -11106,72 +13177,84 @@ static int icc_check_id(
     unsigned char buf[128];
     ORD8 id[16];
     icmMD5 *md5 = NULL;
-    unsigned int len;
+    unsigned int i, len;
     
     if (p->header == NULL) {
         sprintf(p->err,"icc_check_id: No header defined");
         return p->errc = 3;
     }
-    len = p->header->size;        /* Claimed size of profile */
 
     /* See if there is an ID to compare against */
-    for (len = 0; len < 16; len++) {
-        if (p->header->id[len] != 0)
+    for (i = 0; i < 16; i++) {
+        if (p->header->id[i] != 0)
             break;
     }
-    if (len >= 16) {
+    if (i >= 16) {
         return 1; 
     }
 
-    if ((md5 = new_icmMD5(p->al)) == NULL) {
-        sprintf(p->err,"icc_check_id: new_icmMD5 failed");
-        return p->errc = 3;
-    }
-        
-    /* Check the header */
-    if (   p->fp->seek(p->fp, p->of) != 0
-        || p->fp->read(p->fp, buf, 1, 128) != 128) {
-        sprintf(p->err,"icc_check_id: fseek() or fread() failed");
-        return p->errc = 3;
-    }
-
-    /* Zero the appropriate bytes in the header */
-    buf[44] = buf[45] = buf[46] = buf[47] = 0;
-    buf[64] = buf[65] = buf[66] = buf[67] = 0;
-    buf[84] = buf[85] = buf[86] = buf[87] =
-    buf[88] = buf[89] = buf[90] = buf[91] =
-    buf[92] = buf[93] = buf[94] = buf[95] =
-    buf[96] = buf[97] = buf[98] = buf[99] = 0;
+    if (p->cid_valid) {        /* Computed when the profile was read */
+        memcpy(id, p->cid, 16);
 
-    md5->add(md5, buf, 128);
+    } else {
+        if (p->fp == NULL || p->header->size < 128) {
+            sprintf(p->err,"icc_check_id: No profile file to check");
+            return p->errc = 3;
+        }
+        len = p->header->size - 128;        /* Claimed size of the rest of the profile */
 
-    /* Suck in the rest of the profile */
-    for (;len > 0;) {
-        unsigned int rsize = 128;
-        if (rsize > len)
-            rsize = len;
-        if (p->fp->read(p->fp, buf, 1, rsize) != rsize) {
-            sprintf(p->err,"icc_check_id: fread() failed");
+        if ((md5 = new_icmMD5(p->al)) == NULL) {
+            sprintf(p->err,"icc_check_id: new_icmMD5 failed");
+            return p->errc = 3;
+        }
+            
+        /* Check the header */
+        if (   p->fp->seek(p->fp, p->of) != 0
+            || p->fp->read(p->fp, buf, 1, 128) != 128) {
+            sprintf(p->err,"icc_check_id: fseek() or fread() failed");
+            md5->del(md5);
             return p->errc = 3;
         }
-        md5->add(md5, buf, rsize);
-        len -= rsize;
-    }
 
-    md5->get(md5, id);
-    md5->del(md5);
+        /* Zero the appropriate bytes in the header */
+        buf[44] = buf[45] = buf[46] = buf[47] = 0;
+        buf[64] = buf[65] = buf[66] = buf[67] = 0;
+        buf[84] = buf[85] = buf[86] = buf[87] =
+        buf[88] = buf[89] = buf[90] = buf[91] =
+        buf[92] = buf[93] = buf[94] = buf[95] =
+        buf[96] = buf[97] = buf[98] = buf[99] = 0;
+
+        md5->add(md5, buf, 128);
+
+        /* Suck in the rest of the profile */
+        for (;len > 0;) {
+            unsigned int rsize = 128;
+            if (rsize > len)
+                rsize = len;
+            if (p->fp->read(p->fp, buf, 1, rsize) != rsize) {
+                sprintf(p->err,"icc_check_id: fread() failed");
+                md5->del(md5);
+                return p->errc = 3;
+            }
+            md5->add(md5, buf, rsize);
+            len -= rsize;
+        }
+
+        md5->get(md5, id);
+        md5->del(md5);
+    }
 
     if (rid != NULL) {
-        for (len = 0; len < 16; len++)
-            rid[len] = id[len];
+        for (i = 0; i < 16; i++)
+            rid[i] = id[i];
     }
 
     /* Check the ID */
-    for (len = 0; len < 16; len++) {
-        if (p->header->id[len] != id[len])
+    for (i = 0; i < 16; i++) {
+        if (p->header->id[i] != id[i])
             break;
     }
-    if (len >= 16) {
+    if (i >= 16) {
         return 0;        /* Matched */ 
     }
     return 2;            /* Didn't match */
@@ -11345,8 +13428,9 @@ static int icc_write_x(
     
 
     /* If V4.0+, Compute the MD5 id for the profile. */
-    /* We do this by writing to a fake icmFile */
-    if (p->ver) {
+    /* We do this by writing to a fake icmFile, unless we are writing */
+    /* to a single memory buffer, where it is computed from the buffer. */
+    if (p->ver && p->wbase == NULL) {
         icmMD5 *md5 = NULL;
         icmFile *ofp, *dfp = NULL;
 
@@ -11466,6 +13550,13 @@ static int icc_write_x(
         return p->errc = 1;
     }
 
+    /* Compute the MD5 id from the memory buffer and set it in the header */
+    if (p->ver && p->wbase != NULL) {
+        if ((rv = icc_compute_id(p, (ORD8 *)p->wbase + of, size, p->header->id)) != 0)
+            return rv;
+        memcpy(p->wbase + of + 84, p->header->id, 16);
+    }
+
     return rv;
 }
 
@@ -11476,68 +13567,390 @@ static int icc_write(
     icmFile *fp,        /* File to write to */
     unsigned int of    /* File offset to write to */
 ) {
-    return icc_write_x(p, fp, of, 0);
+    return p->write_x(p, fp, of, 0);
 }
 
-/* Create and add a tag with the given signature. */
-/* Returns a pointer to the element object */
-/* Returns NULL if error - icc->errc will contain */
-/* 2 on system error, */
-/* 3 if unknown tag */
-/* NOTE: that we prevent tag duplication */
-/* NOTE: to create a tag type icmSigUnknownType, set ttype to icmSigUnknownType, */
-/* and set the actual tag type in icmSigUnknownType->uttype */
-static icmBase *icc_add_tag(
+/* Write the profile into a single memory buffer, encoding the tags */
+/* directly into it. If *bufp is NULL a buffer of the profile size is */
+/* allocated using the allocator the icc was created with, otherwise *bufp of *lenp bytes */
+/* is used. *lenp is set to the profile size. */
+/* Return 0 on sucess, error code on failure */
+static int icc_write_mem(
     icc *p,
-    icTagSignature sig,            /* Tag signature - may be unknown */
-    icTagTypeSignature  ttype    /* Tag type */
+    void **bufp,        /* Buffer to write to, or NULL to allocate */
+    size_t *lenp        /* Buffer size, returns profile size */
 ) {
-    icmBase *tp;
-    icmBase *nob;
-    int i = 0, ok = 1;
-    unsigned int j;
+    icmAlloc *al;
+    icmFile *fp, *ofp;
+    unsigned int size;
+    char *buf = (char *)*bufp;
+    unsigned int oof;
+    int odel_fp, rv;
 
-    if (ttype != icmSigUnknownType) {   /* Check only for possibly known types */
+    /* The buffer is the caller's, so isn't accounted as icc memory */
+    al = ((icmAllocAcct *)p->al)->base;
 
-        /* Check that a known signature has an acceptable type */
-        for (i = 0; sigtypetable[i].sig != icMaxEnumType; i++) {
-            if (sigtypetable[i].sig == sig) {    /* recognized signature */
-                ok = 0;
-                for (j = 0; sigtypetable[i].ttypes[j] != icMaxEnumType; j++) {
-                    if (sigtypetable[i].ttypes[j] == ttype)    /* recognized type */
-                        ok = 1;
-                }
-                break;
-            }
-        }
-        if (!ok) {
-            sprintf(p->err,"icc_add_tag: wrong tag type for signature");
+    if ((size = p->get_size(p)) == 0 || size == UINT_MAX) {
+        if (p->errc == 0) {
+            sprintf(p->err,"icc_write_mem: get_size failed");
             p->errc = 1;
-            return NULL;
         }
+        return p->errc;
+    }
 
-        /* Check that we know how to handle this type */
-        for (i = 0; typetable[i].ttype != icMaxEnumType; i++) {
-            if (typetable[i].ttype == ttype)
-                break;
-        }
-        if (typetable[i].ttype == icMaxEnumType) {
-            sprintf(p->err,"icc_add_tag: unsupported tag type");
-            p->errc = 1;
-            return NULL;
+    if (buf == NULL) {
+        if ((buf = (char *) al->calloc(al, 1, size)) == NULL) {
+            sprintf(p->err,"icc_write_mem: calloc() failed");
+            return p->errc = 2;
         }
+    } else if (*lenp < size) {
+        sprintf(p->err,"icc_write_mem: buffer too small, need %u bytes",size);
+        return p->errc = 1;
     }
 
-    /* Check that this tag doesn't already exist */
-    /* (Perhaps we should simply replace it, rather than erroring ?) */
-    for (j = 0; j < p->count; j++) {
-        if (p->data[j].sig == sig) {
-            sprintf(p->err,"icc_add_tag: Already have tag '%s' in profile",tag2str(p->data[j].sig)); 
-            p->errc = 1;
-            return NULL;
-        }
+    if ((fp = new_icmFileMem_a(buf, size, p->al)) == NULL) {
+        sprintf(p->err,"icc_write_mem: new_icmFileMem failed");
+        if (*bufp == NULL)
+            al->free(al, buf);
+        return p->errc = 2;
     }
 
+    /* Restore any file the profile was read from, and its offset */
+    /* in the file, since tags may still be read from it. */
+    ofp = p->fp;
+    odel_fp = p->del_fp;
+    oof = p->of;
+
+    p->wbase = buf;
+    p->wsize = size;
+    rv = icc_write_x(p, fp, 0, 0);
+    p->wbase = NULL;
+    p->wsize = 0;
+
+    fp->del(fp);
+    p->fp = ofp;
+    p->del_fp = odel_fp;
+    p->of = oof;
+
+    if (rv != 0) {
+        if (*bufp == NULL)
+            al->free(al, buf);
+        return rv;
+    }
+
+    *bufp = (void *)buf;
+    *lenp = size;
+    return 0;
+}
+
+/* A memoised lookup object, and the get_luobj_shared() arguments that made it */
+struct _icmLuCache {
+    icmLookupFunc func;
+    icRenderingIntent intent;
+    icColorSpaceSignature pcsor;
+    icmLookupOrder order;
+    icmLuBase *luo;
+}; typedef struct _icmLuCache icmLuCache;
+
+/* Release a reference to a memoised lookup object, */
+/* deleting it when the last one goes. */
+static void icmLu_release(icmLuBase *p) {
+    if (ICM_ATOMIC_SUB(p->refs, 1) > 0)
+        return;
+    p->rdel(p);
+}
+
+/* Release the memoised lookup objects, because the tags */
+/* they were made from may be about to change. Objects */
+/* still held by callers are deleted when they release them. */
+static void icc_flush_lucache(icc *p) {
+    unsigned int i;
+
+    for (i = 0; i < p->nlucache; i++)
+        icmLu_release(p->lucache[i].luo);
+    p->nlucache = 0;
+}
+
+static icmBase *icc_read_tag_ix(icc *p, unsigned int i);
+
+/* Return NZ if any lookup objects of the icc are in use, */
+/* other than those only held by the get_luobj_shared() memo. */
+/* Called with icmMemLock held, so no lookup objects are being */
+/* made, and the counts can only fall while we look at them. */
+static int icc_lu_inuse(icc *p) {
+    unsigned int i;
+    int nmemo = 0;
+
+    for (i = 0; i < p->nlucache; i++) {
+        if (ICM_ATOMIC_GET(p->lucache[i].luo->refs) == 1)
+            nmemo++;
+    }
+    return ICM_ATOMIC_GET(p->nlu) != nmemo;
+}
+
+/* Unload the tag object of entry i, and any links to it */
+static void icc_evict_tag(icc *p, unsigned int i) {
+    icmBase *ob = p->data[i].objp;
+    unsigned int k;
+
+    for (k = 0; k < p->count; k++) {
+        if (p->data[k].objp != ob)
+            continue;
+        p->data[k].objp = NULL;
+        p->data[k].mevicted = 1;
+        if (--ob->refcount == 0)
+            ob->del(ob);
+    }
+    ((icmAllocAcct *)p->al)->evictions++;
+    icmMem.evictions++;
+}
+
+/* Unload the least recently read tag objects until the total memory */
+/* is within the budget, or nothing more can be unloaded. Only the tags */
+/* of the icc only are unloaded, or of every icc if it is NULL. The */
+/* object keep isn't unloaded. Called with icmMemLock held. */
+static void icc_mem_evict(icc *only, icmBase *keep) {
+    icc *p, *bp;
+    unsigned int i, bi = 0;
+    unsigned long bused;
+    size_t tot;
+    int c;
+
+    for (;;) {
+        for (tot = 0, c = 0; c < icmMemN; c++)
+            tot += ICM_ATOMIC_GET(icmMem.bytes[c]);
+        if (tot <= icmMem.budget)
+            break;
+
+        for (bp = NULL, p = icmMem.head; p != NULL; p = p->mnext) {
+            if ((only != NULL && p != only)
+             || p->mbusy != 0 || p->fp == NULL || icc_lu_inuse(p))
+                continue;
+            for (i = 0; i < p->count; i++) {
+                if (p->data[i].objp == NULL || p->data[i].objp == keep || !p->data[i].mfile)
+                    continue;
+                if (bp == NULL || p->data[i].mused < bused) {
+                    bp = p;
+                    bi = i;
+                    bused = p->data[i].mused;
+                }
+            }
+        }
+        if (bp == NULL)
+            break;
+
+        /* Memoised lookups may refer to the tag */
+        icc_flush_lucache(bp);
+        icc_evict_tag(bp, bi);
+    }
+}
+
+/* Note that tags of the icc are being used, and mustn't be unloaded */
+static void icc_mem_enter(icc *p) {
+    ICM_LOCK(icmMemLock);
+    p->mbusy++;
+    ICM_UNLOCK(icmMemLock);
+}
+
+/* Note that the tags of the icc are no longer being used, having */
+/* read tag ix (-1 for none), and unload its own tags to meet the */
+/* budget if there is one. The tags of other iccs may still be in */
+/* use by other callers, so they are only unloaded by icmMemTrim(). */
+static void icc_mem_leave(icc *p, int ix) {
+    ICM_LOCK(icmMemLock);
+    if (ix >= 0)
+        p->data[ix].mused = ++icmMem.clock;
+    if (--p->mbusy == 0 && icmMem.budget != 0)
+        icc_mem_evict(p, ix >= 0 ? p->data[ix].objp : NULL);
+    ICM_UNLOCK(icmMemLock);
+}
+
+/* Add an icc to the list of all of them */
+static void icc_mem_register(icc *p) {
+    ICM_LOCK(icmMemLock);
+    p->mprev = NULL;
+    if ((p->mnext = icmMem.head) != NULL)
+        icmMem.head->mprev = p;
+    icmMem.head = p;
+    icmMem.nicc++;
+    ICM_UNLOCK(icmMemLock);
+}
+
+/* Remove an icc from the list of all of them */
+static void icc_mem_unregister(icc *p) {
+    ICM_LOCK(icmMemLock);
+    if (p->mprev != NULL)
+        p->mprev->mnext = p->mnext;
+    else
+        icmMem.head = p->mnext;
+    if (p->mnext != NULL)
+        p->mnext->mprev = p->mprev;
+    icmMem.nicc--;
+    ICM_UNLOCK(icmMemLock);
+}
+
+/* Re-read any tags that were unloaded to meet the budget, */
+/* for operations that need all of them. Return error code. */
+static int icc_reload_tags(icc *p) {
+    unsigned int i;
+
+    for (i = 0; i < p->count; i++) {
+        if (p->data[i].objp == NULL && p->data[i].mevicted) {
+            if (icc_read_tag_ix(p, i) == NULL)
+                return p->errc;
+        }
+    }
+    return 0;
+}
+
+/* Get the memory statistics of this icc */
+static void icc_get_memstats(icc *p, icmMemStats *st) {
+    icmAllocAcct *ap = (icmAllocAcct *)p->al;
+    unsigned int i;
+    int c;
+
+    memset((void *)st, 0, sizeof(icmMemStats));
+    ICM_LOCK(icmMemLock);
+    for (c = 0; c < icmMemN; c++)
+        st->bytes[c] = ICM_ATOMIC_GET(ap->bytes[c]);
+    st->budget = icmMem.budget;
+    st->nicc = 1;
+    for (i = 0; i < p->count; i++) {
+        if (p->data[i].objp != NULL)
+            st->ntags++;
+    }
+    st->reads = ICM_ATOMIC_GET(ap->reads);
+    st->rereads = ICM_ATOMIC_GET(ap->rereads);
+    st->evictions = ap->evictions;
+    ICM_UNLOCK(icmMemLock);
+}
+
+/* Get the decoding statistics of the tag with signature sig. */
+/* Return 0 on success, 2 if the tag isn't found. */
+static int icc_get_tagstats(icc *p, icTagSignature sig, icmTagStats *st) {
+    unsigned int i;
+
+    memset((void *)st, 0, sizeof(icmTagStats));
+    for (i = 0; i < p->count; i++) {
+        if (p->data[i].sig == sig)
+            break;
+    }
+    if (i == p->count) {
+        sprintf(p->err,"icc_get_tagstats: Tag '%s' not found",string_TagSignature(sig));
+        return p->errc = 2;
+    }
+
+    ICM_LOCK(icmMemLock);
+    st->size = p->data[i].size;
+    st->rbytes = p->data[i].rbytes;
+    st->loaded = p->data[i].objp != NULL;
+    if (st->loaded && p->data[i].mfile)
+        st->mbytes = p->data[i].mbytes;
+    ICM_UNLOCK(icmMemLock);
+    return 0;
+}
+
+/* Set the memory budget of all the icc objects, 0 for none */
+void icmSetMemBudget(size_t bytes) {
+    ICM_LOCK(icmMemLock);
+    icmMem.budget = bytes;
+    ICM_UNLOCK(icmMemLock);
+}
+
+/* Unload the least recently read tags of any icc to meet the budget */
+void icmMemTrim(void) {
+    ICM_LOCK(icmMemLock);
+    if (icmMem.budget != 0)
+        icc_mem_evict(NULL, NULL);
+    ICM_UNLOCK(icmMemLock);
+}
+
+/* Get the memory statistics of all the icc objects */
+void icmGetMemStats(icmMemStats *st) {
+    icc *p;
+    unsigned int i;
+    int c;
+
+    memset((void *)st, 0, sizeof(icmMemStats));
+    ICM_LOCK(icmMemLock);
+    for (c = 0; c < icmMemN; c++)
+        st->bytes[c] = ICM_ATOMIC_GET(icmMem.bytes[c]);
+    st->budget = icmMem.budget;
+    st->nicc = icmMem.nicc;
+    for (p = icmMem.head; p != NULL; p = p->mnext) {
+        for (i = 0; i < p->count; i++) {
+            if (p->data[i].objp != NULL)
+                st->ntags++;
+        }
+    }
+    st->reads = ICM_ATOMIC_GET(icmMem.reads);
+    st->rereads = ICM_ATOMIC_GET(icmMem.rereads);
+    st->evictions = icmMem.evictions;
+    ICM_UNLOCK(icmMemLock);
+}
+
+/* Create and add a tag with the given signature. */
+/* Returns a pointer to the element object */
+/* Returns NULL if error - icc->errc will contain */
+/* 2 on system error, */
+/* 3 if unknown tag */
+/* NOTE: that we prevent tag duplication */
+/* NOTE: to create a tag type icmSigUnknownType, set ttype to icmSigUnknownType, */
+/* and set the actual tag type in icmSigUnknownType->uttype */
+static icmBase *icc_add_tag(
+    icc *p,
+    icTagSignature sig,            /* Tag signature - may be unknown */
+    icTagTypeSignature  ttype    /* Tag type */
+) {
+    icmBase *tp;
+    icmBase *nob;
+    int i = 0, ok = 1;
+    unsigned int j;
+
+    if (ttype != icmSigUnknownType) {   /* Check only for possibly known types */
+
+        /* Check that a known signature has an acceptable type */
+        for (i = 0; sigtypetable[i].sig != icMaxEnumType; i++) {
+            if (sigtypetable[i].sig == sig) {    /* recognized signature */
+                ok = 0;
+                for (j = 0; sigtypetable[i].ttypes[j] != icMaxEnumType; j++) {
+                    if (sigtypetable[i].ttypes[j] == ttype)    /* recognized type */
+                        ok = 1;
+                }
+                break;
+            }
+        }
+        if (!ok) {
+            sprintf(p->err,"icc_add_tag: wrong tag type for signature");
+            p->errc = 1;
+            return NULL;
+        }
+
+        /* Check that we know how to handle this type */
+        for (i = 0; typetable[i].ttype != icMaxEnumType; i++) {
+            if (typetable[i].ttype == ttype)
+                break;
+        }
+        if (typetable[i].ttype == icMaxEnumType) {
+            sprintf(p->err,"icc_add_tag: unsupported tag type");
+            p->errc = 1;
+            return NULL;
+        }
+    }
+
+    /* Check that this tag doesn't already exist */
+    /* (Perhaps we should simply replace it, rather than erroring ?) */
+    for (j = 0; j < p->count; j++) {
+        if (p->data[j].sig == sig) {
+            sprintf(p->err,"icc_add_tag: Already have tag '%s' in profile",tag2str(p->data[j].sig)); 
+            p->errc = 1;
+            return NULL;
+        }
+    }
+
+    /* Lookups made from the tags may change */
+    icc_flush_lucache(p);
+
     /* Make space in tag table for new tag item */
     if (ovr_mul(sat_add(p->count,1), sizeof(icmTag))) {
         sprintf(p->err,"icc_add_tag: size overflow");
@@ -11600,6 +14013,10 @@ static icmBase *icc_link_tag(
         return NULL;
     }
 
+    /* Re-read it if the memory budget unloaded it */
+    if (p->data[exi].objp == NULL && p->data[exi].mevicted)
+        icc_read_tag_ix(p, exi);
+
     if (p->data[exi].objp == NULL) {
         sprintf(p->err,"icc_link_tag: Existing tag '%s' isn't loaded",tag2str(ex_sig)); 
         p->errc = 1;
@@ -11632,6 +14049,9 @@ static icmBase *icc_link_tag(
         }
     }
 
+    /* Lookups made from the tags may change */
+    icc_flush_lucache(p);
+
     /* Make space in tag table for new tag item */
     if (p->data == NULL)
         tp = (icmBase *)p->al->malloc(p->al, (p->count+1) * sizeof(icmTag));
@@ -11689,19 +14109,23 @@ static int icc_find_tag(
     return 0;
 }
 
-/* Read the specific tag element data, and return a pointer to the object */
+/* Read the specific tag element data, and return a pointer to the object, */
+/* without regard to the memory budget. */
 /* (This is an internal function)                  */
 /* Returns NULL if error - icc->errc will contain: */
 /* 2 if not found                                  */
 /* Returns an icmSigUnknownType object if the tag type isn't handled by a specific object.
  */
 /* NOTE: we don't handle tag duplication - you'll always get the first in the file */
-static icmBase *icc_read_tag_ix(
+static icmBase *icc_decode_tag_ix(
     icc *p,
     unsigned int i                /* Index from 0.. p->count-1 */
 ) {
+    icmAllocAcct *ap = (icmAllocAcct *)p->al;
     icTagTypeSignature ttype;    /* Tag type we will create */
     icmBase *nob;
+    icmMemCat ocat;
+    size_t tbytes;
     unsigned int k;
     int j;
 
@@ -11728,6 +14152,8 @@ static icmBase *icc_read_tag_ix(
     }
     if (k < p->count) {        /* Make this a link */
         p->data[i].objp = p->data[k].objp;
+        p->data[i].mfile = p->data[k].mfile;
+        p->data[i].mbytes = 0;
         p->data[k].objp->refcount++;    /* Bump reference count */
         return p->data[k].objp;            /* Done */
     }
@@ -11745,22 +14171,62 @@ static icmBase *icc_read_tag_ix(
     }
     
     /* Creat and read in the object */
+    ocat = icc_memcat(p, icmMemTag);
+    tbytes = ICM_ATOMIC_GET(ap->bytes[icmMemTag]);
+
     if (ttype == icmSigUnknownType)
         nob = new_icmUnknown(p);
     else
         nob = typetable[j].new_obj(p);
 
-    if (nob == NULL)
+    if (nob == NULL) {
+        icc_memcat(p, ocat);
         return NULL;
+    }
 
     if ((nob->read(nob, p->data[i].size, p->of + p->data[i].offset)) != 0) {
         nob->del(nob);        /* Failed, so destroy it */
+        icc_memcat(p, ocat);
         return NULL;
     }
+    icc_memcat(p, ocat);
+
     p->data[i].objp = nob;
+    p->data[i].rbytes += p->data[i].size;
+
+    /* Account for the decoded object */
+    p->data[i].mbytes = ICM_ATOMIC_GET(ap->bytes[icmMemTag]) - tbytes;
+    ICM_ATOMIC_ADD(ap->reads, 1);
+    ICM_ATOMIC_ADD(icmMem.reads, 1);
+    if (p->data[i].mevicted) {
+        ICM_ATOMIC_ADD(ap->rereads, 1);
+        ICM_ATOMIC_ADD(icmMem.rereads, 1);
+    }
+    p->data[i].mfile = 1;
+    p->data[i].mevicted = 0;
+
     return nob;
 }
 
+/* Read the specific tag element data, and return a pointer to the object. */
+/* If this takes the memory allocated over the budget, other tags may be */
+/* unloaded. */
+/* (This is an internal function)                  */
+/* Returns NULL if error - icc->errc will contain: */
+/* 2 if not found                                  */
+static icmBase *icc_read_tag_ix(
+    icc *p,
+    unsigned int i                /* Index from 0.. p->count-1 */
+) {
+    icmBase *ob;
+
+    icc_mem_enter(p);
+    ob = icc_decode_tag_ix(p, i);
+    icc_mem_leave(p, ob != NULL ? (int)i : -1);
+
+    return ob;
+}
+
 /* Read the tag element data of the first matching, and return a pointer to the object */
 /* Returns NULL if error - icc->errc will contain:         */
 /* 2 if not found                                          */
@@ -11824,6 +14290,9 @@ static int icc_rename_tag(
         return p->errc;
     }
 
+    /* Lookups made from the tags may change */
+    icc_flush_lucache(p);
+
     /* change its signature */
     p->data[k].sig = sigNew;
 
@@ -11850,7 +14319,10 @@ static int icc_unread_tag_ix(
         sprintf(p->err,"icc_unread_tag: Tag '%s' not currently loaded",string_TagSignature(p->data[i].sig));
         return p->errc = 2;
     }
-    
+
+    /* Lookups made from the tags may change */
+    icc_flush_lucache(p);
+
     if (--(p->data[i].objp->refcount) == 0)            /* decrement reference count */
             (p->data[i].objp->del)(p->data[i].objp);    /* Last reference */
       p->data[i].objp = NULL;
@@ -11880,7 +14352,7 @@ static int icc_unread_tag(
         return p->errc = 2;
     }
 
-    return icc_unread_tag(p, i);
+    return icc_unread_tag_ix(p, i);
 }
 
 /* Delete the tag, and free the underlying tag type, */
@@ -11897,6 +14369,9 @@ static int icc_delete_tag_ix(
         return p->errc = 2;
     }
 
+    /* Lookups made from the tags may change */
+    icc_flush_lucache(p);
+
     /* If it's been read into memory, decrement the reference count */
     if (p->data[i].objp != NULL) {
         if (--(p->data[i].objp->refcount) == 0)            /* decrement reference count */
@@ -11997,4533 +14472,7639 @@ static void icc_dump(
 }
 
 
-static void icc_delete(
-    icc *p
-) {
-    unsigned int i;
-    icmAlloc *al = p->al;
-    int del_al   = p->del_al;
-
-    /* Free up the header */
-    if (p->header != NULL)
-        (p->header->del)(p->header);
-
-    /* Free up the tag data objects */
-    if (p->data != NULL) {
-        for (i = 0; i < p->count; i++) {
-            if (p->data[i].objp != NULL) {
-                if (--(p->data[i].objp->refcount) == 0)    /* decrement reference count */
-                    (p->data[i].objp->del)(p->data[i].objp);    /* Last reference */
-                    p->data[i].objp = NULL;
-            }
-        }
-        /* Free tag table */
-        al->free(al, p->data);
-    }
+/* ---------------------------------------------------------- */
+/* Machine readable dump. This writes the same information as */
+/* icc_dump() as a JSON document, through a large output buffer */
+/* rather than one gprintf() per field. */
 
-    /* We are responsible for deleting the file object */
-    if (p->del_fp && p->fp != NULL)
-        p->fp->del(p->fp);
+#define JSON_BUFSZ 65536        /* Output buffer size */
+#define JSON_ROOM 80            /* Largest single formatted item */
 
-    /* This object */
-    al->free(al, p);
+typedef struct {
+    icmFile *op;
+    char *buf;                    /* Output buffer [JSON_BUFSZ] */
+    unsigned int len;            /* Bytes used in buf */
+    int first;                    /* Next item is the first in its object or array */
+    int err;                    /* NZ if a write failed */
+} icmJson;
 
-    if (del_al)            /* We are responsible for deleting allocator */
-        al->del(al);
+static void json_flush(icmJson *jp) {
+    if (jp->len > 0 && jp->err == 0) {
+        if (jp->op->write(jp->op, jp->buf, 1, jp->len) != jp->len)
+            jp->err = 1;
+    }
+    jp->len = 0;
 }
 
-/* ================================================== */
-/* Lut Color normalizing and de-normalizing functions */
+/* Return a pointer to at least n free bytes in the buffer */
+static char *json_room(icmJson *jp, unsigned int n) {
+    if ((jp->len + n) > JSON_BUFSZ)
+        json_flush(jp);
+    return jp->buf + jp->len;
+}
 
-/* As a rule, I am representing Lut in memory as values in machine form as real */
-/* numbers in the range 0.0 - 1.0. For many color spaces (ie. RGB, Gray, */
-/* hsv, hls, cmyk and other device coords), this is entirely appropriate. */
-/* For CIE based spaces though, this is not correct, since (I assume!) the binary */
-/* representation will be consistent with the encoding in Annex A, page 74 */
-/* of the standard. Note that the standard doesn't specify the encoding of */
-/* many color spaces (ie. Yuv, Yxy etc.), and is unclear about PCS. */
+/* Start an item, with a key if it is an object member */
+static void json_item(icmJson *jp, char *key) {
+    char *bp = json_room(jp, JSON_ROOM);
 
-/* The following functions convert to and from the CIE base spaces */
-/* and the real Lut input/output values. These are used to convert real color */
-/* space values into/out of the raw lut 0.0-1.0 representation (which subsequently */
-/* get converted to ICC integer values in the obvious way as a mapping to 0 .. 2^n-1). */
+    if (!jp->first)
+        *bp++ = ',';
+    jp->first = 0;
+    if (key != NULL)
+        bp += sprintf(bp, "\"%s\":", key);
+    jp->len = bp - jp->buf;
+}
 
-/* This is used internally to support the Lut->lookup() function, */
-/* and can also be used by someone writing a Lut based profile to determine */
-/* the colorspace range that the input lut indexes cover, as well */
-/* as processing the output luts values into normalized form ready */
-/* for writing. */
+/* Open an object ('{') or array ('[') */
+static void json_open(icmJson *jp, char *key, int c) {
+    json_item(jp, key);
+    jp->buf[jp->len++] = (char)c;
+    jp->first = 1;
+}
 
-/* These functions should be accessed by calling icc.getNormFuncs() */ 
+static void json_close(icmJson *jp, int c) {
+    json_room(jp, 1);
+    jp->buf[jp->len++] = (char)c;
+    jp->first = 0;
+}
 
-/* - - - - - - - - - - - - - - - - */
-/* According to 6.5.5 and 6.5.6 of the spec., */
-/* XYZ index values are represented the same as their table */
-/* values, ie. as a u1.15 representation, with a value */
-/* range from 0.0 ->  1.999969482422 */
+static void json_num(icmJson *jp, char *key, double vv) {
+    json_item(jp, key);
+    if ((vv - vv) != 0.0)        /* Infinity or NaN */
+        jp->len += sprintf(jp->buf + jp->len, "null");
+    else
+        jp->len += sprintf(jp->buf + jp->len, "%.10g", vv);
+}
 
-/* Convert Lut index/value to XYZ coord. */ 
-static void Lut_Lut2XYZ(double *out, double *in) {
-    out[0] = in[0] * (1.0 + 32767.0/32768); /* X */
-    out[1] = in[1] * (1.0 + 32767.0/32768); /* Y */
-    out[2] = in[2] * (1.0 + 32767.0/32768); /* Z */
+static void json_uint(icmJson *jp, char *key, unsigned long vv) {
+    json_item(jp, key);
+    jp->len += sprintf(jp->buf + jp->len, "%lu", vv);
 }
 
-/* Convert XYZ coord to Lut index/value. */ 
-static void Lut_XYZ2Lut(double *out, double *in) {
-    out[0] = in[0] * (1.0/(1.0 + 32767.0/32768));
-    out[1] = in[1] * (1.0/(1.0 + 32767.0/32768));
-    out[2] = in[2] * (1.0/(1.0 + 32767.0/32768));
+static void json_int(icmJson *jp, char *key, long vv) {
+    json_item(jp, key);
+    jp->len += sprintf(jp->buf + jp->len, "%ld", vv);
 }
 
-/* Convert Lut index/value to Y coord. */ 
-static void Lut_Lut2Y(double *out, double *in) {
-    out[0] = in[0] * (1.0 + 32767.0/32768); /* Y */
+/* A string of n bytes. Bytes outside printable ASCII are escaped */
+/* as the corresponding Latin-1 code point. */
+static void json_strn(icmJson *jp, char *key, char *s, unsigned int n) {
+    unsigned int i;
+    char *bp;
+
+    json_item(jp, key);
+    json_room(jp, 1);
+    jp->buf[jp->len++] = '"';
+    for (i = 0; i < n; i++) {
+        int c = ((unsigned char *)s)[i];
+        bp = json_room(jp, 6);
+        if (c == '"' || c == '\\') {
+            *bp++ = '\\';
+            *bp++ = (char)c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            bp += sprintf(bp, "\\u%04x", c);
+        } else {
+            *bp++ = (char)c;
+        }
+        jp->len = bp - jp->buf;
+    }
+    json_room(jp, 1);
+    jp->buf[jp->len++] = '"';
 }
 
-/* Convert Y coord to Lut index/value. */ 
-static void Lut_Y2Lut(double *out, double *in) {
-    out[0] = in[0] * (1.0/(1.0 + 32767.0/32768));
+/* A null terminated string, NULL for none */
+static void json_str(icmJson *jp, char *key, const char *s) {
+    if (s == NULL) {
+        json_item(jp, key);
+        jp->len += sprintf(jp->buf + jp->len, "null");
+    } else {
+        json_strn(jp, key, (char *)s, strlen(s));
+    }
 }
 
-/* - - - - - - - - - - - - - - - - */
-/* Convert 8 bit Lab to Lut numbers */
-/* Annex A specifies 8 and 16 bit encoding, but is */
-/* silent on the Lut index normalization. */
-/* Following Michael Bourgoin's 1998 SIGGRAPH course comment on this, */
-/* we assume here that the index encoding is the same as the */
-/* value encoding. */
+/* A signature, as its four characters if they are printable */
+static void json_sig(icmJson *jp, char *key, unsigned int sig) {
+    char c[4];
+    int i;
 
-/* Convert Lut8 table index/value to Lab */
-static void Lut_Lut2Lab_8(double *out, double *in) {
-    out[0] = in[0] * 100.0;                /* L */
-    out[1] = (in[1] * 255.0) - 128.0;    /* a */
-    out[2] = (in[2] * 255.0) - 128.0;    /* b */
+    for (i = 0; i < 4; i++) {
+        c[i] = (char)(0xff & (sig >> (24 - 8 * i)));
+        if (!isprint(c[i]))
+            break;
+    }
+    json_item(jp, key);
+    if (i < 4)
+        jp->len += sprintf(jp->buf + jp->len, "\"0x%x\"", sig);
+    else
+        jp->len += sprintf(jp->buf + jp->len, "\"%c%c%c%c\"", c[0], c[1], c[2], c[3]);
 }
 
-/* Convert Lab to Lut8 table index/value */
-static void Lut_Lab2Lut_8(double *out, double *in) {
-    out[0] = in[0] * 1.0/100.0;                /* L */
-    out[1] = (in[1] + 128.0) * 1.0/255.0;    /* a */
-    out[2] = (in[2] + 128.0) * 1.0/255.0;    /* b */
+static void json_u64(icmJson *jp, char *key, icmUint64 *vv) {
+    json_item(jp, key);
+    jp->len += sprintf(jp->buf + jp->len, "\"0x%08x%08x\"", vv->h, vv->l);
 }
 
-/* Convert Lut8 table index/value to L */
-static void Lut_Lut2L_8(double *out, double *in) {
-    out[0] = in[0] * 100.0;                /* L */
-}
+static void json_darr(icmJson *jp, char *key, double *v, unsigned int n) {
+    unsigned int i;
 
-/* Convert L to Lut8 table index/value */
-static void Lut_L2Lut_8(double *out, double *in) {
-    out[0] = in[0] * 1.0/100.0;                /* L */
+    json_open(jp, key, '[');
+    for (i = 0; i < n; i++)
+        json_num(jp, NULL, v[i]);
+    json_close(jp, ']');
 }
 
-/* - - - - - - - - - - - - - - - - */
-/* Convert 16 bit Lab to Lut numbers, V2 */
+static void json_uarr(icmJson *jp, char *key, unsigned int *v, unsigned int n) {
+    unsigned int i;
 
-/* Convert Lut16 table index/value to Lab */
-static void Lut_Lut2LabV2_16(double *out, double *in) {
-    out[0] = in[0] * (100.0 * 65535.0)/65280.0;            /* L */
-    out[1] = (in[1] * (255.0 * 65535.0)/65280) - 128.0;    /* a */
-    out[2] = (in[2] * (255.0 * 65535.0)/65280) - 128.0;    /* b */
+    json_open(jp, key, '[');
+    for (i = 0; i < n; i++)
+        json_uint(jp, NULL, v[i]);
+    json_close(jp, ']');
 }
 
-/* Convert Lab to Lut16 table index/value */
-static void Lut_Lab2LutV2_16(double *out, double *in) {
-    out[0] = in[0] * 65280.0/(100.0 * 65535.0);                /* L */
-    out[1] = (in[1] + 128.0) * 65280.0/(255.0 * 65535.0);    /* a */
-    out[2] = (in[2] + 128.0) * 65280.0/(255.0 * 65535.0);    /* b */
+static void json_xyz(icmJson *jp, char *key, icmXYZNumber *p) {
+    json_open(jp, key, '[');
+    json_num(jp, NULL, p->X);
+    json_num(jp, NULL, p->Y);
+    json_num(jp, NULL, p->Z);
+    json_close(jp, ']');
 }
 
-/* Convert Lut16 table index/value to L */
-static void Lut_Lut2LV2_16(double *out, double *in) {
-    out[0] = in[0] * (100.0 * 65535.0)/65280.0;            /* L */
+static void json_matrix(icmJson *jp, char *key, double e[3][3]) {
+    int i;
+
+    json_open(jp, key, '[');
+    for (i = 0; i < 3; i++)
+        json_darr(jp, NULL, e[i], 3);
+    json_close(jp, ']');
 }
 
-/* Convert Lab to Lut16 table index/value */
-static void Lut_L2LutV2_16(double *out, double *in) {
-    out[0] = in[0] * 65280.0/(100.0 * 65535.0);                /* L */
+static void json_datetime(icmJson *jp, char *key, icmDateTimeNumber *p) {
+    json_item(jp, key);
+    jp->len += sprintf(jp->buf + jp->len, "\"%04u-%02u-%02uT%02u:%02u:%02u\"",
+                       p->year, p->month, p->day, p->hours, p->minutes, p->seconds);
 }
 
-/* - - - - - - - - - - - - - - - - */
-/* Convert 16 bit Lab to Lut numbers, V4 */
+static void json_header(icmJson *jp, icmHeader *p) {
+    char id[33];
+    int i;
 
-/* Convert Lut16 table index/value to Lab */
-static void Lut_Lut2LabV4_16(double *out, double *in) {
-    out[0] = in[0] * 100.0;                /* L */
-    out[1] = (in[1] * 255.0) - 128.0;    /* a */
-    out[2] = (in[2] * 255.0) - 128.0;    /* b */
+    json_open(jp, "header", '{');
+    json_uint(jp, "size", p->size);
+    json_sig(jp, "cmm", p->cmmId);
+    json_int(jp, "majv", p->majv);
+    json_int(jp, "minv", p->minv);
+    json_int(jp, "bfv", p->bfv);
+    json_sig(jp, "deviceClass", p->deviceClass);
+    json_sig(jp, "colorSpace", p->colorSpace);
+    json_sig(jp, "pcs", p->pcs);
+    json_datetime(jp, "date", &p->date);
+    json_sig(jp, "platform", p->platform);
+    json_uint(jp, "flags", p->flags);
+    json_sig(jp, "manufacturer", p->manufacturer);
+    json_sig(jp, "model", p->model);
+    json_u64(jp, "attributes", &p->attributes);
+    json_int(jp, "renderingIntent", p->renderingIntent);
+    json_xyz(jp, "illuminant", &p->illuminant);
+    json_sig(jp, "creator", p->creator);
+    for (i = 0; i < 16; i++)
+        sprintf(id + 2 * i, "%02X", p->id[i]);
+    json_str(jp, "id", id);
+    json_close(jp, '}');
 }
 
-/* Convert Lab to Lut16 table index/value */
-static void Lut_Lab2LutV4_16(double *out, double *in) {
-    out[0] = in[0] * 1.0/100.0;                /* L */
-    out[1] = (in[1] + 128.0) * 1.0/255.0;    /* a */
-    out[2] = (in[2] + 128.0) * 1.0/255.0;    /* b */
+/* A curve. The table entries are only included if verb >= 2 */
+static void json_curve(icmJson *jp, char *key, icmCurve *p, int verb) {
+    json_open(jp, key, '{');
+    json_sig(jp, "type", p->ttype);
+    if (p->flag == icmCurveLin) {
+        json_str(jp, "style", "linear");
+    } else if (p->flag == icmCurveGamma) {
+        json_str(jp, "style", "gamma");
+        json_num(jp, "gamma", p->data[0]);
+    } else if (p->flag == icmCurvePara) {
+        json_str(jp, "style", "parametric");
+        json_int(jp, "function", p->ctype);
+        json_darr(jp, "params", p->data, p->size);
+    } else {
+        json_str(jp, "style", "table");
+        json_uint(jp, "entries", p->size);
+        if (verb >= 2)
+            json_darr(jp, "data", p->data, p->size);
+    }
+    json_close(jp, '}');
 }
 
-/* Convert Lut16 table index/value to L */
-static void Lut_Lut2LV4_16(double *out, double *in) {
-    out[0] = in[0] * 100.0;                /* L */
+static void json_curves(icmJson *jp, char *key, icmCurve **cv, unsigned int n, int verb) {
+    unsigned int i;
+
+    json_open(jp, key, '[');
+    for (i = 0; i < n; i++)
+        json_curve(jp, NULL, cv[i], verb);
+    json_close(jp, ']');
 }
 
-/* Convert L to Lut16 table index/value */
-static void Lut_L2LutV4_16(double *out, double *in) {
-    out[0] = in[0] * 1.0/100.0;                /* L */
+static void json_textdesc(icmJson *jp, char *key, icmTextDescription *p) {
+    json_open(jp, key, '{');
+    json_strn(jp, "ascii", p->desc != NULL ? p->desc : "", p->size > 0 ? p->size-1 : 0);
+    if (p->ucSize > 0) {
+        unsigned int i;
+        json_uint(jp, "ucLangCode", p->ucLangCode);
+        json_open(jp, "unicode", '[');
+        for (i = 0; i < p->ucSize; i++)
+            json_uint(jp, NULL, p->ucDesc[i]);
+        json_close(jp, ']');
+    }
+    if (p->scSize > 0) {
+        json_uint(jp, "scCode", p->scCode);
+        json_strn(jp, "scriptCode", (char *)p->scDesc, p->scSize-1);
+    }
+    json_close(jp, '}');
 }
 
-/* - - - - - - - - - - - - - - - - */
-/* Convert Luv to Lut number */
-/* This data normalization is taken from Apples */
-/* Colorsync specification. */
-/* As per other color spaces, we assume that the index */
-/* normalization is the same as the data normalization. */
+/* The contents of a tag. Bulk table data is only included if verb >= 2 */
+static void json_tag(icmJson *jp, icmBase *ob, int verb) {
+    unsigned int i, j;
 
-/* Convert Lut table index/value to Luv */
-static void Lut_Lut2Luv(double *out, double *in) {
-    out[0] = in[0] * 100.0;                        /* L */
-    out[1] = (in[1] * 65535.0/256.0) - 128.0;    /* u */
-    out[2] = (in[2] * 65535.0/256.0) - 128.0;    /* v */
+    json_open(jp, "data", '{');
+    switch (ob->ttype) {
+        case icSigUInt8ArrayType:
+        case icSigUInt16ArrayType:
+        case icSigUInt32ArrayType: {
+            /* These have the same layout */
+            icmUInt32Array *p = (icmUInt32Array *)ob;
+            json_uarr(jp, "values", p->data, p->size);
+            break;
+        }
+        case icSigUInt64ArrayType: {
+            icmUInt64Array *p = (icmUInt64Array *)ob;
+            json_open(jp, "values", '[');
+            for (i = 0; i < p->size; i++)
+                json_u64(jp, NULL, &p->data[i]);
+            json_close(jp, ']');
+            break;
+        }
+        case icSigU16Fixed16ArrayType:
+        case icSigS15Fixed16ArrayType: {
+            icmS15Fixed16Array *p = (icmS15Fixed16Array *)ob;
+            json_darr(jp, "values", p->data, p->size);
+            break;
+        }
+        case icSigXYZArrayType: {
+            icmXYZArray *p = (icmXYZArray *)ob;
+            json_open(jp, "values", '[');
+            for (i = 0; i < p->size; i++)
+                json_xyz(jp, NULL, &p->data[i]);
+            json_close(jp, ']');
+            break;
+        }
+        case icSigCurveType:
+        case icSigParametricCurveType:
+            json_curve(jp, "curve", (icmCurve *)ob, verb);
+            break;
+        case icSigDataType: {
+            icmData *p = (icmData *)ob;
+            if (p->flag == icmDataASCII) {
+                json_strn(jp, "ascii", (char *)p->data, p->size > 0 ? p->size-1 : 0);
+            } else {
+                json_uint(jp, "bytes", p->size);
+                if (verb >= 2) {
+                    json_open(jp, "binary", '[');
+                    for (i = 0; i < p->size; i++)
+                        json_uint(jp, NULL, p->data[i]);
+                    json_close(jp, ']');
+                }
+            }
+            break;
+        }
+        case icSigTextType: {
+            icmText *p = (icmText *)ob;
+            json_strn(jp, "text", p->data != NULL ? p->data : "", p->size > 0 ? p->size-1 : 0);
+            break;
+        }
+        case icSigDateTimeType:
+            json_datetime(jp, "date", (icmDateTimeNumber *)ob);
+            break;
+        case icSigLut8Type:
+        case icSigLut16Type: {
+            icmLut *p = (icmLut *)ob;
+            json_uint(jp, "inputChan", p->inputChan);
+            json_uint(jp, "outputChan", p->outputChan);
+            json_uint(jp, "clutPoints", p->clutPoints);
+            json_uint(jp, "inputEnt", p->inputEnt);
+            json_uint(jp, "outputEnt", p->outputEnt);
+            json_matrix(jp, "matrix", p->e);
+            if (verb >= 2) {
+                json_open(jp, "inputTable", '[');
+                for (i = 0; i < p->inputChan; i++)
+                    json_darr(jp, NULL, p->inputTable + i * p->inputEnt, p->inputEnt);
+                json_close(jp, ']');
+                /* Input channel 0 varies slowest, as in the file */
+                json_darr(jp, "clutTable", p->clutTable,
+                          p->outputChan * sat_pow(p->clutPoints, p->inputChan));
+                json_open(jp, "outputTable", '[');
+                for (i = 0; i < p->outputChan; i++)
+                    json_darr(jp, NULL, p->outputTable + i * p->outputEnt, p->outputEnt);
+                json_close(jp, ']');
+            }
+            break;
+        }
+        case icSigLutAtoBType:
+        case icSigLutBtoAType: {
+            icmLutAB *p = (icmLutAB *)ob;
+            json_uint(jp, "inputChan", p->inputChan);
+            json_uint(jp, "outputChan", p->outputChan);
+            json_curves(jp, "bCurves", p->bCurves, LUTAB_NB(p), verb);
+            if (p->mmatrix) {
+                json_matrix(jp, "matrix", p->e);
+                json_darr(jp, "offset", p->off, 3);
+                json_curves(jp, "mCurves", p->mCurves, 3, verb);
+            }
+            if (p->aclut) {
+                json_uarr(jp, "clutPoints", p->clutPoints, p->inputChan);
+                json_uint(jp, "clutPrec", p->clutPrec);
+                json_curves(jp, "aCurves", p->aCurves, LUTAB_NA(p), verb);
+                if (verb >= 2)
+                    json_darr(jp, "clutTable", p->clutTable,
+                              p->outputChan * icmLutAB_clut_points(p));
+            }
+            break;
+        }
+        case icSigMeasurementType: {
+            icmMeasurement *p = (icmMeasurement *)ob;
+            json_int(jp, "observer", p->observer);
+            json_xyz(jp, "backing", &p->backing);
+            json_int(jp, "geometry", p->geometry);
+            json_num(jp, "flare", p->flare);
+            json_int(jp, "illuminant", p->illuminant);
+            break;
+        }
+        case icSigNamedColorType:
+        case icSigNamedColor2Type: {
+            icmNamedColor *p = (icmNamedColor *)ob;
+            json_uint(jp, "vendorFlag", p->vendorFlag);
+            json_uint(jp, "count", p->count);
+            json_uint(jp, "nDeviceCoords", p->nDeviceCoords);
+            json_str(jp, "prefix", p->prefix);
+            json_str(jp, "suffix", p->suffix);
+            if (verb >= 2) {
+                json_open(jp, "colors", '[');
+                for (i = 0; i < p->count; i++) {
+                    icmNamedColorVal *vp = p->data + i;
+                    json_open(jp, NULL, '{');
+                    json_str(jp, "root", vp->root);
+                    if (p->ttype == icSigNamedColor2Type)
+                        json_darr(jp, "pcsCoords", vp->pcsCoords, 3);
+                    json_darr(jp, "deviceCoords", vp->deviceCoords, p->nDeviceCoords);
+                    json_close(jp, '}');
+                }
+                json_close(jp, ']');
+            }
+            break;
+        }
+        case icSigColorantTableType: {
+            icmColorantTable *p = (icmColorantTable *)ob;
+            json_open(jp, "colorants", '[');
+            for (i = 0; i < p->count; i++) {
+                json_open(jp, NULL, '{');
+                json_str(jp, "name", p->data[i].name);
+                json_darr(jp, "pcsCoords", p->data[i].pcsCoords, 3);
+                json_close(jp, '}');
+            }
+            json_close(jp, ']');
+            break;
+        }
+        case icSigTextDescriptionType:
+            json_textdesc(jp, "desc", (icmTextDescription *)ob);
+            break;
+        case icSigProfileSequenceDescType: {
+            icmProfileSequenceDesc *p = (icmProfileSequenceDesc *)ob;
+            json_open(jp, "descriptions", '[');
+            for (i = 0; i < p->count; i++) {
+                icmDescStruct *dp = p->data + i;
+                json_open(jp, NULL, '{');
+                json_sig(jp, "deviceMfg", dp->deviceMfg);
+                json_sig(jp, "deviceModel", dp->deviceModel);
+                json_u64(jp, "attributes", &dp->attributes);
+                json_sig(jp, "technology", dp->technology);
+                json_textdesc(jp, "device", &dp->device);
+                json_textdesc(jp, "model", &dp->model);
+                json_close(jp, '}');
+            }
+            json_close(jp, ']');
+            break;
+        }
+        case icSigSignatureType:
+            json_sig(jp, "sig", ((icmSignature *)ob)->sig);
+            break;
+        case icSigScreeningType: {
+            icmScreening *p = (icmScreening *)ob;
+            json_uint(jp, "screeningFlag", p->screeningFlag);
+            json_open(jp, "channels", '[');
+            for (i = 0; i < p->channels; i++) {
+                json_open(jp, NULL, '{');
+                json_num(jp, "frequency", p->data[i].frequency);
+                json_num(jp, "angle", p->data[i].angle);
+                json_int(jp, "spotShape", p->data[i].spotShape);
+                json_close(jp, '}');
+            }
+            json_close(jp, ']');
+            break;
+        }
+        case icSigUcrBgType: {
+            icmUcrBg *p = (icmUcrBg *)ob;
+            json_darr(jp, "UCRcurve", p->UCRcurve, p->UCRcount);
+            json_darr(jp, "BGcurve", p->BGcurve, p->BGcount);
+            json_strn(jp, "string", p->string != NULL ? p->string : "", p->size > 0 ? p->size-1 : 0);
+            break;
+        }
+        case icSigVideoCardGammaType: {
+            icmVideoCardGamma *p = (icmVideoCardGamma *)ob;
+            if (p->tagType == icmVideoCardGammaTableType) {
+                icmVideoCardGammaTable *t = &p->u.table;
+                json_uint(jp, "channels", t->channels);
+                json_uint(jp, "entryCount", t->entryCount);
+                json_uint(jp, "entrySize", t->entrySize);
+                if (verb >= 2) {
+                    json_open(jp, "table", '[');
+                    for (i = 0; i < t->channels; i++) {
+                        json_open(jp, NULL, '[');
+                        for (j = 0; j < t->entryCount; j++) {
+                            if (t->entrySize == 1)
+                                json_uint(jp, NULL, ((ORD8 *)t->data)[i * t->entryCount + j]);
+                            else
+                                json_uint(jp, NULL, ((ORD16 *)t->data)[i * t->entryCount + j]);
+                        }
+                        json_close(jp, ']');
+                    }
+                    json_close(jp, ']');
+                }
+            } else {
+                icmVideoCardGammaFormula *f = &p->u.formula;
+                double gmm[9];
+                gmm[0] = f->redGamma;   gmm[1] = f->redMin;   gmm[2] = f->redMax;
+                gmm[3] = f->greenGamma; gmm[4] = f->greenMin; gmm[5] = f->greenMax;
+                gmm[6] = f->blueGamma;  gmm[7] = f->blueMin;  gmm[8] = f->blueMax;
+                json_open(jp, "formula", '[');
+                for (i = 0; i < 3; i++)
+                    json_darr(jp, NULL, gmm + 3 * i, 3);        /* gamma, min, max */
+                json_close(jp, ']');
+            }
+            break;
+        }
+        case icSigViewingConditionsType: {
+            icmViewingConditions *p = (icmViewingConditions *)ob;
+            json_xyz(jp, "illuminant", &p->illuminant);
+            json_xyz(jp, "surround", &p->surround);
+            json_int(jp, "stdIlluminant", p->stdIlluminant);
+            break;
+        }
+        case icSigCrdInfoType: {
+            icmCrdInfo *p = (icmCrdInfo *)ob;
+            json_strn(jp, "ppname", p->ppname != NULL ? p->ppname : "", p->ppsize > 0 ? p->ppsize-1 : 0);
+            json_open(jp, "crdnames", '[');
+            for (i = 0; i < 4; i++)
+                json_strn(jp, NULL, p->crdname[i] != NULL ? p->crdname[i] : "",
+                          p->crdsize[i] > 0 ? p->crdsize[i]-1 : 0);
+            json_close(jp, ']');
+            break;
+        }
+        default: {
+            icmUnknown *p = (icmUnknown *)ob;
+            json_sig(jp, "type", p->uttype);
+            json_uint(jp, "bytes", p->size);
+            if (verb >= 2) {
+                json_open(jp, "binary", '[');
+                for (i = 0; i < p->size; i++)
+                    json_uint(jp, NULL, p->data[i]);
+                json_close(jp, ']');
+            }
+            break;
+        }
+    }
+    json_close(jp, '}');
 }
 
-/* Convert Luv to Lut table index/value */
-static void Lut_Luv2Lut(double *out, double *in) {
-    out[0] = in[0] * 1.0/100.0;                    /* L */
-    out[1] = (in[1] + 128.0) * 256.0/65535.0;    /* u */
-    out[2] = (in[2] + 128.0) * 256.0/65535.0;    /* v */
-}
+/* Dump the header, tag table and tags as a JSON document. */
+/* Bulk tag data is included if verb >= 3 */
+/* Return 0 on success, 2 on a malloc or write failure */
+static int icc_dump_json(
+    icc *p,
+    icmFile *op,      /* Output to dump to */
+    int   verb        /* Verbosity level */
+) {
+    icmJson js, *jp = &js;
+    unsigned int i;
 
-/* - - - - - - - - - - - - - - - - */
-/* Default N component conversions */
-static void Lut_N(double *out, double *in, int nc) {
-    for (--nc; nc >= 0; nc--)
-        out[nc] = in[nc];
-}
+    jp->op = op;
+    jp->len = 0;
+    jp->first = 1;
+    jp->err = 0;
+    if ((jp->buf = (char *) p->al->malloc(p->al, JSON_BUFSZ)) == NULL) {
+        sprintf(p->err,"icc_dump_json: malloc() failed");
+        return p->errc = 2;
+    }
 
-/* 1 */
-static void Lut_1(double *out, double *in) {
-    out[0] = in[0];
-}
+    json_open(jp, NULL, '{');
+    if (p->header != NULL)
+        json_header(jp, p->header);
 
-/* 2 */
-static void Lut_2(double *out, double *in) {
-    out[0] = in[0];
-    out[1] = in[1];
-}
+    json_open(jp, "tags", '[');
+    for (i = 0; i < p->count; i++) {
+        icmBase *ob;
+        int tr = 0;
 
-/* 3 */
-static void Lut_3(double *out, double *in) {
-    out[0] = in[0];
-    out[1] = in[1];
-    out[2] = in[2];
-}
+        json_open(jp, NULL, '{');
+        json_sig(jp, "sig", p->data[i].sig);
+        json_sig(jp, "type", p->data[i].ttype);
+        json_uint(jp, "offset", p->data[i].offset);
+        json_uint(jp, "size", p->data[i].size);
+        if (p->data[i].objp == NULL) {
+            /* The object is not loaded, so load it then free it */
+            if (icc_read_tag_ix(p, i) == NULL)
+                json_str(jp, "error", p->err);
+            tr = 1;
+        }
+        if ((ob = p->data[i].objp) != NULL) {
+            json_tag(jp, ob, verb-1);
+            if (tr != 0)
+                icc_unread_tag_ix(p, i);
+        }
+        json_close(jp, '}');
+    }
+    json_close(jp, ']');
+    json_close(jp, '}');
+    json_room(jp, 1);
+    jp->buf[jp->len++] = '\n';
 
-/* 4 */
-static void Lut_4(double *out, double *in) {
-    out[0] = in[0];
-    out[1] = in[1];
-    out[2] = in[2];
-    out[3] = in[3];
+    json_flush(jp);
+    p->al->free(p->al, jp->buf);
+    if (jp->err != 0 || op->flush(op) != 0) {
+        sprintf(p->err,"icc_dump_json: write failed");
+        return p->errc = 2;
+    }
+    return 0;
 }
 
-/* 5 */
-static void Lut_5(double *out, double *in) {
-    out[0] = in[0];
-    out[1] = in[1];
-    out[2] = in[2];
-    out[3] = in[3];
-    out[4] = in[4];
-}
 
-/* 6 */
-static void Lut_6(double *out, double *in) {
-    out[0] = in[0];
-    out[1] = in[1];
-    out[2] = in[2];
-    out[3] = in[3];
-    out[4] = in[4];
-    out[5] = in[5];
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/* The icc methods that use more than one tag, or change the tag */
+/* table, hold the icc busy so that the memory budget doesn't */
+/* unload its tags underneath them. */
+
+/* Once written, the tags no longer match the file they were */
+/* read from, so they mustn't be unloaded and re-read. */
+static void icc_mem_written(icc *p) {
+    unsigned int i;
+
+    for (i = 0; i < p->count; i++)
+        p->data[i].mfile = 0;
 }
 
-/* 7 */
-static void Lut_7(double *out, double *in) {
-    Lut_N(out, in, 7);
+static int icc_read_x_busy(icc *p, icmFile *fp, unsigned int of, int take_fp) {
+    int rv;
+
+    icc_mem_enter(p);
+    rv = icc_read_x(p, fp, of, take_fp);
+    icc_mem_leave(p, -1);
+    return rv;
 }
 
-/* 8 */
-static void Lut_8(double *out, double *in) {
-    Lut_N(out, in, 8);
+static int icc_read_slurp_busy(icc *p, icmFile *fp, unsigned int of, int take_fp) {
+    int rv;
+
+    icc_mem_enter(p);
+    rv = icc_read_slurp(p, fp, of, take_fp);
+    icc_mem_leave(p, -1);
+    return rv;
 }
 
-/* 9 */
-static void Lut_9(double *out, double *in) {
-    Lut_N(out, in, 9);
+static unsigned int icc_get_size_busy(icc *p) {
+    unsigned int size = 0;
+
+    icc_mem_enter(p);
+    if (icc_reload_tags(p) == 0)
+        size = icc_get_size(p);
+    icc_mem_leave(p, -1);
+    return size;
 }
 
-/* 10 */
-static void Lut_10(double *out, double *in) {
-    Lut_N(out, in, 10);
+static int icc_write_x_busy(icc *p, icmFile *fp, unsigned int of, int take_fp) {
+    int rv;
+
+    icc_mem_enter(p);
+    if ((rv = icc_reload_tags(p)) == 0) {
+        rv = icc_write_x(p, fp, of, take_fp);
+        icc_mem_written(p);
+    } else if (take_fp) {
+        fp->del(fp);
+    }
+    icc_mem_leave(p, -1);
+    return rv;
 }
 
-/* 11 */
-static void Lut_11(double *out, double *in) {
-    Lut_N(out, in, 11);
+static int icc_write_mem_busy(icc *p, void **bufp, size_t *lenp) {
+    int rv;
+
+    icc_mem_enter(p);
+    if ((rv = icc_reload_tags(p)) == 0) {
+        rv = icc_write_mem(p, bufp, lenp);
+        icc_mem_written(p);
+    }
+    icc_mem_leave(p, -1);
+    return rv;
 }
 
-/* 12 */
-static void Lut_12(double *out, double *in) {
-    Lut_N(out, in, 12);
+static void icc_dump_busy(icc *p, icmFile *op, int verb) {
+    icc_mem_enter(p);
+    icc_dump(p, op, verb);
+    icc_mem_leave(p, -1);
 }
 
-/* 13 */
-static void Lut_13(double *out, double *in) {
-    Lut_N(out, in, 13);
+static int icc_dump_json_busy(icc *p, icmFile *op, int verb) {
+    int rv;
+
+    icc_mem_enter(p);
+    rv = icc_dump_json(p, op, verb);
+    icc_mem_leave(p, -1);
+    return rv;
 }
 
-/* 14 */
-static void Lut_14(double *out, double *in) {
-    Lut_N(out, in, 14);
+static int icc_read_all_tags_busy(icc *p) {
+    int rv;
+
+    icc_mem_enter(p);
+    rv = icc_read_all_tags(p);
+    icc_mem_leave(p, -1);
+    return rv;
 }
 
-/* 15 */
-static void Lut_15(double *out, double *in) {
-    Lut_N(out, in, 15);
+static icmBase *icc_add_tag_busy(icc *p, icTagSignature sig, icTagTypeSignature ttype) {
+    icmBase *ob;
+
+    icc_mem_enter(p);
+    ob = icc_add_tag(p, sig, ttype);
+    icc_mem_leave(p, -1);
+    return ob;
 }
 
-/* Function table - match conversions to color spaces. */
-/* Anything not here, we don't know how to convert. */
-/* (ie. YCbCr) */
-static struct {
-    icColorSpaceSignature csig;
-    void (*fromLut)(double *out, double *in);    /* from Lut index/entry */
-    void (*toLut)(double *out, double *in);        /* to Lut index/entry */
-} colnormtable[] = {
-    {icSigXYZData,     Lut_Lut2XYZ,      Lut_XYZ2Lut },
-    {icmSigYData,      Lut_Lut2Y,        Lut_Y2Lut },
-    {icmSigLab8Data,   Lut_Lut2Lab_8,    Lut_Lab2Lut_8 },
-    {icmSigLabV2Data,  Lut_Lut2LabV2_16, Lut_Lab2LutV2_16 },
-    {icmSigLabV4Data,  Lut_Lut2LabV4_16, Lut_Lab2LutV4_16 },
-    {icmSigL8Data,     Lut_Lut2L_8,      Lut_L2Lut_8 },
-    {icmSigLV2Data,    Lut_Lut2LV2_16,   Lut_L2LutV2_16 },
-    {icmSigLV4Data,    Lut_Lut2LV4_16,   Lut_L2LutV4_16 },
-    {icSigLuvData,     Lut_Lut2Luv,      Lut_Luv2Lut },
-    {icSigYxyData,     Lut_3,            Lut_3 },
-    {icSigRgbData,     Lut_3,            Lut_3 },
-    {icSigGrayData,    Lut_1,            Lut_1 },
-    {icSigHsvData,     Lut_3,            Lut_3 },
-    {icSigHlsData,     Lut_3,            Lut_3 },
-    {icSigCmykData,    Lut_4,            Lut_4 },
-    {icSigCmyData,     Lut_3,            Lut_3 },
-    {icSigMch6Data,    Lut_6,            Lut_6 },
-    {icSig2colorData,  Lut_2,            Lut_2 },
-    {icSig3colorData,  Lut_3,            Lut_3 },
-    {icSig4colorData,  Lut_4,            Lut_4 },
-    {icSig5colorData,  Lut_5,            Lut_5 },
-    {icSig6colorData,  Lut_6,            Lut_6 },
-    {icSig7colorData,  Lut_7,            Lut_7 },
-    {icSigMch5Data,    Lut_5,            Lut_5 },
-    {icSigMch6Data,    Lut_6,            Lut_6 },
-    {icSigMch7Data,    Lut_7,            Lut_7 },
-    {icSigMch8Data,    Lut_8,            Lut_8 },
-    {icSig8colorData,  Lut_8,            Lut_8 },
-    {icSig9colorData,  Lut_9,            Lut_9 },
-    {icSig10colorData, Lut_10,           Lut_10 },
-    {icSig11colorData, Lut_11,           Lut_11 },
-    {icSig12colorData, Lut_12,           Lut_12 },
-    {icSig13colorData, Lut_13,           Lut_13 },
-    {icSig14colorData, Lut_14,           Lut_14 },
-    {icSig15colorData, Lut_15,           Lut_15 },
-    {icMaxEnumData,    NULL,             NULL   }
-};
-    
-/*
-    Legacy Lab encoding:
+static icmBase *icc_link_tag_busy(icc *p, icTagSignature sig, icTagSignature ex_sig) {
+    icmBase *ob;
 
-    The V4 specificatins are misleading on this, since they assume in this
-    instance that all devices spaces, however labeled, have no defined
-    ICC encoding. The end result is simple enough though:
+    icc_mem_enter(p);
+    ob = icc_link_tag(p, sig, ex_sig);
+    icc_mem_leave(p, -1);
+    return ob;
+}
 
-    ICC V2 Lab encoding should be used in all PCS encodings in
-    a icSigLut16Type or icSigNamedColor2Type tag, and can be used
-    for Lab encoding in device spaces for these tags.
+static int icc_rename_tag_busy(icc *p, icTagSignature sig, icTagSignature sigNew) {
+    int rv;
 
-    ICC V4 Lab encoding should be used in all PCS encodings in
-    all other situations, and can be used for Lab encoding in
-    device spaces for all other situtaions.
+    icc_mem_enter(p);
+    rv = icc_rename_tag(p, sig, sigNew);
+    icc_mem_leave(p, -1);
+    return rv;
+}
 
-    [ Since the ICC spec. doesn't cover device spaces labeled as Lab,
-      these are ripe for mis-matches between different implementations.]
+static int icc_unread_tag_busy(icc *p, icTagSignature sig) {
+    int rv;
 
-    This logic has yet to be fully implemented here.
-*/
+    icc_mem_enter(p);
+    rv = icc_unread_tag(p, sig);
+    icc_mem_leave(p, -1);
+    return rv;
+}
 
-/* Find appropriate conversion functions from the normalised */
-/* Lut data range 0.0 - 1.0 to/from a given colorspace value, */
-/* given the color space and Lut type. */
-/* Return 0 on success, 1 on match failure. */
-/* NOTE: doesn't set error value, message etc.! */
-static int getNormFunc(
-    icc *icp,
-//    icProfileClassSignature psig,        /* Profile signature to use */
-    icColorSpaceSignature   csig,         /* Colorspace to use. */
-//  int                     lutin,        /* 0 if this is for a icSigLut16Type input, nz for output */
-//    icTagSignature          tagSig,        /* Tag signature involved (AtoB or B2A etc.) */
-    icTagTypeSignature      tagType,    /* icSigLut8Type or icSigLut16Type or V4 lut */
-    icmNormFlag             flag,        /* icmFromLuti, icmFromLutv or icmToLuti, icmToLutv */
-    void                 (**nfunc)(double *out, double *in)
+static int icc_delete_tag_busy(icc *p, icTagSignature sig) {
+    int rv;
+
+    icc_mem_enter(p);
+    rv = icc_delete_tag(p, sig);
+    icc_mem_leave(p, -1);
+    return rv;
+}
+
+static void icc_delete(
+    icc *p
 ) {
-    int i;
-    if (tagType == icSigLut8Type && csig == icSigLabData) {
-        csig = icmSigLab8Data;
-    }
-    if (csig == icSigLabData) {
-        if (tagType == icSigLut16Type)    /* Lut16 retains legacy encoding */
-            csig = icmSigLabV2Data;
-        else {                            /* Other tag types use version specific encoding */
-            if (icp->ver)
-                csig = icmSigLabV4Data;
-            else
-                csig = icmSigLabV2Data;
+    unsigned int i;
+    icmAlloc *al = p->al;
+    icmAlloc *bal = ((icmAllocAcct *)p->al)->base;
+    int del_al   = p->del_al;
+
+    /* Stop the budget unloading our tags */
+    icc_mem_unregister(p);
+
+    /* Free up the memoised lookup objects */
+    icc_flush_lucache(p);
+    if (p->lucache != NULL)
+        al->free(al, p->lucache);
+
+    /* Free up the header */
+    if (p->header != NULL)
+        (p->header->del)(p->header);
+
+    /* Free up the tag data objects */
+    if (p->data != NULL) {
+        for (i = 0; i < p->count; i++) {
+            if (p->data[i].objp != NULL) {
+                if (--(p->data[i].objp->refcount) == 0)    /* decrement reference count */
+                    (p->data[i].objp->del)(p->data[i].objp);    /* Last reference */
+                    p->data[i].objp = NULL;
+            }
         }
+        /* Free tag table */
+        al->free(al, p->data);
     }
 
-    for (i = 0; colnormtable[i].csig != icMaxEnumData; i++) {
-        if (colnormtable[i].csig == csig)
-            break;    /* Found it */
-    }
-    if (colnormtable[i].csig == icMaxEnumData) {    /* Oops */
-        *nfunc   = NULL;
-        return 1;
-    }
+    /* We are responsible for deleting the file object */
+    if (p->del_fp && p->fp != NULL)
+        p->fp->del(p->fp);
 
-    if (flag == icmFromLuti || flag == icmFromLutv) {    /* Table index/value decoding functions */
-        *nfunc = colnormtable[i].fromLut;
-        return 0;
-    } else if (flag == icmToLuti || flag == icmToLutv) {    /* Table index/value encoding functions */
-        *nfunc = colnormtable[i].toLut;
-        return 0;
-    }
-    *nfunc   = NULL;
-    return 1;
+    /* This object */
+    al->del(al);
+    bal->free(bal, p);
+
+    if (del_al)            /* We are responsible for deleting allocator */
+        bal->del(bal);
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Colorspace ranges - used instead of norm/denorm by Mono, Matrix and */
-/* override PCS */
+/* ================================================== */
+/* Lut Color normalizing and de-normalizing functions */
 
-/* Function table - match ranges to color spaces. */
-/* Anything not here, we don't know how to convert. */
-/* (ie. YCbCr) */
-/* Hmm. we're not handling Lab8 properly ?? ~~~8888 */
-static struct {
-    icColorSpaceSignature csig;
-    int same;                /* Non zero if first entry applies to all channels */
-    double min[3];            /* Minimum value for this colorspace */
-    double max[3];            /* Maximum value for this colorspace */
-} colorrangetable[] = {
-    {icSigXYZData,     1, { 0.0 } , { 1.0 + 32767.0/32768.0 } },
-    {icmSigLab8Data,   0, { 0.0, -128.0, -128.0 }, { 100.0, 127.0,  127.0 } }, 
-    {icmSigLabV2Data,  0, { 0.0, -128.0, -128.0 },
-                          { 100.0 + 25500.0/65280.0, 127.0 + 255.0/256.0, 127.0 + 255.0/256.0 } }, 
-    {icmSigLabV4Data,  0, { 0.0, -128.0, -128.0 }, { 100.0, 127.0,  127.0 } }, 
-    {icmSigYData,      1, { 0.0 }, { 1.0 + 32767.0/32768.0 } },
-    {icmSigL8Data,     1, { 0.0 }, { 100.0 } }, 
-    {icmSigLV2Data,    1, { 0.0 }, { 100.0 + 25500.0/65280.0 } }, 
-    {icmSigLV4Data,    1, { 0.0 }, { 100.0 } }, 
-    {icSigLuvData,     0, { 0.0, -128.0, -128.0 },
-                          { 100.0, 127.0 + 255.0/256.0, 127.0 + 255.0/256.0 } },
-    {icSigYCbCrData,   1, { 0.0 }, { 1.0 } },            /* ??? */
-    {icSigYxyData,     1, { 0.0 }, { 1.0 } },            /* ??? */
-    {icSigRgbData,     1, { 0.0 }, { 1.0 } },
-    {icSigGrayData,    1, { 0.0 }, { 1.0 } },
-    {icSigHsvData,     1, { 0.0 }, { 1.0 } },
-    {icSigHlsData,     1, { 0.0 }, { 1.0 } },
-    {icSigCmykData,    1, { 0.0 }, { 1.0 } },
-    {icSigCmyData,     1, { 0.0 }, { 1.0 } },
-    {icSigMch6Data,    1, { 0.0 }, { 1.0 } },
-    {icSig2colorData,  1, { 0.0 }, { 1.0 } },
-    {icSig3colorData,  1, { 0.0 }, { 1.0 } },
-    {icSig4colorData,  1, { 0.0 }, { 1.0 } },
-    {icSig5colorData,  1, { 0.0 }, { 1.0 } },
-    {icSig6colorData,  1, { 0.0 }, { 1.0 } },
-    {icSig7colorData,  1, { 0.0 }, { 1.0 } },
-    {icSig8colorData,  1, { 0.0 }, { 1.0 } },
-    {icSigMch5Data,    1, { 0.0 }, { 1.0 } },
-    {icSigMch6Data,    1, { 0.0 }, { 1.0 } },
-    {icSigMch7Data,    1, { 0.0 }, { 1.0 } },
-    {icSigMch8Data,    1, { 0.0 }, { 1.0 } },
-    {icSig9colorData,  1, { 0.0 }, { 1.0 } },
-    {icSig10colorData, 1, { 0.0 }, { 1.0 } },
-    {icSig11colorData, 1, { 0.0 }, { 1.0 } },
-    {icSig12colorData, 1, { 0.0 }, { 1.0 } },
-    {icSig13colorData, 1, { 0.0 }, { 1.0 } },
-    {icSig14colorData, 1, { 0.0 }, { 1.0 } },
-    {icSig15colorData, 1, { 0.0 }, { 1.0 } },
-    {icMaxEnumData,    1, { 0.0 }, { 1.0 } }
-};
-    
-/* Find appropriate typical encoding ranges for a */
-/* colorspace given the color space. */
-/* Return 0 on success, 1 on match failure */
-static int getRange(
-    icc *icp,
-//    icProfileClassSignature psig,        /* Profile signature to use */
-    icColorSpaceSignature   csig,         /* Colorspace to use. */
-//  int                     lutin,        /* 0 if this is for a icSigLut16Type input, nz for output */
-//    icTagSignature          tagSig,        /* Tag signature involved (AtoB or B2A etc.) */
-    icTagTypeSignature      tagType,    /* icSigLut8Type or icSigLut16Type or V4 lut */
-    double *min, double *max            /* Return range values */
-) {
-    int i, e, ee;
+/* As a rule, I am representing Lut in memory as values in machine form as real */
+/* numbers in the range 0.0 - 1.0. For many color spaces (ie. RGB, Gray, */
+/* hsv, hls, cmyk and other device coords), this is entirely appropriate. */
+/* For CIE based spaces though, this is not correct, since (I assume!) the binary */
+/* representation will be consistent with the encoding in Annex A, page 74 */
+/* of the standard. Note that the standard doesn't specify the encoding of */
+/* many color spaces (ie. Yuv, Yxy etc.), and is unclear about PCS. */
 
-    if (tagType == icSigLut8Type && csig == icSigLabData) {
-        csig = icmSigLab8Data;
-    }
-    if (csig == icSigLabData) {
-        if (tagType == icSigLut16Type)    /* Lut16 retains legacy encoding */
-            csig = icmSigLabV2Data;
-        else {                            /* Other tag types use version specific encoding */
-            if (icp->ver)
-                csig = icmSigLabV4Data;
-            else
-                csig = icmSigLabV2Data;
-        }
-    }
-
-    for (i = 0; colorrangetable[i].csig != icMaxEnumData; i++) {
-        if (colorrangetable[i].csig == csig)
-            break;    /* Found it */
-    }
-    if (colorrangetable[i].csig == icMaxEnumData) {    /* Oops */
-        return 1;
-    }
-    ee = number_ColorSpaceSignature(csig);        /* Get number of components */
+/* The following functions convert to and from the CIE base spaces */
+/* and the real Lut input/output values. These are used to convert real color */
+/* space values into/out of the raw lut 0.0-1.0 representation (which subsequently */
+/* get converted to ICC integer values in the obvious way as a mapping to 0 .. 2^n-1). */
 
-    if (colorrangetable[i].same) {        /* All channels are the same */
-        for (e = 0; e < ee; e++) {
-            if (min != NULL)
-                min[e] = colorrangetable[i].min[0];
-            if (max != NULL)
-                max[e] = colorrangetable[i].max[0];
-        }
-    } else {
-        for (e = 0; e < ee; e++) {
-            if (min != NULL)
-                min[e] = colorrangetable[i].min[e];
-            if (max != NULL)
-                max[e] = colorrangetable[i].max[e];
-        }
-    }
-    return 0;
-}
+/* This is used internally to support the Lut->lookup() function, */
+/* and can also be used by someone writing a Lut based profile to determine */
+/* the colorspace range that the input lut indexes cover, as well */
+/* as processing the output luts values into normalized form ready */
+/* for writing. */
 
-/* ============================================= */
-/* Misc. support functions.                      */
+/* These functions should be accessed by calling icc.getNormFuncs() */ 
 
+/* - - - - - - - - - - - - - - - - */
+/* According to 6.5.5 and 6.5.6 of the spec., */
+/* XYZ index values are represented the same as their table */
+/* values, ie. as a u1.15 representation, with a value */
+/* range from 0.0 ->  1.999969482422 */
 
-/* Add two 3 vectors */
-void icmAdd3(double out[3], double in1[3], double in2[3]) {
-    out[0] = in1[0] + in2[0];
-    out[1] = in1[1] + in2[1];
-    out[2] = in1[2] + in2[2];
+/* Convert Lut index/value to XYZ coord. */ 
+static void Lut_Lut2XYZ(double *out, double *in) {
+    out[0] = in[0] * (1.0 + 32767.0/32768); /* X */
+    out[1] = in[1] * (1.0 + 32767.0/32768); /* Y */
+    out[2] = in[2] * (1.0 + 32767.0/32768); /* Z */
 }
 
-/* Subtract two 3 vectors, out = in1 - in2 */
-void icmSub3(double out[3], double in1[3], double in2[3]) {
-    out[0] = in1[0] - in2[0];
-    out[1] = in1[1] - in2[1];
-    out[2] = in1[2] - in2[2];
+/* Convert XYZ coord to Lut index/value. */ 
+static void Lut_XYZ2Lut(double *out, double *in) {
+    out[0] = in[0] * (1.0/(1.0 + 32767.0/32768));
+    out[1] = in[1] * (1.0/(1.0 + 32767.0/32768));
+    out[2] = in[2] * (1.0/(1.0 + 32767.0/32768));
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Convert Lut index/value to Y coord. */ 
+static void Lut_Lut2Y(double *out, double *in) {
+    out[0] = in[0] * (1.0 + 32767.0/32768); /* Y */
+}
 
-/* Set a 3x3 matrix to unity */
-void icmSetUnity3x3(double mat[3][3]) {
-    int i, j;
-    for (j = 0; j < 3; j++) {
-        for (i = 0; i < 3; i++) {
-            if (i == j)
-                mat[j][i] = 1.0;
-            else
-                mat[j][i] = 0.0;
-        }
-    }
-    
+/* Convert Y coord to Lut index/value. */ 
+static void Lut_Y2Lut(double *out, double *in) {
+    out[0] = in[0] * (1.0/(1.0 + 32767.0/32768));
 }
 
-/* Copy a 3x3 transform matrix */
-void icmCpy3x3(double dst[3][3], double src[3][3]) {
-    int i, j;
+/* - - - - - - - - - - - - - - - - */
+/* Convert 8 bit Lab to Lut numbers */
+/* Annex A specifies 8 and 16 bit encoding, but is */
+/* silent on the Lut index normalization. */
+/* Following Michael Bourgoin's 1998 SIGGRAPH course comment on this, */
+/* we assume here that the index encoding is the same as the */
+/* value encoding. */
 
-    for (j = 0; j < 3; j++) {
-        for (i = 0; i < 3; i++)
-            dst[j][i] = src[j][i];
-    }
+/* Convert Lut8 table index/value to Lab */
+static void Lut_Lut2Lab_8(double *out, double *in) {
+    out[0] = in[0] * 100.0;                /* L */
+    out[1] = (in[1] * 255.0) - 128.0;    /* a */
+    out[2] = (in[2] * 255.0) - 128.0;    /* b */
 }
 
-/* Scale each element of a 3x3 transform matrix */
-void icmScale3x3(double dst[3][3], double src[3][3], double scale) {
-    int i, j;
+/* Convert Lab to Lut8 table index/value */
+static void Lut_Lab2Lut_8(double *out, double *in) {
+    out[0] = in[0] * 1.0/100.0;                /* L */
+    out[1] = (in[1] + 128.0) * 1.0/255.0;    /* a */
+    out[2] = (in[2] + 128.0) * 1.0/255.0;    /* b */
+}
 
-    for (j = 0; j < 3; j++) {
-        for (i = 0; i < 3; i++)
-            dst[j][i] = src[j][i] * scale;
-    }
+/* Convert Lut8 table index/value to L */
+static void Lut_Lut2L_8(double *out, double *in) {
+    out[0] = in[0] * 100.0;                /* L */
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Convert L to Lut8 table index/value */
+static void Lut_L2Lut_8(double *out, double *in) {
+    out[0] = in[0] * 1.0/100.0;                /* L */
+}
 
-/* 
+/* - - - - - - - - - - - - - - - - */
+/* Convert 16 bit Lab to Lut numbers, V2 */
 
-  mat     in    out
+/* Convert Lut16 table index/value to Lab */
+static void Lut_Lut2LabV2_16(double *out, double *in) {
+    out[0] = in[0] * (100.0 * 65535.0)/65280.0;            /* L */
+    out[1] = (in[1] * (255.0 * 65535.0)/65280) - 128.0;    /* a */
+    out[2] = (in[2] * (255.0 * 65535.0)/65280) - 128.0;    /* b */
+}
 
-[     ]   []    []
-[     ] * [] => []
-[     ]   []    []
+/* Convert Lab to Lut16 table index/value */
+static void Lut_Lab2LutV2_16(double *out, double *in) {
+    out[0] = in[0] * 65280.0/(100.0 * 65535.0);                /* L */
+    out[1] = (in[1] + 128.0) * 65280.0/(255.0 * 65535.0);    /* a */
+    out[2] = (in[2] + 128.0) * 65280.0/(255.0 * 65535.0);    /* b */
+}
 
- */
+/* Convert Lut16 table index/value to L */
+static void Lut_Lut2LV2_16(double *out, double *in) {
+    out[0] = in[0] * (100.0 * 65535.0)/65280.0;            /* L */
+}
 
-/* Multiply 3 array by 3x3 transform matrix */
-void icmMulBy3x3(double out[3], double mat[3][3], double in[3]) {
-    double tt[3];
+/* Convert Lab to Lut16 table index/value */
+static void Lut_L2LutV2_16(double *out, double *in) {
+    out[0] = in[0] * 65280.0/(100.0 * 65535.0);                /* L */
+}
 
-    tt[0] = mat[0][0] * in[0] + mat[0][1] * in[1] + mat[0][2] * in[2];
-    tt[1] = mat[1][0] * in[0] + mat[1][1] * in[1] + mat[1][2] * in[2];
-    tt[2] = mat[2][0] * in[0] + mat[2][1] * in[1] + mat[2][2] * in[2];
+/* - - - - - - - - - - - - - - - - */
+/* Convert 16 bit Lab to Lut numbers, V4 */
 
-    out[0] = tt[0];
-    out[1] = tt[1];
-    out[2] = tt[2];
+/* Convert Lut16 table index/value to Lab */
+static void Lut_Lut2LabV4_16(double *out, double *in) {
+    out[0] = in[0] * 100.0;                /* L */
+    out[1] = (in[1] * 255.0) - 128.0;    /* a */
+    out[2] = (in[2] * 255.0) - 128.0;    /* b */
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Add one 3x3 to another */
-/* dst = src1 + src2 */
-void icmAdd3x3(double dst[3][3], double src1[3][3], double src2[3][3]) {
-    int i, j;
-
-    for (j = 0; j < 3; j++) {
-        for (i = 0; i < 3; i++)
-            dst[j][i] = src1[j][i] + src2[j][i];
-    }
+/* Convert Lab to Lut16 table index/value */
+static void Lut_Lab2LutV4_16(double *out, double *in) {
+    out[0] = in[0] * 1.0/100.0;                /* L */
+    out[1] = (in[1] + 128.0) * 1.0/255.0;    /* a */
+    out[2] = (in[2] + 128.0) * 1.0/255.0;    /* b */
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Tensor product. Multiply two 3 vectors to form a 3x3 matrix */
-/* src1[] forms the colums, and src2[] forms the rows in the result */
-void icmTensMul3(double dst[3][3], double src1[3], double src2[3]) {
-    int i, j;
-    
-    for (j = 0; j < 3; j++) {
-        for (i = 0; i < 3; i++)
-            dst[j][i] = src1[j] * src2[i];
-    }
+/* Convert Lut16 table index/value to L */
+static void Lut_Lut2LV4_16(double *out, double *in) {
+    out[0] = in[0] * 100.0;                /* L */
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Convert L to Lut16 table index/value */
+static void Lut_L2LutV4_16(double *out, double *in) {
+    out[0] = in[0] * 1.0/100.0;                /* L */
+}
 
-/* Multiply one 3x3 with another */
-/* dst = src * dst */
-void icmMul3x3(double dst[3][3], double src[3][3]) {
-    int i, j, k;
-    double td[3][3];        /* Temporary dest */
+/* - - - - - - - - - - - - - - - - */
+/* Convert Luv to Lut number */
+/* This data normalization is taken from Apples */
+/* Colorsync specification. */
+/* As per other color spaces, we assume that the index */
+/* normalization is the same as the data normalization. */
 
-    for (j = 0; j < 3; j++) {
-        for (i = 0; i < 3; i++) {
-            double tt = 0.0;
-            for (k = 0; k < 3; k++)
-                tt += src[j][k] * dst[k][i];
-            td[j][i] = tt;
-        }
-    }
+/* Convert Lut table index/value to Luv */
+static void Lut_Lut2Luv(double *out, double *in) {
+    out[0] = in[0] * 100.0;                        /* L */
+    out[1] = (in[1] * 65535.0/256.0) - 128.0;    /* u */
+    out[2] = (in[2] * 65535.0/256.0) - 128.0;    /* v */
+}
 
-    /* Copy result out */
-    for (j = 0; j < 3; j++)
-        for (i = 0; i < 3; i++)
-            dst[j][i] = td[j][i];
+/* Convert Luv to Lut table index/value */
+static void Lut_Luv2Lut(double *out, double *in) {
+    out[0] = in[0] * 1.0/100.0;                    /* L */
+    out[1] = (in[1] + 128.0) * 256.0/65535.0;    /* u */
+    out[2] = (in[2] + 128.0) * 256.0/65535.0;    /* v */
 }
 
-/* Multiply one 3x3 with another #2 */
-/* dst = src1 * src2 */
-void icmMul3x3_2(double dst[3][3], double src1[3][3], double src2[3][3]) {
-    int i, j, k;
-    double td[3][3];        /* Temporary dest */
+/* - - - - - - - - - - - - - - - - */
+/* Default N component conversions */
+static void Lut_N(double *out, double *in, int nc) {
+    for (--nc; nc >= 0; nc--)
+        out[nc] = in[nc];
+}
 
-    for (j = 0; j < 3; j++) {
-        for (i = 0; i < 3; i++) {
-            double tt = 0.0;
-            for (k = 0; k < 3; k++)
-                tt += src1[j][k] * src2[k][i];
-            td[j][i] = tt;
-        }
-    }
-
-    /* Copy result out */
-    for (j = 0; j < 3; j++)
-        for (i = 0; i < 3; i++)
-            dst[j][i] = td[j][i];
+/* 1 */
+static void Lut_1(double *out, double *in) {
+    out[0] = in[0];
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* 
-    Matrix Inversion
-    by Richard Carling
-    from "Graphics Gems", Academic Press, 1990
-*/
-
-/* 
- *   adjoint( original_matrix, inverse_matrix )
- * 
- *     calculate the adjoint of a 3x3 matrix
- *
- *      Let  a   denote the minor determinant of matrix A obtained by
- *           ij
- *
- *      deleting the ith row and jth column from A.
- *
- *                    i+j
- *     Let  b   = (-1)    a
- *          ij            ji
- *
- *    The matrix B = (b  ) is the adjoint of A
- *                     ij
- */
-
-#define det2x2(a, b, c, d) (a * d - b * c)
-
-static void adjoint(
-double out[3][3],
-double in[3][3]
-) {
-    double a1, a2, a3, b1, b2, b3, c1, c2, c3;
-
-    /* assign to individual variable names to aid  */
-    /* selecting correct values  */
-
-    a1 = in[0][0]; b1 = in[0][1]; c1 = in[0][2];
-    a2 = in[1][0]; b2 = in[1][1]; c2 = in[1][2];
-    a3 = in[2][0]; b3 = in[2][1]; c3 = in[2][2];
-
-    /* row column labeling reversed since we transpose rows & columns */
-
-    out[0][0]  =   det2x2(b2, b3, c2, c3);
-    out[1][0]  = - det2x2(a2, a3, c2, c3);
-    out[2][0]  =   det2x2(a2, a3, b2, b3);
-        
-    out[0][1]  = - det2x2(b1, b3, c1, c3);
-    out[1][1]  =   det2x2(a1, a3, c1, c3);
-    out[2][1]  = - det2x2(a1, a3, b1, b3);
-        
-    out[0][2]  =   det2x2(b1, b2, c1, c2);
-    out[1][2]  = - det2x2(a1, a2, c1, c2);
-    out[2][2]  =   det2x2(a1, a2, b1, b2);
+/* 2 */
+static void Lut_2(double *out, double *in) {
+    out[0] = in[0];
+    out[1] = in[1];
 }
 
-/*
- * double = icmDet3x3(  a1, a2, a3, b1, b2, b3, c1, c2, c3 )
- * 
- * calculate the determinant of a 3x3 matrix
- * in the form
- *
- *     | a1,  b1,  c1 |
- *     | a2,  b2,  c2 |
- *     | a3,  b3,  c3 |
- */
-
-double icmDet3x3(double in[3][3]) {
-    double a1, a2, a3, b1, b2, b3, c1, c2, c3;
-    double ans;
-
-    a1 = in[0][0]; b1 = in[0][1]; c1 = in[0][2];
-    a2 = in[1][0]; b2 = in[1][1]; c2 = in[1][2];
-    a3 = in[2][0]; b3 = in[2][1]; c3 = in[2][2];
-
-    ans = a1 * det2x2(b2, b3, c2, c3)
-        - b1 * det2x2(a2, a3, c2, c3)
-        + c1 * det2x2(a2, a3, b2, b3);
-    return ans;
+/* 3 */
+static void Lut_3(double *out, double *in) {
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
 }
 
-#define ICM_SMALL_NUMBER    1.e-8
-/* 
- *   inverse( original_matrix, inverse_matrix )
- * 
- *    calculate the inverse of a 4x4 matrix
- *
- *     -1     
- *     A  = ___1__ adjoint A
- *         det A
- */
-
-/* Return non-zero if not invertable */
-int icmInverse3x3(
-double out[3][3],
-double in[3][3]
-) {
-    int i, j;
-    double det;
-
-    /*  calculate the 3x3 determinant
-     *  if the determinant is zero, 
-     *  then the inverse matrix is not unique.
-     */
-    det = icmDet3x3(in);
-
-    if ( fabs(det) < ICM_SMALL_NUMBER)
-        return 1;
+/* 4 */
+static void Lut_4(double *out, double *in) {
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
+    out[3] = in[3];
+}
 
-    /* calculate the adjoint matrix */
-    adjoint(out, in);
+/* 5 */
+static void Lut_5(double *out, double *in) {
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
+    out[3] = in[3];
+    out[4] = in[4];
+}
 
-    /* scale the adjoint matrix to get the inverse */
-    for (i = 0; i < 3; i++)
-        for(j = 0; j < 3; j++)
-            out[i][j] /= det;
-    return 0;
+/* 6 */
+static void Lut_6(double *out, double *in) {
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
+    out[3] = in[3];
+    out[4] = in[4];
+    out[5] = in[5];
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Transpose a 3x3 matrix */
-void icmTranspose3x3(double out[3][3], double in[3][3]) {
-    int i, j;
-    if (out != in) {
-        for (i = 0; i < 3; i++)
-            for (j = 0; j < 3; j++)
-                out[i][j] = in[j][i];
-    } else {
-        double tt[3][3];
-        for (i = 0; i < 3; i++)
-            for (j = 0; j < 3; j++)
-                tt[i][j] = in[j][i];
-        for (i = 0; i < 3; i++)
-            for (j = 0; j < 3; j++)
-                out[i][j] = tt[i][j];
-    }
+/* 7 */
+static void Lut_7(double *out, double *in) {
+    Lut_N(out, in, 7);
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Compute the dot product of two 3 vectors */
-double icmDot3(double in1[3], double in2[3]) {
-    return in1[0] * in2[0] + in1[1] * in2[1] + in1[2] * in2[2];
+/* 8 */
+static void Lut_8(double *out, double *in) {
+    Lut_N(out, in, 8);
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Compute the cross product of two 3D vectors, out = in1 x in2 */
-void icmCross3(double out[3], double in1[3], double in2[3]) {
-    double tt[3];
-    tt[0] = (in1[1] * in2[2]) - (in1[2] * in2[1]);
-    tt[1] = (in1[2] * in2[0]) - (in1[0] * in2[2]);
-    tt[2] = (in1[0] * in2[1]) - (in1[1] * in2[0]);
-    out[0] = tt[0];
-    out[1] = tt[1];
-    out[2] = tt[2];
+/* 9 */
+static void Lut_9(double *out, double *in) {
+    Lut_N(out, in, 9);
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Compute the norm (length) squared of a 3 vector */
-double icmNorm3sq(double in[3]) {
-    return in[0] * in[0] + in[1] * in[1] + in[2] * in[2];
+/* 10 */
+static void Lut_10(double *out, double *in) {
+    Lut_N(out, in, 10);
 }
 
-/* Compute the norm (length) of a 3 vector */
-double icmNorm3(double in[3]) {
-    return sqrt(in[0] * in[0] + in[1] * in[1] + in[2] * in[2]);
+/* 11 */
+static void Lut_11(double *out, double *in) {
+    Lut_N(out, in, 11);
 }
 
-/* Scale a 3 vector by the given ratio */
-void icmScale3(double out[3], double in[3], double rat) {
-    out[0] = in[0] * rat;
-    out[1] = in[1] * rat;
-    out[2] = in[2] * rat;
+/* 12 */
+static void Lut_12(double *out, double *in) {
+    Lut_N(out, in, 12);
 }
 
-/* Compute a blend between in0 and in1 */
-void icmBlend3(double out[3], double in0[3], double in1[3], double bf) {
-    out[0] = (1.0 - bf) * in0[0] + bf * in1[0];
-    out[1] = (1.0 - bf) * in0[1] + bf * in1[1];
-    out[2] = (1.0 - bf) * in0[2] + bf * in1[2];
+/* 13 */
+static void Lut_13(double *out, double *in) {
+    Lut_N(out, in, 13);
 }
 
-/* Normalise a 3 vector to the given length. Return nz if not normalisable */
-int icmNormalize3(double out[3], double in[3], double len) {
-    double tt = sqrt(in[0] * in[0] + in[1] * in[1] + in[2] * in[2]);
-    
-    if (tt < ICM_SMALL_NUMBER)
-        return 1;
-    tt = len/tt;
-    out[0] = in[0] * tt;
-    out[1] = in[1] * tt;
-    out[2] = in[2] * tt;
-    return 0;
+/* 14 */
+static void Lut_14(double *out, double *in) {
+    Lut_N(out, in, 14);
 }
 
-/* Compute the norm (length) squared of a vector define by two points */
-double icmNorm33sq(double in1[3], double in0[3]) {
-    int j;
-    double rv;
-    for (rv = 0.0, j = 0; j < 3; j++) {
-        double tt = in1[j] - in0[j];
-        rv += tt * tt;
-    }
-    return rv;
+/* 15 */
+static void Lut_15(double *out, double *in) {
+    Lut_N(out, in, 15);
 }
 
-/* Compute the norm (length) of a vector define by two points */
-double icmNorm33(double in1[3], double in0[3]) {
-    int j;
-    double rv;
-    for (rv = 0.0, j = 0; j < 3; j++) {
-        double tt = in1[j] - in0[j];
-        rv += tt * tt;
-    }
-    return sqrt(rv);
-}
-
-/* Scale a two point vector by the given ratio. in0[] is the origin */
-void icmScale33(double out[3], double in1[3], double in0[3], double rat) {
-    out[0] = in0[0] + (in1[0] - in0[0]) * rat;
-    out[1] = in0[1] + (in1[1] - in0[1]) * rat;
-    out[2] = in0[2] + (in1[2] - in0[2]) * rat;
-}
-
-/* Normalise a two point vector to the given length. */
-/* The new location of in1[] is returned in out[]. */
-/* Return nz if not normalisable */
-int icmNormalize33(double out[3], double in1[3], double in0[3], double len) {
-    int j;
-    double vl;
-
-    for (vl = 0.0, j = 0; j < 3; j++) {
-        double tt = in1[j] - in0[j];
-        vl += tt * tt;
-    }
-    vl = sqrt(vl);
-    if (vl < ICM_SMALL_NUMBER)
-        return 1;
+/* Function table - match conversions to color spaces. */
+/* Anything not here, we don't know how to convert. */
+/* (ie. YCbCr) */
+static struct {
+    icColorSpaceSignature csig;
+    void (*fromLut)(double *out, double *in);    /* from Lut index/entry */
+    void (*toLut)(double *out, double *in);        /* to Lut index/entry */
+} colnormtable[] = {
+    {icSigXYZData,     Lut_Lut2XYZ,      Lut_XYZ2Lut },
+    {icmSigYData,      Lut_Lut2Y,        Lut_Y2Lut },
+    {icmSigLab8Data,   Lut_Lut2Lab_8,    Lut_Lab2Lut_8 },
+    {icmSigLabV2Data,  Lut_Lut2LabV2_16, Lut_Lab2LutV2_16 },
+    {icmSigLabV4Data,  Lut_Lut2LabV4_16, Lut_Lab2LutV4_16 },
+    {icmSigL8Data,     Lut_Lut2L_8,      Lut_L2Lut_8 },
+    {icmSigLV2Data,    Lut_Lut2LV2_16,   Lut_L2LutV2_16 },
+    {icmSigLV4Data,    Lut_Lut2LV4_16,   Lut_L2LutV4_16 },
+    {icSigLuvData,     Lut_Lut2Luv,      Lut_Luv2Lut },
+    {icSigYxyData,     Lut_3,            Lut_3 },
+    {icSigRgbData,     Lut_3,            Lut_3 },
+    {icSigGrayData,    Lut_1,            Lut_1 },
+    {icSigHsvData,     Lut_3,            Lut_3 },
+    {icSigHlsData,     Lut_3,            Lut_3 },
+    {icSigCmykData,    Lut_4,            Lut_4 },
+    {icSigCmyData,     Lut_3,            Lut_3 },
+    {icSigMch6Data,    Lut_6,            Lut_6 },
+    {icSig2colorData,  Lut_2,            Lut_2 },
+    {icSig3colorData,  Lut_3,            Lut_3 },
+    {icSig4colorData,  Lut_4,            Lut_4 },
+    {icSig5colorData,  Lut_5,            Lut_5 },
+    {icSig6colorData,  Lut_6,            Lut_6 },
+    {icSig7colorData,  Lut_7,            Lut_7 },
+    {icSigMch5Data,    Lut_5,            Lut_5 },
+    {icSigMch6Data,    Lut_6,            Lut_6 },
+    {icSigMch7Data,    Lut_7,            Lut_7 },
+    {icSigMch8Data,    Lut_8,            Lut_8 },
+    {icSig8colorData,  Lut_8,            Lut_8 },
+    {icSig9colorData,  Lut_9,            Lut_9 },
+    {icSig10colorData, Lut_10,           Lut_10 },
+    {icSig11colorData, Lut_11,           Lut_11 },
+    {icSig12colorData, Lut_12,           Lut_12 },
+    {icSig13colorData, Lut_13,           Lut_13 },
+    {icSig14colorData, Lut_14,           Lut_14 },
+    {icSig15colorData, Lut_15,           Lut_15 },
+    {icMaxEnumData,    NULL,             NULL   }
+};
     
-    vl = len/vl;
-    for (j = 0; j < 3; j++) {
-        out[j] = in0[j] + (in1[j] - in0[j]) * vl;
-    }
-    return 0;
-}
-
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Given two 3D points, create a matrix that rotates */
-/* and scales one onto the other about the origin 0,0,0. */
-/* The maths is from page 52 of Tomas Moller and Eric Haines "Real-Time Rendering". */
-/* s is source vector, t is target vector. */
-/* Usage of icmRotMat: */
-/*    t[0] == mat[0][0] * s[0] + mat[0][1] * s[1] + mat[0][2] * s[2]; */
-/*    t[1] == mat[1][0] * s[0] + mat[1][1] * s[1] + mat[1][2] * s[2]; */
-/*    t[2] == mat[2][0] * s[0] + mat[2][1] * s[1] + mat[2][2] * s[2]; */
-/* i.e. use icmMulBy3x3 */
-void icmRotMat(double m[3][3], double s[3], double t[3]) {
-    double sl, tl, sn[3], tn[3];
-    double v[3];        /* Cross product */
-    double e;            /* Dot product */
-    double h;            /* 1-e/Cross product dot squared */
-
-    /* Normalise input vectors */
-    /* The rotation will be about 0,0,0 */
-    sl = sqrt(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
-    tl = sqrt(t[0] * t[0] + t[1] * t[1] + t[2] * t[2]);
-
-    if (sl < 1e-12 || tl < 1e-12) {    /* Hmm. Do nothing */
-        m[0][0] = 1.0;
-        m[0][1] = 0.0;
-        m[0][2] = 0.0;
-        m[1][0] = 0.0;
-        m[1][1] = 1.0;
-        m[1][2] = 0.0;
-        m[2][0] = 0.0;
-        m[2][1] = 0.0;
-        m[2][2] = 1.0;
-        return;
-    }
+/*
+    Legacy Lab encoding:
 
-    sn[0] = s[0]/sl; sn[1] = s[1]/sl; sn[2] = s[2]/sl;
-    tn[0] = t[0]/tl; tn[1] = t[1]/tl; tn[2] = t[2]/tl;
+    The V4 specificatins are misleading on this, since they assume in this
+    instance that all devices spaces, however labeled, have no defined
+    ICC encoding. The end result is simple enough though:
 
-    /* Compute the cross product */
-    v[0] = (sn[1] * tn[2]) - (sn[2] * tn[1]);
-    v[1] = (sn[2] * tn[0]) - (sn[0] * tn[2]);
-    v[2] = (sn[0] * tn[1]) - (sn[1] * tn[0]);
+    ICC V2 Lab encoding should be used in all PCS encodings in
+    a icSigLut16Type or icSigNamedColor2Type tag, and can be used
+    for Lab encoding in device spaces for these tags.
 
-    /* Compute the dot product */
-    e = sn[0] * tn[0] + sn[1] * tn[1] + sn[2] * tn[2];
+    ICC V4 Lab encoding should be used in all PCS encodings in
+    all other situations, and can be used for Lab encoding in
+    device spaces for all other situtaions.
 
-    /* Cross product dot squared */
-    h = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+    [ Since the ICC spec. doesn't cover device spaces labeled as Lab,
+      these are ripe for mis-matches between different implementations.]
 
-    /* If the two input vectors are close to being parallel, */
-    /* then h will be close to zero. */
-    if (fabs(h) < 1e-12) {
-        m[0][0] = tl/sl;
-        m[0][1] = 0.0;
-        m[0][2] = 0.0;
-        m[1][0] = 0.0;
-        m[1][1] = tl/sl;
-        m[1][2] = 0.0;
-        m[2][0] = 0.0;
-        m[2][1] = 0.0;
-        m[2][2] = tl/sl;
-    } else {
-        /* 1-e/Cross product dot squared */
-        h = (1.0 - e) / h;
+    This logic has yet to be fully implemented here.
+*/
 
-        m[0][0] = tl/sl * (e + h * v[0] * v[0]);
-        m[0][1] = tl/sl * (h * v[0] * v[1] - v[2]);
-        m[0][2] = tl/sl * (h * v[0] * v[2] + v[1]);
-        m[1][0] = tl/sl * (h * v[0] * v[1] + v[2]);
-        m[1][1] = tl/sl * (e + h * v[1] * v[1]);
-        m[1][2] = tl/sl * (h * v[1] * v[2] - v[0]);
-        m[2][0] = tl/sl * (h * v[0] * v[2] - v[1]);
-        m[2][1] = tl/sl * (h * v[1] * v[2] + v[0]);
-        m[2][2] = tl/sl * (e + h * v[2] * v[2]);
+/* Find appropriate conversion functions from the normalised */
+/* Lut data range 0.0 - 1.0 to/from a given colorspace value, */
+/* given the color space and Lut type. */
+/* Return 0 on success, 1 on match failure. */
+/* NOTE: doesn't set error value, message etc.! */
+static int getNormFunc(
+    icc *icp,
+//    icProfileClassSignature psig,        /* Profile signature to use */
+    icColorSpaceSignature   csig,         /* Colorspace to use. */
+//  int                     lutin,        /* 0 if this is for a icSigLut16Type input, nz for output */
+//    icTagSignature          tagSig,        /* Tag signature involved (AtoB or B2A etc.) */
+    icTagTypeSignature      tagType,    /* icSigLut8Type or icSigLut16Type or V4 lut */
+    icmNormFlag             flag,        /* icmFromLuti, icmFromLutv or icmToLuti, icmToLutv */
+    void                 (**nfunc)(double *out, double *in)
+) {
+    int i;
+    if (tagType == icSigLut8Type && csig == icSigLabData) {
+        csig = icmSigLab8Data;
     }
-}
-
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Multiply 2 array by 2x2 transform matrix */
-void icmMulBy2x2(double out[2], double mat[2][2], double in[2]) {
-    double tt[2];
-
-    tt[0] = mat[0][0] * in[0] + mat[0][1] * in[1];
-    tt[1] = mat[1][0] * in[0] + mat[1][1] * in[1];
-
-    out[0] = tt[0];
-    out[1] = tt[1];
-}
-
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-
-/* Copy a 3x4 transform matrix */
-void icmCpy3x4(double dst[3][4], double src[3][4]) {
-    int i, j;
-
-    for (j = 0; j < 3; j++) {
-        for (i = 0; i < 4; i++)
-            dst[j][i] = src[j][i];
+    if (csig == icSigLabData) {
+        if (tagType == icSigLut16Type)    /* Lut16 retains legacy encoding */
+            csig = icmSigLabV2Data;
+        else {                            /* Other tag types use version specific encoding */
+            if (icp->ver)
+                csig = icmSigLabV4Data;
+            else
+                csig = icmSigLabV2Data;
+        }
     }
-}
-
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-
-/* Multiply 3 array by 3x4 transform matrix */
-void icmMul3By3x4(double out[3], double mat[3][4], double in[3]) {
-    double tt[3];
 
-    tt[0] = mat[0][0] * in[0] + mat[0][1] * in[1] + mat[0][2] * in[2] + mat[0][3];
-    tt[1] = mat[1][0] * in[0] + mat[1][1] * in[1] + mat[1][2] * in[2] + mat[1][3];
-    tt[2] = mat[2][0] * in[0] + mat[2][1] * in[1] + mat[2][2] * in[2] + mat[2][3];
+    for (i = 0; colnormtable[i].csig != icMaxEnumData; i++) {
+        if (colnormtable[i].csig == csig)
+            break;    /* Found it */
+    }
+    if (colnormtable[i].csig == icMaxEnumData) {    /* Oops */
+        *nfunc   = NULL;
+        return 1;
+    }
 
-    out[0] = tt[0];
-    out[1] = tt[1];
-    out[2] = tt[2];
+    if (flag == icmFromLuti || flag == icmFromLutv) {    /* Table index/value decoding functions */
+        *nfunc = colnormtable[i].fromLut;
+        return 0;
+    } else if (flag == icmToLuti || flag == icmToLutv) {    /* Table index/value encoding functions */
+        *nfunc = colnormtable[i].toLut;
+        return 0;
+    }
+    *nfunc   = NULL;
+    return 1;
 }
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Given two 3D vectors, create a matrix that translates, */
-/* rotates and scales one onto the other. */
-/* The maths is from page 52 of Tomas Moller and Eric Haines */
-/* "Real-Time Rendering". */
-/* s0 -> s1 is source vector, t0 -> t1 is target vector. */
-/* Usage of icmRotMat: */
-/*    t[0] == mat[0][0] * s[0] + mat[0][1] * s[1] + mat[0][2] * s[2] + mat[0][3]; */
-/*    t[1] == mat[1][0] * s[0] + mat[1][1] * s[1] + mat[1][2] * s[2] + mat[1][3]; */
-/*    t[2] == mat[2][0] * s[0] + mat[2][1] * s[1] + mat[2][2] * s[2] + mat[2][3]; */
-/* i.e. use icmMul3By3x4 */
-void icmVecRotMat(double m[3][4], double s1[3], double s0[3], double t1[3], double t0[3]) {
-    int i, j;
-    double ss[3], tt[3], rr[3][3];
+/* Colorspace ranges - used instead of norm/denorm by Mono, Matrix and */
+/* override PCS */
 
-    /* Create the rotation matrix: */
-    for (i = 0; i < 3; i++) {
-        ss[i] = s1[i] - s0[i];
-        tt[i] = t1[i] - t0[i];
-    }
-    icmRotMat(rr, ss, tt);
+/* Function table - match ranges to color spaces. */
+/* Anything not here, we don't know how to convert. */
+/* (ie. YCbCr) */
+/* Hmm. we're not handling Lab8 properly ?? ~~~8888 */
+static struct {
+    icColorSpaceSignature csig;
+    int same;                /* Non zero if first entry applies to all channels */
+    double min[3];            /* Minimum value for this colorspace */
+    double max[3];            /* Maximum value for this colorspace */
+} colorrangetable[] = {
+    {icSigXYZData,     1, { 0.0 } , { 1.0 + 32767.0/32768.0 } },
+    {icmSigLab8Data,   0, { 0.0, -128.0, -128.0 }, { 100.0, 127.0,  127.0 } }, 
+    {icmSigLabV2Data,  0, { 0.0, -128.0, -128.0 },
+                          { 100.0 + 25500.0/65280.0, 127.0 + 255.0/256.0, 127.0 + 255.0/256.0 } }, 
+    {icmSigLabV4Data,  0, { 0.0, -128.0, -128.0 }, { 100.0, 127.0,  127.0 } }, 
+    {icmSigYData,      1, { 0.0 }, { 1.0 + 32767.0/32768.0 } },
+    {icmSigL8Data,     1, { 0.0 }, { 100.0 } }, 
+    {icmSigLV2Data,    1, { 0.0 }, { 100.0 + 25500.0/65280.0 } }, 
+    {icmSigLV4Data,    1, { 0.0 }, { 100.0 } }, 
+    {icSigLuvData,     0, { 0.0, -128.0, -128.0 },
+                          { 100.0, 127.0 + 255.0/256.0, 127.0 + 255.0/256.0 } },
+    {icSigYCbCrData,   1, { 0.0 }, { 1.0 } },            /* ??? */
+    {icSigYxyData,     1, { 0.0 }, { 1.0 } },            /* ??? */
+    {icSigRgbData,     1, { 0.0 }, { 1.0 } },
+    {icSigGrayData,    1, { 0.0 }, { 1.0 } },
+    {icSigHsvData,     1, { 0.0 }, { 1.0 } },
+    {icSigHlsData,     1, { 0.0 }, { 1.0 } },
+    {icSigCmykData,    1, { 0.0 }, { 1.0 } },
+    {icSigCmyData,     1, { 0.0 }, { 1.0 } },
+    {icSigMch6Data,    1, { 0.0 }, { 1.0 } },
+    {icSig2colorData,  1, { 0.0 }, { 1.0 } },
+    {icSig3colorData,  1, { 0.0 }, { 1.0 } },
+    {icSig4colorData,  1, { 0.0 }, { 1.0 } },
+    {icSig5colorData,  1, { 0.0 }, { 1.0 } },
+    {icSig6colorData,  1, { 0.0 }, { 1.0 } },
+    {icSig7colorData,  1, { 0.0 }, { 1.0 } },
+    {icSig8colorData,  1, { 0.0 }, { 1.0 } },
+    {icSigMch5Data,    1, { 0.0 }, { 1.0 } },
+    {icSigMch6Data,    1, { 0.0 }, { 1.0 } },
+    {icSigMch7Data,    1, { 0.0 }, { 1.0 } },
+    {icSigMch8Data,    1, { 0.0 }, { 1.0 } },
+    {icSig9colorData,  1, { 0.0 }, { 1.0 } },
+    {icSig10colorData, 1, { 0.0 }, { 1.0 } },
+    {icSig11colorData, 1, { 0.0 }, { 1.0 } },
+    {icSig12colorData, 1, { 0.0 }, { 1.0 } },
+    {icSig13colorData, 1, { 0.0 }, { 1.0 } },
+    {icSig14colorData, 1, { 0.0 }, { 1.0 } },
+    {icSig15colorData, 1, { 0.0 }, { 1.0 } },
+    {icMaxEnumData,    1, { 0.0 }, { 1.0 } }
+};
     
-    /* Create rotated version of s0: */
-    icmMulBy3x3(ss, rr, s0);
+/* Find appropriate typical encoding ranges for a */
+/* colorspace given the color space. */
+/* Return 0 on success, 1 on match failure */
+static int getRange(
+    icc *icp,
+//    icProfileClassSignature psig,        /* Profile signature to use */
+    icColorSpaceSignature   csig,         /* Colorspace to use. */
+//  int                     lutin,        /* 0 if this is for a icSigLut16Type input, nz for output */
+//    icTagSignature          tagSig,        /* Tag signature involved (AtoB or B2A etc.) */
+    icTagTypeSignature      tagType,    /* icSigLut8Type or icSigLut16Type or V4 lut */
+    double *min, double *max            /* Return range values */
+) {
+    int i, e, ee;
 
-    /* Create 4x4 matrix */
-    for (j = 0; j < 3; j++) {
-        for (i = 0; i < 4; i++) {
-            if (i < 3 && j < 3)
-                m[j][i] = rr[j][i];
-            else if (i == 3 && j < 3)
-                m[j][i] = t0[j] - ss[j];
-            else if (i == j)
-                m[j][i] = 1.0;
+    if (tagType == icSigLut8Type && csig == icSigLabData) {
+        csig = icmSigLab8Data;
+    }
+    if (csig == icSigLabData) {
+        if (tagType == icSigLut16Type)    /* Lut16 retains legacy encoding */
+            csig = icmSigLabV2Data;
+        else {                            /* Other tag types use version specific encoding */
+            if (icp->ver)
+                csig = icmSigLabV4Data;
             else
-                m[j][i] = 0.0;
+                csig = icmSigLabV2Data;
         }
     }
-}
-
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Compute the 3D intersection of a vector and a plane */
-/* return nz if there is no intersection */
-int icmVecPlaneIsect(
-double isect[3],        /* return intersection point */
-double pl_const,        /* Plane equation constant */
-double pl_norm[3],        /* Plane normal vector */
-double ve_1[3],            /* Point on line */
-double ve_0[3]            /* Second point on line */
-) {
-    double den;            /* denominator */
-    double rv;            /* Vector parameter value */
-    double vvec[3];        /* Vector vector */
-    double ival[3];        /* Intersection value */
-
-    /* Compute vector between the two points */
-    vvec[0] = ve_1[0] - ve_0[0];
-    vvec[1] = ve_1[1] - ve_0[1];
-    vvec[2] = ve_1[2] - ve_0[2];
 
-    /* Compute the denominator */
-    den = pl_norm[0] * vvec[0] + pl_norm[1] * vvec[1] + pl_norm[2] * vvec[2];
-
-    /* Too small to intersect ? */
-    if (fabs(den) < 1e-12) {
+    for (i = 0; colorrangetable[i].csig != icMaxEnumData; i++) {
+        if (colorrangetable[i].csig == csig)
+            break;    /* Found it */
+    }
+    if (colorrangetable[i].csig == icMaxEnumData) {    /* Oops */
         return 1;
     }
+    ee = number_ColorSpaceSignature(csig);        /* Get number of components */
 
-    /* Compute the parameterized intersction point */
-    rv = -(pl_norm[0] * ve_0[0] + pl_norm[1] * ve_0[1] + pl_norm[2] * ve_0[2] + pl_const)/den;
-
-    /* Compute the actual intersection point */
-    isect[0] = ve_0[0] + rv * vvec[0];
-    isect[1] = ve_0[1] + rv * vvec[1];
-    isect[2] = ve_0[2] + rv * vvec[2];
-
+    if (colorrangetable[i].same) {        /* All channels are the same */
+        for (e = 0; e < ee; e++) {
+            if (min != NULL)
+                min[e] = colorrangetable[i].min[0];
+            if (max != NULL)
+                max[e] = colorrangetable[i].max[0];
+        }
+    } else {
+        for (e = 0; e < ee; e++) {
+            if (min != NULL)
+                min[e] = colorrangetable[i].min[e];
+            if (max != NULL)
+                max[e] = colorrangetable[i].max[e];
+        }
+    }
     return 0;
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Compute the closest points between two lines a and b. */
-/* Return closest points and parameter values if not NULL. */
-/* Return nz if they are paralel. */
-/* The maths is from page 338 of Tomas Moller and Eric Haines "Real-Time Rendering". */
-int icmLineLineClosest(double ca[3], double cb[3], double *pa, double * pb,
-                       double la0[3], double la1[3], double lb0[3], double lb1[3]) {
-    double va[3], vb[3];
-    double vvab[3], vvabns;        /* Cross product of va and vb and its norm squared */
-    double vba0[3];                /* lb0 - la0 */
-    double tt[3];
-    double a, b;                /* Parameter values */
-
-    icmSub3(va, la1, la0);
-    icmSub3(vb, lb1, lb0);
-    icmCross3(vvab, va, vb);
-    vvabns = icmNorm3sq(vvab);
-
-    if (vvabns < 1e-12)
-        return 1;
+/* ============================================= */
+/* Misc. support functions.                      */
 
-    icmSub3(vba0, lb0, la0);
-    icmCross3(tt, vba0, vb);
-    a = icmDot3(tt, vvab) / vvabns;
 
-    icmCross3(tt, vba0, va);
-    b = icmDot3(tt, vvab) / vvabns;
+/* Add two 3 vectors */
+void icmAdd3(double out[3], double in1[3], double in2[3]) {
+    out[0] = in1[0] + in2[0];
+    out[1] = in1[1] + in2[1];
+    out[2] = in1[2] + in2[2];
+}
 
-    if (pa != NULL)
-        *pa = a;
+/* Subtract two 3 vectors, out = in1 - in2 */
+void icmSub3(double out[3], double in1[3], double in2[3]) {
+    out[0] = in1[0] - in2[0];
+    out[1] = in1[1] - in2[1];
+    out[2] = in1[2] - in2[2];
+}
 
-    if (pb != NULL)
-        *pb = b;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
 
-    if (ca != NULL) {
-        ca[0] = la0[0] + a * va[0];
-        ca[1] = la0[1] + a * va[1];
-        ca[2] = la0[2] + a * va[2];
+/* Set a 3x3 matrix to unity */
+void icmSetUnity3x3(double mat[3][3]) {
+    int i, j;
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < 3; i++) {
+            if (i == j)
+                mat[j][i] = 1.0;
+            else
+                mat[j][i] = 0.0;
+        }
     }
+    
+}
 
-    if (cb != NULL) {
-        cb[0] = lb0[0] + b * vb[0];
-        cb[1] = lb0[1] + b * vb[1];
-        cb[2] = lb0[2] + b * vb[2];
+/* Copy a 3x3 transform matrix */
+void icmCpy3x3(double dst[3][3], double src[3][3]) {
+    int i, j;
+
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < 3; i++)
+            dst[j][i] = src[j][i];
     }
+}
 
-#ifdef NEVER    /* Verify  */
-    {
-        double vab[3];        /* Vector from ca to cb */
+/* Scale each element of a 3x3 transform matrix */
+void icmScale3x3(double dst[3][3], double src[3][3], double scale) {
+    int i, j;
 
-        vab[0] = lb0[0] + b * vb[0] - la0[0] - a * va[0];
-        vab[1] = lb0[1] + b * vb[1] - la0[1] - a * va[1];
-        vab[2] = lb0[2] + b * vb[2] - la0[2] - a * va[2];
-        
-        if (icmDot3(va, vab) > 1e-6
-         || icmDot3(vb, vab) > 1e-6)
-            warning("icmLineLineClosest verify failed\n");
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < 3; i++)
+            dst[j][i] = src[j][i] * scale;
     }
-#endif
-
-    return 0;
 }
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Given 3 3D points, compute a plane equation. */
-/* The normal will be right handed given the order of the points */
-/* The plane equation will be the 3 normal components and the constant. */
-/* Return nz if any points are cooincident or co-linear */
-int icmPlaneEqn3(double eq[4], double p0[3], double p1[3], double p2[3]) {
-    double ll, v1[3], v2[3];
 
-    /* Compute vectors along edges */
-    v2[0] = p1[0] - p0[0];
-    v2[1] = p1[1] - p0[1];
-    v2[2] = p1[2] - p0[2];
+/* 
 
-    v1[0] = p2[0] - p0[0];
-    v1[1] = p2[1] - p0[1];
-    v1[2] = p2[2] - p0[2];
+  mat     in    out
 
-    /* Compute cross products v1 x v2, which will be the normal */
-    eq[0] = v1[1] * v2[2] - v1[2] * v2[1];
-    eq[1] = v1[2] * v2[0] - v1[0] * v2[2];
-    eq[2] = v1[0] * v2[1] - v1[1] * v2[0];
+[     ]   []    []
+[     ] * [] => []
+[     ]   []    []
 
-    /* Normalise the equation */
-    ll = sqrt(eq[0] * eq[0] + eq[1] * eq[1] + eq[2] * eq[2]);
-    if (ll < 1e-10) {
-        return 1;
-    }
-    eq[0] /= ll;
-    eq[1] /= ll;
-    eq[2] /= ll;
+ */
 
-    /* Compute the plane equation constant */
-    eq[3] = - (eq[0] * p0[0])
-            - (eq[1] * p0[1])
-            - (eq[2] * p0[2]);
+/* Multiply 3 array by 3x3 transform matrix */
+void icmMulBy3x3(double out[3], double mat[3][3], double in[3]) {
+    double tt[3];
 
-    return 0;
+    tt[0] = mat[0][0] * in[0] + mat[0][1] * in[1] + mat[0][2] * in[2];
+    tt[1] = mat[1][0] * in[0] + mat[1][1] * in[1] + mat[1][2] * in[2];
+    tt[2] = mat[2][0] * in[0] + mat[2][1] * in[1] + mat[2][2] * in[2];
+
+    out[0] = tt[0];
+    out[1] = tt[1];
+    out[2] = tt[2];
 }
 
-/* Given a 3D point and a plane equation, return the signed */
-/* distance from the plane */
-double icmPlaneDist3(double eq[4], double p[3]) {
-    double rv;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Add one 3x3 to another */
+/* dst = src1 + src2 */
+void icmAdd3x3(double dst[3][3], double src1[3][3], double src2[3][3]) {
+    int i, j;
 
-    rv = eq[0] * p[0]
-       + eq[1] * p[1]
-       + eq[2] * p[2]
-       + eq[3];
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < 3; i++)
+            dst[j][i] = src1[j][i] + src2[j][i];
+    }
+}
 
-    return rv;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Tensor product. Multiply two 3 vectors to form a 3x3 matrix */
+/* src1[] forms the colums, and src2[] forms the rows in the result */
+void icmTensMul3(double dst[3][3], double src1[3], double src2[3]) {
+    int i, j;
+    
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < 3; i++)
+            dst[j][i] = src1[j] * src2[i];
+    }
 }
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* CIE Y (range 0 .. 1) to perceptual CIE 1976 L* (range 0 .. 100) */
-double
-icmY2L(double val) {
-    if (val > 0.008856451586)
-        val = pow(val,1.0/3.0);
-    else
-        val = 7.787036979 * val + 16.0/116.0;
 
-    val = (116.0 * val - 16.0);
-    return val;
-}
+/* Multiply one 3x3 with another */
+/* dst = src * dst */
+void icmMul3x3(double dst[3][3], double src[3][3]) {
+    int i, j, k;
+    double td[3][3];        /* Temporary dest */
 
-/* Perceptual CIE 1976 L* (range 0 .. 100) to CIE Y (range 0 .. 1) */
-double
-icmL2Y(double val) {
-    val = (val + 16.0)/116.0;
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < 3; i++) {
+            double tt = 0.0;
+            for (k = 0; k < 3; k++)
+                tt += src[j][k] * dst[k][i];
+            td[j][i] = tt;
+        }
+    }
 
-    if (val > 24.0/116.0)
-        val = pow(val,3.0);
-    else
-        val = (val - 16.0/116.0)/7.787036979;
-    return val;
+    /* Copy result out */
+    for (j = 0; j < 3; j++)
+        for (i = 0; i < 3; i++)
+            dst[j][i] = td[j][i];
 }
 
-/* CIE XYZ to perceptual CIE 1976 L*a*b* */
-void
-icmXYZ2Lab(icmXYZNumber *w, double *out, double *in) {
-    double X = in[0], Y = in[1], Z = in[2];
-    double x,y,z,fx,fy,fz;
-
-    x = X/w->X;
-    y = Y/w->Y;
-    z = Z/w->Z;
+/* Multiply one 3x3 with another #2 */
+/* dst = src1 * src2 */
+void icmMul3x3_2(double dst[3][3], double src1[3][3], double src2[3][3]) {
+    int i, j, k;
+    double td[3][3];        /* Temporary dest */
 
-    if (x > 0.008856451586)
-        fx = pow(x,1.0/3.0);
-    else
-        fx = 7.787036979 * x + 16.0/116.0;
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < 3; i++) {
+            double tt = 0.0;
+            for (k = 0; k < 3; k++)
+                tt += src1[j][k] * src2[k][i];
+            td[j][i] = tt;
+        }
+    }
 
-    if (y > 0.008856451586)
-        fy = pow(y,1.0/3.0);
-    else
-        fy = 7.787036979 * y + 16.0/116.0;
+    /* Copy result out */
+    for (j = 0; j < 3; j++)
+        for (i = 0; i < 3; i++)
+            dst[j][i] = td[j][i];
+}
 
-    if (z > 0.008856451586)
-        fz = pow(z,1.0/3.0);
-    else
-        fz = 7.787036979 * z + 16.0/116.0;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* 
+    Matrix Inversion
+    by Richard Carling
+    from "Graphics Gems", Academic Press, 1990
+*/
 
-    out[0] = 116.0 * fy - 16.0;
-    out[1] = 500.0 * (fx - fy);
-    out[2] = 200.0 * (fy - fz);
-}
+/* 
+ *   adjoint( original_matrix, inverse_matrix )
+ * 
+ *     calculate the adjoint of a 3x3 matrix
+ *
+ *      Let  a   denote the minor determinant of matrix A obtained by
+ *           ij
+ *
+ *      deleting the ith row and jth column from A.
+ *
+ *                    i+j
+ *     Let  b   = (-1)    a
+ *          ij            ji
+ *
+ *    The matrix B = (b  ) is the adjoint of A
+ *                     ij
+ */
 
-/* Perceptual CIE 1976 L*a*b* to CIE XYZ */
-void
-icmLab2XYZ(icmXYZNumber *w, double *out, double *in) {
-    double L = in[0], a = in[1], b = in[2];
-    double x,y,z,fx,fy,fz;
+#define det2x2(a, b, c, d) (a * d - b * c)
 
-    fy = (L + 16.0)/116.0;
-    fx = a/500.0 + fy;
-    fz = fy - b/200.0;
+static void adjoint(
+double out[3][3],
+double in[3][3]
+) {
+    double a1, a2, a3, b1, b2, b3, c1, c2, c3;
 
-    if (fy > 24.0/116.0)
-        y = pow(fy,3.0);
-    else
-        y = (fy - 16.0/116.0)/7.787036979;
+    /* assign to individual variable names to aid  */
+    /* selecting correct values  */
 
-    if (fx > 24.0/116.0)
-        x = pow(fx,3.0);
-    else
-        x = (fx - 16.0/116.0)/7.787036979;
+    a1 = in[0][0]; b1 = in[0][1]; c1 = in[0][2];
+    a2 = in[1][0]; b2 = in[1][1]; c2 = in[1][2];
+    a3 = in[2][0]; b3 = in[2][1]; c3 = in[2][2];
 
-    if (fz > 24.0/116.0)
-        z = pow(fz,3.0);
-    else
-        z = (fz - 16.0/116.0)/7.787036979;
+    /* row column labeling reversed since we transpose rows & columns */
 
-    out[0] = x * w->X;
-    out[1] = y * w->Y;
-    out[2] = z * w->Z;
+    out[0][0]  =   det2x2(b2, b3, c2, c3);
+    out[1][0]  = - det2x2(a2, a3, c2, c3);
+    out[2][0]  =   det2x2(a2, a3, b2, b3);
+        
+    out[0][1]  = - det2x2(b1, b3, c1, c3);
+    out[1][1]  =   det2x2(a1, a3, c1, c3);
+    out[2][1]  = - det2x2(a1, a3, b1, b3);
+        
+    out[0][2]  =   det2x2(b1, b2, c1, c2);
+    out[1][2]  = - det2x2(a1, a2, c1, c2);
+    out[2][2]  =   det2x2(a1, a2, b1, b2);
 }
 
+/*
+ * double = icmDet3x3(  a1, a2, a3, b1, b2, b3, c1, c2, c3 )
+ * 
+ * calculate the determinant of a 3x3 matrix
+ * in the form
+ *
+ *     | a1,  b1,  c1 |
+ *     | a2,  b2,  c2 |
+ *     | a3,  b3,  c3 |
+ */
 
-/* LCh to Lab */
-void icmLCh2Lab(double *out, double *in) {
-    double C, h;
+double icmDet3x3(double in[3][3]) {
+    double a1, a2, a3, b1, b2, b3, c1, c2, c3;
+    double ans;
 
-    C = in[1];
-    h = 3.14159265359/180.0 * in[2];
+    a1 = in[0][0]; b1 = in[0][1]; c1 = in[0][2];
+    a2 = in[1][0]; b2 = in[1][1]; c2 = in[1][2];
+    a3 = in[2][0]; b3 = in[2][1]; c3 = in[2][2];
 
-    out[0] = in[0];
-    out[1] = C * cos(h);
-    out[2] = C * sin(h);
+    ans = a1 * det2x2(b2, b3, c2, c3)
+        - b1 * det2x2(a2, a3, c2, c3)
+        + c1 * det2x2(a2, a3, b2, b3);
+    return ans;
 }
 
-/* Lab to LCh */
-void icmLab2LCh(double *out, double *in) {
-    double C, h;
-
-    C = sqrt(in[1] * in[1] + in[2] * in[2]);
+#define ICM_SMALL_NUMBER    1.e-8
+/* 
+ *   inverse( original_matrix, inverse_matrix )
+ * 
+ *    calculate the inverse of a 4x4 matrix
+ *
+ *     -1     
+ *     A  = ___1__ adjoint A
+ *         det A
+ */
 
-    h = (180.0/3.14159265359) * atan2(in[2], in[1]);
-    h = (h < 0.0) ? h + 360.0 : h;
+/* Return non-zero if not invertable */
+int icmInverse3x3(
+double out[3][3],
+double in[3][3]
+) {
+    int i, j;
+    double det;
 
-    out[0] = in[0];
-    out[1] = C;
-    out[2] = h;
-}
+    /*  calculate the 3x3 determinant
+     *  if the determinant is zero, 
+     *  then the inverse matrix is not unique.
+     */
+    det = icmDet3x3(in);
 
-/* XYZ to Yxy */
-extern ICCLIB_API void icmXYZ2Yxy(double *out, double *in) {
-    double sum = in[0] + in[1] + in[2];
-    double Y, x, y;
+    if ( fabs(det) < ICM_SMALL_NUMBER)
+        return 1;
 
-    if (sum < 1e-9) {
-        Y = 0.0;
-        y = 0.0;
-        x = 0.0;
-    } else {
-        Y = in[1];
-        x = in[0]/sum;
-        y = in[1]/sum;
-    }
-    out[0] = Y;
-    out[1] = x;
-    out[2] = y;
+    /* calculate the adjoint matrix */
+    adjoint(out, in);
+
+    /* scale the adjoint matrix to get the inverse */
+    for (i = 0; i < 3; i++)
+        for(j = 0; j < 3; j++)
+            out[i][j] /= det;
+    return 0;
 }
 
-/* Yxy to XYZ */
-extern ICCLIB_API void icmYxy2XYZ(double *out, double *in) {
-    double Y = in[0];
-    double x = in[1];
-    double y = in[2];
-    double z = 1.0 - x - y;
-    double sum;
-    if (y < 1e-9) {
-        out[0] = out[1] = out[2] = 0.0;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Transpose a 3x3 matrix */
+void icmTranspose3x3(double out[3][3], double in[3][3]) {
+    int i, j;
+    if (out != in) {
+        for (i = 0; i < 3; i++)
+            for (j = 0; j < 3; j++)
+                out[i][j] = in[j][i];
     } else {
-        sum = Y/y;
-        out[0] = x * sum;
-        out[1] = Y;
-        out[2] = z * sum;
+        double tt[3][3];
+        for (i = 0; i < 3; i++)
+            for (j = 0; j < 3; j++)
+                tt[i][j] = in[j][i];
+        for (i = 0; i < 3; i++)
+            for (j = 0; j < 3; j++)
+                out[i][j] = tt[i][j];
     }
 }
 
-
-/* CIE XYZ to perceptual CIE 1976 L*u*v* */
-extern ICCLIB_API void icmXYZ2Luv(icmXYZNumber *w, double *out, double *in) {
-    double X = in[0], Y = in[1], Z = in[2];
-    double un, vn, u, v, fl, fu, fv;
-
-    un = (4.0 * w->X) / (w->X + 15.0 * w->Y + 3.0 * w->Z);
-    vn = (9.0 * w->Y) / (w->X + 15.0 * w->Y + 3.0 * w->Z);
-    u = (4.0 * X) / (X + 15.0 * Y + 3.0 * Z);
-    v = (9.0 * Y) / (X + 15.0 * Y + 3.0 * Z);
-    
-    Y /= w->Y;
-
-    if (Y > 0.008856451586)
-        fl = pow(Y,1.0/3.0);
-    else
-        fl = 7.787036979 * Y + 16.0/116.0;
-
-    fu = u - un;
-    fv = v - vn;
-
-    out[0] = 116.0 * fl - 16.0;
-    out[1] = 13.0 * out[0] * fu;
-    out[2] = 13.0 * out[0] * fv;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Compute the dot product of two 3 vectors */
+double icmDot3(double in1[3], double in2[3]) {
+    return in1[0] * in2[0] + in1[1] * in2[1] + in1[2] * in2[2];
 }
 
-/* Perceptual CIE 1976 L*u*v* to CIE XYZ */
-extern ICCLIB_API void icmLuv2XYZ(icmXYZNumber *w, double *out, double *in) {
-    double un, vn, u, v, fl, fu, fv, sum, X, Y, Z;
-
-    fl = (in[0] + 16.0)/116.0;
-    fu = in[1] / (13.0 * in[0]);
-    fv = in[2] / (13.0 * in[0]);
-
-    un = (4.0 * w->X) / (w->X + 15.0 * w->Y + 3.0 * w->Z);
-    vn = (9.0 * w->Y) / (w->X + 15.0 * w->Y + 3.0 * w->Z);
-
-    u = fu + un;
-    v = fv + vn;
-
-    if (fl > 24.0/116.0)
-        Y = pow(fl,3.0);
-    else
-        Y = (fl - 16.0/116.0)/7.787036979;
-    Y *= w->Y;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Compute the cross product of two 3D vectors, out = in1 x in2 */
+void icmCross3(double out[3], double in1[3], double in2[3]) {
+    double tt[3];
+    tt[0] = (in1[1] * in2[2]) - (in1[2] * in2[1]);
+    tt[1] = (in1[2] * in2[0]) - (in1[0] * in2[2]);
+    tt[2] = (in1[0] * in2[1]) - (in1[1] * in2[0]);
+    out[0] = tt[0];
+    out[1] = tt[1];
+    out[2] = tt[2];
+}
 
-    sum = (9.0 * Y)/v;
-    X = (u * sum)/4.0;
-    Z = (sum - X - 15.0 * Y)/3.0;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Compute the norm (length) squared of a 3 vector */
+double icmNorm3sq(double in[3]) {
+    return in[0] * in[0] + in[1] * in[1] + in[2] * in[2];
+}
 
-    out[0] = X;
-    out[1] = Y;
-    out[2] = Z;
+/* Compute the norm (length) of a 3 vector */
+double icmNorm3(double in[3]) {
+    return sqrt(in[0] * in[0] + in[1] * in[1] + in[2] * in[2]);
 }
 
-/* NOTE :- none of the following seven have been protected */
-/* against arithmmetic issues (ie. for black) */
+/* Scale a 3 vector by the given ratio */
+void icmScale3(double out[3], double in[3], double rat) {
+    out[0] = in[0] * rat;
+    out[1] = in[1] * rat;
+    out[2] = in[2] * rat;
+}
 
-/* CIE XYZ to perceptual CIE 1976 UCS diagram Yu'v'*/
-/* (Yu'v' is a better chromaticity space than Yxy) */
-extern ICCLIB_API void icmXYZ21976UCS(double *out, double *in) {
-    double X = in[0], Y = in[1], Z = in[2];
-    double den, u, v;
+/* Compute a blend between in0 and in1 */
+void icmBlend3(double out[3], double in0[3], double in1[3], double bf) {
+    out[0] = (1.0 - bf) * in0[0] + bf * in1[0];
+    out[1] = (1.0 - bf) * in0[1] + bf * in1[1];
+    out[2] = (1.0 - bf) * in0[2] + bf * in1[2];
+}
 
-    den = (X + 15.0 * Y + 3.0 * Z);
-    u = (4.0 * X) / den;
-    v = (9.0 * Y) / den;
+/* Normalise a 3 vector to the given length. Return nz if not normalisable */
+int icmNormalize3(double out[3], double in[3], double len) {
+    double tt = sqrt(in[0] * in[0] + in[1] * in[1] + in[2] * in[2]);
     
-    out[0] = Y;
-    out[1] = u;
-    out[2] = v;
+    if (tt < ICM_SMALL_NUMBER)
+        return 1;
+    tt = len/tt;
+    out[0] = in[0] * tt;
+    out[1] = in[1] * tt;
+    out[2] = in[2] * tt;
+    return 0;
 }
 
-/* Perceptual CIE 1976 UCS diagram Yu'v' to CIE XYZ */
-extern ICCLIB_API void icm1976UCS2XYZ(double *out, double *in) {
-    double u, v, fl, fu, fv, sum, X, Y, Z;
-
-    Y = in[0];
-    u = in[1];
-    v = in[2];
+/* Compute the norm (length) squared of a vector define by two points */
+double icmNorm33sq(double in1[3], double in0[3]) {
+    int j;
+    double rv;
+    for (rv = 0.0, j = 0; j < 3; j++) {
+        double tt = in1[j] - in0[j];
+        rv += tt * tt;
+    }
+    return rv;
+}
 
-    X = ((9.0 * u * Y)/(4.0 * v));
-    Z = -(((20.0 * v + 3.0 * u - 12.0) * Y)/(4.0 * v));
+/* Compute the norm (length) of a vector define by two points */
+double icmNorm33(double in1[3], double in0[3]) {
+    int j;
+    double rv;
+    for (rv = 0.0, j = 0; j < 3; j++) {
+        double tt = in1[j] - in0[j];
+        rv += tt * tt;
+    }
+    return sqrt(rv);
+}
 
-    out[0] = X;
-    out[1] = Y;
-    out[2] = Z;
+/* Scale a two point vector by the given ratio. in0[] is the origin */
+void icmScale33(double out[3], double in1[3], double in0[3], double rat) {
+    out[0] = in0[0] + (in1[0] - in0[0]) * rat;
+    out[1] = in0[1] + (in1[1] - in0[1]) * rat;
+    out[2] = in0[2] + (in1[2] - in0[2]) * rat;
 }
 
-/* CIE XYZ to perceptual CIE 1960 UCS */
-/* (This was obsoleted by the 1976UCS, but is still used */
-/*  in computing color temperatures.) */
-extern ICCLIB_API void icmXYZ21960UCS(double *out, double *in) {
-    double X = in[0], Y = in[1], Z = in[2];
-    double u, v;
+/* Normalise a two point vector to the given length. */
+/* The new location of in1[] is returned in out[]. */
+/* Return nz if not normalisable */
+int icmNormalize33(double out[3], double in1[3], double in0[3], double len) {
+    int j;
+    double vl;
 
-    u = (4.0 * X) / (X + 15.0 * Y + 3.0 * Z);
-    v = (6.0 * Y) / (X + 15.0 * Y + 3.0 * Z);
+    for (vl = 0.0, j = 0; j < 3; j++) {
+        double tt = in1[j] - in0[j];
+        vl += tt * tt;
+    }
+    vl = sqrt(vl);
+    if (vl < ICM_SMALL_NUMBER)
+        return 1;
     
-    out[0] = Y;
-    out[1] = u;
-    out[2] = v;
+    vl = len/vl;
+    for (j = 0; j < 3; j++) {
+        out[j] = in0[j] + (in1[j] - in0[j]) * vl;
+    }
+    return 0;
 }
 
-/* Perceptual CIE 1960 UCS to CIE XYZ */
-extern ICCLIB_API void icm1960UCS2XYZ(double *out, double *in) {
-    double u, v, fl, fu, fv, sum, X, Y, Z;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Given two 3D points, create a matrix that rotates */
+/* and scales one onto the other about the origin 0,0,0. */
+/* The maths is from page 52 of Tomas Moller and Eric Haines "Real-Time Rendering". */
+/* s is source vector, t is target vector. */
+/* Usage of icmRotMat: */
+/*    t[0] == mat[0][0] * s[0] + mat[0][1] * s[1] + mat[0][2] * s[2]; */
+/*    t[1] == mat[1][0] * s[0] + mat[1][1] * s[1] + mat[1][2] * s[2]; */
+/*    t[2] == mat[2][0] * s[0] + mat[2][1] * s[1] + mat[2][2] * s[2]; */
+/* i.e. use icmMulBy3x3 */
+void icmRotMat(double m[3][3], double s[3], double t[3]) {
+    double sl, tl, sn[3], tn[3];
+    double v[3];        /* Cross product */
+    double e;            /* Dot product */
+    double h;            /* 1-e/Cross product dot squared */
 
-    Y = in[0];
-    u = in[1];
-    v = in[2];
-
-    X = ((3.0 * u * Y)/(2.0 * v));
-    Z = -(((10.0 * v + u - 4.0) * Y)/(2.0 * v));
+    /* Normalise input vectors */
+    /* The rotation will be about 0,0,0 */
+    sl = sqrt(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
+    tl = sqrt(t[0] * t[0] + t[1] * t[1] + t[2] * t[2]);
 
-    out[0] = X;
-    out[1] = Y;
-    out[2] = Z;
-}
+    if (sl < 1e-12 || tl < 1e-12) {    /* Hmm. Do nothing */
+        m[0][0] = 1.0;
+        m[0][1] = 0.0;
+        m[0][2] = 0.0;
+        m[1][0] = 0.0;
+        m[1][1] = 1.0;
+        m[1][2] = 0.0;
+        m[2][0] = 0.0;
+        m[2][1] = 0.0;
+        m[2][2] = 1.0;
+        return;
+    }
 
-/* CIE XYZ to perceptual CIE 1964 WUV (U*V*W*) */
-/* (This is obsolete but still used in computing CRI) */
-extern ICCLIB_API void icmXYZ21964WUV(icmXYZNumber *w, double *out, double *in) {
-    double W, U, V;
-    double wucs[3];
-    double iucs[3];
+    sn[0] = s[0]/sl; sn[1] = s[1]/sl; sn[2] = s[2]/sl;
+    tn[0] = t[0]/tl; tn[1] = t[1]/tl; tn[2] = t[2]/tl;
 
-    icmXYZ2Ary(wucs, *w);
-    icmXYZ21960UCS(wucs, wucs);
-    icmXYZ21960UCS(iucs, in);
+    /* Compute the cross product */
+    v[0] = (sn[1] * tn[2]) - (sn[2] * tn[1]);
+    v[1] = (sn[2] * tn[0]) - (sn[0] * tn[2]);
+    v[2] = (sn[0] * tn[1]) - (sn[1] * tn[0]);
 
-    W = 25.0 * pow(iucs[0] * 100.0/wucs[0], 1.0/3.0) - 17.0;
-    U = 13.0 * W * (iucs[1] - wucs[1]);
-    V = 13.0 * W * (iucs[2] - wucs[2]);
+    /* Compute the dot product */
+    e = sn[0] * tn[0] + sn[1] * tn[1] + sn[2] * tn[2];
 
-    out[0] = W;
-    out[1] = U;
-    out[2] = V;
-}
+    /* Cross product dot squared */
+    h = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
 
-/* Perceptual CIE 1964 WUV (U*V*W*) to CIE XYZ */
-extern ICCLIB_API void icm1964WUV2XYZ(icmXYZNumber *w, double *out, double *in) {
-    double W, U, V;
-    double wucs[3];
-    double iucs[3];
+    /* If the two input vectors are close to being parallel, */
+    /* then h will be close to zero. */
+    if (fabs(h) < 1e-12) {
+        m[0][0] = tl/sl;
+        m[0][1] = 0.0;
+        m[0][2] = 0.0;
+        m[1][0] = 0.0;
+        m[1][1] = tl/sl;
+        m[1][2] = 0.0;
+        m[2][0] = 0.0;
+        m[2][1] = 0.0;
+        m[2][2] = tl/sl;
+    } else {
+        /* 1-e/Cross product dot squared */
+        h = (1.0 - e) / h;
 
-    icmXYZ2Ary(wucs, *w);
-    icmXYZ21960UCS(wucs, wucs);
+        m[0][0] = tl/sl * (e + h * v[0] * v[0]);
+        m[0][1] = tl/sl * (h * v[0] * v[1] - v[2]);
+        m[0][2] = tl/sl * (h * v[0] * v[2] + v[1]);
+        m[1][0] = tl/sl * (h * v[0] * v[1] + v[2]);
+        m[1][1] = tl/sl * (e + h * v[1] * v[1]);
+        m[1][2] = tl/sl * (h * v[1] * v[2] - v[0]);
+        m[2][0] = tl/sl * (h * v[0] * v[2] - v[1]);
+        m[2][1] = tl/sl * (h * v[1] * v[2] + v[0]);
+        m[2][2] = tl/sl * (e + h * v[2] * v[2]);
+    }
+}
 
-    W = in[0];
-    U = in[1];
-    V = in[2];
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Multiply 2 array by 2x2 transform matrix */
+void icmMulBy2x2(double out[2], double mat[2][2], double in[2]) {
+    double tt[2];
 
-    iucs[0] = pow((W + 17.0)/25.0, 3.0) * wucs[0]/100.0;
-    iucs[1] = U / (13.0 * W) + wucs[1];
-    iucs[2] = V / (13.0 * W) + wucs[2];
+    tt[0] = mat[0][0] * in[0] + mat[0][1] * in[1];
+    tt[1] = mat[1][0] * in[0] + mat[1][1] * in[1];
 
-    icm1960UCS2XYZ(out, iucs);
+    out[0] = tt[0];
+    out[1] = tt[1];
 }
 
-/* CIE CIE1960 UCS to perceptual CIE 1964 WUV (U*V*W*) */
-extern ICCLIB_API void icm1960UCS21964WUV(icmXYZNumber *w, double *out, double *in) {
-    double W, U, V;
-    double wucs[3];
-
-    icmXYZ2Ary(wucs, *w);
-    icmXYZ21960UCS(wucs, wucs);
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
 
-    W = 25.0 * pow(in[0] * 100.0/wucs[0], 1.0/3.0) - 17.0;
-    U = 13.0 * W * (in[1] - wucs[1]);
-    V = 13.0 * W * (in[2] - wucs[2]);
+/* Copy a 3x4 transform matrix */
+void icmCpy3x4(double dst[3][4], double src[3][4]) {
+    int i, j;
 
-    out[0] = W;
-    out[1] = U;
-    out[2] = V;
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < 4; i++)
+            dst[j][i] = src[j][i];
+    }
 }
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - */
 
-/* available D50 Illuminant */
-icmXYZNumber icmD50 = {         /* Profile illuminant - D50 */
-    0.9642, 1.0000, 0.8249
-};
+/* Multiply 3 array by 3x4 transform matrix */
+void icmMul3By3x4(double out[3], double mat[3][4], double in[3]) {
+    double tt[3];
 
-icmXYZNumber icmD50_100 = {        /* Profile illuminant - D50, scaled to 100 */
-    96.42, 100.00, 82.49
-};
+    tt[0] = mat[0][0] * in[0] + mat[0][1] * in[1] + mat[0][2] * in[2] + mat[0][3];
+    tt[1] = mat[1][0] * in[0] + mat[1][1] * in[1] + mat[1][2] * in[2] + mat[1][3];
+    tt[2] = mat[2][0] * in[0] + mat[2][1] * in[1] + mat[2][2] * in[2] + mat[2][3];
 
-double icmD50_ary3[3] = {         /* Profile illuminant - D50 */
-    0.9642, 1.0000, 0.8249
-};
+    out[0] = tt[0];
+    out[1] = tt[1];
+    out[2] = tt[2];
+}
 
-/* available D65 Illuminant */
-icmXYZNumber icmD65 = {         /* Profile illuminant - D65 */
-    0.9505, 1.0000, 1.0890
-};
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Given two 3D vectors, create a matrix that translates, */
+/* rotates and scales one onto the other. */
+/* The maths is from page 52 of Tomas Moller and Eric Haines */
+/* "Real-Time Rendering". */
+/* s0 -> s1 is source vector, t0 -> t1 is target vector. */
+/* Usage of icmRotMat: */
+/*    t[0] == mat[0][0] * s[0] + mat[0][1] * s[1] + mat[0][2] * s[2] + mat[0][3]; */
+/*    t[1] == mat[1][0] * s[0] + mat[1][1] * s[1] + mat[1][2] * s[2] + mat[1][3]; */
+/*    t[2] == mat[2][0] * s[0] + mat[2][1] * s[1] + mat[2][2] * s[2] + mat[2][3]; */
+/* i.e. use icmMul3By3x4 */
+void icmVecRotMat(double m[3][4], double s1[3], double s0[3], double t1[3], double t0[3]) {
+    int i, j;
+    double ss[3], tt[3], rr[3][3];
 
-icmXYZNumber icmD65_100 = {     /* Profile illuminant - D65, scaled to 100 */
-    95.05, 100.00, 108.90
-};
+    /* Create the rotation matrix: */
+    for (i = 0; i < 3; i++) {
+        ss[i] = s1[i] - s0[i];
+        tt[i] = t1[i] - t0[i];
+    }
+    icmRotMat(rr, ss, tt);
+    
+    /* Create rotated version of s0: */
+    icmMulBy3x3(ss, rr, s0);
 
-double icmD65_ary3[3] = {         /* Profile illuminant - D65 */
-    0.9505, 1.0000, 1.0890
-};
+    /* Create 4x4 matrix */
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < 4; i++) {
+            if (i < 3 && j < 3)
+                m[j][i] = rr[j][i];
+            else if (i == 3 && j < 3)
+                m[j][i] = t0[j] - ss[j];
+            else if (i == j)
+                m[j][i] = 1.0;
+            else
+                m[j][i] = 0.0;
+        }
+    }
+}
 
-/* Default black point */
-icmXYZNumber icmBlack = {
-    0.0000, 0.0000, 0.0000
-};
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Compute the 3D intersection of a vector and a plane */
+/* return nz if there is no intersection */
+int icmVecPlaneIsect(
+double isect[3],        /* return intersection point */
+double pl_const,        /* Plane equation constant */
+double pl_norm[3],        /* Plane normal vector */
+double ve_1[3],            /* Point on line */
+double ve_0[3]            /* Second point on line */
+) {
+    double den;            /* denominator */
+    double rv;            /* Vector parameter value */
+    double vvec[3];        /* Vector vector */
+    double ival[3];        /* Intersection value */
 
-/* Return the normal Delta E given two Lab values */
-double icmLabDE(double *Lab0, double *Lab1) {
-    double rv = 0.0, tt;
+    /* Compute vector between the two points */
+    vvec[0] = ve_1[0] - ve_0[0];
+    vvec[1] = ve_1[1] - ve_0[1];
+    vvec[2] = ve_1[2] - ve_0[2];
 
-    tt = Lab0[0] - Lab1[0];
-    rv += tt * tt;
-    tt = Lab0[1] - Lab1[1];
-    rv += tt * tt;
-    tt = Lab0[2] - Lab1[2];
-    rv += tt * tt;
-    
-    return sqrt(rv);
-}
+    /* Compute the denominator */
+    den = pl_norm[0] * vvec[0] + pl_norm[1] * vvec[1] + pl_norm[2] * vvec[2];
 
-/* Return the normal Delta E squared, given two Lab values */
-double icmLabDEsq(double *Lab0, double *Lab1) {
-    double rv = 0.0, tt;
+    /* Too small to intersect ? */
+    if (fabs(den) < 1e-12) {
+        return 1;
+    }
 
-    tt = Lab0[0] - Lab1[0];
-    rv += tt * tt;
-    tt = Lab0[1] - Lab1[1];
-    rv += tt * tt;
-    tt = Lab0[2] - Lab1[2];
-    rv += tt * tt;
-    
-    return rv;
-}
+    /* Compute the parameterized intersction point */
+    rv = -(pl_norm[0] * ve_0[0] + pl_norm[1] * ve_0[1] + pl_norm[2] * ve_0[2] + pl_const)/den;
 
-/* Return the normal Delta E given two XYZ values */
-extern ICCLIB_API double icmXYZLabDE(icmXYZNumber *w, double *in0, double *in1) {
-    double lab0[3], lab1[3], rv;
+    /* Compute the actual intersection point */
+    isect[0] = ve_0[0] + rv * vvec[0];
+    isect[1] = ve_0[1] + rv * vvec[1];
+    isect[2] = ve_0[2] + rv * vvec[2];
 
-    icmXYZ2Lab(w, lab0, in0);
-    icmXYZ2Lab(w, lab1, in1);
-    rv = icmLabDE(lab0, lab1);
-    return rv;
+    return 0;
 }
 
-/* (Note that CIE94 can give odd results for very large delta E's, */
-/* when one of the two points is near the neutral axis: */
-/* ie DE(A,B + del) != DE(A,B) + DE(del) */
-#ifdef NEVER
-{
-    double w1[3] = { 99.996101, -0.058417, -0.010557 };
-    double c1[3] = { 60.267956, 98.845863, -61.163277 };
-    double w2[3] = { 100.014977, -0.138339, 0.089744 };
-    double c2[3] = { 60.294464, 98.117104, -60.843159 };
-    
-    printf("DE   1 = %f, 2 = %f\n", icmLabDE(c1, w1), icmLabDE(c2, w2));
-    printf("DE94 1 = %f, 2 = %f\n", icmCIE94(c1, w1), icmCIE94(c2, w2));
-}
-#endif
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Compute the closest points between two lines a and b. */
+/* Return closest points and parameter values if not NULL. */
+/* Return nz if they are paralel. */
+/* The maths is from page 338 of Tomas Moller and Eric Haines "Real-Time Rendering". */
+int icmLineLineClosest(double ca[3], double cb[3], double *pa, double * pb,
+                       double la0[3], double la1[3], double lb0[3], double lb1[3]) {
+    double va[3], vb[3];
+    double vvab[3], vvabns;        /* Cross product of va and vb and its norm squared */
+    double vba0[3];                /* lb0 - la0 */
+    double tt[3];
+    double a, b;                /* Parameter values */
 
+    icmSub3(va, la1, la0);
+    icmSub3(vb, lb1, lb0);
+    icmCross3(vvab, va, vb);
+    vvabns = icmNorm3sq(vvab);
 
-/* Return the CIE94 Delta E color difference measure, squared */
-double icmCIE94sq(double Lab0[3], double Lab1[3]) {
-    double desq, dhsq;
-    double dlsq, dcsq;
-    double c12;
+    if (vvabns < 1e-12)
+        return 1;
 
-    {
-        double dl, da, db;
-        dl = Lab0[0] - Lab1[0];
-        dlsq = dl * dl;        /* dl squared */
-        da = Lab0[1] - Lab1[1];
-        db = Lab0[2] - Lab1[2];
+    icmSub3(vba0, lb0, la0);
+    icmCross3(tt, vba0, vb);
+    a = icmDot3(tt, vvab) / vvabns;
 
-        /* Compute normal Lab delta E squared */
-        desq = dlsq + da * da + db * db;
-    }
+    icmCross3(tt, vba0, va);
+    b = icmDot3(tt, vvab) / vvabns;
 
-    {
-        double c1, c2, dc;
+    if (pa != NULL)
+        *pa = a;
 
-        /* Compute chromanance for the two colors */
-        c1 = sqrt(Lab0[1] * Lab0[1] + Lab0[2] * Lab0[2]);
-        c2 = sqrt(Lab1[1] * Lab1[1] + Lab1[2] * Lab1[2]);
-        c12 = sqrt(c1 * c2);    /* Symetric chromanance */
+    if (pb != NULL)
+        *pb = b;
 
-        /* delta chromanance squared */
-        dc = c2 - c1;
-        dcsq = dc * dc;
+    if (ca != NULL) {
+        ca[0] = la0[0] + a * va[0];
+        ca[1] = la0[1] + a * va[1];
+        ca[2] = la0[2] + a * va[2];
     }
 
-    /* Compute delta hue squared */
-    if ((dhsq = desq - dlsq - dcsq) < 0.0)
-        dhsq = 0.0;
+    if (cb != NULL) {
+        cb[0] = lb0[0] + b * vb[0];
+        cb[1] = lb0[1] + b * vb[1];
+        cb[2] = lb0[2] + b * vb[2];
+    }
+
+#ifdef NEVER    /* Verify  */
     {
-        double sc, sh;
+        double vab[3];        /* Vector from ca to cb */
 
-        /* Weighting factors for delta chromanance & delta hue */
-        sc = 1.0 + 0.048 * c12;
-        sh = 1.0 + 0.014 * c12;
-        return dlsq + dcsq/(sc * sc) + dhsq/(sh * sh);
+        vab[0] = lb0[0] + b * vb[0] - la0[0] - a * va[0];
+        vab[1] = lb0[1] + b * vb[1] - la0[1] - a * va[1];
+        vab[2] = lb0[2] + b * vb[2] - la0[2] - a * va[2];
+        
+        if (icmDot3(va, vab) > 1e-6
+         || icmDot3(vb, vab) > 1e-6)
+            warning("icmLineLineClosest verify failed\n");
     }
-}
+#endif
 
-/* Return the CIE94 Delta E color difference measure */
-double icmCIE94(double Lab0[3], double Lab1[3]) {
-    return sqrt(icmCIE94sq(Lab0, Lab1));
+    return 0;
 }
 
-/* Return the CIE94 Delta E color difference measure for two XYZ values */
-extern ICCLIB_API double icmXYZCIE94(icmXYZNumber *w, double *in0, double *in1) {
-    double lab0[3], lab1[3];
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Given 3 3D points, compute a plane equation. */
+/* The normal will be right handed given the order of the points */
+/* The plane equation will be the 3 normal components and the constant. */
+/* Return nz if any points are cooincident or co-linear */
+int icmPlaneEqn3(double eq[4], double p0[3], double p1[3], double p2[3]) {
+    double ll, v1[3], v2[3];
 
-    icmXYZ2Lab(w, lab0, in0);
-    icmXYZ2Lab(w, lab1, in1);
-    return sqrt(icmCIE94sq(lab0, lab1));
-}
+    /* Compute vectors along edges */
+    v2[0] = p1[0] - p0[0];
+    v2[1] = p1[1] - p0[1];
+    v2[2] = p1[2] - p0[2];
 
+    v1[0] = p2[0] - p0[0];
+    v1[1] = p2[1] - p0[1];
+    v1[2] = p2[2] - p0[2];
 
-/* From the paper "The CIEDE2000 Color-Difference Formula: Implementation Notes, */
-/* Supplementary Test Data, and Mathematical Observations", by */
-/* Gaurav Sharma, Wencheng Wu and Edul N. Dalal, */
-/* Color Res. Appl., vol. 30, no. 1, pp. 21-30, Feb. 2005. */
+    /* Compute cross products v1 x v2, which will be the normal */
+    eq[0] = v1[1] * v2[2] - v1[2] * v2[1];
+    eq[1] = v1[2] * v2[0] - v1[0] * v2[2];
+    eq[2] = v1[0] * v2[1] - v1[1] * v2[0];
 
-/* Return the CIEDE2000 Delta E color difference measure squared, for two Lab values */
-double icmCIE2Ksq(double *Lab0, double *Lab1) {
-    double C1, C2;
-    double h1, h2;
-    double dL, dC, dH;
-    double dsq;
+    /* Normalise the equation */
+    ll = sqrt(eq[0] * eq[0] + eq[1] * eq[1] + eq[2] * eq[2]);
+    if (ll < 1e-10) {
+        return 1;
+    }
+    eq[0] /= ll;
+    eq[1] /= ll;
+    eq[2] /= ll;
 
-    /* The trucated value of PI is needed to ensure that the */
-    /* test cases pass, as one of them lies on the edge of */
-    /* a mathematical discontinuity. The precision is still */
-    /* enough for any practical use. */
-#define RAD2DEG(xx) (180.0/3.14159265358979 * (xx))
-#define DEG2RAD(xx) (3.14159265358979/180.0 * (xx))
+    /* Compute the plane equation constant */
+    eq[3] = - (eq[0] * p0[0])
+            - (eq[1] * p0[1])
+            - (eq[2] * p0[2]);
 
-    /* Compute Cromanance and Hue angles */
-    {
-        double C1ab, C2ab;
-        double Cab, Cab7, G;
-        double a1, a2;
+    return 0;
+}
 
-        C1ab = sqrt(Lab0[1] * Lab0[1] + Lab0[2] * Lab0[2]);
-        C2ab = sqrt(Lab1[1] * Lab1[1] + Lab1[2] * Lab1[2]);
-        Cab = 0.5 * (C1ab + C2ab);
-        Cab7 = pow(Cab,7.0);
-        G = 0.5 * (1.0 - sqrt(Cab7/(Cab7 + 6103515625.0)));
-        a1 = (1.0 + G) * Lab0[1];
-        a2 = (1.0 + G) * Lab1[1];
-        C1 = sqrt(a1 * a1 + Lab0[2] * Lab0[2]);
-        C2 = sqrt(a2 * a2 + Lab1[2] * Lab1[2]);
+/* Given a 3D point and a plane equation, return the signed */
+/* distance from the plane */
+double icmPlaneDist3(double eq[4], double p[3]) {
+    double rv;
 
-        if (C1 < 1e-9)
-            h1 = 0.0;
-        else {
-            h1 = RAD2DEG(atan2(Lab0[2], a1));
-            if (h1 < 0.0)
-                h1 += 360.0;
-        }
+    rv = eq[0] * p[0]
+       + eq[1] * p[1]
+       + eq[2] * p[2]
+       + eq[3];
 
-        if (C2 < 1e-9)
-            h2 = 0.0;
-        else {
-            h2 = RAD2DEG(atan2(Lab1[2], a2));
-            if (h2 < 0.0)
-                h2 += 360.0;
-        }
-    }
+    return rv;
+}
 
-    /* Compute delta L, C and H */
-    {
-        double dh;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Fast approximations of the libm functions, used by the array */
+/* versions of the color conversion and Delta E functions. These */
+/* use polynomials without table lookups or data dependent branches, */
+/* so that the loops that use them are suitable for compiler vectorization. */
+
+/* Return the cube root of x > 0.0 */
+static double icmFastCbrt(double x) {
+    ORD64 i;
+    double y, y3;
+
+    /* Initial estimate by dividing the exponent by 3, error < 4% */
+    memcpy(&i, &x, sizeof(double));
+    i = i/3 + (((ORD64)0x2A9F7893 << 32) | 0x782DA1CE);
+    memcpy(&y, &i, sizeof(double));
+
+    /* Two Halley iterations, then a Newton iteration */
+    y3 = y * y * y;
+    y = y * (y3 + 2.0 * x)/(2.0 * y3 + x);
+    y3 = y * y * y;
+    y = y * (y3 + 2.0 * x)/(2.0 * y3 + x);
+    y = y - (y * y * y - x)/(3.0 * y * y);
+
+    return y;
+}
+
+/* The truncated PI used by icmCIE2Ksq() */
+#define FAST_PI 3.14159265358979
+
+/* Return atan2(y, x) in degrees, 0.0 .. 360.0 */
+static double icmFastAtan2Deg(double y, double x) {
+    double ax, ay, mn, mx, t, z, zz, a;
+    int big;
+
+    ax = fabs(x);
+    ay = fabs(y);
+    mn = ax < ay ? ax : ay;
+    mx = ax < ay ? ay : ax;
+    t = mx > 0.0 ? mn/mx : 0.0;                /* 0 .. 1 */
+
+    /* Reduce to |z| <= tan(PI/8) using atan(t) = PI/4 + atan((t-1)/(t+1)) */
+    big = t > 0.41421356237309503;
+    z = big ? (t - 1.0)/(t + 1.0) : t;
+    zz = z * z;
+
+    /* atan(z) series to z^23, error < 2e-11 */
+    a = -1.0/23.0;
+    a = a * zz + 1.0/21.0;
+    a = a * zz - 1.0/19.0;
+    a = a * zz + 1.0/17.0;
+    a = a * zz - 1.0/15.0;
+    a = a * zz + 1.0/13.0;
+    a = a * zz - 1.0/11.0;
+    a = a * zz + 1.0/9.0;
+    a = a * zz - 1.0/7.0;
+    a = a * zz + 1.0/5.0;
+    a = a * zz - 1.0/3.0;
+    a = a * zz + 1.0;
+    a = a * z + (big ? 0.25 * FAST_PI : 0.0);
+
+    /* Undo the octant reduction */
+    a = ay > ax ? 0.5 * FAST_PI - a : a;
+    a = x < 0.0 ? FAST_PI - a : a;
+    a = y < 0.0 ? 2.0 * FAST_PI - a : a;
+
+    return (180.0/FAST_PI) * a;
+}
+
+/* Return sin() and cos() of an angle in degrees */
+static void icmFastSinCosDeg(double *ps, double *pc, double deg) {
+    double r, q, f, ff, s, c, ts;
+    int iq;
+
+    /* Reduce to -45 .. 45 degrees and a quadrant */
+    r = deg * (1.0/90.0);
+    q = floor(r + 0.5);
+    f = (r - q) * (0.5 * FAST_PI);        /* -PI/4 .. PI/4 */
+    iq = ((int)q) & 3;
+    ff = f * f;
+
+    /* sin & cos series to f^15 & f^16, error < 1e-15 */
+    s = 1.0/1307674368000.0;
+    s = -s * ff + 1.0/6227020800.0;
+    s = s * ff - 1.0/39916800.0;
+    s = s * ff + 1.0/362880.0;
+    s = s * ff - 1.0/5040.0;
+    s = s * ff + 1.0/120.0;
+    s = s * ff - 1.0/6.0;
+    s = (s * ff + 1.0) * f;
+
+    c = 1.0/20922789888000.0;
+    c = c * ff - 1.0/87178291200.0;
+    c = c * ff + 1.0/479001600.0;
+    c = c * ff - 1.0/3628800.0;
+    c = c * ff + 1.0/40320.0;
+    c = c * ff - 1.0/720.0;
+    c = c * ff + 1.0/24.0;
+    c = c * ff - 0.5;
+    c = c * ff + 1.0;
+
+    /* Rotate by the quadrant */
+    ts = s;
+    s = (iq & 1) ? c : s;
+    c = (iq & 1) ? -ts : c;
+    s = (iq & 2) ? -s : s;
+    c = (iq & 2) ? -c : c;
+
+    *ps = s;
+    *pc = c;
+}
+
+/* Return exp(-x) for x >= 0.0, 0.0 for x > 40.0 */
+static double icmFastExpNeg(double x) {
+    double y, e;
+
+    y = (x > 40.0 ? 40.0 : x) * (1.0/32.0);        /* 0 .. 1.25 */
+
+    /* exp(-y) series to y^16 */
+    e = 1.0/20922789888000.0;
+    e = -e * y + 1.0/1307674368000.0;
+    e = -e * y + 1.0/87178291200.0;
+    e = -e * y + 1.0/6227020800.0;
+    e = -e * y + 1.0/479001600.0;
+    e = -e * y + 1.0/39916800.0;
+    e = -e * y + 1.0/3628800.0;
+    e = -e * y + 1.0/362880.0;
+    e = -e * y + 1.0/40320.0;
+    e = -e * y + 1.0/5040.0;
+    e = -e * y + 1.0/720.0;
+    e = -e * y + 1.0/120.0;
+    e = -e * y + 1.0/24.0;
+    e = -e * y + 1.0/6.0;
+    e = -e * y + 0.5;
+    e = -e * y + 1.0;
+    e = -e * y + 1.0;
+
+    /* exp(-x) = exp(-x/32) ^ 32 */
+    e *= e;
+    e *= e;
+    e *= e;
+    e *= e;
+    e *= e;
+
+    return x > 40.0 ? 0.0 : e;
+}
+
+#undef FAST_PI
 
-        dL = Lab1[0] - Lab0[0];
-        dC = C2 - C1;
-        if (C1 < 1e-9 || C2 < 1e-9) {
-            dh = 0.0;
-        } else {
-            dh = h2 - h1;
-            if (dh > 180.0)
-                dh -= 360.0;
-            else if (dh < -180.0)
-                dh += 360.0;
-        }
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* CIE Y (range 0 .. 1) to perceptual CIE 1976 L* (range 0 .. 100) */
+double
+icmY2L(double val) {
+    if (val > 0.008856451586)
+        val = pow(val,1.0/3.0);
+    else
+        val = 7.787036979 * val + 16.0/116.0;
 
-        dH = 2.0 * sqrt(C1 * C2) * sin(DEG2RAD(0.5 * dh));
-    }
+    val = (116.0 * val - 16.0);
+    return val;
+}
 
-    {
-        double L, C, h, T;
-        double hh, ddeg;
-        double C7, RC, L50sq, SL, SC, SH, RT;
-        double dLsq, dCsq, dHsq, RCH;
+/* Perceptual CIE 1976 L* (range 0 .. 100) to CIE Y (range 0 .. 1) */
+double
+icmL2Y(double val) {
+    val = (val + 16.0)/116.0;
 
-        L = 0.5 * (Lab0[0]  + Lab1[0]);
-        C = 0.5 * (C1 + C2);
-        if (C1 < 1e-9 || C2 < 1e-9) {
-            h = h1 + h2;
-        } else {
-            h = h1 + h2;
-            if (fabs(h1 - h2) > 180.0) {
-                if (h < 360.0)
-                    h += 360.0;
-                else if (h >= 360.0)
-                    h -= 360.0;
-            }
-            h *= 0.5;
-        }
-        T = 1.0 - 0.17 * cos(DEG2RAD(h-30.0)) + 0.24 * cos(DEG2RAD(2.0 * h))
-          + 0.32 * cos(DEG2RAD(3.0 * h + 6.0)) - 0.2 * cos(DEG2RAD(4.0 * h - 63.0));
-        hh = (h - 275.0)/25.0;
-        ddeg = 30.0 * exp(-hh * hh);
-        C7 = pow(C,7.0);
-        RC = 2.0 * sqrt(C7/(C7 + 6103515625.0));
-        L50sq = (L - 50.0) * (L - 50.0);
-        SL = 1.0 + (0.015 * L50sq)/sqrt(20.0 + L50sq);
-        SC = 1.0 + 0.045 * C;
-        SH = 1.0 + 0.015 * C * T;
-        RT = -sin(DEG2RAD(2 * ddeg)) * RC;
+    if (val > 24.0/116.0)
+        val = pow(val,3.0);
+    else
+        val = (val - 16.0/116.0)/7.787036979;
+    return val;
+}
 
-        dLsq = dL/SL;
-        dCsq = dC/SC;
-        dHsq = dH/SH;
+/* CIE XYZ to perceptual CIE 1976 L*a*b* */
+void
+icmXYZ2Lab(icmXYZNumber *w, double *out, double *in) {
+    double X = in[0], Y = in[1], Z = in[2];
+    double x,y,z,fx,fy,fz;
 
-        RCH = RT * dCsq * dHsq;
+    x = X/w->X;
+    y = Y/w->Y;
+    z = Z/w->Z;
 
-        dLsq *= dLsq;
-        dCsq *= dCsq;
-        dHsq *= dHsq;
+    if (x > 0.008856451586)
+        fx = pow(x,1.0/3.0);
+    else
+        fx = 7.787036979 * x + 16.0/116.0;
 
-        dsq = dLsq + dCsq + dHsq + RCH;
-    }
+    if (y > 0.008856451586)
+        fy = pow(y,1.0/3.0);
+    else
+        fy = 7.787036979 * y + 16.0/116.0;
 
-    return dsq;
+    if (z > 0.008856451586)
+        fz = pow(z,1.0/3.0);
+    else
+        fz = 7.787036979 * z + 16.0/116.0;
 
-#undef RAD2DEG
-#undef DEG2RAD
+    out[0] = 116.0 * fy - 16.0;
+    out[1] = 500.0 * (fx - fy);
+    out[2] = 200.0 * (fy - fz);
 }
 
-/* Return the CIE2DE000 Delta E color difference measure for two Lab values */
-double icmCIE2K(double *Lab0, double *Lab1) {
-    return sqrt(icmCIE2Ksq(Lab0, Lab1));
-}
+/* Perceptual CIE 1976 L*a*b* to CIE XYZ */
+void
+icmLab2XYZ(icmXYZNumber *w, double *out, double *in) {
+    double L = in[0], a = in[1], b = in[2];
+    double x,y,z,fx,fy,fz;
 
-/* Return the CIEDE2000 Delta E color difference measure for two XYZ values */
-extern ICCLIB_API double icmXYZCIE2K(icmXYZNumber *w, double *in0, double *in1) {
-    double lab0[3], lab1[3];
+    fy = (L + 16.0)/116.0;
+    fx = a/500.0 + fy;
+    fz = fy - b/200.0;
 
-    icmXYZ2Lab(w, lab0, in0);
-    icmXYZ2Lab(w, lab1, in1);
-    return sqrt(icmCIE2Ksq(lab0, lab1));
-}
+    if (fy > 24.0/116.0)
+        y = pow(fy,3.0);
+    else
+        y = (fy - 16.0/116.0)/7.787036979;
 
+    if (fx > 24.0/116.0)
+        x = pow(fx,3.0);
+    else
+        x = (fx - 16.0/116.0)/7.787036979;
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Chromatic adaptation transform utility */
-/* Return a 3x3 chromatic adaptation matrix */
-/* Use icmMulBy3x3(dst, mat, src) */
-void icmChromAdaptMatrix(
-    int flags,                /* Use bradford, Transform given matrix flags */
-    icmXYZNumber d_wp,        /* Destination white point */
-    icmXYZNumber s_wp,        /* Source white point */
-    double mat[3][3]        /* Destination matrix */
-) {
-    double dst[3], src[3];            /* Source & destination white points */
-    double vkmat[3][3];                /* Von Kries matrix */
-#ifdef NEVER
-    static double bradford[3][3] = {    /* Linear cone space matrix */
-        {  1.0,  0.0, 0.0 },
-        {  0.0,  1.0, 0.0 },
-        {  0.0,  0.0, 1.0 }
-    };
-#endif /* NEVER */
-    static double bradford[3][3] = {    /* Bradford cone space matrix */
-        {  0.8951,  0.2664, -0.1614 },
-        { -0.7502,  1.7135,  0.0367 },
-        {  0.0389, -0.0685,  1.0296 }
-    };
-    static int inited = 0;            /* Compute inverse bradford once */
-    static double ibradford[3][3];    /* Inverse Bradford */
+    if (fz > 24.0/116.0)
+        z = pow(fz,3.0);
+    else
+        z = (fz - 16.0/116.0)/7.787036979;
 
-    /* Set initial matrix to unity */
-    if (!(flags & ICM_CAM_MULMATRIX)) {
-        icmSetUnity3x3(mat);
-    }
+    out[0] = x * w->X;
+    out[1] = y * w->Y;
+    out[2] = z * w->Z;
+}
 
-    icmXYZ2Ary(src, s_wp);
-    icmXYZ2Ary(dst, d_wp);
 
-    if (flags & ICM_CAM_BRADFORD) {
-        icmMulBy3x3(src, bradford, src);
-        icmMulBy3x3(dst, bradford, dst);
-    }
+/* LCh to Lab */
+void icmLCh2Lab(double *out, double *in) {
+    double C, h;
 
-    /* Setup the Von Kries white point adaptation matrix */
-    vkmat[0][0] = dst[0]/src[0];
-    vkmat[1][1] = dst[1]/src[1];
-    vkmat[2][2] = dst[2]/src[2];
-    vkmat[0][1] = vkmat[0][2] = 0.0;
-    vkmat[1][0] = vkmat[1][2] = 0.0;
-    vkmat[2][0] = vkmat[2][1] = 0.0;
+    C = in[1];
+    h = 3.14159265359/180.0 * in[2];
 
-    /* Transform to Bradford space if requested */
-    if (flags & ICM_CAM_BRADFORD) {
-        icmMul3x3(mat, bradford);
-    }
+    out[0] = in[0];
+    out[1] = C * cos(h);
+    out[2] = C * sin(h);
+}
 
-    /* Apply chromatic adaptation */
-    icmMul3x3(mat, vkmat);
+/* Lab to LCh */
+void icmLab2LCh(double *out, double *in) {
+    double C, h;
 
-    /* Transform from Bradford space */
-    if (flags & ICM_CAM_BRADFORD) {
-        if (inited == 0) {
-            icmInverse3x3(ibradford, bradford);
-            inited = 1;
-        }
-        icmMul3x3(mat, ibradford);
-    }
+    C = sqrt(in[1] * in[1] + in[2] * in[2]);
 
-    /* We're done */
+    h = (180.0/3.14159265359) * atan2(in[2], in[1]);
+    h = (h < 0.0) ? h + 360.0 : h;
+
+    out[0] = in[0];
+    out[1] = C;
+    out[2] = h;
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* XYZ to Yxy */
+extern ICCLIB_API void icmXYZ2Yxy(double *out, double *in) {
+    double sum = in[0] + in[1] + in[2];
+    double Y, x, y;
 
-/* RGB primaries device to RGB->XYZ transform matrix. */
-/* We assume that the device is perfectly additive, but that */
-/* there may be a scale factor applied to the channels to */
-/* match the white point at RGB = 1. */
+    if (sum < 1e-9) {
+        Y = 0.0;
+        y = 0.0;
+        x = 0.0;
+    } else {
+        Y = in[1];
+        x = in[0]/sum;
+        y = in[1]/sum;
+    }
+    out[0] = Y;
+    out[1] = x;
+    out[2] = y;
+}
 
-/* Return non-zero if matrix would be singular */
-int icmRGBprim2matrix(
-    icmXYZNumber white,        /* White point */
-    icmXYZNumber red,        /* Red colorant */
-    icmXYZNumber green,        /* Green colorant */
-    icmXYZNumber blue,        /* Blue colorant */
-    double mat[3][3]        /* Destination matrix */
-) {
-    double tmat[3][3];
-    double t[3];
+/* Yxy to XYZ */
+extern ICCLIB_API void icmYxy2XYZ(double *out, double *in) {
+    double Y = in[0];
+    double x = in[1];
+    double y = in[2];
+    double z = 1.0 - x - y;
+    double sum;
+    if (y < 1e-9) {
+        out[0] = out[1] = out[2] = 0.0;
+    } else {
+        sum = Y/y;
+        out[0] = x * sum;
+        out[1] = Y;
+        out[2] = z * sum;
+    }
+}
 
-    /* Assemble the colorants into a matrix */
-    tmat[0][0] = red.X;
-    tmat[0][1] = green.X;
-    tmat[0][2] = blue.X;
-    tmat[1][0] = red.Y;
-    tmat[1][1] = green.Y;
-    tmat[1][2] = blue.Y;
-    tmat[2][0] = red.Z;
-    tmat[2][1] = green.Z;
-    tmat[2][2] = blue.Z;
 
-    /* Compute the inverse */
-    if (icmInverse3x3(mat, tmat))
-        return 1;
+/* CIE XYZ to perceptual CIE 1976 L*u*v* */
+extern ICCLIB_API void icmXYZ2Luv(icmXYZNumber *w, double *out, double *in) {
+    double X = in[0], Y = in[1], Z = in[2];
+    double un, vn, u, v, fl, fu, fv;
 
-    /* Compute scale vector that maps colorants to white point */
-    t[0] = mat[0][0] * white.X 
-         + mat[0][1] * white.Y 
-         + mat[0][2] * white.Z; 
-    t[1] = mat[1][0] * white.X 
-         + mat[1][1] * white.Y 
-         + mat[1][2] * white.Z; 
-    t[2] = mat[2][0] * white.X 
-         + mat[2][1] * white.Y 
-         + mat[2][2] * white.Z; 
+    un = (4.0 * w->X) / (w->X + 15.0 * w->Y + 3.0 * w->Z);
+    vn = (9.0 * w->Y) / (w->X + 15.0 * w->Y + 3.0 * w->Z);
+    u = (4.0 * X) / (X + 15.0 * Y + 3.0 * Z);
+    v = (9.0 * Y) / (X + 15.0 * Y + 3.0 * Z);
+    
+    Y /= w->Y;
 
-    /* Now formulate the transform matrix */
-    mat[0][0] = red.X   * t[0];
-    mat[0][1] = green.X * t[1];
-    mat[0][2] = blue.X  * t[2];
-    mat[1][0] = red.Y   * t[0];
-    mat[1][1] = green.Y * t[1];
-    mat[1][2] = blue.Y  * t[2];
-    mat[2][0] = red.Z   * t[0];
-    mat[2][1] = green.Z * t[1];
-    mat[2][2] = blue.Z  * t[2];
+    if (Y > 0.008856451586)
+        fl = pow(Y,1.0/3.0);
+    else
+        fl = 7.787036979 * Y + 16.0/116.0;
 
-    return 0;
+    fu = u - un;
+    fv = v - vn;
+
+    out[0] = 116.0 * fl - 16.0;
+    out[1] = 13.0 * out[0] * fu;
+    out[2] = 13.0 * out[0] * fv;
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Some PCS utility functions */
+/* Perceptual CIE 1976 L*u*v* to CIE XYZ */
+extern ICCLIB_API void icmLuv2XYZ(icmXYZNumber *w, double *out, double *in) {
+    double un, vn, u, v, fl, fu, fv, sum, X, Y, Z;
 
-/* Clip Lab, while maintaining hue angle. */
-/* Return nz if clipping occured */
-int icmClipLab(double out[3], double in[3]) {
-    double C;
+    fl = (in[0] + 16.0)/116.0;
+    fu = in[1] / (13.0 * in[0]);
+    fv = in[2] / (13.0 * in[0]);
 
-    out[0] = in[0];
-    out[1] = in[1];
-    out[2] = in[2];
+    un = (4.0 * w->X) / (w->X + 15.0 * w->Y + 3.0 * w->Z);
+    vn = (9.0 * w->Y) / (w->X + 15.0 * w->Y + 3.0 * w->Z);
 
-    if (out[0] >= 0.0 && out[0] <= 100.0
-     && out[1] >= -128.0 && out[1] <= 127.0
-     && out[2] >= -128.0 && out[2] <= 127.0)
-        return 0;
+    u = fu + un;
+    v = fv + vn;
 
-    /* Clip L */
-    if (out[0] < 0.0)
-        out[0] = 0.0;
-    else if (out[0] > 100.0)
-        out[0] = 100.0;
-    
-    C = out[1];
-    if (fabs(out[2]) > fabs(C))
-        C = out[2];
-    if (C < -128.0 || C > 127.0) {
-        if (C < 0.0)
-            C = -128.0/C;
-        else
-            C = 127.0/C;
-        out[1] *= C;
-        out[2] *= C;
-    }
+    if (fl > 24.0/116.0)
+        Y = pow(fl,3.0);
+    else
+        Y = (fl - 16.0/116.0)/7.787036979;
+    Y *= w->Y;
 
-    return 1;
+    sum = (9.0 * Y)/v;
+    X = (u * sum)/4.0;
+    Z = (sum - X - 15.0 * Y)/3.0;
+
+    out[0] = X;
+    out[1] = Y;
+    out[2] = Z;
 }
 
-/* Clip XYZ, while maintaining hue angle */
-/* Return nz if clipping occured */
-int icmClipXYZ(double out[3], double in[3]) {
-    out[0] = in[0];
-    out[1] = in[1];
-    out[2] = in[2];
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Array versions of the color conversions. icmLuLookupPix() uses */
+/* the XYZ <-> Lab ones to convert a whole chunk of PCS values at once. */
 
-    if (out[0] >= 0.0 && out[0] <= 1.9999
-     && out[1] >= 0.0 && out[1] <= 1.9999
-     && out[2] >= 0.0 && out[2] <= 1.9999)
-        return 0;
+/* The _n versions convert n interleaved triples, and the _p versions */
+/* convert n values held in three separate planes. out may be the same */
+/* as in. The fast approximations are used in place of pow() and the */
+/* trigonometric functions, and black is handled without NaNs. */
 
-    /* Clip Y and scale X and Z similarly */
+/* White point dependent constants */
+typedef struct {
+    double wX, wY, wZ;            /* White point */
+    double rX, rY, rZ;            /* 1/white point */
+    double un, vn;                /* White point u', v' */
+} icmWhiteC;
 
-    if (out[1] > 1.9999) {
-        out[0] *= 1.9999/out[1];
-        out[2] *= 1.9999/out[1];
-        out[1] = 1.9999;
-    } else if (out[1] < 0.0) {
-        out[0] = 0.0;
-        out[1] = 0.0;
-        out[2] = 0.0;
-    }
+static void icmWhiteC_init(icmWhiteC *c, icmXYZNumber *w) {
+    c->wX = w->X;
+    c->wY = w->Y;
+    c->wZ = w->Z;
+    c->rX = 1.0/w->X;
+    c->rY = 1.0/w->Y;
+    c->rZ = 1.0/w->Z;
+    c->un = (4.0 * w->X) / (w->X + 15.0 * w->Y + 3.0 * w->Z);
+    c->vn = (9.0 * w->Y) / (w->X + 15.0 * w->Y + 3.0 * w->Z);
+}
 
-    if (out[0] < 0.0 || out[0] > 1.9999
-     || out[2] < 0.0 || out[2] > 1.9999) {
-        double D50[3] = { 0.9642, 1.0000, 0.8249 };
-        double bb = 0.0;
+/* L*a*b* forward and inverse non-linearity */
+static double icmLabF(double t) {
+    double ct = icmFastCbrt(t > 0.008856451586 ? t : 1.0);
+    return t > 0.008856451586 ? ct : 7.787036979 * t + 16.0/116.0;
+}
 
-        /* Scale the D50 so that it has the same Y value as our color */
-        D50[0] *= out[1];
-        D50[1] *= out[1];
-        D50[2] *= out[1];
+static double icmLabFinv(double f) {
+    return f > 24.0/116.0 ? f * f * f : (f - 16.0/116.0)/7.787036979;
+}
 
-        /* Figure out what blend factor with Y scaled D50, brings our */
-        /* color X and Z values into range */
+static void icmXYZ2Lab_e(icmWhiteC *c, double out[3], double in[3]) {
+    double fx, fy, fz;
 
-        if (out[0] < 0.0) {
-            double b;
-            b = (0.0 - out[0])/(D50[0] - out[0]);
-            if (b > bb)
-                bb = b;
-        } else if (out[0] > 1.9999) {
-            double b;
-            b = (1.9999 - out[0])/(D50[0] - out[0]);
-            if (b > bb)
-                bb = b;
-        }
-        if (out[2] < 0.0) {
-            double b;
-            b = (0.0 - out[2])/(D50[2] - out[2]);
-            if (b > bb)
-                bb = b;
-        } else if (out[2] > 1.9999) {
-            double b;
-            b = (1.9999 - out[2])/(D50[2] - out[2]);
-            if (b > bb)
-                bb = b;
-        }
-        /* Do the desaturation */
-        out[0] = D50[0] * bb + (1.0 - bb) * out[0];
-        out[2] = D50[2] * bb + (1.0 - bb) * out[2];
-    }
-    return 1;
+    fx = icmLabF(in[0] * c->rX);
+    fy = icmLabF(in[1] * c->rY);
+    fz = icmLabF(in[2] * c->rZ);
+
+    out[0] = 116.0 * fy - 16.0;
+    out[1] = 500.0 * (fx - fy);
+    out[2] = 200.0 * (fy - fz);
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
+static void icmLab2XYZ_e(icmWhiteC *c, double out[3], double in[3]) {
+    double fx, fy, fz;
 
-/* Object for computing RFC 1321 MD5 checksums. */
-/* Derived from Colin Plumb's 1993 public domain code. */
+    fy = (in[0] + 16.0)/116.0;
+    fx = in[1]/500.0 + fy;
+    fz = fy - in[2]/200.0;
 
-/* Reset the checksum */
-static void icmMD5_reset(icmMD5 *p) {
-    p->tlen = 0;
+    out[0] = icmLabFinv(fx) * c->wX;
+    out[1] = icmLabFinv(fy) * c->wY;
+    out[2] = icmLabFinv(fz) * c->wZ;
+}
 
-    p->sum[0] = 0x67452301;
-    p->sum[1] = 0xefcdab89;
-    p->sum[2] = 0x98badcfe;
-    p->sum[3] = 0x10325476;
+static void icmLab2LCh_e(double out[3], double in[3]) {
+    double L = in[0], a = in[1], b = in[2];
 
-    p->fin = 0;
+    out[0] = L;
+    out[1] = sqrt(a * a + b * b);
+    out[2] = icmFastAtan2Deg(b, a);
+    out[2] = out[2] >= 360.0 ? out[2] - 360.0 : out[2];
 }
 
-#define F1(x, y, z) (z ^ (x & (y ^ z)))
-#define F2(x, y, z) F1(z, x, y)
-#define F3(x, y, z) (x ^ y ^ z)
-#define F4(x, y, z) (y ^ (x | ~z))
-
-#define MD5STEP(f, w, x, y, z, pp, xtra, s) \
-        data = (pp)[0] + ((pp)[3] << 24) + ((pp)[2] << 16) + ((pp)[1] << 8); \
-        w += f(x, y, z) + data + xtra; \
-        w = (w << s) | (w >> (32-s)); \
-        w += x;
+static void icmLCh2Lab_e(double out[3], double in[3]) {
+    double L = in[0], C = in[1], s, c;
 
-/* Add another 64 bytes to the checksum */
-static void icmMD5_accume(icmMD5 *p, ORD8 *in) {
-    ORD32 data, a, b, c, d;
+    icmFastSinCosDeg(&s, &c, in[2]);
+    out[0] = L;
+    out[1] = C * c;
+    out[2] = C * s;
+}
 
-    a = p->sum[0];
-    b = p->sum[1];
-    c = p->sum[2];
-    d = p->sum[3];
+static void icmXYZ2Yxy_e(double out[3], double in[3]) {
+    double X = in[0], Y = in[1], sum;
+    int blk;
 
-    MD5STEP(F1, a, b, c, d, in + (4 * 0),  0xd76aa478, 7);
-    MD5STEP(F1, d, a, b, c, in + (4 * 1),  0xe8c7b756, 12);
-    MD5STEP(F1, c, d, a, b, in + (4 * 2),  0x242070db, 17);
-    MD5STEP(F1, b, c, d, a, in + (4 * 3),  0xc1bdceee, 22);
-    MD5STEP(F1, a, b, c, d, in + (4 * 4),  0xf57c0faf, 7);
-    MD5STEP(F1, d, a, b, c, in + (4 * 5),  0x4787c62a, 12);
-    MD5STEP(F1, c, d, a, b, in + (4 * 6),  0xa8304613, 17);
-    MD5STEP(F1, b, c, d, a, in + (4 * 7),  0xfd469501, 22);
-    MD5STEP(F1, a, b, c, d, in + (4 * 8),  0x698098d8, 7);
-    MD5STEP(F1, d, a, b, c, in + (4 * 9),  0x8b44f7af, 12);
-    MD5STEP(F1, c, d, a, b, in + (4 * 10), 0xffff5bb1, 17);
-    MD5STEP(F1, b, c, d, a, in + (4 * 11), 0x895cd7be, 22);
-    MD5STEP(F1, a, b, c, d, in + (4 * 12), 0x6b901122, 7);
-    MD5STEP(F1, d, a, b, c, in + (4 * 13), 0xfd987193, 12);
-    MD5STEP(F1, c, d, a, b, in + (4 * 14), 0xa679438e, 17);
-    MD5STEP(F1, b, c, d, a, in + (4 * 15), 0x49b40821, 22);
-
-    MD5STEP(F2, a, b, c, d, in + (4 * 1),  0xf61e2562, 5);
-    MD5STEP(F2, d, a, b, c, in + (4 * 6),  0xc040b340, 9);
-    MD5STEP(F2, c, d, a, b, in + (4 * 11), 0x265e5a51, 14);
-    MD5STEP(F2, b, c, d, a, in + (4 * 0),  0xe9b6c7aa, 20);
-    MD5STEP(F2, a, b, c, d, in + (4 * 5),  0xd62f105d, 5);
-    MD5STEP(F2, d, a, b, c, in + (4 * 10), 0x02441453, 9);
-    MD5STEP(F2, c, d, a, b, in + (4 * 15), 0xd8a1e681, 14);
-    MD5STEP(F2, b, c, d, a, in + (4 * 4),  0xe7d3fbc8, 20);
-    MD5STEP(F2, a, b, c, d, in + (4 * 9),  0x21e1cde6, 5);
-    MD5STEP(F2, d, a, b, c, in + (4 * 14), 0xc33707d6, 9);
-    MD5STEP(F2, c, d, a, b, in + (4 * 3),  0xf4d50d87, 14);
-    MD5STEP(F2, b, c, d, a, in + (4 * 8),  0x455a14ed, 20);
-    MD5STEP(F2, a, b, c, d, in + (4 * 13), 0xa9e3e905, 5);
-    MD5STEP(F2, d, a, b, c, in + (4 * 2),  0xfcefa3f8, 9);
-    MD5STEP(F2, c, d, a, b, in + (4 * 7),  0x676f02d9, 14);
-    MD5STEP(F2, b, c, d, a, in + (4 * 12), 0x8d2a4c8a, 20);
-
-    MD5STEP(F3, a, b, c, d, in + (4 * 5),  0xfffa3942, 4);
-    MD5STEP(F3, d, a, b, c, in + (4 * 8),  0x8771f681, 11);
-    MD5STEP(F3, c, d, a, b, in + (4 * 11), 0x6d9d6122, 16);
-    MD5STEP(F3, b, c, d, a, in + (4 * 14), 0xfde5380c, 23);
-    MD5STEP(F3, a, b, c, d, in + (4 * 1),  0xa4beea44, 4);
-    MD5STEP(F3, d, a, b, c, in + (4 * 4),  0x4bdecfa9, 11);
-    MD5STEP(F3, c, d, a, b, in + (4 * 7),  0xf6bb4b60, 16);
-    MD5STEP(F3, b, c, d, a, in + (4 * 10), 0xbebfbc70, 23);
-    MD5STEP(F3, a, b, c, d, in + (4 * 13), 0x289b7ec6, 4);
-    MD5STEP(F3, d, a, b, c, in + (4 * 0),  0xeaa127fa, 11);
-    MD5STEP(F3, c, d, a, b, in + (4 * 3),  0xd4ef3085, 16);
-    MD5STEP(F3, b, c, d, a, in + (4 * 6),  0x04881d05, 23);
-    MD5STEP(F3, a, b, c, d, in + (4 * 9),  0xd9d4d039, 4);
-    MD5STEP(F3, d, a, b, c, in + (4 * 12), 0xe6db99e5, 11);
-    MD5STEP(F3, c, d, a, b, in + (4 * 15), 0x1fa27cf8, 16);
-    MD5STEP(F3, b, c, d, a, in + (4 * 2),  0xc4ac5665, 23);
-
-    MD5STEP(F4, a, b, c, d, in + (4 * 0),  0xf4292244, 6);
-    MD5STEP(F4, d, a, b, c, in + (4 * 7),  0x432aff97, 10);
-    MD5STEP(F4, c, d, a, b, in + (4 * 14), 0xab9423a7, 15);
-    MD5STEP(F4, b, c, d, a, in + (4 * 5),  0xfc93a039, 21);
-    MD5STEP(F4, a, b, c, d, in + (4 * 12), 0x655b59c3, 6);
-    MD5STEP(F4, d, a, b, c, in + (4 * 3),  0x8f0ccc92, 10);
-    MD5STEP(F4, c, d, a, b, in + (4 * 10), 0xffeff47d, 15);
-    MD5STEP(F4, b, c, d, a, in + (4 * 1),  0x85845dd1, 21);
-    MD5STEP(F4, a, b, c, d, in + (4 * 8),  0x6fa87e4f, 6);
-    MD5STEP(F4, d, a, b, c, in + (4 * 15), 0xfe2ce6e0, 10);
-    MD5STEP(F4, c, d, a, b, in + (4 * 6),  0xa3014314, 15);
-    MD5STEP(F4, b, c, d, a, in + (4 * 13), 0x4e0811a1, 21);
-    MD5STEP(F4, a, b, c, d, in + (4 * 4),  0xf7537e82, 6);
-    MD5STEP(F4, d, a, b, c, in + (4 * 11), 0xbd3af235, 10);
-    MD5STEP(F4, c, d, a, b, in + (4 * 2),  0x2ad7d2bb, 15);
-    MD5STEP(F4, b, c, d, a, in + (4 * 9),  0xeb86d391, 21);
+    sum = in[0] + in[1] + in[2];
+    blk = sum < 1e-9;
+    sum = blk ? 1.0 : sum;
 
-    p->sum[0] += a;
-    p->sum[1] += b;
-    p->sum[2] += c;
-    p->sum[3] += d;
+    out[0] = blk ? 0.0 : Y;
+    out[1] = blk ? 0.0 : X/sum;
+    out[2] = blk ? 0.0 : Y/sum;
 }
 
-#undef F1
-#undef F2
-#undef F3
-#undef F4
-#undef MD5STEP
+static void icmYxy2XYZ_e(double out[3], double in[3]) {
+    double Y = in[0], x = in[1], y = in[2], sum;
+    int blk;
 
-/* Add some bytes */
-static void icmMD5_add(icmMD5 *p, ORD8 *ibuf, unsigned int len) {
-    unsigned int bs;
+    blk = y < 1e-9;
+    sum = Y/(blk ? 1.0 : y);
 
-    if (p->fin)
-        return;                /* This is actually an error */
+    out[0] = blk ? 0.0 : x * sum;
+    out[1] = blk ? 0.0 : Y;
+    out[2] = blk ? 0.0 : (1.0 - x - y) * sum;
+}
 
-    bs = p->tlen;            /* Current bytes added */
-    p->tlen = bs + len;        /* Update length after adding this buffer */
-    bs &= 0x3f;                /* Bytes already in buffer */
+static void icmXYZ2Luv_e(icmWhiteC *c, double out[3], double in[3]) {
+    double X = in[0], Y = in[1], Z = in[2];
+    double den, u, v, L;
+    int blk;
 
-    /* Deal with any existing partial bytes in p->buf */
-    if (bs) {
-        ORD8 *np = (ORD8 *)p->buf + bs;    /* Next free location in partial buffer */
+    den = X + 15.0 * Y + 3.0 * Z;
+    blk = den < 1e-12;
+    den = blk ? 1.0 : den;
+    u = blk ? c->un : (4.0 * X) / den;
+    v = blk ? c->vn : (9.0 * Y) / den;
 
-        bs = 64 - bs;        /* Free space in partial buffer */
+    L = 116.0 * icmLabF(Y * c->rY) - 16.0;
+    out[0] = L;
+    out[1] = 13.0 * L * (u - c->un);
+    out[2] = 13.0 * L * (v - c->vn);
+}
 
-        if (len < bs) {        /* Not enought new to make a full buffer */
-            memmove(np, ibuf, len);
-            return;
-        }
+static void icmLuv2XYZ_e(icmWhiteC *c, double out[3], double in[3]) {
+    double L = in[0], u, v, Y, sum, X;
+    int blk;
 
-        memmove(np, ibuf, bs);    /* Now got one full buffer */
-        icmMD5_accume(p, np);
-        ibuf += bs;
-        len -= bs;
-    }
+    blk = L < 1e-9;
+    L = blk ? 1.0 : L;
+    u = in[1] / (13.0 * L) + c->un;
+    v = in[2] / (13.0 * L) + c->vn;
+    blk = blk || v < 1e-12;
+    v = blk ? 1.0 : v;
 
-    /* Deal with input data 64 bytes at a time */
-    while (len >= 64) {
-        icmMD5_accume(p, ibuf);
-        ibuf += 64;
-        len -= 64;
-    }
+    Y = icmLabFinv((L + 16.0)/116.0) * c->wY;
+    sum = (9.0 * Y)/v;
+    X = (u * sum)/4.0;
 
-    /* Deal with any remaining bytes */
-    memmove(p->buf, ibuf, len);
+    out[0] = blk ? 0.0 : X;
+    out[1] = blk ? 0.0 : Y;
+    out[2] = blk ? 0.0 : (sum - X - 15.0 * Y)/3.0;
 }
 
-/* Finalise the checksum and return the result. */
-static void icmMD5_get(icmMD5 *p, ORD8 chsum[16]) {
-    int i;
-    unsigned count;
-    ORD32 bits1, bits0;
-    ORD8 *pp;
+/* CIE XYZ to perceptual Lab */
+void icmXYZ2Lab_n(icmXYZNumber *w, double *out, double *in, unsigned int n) {
+    icmWhiteC c;
+    unsigned int i;
 
-    if (p->fin == 0) {
-    
-        /* Compute number of bytes processed mod 64 */
-        count = p->tlen & 0x3f;
+    icmWhiteC_init(&c, w);
+    for (i = 0; i < n; i++, out += 3, in += 3)
+        icmXYZ2Lab_e(&c, out, in);
+}
 
-        /* Set the first char of padding to 0x80.  This is safe since there is
-           always at least one byte free */
-        pp = p->buf + count;
-        *pp++ = 0x80;
+void icmXYZ2Lab_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n) {
+    icmWhiteC c;
+    unsigned int i;
 
-        /* Bytes of padding needed to make 64 bytes */
-        count = 64 - 1 - count;
+    icmWhiteC_init(&c, w);
+    for (i = 0; i < n; i++) {
+        double tt[3];
+        tt[0] = in[0][i]; tt[1] = in[1][i]; tt[2] = in[2][i];
+        icmXYZ2Lab_e(&c, tt, tt);
+        out[0][i] = tt[0]; out[1][i] = tt[1]; out[2][i] = tt[2];
+    }
+}
 
-        /* Pad out to 56 mod 64, allowing 8 bytes for length in bits. */
-        if (count < 8) {    /* Not enough space for padding and length */
+/* Perceptual Lab to CIE XYZ */
+void icmLab2XYZ_n(icmXYZNumber *w, double *out, double *in, unsigned int n) {
+    icmWhiteC c;
+    unsigned int i;
 
-            memset(pp, 0, count);
-            icmMD5_accume(p, p->buf);
+    icmWhiteC_init(&c, w);
+    for (i = 0; i < n; i++, out += 3, in += 3)
+        icmLab2XYZ_e(&c, out, in);
+}
 
-            /* Now fill the next block with 56 bytes */
-            memset(p->buf, 0, 56);
-        } else {
-            /* Pad block to 56 bytes */
-            memset(pp, 0, count - 8);
-        }
+void icmLab2XYZ_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n) {
+    icmWhiteC c;
+    unsigned int i;
 
-        /* Compute number of bits */
-        bits1 = 0x7 & (p->tlen >> (32 - 3)); 
-        bits0 = p->tlen << 3;
+    icmWhiteC_init(&c, w);
+    for (i = 0; i < n; i++) {
+        double tt[3];
+        tt[0] = in[0][i]; tt[1] = in[1][i]; tt[2] = in[2][i];
+        icmLab2XYZ_e(&c, tt, tt);
+        out[0][i] = tt[0]; out[1][i] = tt[1]; out[2][i] = tt[2];
+    }
+}
 
-        /* Append number of bits */
-        p->buf[64 - 8] = bits0 & 0xff; 
-        p->buf[64 - 7] = (bits0 >> 8) & 0xff; 
-        p->buf[64 - 6] = (bits0 >> 16) & 0xff; 
-        p->buf[64 - 5] = (bits0 >> 24) & 0xff; 
-        p->buf[64 - 4] = bits1 & 0xff; 
-        p->buf[64 - 3] = (bits1 >> 8) & 0xff; 
-        p->buf[64 - 2] = (bits1 >> 16) & 0xff; 
-        p->buf[64 - 1] = (bits1 >> 24) & 0xff; 
+/* Lab to LCh */
+void icmLab2LCh_n(double *out, double *in, unsigned int n) {
+    unsigned int i;
 
-        icmMD5_accume(p, p->buf);
+    for (i = 0; i < n; i++, out += 3, in += 3)
+        icmLab2LCh_e(out, in);
+}
 
-        p->fin = 1;
-    }
+void icmLab2LCh_p(double *out[3], double *in[3], unsigned int n) {
+    unsigned int i;
 
-    /* Return the result, lsb to msb */
-    pp = chsum;
-    for (i = 0; i < 4; i++) {
-        *pp++ = p->sum[i] & 0xff; 
-        *pp++ = (p->sum[i] >> 8) & 0xff; 
-        *pp++ = (p->sum[i] >> 16) & 0xff; 
-        *pp++ = (p->sum[i] >> 24) & 0xff; 
+    for (i = 0; i < n; i++) {
+        double tt[3];
+        tt[0] = in[0][i]; tt[1] = in[1][i]; tt[2] = in[2][i];
+        icmLab2LCh_e(tt, tt);
+        out[0][i] = tt[0]; out[1][i] = tt[1]; out[2][i] = tt[2];
     }
 }
 
+/* LCh to Lab */
+void icmLCh2Lab_n(double *out, double *in, unsigned int n) {
+    unsigned int i;
 
-/* Delete the instance */
-static void icmMD5_del(icmMD5 *p) {
-    p->al->free(p->al, p);
+    for (i = 0; i < n; i++, out += 3, in += 3)
+        icmLCh2Lab_e(out, in);
 }
 
-/* Create a new MD5 checksumming object, with a reset checksum value */
-/* Return it or NULL if there is an error */
-icmMD5 *new_icmMD5(icmAlloc *al) {
-    icmMD5 *p;
+void icmLCh2Lab_p(double *out[3], double *in[3], unsigned int n) {
+    unsigned int i;
 
-    if ((p = (icmMD5 *)al->calloc(al,1,sizeof(icmMD5))) == NULL)
-        return NULL;
-
-    p->al       = al;
-    p->reset    = icmMD5_reset;
-    p->add      = icmMD5_add;
-    p->get      = icmMD5_get;
-    p->del      = icmMD5_del;
-
-    p->reset(p);
-
-    return p;
+    for (i = 0; i < n; i++) {
+        double tt[3];
+        tt[0] = in[0][i]; tt[1] = in[1][i]; tt[2] = in[2][i];
+        icmLCh2Lab_e(tt, tt);
+        out[0][i] = tt[0]; out[1][i] = tt[1]; out[2][i] = tt[2];
+    }
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - */
-
-/* Dumy icmFile used to compute MD5 checksum on write */
+/* XYZ to Yxy */
+void icmXYZ2Yxy_n(double *out, double *in, unsigned int n) {
+    unsigned int i;
 
-/* Get the size of the file (Only valid for reading file. */
-static size_t icmFileMD5_get_size(icmFile *pp) {
-    return pp->size;
+    for (i = 0; i < n; i++, out += 3, in += 3)
+        icmXYZ2Yxy_e(out, in);
 }
 
-/* Set current position to offset. Return 0 on success, nz on failure. */
-/* Seek can't be supported for MD5, so and seek must be to current location. */
-static int icmFileMD5_seek(
-icmFile *pp,
-unsigned int offset
-) {
-    icmFileMD5 *p = (icmFileMD5 *)pp;
+void icmXYZ2Yxy_p(double *out[3], double *in[3], unsigned int n) {
+    unsigned int i;
 
-    if (p->of != offset) {
-        p->errc = 1;
+    for (i = 0; i < n; i++) {
+        double tt[3];
+        tt[0] = in[0][i]; tt[1] = in[1][i]; tt[2] = in[2][i];
+        icmXYZ2Yxy_e(tt, tt);
+        out[0][i] = tt[0]; out[1][i] = tt[1]; out[2][i] = tt[2];
     }
-    return 0;
 }
 
-/* Read count items of size length. Return number of items successfully read. */
-/* Read is not implemented */
-static size_t icmFileMD5_read(
-icmFile *pp,
-void *buffer,
-size_t size,
-size_t count
-) {
-    return 0;
+/* Yxy to XYZ */
+void icmYxy2XYZ_n(double *out, double *in, unsigned int n) {
+    unsigned int i;
+
+    for (i = 0; i < n; i++, out += 3, in += 3)
+        icmYxy2XYZ_e(out, in);
 }
 
-/* write count items of size length. Return number of items successfully written. */
-/* Simply pass to MD5 to compute checksum */
-static size_t icmFileMD5_write(
-icmFile *pp,
-void *buffer,
-size_t size,
-size_t count
-) {
-    icmFileMD5 *p = (icmFileMD5 *)pp;
-    size_t len = size * count;
+void icmYxy2XYZ_p(double *out[3], double *in[3], unsigned int n) {
+    unsigned int i;
 
-    p->md5->add(p->md5, (ORD8 *)buffer, len);
-    p->of += len;
-    return count;
+    for (i = 0; i < n; i++) {
+        double tt[3];
+        tt[0] = in[0][i]; tt[1] = in[1][i]; tt[2] = in[2][i];
+        icmYxy2XYZ_e(tt, tt);
+        out[0][i] = tt[0]; out[1][i] = tt[1]; out[2][i] = tt[2];
+    }
 }
 
-/* do a printf */
-/* Not implemented */
-static int icmFileMD5_printf(
-icmFile *pp,
-const char *format,
-...
-) {
-    icmFileMD5 *p = (icmFileMD5 *)pp;
-    p->errc = 2;
-    return 0;
-}
+/* CIE XYZ to perceptual Luv */
+void icmXYZ2Luv_n(icmXYZNumber *w, double *out, double *in, unsigned int n) {
+    icmWhiteC c;
+    unsigned int i;
 
-/* flush all write data out to secondary storage. Return nz on failure. */
-static int icmFileMD5_flush(
-icmFile *pp
-) {
-    return 0;
+    icmWhiteC_init(&c, w);
+    for (i = 0; i < n; i++, out += 3, in += 3)
+        icmXYZ2Luv_e(&c, out, in);
 }
 
-/* we're done with the file object, return nz on failure */
-static int icmFileMD5_delete(
-icmFile *pp
-) {
-    icmFileMD5 *p = (icmFileMD5 *)pp;
+void icmXYZ2Luv_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n) {
+    icmWhiteC c;
+    unsigned int i;
 
-    p->al->free(p->al, p);    /* Free object */
-    return 0;
+    icmWhiteC_init(&c, w);
+    for (i = 0; i < n; i++) {
+        double tt[3];
+        tt[0] = in[0][i]; tt[1] = in[1][i]; tt[2] = in[2][i];
+        icmXYZ2Luv_e(&c, tt, tt);
+        out[0][i] = tt[0]; out[1][i] = tt[1]; out[2][i] = tt[2];
+    }
 }
 
-/* Return the error code. Error code will usually be set */
-/* if we did a seek to other than the current location, */
-/* or did a printf. */
-static int icmFileMD5_geterrc(
-icmFile *pp
-) {
-    icmFileMD5 *p = (icmFileMD5 *)pp;
+/* Perceptual Luv to CIE XYZ */
+void icmLuv2XYZ_n(icmXYZNumber *w, double *out, double *in, unsigned int n) {
+    icmWhiteC c;
+    unsigned int i;
 
-    return p->errc;
+    icmWhiteC_init(&c, w);
+    for (i = 0; i < n; i++, out += 3, in += 3)
+        icmLuv2XYZ_e(&c, out, in);
 }
 
-/* Create a checksum dump file access class with allocator */
-icmFile *new_icmFileMD5_a(
-icmMD5 *md5,        /* MD5 object to use */
-icmAlloc *al        /* heap allocator */
-) {
-    icmFileMD5 *p;
+void icmLuv2XYZ_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n) {
+    icmWhiteC c;
+    unsigned int i;
 
-    if ((p = (icmFileMD5 *) al->calloc(al, 1, sizeof(icmFileMD5))) == NULL) {
-        return NULL;
+    icmWhiteC_init(&c, w);
+    for (i = 0; i < n; i++) {
+        double tt[3];
+        tt[0] = in[0][i]; tt[1] = in[1][i]; tt[2] = in[2][i];
+        icmLuv2XYZ_e(&c, tt, tt);
+        out[0][i] = tt[0]; out[1][i] = tt[1]; out[2][i] = tt[2];
     }
-    p->md5      = md5;            /* MD5 compute object */
-    p->al       = al;            /* Heap allocator */
-    p->get_size = icmFileMD5_get_size;
-    p->seek     = icmFileMD5_seek;
-    p->read     = icmFileMD5_read;
-    p->write    = icmFileMD5_write;
-    p->gprintf   = icmFileMD5_printf;
-    p->flush    = icmFileMD5_flush;
-    p->del      = icmFileMD5_delete;
-    p->get_errc = icmFileMD5_geterrc;
+}
 
-    p->of = 0;
-    p->errc = 0;
+/* NOTE :- none of the following seven have been protected */
+/* against arithmmetic issues (ie. for black) */
 
-    return (icmFile *)p;
-}
+/* CIE XYZ to perceptual CIE 1976 UCS diagram Yu'v'*/
+/* (Yu'v' is a better chromaticity space than Yxy) */
+extern ICCLIB_API void icmXYZ21976UCS(double *out, double *in) {
+    double X = in[0], Y = in[1], Z = in[2];
+    double den, u, v;
 
+    den = (X + 15.0 * Y + 3.0 * Z);
+    u = (4.0 * X) / den;
+    v = (9.0 * Y) / den;
+    
+    out[0] = Y;
+    out[1] = u;
+    out[2] = v;
+}
 
-/* ============================================= */
-/* Implementation of color transform lookups.    */
+/* Perceptual CIE 1976 UCS diagram Yu'v' to CIE XYZ */
+extern ICCLIB_API void icm1976UCS2XYZ(double *out, double *in) {
+    double u, v, fl, fu, fv, sum, X, Y, Z;
 
-/* - - - - - - - - - - - - - - - - - - - - - - - */
-/* Methods common to all transforms (icmLuBase) : */
+    Y = in[0];
+    u = in[1];
+    v = in[2];
 
-/* Return information about the native lut in/out/pcs colorspaces. */
-/* Any pointer may be NULL if value is not to be returned */
-static void
-icmLutSpaces(
-    struct _icmLuBase *p,            /* This */
-    icColorSpaceSignature *ins,        /* Return Native input color space */
-    int *inn,                        /* Return number of input components */
-    icColorSpaceSignature *outs,    /* Return Native output color space */
-    int *outn,                        /* Return number of output components */
-    icColorSpaceSignature *pcs        /* Return Native PCS color space */
-                                    /* (this will be the same as ins or outs */
-                                    /* depending on the lookup direction) */
-) {
-    if (ins != NULL)
-        *ins = p->inSpace;
-    if (inn != NULL)
-        *inn = (int)number_ColorSpaceSignature(p->inSpace);
+    X = ((9.0 * u * Y)/(4.0 * v));
+    Z = -(((20.0 * v + 3.0 * u - 12.0) * Y)/(4.0 * v));
 
-    if (outs != NULL)
-        *outs = p->outSpace;
-    if (outn != NULL)
-        *outn = (int)number_ColorSpaceSignature(p->outSpace);
-    if (pcs != NULL)
-        *pcs = p->pcs;
+    out[0] = X;
+    out[1] = Y;
+    out[2] = Z;
 }
 
-/* Return information about the effective lookup in/out colorspaces, */
-/* including allowance for PCS override. */
-/* Any pointer may be NULL if value is not to be returned */
-static void
-icmLuSpaces(
-    struct _icmLuBase *p,            /* This */
-    icColorSpaceSignature *ins,        /* Return effective input color space */
-    int *inn,                        /* Return number of input components */
-    icColorSpaceSignature *outs,    /* Return effective output color space */
-    int *outn,                        /* Return number of output components */
-    icmLuAlgType *alg,                /* Return type of lookup algorithm used */
-    icRenderingIntent *intt,        /* Return the intent being implented */
-    icmLookupFunc *fnc,                /* Return the profile function being implemented */
-    icColorSpaceSignature *pcs,        /* Return the profile effective PCS */
-    icmLookupOrder *ord                /* return the search Order */
-) {
-    if (ins != NULL)
-        *ins = p->e_inSpace;
-    if (inn != NULL)
-        *inn = (int)number_ColorSpaceSignature(p->e_inSpace);
-
-    if (outs != NULL)
-        *outs = p->e_outSpace;
-    if (outn != NULL)
-        *outn = (int)number_ColorSpaceSignature(p->e_outSpace);
+/* CIE XYZ to perceptual CIE 1960 UCS */
+/* (This was obsoleted by the 1976UCS, but is still used */
+/*  in computing color temperatures.) */
+extern ICCLIB_API void icmXYZ21960UCS(double *out, double *in) {
+    double X = in[0], Y = in[1], Z = in[2];
+    double u, v;
 
-    if (alg != NULL)
-        *alg = p->ttype;
+    u = (4.0 * X) / (X + 15.0 * Y + 3.0 * Z);
+    v = (6.0 * Y) / (X + 15.0 * Y + 3.0 * Z);
+    
+    out[0] = Y;
+    out[1] = u;
+    out[2] = v;
+}
 
-    if (intt != NULL)
-        *intt = p->intent;
+/* Perceptual CIE 1960 UCS to CIE XYZ */
+extern ICCLIB_API void icm1960UCS2XYZ(double *out, double *in) {
+    double u, v, fl, fu, fv, sum, X, Y, Z;
 
-    if (fnc != NULL)
-        *fnc = p->function;
+    Y = in[0];
+    u = in[1];
+    v = in[2];
 
-    if (pcs != NULL)
-        *pcs = p->e_pcs;
+    X = ((3.0 * u * Y)/(2.0 * v));
+    Z = -(((10.0 * v + u - 4.0) * Y)/(2.0 * v));
 
-    if (ord != NULL)
-        *ord = p->order;
+    out[0] = X;
+    out[1] = Y;
+    out[2] = Z;
 }
 
-/* Relative to Absolute for this WP in XYZ */
-static void icmLuXYZ_Rel2Abs(icmLuBase *p, double *out, double *in) {
-    icmMulBy3x3(out, p->toAbs, in);
-}
+/* CIE XYZ to perceptual CIE 1964 WUV (U*V*W*) */
+/* (This is obsolete but still used in computing CRI) */
+extern ICCLIB_API void icmXYZ21964WUV(icmXYZNumber *w, double *out, double *in) {
+    double W, U, V;
+    double wucs[3];
+    double iucs[3];
 
-/* Absolute to Relative for this WP in XYZ */
-static void icmLuXYZ_Abs2Rel(icmLuBase *p, double *out, double *in) {
-    icmMulBy3x3(out, p->fromAbs, in);
-}
+    icmXYZ2Ary(wucs, *w);
+    icmXYZ21960UCS(wucs, wucs);
+    icmXYZ21960UCS(iucs, in);
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Methods common to all non-named transforms (icmLuBase) : */
+    W = 25.0 * pow(iucs[0] * 100.0/wucs[0], 1.0/3.0) - 17.0;
+    U = 13.0 * W * (iucs[1] - wucs[1]);
+    V = 13.0 * W * (iucs[2] - wucs[2]);
 
-/* Initialise the LU white and black points from the ICC tags, */
-/* and the corresponding absolute<->relative conversion matrices */
-/* return nz on error */
-static int icmLuInit_Wh_bk(
-struct _icmLuBase *lup
-) {
-    icmXYZArray *whitePointTag, *blackPointTag;
-    icc *p = lup->icp;
-
-    if ((whitePointTag = (icmXYZArray *)p->read_tag(p, icSigMediaWhitePointTag)) == NULL
-        || whitePointTag->ttype != icSigXYZType || whitePointTag->size < 1) {
-        if (p->header->deviceClass != icSigLinkClass 
-         && (lup->intent == icAbsoluteColorimetric
-          || lup->intent == icmAbsolutePerceptual
-          || lup->intent == icmAbsoluteSaturation)) {
-            sprintf(p->err,"icc_lookup: Profile is missing Media White Point Tag");
-            p->errc = 1;
-            return 1;
-        }
-        p->err[0] = '\000';
-        p->errc = 0;
-        lup->whitePoint = icmD50;                    /* safe value */
-    } else
-        lup->whitePoint = whitePointTag->data[0];    /* Copy structure */
+    out[0] = W;
+    out[1] = U;
+    out[2] = V;
+}
 
-    if ((blackPointTag = (icmXYZArray *)p->read_tag(p, icSigMediaBlackPointTag)) == NULL
-        || blackPointTag->ttype != icSigXYZType || blackPointTag->size < 1) {
-        p->err[0] = '\000';
-        p->errc = 0;
-        lup->blackPoint = icmBlack;                    /* default */
-        lup->blackisassumed = 1;                    /* We assumed the default */
-    } else  {
-        lup->blackPoint = blackPointTag->data[0];    /* Copy structure */
-        lup->blackisassumed = 0;                    /* The black is from the tag */
-    }
+/* Perceptual CIE 1964 WUV (U*V*W*) to CIE XYZ */
+extern ICCLIB_API void icm1964WUV2XYZ(icmXYZNumber *w, double *out, double *in) {
+    double W, U, V;
+    double wucs[3];
+    double iucs[3];
 
-    /* Create absolute <-> relative conversion matricies */
-    icmChromAdaptMatrix(ICM_CAM_BRADFORD, lup->whitePoint, icmD50, lup->toAbs);
-    icmChromAdaptMatrix(ICM_CAM_BRADFORD, icmD50, lup->whitePoint,  lup->fromAbs);
-    DBLLL(("toAbs and fromAbs created from wp %f %f %f and D50 %f %f %f\n", lup->whitePoint.X, lup->whitePoint.Y, lup->whitePoint.Z, icmD50.X, icmD50.Y, icmD50.Z));
-    DBLLL(("toAbs   = %f %f %f\n          %f %f %f\n          %f %f %f\n", lup->toAbs[0][0], lup->toAbs[0][1], lup->toAbs[0][2], lup->toAbs[1][0], lup->toAbs[1][1], lup->toAbs[1][2], lup->toAbs[2][0], lup->toAbs[2][1], lup->toAbs[2][2]));
-    DBLLL(("fromAbs = %f %f %f\n          %f %f %f\n          %f %f %f\n", lup->fromAbs[0][0], lup->fromAbs[0][1], lup->fromAbs[0][2], lup->fromAbs[1][0], lup->fromAbs[1][1], lup->fromAbs[1][2], lup->fromAbs[2][0], lup->fromAbs[2][1], lup->fromAbs[2][2]));
+    icmXYZ2Ary(wucs, *w);
+    icmXYZ21960UCS(wucs, wucs);
 
-    return 0;
-}
+    W = in[0];
+    U = in[1];
+    V = in[2];
 
-/* Return the media white and black points in absolute XYZ space. */
-/* Note that if not in the icc, the black point will be returned as 0, 0, 0, */
-/* and the function will return nz. */ 
-/* Any pointer may be NULL if value is not to be returned */
-static int icmLuWh_bk_points(
-struct _icmLuBase *p,
-double *wht,
-double *blk
-) {
-    if (wht != NULL) {
-        icmXYZ2Ary(wht,p->whitePoint);
-    }
+    iucs[0] = pow((W + 17.0)/25.0, 3.0) * wucs[0]/100.0;
+    iucs[1] = U / (13.0 * W) + wucs[1];
+    iucs[2] = V / (13.0 * W) + wucs[2];
 
-    if (blk != NULL) {
-        icmXYZ2Ary(blk,p->blackPoint);
-    }
-    if (p->blackisassumed)
-        return 1;
-    return 0;
+    icm1960UCS2XYZ(out, iucs);
 }
 
-/* Get the LU white and black points in LU PCS space, converted to XYZ. */
-/* (ie. white and black will be relative if LU is relative intent etc.) */
-/* Return nz if the black point is being assumed to be 0,0,0 rather */
-/* than being from the tag. */                                                            \
-static int icmLuLu_wh_bk_points(
-struct _icmLuBase *p,
-double *wht,
-double *blk
-) {
-    if (wht != NULL) {
-        icmXYZ2Ary(wht,p->whitePoint);
-    }
+/* CIE CIE1960 UCS to perceptual CIE 1964 WUV (U*V*W*) */
+extern ICCLIB_API void icm1960UCS21964WUV(icmXYZNumber *w, double *out, double *in) {
+    double W, U, V;
+    double wucs[3];
 
-    if (blk != NULL) {
-        icmXYZ2Ary(blk,p->blackPoint);
-    }
-    if (p->intent != icAbsoluteColorimetric
-     && p->intent != icmAbsolutePerceptual
-     && p->intent != icmAbsoluteSaturation) {
-        if (wht != NULL)
-            icmMulBy3x3(wht, p->fromAbs, wht);
-        if (blk != NULL)
-            icmMulBy3x3(blk, p->fromAbs, blk);
-    }
-    if (p->blackisassumed)
-        return 1;
-    return 0;
-}
+    icmXYZ2Ary(wucs, *w);
+    icmXYZ21960UCS(wucs, wucs);
 
-/* Get the native (internal) ranges for the Monochrome or Matrix profile */
-/* Arguments may be NULL */
-static void
-icmLu_get_lutranges (
-    struct _icmLuBase *p,
-    double *inmin, double *inmax,        /* Return maximum range of inspace values */
-    double *outmin, double *outmax        /* Return maximum range of outspace values */
-) {
-    /* Hmm. we have no way of handling an error from getRange. */
-    /* It shouldn't ever return one unless there is a mismatch between */
-    /* getRange and Lu creation... */
-    getRange(p->icp, p->inSpace, p->ttype, inmin, inmax);
-    getRange(p->icp, p->outSpace, p->ttype, outmin, outmax);
-}
+    W = 25.0 * pow(in[0] * 100.0/wucs[0], 1.0/3.0) - 17.0;
+    U = 13.0 * W * (in[1] - wucs[1]);
+    V = 13.0 * W * (in[2] - wucs[2]);
 
-/* Get the effective (externally visible) ranges for the all profile types */
-/* Arguments may be NULL */
-static void
-icmLu_get_ranges (
-    struct _icmLuBase *p,
-    double *inmin, double *inmax,        /* Return maximum range of inspace values */
-    double *outmin, double *outmax        /* Return maximum range of outspace values */
-) {
-    /* Hmm. we have no way of handling an error from getRange. */
-    /* It shouldn't ever return one unless there is a mismatch between */
-    /* getRange and Lu creation... */
-    getRange(p->icp, p->e_inSpace, p->ttype, inmin, inmax);
-    getRange(p->icp, p->e_outSpace, p->ttype, outmin, outmax);
+    out[0] = W;
+    out[1] = U;
+    out[2] = V;
 }
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - */
-/* Forward and Backward Monochrome type methods: */
-/* Return 0 on success, 1 if clipping occured, 2 on other error */
 
-/* Individual components of Fwd conversion: */
+/* available D50 Illuminant */
+icmXYZNumber icmD50 = {         /* Profile illuminant - D50 */
+    0.9642, 1.0000, 0.8249
+};
 
-/* Actual device to linearised device */
-static int
-icmLuMonoFwd_curve (
-icmLuMono *p,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    icc *icp = p->icp;
-    int rv = 0;
+icmXYZNumber icmD50_100 = {        /* Profile illuminant - D50, scaled to 100 */
+    96.42, 100.00, 82.49
+};
 
-    /* Translate from device to PCS scale */
-    if ((rv |= p->grayCurve->lookup_fwd(p->grayCurve,&out[0],&in[0])) > 1) {
-        sprintf(icp->err,"icc_lookup: Curve->lookup_fwd() failed");
-        icp->errc = rv;
-        return 2;
-    }
+double icmD50_ary3[3] = {         /* Profile illuminant - D50 */
+    0.9642, 1.0000, 0.8249
+};
 
-    return rv;
-}
+/* available D65 Illuminant */
+icmXYZNumber icmD65 = {         /* Profile illuminant - D65 */
+    0.9505, 1.0000, 1.0890
+};
 
-/* Linearised device to relative PCS */
-static int
-icmLuMonoFwd_map (
-icmLuMono *p,        /* This */
-double *out,        /* Vector of output values (native space) */
-double *in            /* Vector of input values (native space) */
-) {
-    int rv = 0;
-    double Y = in[0];        /* In case out == in */
+icmXYZNumber icmD65_100 = {     /* Profile illuminant - D65, scaled to 100 */
+    95.05, 100.00, 108.90
+};
 
-    out[0] = p->pcswht.X;
-    out[1] = p->pcswht.Y;
-    out[2] = p->pcswht.Z;
-    if (p->pcs == icSigLabData)
-        icmXYZ2Lab(&p->pcswht, out, out);    /* in Lab */
+double icmD65_ary3[3] = {         /* Profile illuminant - D65 */
+    0.9505, 1.0000, 1.0890
+};
 
-    /* Scale linearized device level to PCS white */
-    out[0] *= Y;
-    out[1] *= Y;
-    out[2] *= Y;
+/* Default black point */
+icmXYZNumber icmBlack = {
+    0.0000, 0.0000, 0.0000
+};
 
-    return rv;
+/* Return the normal Delta E given two Lab values */
+double icmLabDE(double *Lab0, double *Lab1) {
+    double rv = 0.0, tt;
+
+    tt = Lab0[0] - Lab1[0];
+    rv += tt * tt;
+    tt = Lab0[1] - Lab1[1];
+    rv += tt * tt;
+    tt = Lab0[2] - Lab1[2];
+    rv += tt * tt;
+    
+    return sqrt(rv);
 }
 
-/* relative PCS to absolute PCS (if required) */
-static int
-icmLuMonoFwd_abs (    /* Abs comes last in Fwd conversion */
-icmLuMono *p,        /* This */
-double *out,        /* Vector of output values in Effective PCS */
-double *in            /* Vector of input values in Native PCS */
-) {
-    int rv = 0;
+/* Return the normal Delta E squared, given two Lab values */
+double icmLabDEsq(double *Lab0, double *Lab1) {
+    double rv = 0.0, tt;
 
-    if (out != in) {    /* Don't alter input values */
-        out[0] = in[0];
-        out[1] = in[1];
-        out[2] = in[2];
-    }
+    tt = Lab0[0] - Lab1[0];
+    rv += tt * tt;
+    tt = Lab0[1] - Lab1[1];
+    rv += tt * tt;
+    tt = Lab0[2] - Lab1[2];
+    rv += tt * tt;
+    
+    return rv;
+}
 
-    /* Do absolute conversion */
-    if (p->intent == icAbsoluteColorimetric
-     || p->intent == icmAbsolutePerceptual
-     || p->intent == icmAbsoluteSaturation) {
+/* Return the normal Delta E given two XYZ values */
+extern ICCLIB_API double icmXYZLabDE(icmXYZNumber *w, double *in0, double *in1) {
+    double lab0[3], lab1[3], rv;
 
-        if (p->pcs == icSigLabData)     /* Convert L to Y */
-            icmLab2XYZ(&p->pcswht, out, out);
-        
-        /* Convert from Relative to Absolute colorimetric */
-        icmMulBy3x3(out, p->toAbs, out);
-        
-        if (p->e_pcs == icSigLabData)
-            icmXYZ2Lab(&p->pcswht, out, out);
+    icmXYZ2Lab(w, lab0, in0);
+    icmXYZ2Lab(w, lab1, in1);
+    rv = icmLabDE(lab0, lab1);
+    return rv;
+}
 
-    } else {
+/* (Note that CIE94 can give odd results for very large delta E's, */
+/* when one of the two points is near the neutral axis: */
+/* ie DE(A,B + del) != DE(A,B) + DE(del) */
+#ifdef NEVER
+{
+    double w1[3] = { 99.996101, -0.058417, -0.010557 };
+    double c1[3] = { 60.267956, 98.845863, -61.163277 };
+    double w2[3] = { 100.014977, -0.138339, 0.089744 };
+    double c2[3] = { 60.294464, 98.117104, -60.843159 };
+    
+    printf("DE   1 = %f, 2 = %f\n", icmLabDE(c1, w1), icmLabDE(c2, w2));
+    printf("DE94 1 = %f, 2 = %f\n", icmCIE94(c1, w1), icmCIE94(c2, w2));
+}
+#endif
 
-        /* Convert from Native to Effective output space */
-        if (p->pcs == icSigLabData && p->e_pcs == icSigXYZData)
-            icmLab2XYZ(&p->pcswht, out, out);
-        else if (p->pcs == icSigXYZData && p->e_pcs == icSigLabData)
-            icmXYZ2Lab(&p->pcswht, out, out);
+
+/* Return the CIE94 Delta E color difference measure, squared */
+double icmCIE94sq(double Lab0[3], double Lab1[3]) {
+    double desq, dhsq;
+    double dlsq, dcsq;
+    double c12;
+
+    {
+        double dl, da, db;
+        dl = Lab0[0] - Lab1[0];
+        dlsq = dl * dl;        /* dl squared */
+        da = Lab0[1] - Lab1[1];
+        db = Lab0[2] - Lab1[2];
+
+        /* Compute normal Lab delta E squared */
+        desq = dlsq + da * da + db * db;
     }
 
-    return rv;
-}
+    {
+        double c1, c2, dc;
 
+        /* Compute chromanance for the two colors */
+        c1 = sqrt(Lab0[1] * Lab0[1] + Lab0[2] * Lab0[2]);
+        c2 = sqrt(Lab1[1] * Lab1[1] + Lab1[2] * Lab1[2]);
+        c12 = sqrt(c1 * c2);    /* Symetric chromanance */
 
-/* Overall Fwd conversion routine (Dev->PCS) */
-static int
-icmLuMonoFwd_lookup (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Input value */
-) {
-    int rv = 0;
-    icmLuMono *p = (icmLuMono *)pp;
-    rv |= icmLuMonoFwd_curve(p, out, in);
-    rv |= icmLuMonoFwd_map(p, out, out);
-    rv |= icmLuMonoFwd_abs(p, out, out);
-    return rv;
-}
+        /* delta chromanance squared */
+        dc = c2 - c1;
+        dcsq = dc * dc;
+    }
 
-/* Three stage conversion routines */
-static int
-icmLuMonoFwd_lookup_in(
-icmLuBase *pp,        /* This */
-double *out,        /* Output value */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuMono *p = (icmLuMono *)pp;
-    rv |= icmLuMonoFwd_curve(p, out, in);
-    return rv;
+    /* Compute delta hue squared */
+    if ((dhsq = desq - dlsq - dcsq) < 0.0)
+        dhsq = 0.0;
+    {
+        double sc, sh;
+
+        /* Weighting factors for delta chromanance & delta hue */
+        sc = 1.0 + 0.048 * c12;
+        sh = 1.0 + 0.014 * c12;
+        return dlsq + dcsq/(sc * sc) + dhsq/(sh * sh);
+    }
 }
 
-static int
-icmLuMonoFwd_lookup_core(
-icmLuBase *pp,        /* This */
-double *out,        /* Output value */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuMono *p = (icmLuMono *)pp;
-    rv |= icmLuMonoFwd_map(p, out, in);
-    rv |= icmLuMonoFwd_abs(p, out, out);
-    return rv;
+/* Return the CIE94 Delta E color difference measure */
+double icmCIE94(double Lab0[3], double Lab1[3]) {
+    return sqrt(icmCIE94sq(Lab0, Lab1));
 }
 
-static int
-icmLuMonoFwd_lookup_out(
-icmLuBase *pp,        /* This */
-double *out,        /* Output value */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    out[0] = in[0]; 
-    out[1] = in[1]; 
-    out[2] = in[2]; 
-    return rv;
+/* Return the CIE94 Delta E color difference measure for two XYZ values */
+extern ICCLIB_API double icmXYZCIE94(icmXYZNumber *w, double *in0, double *in1) {
+    double lab0[3], lab1[3];
+
+    icmXYZ2Lab(w, lab0, in0);
+    icmXYZ2Lab(w, lab1, in1);
+    return sqrt(icmCIE94sq(lab0, lab1));
 }
 
 
-/* -  -  -  -  -  -  -  -  -  -  -  -  -  - */
-/* Individual components of Bwd conversion: */
+/* From the paper "The CIEDE2000 Color-Difference Formula: Implementation Notes, */
+/* Supplementary Test Data, and Mathematical Observations", by */
+/* Gaurav Sharma, Wencheng Wu and Edul N. Dalal, */
+/* Color Res. Appl., vol. 30, no. 1, pp. 21-30, Feb. 2005. */
 
-/* Convert from relative PCS to absolute PCS (if required) */
-static int
-icmLuMonoBwd_abs (    /* Abs comes first in Bwd conversion */
-icmLuMono *p,        /* This */
-double *out,        /* Vector of output values in Native PCS */
-double *in            /* Vector of input values in Effective PCS */
-) {
-    int rv = 0;
+/* Return the CIEDE2000 Delta E color difference measure squared, for two Lab values */
+double icmCIE2Ksq(double *Lab0, double *Lab1) {
+    double C1, C2;
+    double h1, h2;
+    double dL, dC, dH;
+    double dsq;
 
-    if (out != in) {    /* Don't alter input values */
-        out[0] = in[0];
-        out[1] = in[1];
-        out[2] = in[2];
-    }
+    /* The trucated value of PI is needed to ensure that the */
+    /* test cases pass, as one of them lies on the edge of */
+    /* a mathematical discontinuity. The precision is still */
+    /* enough for any practical use. */
+#define RAD2DEG(xx) (180.0/3.14159265358979 * (xx))
+#define DEG2RAD(xx) (3.14159265358979/180.0 * (xx))
 
-    /* Force to monochrome locus in correct space */
-    if (p->e_pcs == icSigLabData) {
-        double wp[3];
+    /* Compute Cromanance and Hue angles */
+    {
+        double C1ab, C2ab;
+        double Cab, Cab7, G;
+        double a1, a2;
 
-        if (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation) {
-            wp[0] = p->whitePoint.X;
-            wp[1] = p->whitePoint.Y;
-            wp[2] = p->whitePoint.Z;
-        } else {
-            wp[0] = p->pcswht.X;
-            wp[1] = p->pcswht.Y;
-            wp[2] = p->pcswht.Z;
+        C1ab = sqrt(Lab0[1] * Lab0[1] + Lab0[2] * Lab0[2]);
+        C2ab = sqrt(Lab1[1] * Lab1[1] + Lab1[2] * Lab1[2]);
+        Cab = 0.5 * (C1ab + C2ab);
+        Cab7 = pow(Cab,7.0);
+        G = 0.5 * (1.0 - sqrt(Cab7/(Cab7 + 6103515625.0)));
+        a1 = (1.0 + G) * Lab0[1];
+        a2 = (1.0 + G) * Lab1[1];
+        C1 = sqrt(a1 * a1 + Lab0[2] * Lab0[2]);
+        C2 = sqrt(a2 * a2 + Lab1[2] * Lab1[2]);
+
+        if (C1 < 1e-9)
+            h1 = 0.0;
+        else {
+            h1 = RAD2DEG(atan2(Lab0[2], a1));
+            if (h1 < 0.0)
+                h1 += 360.0;
         }
-        icmXYZ2Lab(&p->pcswht, wp, wp);    /* Convert to Lab white point */
-        out[1] = out[0]/wp[0] * wp[1];
-        out[2] = out[0]/wp[0] * wp[2];
 
-    } else {
-        if (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation) {
-            out[0] = out[1]/p->whitePoint.Y * p->whitePoint.X;
-            out[2] = out[1]/p->whitePoint.Y * p->whitePoint.Z;
-        } else {
-            out[0] = out[1]/p->pcswht.Y * p->pcswht.X;
-            out[2] = out[1]/p->pcswht.Y * p->pcswht.Z;
+        if (C2 < 1e-9)
+            h2 = 0.0;
+        else {
+            h2 = RAD2DEG(atan2(Lab1[2], a2));
+            if (h2 < 0.0)
+                h2 += 360.0;
         }
     }
 
-    /* Do absolute conversion, and conversion to effective PCS */
-    if (p->intent == icAbsoluteColorimetric
-     || p->intent == icmAbsolutePerceptual
-     || p->intent == icmAbsoluteSaturation) {
-
-        if (p->e_pcs == icSigLabData)
-            icmLab2XYZ(&p->pcswht, out, out);
-
-        icmMulBy3x3(out, p->fromAbs, out);
-
-        /* Convert from Effective to Native input space */
-        if (p->pcs == icSigLabData)
-            icmXYZ2Lab(&p->pcswht, out, out);
+    /* Compute delta L, C and H */
+    {
+        double dh;
 
-    } else {
+        dL = Lab1[0] - Lab0[0];
+        dC = C2 - C1;
+        if (C1 < 1e-9 || C2 < 1e-9) {
+            dh = 0.0;
+        } else {
+            dh = h2 - h1;
+            if (dh > 180.0)
+                dh -= 360.0;
+            else if (dh < -180.0)
+                dh += 360.0;
+        }
 
-        /* Convert from Effective to Native input space */
-        if (p->e_pcs == icSigLabData && p->pcs == icSigXYZData)
-            icmLab2XYZ(&p->pcswht, out, out);
-        else if (p->e_pcs == icSigXYZData && p->pcs == icSigLabData)
-            icmXYZ2Lab(&p->pcswht, out, out);
+        dH = 2.0 * sqrt(C1 * C2) * sin(DEG2RAD(0.5 * dh));
     }
 
-    return rv;
-}
+    {
+        double L, C, h, T;
+        double hh, ddeg;
+        double C7, RC, L50sq, SL, SC, SH, RT;
+        double dLsq, dCsq, dHsq, RCH;
 
-/* Map from relative PCS to linearised device */
-static int
-icmLuMonoBwd_map (
-icmLuMono *p,        /* This */
-double *out,        /* Output value */
-double *in            /* Vector of input values (native space) */
-) {
-    int rv = 0;
-    double pcsw[3];
-
-    pcsw[0] = p->pcswht.X;
-    pcsw[1] = p->pcswht.Y;
-    pcsw[2] = p->pcswht.Z;
-    if (p->pcs == icSigLabData)
-        icmXYZ2Lab(&p->pcswht, pcsw, pcsw);    /* in Lab (should be 100.0!) */
+        L = 0.5 * (Lab0[0]  + Lab1[0]);
+        C = 0.5 * (C1 + C2);
+        if (C1 < 1e-9 || C2 < 1e-9) {
+            h = h1 + h2;
+        } else {
+            h = h1 + h2;
+            if (fabs(h1 - h2) > 180.0) {
+                if (h < 360.0)
+                    h += 360.0;
+                else if (h >= 360.0)
+                    h -= 360.0;
+            }
+            h *= 0.5;
+        }
+        T = 1.0 - 0.17 * cos(DEG2RAD(h-30.0)) + 0.24 * cos(DEG2RAD(2.0 * h))
+          + 0.32 * cos(DEG2RAD(3.0 * h + 6.0)) - 0.2 * cos(DEG2RAD(4.0 * h - 63.0));
+        hh = (h - 275.0)/25.0;
+        ddeg = 30.0 * exp(-hh * hh);
+        C7 = pow(C,7.0);
+        RC = 2.0 * sqrt(C7/(C7 + 6103515625.0));
+        L50sq = (L - 50.0) * (L - 50.0);
+        SL = 1.0 + (0.015 * L50sq)/sqrt(20.0 + L50sq);
+        SC = 1.0 + 0.045 * C;
+        SH = 1.0 + 0.015 * C * T;
+        RT = -sin(DEG2RAD(2 * ddeg)) * RC;
 
-    /* Divide linearized device level into PCS white luminence */
-    if (p->pcs == icSigLabData)
-        out[0] = in[0]/pcsw[0];
-    else
-        out[0] = in[1]/pcsw[1];
+        dLsq = dL/SL;
+        dCsq = dC/SC;
+        dHsq = dH/SH;
 
-    return rv;
-}
+        RCH = RT * dCsq * dHsq;
 
-/* Map from linearised device to actual device */
-static int
-icmLuMonoBwd_curve (
-icmLuMono *p,        /* This */
-double *out,        /* Output value */
-double *in            /* Input value */
-) {
-    icc *icp = p->icp;
-    int rv = 0;
+        dLsq *= dLsq;
+        dCsq *= dCsq;
+        dHsq *= dHsq;
 
-    /* Convert to device value through curve */
-    if ((rv = p->grayCurve->lookup_bwd(p->grayCurve,&out[0],&in[0])) > 1) {
-        sprintf(icp->err,"icc_lookup: Curve->lookup_bwd() failed");
-        icp->errc = rv;
-        return 2;
+        dsq = dLsq + dCsq + dHsq + RCH;
     }
 
-    return rv;
-}
+    return dsq;
 
-/* Overall Bwd conversion routine (PCS->Dev) */
-static int
-icmLuMonoBwd_lookup (
-icmLuBase *pp,        /* This */
-double *out,        /* Output value */
-double *in            /* Vector of input values */
-) {
-    double temp[3];
-    int rv = 0;
-    icmLuMono *p = (icmLuMono *)pp;
-    rv |= icmLuMonoBwd_abs(p, temp, in);
-    rv |= icmLuMonoBwd_map(p, out, temp);
-    rv |= icmLuMonoBwd_curve(p, out, out);
-    return rv;
+#undef RAD2DEG
+#undef DEG2RAD
 }
 
-/* Three stage conversion routines */
-static int
-icmLuMonoBwd_lookup_in(
-icmLuBase *pp,        /* This */
-double *out,        /* Output value */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    out[0] = in[0];
-    out[1] = in[1];
-    out[2] = in[2];
-    return rv;
+/* Return the CIE2DE000 Delta E color difference measure for two Lab values */
+double icmCIE2K(double *Lab0, double *Lab1) {
+    return sqrt(icmCIE2Ksq(Lab0, Lab1));
 }
 
-static int
-icmLuMonoBwd_lookup_core(
-icmLuBase *pp,        /* This */
-double *out,        /* Output value */
-double *in            /* Vector of input values */
-) {
-    double temp[3];
-    int rv = 0;
-    icmLuMono *p = (icmLuMono *)pp;
-    rv |= icmLuMonoBwd_abs(p, temp, in);
-    rv |= icmLuMonoBwd_map(p, out, temp);
-    return rv;
-}
+/* Return the CIEDE2000 Delta E color difference measure for two XYZ values */
+extern ICCLIB_API double icmXYZCIE2K(icmXYZNumber *w, double *in0, double *in1) {
+    double lab0[3], lab1[3];
 
-static int
-icmLuMonoBwd_lookup_out(
-icmLuBase *pp,        /* This */
-double *out,        /* Output value */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuMono *p = (icmLuMono *)pp;
-    rv |= icmLuMonoBwd_curve(p, out, in);
-    return rv;
+    icmXYZ2Lab(w, lab0, in0);
+    icmXYZ2Lab(w, lab1, in1);
+    return sqrt(icmCIE2Ksq(lab0, lab1));
 }
 
-/* -  -  -  -  -  -  -  -  -  -  -  -  -  - */
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Array versions of the Delta E functions. */
 
-static void
-icmLuMono_delete(
-icmLuBase *p
-) {
-    icc *icp = p->icp;
+/* These process n interleaved Lab triples, using the fast approximations */
+/* in place of the libm functions. The results agree with the scalar */
+/* functions to better than 1e-8 DE. */
 
-    icp->al->free(icp->al, p);
+/* Set out[i] to the normal Delta E between n pairs of Lab values */
+void icmLabDE_n(double *out, double *Lab0, double *Lab1, unsigned int n) {
+    unsigned int i;
+
+    for (i = 0; i < n; i++, Lab0 += 3, Lab1 += 3) {
+        double dl, da, db;
+        dl = Lab0[0] - Lab1[0];
+        da = Lab0[1] - Lab1[1];
+        db = Lab0[2] - Lab1[2];
+        out[i] = sqrt(dl * dl + da * da + db * db);
+    }
 }
 
-static icmLuBase *
-new_icmLuMono(
-    struct _icc          *icp,
-    icColorSpaceSignature inSpace,        /* Native Input color space */
-    icColorSpaceSignature outSpace,        /* Native Output color space */
-    icColorSpaceSignature pcs,            /* Native PCS */
-    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
-    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
-    icColorSpaceSignature e_pcs,        /* Effective PCS */
-    icRenderingIntent     intent,        /* Rendering intent */
-    icmLookupFunc         func,            /* Functionality requested */
-    int dir                                /* 0 = fwd, 1 = bwd */
-) {
-    icmLuMono *p;
+/* Set out[i] to the CIE94 Delta E between n pairs of Lab values */
+void icmCIE94_n(double *out, double *Lab0, double *Lab1, unsigned int n) {
+    unsigned int i;
 
-    if ((p = (icmLuMono *) icp->al->calloc(icp->al,1,sizeof(icmLuMono))) == NULL)
-        return NULL;
-    p->icp      = icp;
-    p->del      = icmLuMono_delete;
-    p->lutspaces= icmLutSpaces;
-    p->spaces   = icmLuSpaces;
-    p->XYZ_Rel2Abs = icmLuXYZ_Rel2Abs;
-    p->XYZ_Abs2Rel = icmLuXYZ_Abs2Rel;
-    p->get_lutranges = icmLu_get_lutranges;
-    p->get_ranges = icmLu_get_ranges;
-    p->init_wh_bk = icmLuInit_Wh_bk;
-    p->wh_bk_points = icmLuWh_bk_points;
-    p->lu_wh_bk_points = icmLuLu_wh_bk_points;
-    p->fwd_lookup = icmLuMonoFwd_lookup;
-    p->fwd_curve  = icmLuMonoFwd_curve;
-    p->fwd_map    = icmLuMonoFwd_map;
-    p->fwd_abs    = icmLuMonoFwd_abs;
-    p->bwd_lookup = icmLuMonoBwd_lookup;
-    p->bwd_abs    = icmLuMonoFwd_abs;
-    p->bwd_map    = icmLuMonoFwd_map;
-    p->bwd_curve  = icmLuMonoFwd_curve;
-    if (dir) {
-        p->ttype         = icmMonoBwdType;
-        p->lookup        = icmLuMonoBwd_lookup;
-        p->lookup_in     = icmLuMonoBwd_lookup_in;
-        p->lookup_core   = icmLuMonoBwd_lookup_core;
-        p->lookup_out    = icmLuMonoBwd_lookup_out;
-        p->lookup_inv_in = icmLuMonoFwd_lookup_out;        /* Opposite of Bwd_lookup_in */
-    } else {
-        p->ttype         = icmMonoFwdType;
-        p->lookup        = icmLuMonoFwd_lookup;
-        p->lookup_in     = icmLuMonoFwd_lookup_in;
-        p->lookup_core   = icmLuMonoFwd_lookup_core;
-        p->lookup_out    = icmLuMonoFwd_lookup_out;
-        p->lookup_inv_in = icmLuMonoBwd_lookup_out;        /* Opposite of Fwd_lookup_in */
-    }
+    for (i = 0; i < n; i++, Lab0 += 3, Lab1 += 3) {
+        double dl, da, db, dlsq, desq, dhsq;
+        double c1, c2, c12, dc, dcsq;
+        double sc, sh;
 
-    /* Lookup the white and black points */
-    if (p->init_wh_bk((icmLuBase *)p)) {
-        p->del((icmLuBase *)p);
-        return NULL;
-    }
+        dl = Lab0[0] - Lab1[0];
+        da = Lab0[1] - Lab1[1];
+        db = Lab0[2] - Lab1[2];
+        dlsq = dl * dl;
+        desq = dlsq + da * da + db * db;
 
-    /* See if the color spaces are appropriate for the mono type */
-    if (number_ColorSpaceSignature(icp->header->colorSpace) != 1
-      || ( icp->header->pcs != icSigXYZData && icp->header->pcs != icSigLabData)) {
-        p->del((icmLuBase *)p);
-        return NULL;
-    }
+        c1 = sqrt(Lab0[1] * Lab0[1] + Lab0[2] * Lab0[2]);
+        c2 = sqrt(Lab1[1] * Lab1[1] + Lab1[2] * Lab1[2]);
+        c12 = sqrt(c1 * c2);
+        dc = c2 - c1;
+        dcsq = dc * dc;
 
-    /* Find the appropriate tags */
-    if ((p->grayCurve = (icmCurve *)icp->read_tag(icp, icSigGrayTRCTag)) == NULL
-         || p->grayCurve->ttype != icSigCurveType) {
-        p->del((icmLuBase *)p);
-        return NULL;
+        dhsq = desq - dlsq - dcsq;
+        dhsq = dhsq < 0.0 ? 0.0 : dhsq;
+
+        sc = 1.0 + 0.048 * c12;
+        sh = 1.0 + 0.014 * c12;
+        out[i] = sqrt(dlsq + dcsq/(sc * sc) + dhsq/(sh * sh));
     }
+}
 
-    p->pcswht = icp->header->illuminant;
-    p->intent   = intent;
-    p->function = func;
-    p->inSpace  = inSpace;
-    p->outSpace = outSpace;
-    p->pcs      = pcs;
-    p->e_inSpace  = e_inSpace;
-    p->e_outSpace = e_outSpace;
-    p->e_pcs      = e_pcs;
+/* Set out[i] to the CIEDE2000 Delta E between n pairs of Lab values */
+void icmCIE2K_n(double *out, double *Lab0, double *Lab1, unsigned int n) {
+    unsigned int i;
 
-    return (icmLuBase *)p;
-}
+    for (i = 0; i < n; i++, Lab0 += 3, Lab1 += 3) {
+        double C1ab, C2ab, Cab, Cab2, Cab7, G;
+        double a1, a2, C1, C2, h1, h2;
+        int achrom;                        /* nz if either color is achromatic */
+        double dL, dC, dH, dh, sdh, cdh;
+        double L, C, h, T, hh, ddeg;
+        double sh, ch, s2h, c2h, s3h, c3h, s4h, c4h;
+        double C2_, C7, RC, L50sq, SL, SC, SH, RT, srt, crt;
+        double dLs, dCs, dHs;
 
-static icmLuBase *
-new_icmLuMonoFwd(
-    struct _icc          *icp,
-    icColorSpaceSignature inSpace,        /* Native Input color space */
-    icColorSpaceSignature outSpace,        /* Native Output color space */
-    icColorSpaceSignature pcs,            /* Native PCS */
-    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
-    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
-    icColorSpaceSignature e_pcs,        /* Effective PCS */
-    icRenderingIntent     intent,        /* Rendering intent */
-    icmLookupFunc         func            /* Functionality requested */
-) {
-    return new_icmLuMono(icp, inSpace, outSpace, pcs, e_inSpace, e_outSpace, e_pcs,
-                         intent, func, 0);
-}
+        C1ab = sqrt(Lab0[1] * Lab0[1] + Lab0[2] * Lab0[2]);
+        C2ab = sqrt(Lab1[1] * Lab1[1] + Lab1[2] * Lab1[2]);
+        Cab = 0.5 * (C1ab + C2ab);
+        Cab2 = Cab * Cab;
+        Cab7 = Cab2 * Cab2 * Cab2 * Cab;
+        G = 0.5 * (1.0 - sqrt(Cab7/(Cab7 + 6103515625.0)));
+        a1 = (1.0 + G) * Lab0[1];
+        a2 = (1.0 + G) * Lab1[1];
+        C1 = sqrt(a1 * a1 + Lab0[2] * Lab0[2]);
+        C2 = sqrt(a2 * a2 + Lab1[2] * Lab1[2]);
 
+        h1 = C1 < 1e-9 ? 0.0 : icmFastAtan2Deg(Lab0[2], a1);
+        h2 = C2 < 1e-9 ? 0.0 : icmFastAtan2Deg(Lab1[2], a2);
+        h1 = h1 >= 360.0 ? h1 - 360.0 : h1;
+        h2 = h2 >= 360.0 ? h2 - 360.0 : h2;
+        achrom = C1 < 1e-9 || C2 < 1e-9;
 
-static icmLuBase *
-new_icmLuMonoBwd(
-    struct _icc          *icp,
-    icColorSpaceSignature inSpace,        /* Native Input color space */
-    icColorSpaceSignature outSpace,        /* Native Output color space */
-    icColorSpaceSignature pcs,            /* Native PCS */
-    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
-    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
-    icColorSpaceSignature e_pcs,        /* Effective PCS */
-    icRenderingIntent     intent,        /* Rendering intent */
-    icmLookupFunc         func            /* Functionality requested */
-) {
-    return new_icmLuMono(icp, inSpace, outSpace, pcs, e_inSpace, e_outSpace, e_pcs,
-                         intent, func, 1);
+        /* Delta L, C and H */
+        dL = Lab1[0] - Lab0[0];
+        dC = C2 - C1;
+        dh = h2 - h1;
+        dh = dh > 180.0 ? dh - 360.0 : dh;
+        dh = dh < -180.0 ? dh + 360.0 : dh;
+        dh = achrom ? 0.0 : dh;
+        icmFastSinCosDeg(&sdh, &cdh, 0.5 * dh);
+        dH = 2.0 * sqrt(C1 * C2) * sdh;
+
+        /* Mean L, C and h */
+        L = 0.5 * (Lab0[0]  + Lab1[0]);
+        C = 0.5 * (C1 + C2);
+        h = h1 + h2;
+        h = (!achrom && fabs(h1 - h2) > 180.0) ? (h < 360.0 ? h + 360.0 : h - 360.0) : h;
+        h = achrom ? h : 0.5 * h;
+
+        /* T from the multiple angles of h */
+        icmFastSinCosDeg(&sh, &ch, h);
+        c2h = 2.0 * ch * ch - 1.0;
+        s2h = 2.0 * sh * ch;
+        c3h = ch * (4.0 * ch * ch - 3.0);
+        s3h = sh * (3.0 - 4.0 * sh * sh);
+        c4h = 2.0 * c2h * c2h - 1.0;
+        s4h = 2.0 * s2h * c2h;
+        T = 1.0 - 0.17 * (ch * 0.86602540378443865 + sh * 0.5)           /* cos(h - 30) */
+                + 0.24 * c2h                                            /* cos(2h) */
+                + 0.32 * (c3h * 0.99452189536827333 - s3h * 0.10452846326765347) /* cos(3h + 6) */
+                - 0.2 * (c4h * 0.45399049973954675 + s4h * 0.89100652418836786); /* cos(4h - 63) */
+
+        hh = (h - 275.0)/25.0;
+        ddeg = 30.0 * icmFastExpNeg(hh * hh);
+        C2_ = C * C;
+        C7 = C2_ * C2_ * C2_ * C;
+        RC = 2.0 * sqrt(C7/(C7 + 6103515625.0));
+        L50sq = (L - 50.0) * (L - 50.0);
+        SL = 1.0 + (0.015 * L50sq)/sqrt(20.0 + L50sq);
+        SC = 1.0 + 0.045 * C;
+        SH = 1.0 + 0.015 * C * T;
+        icmFastSinCosDeg(&srt, &crt, 2.0 * ddeg);
+        RT = -srt * RC;
+
+        dLs = dL/SL;
+        dCs = dC/SC;
+        dHs = dH/SH;
+
+        out[i] = sqrt(dLs * dLs + dCs * dCs + dHs * dHs + RT * dCs * dHs);
+    }
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - */
-/* Forward and Backward Matrix type conversion */
-/* Return 0 on success, 1 if clipping occured, 2 on other error */
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Array statistics, used to summarise arrays of Delta E values. */
+
+#define STATS_CHUNK 65536        /* Values per reduction job */
+
+/* Context for a parallel statistics reduction */
+typedef struct {
+    double *v;                    /* Values */
+    unsigned int n;                /* Number of values */
+    double *mean, *m2;            /* Per chunk mean and sum of squared deviations */
+    double *min, *max;            /* Per chunk min and max */
+} icmStatsCtx;
+
+/* Reduce one chunk. Called by icmParallel() */
+static int icmArrayStats_chunk(void *cntx, int thix, int jix) {
+    icmStatsCtx *sx = (icmStatsCtx *)cntx;
+    unsigned int i, s, e;
+    double sum = 0.0, m2 = 0.0, mean, min, max;
+
+    s = jix * STATS_CHUNK;
+    e = s + STATS_CHUNK;
+    if (e > sx->n)
+        e = sx->n;
+
+    /* Sum the differences from the first value, which keeps */
+    /* the sum small if the values are close together */
+    min = max = sx->v[s];
+    for (i = s; i < e; i++) {
+        double vv = sx->v[i];
+        sum += vv - sx->v[s];
+        min = vv < min ? vv : min;
+        max = vv > max ? vv : max;
+    }
+    mean = sx->v[s] + sum/(e - s);
+
+    /* Second pass over the chunk while it is in cache, so that a */
+    /* small spread about a large mean doesn't lose precision */
+    for (i = s; i < e; i++) {
+        double dv = sx->v[i] - mean;
+        m2 += dv * dv;
+    }
+    sx->mean[jix] = mean;
+    sx->m2[jix] = m2;
+    sx->min[jix] = min;
+    sx->max[jix] = max;
 
-/* Individual components of Fwd conversion: */
-static int
-icmLuMatrixFwd_curve (
-icmLuMatrix *p,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    icc *icp = p->icp;
-    int rv = 0;
+    return 0;
+}
 
-    /* Curve lookups */
-    if ((rv |= p->redCurve->lookup_fwd(  p->redCurve,  &out[0],&in[0])) > 1
-     || (rv |= p->greenCurve->lookup_fwd(p->greenCurve,&out[1],&in[1])) > 1
-     || (rv |= p->blueCurve->lookup_fwd( p->blueCurve, &out[2],&in[2])) > 1) {
-        sprintf(icp->err,"icc_lookup: Curve->lookup_fwd() failed");
-        icp->errc = rv;
+/* Compute the minimum, maximum, mean and standard deviation of n values */
+/* using up to nthreads threads (0 = icmNumThreads()). The chunking doesn't */
+/* depend on the number of threads, so the result is always the same. */
+/* Return 0 on success, 2 on a memory allocation failure */
+int icmArrayStats(
+    icmAlloc *al,                /* Allocator for temporary storage */
+    icmStats *st,                /* Return the statistics */
+    double *v,                    /* Values */
+    unsigned int n,                /* Number of values */
+    int nthreads
+) {
+    icmStatsCtx sx;
+    double mean = 0.0, m2 = 0.0, cn = 0.0;
+    int nchunks, ch;
+
+    st->n = n;
+    st->min = st->max = st->mean = st->stddev = 0.0;
+    if (n == 0)
+        return 0;
+
+    nchunks = (n + STATS_CHUNK - 1)/STATS_CHUNK;
+    sx.v = v;
+    sx.n = n;
+    if ((sx.mean = (double *) al->malloc(al, sizeof(double) * 4 * nchunks)) == NULL)
         return 2;
-    }
+    sx.m2 = sx.mean + nchunks;
+    sx.min = sx.m2 + nchunks;
+    sx.max = sx.min + nchunks;
+
+    icmParallel(nthreads, nchunks, (void *)&sx, icmArrayStats_chunk);
+
+    st->min = sx.min[0];
+    st->max = sx.max[0];
+    /* Combine the chunks' means and squared deviations, */
+    /* after Chan, Golub and LeVeque */
+    for (ch = 0; ch < nchunks; ch++) {
+        double nn = (double)(ch < (nchunks-1) ? STATS_CHUNK : n - ch * STATS_CHUNK);
+        double delta = sx.mean[ch] - mean;
+        mean += delta * nn/(cn + nn);
+        m2 += sx.m2[ch] + delta * delta * cn * nn/(cn + nn);
+        cn += nn;
+        if (sx.min[ch] < st->min)
+            st->min = sx.min[ch];
+        if (sx.max[ch] > st->max)
+            st->max = sx.max[ch];
+    }
+    al->free(al, sx.mean);
+
+    st->mean = mean;
+    st->stddev = sqrt(m2/n);
 
-    return rv;
+    return 0;
 }
 
-static int
-icmLuMatrixFwd_matrix (
-icmLuMatrix *p,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    double tt[3];
+/* Partition v[s..e] so that v[k] holds the k'th smallest value */
+static void icmSelect(double *v, unsigned int s, unsigned int e, unsigned int k) {
 
-    /* Matrix */
-    tt[0] = p->mx[0][0] * in[0] + p->mx[0][1] * in[1] + p->mx[0][2] * in[2];
-    tt[1] = p->mx[1][0] * in[0] + p->mx[1][1] * in[1] + p->mx[1][2] * in[2];
-    tt[2] = p->mx[2][0] * in[0] + p->mx[2][1] * in[1] + p->mx[2][2] * in[2];
+    while (s < e) {
+        unsigned int i, j, m;
+        double pv, tt;
 
-    out[0] = tt[0];
-    out[1] = tt[1];
-    out[2] = tt[2];
+        /* Median of three pivot */
+        m = s + (e - s)/2;
+        if (v[m] < v[s]) { tt = v[m]; v[m] = v[s]; v[s] = tt; }
+        if (v[e] < v[s]) { tt = v[e]; v[e] = v[s]; v[s] = tt; }
+        if (v[e] < v[m]) { tt = v[e]; v[e] = v[m]; v[m] = tt; }
+        pv = v[m];
 
-    return rv;
+        for (i = s, j = e; i <= j;) {
+            while (v[i] < pv)
+                i++;
+            while (v[j] > pv)
+                j--;
+            if (i <= j) {
+                tt = v[i]; v[i] = v[j]; v[j] = tt;
+                i++;
+                if (j == 0)
+                    break;
+                j--;
+            }
+        }
+        if (k <= j)
+            e = j;
+        else if (k >= i)
+            s = i;
+        else
+            break;
+    }
 }
 
-static int
-icmLuMatrixFwd_abs (/* Abs comes last in Fwd conversion */
-icmLuMatrix *p,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
+/* Compute npct percentiles (0.0 .. 100.0) of n values, interpolating */
+/* between the closest ranks. The values are not modified. */
+/* Return 0 on success, 2 on a memory allocation failure */
+int icmArrayPercentiles(
+    icmAlloc *al,                /* Allocator for temporary storage */
+    double *out,                /* Return the npct percentile values */
+    double *pct,                /* Percentiles to compute */
+    int npct,
+    double *v,                    /* Values */
+    unsigned int n                /* Number of values */
 ) {
-    int rv = 0;
+    double *tv;
+    int j;
 
-    if (out != in) {    /* Don't alter input values */
-        out[0] = in[0];
-        out[1] = in[1];
-        out[2] = in[2];
+    if (n == 0) {
+        for (j = 0; j < npct; j++)
+            out[j] = 0.0;
+        return 0;
     }
 
-    /* If required, convert from Relative to Absolute colorimetric */
-    if (p->intent == icAbsoluteColorimetric
-     || p->intent == icmAbsolutePerceptual
-     || p->intent == icmAbsoluteSaturation) {
-        icmMulBy3x3(out, p->toAbs, out);
+    if ((tv = (double *) al->malloc(al, sizeof(double) * n)) == NULL)
+        return 2;
+    memcpy(tv, v, sizeof(double) * n);
+
+    for (j = 0; j < npct; j++) {
+        double fk, w, v0, v1;
+        unsigned int i, k;
+
+        fk = pct[j]/100.0 * (n - 1.0);
+        if (fk < 0.0)
+            fk = 0.0;
+        else if (fk > (n - 1.0))
+            fk = n - 1.0;
+        k = (unsigned int)floor(fk);
+        w = fk - k;
+
+        icmSelect(tv, 0, n-1, k);
+        v0 = v1 = tv[k];
+
+        /* The next rank is the smallest value above k */
+        if (w > 0.0 && k < (n-1)) {
+            v1 = tv[k+1];
+            for (i = k+2; i < n; i++) {
+                if (tv[i] < v1)
+                    v1 = tv[i];
+            }
+        }
+        out[j] = v0 + w * (v1 - v0);
     }
 
-    /* If e_pcs is Lab, then convert XYZ to Lab */
-    if (p->e_pcs == icSigLabData)
-        icmXYZ2Lab(&p->pcswht, out, out);
+    al->free(al, tv);
 
-    return rv;
+    return 0;
 }
 
+#undef STATS_CHUNK
 
-/* Overall Fwd conversion (Dev->PCS)*/
-static int
-icmLuMatrixFwd_lookup (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuMatrix *p = (icmLuMatrix *)pp;
-    rv |= icmLuMatrixFwd_curve(p, out, in);
-    rv |= icmLuMatrixFwd_matrix(p, out, out);
-    rv |= icmLuMatrixFwd_abs(p, out, out);
-    return rv;
-}
+/* Return value i of the Halton sequence in the given prime base */
+static double icmHalton(unsigned int i, int base) {
+    double f = 1.0, rv = 0.0;
 
-/* Three stage conversion routines */
-static int
-icmLuMatrixFwd_lookup_in (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuMatrix *p = (icmLuMatrix *)pp;
-    rv |= icmLuMatrixFwd_curve(p, out, in);
+    for (; i > 0; i /= base) {
+        f /= (double)base;
+        rv += f * (double)(i % base);
+    }
     return rv;
 }
 
-static int
-icmLuMatrixFwd_lookup_core (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuMatrix *p = (icmLuMatrix *)pp;
-    rv |= icmLuMatrixFwd_matrix(p, out, in);
-    rv |= icmLuMatrixFwd_abs(p, out, out);
-    return rv;
-}
+/* Set out[inn] to point i of a Halton sequence spanning min[] .. max[], */
+/* using the first inn primes as the bases. Successive points stratify */
+/* the space evenly, whatever the number of points used. */
+void icmHaltonPoint(double *out, unsigned int i, int inn, double *min, double *max) {
+    static int primes[MAX_CHAN] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47 };
+    int e;
 
-static int
-icmLuMatrixFwd_lookup_out (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    out[0] = in[0];
-    out[1] = in[1];
-    out[2] = in[2];
-    return rv;
+    for (e = 0; e < inn; e++)
+        out[e] = min[e] + icmHalton(i, primes[e]) * (max[e] - min[e]);
 }
 
-/* -  -  -  -  -  -  -  -  -  -  -  -  -  - */
-/* Individual components of Bwd conversion: */
 
-static int
-icmLuMatrixBwd_abs (/* Abs comes first in Bwd conversion */
-icmLuMatrix *p,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Chromatic adaptation transform utility */
+/* Return a 3x3 chromatic adaptation matrix */
+/* Use icmMulBy3x3(dst, mat, src) */
+void icmChromAdaptMatrix(
+    int flags,                /* Use bradford, Transform given matrix flags */
+    icmXYZNumber d_wp,        /* Destination white point */
+    icmXYZNumber s_wp,        /* Source white point */
+    double mat[3][3]        /* Destination matrix */
 ) {
-    int rv = 0;
+    double dst[3], src[3];            /* Source & destination white points */
+    double vkmat[3][3];                /* Von Kries matrix */
+#ifdef NEVER
+    static double bradford[3][3] = {    /* Linear cone space matrix */
+        {  1.0,  0.0, 0.0 },
+        {  0.0,  1.0, 0.0 },
+        {  0.0,  0.0, 1.0 }
+    };
+#endif /* NEVER */
+    static double bradford[3][3] = {    /* Bradford cone space matrix */
+        {  0.8951,  0.2664, -0.1614 },
+        { -0.7502,  1.7135,  0.0367 },
+        {  0.0389, -0.0685,  1.0296 }
+    };
+    static int inited = 0;            /* Compute inverse bradford once */
+    static double ibradford[3][3];    /* Inverse Bradford */
 
-    if (out != in) {    /* Don't alter input values */
-        out[0] = in[0];
-        out[1] = in[1];
-        out[2] = in[2];
+    /* Set initial matrix to unity */
+    if (!(flags & ICM_CAM_MULMATRIX)) {
+        icmSetUnity3x3(mat);
     }
 
-    /* If e_pcs is Lab, then convert Lab to XYZ */
-    if (p->e_pcs == icSigLabData)
-        icmLab2XYZ(&p->pcswht, out, out);
+    icmXYZ2Ary(src, s_wp);
+    icmXYZ2Ary(dst, d_wp);
 
-    /* If required, convert from Absolute to Relative colorimetric */
-    if (p->intent == icAbsoluteColorimetric
-     || p->intent == icmAbsolutePerceptual
-     || p->intent == icmAbsoluteSaturation) {
-        icmMulBy3x3(out, p->fromAbs, out);
+    if (flags & ICM_CAM_BRADFORD) {
+        icmMulBy3x3(src, bradford, src);
+        icmMulBy3x3(dst, bradford, dst);
     }
 
-    return rv;
-}
+    /* Setup the Von Kries white point adaptation matrix */
+    vkmat[0][0] = dst[0]/src[0];
+    vkmat[1][1] = dst[1]/src[1];
+    vkmat[2][2] = dst[2]/src[2];
+    vkmat[0][1] = vkmat[0][2] = 0.0;
+    vkmat[1][0] = vkmat[1][2] = 0.0;
+    vkmat[2][0] = vkmat[2][1] = 0.0;
 
-static int
-icmLuMatrixBwd_matrix (
-icmLuMatrix *p,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    double tt[3];
+    /* Transform to Bradford space if requested */
+    if (flags & ICM_CAM_BRADFORD) {
+        icmMul3x3(mat, bradford);
+    }
 
-    tt[0] = in[0];
-    tt[1] = in[1];
-    tt[2] = in[2];
+    /* Apply chromatic adaptation */
+    icmMul3x3(mat, vkmat);
 
-    /* Matrix */
-    out[0] = p->bmx[0][0] * tt[0] + p->bmx[0][1] * tt[1] + p->bmx[0][2] * tt[2];
-    out[1] = p->bmx[1][0] * tt[0] + p->bmx[1][1] * tt[1] + p->bmx[1][2] * tt[2];
-    out[2] = p->bmx[2][0] * tt[0] + p->bmx[2][1] * tt[1] + p->bmx[2][2] * tt[2];
+    /* Transform from Bradford space */
+    if (flags & ICM_CAM_BRADFORD) {
+        if (inited == 0) {
+            icmInverse3x3(ibradford, bradford);
+            inited = 1;
+        }
+        icmMul3x3(mat, ibradford);
+    }
 
-    return rv;
+    /* We're done */
 }
 
-static int
-icmLuMatrixBwd_curve (
-icmLuMatrix *p,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    icc *icp = p->icp;
-    int rv = 0;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
 
-    /* Curves */
-    if ((rv |= p->redCurve->lookup_bwd(p->redCurve,&out[0],&in[0])) > 1
-     ||    (rv |= p->greenCurve->lookup_bwd(p->greenCurve,&out[1],&in[1])) > 1
-     || (rv |= p->blueCurve->lookup_bwd(p->blueCurve,&out[2],&in[2])) > 1) {
-        sprintf(icp->err,"icc_lookup: Curve->lookup_bwd() failed");
-        icp->errc = rv;
-        return 2;
-    }
-    return rv;
-}
-
-/* Overall Bwd conversion (PCS->Dev) */
-static int
-icmLuMatrixBwd_lookup (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuMatrix *p = (icmLuMatrix *)pp;
-    rv |= icmLuMatrixBwd_abs(p, out, in);
-    rv |= icmLuMatrixBwd_matrix(p, out, out);
-    rv |= icmLuMatrixBwd_curve(p, out, out);
-    return rv;
-}
+/* RGB primaries device to RGB->XYZ transform matrix. */
+/* We assume that the device is perfectly additive, but that */
+/* there may be a scale factor applied to the channels to */
+/* match the white point at RGB = 1. */
 
-/* Three stage conversion routines */
-static int
-icmLuMatrixBwd_lookup_in (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
+/* Return non-zero if matrix would be singular */
+int icmRGBprim2matrix(
+    icmXYZNumber white,        /* White point */
+    icmXYZNumber red,        /* Red colorant */
+    icmXYZNumber green,        /* Green colorant */
+    icmXYZNumber blue,        /* Blue colorant */
+    double mat[3][3]        /* Destination matrix */
 ) {
-    int rv = 0;
-    out[0] = in[0];
-    out[1] = in[1];
-    out[2] = in[2];
-    return rv;
-}
+    double tmat[3][3];
+    double t[3];
 
-static int
-icmLuMatrixBwd_lookup_core (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuMatrix *p = (icmLuMatrix *)pp;
-    rv |= icmLuMatrixBwd_abs(p, out, in);
-    rv |= icmLuMatrixBwd_matrix(p, out, out);
-    return rv;
-}
+    /* Assemble the colorants into a matrix */
+    tmat[0][0] = red.X;
+    tmat[0][1] = green.X;
+    tmat[0][2] = blue.X;
+    tmat[1][0] = red.Y;
+    tmat[1][1] = green.Y;
+    tmat[1][2] = blue.Y;
+    tmat[2][0] = red.Z;
+    tmat[2][1] = green.Z;
+    tmat[2][2] = blue.Z;
 
-static int
-icmLuMatrixBwd_lookup_out (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuMatrix *p = (icmLuMatrix *)pp;
-    rv |= icmLuMatrixBwd_curve(p, out, in);
-    return rv;
-}
+    /* Compute the inverse */
+    if (icmInverse3x3(mat, tmat))
+        return 1;
 
-/* -  -  -  -  -  -  -  -  -  -  -  -  -  - */
+    /* Compute scale vector that maps colorants to white point */
+    t[0] = mat[0][0] * white.X 
+         + mat[0][1] * white.Y 
+         + mat[0][2] * white.Z; 
+    t[1] = mat[1][0] * white.X 
+         + mat[1][1] * white.Y 
+         + mat[1][2] * white.Z; 
+    t[2] = mat[2][0] * white.X 
+         + mat[2][1] * white.Y 
+         + mat[2][2] * white.Z; 
 
-static void
-icmLuMatrix_delete(
-icmLuBase *p
-) {
-    icc *icp = p->icp;
+    /* Now formulate the transform matrix */
+    mat[0][0] = red.X   * t[0];
+    mat[0][1] = green.X * t[1];
+    mat[0][2] = blue.X  * t[2];
+    mat[1][0] = red.Y   * t[0];
+    mat[1][1] = green.Y * t[1];
+    mat[1][2] = blue.Y  * t[2];
+    mat[2][0] = red.Z   * t[0];
+    mat[2][1] = green.Z * t[1];
+    mat[2][2] = blue.Z  * t[2];
 
-    icp->al->free(icp->al, p);
+    return 0;
 }
 
-/* We setup valid fwd and bwd component conversions, */
-/* but setup only the asked for overal conversion. */
-static icmLuBase *
-new_icmLuMatrix(
-    struct _icc          *icp,
-    icColorSpaceSignature inSpace,        /* Native Input color space */
-    icColorSpaceSignature outSpace,        /* Native Output color space */
-    icColorSpaceSignature pcs,            /* Native PCS */
-    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
-    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
-    icColorSpaceSignature e_pcs,        /* Effective PCS */
-    icRenderingIntent     intent,        /* Rendering intent */
-    icmLookupFunc         func,            /* Functionality requested */
-    int dir                                /* 0 = fwd, 1 = bwd */
-) {
-    icmLuMatrix *p;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Some PCS utility functions */
 
-    if ((p = (icmLuMatrix *) icp->al->calloc(icp->al,1,sizeof(icmLuMatrix))) == NULL)
-        return NULL;
-    p->icp      = icp;
-    p->del      = icmLuMatrix_delete;
-    p->lutspaces= icmLutSpaces;
-    p->spaces   = icmLuSpaces;
-    p->XYZ_Rel2Abs = icmLuXYZ_Rel2Abs;
-    p->XYZ_Abs2Rel = icmLuXYZ_Abs2Rel;
-    p->get_lutranges = icmLu_get_lutranges;
-    p->get_ranges = icmLu_get_ranges;
-    p->init_wh_bk = icmLuInit_Wh_bk;
-    p->wh_bk_points = icmLuWh_bk_points;
-    p->lu_wh_bk_points = icmLuLu_wh_bk_points;
-    p->fwd_lookup = icmLuMatrixFwd_lookup;
-    p->fwd_curve  = icmLuMatrixFwd_curve;
-    p->fwd_matrix = icmLuMatrixFwd_matrix;
-    p->fwd_abs    = icmLuMatrixFwd_abs;
-    p->bwd_lookup = icmLuMatrixBwd_lookup;
-    p->bwd_abs    = icmLuMatrixBwd_abs;
-    p->bwd_matrix = icmLuMatrixBwd_matrix;
-    p->bwd_curve  = icmLuMatrixBwd_curve;
-    if (dir) {
-        p->ttype         = icmMatrixBwdType;
-        p->lookup        = icmLuMatrixBwd_lookup;
-        p->lookup_in     = icmLuMatrixBwd_lookup_in;
-        p->lookup_core   = icmLuMatrixBwd_lookup_core;
-        p->lookup_out    = icmLuMatrixBwd_lookup_out;
-        p->lookup_inv_in = icmLuMatrixFwd_lookup_out;        /* Opposite of Bwd_lookup_in */
-    } else {
-        p->ttype         = icmMatrixFwdType;
-        p->lookup        = icmLuMatrixFwd_lookup;
-        p->lookup_in     = icmLuMatrixFwd_lookup_in;
-        p->lookup_core   = icmLuMatrixFwd_lookup_core;
-        p->lookup_out    = icmLuMatrixFwd_lookup_out;
-        p->lookup_inv_in = icmLuMatrixBwd_lookup_out;        /* Opposite of Fwd_lookup_in */
-    }
+/* Clip Lab, while maintaining hue angle. */
+/* Return nz if clipping occured */
+int icmClipLab(double out[3], double in[3]) {
+    double C;
 
-    /* Lookup the white and black points */
-    if (p->init_wh_bk((icmLuBase *)p)) {
-        p->del((icmLuBase *)p);
-        return NULL;
-    }
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
 
-    /* Note that we can use matrix type even if PCS is Lab, */
-    /* by simply converting it. */
+    if (out[0] >= 0.0 && out[0] <= 100.0
+     && out[1] >= -128.0 && out[1] <= 127.0
+     && out[2] >= -128.0 && out[2] <= 127.0)
+        return 0;
 
-    /* Find the appropriate tags */
-    if ((p->redCurve = (icmCurve *)icp->read_tag(icp, icSigRedTRCTag)) == NULL
-     || p->redCurve->ttype != icSigCurveType
-     || (p->greenCurve = (icmCurve *)icp->read_tag(icp, icSigGreenTRCTag)) == NULL
-     || p->greenCurve->ttype != icSigCurveType
-     || (p->blueCurve = (icmCurve *)icp->read_tag(icp, icSigBlueTRCTag)) == NULL
-     || p->blueCurve->ttype != icSigCurveType
-     || (p->redColrnt = (icmXYZArray *)icp->read_tag(icp, icSigRedColorantTag)) == NULL
-     || p->redColrnt->ttype != icSigXYZType || p->redColrnt->size < 1
-     || (p->greenColrnt = (icmXYZArray *)icp->read_tag(icp, icSigGreenColorantTag)) == NULL
-     || p->greenColrnt->ttype != icSigXYZType || p->greenColrnt->size < 1
-     || (p->blueColrnt = (icmXYZArray *)icp->read_tag(icp, icSigBlueColorantTag)) == NULL
-     || p->blueColrnt->ttype != icSigXYZType || p->blueColrnt->size < 1) {
-        p->del((icmLuBase *)p);
-        return NULL;
+    /* Clip L */
+    if (out[0] < 0.0)
+        out[0] = 0.0;
+    else if (out[0] > 100.0)
+        out[0] = 100.0;
+    
+    C = out[1];
+    if (fabs(out[2]) > fabs(C))
+        C = out[2];
+    if (C < -128.0 || C > 127.0) {
+        if (C < 0.0)
+            C = -128.0/C;
+        else
+            C = 127.0/C;
+        out[1] *= C;
+        out[2] *= C;
     }
 
-    /* Setup the matrix */
-    p->mx[0][0] = p->redColrnt->data[0].X;
-    p->mx[0][1] = p->greenColrnt->data[0].X;
-    p->mx[0][2] = p->blueColrnt->data[0].X;
-    p->mx[1][1] = p->greenColrnt->data[0].Y;
-    p->mx[1][0] = p->redColrnt->data[0].Y;
-    p->mx[1][2] = p->blueColrnt->data[0].Y;
-    p->mx[2][1] = p->greenColrnt->data[0].Z;
-    p->mx[2][0] = p->redColrnt->data[0].Z;
-    p->mx[2][2] = p->blueColrnt->data[0].Z;
+    return 1;
+}
 
-#ifndef ICM_STRICT    
-    /* Workaround for buggy Kodak RGB profiles. Their matrix values */
-    /* may be scaled to 100 rather than 1.0, and the colorant curves */
-    /* may be scaled by 0.5 */
-    if (icp->header->cmmId == str2tag("KCMS")) {
-        int i, j, oc = 0;
-        for (i = 0; i < 3; i++)
-            for (j = 0; j < 3; j++)
-                if (p->mx[i][j] > 5.0)
-                    oc++;
-        if (oc > 4) {        /* Looks like it */
-            for (i = 0; i < 3; i++)
-                for (j = 0; j < 3; j++)
-                    p->mx[i][j] /= 100.0;
-        }
-    }
-#endif /* ICM_STRICT */
+/* Clip XYZ, while maintaining hue angle */
+/* Return nz if clipping occured */
+int icmClipXYZ(double out[3], double in[3]) {
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
 
-    if (icmInverse3x3(p->bmx, p->mx) != 0) {    /* Compute inverse */
-        sprintf(icp->err,"icc_new_iccLuMatrix: Matrix wasn't invertable");
-        icp->errc = 2;
-        p->del((icmLuBase *)p);
-        return NULL;
-    }
+    if (out[0] >= 0.0 && out[0] <= 1.9999
+     && out[1] >= 0.0 && out[1] <= 1.9999
+     && out[2] >= 0.0 && out[2] <= 1.9999)
+        return 0;
 
-    p->pcswht = icp->header->illuminant;
-    p->intent   = intent;
-    p->function = func;
-    p->inSpace  = inSpace;
-    p->outSpace = outSpace;
-    p->pcs      = pcs;
-    p->e_inSpace  = e_inSpace;
-    p->e_outSpace = e_outSpace;
-    p->e_pcs      = e_pcs;
+    /* Clip Y and scale X and Z similarly */
 
-    /* Lookup the white and black points */
-    if (p->init_wh_bk((icmLuBase *)p)) {
-        p->del((icmLuBase *)p);
-        return NULL;
+    if (out[1] > 1.9999) {
+        out[0] *= 1.9999/out[1];
+        out[2] *= 1.9999/out[1];
+        out[1] = 1.9999;
+    } else if (out[1] < 0.0) {
+        out[0] = 0.0;
+        out[1] = 0.0;
+        out[2] = 0.0;
     }
 
-    return (icmLuBase *)p;
-}
+    if (out[0] < 0.0 || out[0] > 1.9999
+     || out[2] < 0.0 || out[2] > 1.9999) {
+        double D50[3] = { 0.9642, 1.0000, 0.8249 };
+        double bb = 0.0;
 
-static icmLuBase *
-new_icmLuMatrixFwd(
-    struct _icc          *icp,
-    icColorSpaceSignature inSpace,        /* Native Input color space */
-    icColorSpaceSignature outSpace,        /* Native Output color space */
-    icColorSpaceSignature pcs,            /* Native PCS */
-    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
-    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
-    icColorSpaceSignature e_pcs,        /* Effective PCS */
-    icRenderingIntent     intent,        /* Rendering intent */
-    icmLookupFunc         func            /* Functionality requested */
-) {
-    return new_icmLuMatrix(icp, inSpace, outSpace, pcs, e_inSpace, e_outSpace, e_pcs,
-                           intent, func, 0);
-}
+        /* Scale the D50 so that it has the same Y value as our color */
+        D50[0] *= out[1];
+        D50[1] *= out[1];
+        D50[2] *= out[1];
 
+        /* Figure out what blend factor with Y scaled D50, brings our */
+        /* color X and Z values into range */
 
-static icmLuBase *
-new_icmLuMatrixBwd(
-    struct _icc          *icp,
-    icColorSpaceSignature inSpace,        /* Native Input color space */
-    icColorSpaceSignature outSpace,        /* Native Output color space */
-    icColorSpaceSignature pcs,            /* Native PCS */
-    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
-    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
-    icColorSpaceSignature e_pcs,        /* Effective PCS */
-    icRenderingIntent     intent,        /* Rendering intent */
-    icmLookupFunc         func            /* Functionality requested */
-) {
-    return new_icmLuMatrix(icp, inSpace, outSpace, pcs, e_inSpace, e_outSpace, e_pcs,
-                           intent, func, 1);
+        if (out[0] < 0.0) {
+            double b;
+            b = (0.0 - out[0])/(D50[0] - out[0]);
+            if (b > bb)
+                bb = b;
+        } else if (out[0] > 1.9999) {
+            double b;
+            b = (1.9999 - out[0])/(D50[0] - out[0]);
+            if (b > bb)
+                bb = b;
+        }
+        if (out[2] < 0.0) {
+            double b;
+            b = (0.0 - out[2])/(D50[2] - out[2]);
+            if (b > bb)
+                bb = b;
+        } else if (out[2] > 1.9999) {
+            double b;
+            b = (1.9999 - out[2])/(D50[2] - out[2]);
+            if (b > bb)
+                bb = b;
+        }
+        /* Do the desaturation */
+        out[0] = D50[0] * bb + (1.0 - bb) * out[0];
+        out[2] = D50[2] * bb + (1.0 - bb) * out[2];
+    }
+    return 1;
 }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - */
-/* Forward and Backward Multi-Dimensional Interpolation type conversion */
-/* Return 0 on success, 1 if clipping occured, 2 on other error */
-
-/* Components of overall lookup, in order */
-static int icmLuLut_in_abs(icmLuLut *p, double *out, double *in) {
-    icmLut *lut = p->lut;
-    int rv = 0;
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
 
-    DBLLL(("icm in_abs: input %s\n",icmPdv(lut->inputChan, in)));
-    if (out != in) {
-        unsigned int i;
-        for (i = 0; i < lut->inputChan; i++)        /* Don't alter input values */
-            out[i] = in[i];
-    }
+/* Object for computing RFC 1321 MD5 checksums. */
+/* Derived from Colin Plumb's 1993 public domain code. */
 
-    /* If Bwd Lut, take care of Absolute color space and effective input space */
-    if ((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
-        && (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation)) {
-    
-        if (p->e_inSpace == icSigLabData) {
-            icmLab2XYZ(&p->pcswht, out, out);
-            DBLLL(("icm in_abs: after Lab2XYZ %s\n",icmPdv(lut->inputChan, out)));
-        }
+/* Reset the checksum */
+static void icmMD5_reset(icmMD5 *p) {
+    p->tlen = 0;
 
-        /* Convert from Absolute to Relative colorimetric */
-        icmMulBy3x3(out, p->fromAbs, out);
-        DBLLL(("icm in_abs: after fromAbs %s\n",icmPdv(lut->inputChan, out)));
-        
-        if (p->inSpace == icSigLabData) {
-            icmXYZ2Lab(&p->pcswht, out, out);
-            DBLLL(("icm in_abs: after XYZ2Lab %s\n",icmPdv(lut->inputChan, out)));
-        }
+    p->sum[0] = 0x67452301;
+    p->sum[1] = 0xefcdab89;
+    p->sum[2] = 0x98badcfe;
+    p->sum[3] = 0x10325476;
 
-    } else {
+    p->fin = 0;
+}
 
-        /* Convert from Effective to Native input space */
-        if (p->e_inSpace == icSigLabData && p->inSpace == icSigXYZData) {
-            icmLab2XYZ(&p->pcswht, out, out);
-            DBLLL(("icm in_abs: after Lab2XYZ %s\n",icmPdv(lut->inputChan, out)));
-        } else if (p->e_inSpace == icSigXYZData && p->inSpace == icSigLabData) {
-            icmXYZ2Lab(&p->pcswht, out, out);
-            DBLLL(("icm in_abs: after XYZ2Lab %s\n",icmPdv(lut->inputChan, out)));
-        }
-    }
-    DBLLL(("icm in_abs: returning %s\n",icmPdv(lut->inputChan, out)));
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
 
-    return rv;
-}
+#define MD5STEP(f, w, x, y, z, k, xtra, s) \
+        w += f(x, y, z) + X[k] + xtra; \
+        w = (w << s) | (w >> (32-s)); \
+        w += x;
 
-/* Possible matrix lookup */
-static int icmLuLut_matrix(icmLuLut *p, double *out, double *in) {
-    icmLut *lut = p->lut;
-    int rv = 0;
+/* MD5 words are little endian, so they can be copied directly */
+#if (defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) \
+     && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) \
+ || defined(_M_IX86) || defined(_M_X64)
+# define MD5_LITTLE_ENDIAN
+#endif
 
-    if (p->usematrix)        
-        rv |= lut->lookup_matrix(lut,out,in);
-    else if (out != in) {
-        unsigned int i;
-        for (i = 0; i < lut->inputChan; i++)
-            out[i] = in[i];
-    }
-    return rv;
-}
+/* Add another 64 bytes to the checksum */
+static void icmMD5_accume(icmMD5 *p, ORD8 *in) {
+    ORD32 X[16], a, b, c, d;
+#ifndef MD5_LITTLE_ENDIAN
+    int i;
+#endif
 
-/* Do input -> input' lookup */
-static int icmLuLut_input(icmLuLut *p, double *out, double *in) {
-    icmLut *lut = p->lut;
-    int rv = 0;
+    /* Assemble the 16 words once */
+#ifdef MD5_LITTLE_ENDIAN
+    memcpy(X, in, 64);
+#else
+    for (i = 0; i < 16; i++, in += 4)
+        X[i] = in[0] + ((ORD32)in[1] << 8) + ((ORD32)in[2] << 16) + ((ORD32)in[3] << 24);
+#endif
 
-    p->in_normf(out, in);                         /* Normalize from input color space */
-    rv |= lut->lookup_input(lut,out,out);        /* Lookup though input tables */
-    p->in_denormf(out,out);                        /* De-normalize to input color space */
-    return rv;
-}
+    a = p->sum[0];
+    b = p->sum[1];
+    c = p->sum[2];
+    d = p->sum[3];
 
-/* Do input'->output' lookup */
-static int icmLuLut_clut(icmLuLut *p, double *out, double *in) {
-    icmLut *lut = p->lut;
-    double temp[MAX_CHAN];
-    int rv = 0;
+    MD5STEP(F1, a, b, c, d, 0,  0xd76aa478, 7);
+    MD5STEP(F1, d, a, b, c, 1,  0xe8c7b756, 12);
+    MD5STEP(F1, c, d, a, b, 2,  0x242070db, 17);
+    MD5STEP(F1, b, c, d, a, 3,  0xc1bdceee, 22);
+    MD5STEP(F1, a, b, c, d, 4,  0xf57c0faf, 7);
+    MD5STEP(F1, d, a, b, c, 5,  0x4787c62a, 12);
+    MD5STEP(F1, c, d, a, b, 6,  0xa8304613, 17);
+    MD5STEP(F1, b, c, d, a, 7,  0xfd469501, 22);
+    MD5STEP(F1, a, b, c, d, 8,  0x698098d8, 7);
+    MD5STEP(F1, d, a, b, c, 9,  0x8b44f7af, 12);
+    MD5STEP(F1, c, d, a, b, 10, 0xffff5bb1, 17);
+    MD5STEP(F1, b, c, d, a, 11, 0x895cd7be, 22);
+    MD5STEP(F1, a, b, c, d, 12, 0x6b901122, 7);
+    MD5STEP(F1, d, a, b, c, 13, 0xfd987193, 12);
+    MD5STEP(F1, c, d, a, b, 14, 0xa679438e, 17);
+    MD5STEP(F1, b, c, d, a, 15, 0x49b40821, 22);
+
+    MD5STEP(F2, a, b, c, d, 1,  0xf61e2562, 5);
+    MD5STEP(F2, d, a, b, c, 6,  0xc040b340, 9);
+    MD5STEP(F2, c, d, a, b, 11, 0x265e5a51, 14);
+    MD5STEP(F2, b, c, d, a, 0,  0xe9b6c7aa, 20);
+    MD5STEP(F2, a, b, c, d, 5,  0xd62f105d, 5);
+    MD5STEP(F2, d, a, b, c, 10, 0x02441453, 9);
+    MD5STEP(F2, c, d, a, b, 15, 0xd8a1e681, 14);
+    MD5STEP(F2, b, c, d, a, 4,  0xe7d3fbc8, 20);
+    MD5STEP(F2, a, b, c, d, 9,  0x21e1cde6, 5);
+    MD5STEP(F2, d, a, b, c, 14, 0xc33707d6, 9);
+    MD5STEP(F2, c, d, a, b, 3,  0xf4d50d87, 14);
+    MD5STEP(F2, b, c, d, a, 8,  0x455a14ed, 20);
+    MD5STEP(F2, a, b, c, d, 13, 0xa9e3e905, 5);
+    MD5STEP(F2, d, a, b, c, 2,  0xfcefa3f8, 9);
+    MD5STEP(F2, c, d, a, b, 7,  0x676f02d9, 14);
+    MD5STEP(F2, b, c, d, a, 12, 0x8d2a4c8a, 20);
+
+    MD5STEP(F3, a, b, c, d, 5,  0xfffa3942, 4);
+    MD5STEP(F3, d, a, b, c, 8,  0x8771f681, 11);
+    MD5STEP(F3, c, d, a, b, 11, 0x6d9d6122, 16);
+    MD5STEP(F3, b, c, d, a, 14, 0xfde5380c, 23);
+    MD5STEP(F3, a, b, c, d, 1,  0xa4beea44, 4);
+    MD5STEP(F3, d, a, b, c, 4,  0x4bdecfa9, 11);
+    MD5STEP(F3, c, d, a, b, 7,  0xf6bb4b60, 16);
+    MD5STEP(F3, b, c, d, a, 10, 0xbebfbc70, 23);
+    MD5STEP(F3, a, b, c, d, 13, 0x289b7ec6, 4);
+    MD5STEP(F3, d, a, b, c, 0,  0xeaa127fa, 11);
+    MD5STEP(F3, c, d, a, b, 3,  0xd4ef3085, 16);
+    MD5STEP(F3, b, c, d, a, 6,  0x04881d05, 23);
+    MD5STEP(F3, a, b, c, d, 9,  0xd9d4d039, 4);
+    MD5STEP(F3, d, a, b, c, 12, 0xe6db99e5, 11);
+    MD5STEP(F3, c, d, a, b, 15, 0x1fa27cf8, 16);
+    MD5STEP(F3, b, c, d, a, 2,  0xc4ac5665, 23);
+
+    MD5STEP(F4, a, b, c, d, 0,  0xf4292244, 6);
+    MD5STEP(F4, d, a, b, c, 7,  0x432aff97, 10);
+    MD5STEP(F4, c, d, a, b, 14, 0xab9423a7, 15);
+    MD5STEP(F4, b, c, d, a, 5,  0xfc93a039, 21);
+    MD5STEP(F4, a, b, c, d, 12, 0x655b59c3, 6);
+    MD5STEP(F4, d, a, b, c, 3,  0x8f0ccc92, 10);
+    MD5STEP(F4, c, d, a, b, 10, 0xffeff47d, 15);
+    MD5STEP(F4, b, c, d, a, 1,  0x85845dd1, 21);
+    MD5STEP(F4, a, b, c, d, 8,  0x6fa87e4f, 6);
+    MD5STEP(F4, d, a, b, c, 15, 0xfe2ce6e0, 10);
+    MD5STEP(F4, c, d, a, b, 6,  0xa3014314, 15);
+    MD5STEP(F4, b, c, d, a, 13, 0x4e0811a1, 21);
+    MD5STEP(F4, a, b, c, d, 4,  0xf7537e82, 6);
+    MD5STEP(F4, d, a, b, c, 11, 0xbd3af235, 10);
+    MD5STEP(F4, c, d, a, b, 2,  0x2ad7d2bb, 15);
+    MD5STEP(F4, b, c, d, a, 9,  0xeb86d391, 21);
 
-    p->in_normf(temp, in);                         /* Normalize from input color space */
-    rv |= p->lookup_clut(lut,out,temp);            /* Lookup though clut tables */
-    p->out_denormf(out,out);                    /* De-normalize to output color space */
-    return rv;
+    p->sum[0] += a;
+    p->sum[1] += b;
+    p->sum[2] += c;
+    p->sum[3] += d;
 }
 
-/* Do output'->output lookup */
-static int icmLuLut_output(icmLuLut *p, double *out, double *in) {
-    icmLut *lut = p->lut;
-    int rv = 0;
+#undef F1
+#undef F2
+#undef F3
+#undef F4
+#undef MD5STEP
+#undef MD5_LITTLE_ENDIAN
 
-    p->out_normf(out,in);                        /* Normalize from output color space */
-    rv |= lut->lookup_output(lut,out,out);        /* Lookup though output tables */
-    p->out_denormf(out, out);                    /* De-normalize to output color space */
-    return rv;
-}
+/* Add some bytes */
+static void icmMD5_add(icmMD5 *p, ORD8 *ibuf, unsigned int len) {
+    unsigned int bs;
 
-static int icmLuLut_out_abs(icmLuLut *p, double *out, double *in) {
-    icmLut *lut = p->lut;
-    int rv = 0;
+    if (p->fin)
+        return;                /* This is actually an error */
 
-    DBLLL(("icm out_abs: input %s\n",icmPdv(lut->outputChan, in)));
-    if (out != in) {
-        unsigned int i;
-        for (i = 0; i < lut->outputChan; i++)        /* Don't alter input values */
-            out[i] = in[i];
-    }
+    bs = p->tlen;            /* Current bytes added */
+    p->tlen = bs + len;        /* Update length after adding this buffer */
+    bs &= 0x3f;                /* Bytes already in buffer */
 
-    /* If Fwd Lut, take care of Absolute color space */
-    /* and convert from native to effective out PCS */
-    if ((p->function == icmFwd || p->function == icmPreview)
-        && (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation)) {
+    /* Deal with any existing partial bytes in p->buf */
+    if (bs) {
+        ORD8 *np = (ORD8 *)p->buf + bs;    /* Next free location in partial buffer */
 
-        if (p->outSpace == icSigLabData) {
-            icmLab2XYZ(&p->pcswht, out, out);
-            DBLLL(("icm out_abs: after Lab2XYZ %s\n",icmPdv(lut->outputChan, out)));
-        }
-        
-        /* Convert from Relative to Absolute colorimetric XYZ */
-        icmMulBy3x3(out, p->toAbs, out);
-        DBLLL(("icm out_abs: after toAbs %s\n",icmPdv(lut->outputChan, out)));
+        bs = 64 - bs;        /* Free space in partial buffer */
 
-        if (p->e_outSpace == icSigLabData) {
-            icmXYZ2Lab(&p->pcswht, out, out);
-            DBLLL(("icm out_abs: after XYZ2Lab %s\n",icmPdv(lut->outputChan, out)));
+        if (len < bs) {        /* Not enought new to make a full buffer */
+            memmove(np, ibuf, len);
+            return;
         }
-    } else {
 
-        /* Convert from Native to Effective output space */
-        if (p->outSpace == icSigLabData && p->e_outSpace == icSigXYZData) {
-            icmLab2XYZ(&p->pcswht, out, out);
-            DBLLL(("icm out_abs: after Lab2 %s\n",icmPdv(lut->outputChan, out)));
-        } else if (p->outSpace == icSigXYZData && p->e_outSpace == icSigLabData) {
-            icmXYZ2Lab(&p->pcswht, out, out);
-            DBLLL(("icm out_abs: after XYZ2Lab %s\n",icmPdv(lut->outputChan, out)));
-        }
+        memmove(np, ibuf, bs);    /* Now got one full buffer */
+        icmMD5_accume(p, (ORD8 *)p->buf);
+        ibuf += bs;
+        len -= bs;
     }
-    DBLLL(("icm out_abs: returning %s\n",icmPdv(lut->outputChan, out)));
-    return rv;
-}
 
+    /* Deal with input data 64 bytes at a time */
+    while (len >= 64) {
+        icmMD5_accume(p, ibuf);
+        ibuf += 64;
+        len -= 64;
+    }
 
-/* Overall lookup */
-static int
-icmLuLut_lookup (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuLut *p = (icmLuLut *)pp;
-    icmLut *lut = p->lut;
-    double temp[MAX_CHAN];
+    /* Deal with any remaining bytes */
+    memmove(p->buf, ibuf, len);
+}
 
-    DBGLL(("icmLuLut_lookup: in = %s\n", icmPdv(p->inputChan, in)));
-    rv |= p->in_abs(p,temp,in);                        /* Possible absolute conversion */
-    DBGLL(("icmLuLut_lookup: in_abs = %s\n", icmPdv(p->inputChan, temp)));
-    if (p->usematrix) {
-        rv |= lut->lookup_matrix(lut,temp,temp);/* If XYZ, multiply by non-unity matrix */
-        DBGLL(("icmLuLut_lookup: matrix = %s\n", icmPdv(p->inputChan, temp)));
-    }
-    p->in_normf(temp, temp);                    /* Normalize for input color space */
-    DBGLL(("icmLuLut_lookup: norm = %s\n", icmPdv(p->inputChan, temp)));
-    rv |= lut->lookup_input(lut,temp,temp);        /* Lookup though input tables */
-    DBGLL(("icmLuLut_lookup: input = %s\n", icmPdv(p->inputChan, temp)));
-    rv |= p->lookup_clut(lut,out,temp);            /* Lookup though clut tables */
-    DBGLL(("icmLuLut_lookup: clut = %s\n", icmPdv(p->outputChan, out)));
-    rv |= lut->lookup_output(lut,out,out);        /* Lookup though output tables */
-    DBGLL(("icmLuLut_lookup: output = %s\n", icmPdv(p->outputChan, out)));
-    p->out_denormf(out,out);                    /* Normalize for output color space */
-    DBGLL(("icmLuLut_lookup: denorm = %s\n", icmPdv(p->outputChan, out)));
-    rv |= p->out_abs(p,out,out);                /* Possible absolute conversion */
-    DBGLL(("icmLuLut_lookup: out_abse = %s\n", icmPdv(p->outputChan, out)));
+/* Finalise the checksum and return the result. */
+static void icmMD5_get(icmMD5 *p, ORD8 chsum[16]) {
+    int i;
+    unsigned count;
+    ORD32 bits1, bits0;
+    ORD8 *pp;
 
-    return rv;
-}
+    if (p->fin == 0) {
+    
+        /* Compute number of bytes processed mod 64 */
+        count = p->tlen & 0x3f;
 
-#ifdef NEVER    /* The following should be identical in effect to the above. */
+        /* Set the first char of padding to 0x80.  This is safe since there is
+           always at least one byte free */
+        pp = p->buf + count;
+        *pp++ = 0x80;
 
-/* Overall lookup */
-static int
-icmLuLut_lookup (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int i, rv = 0;
-    icmLuLut *p = (icmLuLut *)pp;
-    icmLut *lut = p->lut;
-    double temp[MAX_CHAN];
+        /* Bytes of padding needed to make 64 bytes */
+        count = 64 - 1 - count;
 
-    rv |= p->in_abs(p,temp,in);
-    rv |= p->matrix(p,temp,temp);
-    rv |= p->input(p,temp,temp);
-    rv |= p->clut(p,out,temp);
-    rv |= p->output(p,out,out);
-    rv |= p->out_abs(p,out,out);
+        /* Pad out to 56 mod 64, allowing 8 bytes for length in bits. */
+        if (count < 8) {    /* Not enough space for padding and length */
 
-    return rv;
-}
+            memset(pp, 0, count);
+            icmMD5_accume(p, p->buf);
 
-#endif    /* NEVER */
+            /* Now fill the next block with 56 bytes */
+            memset(p->buf, 0, 56);
+        } else {
+            /* Pad block to 56 bytes */
+            memset(pp, 0, count - 8);
+        }
 
-/* Three stage conversion */
-static int
-icmLuLut_lookup_in (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuLut *p = (icmLuLut *)pp;
-    icmLut *lut = p->lut;
+        /* Compute number of bits */
+        bits1 = 0x7 & (p->tlen >> (32 - 3)); 
+        bits0 = p->tlen << 3;
 
-    /* If in_abs() or matrix() are active, then we can't have a per component input curve */
-    if (((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
-        && (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation))
-     || (p->e_inSpace != p->inSpace)
-     || (p->usematrix)) {
-        unsigned int i;
-        for (i = 0; i < lut->inputChan; i++)
-            out[i] = in[i];
-    } else {
-        rv |= p->input(p,out,in);
-    }
-    return rv;
-}
+        /* Append number of bits */
+        p->buf[64 - 8] = bits0 & 0xff; 
+        p->buf[64 - 7] = (bits0 >> 8) & 0xff; 
+        p->buf[64 - 6] = (bits0 >> 16) & 0xff; 
+        p->buf[64 - 5] = (bits0 >> 24) & 0xff; 
+        p->buf[64 - 4] = bits1 & 0xff; 
+        p->buf[64 - 3] = (bits1 >> 8) & 0xff; 
+        p->buf[64 - 2] = (bits1 >> 16) & 0xff; 
+        p->buf[64 - 1] = (bits1 >> 24) & 0xff; 
 
-static int
-icmLuLut_lookup_core (
-icmLuBase *pp,        /* This */
-double *out,        /* Vector of output values */
-double *in            /* Vector of input values */
-) {
-    int rv = 0;
-    icmLuLut *p = (icmLuLut *)pp;
+        icmMD5_accume(p, p->buf);
 
-    /* If in_abs() or matrix() are active, then we have to do the per component input curve here */
-    if (((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
-        && (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation))
-     || (p->e_inSpace != p->inSpace)
-     || (p->usematrix)) {
-        double temp[MAX_CHAN];
-        rv |= p->in_abs(p,temp,in);
-        rv |= p->matrix(p,temp,temp);
-        rv |= p->input(p,temp,temp);
-        rv |= p->clut(p,out,temp);
-    } else {
-        rv |= p->clut(p,out,in);
+        p->fin = 1;
     }
 
-    /* If out_abs() is active, then we can't have do per component out curve here */
-    if (((p->function == icmFwd || p->function == icmPreview)
-        && (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation))
-     || (p->outSpace != p->e_outSpace)) {
-        rv |= p->output(p,out,out);
-        rv |= p->out_abs(p,out,out);
+    /* Return the result, lsb to msb */
+    pp = chsum;
+    for (i = 0; i < 4; i++) {
+        *pp++ = p->sum[i] & 0xff; 
+        *pp++ = (p->sum[i] >> 8) & 0xff; 
+        *pp++ = (p->sum[i] >> 16) & 0xff; 
+        *pp++ = (p->sum[i] >> 24) & 0xff; 
     }
+}
 
-    return rv;
+
+/* Delete the instance */
+static void icmMD5_del(icmMD5 *p) {
+    p->al->free(p->al, p);
 }
 
+/* Create a new MD5 checksumming object, with a reset checksum value */
+/* Return it or NULL if there is an error */
+icmMD5 *new_icmMD5(icmAlloc *al) {
+    icmMD5 *p;
 
-static int
-icmLuLut_lookup_out (
-    icmLuBase *pp,        /* This */
-    double *out,          /* Vector of output values */
-    double *in            /* Vector of input values */
-)
-{
-    int rv = 0;
-    icmLuLut *p = (icmLuLut *)pp;
-    icmLut *lut = p->lut;
+    if ((p = (icmMD5 *)al->calloc(al,1,sizeof(icmMD5))) == NULL)
+        return NULL;
 
-    /* If out_abs() is active, then we can't have a per component out curve */
-    if (((p->function == icmFwd || p->function == icmPreview)
-        && (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation))
-     || (p->outSpace != p->e_outSpace)) {
-        unsigned int i;
-        for (i = 0; i < lut->outputChan; i++)
-            out[i] = in[i];
-    } else {
-        rv |= p->output(p,out,in);
-    }
+    p->al       = al;
+    p->reset    = icmMD5_reset;
+    p->add      = icmMD5_add;
+    p->get      = icmMD5_get;
+    p->del      = icmMD5_del;
 
-    return rv;
+    p->reset(p);
+
+    return p;
 }
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
 
-/* Inverse three stage conversion (partly implemented) */
-static int
-icmLuLut_lookup_inv_in (
-    icmLuBase *pp,        /* This */
-    double *out,          /* Vector of output values */
-    double *in            /* Vector of input values */
-) 
-{
-    int rv = 0;
-    icmLuLut *p = (icmLuLut *)pp;
-    icmLut *lut = p->lut;
+/* Dumy icmFile used to compute MD5 checksum on write */
 
-    /* If in_abs() or matrix() are active, then we can't have a per component input curve */
-    if (((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
-        && (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation))
-     || (p->e_inSpace != p->inSpace)
-     || (p->usematrix)) {
-        unsigned int i;
-        for (i = 0; i < lut->inputChan; i++)
-            out[i] = in[i];
-    } else {
-        rv |= p->inv_input(p,out,in);
-    }
-    return rv;
+/* Get the size of the file (Only valid for reading file. */
+static size_t icmFileMD5_get_size(icmFile *pp) {
+    return pp->size;
 }
 
+/* Set current position to offset. Return 0 on success, nz on failure. */
+/* Seek can't be supported for MD5, so and seek must be to current location. */
+static int icmFileMD5_seek(
+icmFile *pp,
+unsigned int offset
+) {
+    icmFileMD5 *p = (icmFileMD5 *)pp;
 
-/* Some components of inverse lookup, in order */
-/* ~~ should these be in icmLut (like all the fwd transforms)? */
-static int 
-icmLuLut_inv_out_abs(icmLuLut *p, double *out, double *in) 
-{
-    icmLut *lut = p->lut;
-    int rv = 0;
-
-    DBLLL(("icm inv_out_abs: input %s\n",icmPdv(lut->outputChan, in)));
-    if (out != in) {
-        unsigned int i;
-        for (i = 0; i < lut->outputChan; i++)        /* Don't alter input values */
-            out[i] = in[i];
+    if (p->of != offset) {
+        p->errc = 1;
     }
+    return 0;
+}
 
-    /* If Fwd Lut, take care of Absolute color space */
-    /* and convert from effective to native inverse output PCS */
-    /* OutSpace must be PCS: XYZ or Lab */
-    if ((p->function == icmFwd || p->function == icmPreview)
-        && (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation)) {
-
-        if (p->e_outSpace == icSigLabData) {
-            icmLab2XYZ(&p->pcswht, out, out);
-            DBLLL(("icm inv_out_abs: after Lab2XYZ %s\n",icmPdv(lut->outputChan, out)));
-        }
-    
-        /* Convert from Absolute to Relative colorimetric */
-        icmMulBy3x3(out, p->fromAbs, out);
-        DBLLL(("icm inv_out_abs: after fromAbs %s\n",icmPdv(lut->outputChan, out)));
-        
-        if (p->outSpace == icSigLabData) {
-            icmXYZ2Lab(&p->pcswht, out, out);
-            DBLLL(("icm inv_out_abs: after XYZ2Lab %s\n",icmPdv(lut->outputChan, out)));
-        }
+/* Read count items of size length. Return number of items successfully read. */
+/* Read is not implemented */
+static size_t icmFileMD5_read(
+icmFile *pp,
+void *buffer,
+size_t size,
+size_t count
+) {
+    return 0;
+}
 
-    } else {
+/* write count items of size length. Return number of items successfully written. */
+/* Simply pass to MD5 to compute checksum */
+static size_t icmFileMD5_write(
+icmFile *pp,
+void *buffer,
+size_t size,
+size_t count
+) {
+    icmFileMD5 *p = (icmFileMD5 *)pp;
+    size_t len = size * count;
 
-        /* Convert from Effective to Native output space */
-        if (p->e_outSpace == icSigLabData && p->outSpace == icSigXYZData) {
-            icmLab2XYZ(&p->pcswht, out, out);
-            DBLLL(("icm inv_out_abs: after Lab2XYZ %s\n",icmPdv(lut->outputChan, out)));
-        } else if (p->e_outSpace == icSigXYZData && p->outSpace == icSigLabData) {
-            icmXYZ2Lab(&p->pcswht, out, out);
-            DBLLL(("icm inv_out_abs: after XYZ2Lab %s\n",icmPdv(lut->outputChan, out)));
-        }
-    }
-    return rv;
+    p->md5->add(p->md5, (ORD8 *)buffer, len);
+    p->of += len;
+    return count;
 }
 
+/* do a printf */
+/* Not implemented */
+static int icmFileMD5_printf(
+icmFile *pp,
+const char *format,
+...
+) {
+    icmFileMD5 *p = (icmFileMD5 *)pp;
+    p->errc = 2;
+    return 0;
+}
 
-/* Do output->output' inverse lookup */
-static int 
-icmLuLut_inv_output(icmLuLut *p, double *out, double *in) 
-{
-    icc *icp = p->icp;
-    icmLut *lut = p->lut;
-    int i;
-    int rv = 0;
+/* flush all write data out to secondary storage. Return nz on failure. */
+static int icmFileMD5_flush(
+icmFile *pp
+) {
+    return 0;
+}
 
-    if (lut->rot[0].inited == 0) {    
-        for (i = 0; i < lut->outputChan; i++) {
-            rv = icmTable_setup_bwd(icp, &lut->rot[i], lut->outputEnt,
-                                         lut->outputTable + i * lut->outputEnt);
-            if (rv != 0) {
-                sprintf(icp->err,"icc_Lut_inv_input: Malloc failure in inverse lookup init.");
-                return icp->errc = rv;
-            }
-        }
-    }
+/* we're done with the file object, return nz on failure */
+static int icmFileMD5_delete(
+icmFile *pp
+) {
+    icmFileMD5 *p = (icmFileMD5 *)pp;
 
-    p->out_normf(out,in);                        /* Normalize from output color space */
-    for (i = 0; i < lut->outputChan; i++) {
-        /* Reverse lookup though output tables */
-        rv |= icmTable_lookup_bwd(&lut->rot[i], &out[i], &out[i]);
-    }
-    p->out_denormf(out, out);                    /* De-normalize to output color space */
-    return rv;
+    p->al->free(p->al, p);    /* Free object */
+    return 0;
 }
 
+/* Return the error code. Error code will usually be set */
+/* if we did a seek to other than the current location, */
+/* or did a printf. */
+static int icmFileMD5_geterrc(
+icmFile *pp
+) {
+    icmFileMD5 *p = (icmFileMD5 *)pp;
 
-/* No output' -> input inverse lookup. */
-/* This is non-trivial ! */
-/* Do input' -> input inverse lookup */
-static int 
-icmLuLut_inv_input(icmLuLut *p, double *out, double *in) 
-{
-    icc *icp = p->icp;
-    icmLut *lut = p->lut;
-    int i;
-    int rv = 0;
+    return p->errc;
+}
 
-    if (lut->rit[0].inited == 0) {    
-        for (i = 0; i < lut->inputChan; i++) {
-            rv = icmTable_setup_bwd(icp, &lut->rit[i], lut->inputEnt,
-                                         lut->inputTable + i * lut->inputEnt);
-            if (rv != 0) {
-                sprintf(icp->err,"icc_Lut_inv_input: Malloc failure in inverse lookup init.");
-                return icp->errc = rv;
-            }
-        }
-    }
+/* Create a checksum dump file access class with allocator */
+icmFile *new_icmFileMD5_a(
+icmMD5 *md5,        /* MD5 object to use */
+icmAlloc *al        /* heap allocator */
+) {
+    icmFileMD5 *p;
 
-    p->in_normf(out, in);                         /* Normalize from input color space */
-    for (i = 0; i < lut->inputChan; i++) {
-        /* Reverse lookup though input tables */
-        rv |= icmTable_lookup_bwd(&lut->rit[i], &out[i], &out[i]);
+    if ((p = (icmFileMD5 *) al->calloc(al, 1, sizeof(icmFileMD5))) == NULL) {
+        return NULL;
     }
-    p->in_denormf(out,out);                        /* De-normalize to input color space */
-    return rv;
+    p->md5      = md5;            /* MD5 compute object */
+    p->al       = al;            /* Heap allocator */
+    p->get_size = icmFileMD5_get_size;
+    p->seek     = icmFileMD5_seek;
+    p->read     = icmFileMD5_read;
+    p->write    = icmFileMD5_write;
+    p->gprintf   = icmFileMD5_printf;
+    p->flush    = icmFileMD5_flush;
+    p->del      = icmFileMD5_delete;
+    p->get_errc = icmFileMD5_geterrc;
+
+    p->of = 0;
+    p->errc = 0;
+
+    return (icmFile *)p;
 }
 
 
-/* Possible inverse matrix lookup */
-static int 
-icmLuLut_inv_matrix(icmLuLut *p, double *out, double *in)
-{
-    icc *icp = p->icp;
-    icmLut *lut = p->lut;
-    int rv = 0;
+/* ============================================= */
+/* Implementation of color transform lookups.    */
 
-    if (p->usematrix) {
-        double tt[3];
-        if (p->imx_valid == 0) {
-            if (icmInverse3x3(p->imx, lut->e) != 0) {    /* Compute inverse */
-                sprintf(icp->err,"icc_new_iccLuMatrix: Matrix wasn't invertable");
-                icp->errc = 2;
-                return 2;
-            }
-            p->imx_valid = 1;
-        }
-        /* Matrix multiply */
-        tt[0] = p->imx[0][0] * in[0] + p->imx[0][1] * in[1] + p->imx[0][2] * in[2];
-        tt[1] = p->imx[1][0] * in[0] + p->imx[1][1] * in[1] + p->imx[1][2] * in[2];
-        tt[2] = p->imx[2][0] * in[0] + p->imx[2][1] * in[1] + p->imx[2][2] * in[2];
-        out[0] = tt[0], out[1] = tt[1], out[2] = tt[2];
-    } else if (out != in) {
-        unsigned int i;
-        for (i = 0; i < lut->inputChan; i++)
-            out[i] = in[i];
-    }
-    return rv;
+/* - - - - - - - - - - - - - - - - - - - - - - - */
+/* Methods common to all transforms (icmLuBase) : */
+
+/* Return information about the native lut in/out/pcs colorspaces. */
+/* Any pointer may be NULL if value is not to be returned */
+static void
+icmLutSpaces(
+    struct _icmLuBase *p,            /* This */
+    icColorSpaceSignature *ins,        /* Return Native input color space */
+    int *inn,                        /* Return number of input components */
+    icColorSpaceSignature *outs,    /* Return Native output color space */
+    int *outn,                        /* Return number of output components */
+    icColorSpaceSignature *pcs        /* Return Native PCS color space */
+                                    /* (this will be the same as ins or outs */
+                                    /* depending on the lookup direction) */
+) {
+    if (ins != NULL)
+        *ins = p->inSpace;
+    if (inn != NULL)
+        *inn = (int)number_ColorSpaceSignature(p->inSpace);
+
+    if (outs != NULL)
+        *outs = p->outSpace;
+    if (outn != NULL)
+        *outn = (int)number_ColorSpaceSignature(p->outSpace);
+    if (pcs != NULL)
+        *pcs = p->pcs;
 }
 
+/* Return information about the effective lookup in/out colorspaces, */
+/* including allowance for PCS override. */
+/* Any pointer may be NULL if value is not to be returned */
+static void
+icmLuSpaces(
+    struct _icmLuBase *p,            /* This */
+    icColorSpaceSignature *ins,        /* Return effective input color space */
+    int *inn,                        /* Return number of input components */
+    icColorSpaceSignature *outs,    /* Return effective output color space */
+    int *outn,                        /* Return number of output components */
+    icmLuAlgType *alg,                /* Return type of lookup algorithm used */
+    icRenderingIntent *intt,        /* Return the intent being implented */
+    icmLookupFunc *fnc,                /* Return the profile function being implemented */
+    icColorSpaceSignature *pcs,        /* Return the profile effective PCS */
+    icmLookupOrder *ord                /* return the search Order */
+) {
+    if (ins != NULL)
+        *ins = p->e_inSpace;
+    if (inn != NULL)
+        *inn = (int)number_ColorSpaceSignature(p->e_inSpace);
 
-static int 
-icmLuLut_inv_in_abs(icmLuLut *p, double *out, double *in) 
-{
-    icmLut *lut = p->lut;
-    int rv = 0;
+    if (outs != NULL)
+        *outs = p->e_outSpace;
+    if (outn != NULL)
+        *outn = (int)number_ColorSpaceSignature(p->e_outSpace);
 
-    DBLLL(("icm inv_in_abs: input %s\n",icmPdv(lut->inputChan, in)));
-    if (out != in) {
-        unsigned int i;
-        for (i = 0; i < lut->inputChan; i++)        /* Don't alter input values */
-            out[i] = in[i];
-    }
+    if (alg != NULL)
+        *alg = p->ttype;
 
-    /* If Bwd Lut, take care of Absolute color space, and */
-    /* convert from native to effective input space */
-    if ((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
-        && (p->intent == icAbsoluteColorimetric
-         || p->intent == icmAbsolutePerceptual
-         || p->intent == icmAbsoluteSaturation)) {
+    if (intt != NULL)
+        *intt = p->intent;
 
-        if (p->inSpace == icSigLabData) {
-            icmLab2XYZ(&p->pcswht, out, out);
-            DBLLL(("icm inv_in_abs: after Lab2XYZ %s\n",icmPdv(lut->inputChan, out)));
-        }
+    if (fnc != NULL)
+        *fnc = p->function;
 
-        /* Convert from Relative to Absolute colorimetric XYZ */
-        icmMulBy3x3(out, p->toAbs, out);
-        DBLLL(("icm inv_in_abs: after toAbs %s\n",icmPdv(lut->inputChan, out)));
-        
-        if (p->e_inSpace == icSigLabData) {
-            icmXYZ2Lab(&p->pcswht, out, out);
-            DBLLL(("icm inv_in_abs: after XYZ2Lab %s\n",icmPdv(lut->inputChan, out)));
-        }
-    } else {
+    if (pcs != NULL)
+        *pcs = p->e_pcs;
 
-        /* Convert from Native to Effective input space */
-        if (p->inSpace == icSigLabData && p->e_inSpace == icSigXYZData) {
-            icmLab2XYZ(&p->pcswht, out, out);
-            DBLLL(("icm inv_in_abs: after Lab2XYZ %s\n",icmPdv(lut->inputChan, out)));
-        } else if (p->inSpace == icSigXYZData && p->e_inSpace == icSigLabData) {
-            icmXYZ2Lab(&p->pcswht, out, out);
-            DBLLL(("icm inv_in_abs: after XYZ2Lab %s\n",icmPdv(lut->inputChan, out)));
-        }
-    }
-    DBLLL(("icm inv_in_abs: returning %s\n",icmPdv(lut->inputChan, out)));
-    return rv;
+    if (ord != NULL)
+        *ord = p->order;
 }
 
+/* Relative to Absolute for this WP in XYZ */
+static void icmLuXYZ_Rel2Abs(icmLuBase *p, double *out, double *in) {
+    icmMulBy3x3(out, p->toAbs, in);
+}
 
-/* Return LuLut information */
-static void 
-icmLuLut_get_info(
-    icmLuLut     *p,          /* this */
-    icmLut       **lutp,      /* Pointer to icc lut type */
-    icmXYZNumber *pcswhtp,    /* Pointer to profile PCS white point */
-    icmXYZNumber *whitep,     /* Pointer to profile absolute white point */
-    icmXYZNumber *blackp      /* Pointer to profile absolute black point */
-) 
-{
-    if (lutp != NULL)
-        *lutp = p->lut;
-    if (pcswhtp != NULL)
-        *pcswhtp = p->pcswht;
-    if (whitep != NULL)
-        *whitep = p->whitePoint;
-    if (blackp != NULL)
-        *blackp = p->blackPoint;
+/* Absolute to Relative for this WP in XYZ */
+static void icmLuXYZ_Abs2Rel(icmLuBase *p, double *out, double *in) {
+    icmMulBy3x3(out, p->fromAbs, in);
 }
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Methods common to all non-named transforms (icmLuBase) : */
 
-/* Get the native ranges for the LuLut */
-/* This is computed differently to the mono & matrix types, to */
-/* accurately take into account the different range for 8 bit Lab */
-/* lut type. The range returned for the effective PCS is not so accurate. */
-static void
-icmLuLut_get_lutranges (
-    struct _icmLuBase *pp,
-    double *inmin, double *inmax,        /* Return maximum range of inspace values */
-    double *outmin, double *outmax       /* Return maximum range of outspace values */
-) 
-{
-    icmLuLut *p = (icmLuLut *)pp;
-    unsigned int i;
+/* Return a monotonic time in seconds */
+static double icmLuTime(void) {
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
 
-    for (i = 0; i < p->lut->inputChan; i++) {
-        inmin[i] = 0.0;    /* Normalized range of input space values */
-        inmax[i] = 1.0;
-    }
-    p->in_denormf(inmin,inmin);    /* Convert to real colorspace range */
-    p->in_denormf(inmax,inmax);
+/* Return the total number of reverse curve linear scans */
+/* of the curves used by the lookup */
+static unsigned long icmLu_nscan(icmLuBase *p) {
+    unsigned long ns = 0;
+    unsigned int i;
 
-    /* Make sure min and max are so. */
-    for (i = 0; i < p->lut->inputChan; i++) {
-        if (inmin[i] > inmax[i]) {
-            double tt;
-            tt = inmin[i];
-            inmin[i] = inmax[i];
-            inmax[i] = tt;
+    if (p->ttype == icmMonoBwdType) {
+        ns = ICM_ATOMIC_GET(((icmLuMono *)p)->grayCurve->rt.nscan);
+    } else if (p->ttype == icmMatrixBwdType) {
+        icmLuMatrix *pp = (icmLuMatrix *)p;
+        ns = ICM_ATOMIC_GET(pp->redCurve->rt.nscan) + ICM_ATOMIC_GET(pp->greenCurve->rt.nscan)
+           + ICM_ATOMIC_GET(pp->blueCurve->rt.nscan);
+    } else if (p->ttype == icmLutType) {
+        icmLut *lut = ((icmLuLut *)p)->lut;
+        for (i = 0; i < lut->inputChan; i++)
+            ns += ICM_ATOMIC_GET(lut->rit[i].nscan);
+        for (i = 0; i < lut->outputChan; i++)
+            ns += ICM_ATOMIC_GET(lut->rot[i].nscan);
+    } else if (p->ttype == icmLutABType) {
+        icmLuLutAB *pp = (icmLuLutAB *)p;
+        if (pp->istages > 0) {
+            for (i = 0; i < pp->stage[0].n; i++) {
+                if (pp->stage[0].cv[i] != NULL)
+                    ns += ICM_ATOMIC_GET(pp->stage[0].cv[i]->rt.nscan);
+            }
         }
     }
+    return ns;
+}
 
-    for (i = 0; i < p->lut->outputChan; i++) {
-        outmin[i] = 0.0;    /* Normalized range of output space values */
-        outmax[i] = 1.0;
+#ifdef ICM_THREADS
+static pthread_mutex_t icmTraceLock = PTHREAD_MUTEX_INITIALIZER;    /* Stage times */
+#endif
+
+/* Lookup used in place of the normal one while tracing. This may be */
+/* called by several threads at once, so the counts are atomic. */
+static int icmLu_lookup_traced(
+icmLuBase *p,
+double *out,
+double *in
+) {
+    int rv;
+
+    if ((p->trace & ICM_LU_TRACE_TIME)
+     && (ICM_ATOMIC_ADD(p->tcount, 1) % p->tsample) == 0) {
+        double temp[MAX_CHAN], t0, t1, t2, t3;
+
+        /* Time the equivalent three stage conversion */
+        t0 = icmLuTime();
+        rv = p->lookup_in(p, temp, in);
+        t1 = icmLuTime();
+        rv |= p->lookup_core(p, out, temp);
+        t2 = icmLuTime();
+        rv |= p->lookup_out(p, out, out);
+        t3 = icmLuTime();
+        ICM_LOCK(icmTraceLock);
+        p->stats.stime[icmLuStageIn]   += t1 - t0;
+        p->stats.stime[icmLuStageCore] += t2 - t1;
+        p->stats.stime[icmLuStageOut]  += t3 - t2;
+        p->stats.tsamples++;
+        ICM_UNLOCK(icmTraceLock);
+    } else {
+        rv = p->ulookup(p, out, in);
     }
-    p->out_denormf(outmin,outmin);    /* Convert to real colorspace range */
-    p->out_denormf(outmax,outmax);
 
-    /* Make sure min and max are so. */
-    for (i = 0; i < p->lut->outputChan; i++) {
-        if (outmin[i] > outmax[i]) {
-            double tt;
-            tt = outmin[i];
-            outmin[i] = outmax[i];
-            outmax[i] = tt;
-        }
+    if (p->trace & ICM_LU_TRACE_COUNT) {
+        ICM_ATOMIC_ADD(p->stats.lookups, 1);
+        if (rv == 1)
+            ICM_ATOMIC_ADD(p->stats.clips, 1);
     }
+    return rv;
 }
 
-/* Get the effective (externaly visible) ranges for the LuLut */
-/* This will be accurate if there is no override, but only */
-/* aproximate if a PCS override is in place. */
-static void
-icmLuLut_get_ranges (
-    struct _icmLuBase *pp,
-    double *inmin, double *inmax,        /* Return maximum range of inspace values */
-    double *outmin, double *outmax       /* Return maximum range of outspace values */
-) 
-{
-    icmLuLut *p = (icmLuLut *)pp;
+/* Reset the statistics */
+static void icmLu_reset_stats(icmLuBase *p) {
+    ICM_LOCK(icmTraceLock);
+    memset(&p->stats, 0, sizeof(icmLuStats));
+    p->tcount = 0;
+    p->nscan0 = icmLu_nscan(p);
+    ICM_UNLOCK(icmTraceLock);
+}
 
-    /* Get the native ranges first */
-    icmLuLut_get_lutranges(pp, inmin, inmax, outmin, outmax);
+/* Set the runtime instrumentation */
+static void icmLu_set_trace(icmLuBase *p, int flags, unsigned int sample) {
 
-    /* And replace them if the effective space is different */
-    if (p->e_inSpace != p->inSpace)
-        getRange(p->icp, p->e_inSpace, p->lut->ttype, inmin, inmax);
+    if (p->trace == 0 && flags != 0) {            /* Install the tracing lookup */
+        p->ulookup = p->lookup;
+        p->lookup = icmLu_lookup_traced;
+    } else if (p->trace != 0 && flags == 0) {    /* Restore the normal lookup */
+        p->lookup = p->ulookup;
+    }
+    if (!(p->trace & ICM_LU_TRACE_COUNT) && (flags & ICM_LU_TRACE_COUNT))
+        ICM_ATOMIC_ADD(icmLuNCount, 1);
+    else if ((p->trace & ICM_LU_TRACE_COUNT) && !(flags & ICM_LU_TRACE_COUNT))
+        ICM_ATOMIC_SUB(icmLuNCount, 1);
+    p->trace = flags;
+    p->tsample = sample > 0 ? sample : 1;
+    p->reset_stats(p);
+}
 
-    if (p->e_outSpace != p->outSpace)
-        getRange(p->icp, p->e_outSpace, p->lut->ttype, outmin, outmax);
+/* Stop counting, when a lookup object is deleted */
+static void icmLu_end_trace(icmLuBase *p) {
+    if (p->trace & ICM_LU_TRACE_COUNT)
+        ICM_ATOMIC_SUB(icmLuNCount, 1);
+    p->trace = 0;
 }
 
-/* Return the underlying Lut matrix */
-static void
-icmLuLut_get_matrix (
-    struct _icmLuLut *p,
-    double m[3][3]
+/* Return the statistics */
+static void icmLu_get_stats(icmLuBase *p, icmLuStats *st) {
+    ICM_LOCK(icmTraceLock);
+    *st = p->stats;
+    ICM_UNLOCK(icmTraceLock);
+    st->lookups = ICM_ATOMIC_GET(p->stats.lookups);
+    st->clips = ICM_ATOMIC_GET(p->stats.clips);
+    if (p->trace & ICM_LU_TRACE_COUNT)
+        st->revscans = icmLu_nscan(p) - p->nscan0;
+}
+
+/* Initialise the LU white and black points from the ICC tags, */
+/* and the corresponding absolute<->relative conversion matrices */
+/* return nz on error */
+static int icmLuInit_Wh_bk(
+struct _icmLuBase *lup
 ) {
-    int i, j;
-    icmLut *lut = p->lut;
+    icmXYZArray *whitePointTag, *blackPointTag;
+    icc *p = lup->icp;
 
-    if (p->usematrix) {
-        for (i = 0; i < 3; i++)
-            for (j = 0; j < 3; j++)
-                m[i][j] = lut->e[i][j];    /* Copy from Lut */
+    if ((whitePointTag = (icmXYZArray *)p->read_tag(p, icSigMediaWhitePointTag)) == NULL
+        || whitePointTag->ttype != icSigXYZType || whitePointTag->size < 1) {
+        if (p->header->deviceClass != icSigLinkClass 
+         && (lup->intent == icAbsoluteColorimetric
+          || lup->intent == icmAbsolutePerceptual
+          || lup->intent == icmAbsoluteSaturation)) {
+            sprintf(p->err,"icc_lookup: Profile is missing Media White Point Tag");
+            p->errc = 1;
+            return 1;
+        }
+        p->err[0] = '\000';
+        p->errc = 0;
+        lup->whitePoint = icmD50;                    /* safe value */
+    } else
+        lup->whitePoint = whitePointTag->data[0];    /* Copy structure */
 
-    } else {                            /* return unity matrix */
-        icmSetUnity3x3(m);
+    if ((blackPointTag = (icmXYZArray *)p->read_tag(p, icSigMediaBlackPointTag)) == NULL
+        || blackPointTag->ttype != icSigXYZType || blackPointTag->size < 1) {
+        p->err[0] = '\000';
+        p->errc = 0;
+        lup->blackPoint = icmBlack;                    /* default */
+        lup->blackisassumed = 1;                    /* We assumed the default */
+    } else  {
+        lup->blackPoint = blackPointTag->data[0];    /* Copy structure */
+        lup->blackisassumed = 0;                    /* The black is from the tag */
     }
-}
 
+    /* Create absolute <-> relative conversion matricies */
+    icmChromAdaptMatrix(ICM_CAM_BRADFORD, lup->whitePoint, icmD50, lup->toAbs);
+    icmChromAdaptMatrix(ICM_CAM_BRADFORD, icmD50, lup->whitePoint,  lup->fromAbs);
+    DBLLL(("toAbs and fromAbs created from wp %f %f %f and D50 %f %f %f\n", lup->whitePoint.X, lup->whitePoint.Y, lup->whitePoint.Z, icmD50.X, icmD50.Y, icmD50.Z));
+    DBLLL(("toAbs   = %f %f %f\n          %f %f %f\n          %f %f %f\n", lup->toAbs[0][0], lup->toAbs[0][1], lup->toAbs[0][2], lup->toAbs[1][0], lup->toAbs[1][1], lup->toAbs[1][2], lup->toAbs[2][0], lup->toAbs[2][1], lup->toAbs[2][2]));
+    DBLLL(("fromAbs = %f %f %f\n          %f %f %f\n          %f %f %f\n", lup->fromAbs[0][0], lup->fromAbs[0][1], lup->fromAbs[0][2], lup->fromAbs[1][0], lup->fromAbs[1][1], lup->fromAbs[1][2], lup->fromAbs[2][0], lup->fromAbs[2][1], lup->fromAbs[2][2]));
 
-static void
-icmLuLut_delete( icmLuBase *p) 
-{
-    icc *icp = p->icp;
-
-    icp->al->free(icp->al, p);
+    return 0;
 }
 
+/* Return the media white and black points in absolute XYZ space. */
+/* Note that if not in the icc, the black point will be returned as 0, 0, 0, */
+/* and the function will return nz. */ 
+/* Any pointer may be NULL if value is not to be returned */
+static int icmLuWh_bk_points(
+struct _icmLuBase *p,
+double *wht,
+double *blk
+) {
+    if (wht != NULL) {
+        icmXYZ2Ary(wht,p->whitePoint);
+    }
 
-icmLuBase *
-icc_new_icmLuLut(
-    icc                   *icp,
-    icTagSignature        ttag,            /* Target Lut tag */
-    icColorSpaceSignature inSpace,         /* Native Input color space */
-    icColorSpaceSignature outSpace,        /* Native Output color space */
-    icColorSpaceSignature pcs,             /* Native PCS (from header) */
-    icColorSpaceSignature e_inSpace,       /* Effective Input color space */
-    icColorSpaceSignature e_outSpace,      /* Effective Output color space */
-    icColorSpaceSignature e_pcs,           /* Effective PCS */
-    icRenderingIntent     intent,          /* Rendering intent (For absolute) */
-    icmLookupFunc         func             /* Functionality requested (for icmLuSpaces()) */
-) 
-{
-    icmLuLut *p;
-
-    if ((p = (icmLuLut *) icp->al->calloc(icp->al,1,sizeof(icmLuLut))) == NULL)
-        return NULL;
-    p->ttype    = icmLutType;
-    p->icp      = icp;
-    p->del      = icmLuLut_delete;
-    p->lutspaces= icmLutSpaces;
-    p->spaces   = icmLuSpaces;
-    p->XYZ_Rel2Abs = icmLuXYZ_Rel2Abs;
-    p->XYZ_Abs2Rel = icmLuXYZ_Abs2Rel;
-    p->init_wh_bk  = icmLuInit_Wh_bk;
-    p->wh_bk_points = icmLuWh_bk_points;
-    p->lu_wh_bk_points = icmLuLu_wh_bk_points;
-
-    p->lookup        = icmLuLut_lookup;
-    p->lookup_in     = icmLuLut_lookup_in;
-    p->lookup_core   = icmLuLut_lookup_core;
-    p->lookup_out    = icmLuLut_lookup_out;
-    p->lookup_inv_in = icmLuLut_lookup_inv_in;
+    if (blk != NULL) {
+        icmXYZ2Ary(blk,p->blackPoint);
+    }
+    if (p->blackisassumed)
+        return 1;
+    return 0;
+}
 
-    p->in_abs   = icmLuLut_in_abs;
-    p->matrix   = icmLuLut_matrix;
-    p->input    = icmLuLut_input;
-    p->clut     = icmLuLut_clut;
-    p->output   = icmLuLut_output;
-    p->out_abs  = icmLuLut_out_abs;
+/* Get the LU white and black points in LU PCS space, converted to XYZ. */
+/* (ie. white and black will be relative if LU is relative intent etc.) */
+/* Return nz if the black point is being assumed to be 0,0,0 rather */
+/* than being from the tag. */                                                            \
+static int icmLuLu_wh_bk_points(
+struct _icmLuBase *p,
+double *wht,
+double *blk
+) {
+    if (wht != NULL) {
+        icmXYZ2Ary(wht,p->whitePoint);
+    }
 
-    p->inv_in_abs   = icmLuLut_inv_in_abs;
-    p->inv_matrix   = icmLuLut_inv_matrix;
-    p->inv_input    = icmLuLut_inv_input;
-    p->inv_output   = icmLuLut_inv_output;
-    p->inv_out_abs  = icmLuLut_inv_out_abs;
-
-    p->pcswht   = icp->header->illuminant;
-    p->intent   = intent;            /* used to trigger absolute processing */
-    p->function = func;
-    p->inSpace  = inSpace;
-    p->outSpace = outSpace;
-    p->pcs      = pcs;
-    p->e_inSpace  = e_inSpace;
-    p->e_outSpace = e_outSpace;
-    p->e_pcs      = e_pcs;
-    p->get_info = icmLuLut_get_info;
-    p->get_lutranges = icmLuLut_get_lutranges;
-    p->get_ranges = icmLuLut_get_ranges;
-    p->get_matrix = icmLuLut_get_matrix;
-
-    /* Lookup the white and black points */
-    if (p->init_wh_bk((icmLuBase *)p)) {
-        p->del((icmLuBase *)p);
-        return NULL;
+    if (blk != NULL) {
+        icmXYZ2Ary(blk,p->blackPoint);
     }
-
-    /* Get the Lut tag, & check that it is expected type */
-    if ((p->lut = (icmLut *)icp->read_tag(icp, ttag)) == NULL
-     || (p->lut->ttype != icSigLut8Type && p->lut->ttype != icSigLut16Type)) {
-        p->del((icmLuBase *)p);
-        return NULL;
+    if (p->intent != icAbsoluteColorimetric
+     && p->intent != icmAbsolutePerceptual
+     && p->intent != icmAbsoluteSaturation) {
+        if (wht != NULL)
+            icmMulBy3x3(wht, p->fromAbs, wht);
+        if (blk != NULL)
+            icmMulBy3x3(blk, p->fromAbs, blk);
     }
+    if (p->blackisassumed)
+        return 1;
+    return 0;
+}
 
-    /* Check if matrix should be used */
-    if (inSpace == icSigXYZData && p->lut->nu_matrix(p->lut))
-        p->usematrix = 1;
-    else
-        p->usematrix = 0;
+/* Get the native (internal) ranges for the Monochrome or Matrix profile */
+/* Arguments may be NULL */
+static void
+icmLu_get_lutranges (
+    struct _icmLuBase *p,
+    double *inmin, double *inmax,        /* Return maximum range of inspace values */
+    double *outmin, double *outmax        /* Return maximum range of outspace values */
+) {
+    /* Hmm. we have no way of handling an error from getRange. */
+    /* It shouldn't ever return one unless there is a mismatch between */
+    /* getRange and Lu creation... */
+    getRange(p->icp, p->inSpace, p->ttype, inmin, inmax);
+    getRange(p->icp, p->outSpace, p->ttype, outmin, outmax);
+}
 
-    /* Lookup input color space to normalized index function */
-    if (getNormFunc(icp, inSpace, p->lut->ttype, icmToLuti, &p->in_normf)) {
-        sprintf(icp->err,"icc_get_luobj: Unknown colorspace");
-        icp->errc = 1;
-        p->del((icmLuBase *)p);
-        return NULL;
-    }
+/* Get the effective (externally visible) ranges for the all profile types */
+/* Arguments may be NULL */
+static void
+icmLu_get_ranges (
+    struct _icmLuBase *p,
+    double *inmin, double *inmax,        /* Return maximum range of inspace values */
+    double *outmin, double *outmax        /* Return maximum range of outspace values */
+) {
+    /* Hmm. we have no way of handling an error from getRange. */
+    /* It shouldn't ever return one unless there is a mismatch between */
+    /* getRange and Lu creation... */
+    getRange(p->icp, p->e_inSpace, p->ttype, inmin, inmax);
+    getRange(p->icp, p->e_outSpace, p->ttype, outmin, outmax);
+}
 
-    /* Lookup normalized index to input color space function */
-    if (getNormFunc(icp, inSpace, p->lut->ttype, icmFromLuti, &p->in_denormf)) {
-        sprintf(icp->err,"icc_get_luobj: Unknown colorspace");
-        icp->errc = 1;
-        p->del((icmLuBase *)p);
-        return NULL;
-    }
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Forward and Backward Monochrome type methods: */
+/* Return 0 on success, 1 if clipping occured, 2 on other error */
 
-    /* Lookup output color space to normalized Lut entry value function */
-    if (getNormFunc(icp, outSpace, p->lut->ttype, icmToLutv, &p->out_normf)) {
-        sprintf(icp->err,"icc_get_luobj: Unknown colorspace");
-        icp->errc = 1;
-        p->del((icmLuBase *)p);
-        return NULL;
-    }
+/* Individual components of Fwd conversion: */
 
-    /* Lookup normalized Lut entry value to output color space function */
-    if (getNormFunc(icp, outSpace, p->lut->ttype, icmFromLutv, &p->out_denormf)) {
-        sprintf(icp->err,"icc_get_luobj: Unknown colorspace");
-        icp->errc = 1;
-        p->del((icmLuBase *)p);
-        return NULL;
-    }
+/* Actual device to linearised device */
+static int
+icmLuMonoFwd_curve (
+icmLuMono *p,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    icc *icp = p->icp;
+    int rv = 0;
 
-    /* Note that the following two are only used in computing the expected */
-    /* value ranges of the effective PCS. This might not be the best way of */
-    /* doing this. */
-    /* Lookup normalized index to effective input color space function */
-    if (getNormFunc(icp, e_inSpace, p->lut->ttype, icmFromLuti, &p->e_in_denormf)) {
-        sprintf(icp->err,"icc_get_luobj: Unknown effective colorspace");
-        icp->errc = 1;
-        p->del((icmLuBase *)p);
-        return NULL;
+    /* Translate from device to PCS scale */
+    if ((rv |= p->grayCurve->lookup_fwd(p->grayCurve,&out[0],&in[0])) > 1) {
+        sprintf(icp->err,"icc_lookup: Curve->lookup_fwd() failed");
+        icp->errc = rv;
+        return 2;
     }
 
-    /* Lookup normalized Lut entry value to effective output color space function */
-    if (getNormFunc(icp, e_outSpace, p->lut->ttype, icmFromLutv, &p->e_out_denormf)) {
-        sprintf(icp->err,"icc_get_luobj: Unknown effective colorspace");
-        icp->errc = 1;
-        p->del((icmLuBase *)p);
-        return NULL;
-    }
+    return rv;
+}
 
-    /* Determine appropriate clut lookup algorithm */
-    {
-        int use_sx;                /* -1 = undecided, 0 = N-linear, 1 = Simplex lookup */
-        icColorSpaceSignature ins, outs;    /* In and out Lut color spaces */
-        int inn, outn;        /* in and out number of Lut components */
+/* Linearised device to relative PCS */
+static int
+icmLuMonoFwd_map (
+icmLuMono *p,        /* This */
+double *out,        /* Vector of output values (native space) */
+double *in            /* Vector of input values (native space) */
+) {
+    int rv = 0;
+    double Y = in[0];        /* In case out == in */
 
-        p->lutspaces((icmLuBase *)p, &ins, &inn, &outs, &outn, NULL);
+    out[0] = p->pcswht.X;
+    out[1] = p->pcswht.Y;
+    out[2] = p->pcswht.Z;
+    if (p->pcs == icSigLabData)
+        icmXYZ2Lab(&p->pcswht, out, out);    /* in Lab */
 
-        /* Determine if the input space is "Device" like, */
-        /* ie. luminance will be expected to vary most strongly */
-        /* with the diagonal change in input coordinates. */
-        switch(ins) {
+    /* Scale linearized device level to PCS white */
+    out[0] *= Y;
+    out[1] *= Y;
+    out[2] *= Y;
 
-            /* Luminence is carried by the sum of all the output channels, */
-            /* so output luminence will dominantly be in diagonal direction. */
-            case icSigXYZData:        /* This seems to be appropriate ? */
-            case icSigRgbData:
-            case icSigGrayData:
-            case icSigCmykData:
-            case icSigCmyData:
-            case icSigMch6Data:
-                use_sx = 1;        /* Simplex interpolation is appropriate */
-                break;
+    return rv;
+}
 
-            /* A single channel carries the luminence information */
-            case icSigLabData:
-            case icSigLuvData:
-            case icSigYCbCrData:
-            case icSigYxyData:
-            case icSigHlsData:
-            case icSigHsvData:
-                use_sx = 0;        /* N-linear interpolation is appropriate */
-                break;
-            default:
-                use_sx = -1;        /* undecided */
-                    break;
-        }
+/* relative PCS to absolute PCS (if required) */
+static int
+icmLuMonoFwd_abs (    /* Abs comes last in Fwd conversion */
+icmLuMono *p,        /* This */
+double *out,        /* Vector of output values in Effective PCS */
+double *in            /* Vector of input values in Native PCS */
+) {
+    int rv = 0;
 
-        /* If we couldn't figure it out from the input space, */
-        /* check output luminance variation with a diagonal input */
-        /* change. */
-        if (use_sx == -1) {
-            int lc;        /* Luminance channel */
+    if (out != in) {    /* Don't alter input values */
+        out[0] = in[0];
+        out[1] = in[1];
+        out[2] = in[2];
+    }
 
-            /* Determine where the luminence is carried in the output */
-            switch(outs) {
+    /* Do absolute conversion */
+    if (p->intent == icAbsoluteColorimetric
+     || p->intent == icmAbsolutePerceptual
+     || p->intent == icmAbsoluteSaturation) {
 
-                /* Luminence is carried by the sum of all the output channels */
-                case icSigRgbData:
-                case icSigGrayData:
-                case icSigCmykData:
-                case icSigCmyData:
-                case icSigMch6Data:
-                    lc = -1;        /* Average all channels */
-                    break;
+        if (p->pcs == icSigLabData)     /* Convert L to Y */
+            icmLab2XYZ(&p->pcswht, out, out);
+        
+        /* Convert from Relative to Absolute colorimetric */
+        icmMulBy3x3(out, p->toAbs, out);
+        
+        if (p->e_pcs == icSigLabData)
+            icmXYZ2Lab(&p->pcswht, out, out);
 
-                /* A single channel carries the luminence information */
-                case icSigLabData:
-                case icSigLuvData:
-                case icSigYCbCrData:
-                case icSigYxyData:
-                    lc = 0;
-                    break;
+    } else {
 
-                case icSigXYZData:
-                case icSigHlsData:
-                    lc = 1;
-                    break;
+        /* Convert from Native to Effective output space */
+        if (p->pcs == icSigLabData && p->e_pcs == icSigXYZData)
+            icmLab2XYZ(&p->pcswht, out, out);
+        else if (p->pcs == icSigXYZData && p->e_pcs == icSigLabData)
+            icmXYZ2Lab(&p->pcswht, out, out);
+    }
 
-                case icSigHsvData:
-                    lc = 2;
-                    break;
-                
-                /* default means give up and use N-linear type lookup */
-                default:
-                    lc = -2;
-                    break;
-            }
+    return rv;
+}
 
-            /* If we know how luminance is represented in output space */
-            if (lc != -2) {
-                double tout1[MAX_CHAN];        /* Test output values */
-                double tout2[MAX_CHAN];
-                double tt, diag;
-                int n;
 
-                /* Determine input space location of min and max of */
-                /* given output channel (chan = -1 means average of all) */
-                p->lut->min_max(p->lut, tout1, tout2, lc);
-                
-                /* Convert to vector and then calculate normalized */
-                /* dot product with diagonal vector (1,1,1...) */
-                for (tt = 0.0, n = 0; n < inn; n++) {
-                    tout1[n] = tout2[n] - tout1[n];
-                    tt += tout1[n] * tout1[n];
-                }
-                if (tt > 0.0)
-                    tt = sqrt(tt);            /* normalizing factor for maximum delta */
-                else
-                    tt = 1.0;                /* Hmm. */
-                tt *= sqrt((double)inn);    /* Normalizing factor for diagonal vector */
-                for (diag = 0.0, n = 0; n < outn; n++)
-                    diag += tout1[n] / tt;
-                diag = fabs(diag);
+/* Overall Fwd conversion routine (Dev->PCS) */
+static int
+icmLuMonoFwd_lookup (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Input value */
+) {
+    int rv = 0;
+    icmLuMono *p = (icmLuMono *)pp;
+    rv |= icmLuMonoFwd_curve(p, out, in);
+    rv |= icmLuMonoFwd_map(p, out, out);
+    rv |= icmLuMonoFwd_abs(p, out, out);
+    return rv;
+}
 
-                /* I'm not really convinced that this is a reliable */
-                /* indicator of whether simplex interpolation should be used ... */
-                /* It does seem to do the right thing with YCC space though. */
-                if (diag > 0.8)    /* Diagonal is dominant ? */
-                    use_sx = 1;
+/* Three stage conversion routines */
+static int
+icmLuMonoFwd_lookup_in(
+icmLuBase *pp,        /* This */
+double *out,        /* Output value */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuMono *p = (icmLuMono *)pp;
+    rv |= icmLuMonoFwd_curve(p, out, in);
+    return rv;
+}
 
-                /* If we couldn't figure it out, use N-linear interpolation */
-                if (use_sx == -1)
-                    use_sx = 0;
-            }
+static int
+icmLuMonoFwd_lookup_core(
+icmLuBase *pp,        /* This */
+double *out,        /* Output value */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuMono *p = (icmLuMono *)pp;
+    rv |= icmLuMonoFwd_map(p, out, in);
+    rv |= icmLuMonoFwd_abs(p, out, out);
+    return rv;
+}
+
+static int
+icmLuMonoFwd_lookup_out(
+icmLuBase *pp,        /* This */
+double *out,        /* Output value */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    out[0] = in[0]; 
+    out[1] = in[1]; 
+    out[2] = in[2]; 
+    return rv;
+}
+
+
+/* -  -  -  -  -  -  -  -  -  -  -  -  -  - */
+/* Individual components of Bwd conversion: */
+
+/* Convert from relative PCS to absolute PCS (if required) */
+static int
+icmLuMonoBwd_abs (    /* Abs comes first in Bwd conversion */
+icmLuMono *p,        /* This */
+double *out,        /* Vector of output values in Native PCS */
+double *in            /* Vector of input values in Effective PCS */
+) {
+    int rv = 0;
+
+    if (out != in) {    /* Don't alter input values */
+        out[0] = in[0];
+        out[1] = in[1];
+        out[2] = in[2];
+    }
+
+    /* Force to monochrome locus in correct space */
+    if (p->e_pcs == icSigLabData) {
+        double wp[3];
+
+        if (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation) {
+            wp[0] = p->whitePoint.X;
+            wp[1] = p->whitePoint.Y;
+            wp[2] = p->whitePoint.Z;
+        } else {
+            wp[0] = p->pcswht.X;
+            wp[1] = p->pcswht.Y;
+            wp[2] = p->pcswht.Z;
         }
+        icmXYZ2Lab(&p->pcswht, wp, wp);    /* Convert to Lab white point */
+        out[1] = out[0]/wp[0] * wp[1];
+        out[2] = out[0]/wp[0] * wp[2];
 
-        if (use_sx) {
-            p->lookup_clut = p->lut->lookup_clut_sx;
+    } else {
+        if (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation) {
+            out[0] = out[1]/p->whitePoint.Y * p->whitePoint.X;
+            out[2] = out[1]/p->whitePoint.Y * p->whitePoint.Z;
         } else {
-            p->lookup_clut = p->lut->lookup_clut_nl;
+            out[0] = out[1]/p->pcswht.Y * p->pcswht.X;
+            out[2] = out[1]/p->pcswht.Y * p->pcswht.Z;
         }
     }
 
-    return (icmLuBase *)p;
-}
+    /* Do absolute conversion, and conversion to effective PCS */
+    if (p->intent == icAbsoluteColorimetric
+     || p->intent == icmAbsolutePerceptual
+     || p->intent == icmAbsoluteSaturation) {
 
+        if (p->e_pcs == icSigLabData)
+            icmLab2XYZ(&p->pcswht, out, out);
 
-/* Return an appropriate lookup object */
-/* Return NULL on error, and detailed error in icc */
-static 
-icmLuBase* icc_get_luobj (
-    icc *p,                        /* ICC */
-    icmLookupFunc func,            /* Conversion functionality */
-    icRenderingIntent intent,    /* Rendering intent, including icmAbsoluteColorimetricXYZ */
-    icColorSpaceSignature pcsor,/* PCS override (0 = def) */
-    icmLookupOrder order        /* Conversion representation search Order */
-)
-{
-    icmLuBase *luobj = NULL;    /* Lookup object to return */
-    icColorSpaceSignature pcs, e_pcs;    /* PCS and effective PCS */
-    
-#ifdef ICM_STRICT
-    int rv;
-    /* Check that the profile is legal, since we depend on it ? */
-    if ((rv = check_icc_legal(p)) != 0)
-        return NULL;
-#endif /* ICM_STRICT */
-    
-    /* Figure out the native and effective PCS */
-    e_pcs = pcs = p->header->pcs;
-    if (pcsor != icmSigDefaultData)
-        e_pcs = pcsor;            /* Override */
+        icmMulBy3x3(out, p->fromAbs, out);
 
-    /* How we expect to execute the request depends firstly on the type of profile */
-    switch (p->header->deviceClass) {
-        case icSigInputClass:
-        case icSigDisplayClass:
-        case icSigColorSpaceClass:
+        /* Convert from Effective to Native input space */
+        if (p->pcs == icSigLabData)
+            icmXYZ2Lab(&p->pcswht, out, out);
 
-            /* Look for Intent based AToBX profile + optional BToAX reverse */
-            /* or for AToB0 based profile + optional BToA0 reverse */
-            /* or three component matrix profile (reversable) */
-            /* or momochrome table profile (reversable) */ 
-            /* No Lut intent for ICC < V2.4, but possible for >= V2.4, */
-            /* so fall back if we can't find the chosen Lut intent.. */
-            /* Device <-> PCS */
-            /* Determine the algorithm and set its parameters */
+    } else {
 
-            switch (func) {
-                icRenderingIntent fbintent;        /* Fallback intent */
-                icTagSignature ttag, fbtag;
+        /* Convert from Effective to Native input space */
+        if (p->e_pcs == icSigLabData && p->pcs == icSigXYZData)
+            icmLab2XYZ(&p->pcswht, out, out);
+        else if (p->e_pcs == icSigXYZData && p->pcs == icSigLabData)
+            icmXYZ2Lab(&p->pcswht, out, out);
+    }
 
-                case icmFwd:    /* Device to PCS */
-                    if (intent == icmDefaultIntent)
-                        intent = icPerceptual;    /* Make this the default */
+    return rv;
+}
 
-                    switch (intent) {
-                        case icAbsoluteColorimetric:
-                            ttag = icSigAToB1Tag;
-                            fbtag = icSigAToB0Tag;
-                            fbintent = intent;
-                            break;
-                        case icRelativeColorimetric:
-                            ttag = icSigAToB1Tag;
-                            fbtag = icSigAToB0Tag;
-                            fbintent = icmDefaultIntent;
-                            break;
-                        case icPerceptual:
-                            ttag = icSigAToB0Tag;
-                            fbtag = icSigAToB0Tag;
-                            fbintent = icmDefaultIntent;
-                            break;
-                        case icSaturation:
-                            ttag = icSigAToB2Tag;
-                            fbtag = icSigAToB0Tag;
-                            fbintent = icmDefaultIntent;
-                            break;
-                        case icmAbsolutePerceptual:        /* Special icclib intent */
-                            ttag = icSigAToB0Tag;
-                            fbtag = icSigAToB0Tag;
-                            fbintent = intent;
-                            break;
-                        case icmAbsoluteSaturation:        /* Special icclib intent */
-                            ttag = icSigAToB2Tag;
-                            fbtag = icSigAToB0Tag;
-                            fbintent = intent;
-                            break;
-                        default:
-                            sprintf(p->err,"icc_get_luobj: Unknown intent");
-                            p->errc = 1;
-                            return NULL;
-                    }
+/* Map from relative PCS to linearised device */
+static int
+icmLuMonoBwd_map (
+icmLuMono *p,        /* This */
+double *out,        /* Output value */
+double *in            /* Vector of input values (native space) */
+) {
+    int rv = 0;
+    double pcsw[3];
 
-                    if (order != icmLuOrdRev) {
-                        /* Try Lut type lookup with the chosen intent first */
-                        if ((luobj = icc_new_icmLuLut(p, ttag,
-                             p->header->colorSpace, pcs, pcs,
-                             p->header->colorSpace, e_pcs, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
+    pcsw[0] = p->pcswht.X;
+    pcsw[1] = p->pcswht.Y;
+    pcsw[2] = p->pcswht.Z;
+    if (p->pcs == icSigLabData)
+        icmXYZ2Lab(&p->pcswht, pcsw, pcsw);    /* in Lab (should be 100.0!) */
+
+    /* Divide linearized device level into PCS white luminence */
+    if (p->pcs == icSigLabData)
+        out[0] = in[0]/pcsw[0];
+    else
+        out[0] = in[1]/pcsw[1];
+
+    return rv;
+}
+
+/* Map from linearised device to actual device */
+static int
+icmLuMonoBwd_curve (
+icmLuMono *p,        /* This */
+double *out,        /* Output value */
+double *in            /* Input value */
+) {
+    icc *icp = p->icp;
+    int rv = 0;
+
+    /* Convert to device value through curve */
+    if ((rv = p->grayCurve->lookup_bwd(p->grayCurve,&out[0],&in[0])) > 1) {
+        sprintf(icp->err,"icc_lookup: Curve->lookup_bwd() failed");
+        icp->errc = rv;
+        return 2;
+    }
+
+    return rv;
+}
+
+/* Overall Bwd conversion routine (PCS->Dev) */
+static int
+icmLuMonoBwd_lookup (
+icmLuBase *pp,        /* This */
+double *out,        /* Output value */
+double *in            /* Vector of input values */
+) {
+    double temp[3];
+    int rv = 0;
+    icmLuMono *p = (icmLuMono *)pp;
+    rv |= icmLuMonoBwd_abs(p, temp, in);
+    rv |= icmLuMonoBwd_map(p, out, temp);
+    rv |= icmLuMonoBwd_curve(p, out, out);
+    return rv;
+}
+
+/* Three stage conversion routines */
+static int
+icmLuMonoBwd_lookup_in(
+icmLuBase *pp,        /* This */
+double *out,        /* Output value */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
+    return rv;
+}
+
+static int
+icmLuMonoBwd_lookup_core(
+icmLuBase *pp,        /* This */
+double *out,        /* Output value */
+double *in            /* Vector of input values */
+) {
+    double temp[3];
+    int rv = 0;
+    icmLuMono *p = (icmLuMono *)pp;
+    rv |= icmLuMonoBwd_abs(p, temp, in);
+    rv |= icmLuMonoBwd_map(p, out, temp);
+    return rv;
+}
+
+static int
+icmLuMonoBwd_lookup_out(
+icmLuBase *pp,        /* This */
+double *out,        /* Output value */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuMono *p = (icmLuMono *)pp;
+    rv |= icmLuMonoBwd_curve(p, out, in);
+    return rv;
+}
+
+/* -  -  -  -  -  -  -  -  -  -  -  -  -  - */
+
+static void
+icmLuMono_delete(
+icmLuBase *p
+) {
+    icc *icp = p->icp;
+
+    icmLu_end_trace(p);
+    icp->al->free(icp->al, p);
+    ICM_ATOMIC_SUB(icp->nlu, 1);
+}
+
+static icmLuBase *
+new_icmLuMono(
+    struct _icc          *icp,
+    icColorSpaceSignature inSpace,        /* Native Input color space */
+    icColorSpaceSignature outSpace,        /* Native Output color space */
+    icColorSpaceSignature pcs,            /* Native PCS */
+    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
+    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
+    icColorSpaceSignature e_pcs,        /* Effective PCS */
+    icRenderingIntent     intent,        /* Rendering intent */
+    icmLookupFunc         func,            /* Functionality requested */
+    int dir                                /* 0 = fwd, 1 = bwd */
+) {
+    icmLuMono *p;
+
+    if ((p = (icmLuMono *) icp->al->calloc(icp->al,1,sizeof(icmLuMono))) == NULL)
+        return NULL;
+    ICM_ATOMIC_ADD(icp->nlu, 1);
+    p->icp      = icp;
+    p->del      = icmLuMono_delete;
+    p->lutspaces= icmLutSpaces;
+    p->spaces   = icmLuSpaces;
+    p->XYZ_Rel2Abs = icmLuXYZ_Rel2Abs;
+    p->XYZ_Abs2Rel = icmLuXYZ_Abs2Rel;
+    p->get_lutranges = icmLu_get_lutranges;
+    p->get_ranges = icmLu_get_ranges;
+    p->init_wh_bk = icmLuInit_Wh_bk;
+    p->set_trace = icmLu_set_trace;
+    p->get_stats = icmLu_get_stats;
+    p->reset_stats = icmLu_reset_stats;
+    p->wh_bk_points = icmLuWh_bk_points;
+    p->lu_wh_bk_points = icmLuLu_wh_bk_points;
+    p->fwd_lookup = icmLuMonoFwd_lookup;
+    p->fwd_curve  = icmLuMonoFwd_curve;
+    p->fwd_map    = icmLuMonoFwd_map;
+    p->fwd_abs    = icmLuMonoFwd_abs;
+    p->bwd_lookup = icmLuMonoBwd_lookup;
+    p->bwd_abs    = icmLuMonoFwd_abs;
+    p->bwd_map    = icmLuMonoFwd_map;
+    p->bwd_curve  = icmLuMonoFwd_curve;
+    if (dir) {
+        p->ttype         = icmMonoBwdType;
+        p->lookup        = icmLuMonoBwd_lookup;
+        p->lookup_in     = icmLuMonoBwd_lookup_in;
+        p->lookup_core   = icmLuMonoBwd_lookup_core;
+        p->lookup_out    = icmLuMonoBwd_lookup_out;
+        p->lookup_inv_in = icmLuMonoFwd_lookup_out;        /* Opposite of Bwd_lookup_in */
+    } else {
+        p->ttype         = icmMonoFwdType;
+        p->lookup        = icmLuMonoFwd_lookup;
+        p->lookup_in     = icmLuMonoFwd_lookup_in;
+        p->lookup_core   = icmLuMonoFwd_lookup_core;
+        p->lookup_out    = icmLuMonoFwd_lookup_out;
+        p->lookup_inv_in = icmLuMonoBwd_lookup_out;        /* Opposite of Fwd_lookup_in */
+    }
+
+    /* Lookup the white and black points */
+    if (p->init_wh_bk((icmLuBase *)p)) {
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* See if the color spaces are appropriate for the mono type */
+    if (number_ColorSpaceSignature(icp->header->colorSpace) != 1
+      || ( icp->header->pcs != icSigXYZData && icp->header->pcs != icSigLabData)) {
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Find the appropriate tags */
+    if ((p->grayCurve = (icmCurve *)icp->read_tag(icp, icSigGrayTRCTag)) == NULL
+         || (p->grayCurve->ttype != icSigCurveType
+          && p->grayCurve->ttype != icSigParametricCurveType)) {
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    p->pcswht = icp->header->illuminant;
+    p->intent   = intent;
+    p->function = func;
+    p->inSpace  = inSpace;
+    p->outSpace = outSpace;
+    p->pcs      = pcs;
+    p->e_inSpace  = e_inSpace;
+    p->e_outSpace = e_outSpace;
+    p->e_pcs      = e_pcs;
+
+    return (icmLuBase *)p;
+}
+
+static icmLuBase *
+new_icmLuMonoFwd(
+    struct _icc          *icp,
+    icColorSpaceSignature inSpace,        /* Native Input color space */
+    icColorSpaceSignature outSpace,        /* Native Output color space */
+    icColorSpaceSignature pcs,            /* Native PCS */
+    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
+    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
+    icColorSpaceSignature e_pcs,        /* Effective PCS */
+    icRenderingIntent     intent,        /* Rendering intent */
+    icmLookupFunc         func            /* Functionality requested */
+) {
+    return new_icmLuMono(icp, inSpace, outSpace, pcs, e_inSpace, e_outSpace, e_pcs,
+                         intent, func, 0);
+}
+
+
+static icmLuBase *
+new_icmLuMonoBwd(
+    struct _icc          *icp,
+    icColorSpaceSignature inSpace,        /* Native Input color space */
+    icColorSpaceSignature outSpace,        /* Native Output color space */
+    icColorSpaceSignature pcs,            /* Native PCS */
+    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
+    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
+    icColorSpaceSignature e_pcs,        /* Effective PCS */
+    icRenderingIntent     intent,        /* Rendering intent */
+    icmLookupFunc         func            /* Functionality requested */
+) {
+    return new_icmLuMono(icp, inSpace, outSpace, pcs, e_inSpace, e_outSpace, e_pcs,
+                         intent, func, 1);
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - */
+/* Forward and Backward Matrix type conversion */
+/* Return 0 on success, 1 if clipping occured, 2 on other error */
+
+/* Individual components of Fwd conversion: */
+static int
+icmLuMatrixFwd_curve (
+icmLuMatrix *p,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    icc *icp = p->icp;
+    int rv = 0;
+
+    /* Curve lookups */
+    if ((rv |= p->redCurve->lookup_fwd(  p->redCurve,  &out[0],&in[0])) > 1
+     || (rv |= p->greenCurve->lookup_fwd(p->greenCurve,&out[1],&in[1])) > 1
+     || (rv |= p->blueCurve->lookup_fwd( p->blueCurve, &out[2],&in[2])) > 1) {
+        sprintf(icp->err,"icc_lookup: Curve->lookup_fwd() failed");
+        icp->errc = rv;
+        return 2;
+    }
+
+    return rv;
+}
+
+static int
+icmLuMatrixFwd_matrix (
+icmLuMatrix *p,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    double tt[3];
+
+    /* Matrix */
+    tt[0] = p->mx[0][0] * in[0] + p->mx[0][1] * in[1] + p->mx[0][2] * in[2];
+    tt[1] = p->mx[1][0] * in[0] + p->mx[1][1] * in[1] + p->mx[1][2] * in[2];
+    tt[2] = p->mx[2][0] * in[0] + p->mx[2][1] * in[1] + p->mx[2][2] * in[2];
+
+    out[0] = tt[0];
+    out[1] = tt[1];
+    out[2] = tt[2];
+
+    return rv;
+}
+
+static int
+icmLuMatrixFwd_abs (/* Abs comes last in Fwd conversion */
+icmLuMatrix *p,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+
+    if (out != in) {    /* Don't alter input values */
+        out[0] = in[0];
+        out[1] = in[1];
+        out[2] = in[2];
+    }
+
+    /* If required, convert from Relative to Absolute colorimetric */
+    if (p->intent == icAbsoluteColorimetric
+     || p->intent == icmAbsolutePerceptual
+     || p->intent == icmAbsoluteSaturation) {
+        icmMulBy3x3(out, p->toAbs, out);
+    }
+
+    /* If e_pcs is Lab, then convert XYZ to Lab */
+    if (p->e_pcs == icSigLabData)
+        icmXYZ2Lab(&p->pcswht, out, out);
+
+    return rv;
+}
+
+
+/* Matrix and absolute conversion, using the folded matrix */
+static int
+icmLuMatrixFwd_matrix_abs (
+icmLuMatrix *p,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    icmMulBy3x3(out, p->amx, in);
+
+    /* If e_pcs is Lab, then convert XYZ to Lab */
+    if (p->e_pcs == icSigLabData)
+        icmXYZ2Lab(&p->pcswht, out, out);
+
+    return 0;
+}
+
+/* Overall Fwd conversion (Dev->PCS)*/
+static int
+icmLuMatrixFwd_lookup (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuMatrix *p = (icmLuMatrix *)pp;
+    rv |= icmLuMatrixFwd_curve(p, out, in);
+    rv |= icmLuMatrixFwd_matrix_abs(p, out, out);
+    return rv;
+}
+
+/* Three stage conversion routines */
+static int
+icmLuMatrixFwd_lookup_in (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuMatrix *p = (icmLuMatrix *)pp;
+    rv |= icmLuMatrixFwd_curve(p, out, in);
+    return rv;
+}
+
+static int
+icmLuMatrixFwd_lookup_core (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuMatrix *p = (icmLuMatrix *)pp;
+    rv |= icmLuMatrixFwd_matrix_abs(p, out, in);
+    return rv;
+}
+
+static int
+icmLuMatrixFwd_lookup_out (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
+    return rv;
+}
+
+/* -  -  -  -  -  -  -  -  -  -  -  -  -  - */
+/* Individual components of Bwd conversion: */
+
+static int
+icmLuMatrixBwd_abs (/* Abs comes first in Bwd conversion */
+icmLuMatrix *p,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+
+    if (out != in) {    /* Don't alter input values */
+        out[0] = in[0];
+        out[1] = in[1];
+        out[2] = in[2];
+    }
+
+    /* If e_pcs is Lab, then convert Lab to XYZ */
+    if (p->e_pcs == icSigLabData)
+        icmLab2XYZ(&p->pcswht, out, out);
+
+    /* If required, convert from Absolute to Relative colorimetric */
+    if (p->intent == icAbsoluteColorimetric
+     || p->intent == icmAbsolutePerceptual
+     || p->intent == icmAbsoluteSaturation) {
+        icmMulBy3x3(out, p->fromAbs, out);
+    }
+
+    return rv;
+}
+
+static int
+icmLuMatrixBwd_matrix (
+icmLuMatrix *p,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    double tt[3];
+
+    tt[0] = in[0];
+    tt[1] = in[1];
+    tt[2] = in[2];
+
+    /* Matrix */
+    out[0] = p->bmx[0][0] * tt[0] + p->bmx[0][1] * tt[1] + p->bmx[0][2] * tt[2];
+    out[1] = p->bmx[1][0] * tt[0] + p->bmx[1][1] * tt[1] + p->bmx[1][2] * tt[2];
+    out[2] = p->bmx[2][0] * tt[0] + p->bmx[2][1] * tt[1] + p->bmx[2][2] * tt[2];
+
+    return rv;
+}
+
+static int
+icmLuMatrixBwd_curve (
+icmLuMatrix *p,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    icc *icp = p->icp;
+    int rv = 0;
+
+    /* Curves */
+    if ((rv |= p->redCurve->lookup_bwd(p->redCurve,&out[0],&in[0])) > 1
+     ||    (rv |= p->greenCurve->lookup_bwd(p->greenCurve,&out[1],&in[1])) > 1
+     || (rv |= p->blueCurve->lookup_bwd(p->blueCurve,&out[2],&in[2])) > 1) {
+        sprintf(icp->err,"icc_lookup: Curve->lookup_bwd() failed");
+        icp->errc = rv;
+        return 2;
+    }
+    return rv;
+}
+
+/* Absolute conversion and matrix, using the folded matrix */
+static int
+icmLuMatrixBwd_abs_matrix (
+icmLuMatrix *p,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    double tt[3];
+
+    /* If e_pcs is Lab, then convert Lab to XYZ */
+    if (p->e_pcs == icSigLabData)
+        icmLab2XYZ(&p->pcswht, tt, in);
+    else
+        icmCpy3(tt, in);
+
+    icmMulBy3x3(out, p->abmx, tt);
+
+    return 0;
+}
+
+/* Overall Bwd conversion (PCS->Dev) */
+static int
+icmLuMatrixBwd_lookup (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuMatrix *p = (icmLuMatrix *)pp;
+    rv |= icmLuMatrixBwd_abs_matrix(p, out, in);
+    rv |= icmLuMatrixBwd_curve(p, out, out);
+    return rv;
+}
+
+/* Three stage conversion routines */
+static int
+icmLuMatrixBwd_lookup_in (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
+    return rv;
+}
+
+static int
+icmLuMatrixBwd_lookup_core (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuMatrix *p = (icmLuMatrix *)pp;
+    rv |= icmLuMatrixBwd_abs_matrix(p, out, in);
+    return rv;
+}
+
+static int
+icmLuMatrixBwd_lookup_out (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuMatrix *p = (icmLuMatrix *)pp;
+    rv |= icmLuMatrixBwd_curve(p, out, in);
+    return rv;
+}
+
+/* -  -  -  -  -  -  -  -  -  -  -  -  -  - */
+
+static void
+icmLuMatrix_delete(
+icmLuBase *p
+) {
+    icc *icp = p->icp;
+
+    icmLu_end_trace(p);
+    icp->al->free(icp->al, p);
+    ICM_ATOMIC_SUB(icp->nlu, 1);
+}
+
+/* We setup valid fwd and bwd component conversions, */
+/* but setup only the asked for overal conversion. */
+static icmLuBase *
+new_icmLuMatrix(
+    struct _icc          *icp,
+    icColorSpaceSignature inSpace,        /* Native Input color space */
+    icColorSpaceSignature outSpace,        /* Native Output color space */
+    icColorSpaceSignature pcs,            /* Native PCS */
+    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
+    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
+    icColorSpaceSignature e_pcs,        /* Effective PCS */
+    icRenderingIntent     intent,        /* Rendering intent */
+    icmLookupFunc         func,            /* Functionality requested */
+    int dir                                /* 0 = fwd, 1 = bwd */
+) {
+    icmLuMatrix *p;
+
+    if ((p = (icmLuMatrix *) icp->al->calloc(icp->al,1,sizeof(icmLuMatrix))) == NULL)
+        return NULL;
+    ICM_ATOMIC_ADD(icp->nlu, 1);
+    p->icp      = icp;
+    p->del      = icmLuMatrix_delete;
+    p->lutspaces= icmLutSpaces;
+    p->spaces   = icmLuSpaces;
+    p->XYZ_Rel2Abs = icmLuXYZ_Rel2Abs;
+    p->XYZ_Abs2Rel = icmLuXYZ_Abs2Rel;
+    p->get_lutranges = icmLu_get_lutranges;
+    p->get_ranges = icmLu_get_ranges;
+    p->init_wh_bk = icmLuInit_Wh_bk;
+    p->set_trace = icmLu_set_trace;
+    p->get_stats = icmLu_get_stats;
+    p->reset_stats = icmLu_reset_stats;
+    p->wh_bk_points = icmLuWh_bk_points;
+    p->lu_wh_bk_points = icmLuLu_wh_bk_points;
+    p->fwd_lookup = icmLuMatrixFwd_lookup;
+    p->fwd_curve  = icmLuMatrixFwd_curve;
+    p->fwd_matrix = icmLuMatrixFwd_matrix;
+    p->fwd_abs    = icmLuMatrixFwd_abs;
+    p->bwd_lookup = icmLuMatrixBwd_lookup;
+    p->bwd_abs    = icmLuMatrixBwd_abs;
+    p->bwd_matrix = icmLuMatrixBwd_matrix;
+    p->bwd_curve  = icmLuMatrixBwd_curve;
+    if (dir) {
+        p->ttype         = icmMatrixBwdType;
+        p->lookup        = icmLuMatrixBwd_lookup;
+        p->lookup_in     = icmLuMatrixBwd_lookup_in;
+        p->lookup_core   = icmLuMatrixBwd_lookup_core;
+        p->lookup_out    = icmLuMatrixBwd_lookup_out;
+        p->lookup_inv_in = icmLuMatrixFwd_lookup_out;        /* Opposite of Bwd_lookup_in */
+    } else {
+        p->ttype         = icmMatrixFwdType;
+        p->lookup        = icmLuMatrixFwd_lookup;
+        p->lookup_in     = icmLuMatrixFwd_lookup_in;
+        p->lookup_core   = icmLuMatrixFwd_lookup_core;
+        p->lookup_out    = icmLuMatrixFwd_lookup_out;
+        p->lookup_inv_in = icmLuMatrixBwd_lookup_out;        /* Opposite of Fwd_lookup_in */
+    }
+
+    /* Lookup the white and black points */
+    if (p->init_wh_bk((icmLuBase *)p)) {
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Note that we can use matrix type even if PCS is Lab, */
+    /* by simply converting it. */
+
+    /* Find the appropriate tags */
+    if ((p->redCurve = (icmCurve *)icp->read_tag(icp, icSigRedTRCTag)) == NULL
+     || (p->redCurve->ttype != icSigCurveType && p->redCurve->ttype != icSigParametricCurveType)
+     || (p->greenCurve = (icmCurve *)icp->read_tag(icp, icSigGreenTRCTag)) == NULL
+     || (p->greenCurve->ttype != icSigCurveType && p->greenCurve->ttype != icSigParametricCurveType)
+     || (p->blueCurve = (icmCurve *)icp->read_tag(icp, icSigBlueTRCTag)) == NULL
+     || (p->blueCurve->ttype != icSigCurveType && p->blueCurve->ttype != icSigParametricCurveType)
+     || (p->redColrnt = (icmXYZArray *)icp->read_tag(icp, icSigRedColorantTag)) == NULL
+     || p->redColrnt->ttype != icSigXYZType || p->redColrnt->size < 1
+     || (p->greenColrnt = (icmXYZArray *)icp->read_tag(icp, icSigGreenColorantTag)) == NULL
+     || p->greenColrnt->ttype != icSigXYZType || p->greenColrnt->size < 1
+     || (p->blueColrnt = (icmXYZArray *)icp->read_tag(icp, icSigBlueColorantTag)) == NULL
+     || p->blueColrnt->ttype != icSigXYZType || p->blueColrnt->size < 1) {
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Setup the matrix */
+    p->mx[0][0] = p->redColrnt->data[0].X;
+    p->mx[0][1] = p->greenColrnt->data[0].X;
+    p->mx[0][2] = p->blueColrnt->data[0].X;
+    p->mx[1][1] = p->greenColrnt->data[0].Y;
+    p->mx[1][0] = p->redColrnt->data[0].Y;
+    p->mx[1][2] = p->blueColrnt->data[0].Y;
+    p->mx[2][1] = p->greenColrnt->data[0].Z;
+    p->mx[2][0] = p->redColrnt->data[0].Z;
+    p->mx[2][2] = p->blueColrnt->data[0].Z;
+
+#ifndef ICM_STRICT    
+    /* Workaround for buggy Kodak RGB profiles. Their matrix values */
+    /* may be scaled to 100 rather than 1.0, and the colorant curves */
+    /* may be scaled by 0.5 */
+    if (icp->header->cmmId == str2tag("KCMS")) {
+        int i, j, oc = 0;
+        for (i = 0; i < 3; i++)
+            for (j = 0; j < 3; j++)
+                if (p->mx[i][j] > 5.0)
+                    oc++;
+        if (oc > 4) {        /* Looks like it */
+            for (i = 0; i < 3; i++)
+                for (j = 0; j < 3; j++)
+                    p->mx[i][j] /= 100.0;
+        }
+    }
+#endif /* ICM_STRICT */
+
+    if (icmInverse3x3(p->bmx, p->mx) != 0) {    /* Compute inverse */
+        sprintf(icp->err,"icc_new_iccLuMatrix: Matrix wasn't invertable");
+        icp->errc = 2;
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    p->pcswht = icp->header->illuminant;
+    p->intent   = intent;
+    p->function = func;
+    p->inSpace  = inSpace;
+    p->outSpace = outSpace;
+    p->pcs      = pcs;
+    p->e_inSpace  = e_inSpace;
+    p->e_outSpace = e_outSpace;
+    p->e_pcs      = e_pcs;
+
+    /* Lookup the white and black points */
+    if (p->init_wh_bk((icmLuBase *)p)) {
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Fold any absolute conversion into the matrices used by lookup() */
+    icmCpy3x3(p->amx, p->mx);
+    icmCpy3x3(p->abmx, p->bmx);
+    if (p->intent == icAbsoluteColorimetric
+     || p->intent == icmAbsolutePerceptual
+     || p->intent == icmAbsoluteSaturation) {
+        icmMul3x3(p->amx, p->toAbs);
+        icmMul3x3_2(p->abmx, p->bmx, p->fromAbs);
+    }
+
+    return (icmLuBase *)p;
+}
+
+static icmLuBase *
+new_icmLuMatrixFwd(
+    struct _icc          *icp,
+    icColorSpaceSignature inSpace,        /* Native Input color space */
+    icColorSpaceSignature outSpace,        /* Native Output color space */
+    icColorSpaceSignature pcs,            /* Native PCS */
+    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
+    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
+    icColorSpaceSignature e_pcs,        /* Effective PCS */
+    icRenderingIntent     intent,        /* Rendering intent */
+    icmLookupFunc         func            /* Functionality requested */
+) {
+    return new_icmLuMatrix(icp, inSpace, outSpace, pcs, e_inSpace, e_outSpace, e_pcs,
+                           intent, func, 0);
+}
+
+
+static icmLuBase *
+new_icmLuMatrixBwd(
+    struct _icc          *icp,
+    icColorSpaceSignature inSpace,        /* Native Input color space */
+    icColorSpaceSignature outSpace,        /* Native Output color space */
+    icColorSpaceSignature pcs,            /* Native PCS */
+    icColorSpaceSignature e_inSpace,    /* Effective Input color space */
+    icColorSpaceSignature e_outSpace,    /* Effective Output color space */
+    icColorSpaceSignature e_pcs,        /* Effective PCS */
+    icRenderingIntent     intent,        /* Rendering intent */
+    icmLookupFunc         func            /* Functionality requested */
+) {
+    return new_icmLuMatrix(icp, inSpace, outSpace, pcs, e_inSpace, e_outSpace, e_pcs,
+                           intent, func, 1);
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - */
+/* Forward and Backward Multi-Dimensional Interpolation type conversion */
+/* Return 0 on success, 1 if clipping occured, 2 on other error */
+
+/* Return the 3x3 matrix equivalent of a linear normalizing function, */
+/* or return nz if it isn't linear. */
+static int icmNormf_matrix(void (*normf)(double *out, double *in), double mx[3][3]) {
+    double tt[3], ck[3] = { 0.3, 0.7, 0.2 }, cv[3];
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++)
+            tt[j] = i == j ? 1.0 : 0.0;
+        normf(tt, tt);
+        for (j = 0; j < 3; j++)
+            mx[j][i] = tt[j];
+    }
+
+    /* Check that there is no offset or non-linearity */
+    tt[0] = tt[1] = tt[2] = 0.0;
+    normf(tt, tt);
+    normf(cv, ck);
+    icmMulBy3x3(ck, mx, ck);
+    for (j = 0; j < 3; j++) {
+        if (fabs(tt[j]) > 1e-12 || fabs(cv[j] - ck[j]) > 1e-12)
+            return 1;
+    }
+    return 0;
+}
+
+/* Compose the absolute conversion of a Lu with an XYZ input, */
+/* an optional following matrix and the input normalization into */
+/* the single matrix inmx[], so that an absolute lookup costs */
+/* no more than a relative one. Any Lab to XYZ conversion of the */
+/* effective input space is still done before it. */
+/* Return nz if it's not possible. */
+static int icmLu_fold_in(
+    icmLuBase *p,
+    double mx[3][3],                            /* Matrix following in_abs, NULL if none */
+    void (*normf)(double *out, double *in),        /* Input normalizing function */
+    double inmx[3][3]                            /* Return composed matrix */
+) {
+    double nmx[3][3];
+
+    if (p->inSpace != icSigXYZData
+     || (p->e_inSpace != icSigXYZData && p->e_inSpace != icSigLabData)
+     || icmNormf_matrix(normf, nmx) != 0)
+        return 1;
+
+    if ((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation))
+        icmCpy3x3(inmx, p->fromAbs);
+    else
+        icmSetUnity3x3(inmx);
+    if (mx != NULL)
+        icmMul3x3(inmx, mx);
+    icmMul3x3(inmx, nmx);
+    return 0;
+}
+
+/* Compose the output de-normalization of a Lu with an XYZ output */
+/* with its absolute conversion into the single matrix outmx[]. */
+/* Any XYZ to Lab conversion of the effective output space is still */
+/* done after it. Return nz if it's not possible. */
+static int icmLu_fold_out(
+    icmLuBase *p,
+    void (*denormf)(double *out, double *in),    /* Output de-normalizing function */
+    double outmx[3][3]                            /* Return composed matrix */
+) {
+    if (p->outSpace != icSigXYZData
+     || (p->e_outSpace != icSigXYZData && p->e_outSpace != icSigLabData)
+     || icmNormf_matrix(denormf, outmx) != 0)
+        return 1;
+
+    if ((p->function == icmFwd || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation))
+        icmMul3x3(outmx, p->toAbs);
+    return 0;
+}
+
+/* Absolute and effective PCS conversion of n input channels. */
+/* This is shared by the Lut and LutAB lookups */
+static int icmLuLut_in_abs_n(icmLuBase *p, unsigned int n, double *out, double *in) {
+    int rv = 0;
+
+    DBLLL(("icm in_abs: input %s\n",icmPdv(n, in)));
+    if (out != in) {
+        unsigned int i;
+        for (i = 0; i < n; i++)        /* Don't alter input values */
+            out[i] = in[i];
+    }
+
+    /* If Bwd Lut, take care of Absolute color space and effective input space */
+    if ((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation)) {
+    
+        if (p->e_inSpace == icSigLabData) {
+            icmLab2XYZ(&p->pcswht, out, out);
+            DBLLL(("icm in_abs: after Lab2XYZ %s\n",icmPdv(n, out)));
+        }
+
+        /* Convert from Absolute to Relative colorimetric */
+        icmMulBy3x3(out, p->fromAbs, out);
+        DBLLL(("icm in_abs: after fromAbs %s\n",icmPdv(n, out)));
+        
+        if (p->inSpace == icSigLabData) {
+            icmXYZ2Lab(&p->pcswht, out, out);
+            DBLLL(("icm in_abs: after XYZ2Lab %s\n",icmPdv(n, out)));
+        }
+
+    } else {
+
+        /* Convert from Effective to Native input space */
+        if (p->e_inSpace == icSigLabData && p->inSpace == icSigXYZData) {
+            icmLab2XYZ(&p->pcswht, out, out);
+            DBLLL(("icm in_abs: after Lab2XYZ %s\n",icmPdv(n, out)));
+        } else if (p->e_inSpace == icSigXYZData && p->inSpace == icSigLabData) {
+            icmXYZ2Lab(&p->pcswht, out, out);
+            DBLLL(("icm in_abs: after XYZ2Lab %s\n",icmPdv(n, out)));
+        }
+    }
+    DBLLL(("icm in_abs: returning %s\n",icmPdv(n, out)));
+
+    return rv;
+}
+
+/* Components of overall lookup, in order */
+static int icmLuLut_in_abs(icmLuLut *p, double *out, double *in) {
+    return icmLuLut_in_abs_n((icmLuBase *)p, p->lut->inputChan, out, in);
+}
+
+/* Possible matrix lookup */
+static int icmLuLut_matrix(icmLuLut *p, double *out, double *in) {
+    icmLut *lut = p->lut;
+    int rv = 0;
+
+    if (p->usematrix)        
+        rv |= lut->lookup_matrix(lut,out,in);
+    else if (out != in) {
+        unsigned int i;
+        for (i = 0; i < lut->inputChan; i++)
+            out[i] = in[i];
+    }
+    return rv;
+}
+
+/* Do input -> input' lookup */
+static int icmLuLut_input(icmLuLut *p, double *out, double *in) {
+    icmLut *lut = p->lut;
+    int rv = 0;
+
+    p->in_normf(out, in);                         /* Normalize from input color space */
+    rv |= lut->lookup_input(lut,out,out);        /* Lookup though input tables */
+    p->in_denormf(out,out);                        /* De-normalize to input color space */
+    return rv;
+}
+
+/* Do input'->output' lookup */
+static int icmLuLut_clut(icmLuLut *p, double *out, double *in) {
+    icmLut *lut = p->lut;
+    double temp[MAX_CHAN];
+    int rv = 0;
+
+    p->in_normf(temp, in);                         /* Normalize from input color space */
+    rv |= p->lookup_clut(lut,out,temp);            /* Lookup though clut tables */
+    p->out_denormf(out,out);                    /* De-normalize to output color space */
+    return rv;
+}
+
+/* Do output'->output lookup */
+static int icmLuLut_output(icmLuLut *p, double *out, double *in) {
+    icmLut *lut = p->lut;
+    int rv = 0;
+
+    p->out_normf(out,in);                        /* Normalize from output color space */
+    rv |= lut->lookup_output(lut,out,out);        /* Lookup though output tables */
+    p->out_denormf(out, out);                    /* De-normalize to output color space */
+    return rv;
+}
+
+/* Absolute and effective PCS conversion of n output channels. */
+/* This is shared by the Lut and LutAB lookups */
+static int icmLuLut_out_abs_n(icmLuBase *p, unsigned int n, double *out, double *in) {
+    int rv = 0;
+
+    DBLLL(("icm out_abs: input %s\n",icmPdv(n, in)));
+    if (out != in) {
+        unsigned int i;
+        for (i = 0; i < n; i++)        /* Don't alter input values */
+            out[i] = in[i];
+    }
+
+    /* If Fwd Lut, take care of Absolute color space */
+    /* and convert from native to effective out PCS */
+    if ((p->function == icmFwd || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation)) {
+
+        if (p->outSpace == icSigLabData) {
+            icmLab2XYZ(&p->pcswht, out, out);
+            DBLLL(("icm out_abs: after Lab2XYZ %s\n",icmPdv(n, out)));
+        }
+        
+        /* Convert from Relative to Absolute colorimetric XYZ */
+        icmMulBy3x3(out, p->toAbs, out);
+        DBLLL(("icm out_abs: after toAbs %s\n",icmPdv(n, out)));
+
+        if (p->e_outSpace == icSigLabData) {
+            icmXYZ2Lab(&p->pcswht, out, out);
+            DBLLL(("icm out_abs: after XYZ2Lab %s\n",icmPdv(n, out)));
+        }
+    } else {
+
+        /* Convert from Native to Effective output space */
+        if (p->outSpace == icSigLabData && p->e_outSpace == icSigXYZData) {
+            icmLab2XYZ(&p->pcswht, out, out);
+            DBLLL(("icm out_abs: after Lab2 %s\n",icmPdv(n, out)));
+        } else if (p->outSpace == icSigXYZData && p->e_outSpace == icSigLabData) {
+            icmXYZ2Lab(&p->pcswht, out, out);
+            DBLLL(("icm out_abs: after XYZ2Lab %s\n",icmPdv(n, out)));
+        }
+    }
+    DBLLL(("icm out_abs: returning %s\n",icmPdv(n, out)));
+    return rv;
+}
+
+static int icmLuLut_out_abs(icmLuLut *p, double *out, double *in) {
+    return icmLuLut_out_abs_n((icmLuBase *)p, p->lut->outputChan, out, in);
+}
+
+
+/* Overall lookup */
+static int
+icmLuLut_lookup (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuLut *p = (icmLuLut *)pp;
+    icmLut *lut = p->lut;
+    double temp[MAX_CHAN];
+
+    DBGLL(("icmLuLut_lookup: in = %s\n", icmPdv(p->inputChan, in)));
+    if (p->inmxv) {                                /* in_abs, matrix and normalize in one */
+        if (p->e_inSpace == icSigLabData)
+            icmLab2XYZ(&p->pcswht, temp, in);
+        else
+            icmCpy3(temp, in);
+        icmMulBy3x3(temp, p->inmx, temp);
+    } else {
+        rv |= p->in_abs(p,temp,in);                    /* Possible absolute conversion */
+        DBGLL(("icmLuLut_lookup: in_abs = %s\n", icmPdv(p->inputChan, temp)));
+        if (p->usematrix) {
+            rv |= lut->lookup_matrix(lut,temp,temp);/* If XYZ, multiply by non-unity matrix */
+            DBGLL(("icmLuLut_lookup: matrix = %s\n", icmPdv(p->inputChan, temp)));
+        }
+        p->in_normf(temp, temp);                /* Normalize for input color space */
+    }
+    DBGLL(("icmLuLut_lookup: norm = %s\n", icmPdv(p->inputChan, temp)));
+    rv |= lut->lookup_input(lut,temp,temp);        /* Lookup though input tables */
+    DBGLL(("icmLuLut_lookup: input = %s\n", icmPdv(p->inputChan, temp)));
+    rv |= p->lookup_clut(lut,out,temp);            /* Lookup though clut tables */
+    DBGLL(("icmLuLut_lookup: clut = %s\n", icmPdv(p->outputChan, out)));
+    rv |= lut->lookup_output(lut,out,out);        /* Lookup though output tables */
+    DBGLL(("icmLuLut_lookup: output = %s\n", icmPdv(p->outputChan, out)));
+    if (p->outmxv) {                            /* Denormalize and out_abs in one */
+        icmMulBy3x3(out, p->outmx, out);
+        if (p->e_outSpace == icSigLabData)
+            icmXYZ2Lab(&p->pcswht, out, out);
+    } else {
+        p->out_denormf(out,out);                /* Normalize for output color space */
+        DBGLL(("icmLuLut_lookup: denorm = %s\n", icmPdv(p->outputChan, out)));
+        rv |= p->out_abs(p,out,out);            /* Possible absolute conversion */
+    }
+    DBGLL(("icmLuLut_lookup: out_abse = %s\n", icmPdv(p->outputChan, out)));
+
+    return rv;
+}
+
+#ifdef NEVER    /* The following should be identical in effect to the above. */
+
+/* Overall lookup */
+static int
+icmLuLut_lookup (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int i, rv = 0;
+    icmLuLut *p = (icmLuLut *)pp;
+    icmLut *lut = p->lut;
+    double temp[MAX_CHAN];
+
+    rv |= p->in_abs(p,temp,in);
+    rv |= p->matrix(p,temp,temp);
+    rv |= p->input(p,temp,temp);
+    rv |= p->clut(p,out,temp);
+    rv |= p->output(p,out,out);
+    rv |= p->out_abs(p,out,out);
+
+    return rv;
+}
+
+#endif    /* NEVER */
+
+/* Three stage conversion */
+static int
+icmLuLut_lookup_in (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuLut *p = (icmLuLut *)pp;
+    icmLut *lut = p->lut;
+
+    /* If in_abs() or matrix() are active, then we can't have a per component input curve */
+    if (((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation))
+     || (p->e_inSpace != p->inSpace)
+     || (p->usematrix)) {
+        unsigned int i;
+        for (i = 0; i < lut->inputChan; i++)
+            out[i] = in[i];
+    } else {
+        rv |= p->input(p,out,in);
+    }
+    return rv;
+}
+
+static int
+icmLuLut_lookup_core (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuLut *p = (icmLuLut *)pp;
+
+    /* If in_abs() or matrix() are active, then we have to do the per component input curve here */
+    if (((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation))
+     || (p->e_inSpace != p->inSpace)
+     || (p->usematrix)) {
+        double temp[MAX_CHAN];
+        rv |= p->in_abs(p,temp,in);
+        rv |= p->matrix(p,temp,temp);
+        rv |= p->input(p,temp,temp);
+        rv |= p->clut(p,out,temp);
+    } else {
+        rv |= p->clut(p,out,in);
+    }
+
+    /* If out_abs() is active, then we can't have do per component out curve here */
+    if (((p->function == icmFwd || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation))
+     || (p->outSpace != p->e_outSpace)) {
+        rv |= p->output(p,out,out);
+        rv |= p->out_abs(p,out,out);
+    }
+
+    return rv;
+}
+
+
+static int
+icmLuLut_lookup_out (
+    icmLuBase *pp,        /* This */
+    double *out,          /* Vector of output values */
+    double *in            /* Vector of input values */
+)
+{
+    int rv = 0;
+    icmLuLut *p = (icmLuLut *)pp;
+    icmLut *lut = p->lut;
+
+    /* If out_abs() is active, then we can't have a per component out curve */
+    if (((p->function == icmFwd || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation))
+     || (p->outSpace != p->e_outSpace)) {
+        unsigned int i;
+        for (i = 0; i < lut->outputChan; i++)
+            out[i] = in[i];
+    } else {
+        rv |= p->output(p,out,in);
+    }
+
+    return rv;
+}
+
+
+/* Inverse three stage conversion (partly implemented) */
+static int
+icmLuLut_lookup_inv_in (
+    icmLuBase *pp,        /* This */
+    double *out,          /* Vector of output values */
+    double *in            /* Vector of input values */
+) 
+{
+    int rv = 0;
+    icmLuLut *p = (icmLuLut *)pp;
+    icmLut *lut = p->lut;
+
+    /* If in_abs() or matrix() are active, then we can't have a per component input curve */
+    if (((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation))
+     || (p->e_inSpace != p->inSpace)
+     || (p->usematrix)) {
+        unsigned int i;
+        for (i = 0; i < lut->inputChan; i++)
+            out[i] = in[i];
+    } else {
+        rv |= p->inv_input(p,out,in);
+    }
+    return rv;
+}
+
+
+/* Some components of inverse lookup, in order */
+/* ~~ should these be in icmLut (like all the fwd transforms)? */
+static int 
+icmLuLut_inv_out_abs(icmLuLut *p, double *out, double *in) 
+{
+    icmLut *lut = p->lut;
+    int rv = 0;
+
+    DBLLL(("icm inv_out_abs: input %s\n",icmPdv(lut->outputChan, in)));
+    if (out != in) {
+        unsigned int i;
+        for (i = 0; i < lut->outputChan; i++)        /* Don't alter input values */
+            out[i] = in[i];
+    }
+
+    /* If Fwd Lut, take care of Absolute color space */
+    /* and convert from effective to native inverse output PCS */
+    /* OutSpace must be PCS: XYZ or Lab */
+    if ((p->function == icmFwd || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation)) {
+
+        if (p->e_outSpace == icSigLabData) {
+            icmLab2XYZ(&p->pcswht, out, out);
+            DBLLL(("icm inv_out_abs: after Lab2XYZ %s\n",icmPdv(lut->outputChan, out)));
+        }
+    
+        /* Convert from Absolute to Relative colorimetric */
+        icmMulBy3x3(out, p->fromAbs, out);
+        DBLLL(("icm inv_out_abs: after fromAbs %s\n",icmPdv(lut->outputChan, out)));
+        
+        if (p->outSpace == icSigLabData) {
+            icmXYZ2Lab(&p->pcswht, out, out);
+            DBLLL(("icm inv_out_abs: after XYZ2Lab %s\n",icmPdv(lut->outputChan, out)));
+        }
+
+    } else {
+
+        /* Convert from Effective to Native output space */
+        if (p->e_outSpace == icSigLabData && p->outSpace == icSigXYZData) {
+            icmLab2XYZ(&p->pcswht, out, out);
+            DBLLL(("icm inv_out_abs: after Lab2XYZ %s\n",icmPdv(lut->outputChan, out)));
+        } else if (p->e_outSpace == icSigXYZData && p->outSpace == icSigLabData) {
+            icmXYZ2Lab(&p->pcswht, out, out);
+            DBLLL(("icm inv_out_abs: after XYZ2Lab %s\n",icmPdv(lut->outputChan, out)));
+        }
+    }
+    return rv;
+}
+
+
+/* Do output->output' inverse lookup */
+static int 
+icmLuLut_inv_output(icmLuLut *p, double *out, double *in) 
+{
+    icc *icp = p->icp;
+    icmLut *lut = p->lut;
+    int i;
+    int rv = 0;
+
+    if (lut->rot[0].inited == 0) {    
+        for (i = 0; i < lut->outputChan; i++) {
+            rv = icmTable_setup_bwd(icp, &lut->rot[i], lut->outputEnt,
+                                         lut->outputTable + i * lut->outputEnt);
+            if (rv != 0) {
+                sprintf(icp->err,"icc_Lut_inv_input: Malloc failure in inverse lookup init.");
+                return icp->errc = rv;
+            }
+        }
+    }
+
+    p->out_normf(out,in);                        /* Normalize from output color space */
+    for (i = 0; i < lut->outputChan; i++) {
+        /* Reverse lookup though output tables */
+        rv |= icmTable_lookup_bwd(&lut->rot[i], &out[i], &out[i]);
+    }
+    p->out_denormf(out, out);                    /* De-normalize to output color space */
+    return rv;
+}
+
+
+/* No output' -> input inverse lookup. */
+/* This is non-trivial ! */
+/* Do input' -> input inverse lookup */
+static int 
+icmLuLut_inv_input(icmLuLut *p, double *out, double *in) 
+{
+    icc *icp = p->icp;
+    icmLut *lut = p->lut;
+    int i;
+    int rv = 0;
+
+    if (lut->rit[0].inited == 0) {    
+        for (i = 0; i < lut->inputChan; i++) {
+            rv = icmTable_setup_bwd(icp, &lut->rit[i], lut->inputEnt,
+                                         lut->inputTable + i * lut->inputEnt);
+            if (rv != 0) {
+                sprintf(icp->err,"icc_Lut_inv_input: Malloc failure in inverse lookup init.");
+                return icp->errc = rv;
+            }
+        }
+    }
+
+    p->in_normf(out, in);                         /* Normalize from input color space */
+    for (i = 0; i < lut->inputChan; i++) {
+        /* Reverse lookup though input tables */
+        rv |= icmTable_lookup_bwd(&lut->rit[i], &out[i], &out[i]);
+    }
+    p->in_denormf(out,out);                        /* De-normalize to input color space */
+    return rv;
+}
+
+
+/* Possible inverse matrix lookup */
+static int 
+icmLuLut_inv_matrix(icmLuLut *p, double *out, double *in)
+{
+    icc *icp = p->icp;
+    icmLut *lut = p->lut;
+    int rv = 0;
+
+    if (p->usematrix) {
+        double tt[3];
+        if (p->imx_valid == 0) {
+            if (icmInverse3x3(p->imx, lut->e) != 0) {    /* Compute inverse */
+                sprintf(icp->err,"icc_new_iccLuMatrix: Matrix wasn't invertable");
+                icp->errc = 2;
+                return 2;
+            }
+            p->imx_valid = 1;
+        }
+        /* Matrix multiply */
+        tt[0] = p->imx[0][0] * in[0] + p->imx[0][1] * in[1] + p->imx[0][2] * in[2];
+        tt[1] = p->imx[1][0] * in[0] + p->imx[1][1] * in[1] + p->imx[1][2] * in[2];
+        tt[2] = p->imx[2][0] * in[0] + p->imx[2][1] * in[1] + p->imx[2][2] * in[2];
+        out[0] = tt[0], out[1] = tt[1], out[2] = tt[2];
+    } else if (out != in) {
+        unsigned int i;
+        for (i = 0; i < lut->inputChan; i++)
+            out[i] = in[i];
+    }
+    return rv;
+}
+
+
+static int 
+icmLuLut_inv_in_abs(icmLuLut *p, double *out, double *in) 
+{
+    icmLut *lut = p->lut;
+    int rv = 0;
+
+    DBLLL(("icm inv_in_abs: input %s\n",icmPdv(lut->inputChan, in)));
+    if (out != in) {
+        unsigned int i;
+        for (i = 0; i < lut->inputChan; i++)        /* Don't alter input values */
+            out[i] = in[i];
+    }
+
+    /* If Bwd Lut, take care of Absolute color space, and */
+    /* convert from native to effective input space */
+    if ((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation)) {
+
+        if (p->inSpace == icSigLabData) {
+            icmLab2XYZ(&p->pcswht, out, out);
+            DBLLL(("icm inv_in_abs: after Lab2XYZ %s\n",icmPdv(lut->inputChan, out)));
+        }
+
+        /* Convert from Relative to Absolute colorimetric XYZ */
+        icmMulBy3x3(out, p->toAbs, out);
+        DBLLL(("icm inv_in_abs: after toAbs %s\n",icmPdv(lut->inputChan, out)));
+        
+        if (p->e_inSpace == icSigLabData) {
+            icmXYZ2Lab(&p->pcswht, out, out);
+            DBLLL(("icm inv_in_abs: after XYZ2Lab %s\n",icmPdv(lut->inputChan, out)));
+        }
+    } else {
+
+        /* Convert from Native to Effective input space */
+        if (p->inSpace == icSigLabData && p->e_inSpace == icSigXYZData) {
+            icmLab2XYZ(&p->pcswht, out, out);
+            DBLLL(("icm inv_in_abs: after Lab2XYZ %s\n",icmPdv(lut->inputChan, out)));
+        } else if (p->inSpace == icSigXYZData && p->e_inSpace == icSigLabData) {
+            icmXYZ2Lab(&p->pcswht, out, out);
+            DBLLL(("icm inv_in_abs: after XYZ2Lab %s\n",icmPdv(lut->inputChan, out)));
+        }
+    }
+    DBLLL(("icm inv_in_abs: returning %s\n",icmPdv(lut->inputChan, out)));
+    return rv;
+}
+
+
+/* Return LuLut information */
+static void 
+icmLuLut_get_info(
+    icmLuLut     *p,          /* this */
+    icmLut       **lutp,      /* Pointer to icc lut type */
+    icmXYZNumber *pcswhtp,    /* Pointer to profile PCS white point */
+    icmXYZNumber *whitep,     /* Pointer to profile absolute white point */
+    icmXYZNumber *blackp      /* Pointer to profile absolute black point */
+) 
+{
+    if (lutp != NULL)
+        *lutp = p->lut;
+    if (pcswhtp != NULL)
+        *pcswhtp = p->pcswht;
+    if (whitep != NULL)
+        *whitep = p->whitePoint;
+    if (blackp != NULL)
+        *blackp = p->blackPoint;
+}
+
+
+/* Get the native ranges for the LuLut */
+/* This is computed differently to the mono & matrix types, to */
+/* accurately take into account the different range for 8 bit Lab */
+/* lut type. The range returned for the effective PCS is not so accurate. */
+static void
+icmLuLut_get_lutranges (
+    struct _icmLuBase *pp,
+    double *inmin, double *inmax,        /* Return maximum range of inspace values */
+    double *outmin, double *outmax       /* Return maximum range of outspace values */
+) 
+{
+    icmLuLut *p = (icmLuLut *)pp;
+    unsigned int i;
+
+    for (i = 0; i < p->lut->inputChan; i++) {
+        inmin[i] = 0.0;    /* Normalized range of input space values */
+        inmax[i] = 1.0;
+    }
+    p->in_denormf(inmin,inmin);    /* Convert to real colorspace range */
+    p->in_denormf(inmax,inmax);
+
+    /* Make sure min and max are so. */
+    for (i = 0; i < p->lut->inputChan; i++) {
+        if (inmin[i] > inmax[i]) {
+            double tt;
+            tt = inmin[i];
+            inmin[i] = inmax[i];
+            inmax[i] = tt;
+        }
+    }
+
+    for (i = 0; i < p->lut->outputChan; i++) {
+        outmin[i] = 0.0;    /* Normalized range of output space values */
+        outmax[i] = 1.0;
+    }
+    p->out_denormf(outmin,outmin);    /* Convert to real colorspace range */
+    p->out_denormf(outmax,outmax);
+
+    /* Make sure min and max are so. */
+    for (i = 0; i < p->lut->outputChan; i++) {
+        if (outmin[i] > outmax[i]) {
+            double tt;
+            tt = outmin[i];
+            outmin[i] = outmax[i];
+            outmax[i] = tt;
+        }
+    }
+}
+
+/* Get the effective (externaly visible) ranges for the LuLut */
+/* This will be accurate if there is no override, but only */
+/* aproximate if a PCS override is in place. */
+static void
+icmLuLut_get_ranges (
+    struct _icmLuBase *pp,
+    double *inmin, double *inmax,        /* Return maximum range of inspace values */
+    double *outmin, double *outmax       /* Return maximum range of outspace values */
+) 
+{
+    icmLuLut *p = (icmLuLut *)pp;
+
+    /* Get the native ranges first */
+    icmLuLut_get_lutranges(pp, inmin, inmax, outmin, outmax);
+
+    /* And replace them if the effective space is different */
+    if (p->e_inSpace != p->inSpace)
+        getRange(p->icp, p->e_inSpace, p->lut->ttype, inmin, inmax);
+
+    if (p->e_outSpace != p->outSpace)
+        getRange(p->icp, p->e_outSpace, p->lut->ttype, outmin, outmax);
+}
+
+/* Return the underlying Lut matrix */
+static void
+icmLuLut_get_matrix (
+    struct _icmLuLut *p,
+    double m[3][3]
+) {
+    int i, j;
+    icmLut *lut = p->lut;
+
+    if (p->usematrix) {
+        for (i = 0; i < 3; i++)
+            for (j = 0; j < 3; j++)
+                m[i][j] = lut->e[i][j];    /* Copy from Lut */
+
+    } else {                            /* return unity matrix */
+        icmSetUnity3x3(m);
+    }
+}
+
+/* Choose the clut interpolation */
+/* Return 0 on success, 2 on malloc failure */
+static int
+icmLuLut_set_interp (
+    struct _icmLuLut *p,
+    icmClutInterp interp
+) {
+    icmLut *lut = p->lut;
+    int rv;
+
+    switch (interp) {
+        case icmInterpLinear:
+            p->lookup_clut = lut->lookup_clut_nl;
+            break;
+        case icmInterpSimplex:
+            p->lookup_clut = lut->lookup_clut_sx;
+            break;
+        case icmInterpOSimplex:
+            /* Build the orientation table now, so that lookup() is thread safe */
+            if ((rv = lut->build_osx(lut)) != 0)
+                return rv;
+            p->lookup_clut = lut->lookup_clut_osx;
+            break;
+        default:
+            p->lookup_clut = p->dflt_lookup_clut;
+            break;
+    }
+    return 0;
+}
+
+
+static void
+icmLuLut_delete( icmLuBase *p) 
+{
+    icc *icp = p->icp;
+
+    icmLu_end_trace(p);
+    icp->al->free(icp->al, p);
+    ICM_ATOMIC_SUB(icp->nlu, 1);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - */
+/* V4 lutAtoB/lutBtoA Multi-Dimensional Interpolation type conversion */
+/* The B, M and A curves, matrix and clut of the tag are compiled into */
+/* a list of stages, dropping any that have no effect, so that */
+/* the lookup only does the work that the tag needs. */
+/* Return 0 on success, 1 if clipping occured, 2 on other error */
+
+/* Return nz if the curve is unity over 0.0 .. 1.0 */
+static int icmLuLutAB_unity_curve(icmCurve *cv, int lin) {
+
+    if (cv->flag == icmCurveLin)
+        return 1;
+    if (lin)            /* Has to be unity over all values */
+        return 0;
+    if (cv->flag == icmCurveGamma)
+        return cv->data[0] == 1.0;
+    if (cv->flag == icmCurvePara)
+        return cv->ctype == icCurveFunction1 && cv->data[0] == 1.0;
+    return cv->size == 2 && cv->data[0] == 0.0 && cv->data[1] == 1.0;
+}
+
+/* Add a curves stage to the pipeline, unless all the curves are unity. */
+/* If clip is nz, the following stage clips its input to 0.0 .. 1.0 */
+static void icmLuLutAB_add_curves(icmLuLutAB *p, icmCurve **cv, unsigned int n, int clip) {
+    icmLuABStage *st = &p->stage[p->nstages];
+    unsigned int i;
+    int nu = 0;
+
+    for (i = 0; i < n; i++) {
+        if (icmLuLutAB_unity_curve(cv[i], !clip)) {
+            st->cv[i] = NULL;
+        } else {
+            st->cv[i] = cv[i];
+            nu++;
+        }
+    }
+    if (nu > 0) {
+        st->op = icmLuABCurves;
+        st->n = n;
+        p->nstages++;
+    }
+}
+
+/* Add the matrix stage to the pipeline, unless it is unity */
+static void icmLuLutAB_add_matrix(icmLuLutAB *p) {
+    icmLutAB *lut = p->lut;
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        if (lut->off[i] != 0.0)
+            break;
+        for (j = 0; j < 3; j++) {
+            if (lut->e[i][j] != (i == j ? 1.0 : 0.0))
+                break;
+        }
+        if (j < 3)
+            break;
+    }
+    if (i < 3) {
+        p->stage[p->nstages].op = icmLuABMatrix;
+        p->stage[p->nstages].n = 3;
+        p->nstages++;
+    }
+}
+
+/* Compile the Lut elements into the list of stages */
+static void icmLuLutAB_compile(icmLuLutAB *p) {
+    icmLutAB *lut = p->lut;
+
+    p->nstages = 0;
+    if (lut->ttype == icSigLutBtoAType) {
+        icmLuLutAB_add_curves(p, lut->bCurves, lut->inputChan, !lut->mmatrix && lut->aclut);
+        if (lut->mmatrix) {
+            icmLuLutAB_add_matrix(p);
+            icmLuLutAB_add_curves(p, lut->mCurves, 3, lut->aclut);
+        }
+        if (lut->aclut) {
+            p->stage[p->nstages].op = icmLuABClut;
+            p->stage[p->nstages].n = lut->outputChan;
+            p->nstages++;
+            icmLuLutAB_add_curves(p, lut->aCurves, lut->outputChan, 0);
+        }
+    } else {
+        if (lut->aclut) {
+            icmLuLutAB_add_curves(p, lut->aCurves, lut->inputChan, 1);
+            p->stage[p->nstages].op = icmLuABClut;
+            p->stage[p->nstages].n = lut->outputChan;
+            p->nstages++;
+        }
+        if (lut->mmatrix) {
+            icmLuLutAB_add_curves(p, lut->mCurves, 3, 0);
+            icmLuLutAB_add_matrix(p);
+        }
+        icmLuLutAB_add_curves(p, lut->bCurves, lut->outputChan, 0);
+    }
+
+    /* lookup_in() and lookup_out() can only do per channel curves, */
+    /* and only if there is no absolute or PCS conversion on that side. */
+    p->istages = 0;
+    if (p->nstages > 0 && p->stage[0].op == icmLuABCurves
+     && !(((p->function == icmBwd || p->function == icmGamut || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation))
+     || (p->e_inSpace != p->inSpace)))
+        p->istages = 1;
+
+    p->ostages = 0;
+    if (p->nstages > p->istages && p->stage[p->nstages-1].op == icmLuABCurves
+     && !(((p->function == icmFwd || p->function == icmPreview)
+        && (p->intent == icAbsoluteColorimetric
+         || p->intent == icmAbsolutePerceptual
+         || p->intent == icmAbsoluteSaturation))
+     || (p->outSpace != p->e_outSpace)))
+        p->ostages = 1;
+}
+
+/* Run stages s to e-1 in place on normalized values */
+static int icmLuLutAB_stages(icmLuLutAB *p, int s, int e, double *vals) {
+    icmLutAB *lut = p->lut;
+    int rv = 0;
+
+    for (; s < e; s++) {
+        icmLuABStage *st = &p->stage[s];
+        unsigned int i;
+
+        switch (st->op) {
+            case icmLuABCurves:
+                for (i = 0; i < st->n; i++) {
+                    if (st->cv[i] != NULL)
+                        rv |= st->cv[i]->lookup_fwd(st->cv[i], &vals[i], &vals[i]);
+                }
+                break;
+            case icmLuABMatrix:
+                rv |= lut->lookup_matrix(lut, vals, vals);
+                break;
+            case icmLuABClut:
+                rv |= p->lookup_clut(lut, vals, vals);
+                break;
+        }
+    }
+    return rv;
+}
+
+static int icmLuLutAB_in_abs(icmLuLutAB *p, double *out, double *in) {
+    return icmLuLut_in_abs_n((icmLuBase *)p, p->lut->inputChan, out, in);
+}
+
+static int icmLuLutAB_out_abs(icmLuLutAB *p, double *out, double *in) {
+    return icmLuLut_out_abs_n((icmLuBase *)p, p->lut->outputChan, out, in);
+}
+
+/* Overall lookup */
+static int
+icmLuLutAB_lookup (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuLutAB *p = (icmLuLutAB *)pp;
+    icmLutAB *lut = p->lut;
+    double temp[MAX_CHAN];
+    unsigned int i;
+
+    if (p->inmxv) {                                /* in_abs and normalize in one */
+        if (p->e_inSpace == icSigLabData)
+            icmLab2XYZ(&p->pcswht, temp, in);
+        else
+            icmCpy3(temp, in);
+        icmMulBy3x3(temp, p->inmx, temp);
+    } else {
+        rv |= p->in_abs(p,temp,in);                /* Possible absolute conversion */
+        p->in_normf(temp, temp);                /* Normalize for input color space */
+    }
+    rv |= icmLuLutAB_stages(p, 0, p->nstages, temp);
+    for (i = 0; i < lut->outputChan; i++)
+        out[i] = temp[i];
+    if (p->outmxv) {                            /* Denormalize and out_abs in one */
+        icmMulBy3x3(out, p->outmx, out);
+        if (p->e_outSpace == icSigLabData)
+            icmXYZ2Lab(&p->pcswht, out, out);
+    } else {
+        p->out_denormf(out,out);                /* Normalize for output color space */
+        rv |= p->out_abs(p,out,out);            /* Possible absolute conversion */
+    }
+
+    return rv;
+}
+
+/* Three stage conversion */
+static int
+icmLuLutAB_lookup_in (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuLutAB *p = (icmLuLutAB *)pp;
+
+    if (p->istages == 0) {
+        unsigned int i;
+        for (i = 0; i < p->lut->inputChan; i++)
+            out[i] = in[i];
+    } else {
+        p->in_normf(out, in);
+        rv |= icmLuLutAB_stages(p, 0, p->istages, out);
+        p->in_denormf(out, out);
+    }
+    return rv;
+}
+
+static int
+icmLuLutAB_lookup_core (
+icmLuBase *pp,        /* This */
+double *out,        /* Vector of output values */
+double *in            /* Vector of input values */
+) {
+    int rv = 0;
+    icmLuLutAB *p = (icmLuLutAB *)pp;
+    icmLutAB *lut = p->lut;
+    double temp[MAX_CHAN];
+    unsigned int i;
+
+    if (p->istages == 0) {
+        rv |= p->in_abs(p,temp,in);
+        p->in_normf(temp, temp);
+    } else {
+        p->in_normf(temp, in);
+    }
+    rv |= icmLuLutAB_stages(p, p->istages, p->nstages - p->ostages, temp);
+    for (i = 0; i < lut->outputChan; i++)
+        out[i] = temp[i];
+    p->out_denormf(out,out);
+    if (p->ostages == 0)
+        rv |= p->out_abs(p,out,out);
+
+    return rv;
+}
+
+static int
+icmLuLutAB_lookup_out (
+    icmLuBase *pp,        /* This */
+    double *out,          /* Vector of output values */
+    double *in            /* Vector of input values */
+)
+{
+    int rv = 0;
+    icmLuLutAB *p = (icmLuLutAB *)pp;
+
+    if (p->ostages == 0) {
+        unsigned int i;
+        for (i = 0; i < p->lut->outputChan; i++)
+            out[i] = in[i];
+    } else {
+        p->out_normf(out, in);
+        rv |= icmLuLutAB_stages(p, p->nstages - p->ostages, p->nstages, out);
+        p->out_denormf(out, out);
+    }
+    return rv;
+}
+
+/* Inverse three stage conversion */
+static int
+icmLuLutAB_lookup_inv_in (
+    icmLuBase *pp,        /* This */
+    double *out,          /* Vector of output values */
+    double *in            /* Vector of input values */
+) 
+{
+    int rv = 0;
+    icmLuLutAB *p = (icmLuLutAB *)pp;
+    unsigned int i;
+
+    if (p->istages == 0) {
+        for (i = 0; i < p->lut->inputChan; i++)
+            out[i] = in[i];
+    } else {
+        icmLuABStage *st = &p->stage[0];
+
+        p->in_normf(out, in);
+        for (i = 0; i < st->n; i++) {
+            if (st->cv[i] != NULL)
+                rv |= st->cv[i]->lookup_bwd(st->cv[i], &out[i], &out[i]);
+        }
+        p->in_denormf(out, out);
+    }
+    return rv;
+}
+
+/* Return LuLutAB information */
+static void 
+icmLuLutAB_get_info(
+    icmLuLutAB   *p,          /* this */
+    icmLutAB     **lutp,      /* Pointer to icc lut type */
+    icmXYZNumber *pcswhtp,    /* Pointer to profile PCS white point */
+    icmXYZNumber *whitep,     /* Pointer to profile absolute white point */
+    icmXYZNumber *blackp      /* Pointer to profile absolute black point */
+) 
+{
+    if (lutp != NULL)
+        *lutp = p->lut;
+    if (pcswhtp != NULL)
+        *pcswhtp = p->pcswht;
+    if (whitep != NULL)
+        *whitep = p->whitePoint;
+    if (blackp != NULL)
+        *blackp = p->blackPoint;
+}
+
+/* Get the native ranges for the LuLutAB */
+static void
+icmLuLutAB_get_lutranges (
+    struct _icmLuBase *pp,
+    double *inmin, double *inmax,        /* Return maximum range of inspace values */
+    double *outmin, double *outmax       /* Return maximum range of outspace values */
+) 
+{
+    icmLuLutAB *p = (icmLuLutAB *)pp;
+    unsigned int i;
+
+    for (i = 0; i < p->lut->inputChan; i++) {
+        inmin[i] = 0.0;    /* Normalized range of input space values */
+        inmax[i] = 1.0;
+    }
+    p->in_denormf(inmin,inmin);    /* Convert to real colorspace range */
+    p->in_denormf(inmax,inmax);
+
+    /* Make sure min and max are so. */
+    for (i = 0; i < p->lut->inputChan; i++) {
+        if (inmin[i] > inmax[i]) {
+            double tt;
+            tt = inmin[i];
+            inmin[i] = inmax[i];
+            inmax[i] = tt;
+        }
+    }
+
+    for (i = 0; i < p->lut->outputChan; i++) {
+        outmin[i] = 0.0;    /* Normalized range of output space values */
+        outmax[i] = 1.0;
+    }
+    p->out_denormf(outmin,outmin);    /* Convert to real colorspace range */
+    p->out_denormf(outmax,outmax);
+
+    /* Make sure min and max are so. */
+    for (i = 0; i < p->lut->outputChan; i++) {
+        if (outmin[i] > outmax[i]) {
+            double tt;
+            tt = outmin[i];
+            outmin[i] = outmax[i];
+            outmax[i] = tt;
+        }
+    }
+}
+
+/* Get the effective (externaly visible) ranges for the LuLutAB */
+static void
+icmLuLutAB_get_ranges (
+    struct _icmLuBase *pp,
+    double *inmin, double *inmax,        /* Return maximum range of inspace values */
+    double *outmin, double *outmax       /* Return maximum range of outspace values */
+) 
+{
+    icmLuLutAB *p = (icmLuLutAB *)pp;
+
+    /* Get the native ranges first */
+    icmLuLutAB_get_lutranges(pp, inmin, inmax, outmin, outmax);
+
+    /* And replace them if the effective space is different */
+    if (p->e_inSpace != p->inSpace)
+        getRange(p->icp, p->e_inSpace, p->lut->ttype, inmin, inmax);
+
+    if (p->e_outSpace != p->outSpace)
+        getRange(p->icp, p->e_outSpace, p->lut->ttype, outmin, outmax);
+}
+
+static void
+icmLuLutAB_delete( icmLuBase *p) 
+{
+    icc *icp = p->icp;
+
+    icmLu_end_trace(p);
+    icp->al->free(icp->al, p);
+    ICM_ATOMIC_SUB(icp->nlu, 1);
+}
+
+/* Create a lookup for a lutAtoB or lutBtoA tag. */
+/* Called by icc_new_icmLuLut() when the tag is a V4 Lut */
+static icmLuBase *
+icc_new_icmLuLutAB(
+    icc                   *icp,
+    icmLutAB              *lut,            /* Target Lut */
+    icColorSpaceSignature inSpace,         /* Native Input color space */
+    icColorSpaceSignature outSpace,        /* Native Output color space */
+    icColorSpaceSignature pcs,             /* Native PCS (from header) */
+    icColorSpaceSignature e_inSpace,       /* Effective Input color space */
+    icColorSpaceSignature e_outSpace,      /* Effective Output color space */
+    icColorSpaceSignature e_pcs,           /* Effective PCS */
+    icRenderingIntent     intent,          /* Rendering intent (For absolute) */
+    icmLookupFunc         func             /* Functionality requested (for icmLuSpaces()) */
+) 
+{
+    icmLuLutAB *p;
+
+    if ((p = (icmLuLutAB *) icp->al->calloc(icp->al,1,sizeof(icmLuLutAB))) == NULL)
+        return NULL;
+    ICM_ATOMIC_ADD(icp->nlu, 1);
+    p->ttype    = icmLutABType;
+    p->icp      = icp;
+    p->del      = icmLuLutAB_delete;
+    p->lutspaces= icmLutSpaces;
+    p->spaces   = icmLuSpaces;
+    p->XYZ_Rel2Abs = icmLuXYZ_Rel2Abs;
+    p->XYZ_Abs2Rel = icmLuXYZ_Abs2Rel;
+    p->init_wh_bk  = icmLuInit_Wh_bk;
+    p->set_trace = icmLu_set_trace;
+    p->get_stats = icmLu_get_stats;
+    p->reset_stats = icmLu_reset_stats;
+    p->wh_bk_points = icmLuWh_bk_points;
+    p->lu_wh_bk_points = icmLuLu_wh_bk_points;
+
+    p->lookup        = icmLuLutAB_lookup;
+    p->lookup_in     = icmLuLutAB_lookup_in;
+    p->lookup_core   = icmLuLutAB_lookup_core;
+    p->lookup_out    = icmLuLutAB_lookup_out;
+    p->lookup_inv_in = icmLuLutAB_lookup_inv_in;
+
+    p->in_abs   = icmLuLutAB_in_abs;
+    p->out_abs  = icmLuLutAB_out_abs;
+
+    p->pcswht   = icp->header->illuminant;
+    p->intent   = intent;            /* used to trigger absolute processing */
+    p->function = func;
+    p->inSpace  = inSpace;
+    p->outSpace = outSpace;
+    p->pcs      = pcs;
+    p->e_inSpace  = e_inSpace;
+    p->e_outSpace = e_outSpace;
+    p->e_pcs      = e_pcs;
+    p->get_info = icmLuLutAB_get_info;
+    p->get_lutranges = icmLuLutAB_get_lutranges;
+    p->get_ranges = icmLuLutAB_get_ranges;
+    p->lut = lut;
+
+    /* Lookup the white and black points */
+    if (p->init_wh_bk((icmLuBase *)p)) {
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Lookup the color space normalizing and de-normalizing functions */
+    if (getNormFunc(icp, inSpace, lut->ttype, icmToLuti, &p->in_normf)
+     || getNormFunc(icp, inSpace, lut->ttype, icmFromLuti, &p->in_denormf)
+     || getNormFunc(icp, outSpace, lut->ttype, icmToLutv, &p->out_normf)
+     || getNormFunc(icp, outSpace, lut->ttype, icmFromLutv, &p->out_denormf)) {
+        sprintf(icp->err,"icc_get_luobj: Unknown colorspace");
+        icp->errc = 1;
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Fold the XYZ PCS absolute conversions into matrices */
+    p->inmxv = icmLu_fold_in((icmLuBase *)p, NULL, p->in_normf, p->inmx) == 0;
+    p->outmxv = icmLu_fold_out((icmLuBase *)p, p->out_denormf, p->outmx) == 0;
+
+    /* Determine appropriate clut lookup algorithm. */
+    /* Simplex interpolation suits "Device" like input spaces, */
+    /* where luminance varies most strongly along the diagonal. */
+    {
+        icColorSpaceSignature ins;
+
+        p->lutspaces((icmLuBase *)p, &ins, NULL, NULL, NULL, NULL);
+        switch(ins) {
+            case icSigXYZData:
+            case icSigRgbData:
+            case icSigGrayData:
+            case icSigCmykData:
+            case icSigCmyData:
+            case icSigMch6Data:
+                p->lookup_clut = lut->lookup_clut_sx;
+                break;
+            default:
+                p->lookup_clut = lut->lookup_clut_nl;
+                break;
+        }
+    }
+
+    icmLuLutAB_compile(p);
+
+    return (icmLuBase *)p;
+}
+
+
+icmLuBase *
+icc_new_icmLuLut(
+    icc                   *icp,
+    icTagSignature        ttag,            /* Target Lut tag */
+    icColorSpaceSignature inSpace,         /* Native Input color space */
+    icColorSpaceSignature outSpace,        /* Native Output color space */
+    icColorSpaceSignature pcs,             /* Native PCS (from header) */
+    icColorSpaceSignature e_inSpace,       /* Effective Input color space */
+    icColorSpaceSignature e_outSpace,      /* Effective Output color space */
+    icColorSpaceSignature e_pcs,           /* Effective PCS */
+    icRenderingIntent     intent,          /* Rendering intent (For absolute) */
+    icmLookupFunc         func             /* Functionality requested (for icmLuSpaces()) */
+) 
+{
+    icmLuLut *p;
+
+    icmBase *tag;
+
+    /* V4 lutAtoB and lutBtoA tags have their own lookup */
+    if ((tag = icp->read_tag(icp, ttag)) != NULL
+     && (tag->ttype == icSigLutAtoBType || tag->ttype == icSigLutBtoAType))
+        return icc_new_icmLuLutAB(icp, (icmLutAB *)tag, inSpace, outSpace, pcs,
+                                  e_inSpace, e_outSpace, e_pcs, intent, func);
+
+    if ((p = (icmLuLut *) icp->al->calloc(icp->al,1,sizeof(icmLuLut))) == NULL)
+        return NULL;
+    ICM_ATOMIC_ADD(icp->nlu, 1);
+    p->ttype    = icmLutType;
+    p->icp      = icp;
+    p->del      = icmLuLut_delete;
+    p->lutspaces= icmLutSpaces;
+    p->spaces   = icmLuSpaces;
+    p->XYZ_Rel2Abs = icmLuXYZ_Rel2Abs;
+    p->XYZ_Abs2Rel = icmLuXYZ_Abs2Rel;
+    p->init_wh_bk  = icmLuInit_Wh_bk;
+    p->set_trace = icmLu_set_trace;
+    p->get_stats = icmLu_get_stats;
+    p->reset_stats = icmLu_reset_stats;
+    p->wh_bk_points = icmLuWh_bk_points;
+    p->lu_wh_bk_points = icmLuLu_wh_bk_points;
+
+    p->lookup        = icmLuLut_lookup;
+    p->lookup_in     = icmLuLut_lookup_in;
+    p->lookup_core   = icmLuLut_lookup_core;
+    p->lookup_out    = icmLuLut_lookup_out;
+    p->lookup_inv_in = icmLuLut_lookup_inv_in;
+
+    p->in_abs   = icmLuLut_in_abs;
+    p->matrix   = icmLuLut_matrix;
+    p->input    = icmLuLut_input;
+    p->clut     = icmLuLut_clut;
+    p->output   = icmLuLut_output;
+    p->out_abs  = icmLuLut_out_abs;
+
+    p->inv_in_abs   = icmLuLut_inv_in_abs;
+    p->inv_matrix   = icmLuLut_inv_matrix;
+    p->inv_input    = icmLuLut_inv_input;
+    p->inv_output   = icmLuLut_inv_output;
+    p->inv_out_abs  = icmLuLut_inv_out_abs;
+
+    p->pcswht   = icp->header->illuminant;
+    p->intent   = intent;            /* used to trigger absolute processing */
+    p->function = func;
+    p->inSpace  = inSpace;
+    p->outSpace = outSpace;
+    p->pcs      = pcs;
+    p->e_inSpace  = e_inSpace;
+    p->e_outSpace = e_outSpace;
+    p->e_pcs      = e_pcs;
+    p->get_info = icmLuLut_get_info;
+    p->get_lutranges = icmLuLut_get_lutranges;
+    p->get_ranges = icmLuLut_get_ranges;
+    p->get_matrix = icmLuLut_get_matrix;
+    p->set_interp = icmLuLut_set_interp;
+
+    /* Lookup the white and black points */
+    if (p->init_wh_bk((icmLuBase *)p)) {
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Get the Lut tag, & check that it is expected type */
+    if ((p->lut = (icmLut *)icp->read_tag(icp, ttag)) == NULL
+     || (p->lut->ttype != icSigLut8Type && p->lut->ttype != icSigLut16Type)) {
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Check if matrix should be used */
+    if (inSpace == icSigXYZData && p->lut->nu_matrix(p->lut))
+        p->usematrix = 1;
+    else
+        p->usematrix = 0;
+
+    /* Lookup input color space to normalized index function */
+    if (getNormFunc(icp, inSpace, p->lut->ttype, icmToLuti, &p->in_normf)) {
+        sprintf(icp->err,"icc_get_luobj: Unknown colorspace");
+        icp->errc = 1;
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Lookup normalized index to input color space function */
+    if (getNormFunc(icp, inSpace, p->lut->ttype, icmFromLuti, &p->in_denormf)) {
+        sprintf(icp->err,"icc_get_luobj: Unknown colorspace");
+        icp->errc = 1;
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Lookup output color space to normalized Lut entry value function */
+    if (getNormFunc(icp, outSpace, p->lut->ttype, icmToLutv, &p->out_normf)) {
+        sprintf(icp->err,"icc_get_luobj: Unknown colorspace");
+        icp->errc = 1;
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Lookup normalized Lut entry value to output color space function */
+    if (getNormFunc(icp, outSpace, p->lut->ttype, icmFromLutv, &p->out_denormf)) {
+        sprintf(icp->err,"icc_get_luobj: Unknown colorspace");
+        icp->errc = 1;
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Fold the XYZ PCS absolute conversions into matrices */
+    p->inmxv = icmLu_fold_in((icmLuBase *)p, p->usematrix ? p->lut->e : NULL,
+                             p->in_normf, p->inmx) == 0;
+    p->outmxv = icmLu_fold_out((icmLuBase *)p, p->out_denormf, p->outmx) == 0;
+
+    /* Note that the following two are only used in computing the expected */
+    /* value ranges of the effective PCS. This might not be the best way of */
+    /* doing this. */
+    /* Lookup normalized index to effective input color space function */
+    if (getNormFunc(icp, e_inSpace, p->lut->ttype, icmFromLuti, &p->e_in_denormf)) {
+        sprintf(icp->err,"icc_get_luobj: Unknown effective colorspace");
+        icp->errc = 1;
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Lookup normalized Lut entry value to effective output color space function */
+    if (getNormFunc(icp, e_outSpace, p->lut->ttype, icmFromLutv, &p->e_out_denormf)) {
+        sprintf(icp->err,"icc_get_luobj: Unknown effective colorspace");
+        icp->errc = 1;
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    /* Determine appropriate clut lookup algorithm */
+    {
+        int use_sx;                /* -1 = undecided, 0 = N-linear, 1 = Simplex lookup */
+        icColorSpaceSignature ins, outs;    /* In and out Lut color spaces */
+        int inn, outn;        /* in and out number of Lut components */
+
+        p->lutspaces((icmLuBase *)p, &ins, &inn, &outs, &outn, NULL);
+
+        /* Determine if the input space is "Device" like, */
+        /* ie. luminance will be expected to vary most strongly */
+        /* with the diagonal change in input coordinates. */
+        switch(ins) {
+
+            /* Luminence is carried by the sum of all the output channels, */
+            /* so output luminence will dominantly be in diagonal direction. */
+            case icSigXYZData:        /* This seems to be appropriate ? */
+            case icSigRgbData:
+            case icSigGrayData:
+            case icSigCmykData:
+            case icSigCmyData:
+            case icSigMch6Data:
+                use_sx = 1;        /* Simplex interpolation is appropriate */
+                break;
+
+            /* A single channel carries the luminence information */
+            case icSigLabData:
+            case icSigLuvData:
+            case icSigYCbCrData:
+            case icSigYxyData:
+            case icSigHlsData:
+            case icSigHsvData:
+                use_sx = 0;        /* N-linear interpolation is appropriate */
+                break;
+            default:
+                use_sx = -1;        /* undecided */
+                    break;
+        }
+
+        /* If we couldn't figure it out from the input space, */
+        /* check output luminance variation with a diagonal input */
+        /* change. */
+        if (use_sx == -1) {
+            int lc;        /* Luminance channel */
+
+            /* Determine where the luminence is carried in the output */
+            switch(outs) {
+
+                /* Luminence is carried by the sum of all the output channels */
+                case icSigRgbData:
+                case icSigGrayData:
+                case icSigCmykData:
+                case icSigCmyData:
+                case icSigMch6Data:
+                    lc = -1;        /* Average all channels */
+                    break;
+
+                /* A single channel carries the luminence information */
+                case icSigLabData:
+                case icSigLuvData:
+                case icSigYCbCrData:
+                case icSigYxyData:
+                    lc = 0;
+                    break;
+
+                case icSigXYZData:
+                case icSigHlsData:
+                    lc = 1;
+                    break;
+
+                case icSigHsvData:
+                    lc = 2;
+                    break;
+                
+                /* default means give up and use N-linear type lookup */
+                default:
+                    lc = -2;
+                    break;
+            }
+
+            /* If we know how luminance is represented in output space */
+            if (lc != -2) {
+                double tout1[MAX_CHAN];        /* Test output values */
+                double tout2[MAX_CHAN];
+                double tt, diag;
+                int n;
+
+                /* Determine input space location of min and max of */
+                /* given output channel (chan = -1 means average of all) */
+                p->lut->min_max(p->lut, tout1, tout2, lc);
+                
+                /* Convert to vector and then calculate normalized */
+                /* dot product with diagonal vector (1,1,1...) */
+                for (tt = 0.0, n = 0; n < inn; n++) {
+                    tout1[n] = tout2[n] - tout1[n];
+                    tt += tout1[n] * tout1[n];
+                }
+                if (tt > 0.0)
+                    tt = sqrt(tt);            /* normalizing factor for maximum delta */
+                else
+                    tt = 1.0;                /* Hmm. */
+                tt *= sqrt((double)inn);    /* Normalizing factor for diagonal vector */
+                for (diag = 0.0, n = 0; n < outn; n++)
+                    diag += tout1[n] / tt;
+                diag = fabs(diag);
+
+                /* I'm not really convinced that this is a reliable */
+                /* indicator of whether simplex interpolation should be used ... */
+                /* It does seem to do the right thing with YCC space though. */
+                if (diag > 0.8)    /* Diagonal is dominant ? */
+                    use_sx = 1;
+
+                /* If we couldn't figure it out, use N-linear interpolation */
+                if (use_sx == -1)
+                    use_sx = 0;
+            }
+        }
+
+        if (use_sx) {
+            p->lookup_clut = p->lut->lookup_clut_sx;
+        } else {
+            p->lookup_clut = p->lut->lookup_clut_nl;
+        }
+        p->dflt_lookup_clut = p->lookup_clut;
+    }
+
+    return (icmLuBase *)p;
+}
+
+
+/* ========================================================== */
+/* Named color lookup */
+
+/* Names are found using a hash table, and the closest color */
+/* lookups use k-d trees over the D50 relative Lab and device values. */
+/* The trees are implicit: the color order array is arranged so that the */
+/* median of each sub-range [s,e) is the node at (s+e)/2, with the split */
+/* axis recorded for it. */
+
+#define NAMED_MAXK 32        /* Closest color list size that doesn't need a malloc */
+
+/* FNV-1a hash of a name */
+static unsigned int icmLuNamed_hash(char *s) {
+    unsigned int h = 2166136261u;
+
+    for (; *s != '\000'; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Partition ix[s..e-1] so that ix[k] has the k'th smallest value of axis a */
+static void icmLuNamed_kd_select(double *pts, int di, int a, int *ix, int s, int e, int k) {
+
+    e--;
+    while (s < e) {
+        int i, j, tt;
+        double pv = pts[ix[(s + e)/2] * di + a];
+
+        for (i = s, j = e; i <= j;) {
+            while (pts[ix[i] * di + a] < pv)
+                i++;
+            while (pts[ix[j] * di + a] > pv)
+                j--;
+            if (i <= j) {
+                tt = ix[i]; ix[i] = ix[j]; ix[j] = tt;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j)
+            e = j;
+        else if (k >= i)
+            s = i;
+        else
+            break;
+    }
+}
+
+/* Build the k-d tree over ix[s..e-1] */
+static void icmLuNamed_kd_build(double *pts, int di, int *ix, char *ax, int s, int e) {
+    int i, a, m, ba = 0;
+    double bsp = -1.0;
+
+    if ((e - s) < 1)
+        return;
+
+    /* Split on the axis with the largest spread */
+    for (a = 0; a < di; a++) {
+        double mn, mx;
+        mn = mx = pts[ix[s] * di + a];
+        for (i = s+1; i < e; i++) {
+            double vv = pts[ix[i] * di + a];
+            if (vv < mn)
+                mn = vv;
+            if (vv > mx)
+                mx = vv;
+        }
+        if ((mx - mn) > bsp) {
+            bsp = mx - mn;
+            ba = a;
+        }
+    }
+
+    m = (s + e)/2;
+    icmLuNamed_kd_select(pts, di, ba, ix, s, e, m);
+    ax[m] = (char)ba;
+
+    icmLuNamed_kd_build(pts, di, ix, ax, s, m);
+    icmLuNamed_kd_build(pts, di, ix, ax, m+1, e);
+}
+
+/* State of a closest color search */
+typedef struct {
+    double *pts;            /* Points searched */
+    int di;                    /* Dimensionality */
+    int *ix;                /* Tree color order */
+    char *ax;                /* Tree split axis */
+    double *q;                /* Query point */
+    double w[MAX_CHAN];        /* Lower bound weight of each axis distance */
+    double (*de)(double *in0, double *in1);    /* Distance function */
+    int nk, k;                /* Number wanted, number in list */
+    double *kd;                /* Distance list, closest first */
+    int *ki;                /* Color index list */
+} icmLuNamedSearch;
+
+/* Euclidean distance in device space */
+static double icmLuNamed_devde(icmLuNamedSearch *sx, double *in0, double *in1) {
+    double rv = 0.0;
+    int e;
+
+    for (e = 0; e < sx->di; e++) {
+        double tt = in0[e] - in1[e];
+        rv += tt * tt;
+    }
+    return sqrt(rv);
+}
+
+/* Search the k-d tree over [s,e) */
+static void icmLuNamed_kd_search(icmLuNamedSearch *sx, int s, int e) {
+    int m, i, a, j;
+    double dd, diff;
+
+    if ((e - s) < 1)
+        return;
+
+    m = (s + e)/2;
+    i = sx->ix[m];
+    a = sx->ax[m];
+
+    if (sx->de != NULL)
+        dd = sx->de(sx->q, sx->pts + i * sx->di);
+    else
+        dd = icmLuNamed_devde(sx, sx->q, sx->pts + i * sx->di);
+
+    /* Insert into the sorted list of closest */
+    if (sx->k < sx->nk || dd < sx->kd[sx->k-1]) {
+        if (sx->k < sx->nk)
+            sx->k++;
+        for (j = sx->k-1; j > 0 && sx->kd[j-1] > dd; j--) {
+            sx->kd[j] = sx->kd[j-1];
+            sx->ki[j] = sx->ki[j-1];
+        }
+        sx->kd[j] = dd;
+        sx->ki[j] = i;
+    }
+
+    /* Search the near side, then the far side if it could be closer */
+    diff = sx->q[a] - sx->pts[i * sx->di + a];
+    if (diff < 0.0) {
+        icmLuNamed_kd_search(sx, s, m);
+        if (sx->k < sx->nk || (-diff * sx->w[a]) < sx->kd[sx->k-1])
+            icmLuNamed_kd_search(sx, m+1, e);
+    } else {
+        icmLuNamed_kd_search(sx, m+1, e);
+        if (sx->k < sx->nk || (diff * sx->w[a]) < sx->kd[sx->k-1])
+            icmLuNamed_kd_search(sx, s, m);
+    }
+}
+
+/* Run a closest color search and return the names */
+static int icmLuNamed_closest(icmLuNamed *p, icmLuNamedSearch *sx, char **out, int nout) {
+    icc *icp = p->icp;
+    double _kd[NAMED_MAXK];
+    int _ki[NAMED_MAXK];
+    int j;
+
+    if (nout <= 0)
+        return 0;
+
+    sx->nk = nout;
+    sx->k = 0;
+    if (nout > NAMED_MAXK) {
+        if ((sx->kd = (double *) icp->al->malloc(icp->al, nout * sizeof(double))) == NULL
+         || (sx->ki = (int *) icp->al->malloc(icp->al, nout * sizeof(int))) == NULL) {
+            if (sx->kd != NULL)
+                icp->al->free(icp->al, sx->kd);
+            sprintf(icp->err,"icmLuNamed_lookup: malloc() failed");
+            return icp->errc = 2;
+        }
+    } else {
+        sx->kd = _kd;
+        sx->ki = _ki;
+    }
+
+    icmLuNamed_kd_search(sx, 0, p->nc->count);
+
+    for (j = 0; j < nout; j++)
+        out[j] = j < sx->k ? p->nc->data[sx->ki[j]].root : NULL;
+
+    if (nout > NAMED_MAXK) {
+        icp->al->free(icp->al, sx->kd);
+        icp->al->free(icp->al, sx->ki);
+    }
+    return 0;
+}
+
+/* Convert an effective PCS value to D50 relative Lab */
+static void icmLuNamed_pcs2lab(icmLuNamed *p, double *out, double *in) {
+    double xyz[3];
+
+    if (p->e_pcs == icSigLabData)
+        icmLab2XYZ(&icmD50, xyz, in);
+    else
+        icmAry2Ary(xyz, in);
+    if (p->intent == icAbsoluteColorimetric
+     || p->intent == icmAbsolutePerceptual
+     || p->intent == icmAbsoluteSaturation)
+        icmMulBy3x3(xyz, p->fromAbs, xyz);
+    icmXYZ2Lab(&icmD50, out, xyz);
+}
+
+/* Convert a named color PCS value to the effective PCS */
+static void icmLuNamed_nc2pcs(icmLuNamed *p, double *out, double *in) {
+    double xyz[3];
+
+    if (p->pcs == icSigLabData)
+        icmLab2XYZ(&icmD50, xyz, in);
+    else
+        icmAry2Ary(xyz, in);
+    if (p->intent == icAbsoluteColorimetric
+     || p->intent == icmAbsolutePerceptual
+     || p->intent == icmAbsoluteSaturation)
+        icmMulBy3x3(xyz, p->toAbs, xyz);
+    if (p->e_pcs == icSigLabData)
+        icmXYZ2Lab(&icmD50, out, xyz);
+    else
+        icmAry2Ary(out, xyz);
+}
+
+static void
+icmLuNamed_get_info(
+    icmLuNamed   *p,            /* this */
+    icmXYZNumber *pcswhtp,        /* Return pointer to profile PCS white point */
+    icmXYZNumber *whitep,        /* Return pointer to media white point */
+    icmXYZNumber *blackp,        /* Return pointer to media black point */
+    int *maxnamesize,            /* Return maximum full name size, including nul */
+    int *num_colors,            /* Return number of named colors */
+    char *prefix,                /* Return prefix [32] */
+    char *suffix                /* Return suffix [32] */
+) {
+    if (pcswhtp != NULL)
+        *pcswhtp = p->pcswht;
+    if (whitep != NULL)
+        *whitep = p->whitePoint;
+    if (blackp != NULL)
+        *blackp = p->blackPoint;
+    if (maxnamesize != NULL) {
+        unsigned int i, ml = 0;
+        for (i = 0; i < p->nc->count; i++) {
+            if (strlen(p->nc->data[i].root) > ml)
+                ml = strlen(p->nc->data[i].root);
+        }
+        *maxnamesize = strlen(p->nc->prefix) + ml + strlen(p->nc->suffix) + 1;
+    }
+    if (num_colors != NULL)
+        *num_colors = p->nc->count;
+    if (prefix != NULL)
+        strcpy(prefix, p->nc->prefix);
+    if (suffix != NULL)
+        strcpy(suffix, p->nc->suffix);
+}
+
+static void icmLuNamed_set_metric(icmLuNamed *p, icmNamedMetric metric) {
+    p->metric = metric;
+}
+
+/* Lookup a name that doesn't include prefix and suffix */
+static int icmLuNamed_name_lookup(icmLuNamed *p, double *pcs, double *dev, char *in) {
+    icc *icp = p->icp;
+    int i;
+    unsigned int e;
+
+    for (i = p->hhead[icmLuNamed_hash(in) & (p->hsize-1)]; i >= 0; i = p->hnext[i]) {
+        if (strcmp(p->nc->data[i].root, in) == 0)
+            break;
+    }
+    if (i < 0) {
+        sprintf(icp->err,"icmLuNamed_lookup: Name '%.40s' not found",in);
+        return icp->errc = 2;
+    }
+
+    if (pcs != NULL) {
+        if (p->lab == NULL) {
+            sprintf(icp->err,"icmLuNamed_lookup: Named colors have no PCS values");
+            return icp->errc = 2;
+        }
+        icmLuNamed_nc2pcs(p, pcs, p->nc->data[i].pcsCoords);
+    }
+    if (dev != NULL) {
+        for (e = 0; e < p->nc->nDeviceCoords; e++)
+            dev[e] = p->nc->data[i].deviceCoords[e];
+    }
+    return 0;
+}
+
+/* Lookup a name that includes prefix and suffix */
+static int icmLuNamed_fullname_lookup(icmLuNamed *p, double *pcs, double *dev, char *in) {
+    icc *icp = p->icp;
+    size_t lp = strlen(p->nc->prefix), ls = strlen(p->nc->suffix), ln = strlen(in);
+    char root[32];
+
+    if (ln < (lp + ls)
+     || strncmp(in, p->nc->prefix, lp) != 0
+     || strcmp(in + ln - ls, p->nc->suffix) != 0
+     || (ln - lp - ls) >= sizeof(root)) {
+        sprintf(icp->err,"icmLuNamed_lookup: Name '%.40s' not found",in);
+        return icp->errc = 2;
+    }
+    memcpy(root, in + lp, ln - lp - ls);
+    root[ln - lp - ls] = '\000';
+
+    return icmLuNamed_name_lookup(p, pcs, dev, root);
+}
+
+/* Fill in a list with the nout closest named colors to the pcs target */
+static int icmLuNamed_pcs_lookup(icmLuNamed *p, char **out, int nout, double *in) {
+    icc *icp = p->icp;
+    icmLuNamedSearch sx;
+    double lab[3], S;
+
+    if (p->lab == NULL) {
+        sprintf(icp->err,"icmLuNamed_lookup: Named colors have no PCS values");
+        return icp->errc = 2;
+    }
+
+    icmLuNamed_pcs2lab(p, lab, in);
+
+    sx.pts = p->lab;
+    sx.di = 3;
+    sx.ix = p->pix;
+    sx.ax = p->pax;
+    sx.q = lab;
+
+    /* Choose the metric, and the per axis weights that make the */
+    /* weighted distance to a split plane a lower bound of it. */
+    switch (p->metric) {
+        default:
+        case icmNamedDE76:
+            sx.de = icmLabDE;
+            sx.w[0] = sx.w[1] = sx.w[2] = 1.0;
+            break;
+        case icmNamedDE94:
+            /* SH <= SC <= S for any color in the set */
+            sx.de = icmCIE94;
+            S = 1.0 + 0.048 * sqrt(sqrt(lab[1] * lab[1] + lab[2] * lab[2]) * p->cmax);
+            sx.w[0] = 1.0;
+            sx.w[1] = sx.w[2] = 1.0/S;
+            break;
+        case icmNamedDE2K:
+            /* SL <= 1.75, SH <= SC <= S, a' >= a, and the rotation term */
+            /* can reduce the chroma/hue contribution by at most 1 - sin(60). */
+            sx.de = icmCIE2K;
+            S = 1.0 + 0.045 * 0.75 * (sqrt(lab[1] * lab[1] + lab[2] * lab[2]) + p->cmax);
+            sx.w[0] = 1.0/1.75;
+            sx.w[1] = sx.w[2] = 0.366/S;
+            break;
+    }
+
+    return icmLuNamed_closest(p, &sx, out, nout);
+}
+
+/* Fill in a list with the nout closest named colors to the device target */
+static int icmLuNamed_dev_lookup(icmLuNamed *p, char **out, int nout, double *in) {
+    icmLuNamedSearch sx;
+    int e;
+
+    sx.pts = p->dev;
+    sx.di = p->nc->nDeviceCoords;
+    sx.ix = p->dix;
+    sx.ax = p->dax;
+    sx.q = in;
+    sx.de = NULL;
+    for (e = 0; e < MAX_CHAN; e++)
+        sx.w[e] = 1.0;
+
+    if (sx.di == 0) {
+        for (e = 0; e < nout; e++)
+            out[e] = NULL;
+        return 0;
+    }
+
+    return icmLuNamed_closest(p, &sx, out, nout);
+}
+
+static void
+icmLuNamed_delete(
+icmLuBase *pp
+) {
+    icmLuNamed *p = (icmLuNamed *)pp;
+    icc *icp = p->icp;
+
+    if (p->hhead != NULL)
+        icp->al->free(icp->al, p->hhead);
+    if (p->hnext != NULL)
+        icp->al->free(icp->al, p->hnext);
+    if (p->lab != NULL)
+        icp->al->free(icp->al, p->lab);
+    if (p->pix != NULL)
+        icp->al->free(icp->al, p->pix);
+    if (p->pax != NULL)
+        icp->al->free(icp->al, p->pax);
+    if (p->dix != NULL)
+        icp->al->free(icp->al, p->dix);
+    if (p->dax != NULL)
+        icp->al->free(icp->al, p->dax);
+    if (p->dev != NULL)
+        icp->al->free(icp->al, p->dev);
+    icp->al->free(icp->al, p);
+    ICM_ATOMIC_SUB(icp->nlu, 1);
+}
+
+static icmLuBase *
+new_icmLuNamed(
+    struct _icc          *icp,
+    icColorSpaceSignature pcs,            /* Native PCS */
+    icColorSpaceSignature e_pcs,        /* Effective PCS */
+    icRenderingIntent     intent,        /* Rendering intent */
+    icmLookupFunc         func            /* Functionality requested */
+) {
+    icmLuNamed *p;
+    icmNamedColor *nc;
+    unsigned int i, n;
+
+    /* Find the named color tag */
+    if ((nc = (icmNamedColor *)icp->read_tag(icp, icSigNamedColor2Tag)) == NULL
+     || nc->ttype != icSigNamedColor2Type) {
+        if ((nc = (icmNamedColor *)icp->read_tag(icp, icSigNamedColorTag)) == NULL
+         || nc->ttype != icSigNamedColorType) {
+            return NULL;
+        }
+    }
+    icp->err[0] = '\000';
+    icp->errc = 0;
+
+    if ((p = (icmLuNamed *) icp->al->calloc(icp->al,1,sizeof(icmLuNamed))) == NULL)
+        return NULL;
+    ICM_ATOMIC_ADD(icp->nlu, 1);
+    p->icp      = icp;
+    p->ttype    = icmNamedType;
+    p->del      = icmLuNamed_delete;
+    p->lutspaces= icmLutSpaces;
+    p->spaces   = icmLuSpaces;
+    p->XYZ_Rel2Abs = icmLuXYZ_Rel2Abs;
+    p->XYZ_Abs2Rel = icmLuXYZ_Abs2Rel;
+    p->get_info = icmLuNamed_get_info;
+    p->set_metric = icmLuNamed_set_metric;
+    p->fullname_lookup = icmLuNamed_fullname_lookup;
+    p->name_lookup = icmLuNamed_name_lookup;
+    p->pcs_lookup = icmLuNamed_pcs_lookup;
+    p->dev_lookup = icmLuNamed_dev_lookup;
+
+    p->nc       = nc;
+    p->metric   = icmNamedDE76;
+    p->pcswht   = icp->header->illuminant;
+    p->intent   = intent;
+    p->function = func;
+    p->inSpace  = icmSigNamedData;
+    p->outSpace = pcs;
+    p->pcs      = pcs;
+    p->e_inSpace  = icmSigNamedData;
+    p->e_outSpace = e_pcs;
+    p->e_pcs      = e_pcs;
+
+    /* Lookup the white and black points */
+    if (icmLuInit_Wh_bk((icmLuBase *)p)) {
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+
+    n = nc->count;
+
+    /* Create the name hash index */
+    for (p->hsize = 1; p->hsize < (2 * n); p->hsize <<= 1)
+        ;
+    if ((p->hhead = (int *) icp->al->malloc(icp->al, p->hsize * sizeof(int))) == NULL
+     || (p->hnext = (int *) icp->al->malloc(icp->al, (n + 1) * sizeof(int))) == NULL) {
+        sprintf(icp->err,"icc_get_luobj: malloc() failed");
+        icp->errc = 2;
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+    for (i = 0; i < p->hsize; i++)
+        p->hhead[i] = -1;
+    for (i = n; i > 0; i--) {        /* So that the first of duplicate names is found */
+        unsigned int h = icmLuNamed_hash(nc->data[i-1].root) & (p->hsize-1);
+        p->hnext[i-1] = p->hhead[h];
+        p->hhead[h] = i-1;
+    }
+
+    /* Create the device k-d tree */
+    if ((p->dev = (double *) icp->al->malloc(icp->al, (n * nc->nDeviceCoords + 1) * sizeof(double))) == NULL
+     || (p->dix = (int *) icp->al->malloc(icp->al, (n + 1) * sizeof(int))) == NULL
+     || (p->dax = (char *) icp->al->malloc(icp->al, (n + 1) * sizeof(char))) == NULL) {
+        sprintf(icp->err,"icc_get_luobj: malloc() failed");
+        icp->errc = 2;
+        p->del((icmLuBase *)p);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        unsigned int e;
+        for (e = 0; e < nc->nDeviceCoords; e++)
+            p->dev[i * nc->nDeviceCoords + e] = nc->data[i].deviceCoords[e];
+        p->dix[i] = i;
+    }
+    if (nc->nDeviceCoords > 0)
+        icmLuNamed_kd_build(p->dev, nc->nDeviceCoords, p->dix, p->dax, 0, n);
+
+    /* Create the PCS k-d tree in D50 relative Lab */
+    if (nc->ttype == icSigNamedColor2Type) {
+        if ((p->lab = (double *) icp->al->malloc(icp->al, (n + 1) * 3 * sizeof(double))) == NULL
+         || (p->pix = (int *) icp->al->malloc(icp->al, (n + 1) * sizeof(int))) == NULL
+         || (p->pax = (char *) icp->al->malloc(icp->al, (n + 1) * sizeof(char))) == NULL) {
+            sprintf(icp->err,"icc_get_luobj: malloc() failed");
+            icp->errc = 2;
+            p->del((icmLuBase *)p);
+            return NULL;
+        }
+        p->cmax = 0.0;
+        for (i = 0; i < n; i++) {
+            double *lab = p->lab + 3 * i, cc;
+
+            if (pcs == icSigXYZData)
+                icmXYZ2Lab(&icmD50, lab, nc->data[i].pcsCoords);
+            else
+                icmAry2Ary(lab, nc->data[i].pcsCoords);
+            cc = sqrt(lab[1] * lab[1] + lab[2] * lab[2]);
+            if (cc > p->cmax)
+                p->cmax = cc;
+            p->pix[i] = i;
+        }
+        icmLuNamed_kd_build(p->lab, 3, p->pix, p->pax, 0, n);
+    }
+
+    return (icmLuBase *)p;
+}
+
+#undef NAMED_MAXK
+
+/* Create an appropriate lookup object */
+/* Return NULL on error, and detailed error in icc */
+static 
+icmLuBase* icc_new_luobj (
+    icc *p,                        /* ICC */
+    icmLookupFunc func,            /* Conversion functionality */
+    icRenderingIntent intent,    /* Rendering intent, including icmAbsoluteColorimetricXYZ */
+    icColorSpaceSignature pcsor,/* PCS override (0 = def) */
+    icmLookupOrder order        /* Conversion representation search Order */
+)
+{
+    icmLuBase *luobj = NULL;    /* Lookup object to return */
+    icColorSpaceSignature pcs, e_pcs;    /* PCS and effective PCS */
+    
+#ifdef ICM_STRICT
+    int rv;
+    /* Check that the profile is legal, since we depend on it ? */
+    if ((rv = check_icc_legal(p)) != 0)
+        return NULL;
+#endif /* ICM_STRICT */
+    
+    /* Figure out the native and effective PCS */
+    e_pcs = pcs = p->header->pcs;
+    if (pcsor != icmSigDefaultData)
+        e_pcs = pcsor;            /* Override */
+
+    /* How we expect to execute the request depends firstly on the type of profile */
+    switch (p->header->deviceClass) {
+        case icSigInputClass:
+        case icSigDisplayClass:
+        case icSigColorSpaceClass:
+
+            /* Look for Intent based AToBX profile + optional BToAX reverse */
+            /* or for AToB0 based profile + optional BToA0 reverse */
+            /* or three component matrix profile (reversable) */
+            /* or momochrome table profile (reversable) */ 
+            /* No Lut intent for ICC < V2.4, but possible for >= V2.4, */
+            /* so fall back if we can't find the chosen Lut intent.. */
+            /* Device <-> PCS */
+            /* Determine the algorithm and set its parameters */
+
+            switch (func) {
+                icRenderingIntent fbintent;        /* Fallback intent */
+                icTagSignature ttag, fbtag;
+
+                case icmFwd:    /* Device to PCS */
+                    if (intent == icmDefaultIntent)
+                        intent = icPerceptual;    /* Make this the default */
+
+                    switch (intent) {
+                        case icAbsoluteColorimetric:
+                            ttag = icSigAToB1Tag;
+                            fbtag = icSigAToB0Tag;
+                            fbintent = intent;
+                            break;
+                        case icRelativeColorimetric:
+                            ttag = icSigAToB1Tag;
+                            fbtag = icSigAToB0Tag;
+                            fbintent = icmDefaultIntent;
+                            break;
+                        case icPerceptual:
+                            ttag = icSigAToB0Tag;
+                            fbtag = icSigAToB0Tag;
+                            fbintent = icmDefaultIntent;
+                            break;
+                        case icSaturation:
+                            ttag = icSigAToB2Tag;
+                            fbtag = icSigAToB0Tag;
+                            fbintent = icmDefaultIntent;
+                            break;
+                        case icmAbsolutePerceptual:        /* Special icclib intent */
+                            ttag = icSigAToB0Tag;
+                            fbtag = icSigAToB0Tag;
+                            fbintent = intent;
+                            break;
+                        case icmAbsoluteSaturation:        /* Special icclib intent */
+                            ttag = icSigAToB2Tag;
+                            fbtag = icSigAToB0Tag;
+                            fbintent = intent;
+                            break;
+                        default:
+                            sprintf(p->err,"icc_get_luobj: Unknown intent");
+                            p->errc = 1;
+                            return NULL;
+                    }
+
+                    if (order != icmLuOrdRev) {
+                        /* Try Lut type lookup with the chosen intent first */
+                        if ((luobj = icc_new_icmLuLut(p, ttag,
+                             p->header->colorSpace, pcs, pcs,
+                             p->header->colorSpace, e_pcs, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                        /* Try the fallback tag */
+                        if ((luobj = icc_new_icmLuLut(p, fbtag,
+                             p->header->colorSpace, pcs, pcs,
+                             p->header->colorSpace, e_pcs, e_pcs,
+                             fbintent, func)) != NULL)
+                            break;
+    
+                        /* See if it could be a matrix lookup */
+                        if ((luobj = new_icmLuMatrixFwd(p,
+                             p->header->colorSpace, pcs, pcs,
+                             p->header->colorSpace, e_pcs, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                        /* See if it could be a monochrome lookup */
+                        if ((luobj = new_icmLuMonoFwd(p,
+                             p->header->colorSpace, pcs, pcs,
+                             p->header->colorSpace, e_pcs, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                    } else {
+                        /* See if it could be a monochrome lookup */
+                        if ((luobj = new_icmLuMonoFwd(p,
+                             p->header->colorSpace, pcs, pcs,
+                             p->header->colorSpace, e_pcs, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+
+                        /* See if it could be a matrix lookup */
+                        if ((luobj = new_icmLuMatrixFwd(p,
+                             p->header->colorSpace, pcs, pcs,
+                             p->header->colorSpace, e_pcs, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                        /* Try Lut type lookup last */
+                        if ((luobj = icc_new_icmLuLut(p, ttag,
+                             p->header->colorSpace, pcs, pcs,
+                             p->header->colorSpace, e_pcs, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
                         /* Try the fallback tag */
                         if ((luobj = icc_new_icmLuLut(p, fbtag,
                              p->header->colorSpace, pcs, pcs,
                              p->header->colorSpace, e_pcs, e_pcs,
-                             fbintent, func)) != NULL)
+                             fbintent, func)) != NULL)
+                            break;
+                    }
+                    break;
+
+                case icmBwd:    /* PCS to Device */
+                    if (intent == icmDefaultIntent)
+                        intent = icPerceptual;    /* Make this the default */
+
+                    switch (intent) {
+                        case icAbsoluteColorimetric:
+                            ttag = icSigBToA1Tag;
+                            fbtag = icSigBToA0Tag;
+                            fbintent = intent;
+                            break;
+                        case icRelativeColorimetric:
+                            ttag = icSigBToA1Tag;
+                            fbtag = icSigBToA0Tag;
+                            fbintent = icmDefaultIntent;
+                            break;
+                        case icPerceptual:
+                            ttag = icSigBToA0Tag;
+                            fbtag = icSigBToA0Tag;
+                            fbintent = icmDefaultIntent;
+                            break;
+                        case icSaturation:
+                            ttag = icSigBToA2Tag;
+                            fbtag = icSigBToA0Tag;
+                            fbintent = icmDefaultIntent;
+                            break;
+                        case icmAbsolutePerceptual:        /* Special icclib intent */
+                            ttag = icSigBToA0Tag;
+                            fbtag = icSigBToA0Tag;
+                            fbintent = intent;
+                            break;
+                        case icmAbsoluteSaturation:        /* Special icclib intent */
+                            ttag = icSigBToA2Tag;
+                            fbtag = icSigBToA0Tag;
+                            fbintent = intent;
+                            break;
+                        default:
+                            sprintf(p->err,"icc_get_luobj: Unknown intent");
+                            p->errc = 1;
+                            return NULL;
+                    }
+
+
+                    if (order != icmLuOrdRev) {
+                        /* Try Lut type lookup first */
+                        if ((luobj = icc_new_icmLuLut(p, ttag,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+
+                        /* Try the fallback Lut */
+                        if ((luobj = icc_new_icmLuLut(p, fbtag,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             fbintent, func)) != NULL)
+                            break;
+    
+                        /* See if it could be a matrix lookup */
+                        if ((luobj = new_icmLuMatrixBwd(p,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                        /* See if it could be a monochrome lookup */
+                        if ((luobj = new_icmLuMonoBwd(p,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+                    } else {
+                        /* See if it could be a monochrome lookup */
+                        if ((luobj = new_icmLuMonoBwd(p,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                        /* See if it could be a matrix lookup */
+                        if ((luobj = new_icmLuMatrixBwd(p,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                        /* Try Lut type lookup last */
+                        if ((luobj = icc_new_icmLuLut(p, ttag,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+
+                        /* Try the fallback Lut */
+                        if ((luobj = icc_new_icmLuLut(p, fbtag,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             fbintent, func)) != NULL)
+                            break;
+                    }
+                    break;
+
+                default:
+                    sprintf(p->err,"icc_get_luobj: Inaproptiate function requested");
+                    p->errc = 1;
+                    return NULL;
+                }
+            break;
+            
+        case icSigOutputClass:
+            /* Expect BToA Lut and optional AToB Lut, All intents, expect gamut */
+            /* or momochrome table profile (reversable) */ 
+            /* Device <-> PCS */
+            /* Gamut Lut - no intent */
+            /* Optional preview links PCS <-> PCS */
+            
+            /* Determine the algorithm and set its parameters */
+            switch (func) {
+                icTagSignature ttag;
+                
+                case icmFwd:    /* Device to PCS */
+
+                    if (intent == icmDefaultIntent)
+                        intent = icPerceptual;    /* Make this the default */
+
+                    switch (intent) {
+                        case icRelativeColorimetric:
+                        case icAbsoluteColorimetric:
+                                ttag = icSigAToB1Tag;
+                            break;
+                        case icPerceptual:
+                        case icmAbsolutePerceptual:        /* Special icclib intent */
+                                ttag = icSigAToB0Tag;
+                            break;
+                        case icSaturation:
+                        case icmAbsoluteSaturation:        /* Special icclib intent */
+                                ttag = icSigAToB2Tag;
+                            break;
+                        default:
+                            sprintf(p->err,"icc_get_luobj: Unknown intent");
+                            p->errc = 1;
+                            return NULL;
+                    }
+
+                    if (order != icmLuOrdRev) {
+                        /* Try Lut type lookup first */
+                        if ((luobj = icc_new_icmLuLut(p, ttag,
+                             p->header->colorSpace, pcs, pcs,
+                             p->header->colorSpace, e_pcs, e_pcs,
+                             intent, func)) != NULL) {
                             break;
+                        }
     
                         /* See if it could be a matrix lookup */
                         if ((luobj = new_icmLuMatrixFwd(p,
@@ -16538,7 +22119,6 @@ icmLuBase* icc_get_luobj (
                              p->header->colorSpace, e_pcs, e_pcs,
                              intent, func)) != NULL)
                             break;
-    
                     } else {
                         /* See if it could be a monochrome lookup */
                         if ((luobj = new_icmLuMonoFwd(p,
@@ -16547,581 +22127,2097 @@ icmLuBase* icc_get_luobj (
                              intent, func)) != NULL)
                             break;
 
-                        /* See if it could be a matrix lookup */
-                        if ((luobj = new_icmLuMatrixFwd(p,
-                             p->header->colorSpace, pcs, pcs,
-                             p->header->colorSpace, e_pcs, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
-                        /* Try Lut type lookup last */
-                        if ((luobj = icc_new_icmLuLut(p, ttag,
-                             p->header->colorSpace, pcs, pcs,
-                             p->header->colorSpace, e_pcs, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
-                        /* Try the fallback tag */
-                        if ((luobj = icc_new_icmLuLut(p, fbtag,
-                             p->header->colorSpace, pcs, pcs,
-                             p->header->colorSpace, e_pcs, e_pcs,
-                             fbintent, func)) != NULL)
-                            break;
-                    }
-                    break;
+                        /* See if it could be a matrix lookup */
+                        if ((luobj = new_icmLuMatrixFwd(p,
+                             p->header->colorSpace, pcs, pcs,
+                             p->header->colorSpace, e_pcs, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                        /* Try Lut type lookup last */
+                        if ((luobj = icc_new_icmLuLut(p, ttag,
+                             p->header->colorSpace, pcs, pcs,
+                             p->header->colorSpace, e_pcs, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+                    }
+                    break;
+
+                case icmBwd:    /* PCS to Device */
+
+                    if (intent == icmDefaultIntent)
+                        intent = icPerceptual;            /* Make this the default */
+
+                    switch (intent) {
+                        case icRelativeColorimetric:
+                        case icAbsoluteColorimetric:
+                                ttag = icSigBToA1Tag;
+                            break;
+                        case icPerceptual:
+                        case icmAbsolutePerceptual:        /* Special icclib intent */
+                                ttag = icSigBToA0Tag;
+                            break;
+                        case icSaturation:
+                        case icmAbsoluteSaturation:        /* Special icclib intent */
+                                ttag = icSigBToA2Tag;
+                            break;
+                        default:
+                            sprintf(p->err,"icc_get_luobj: Unknown intent");
+                            p->errc = 1;
+                            return NULL;
+                    }
+
+                    if (order != icmLuOrdRev) {
+                        /* Try Lut type lookup first */
+                        if ((luobj = icc_new_icmLuLut(p, ttag,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                        /* See if it could be a matrix lookup */
+                        if ((luobj = new_icmLuMatrixBwd(p,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                        /* See if it could be a monochrome lookup */
+                        if ((luobj = new_icmLuMonoBwd(p,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+                    } else {
+                        /* See if it could be a monochrome lookup */
+                        if ((luobj = new_icmLuMonoBwd(p,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+
+                        /* See if it could be a matrix lookup */
+                        if ((luobj = new_icmLuMatrixBwd(p,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+    
+                        /* Try Lut type lookup last */
+                        if ((luobj = icc_new_icmLuLut(p, ttag,
+                             pcs, p->header->colorSpace, pcs,
+                             e_pcs, p->header->colorSpace, e_pcs,
+                             intent, func)) != NULL)
+                            break;
+                    }
+                    break;
+
+                case icmGamut:    /* PCS to 1D */
+
+#ifdef ICM_STRICT    /* Allow only default and absolute */
+                    if (intent != icmDefaultIntent
+                     && intent != icAbsoluteColorimetric) {
+                        sprintf(p->err,"icc_get_luobj: Intent is inappropriate for Gamut table");
+                        p->errc = 1;
+                        return NULL;
+                    }
+#else                /* Be more forgiving */
+                    switch (intent) {
+                        case icAbsoluteColorimetric:
+                        case icmAbsolutePerceptual:        /* Special icclib intent */
+                        case icmAbsoluteSaturation:        /* Special icclib intent */
+                            break;
+                        case icmDefaultIntent:
+                        case icRelativeColorimetric:
+                        case icPerceptual:
+                        case icSaturation:
+                            intent = icmDefaultIntent;    /* Make all other look like default */
+                            break;
+                        default:
+                            sprintf(p->err,"icc_get_luobj: Unknown intent (0x%x)",intent);
+                            p->errc = 1;
+                            return NULL;
+                    }
+
+#endif
+                    /* If the target tag exists, and it is a Lut */
+                    luobj = icc_new_icmLuLut(p, icSigGamutTag,
+                         pcs, icSigGrayData, pcs,
+                         e_pcs, icSigGrayData, e_pcs,
+                         intent, func);
+                    break;
+
+                case icmPreview:    /* PCS to PCS */
+
+                    switch (intent)  {
+                        case icRelativeColorimetric:
+                                ttag = icSigPreview1Tag;
+                            break;
+                        case icPerceptual:
+                                ttag = icSigPreview0Tag;
+                            break;
+                        case icSaturation:
+                                ttag = icSigPreview2Tag;
+                            break;
+                        case icAbsoluteColorimetric:
+                        case icmAbsolutePerceptual:        /* Special icclib intent */
+                        case icmAbsoluteSaturation:        /* Special icclib intent */
+                            sprintf(p->err,"icc_get_luobj: Intent is inappropriate for preview table");
+                            p->errc = 1;
+                            return NULL;
+                        default:
+                            sprintf(p->err,"icc_get_luobj: Unknown intent");
+                            p->errc = 1;
+                            return NULL;
+                    }
+
+                    /* If the target tag exists, and it is a Lut */
+                    luobj = icc_new_icmLuLut(p, ttag,
+                         pcs, pcs, pcs,
+                         e_pcs, e_pcs, e_pcs,
+                         intent, func);
+                    break;
+
+                default:
+                    sprintf(p->err,"icc_get_luobj: Inaproptiate function requested");
+                    p->errc = 1;
+                    return NULL;
+            }
+            break;
+
+        case icSigLinkClass:
+            /* Expect AToB0 Lut and optional BToA0 Lut, One intent in header */
+            /* Device <-> Device */
+
+            if (intent != p->header->renderingIntent
+             && intent != icmDefaultIntent) {
+                sprintf(p->err,"icc_get_luobj: Intent is inappropriate for Link profile");
+                p->errc = 1;
+                return NULL;
+            }
+            intent = p->header->renderingIntent;
+
+            /* Determine the algorithm and set its parameters */
+            switch (func) {
+                case icmFwd:    /* Device to PCS (== Device) */
+
+                    luobj = icc_new_icmLuLut(p, icSigAToB0Tag,
+                         p->header->colorSpace, pcs, pcs,
+                         p->header->colorSpace, pcs, pcs,
+                         intent, func);
+                    break;
+
+                case icmBwd:    /* PCS (== Device) to Device */
+
+                    luobj = icc_new_icmLuLut(p, icSigBToA0Tag,
+                         pcs, p->header->colorSpace, pcs,
+                         pcs, p->header->colorSpace, pcs,
+                         intent, func);
+                    break;
+
+                default:
+                    sprintf(p->err,"icc_get_luobj: Inaproptiate function requested");
+                    p->errc = 1;
+                    return NULL;
+            }
+            break;
+
+        case icSigAbstractClass:
+            /* Expect AToB0 Lut and option BToA0 Lut, with either relative or absolute intent. */
+            /* PCS <-> PCS */
+            /* Determine the algorithm and set its parameters */
+
+            if (intent != icmDefaultIntent
+             && intent != icRelativeColorimetric
+             && intent != icAbsoluteColorimetric) {
+                sprintf(p->err,"icc_get_luobj: Intent is inappropriate for Abstract profile");
+                p->errc = 1;
+                return NULL;
+            }
+
+            switch (func) {
+                case icmFwd:    /* PCS (== Device) to PCS */
+
+                    luobj = icc_new_icmLuLut(p, icSigAToB0Tag,
+                         p->header->colorSpace, pcs, pcs,
+                         e_pcs, e_pcs, e_pcs,
+                         intent, func);
+                    break;
+
+                case icmBwd:    /* PCS to PCS (== Device) */
+
+                    luobj = icc_new_icmLuLut(p, icSigBToA0Tag,
+                         pcs, p->header->colorSpace, pcs,
+                         e_pcs, e_pcs, e_pcs,
+                         intent, func);
+                    break;
+
+                default:
+                    sprintf(p->err,"icc_get_luobj: Inaproptiate function requested");
+                    p->errc = 1;
+                    return NULL;
+            }
+            break;
+
+        case icSigNamedColorClass:
+            /* Name -> Device, Optional PCS, */
+            /* and PCS or Device coords to closest named color. */
+
+            /* Absolute intent is valid for processing of */
+            /* PCS from named Colors. */
+            if (intent != icmDefaultIntent
+             && intent != icRelativeColorimetric
+             && intent != icAbsoluteColorimetric) {
+                sprintf(p->err,"icc_get_luobj: Intent is inappropriate for Named Color profile");
+                p->errc = 1;
+                return NULL;
+            }
+
+            if (intent == icmDefaultIntent)
+                intent = icRelativeColorimetric;
+
+            if ((luobj = new_icmLuNamed(p, pcs, e_pcs, intent, func)) == NULL) {
+                if (p->errc == 0) {
+                    sprintf(p->err,"icc_get_luobj: Named Color profile is missing named color tag");
+                    p->errc = 1;
+                }
+                return NULL;
+            }
+            break;
+
+        default:
+            sprintf(p->err,"icc_get_luobj: Unknown profile class");
+            p->errc = 1;
+            return NULL;
+    }
+
+    if (luobj == NULL) {
+        sprintf(p->err,"icc_get_luobj: Unable to locate usable conversion");
+        p->errc = 1;
+    } else {
+        luobj->order = order;
+    }
+
+    return luobj;
+}
+
+/* Return an appropriate lookup object */
+/* Return NULL on error, and detailed error in icc */
+static 
+icmLuBase* icc_get_luobj (
+    icc *p,                        /* ICC */
+    icmLookupFunc func,            /* Conversion functionality */
+    icRenderingIntent intent,    /* Rendering intent, including icmAbsoluteColorimetricXYZ */
+    icColorSpaceSignature pcsor,/* PCS override (0 = def) */
+    icmLookupOrder order        /* Conversion representation search Order */
+) {
+    icmLuBase *luobj;
+    icmMemCat ocat;
+
+    icc_mem_enter(p);
+    ocat = icc_memcat(p, icmMemLu);
+    luobj = icc_new_luobj(p, func, intent, pcsor, order);
+    icc_memcat(p, ocat);
+    icc_mem_leave(p, -1);
+
+    return luobj;
+}
+
+/* Return an appropriate lookup object, re-using the one made */
+/* by an earlier get_luobj_shared() call with the same arguments. */
+/* The memo is locked against unloading by other threads, but like */
+/* the other icc methods, this mustn't be called on one icc from */
+/* several threads at once. */
+/* Return NULL on error, and detailed error in icc */
+static 
+icmLuBase* icc_get_luobj_shared (
+    icc *p,                        /* ICC */
+    icmLookupFunc func,            /* Conversion functionality */
+    icRenderingIntent intent,    /* Rendering intent, including icmAbsoluteColorimetricXYZ */
+    icColorSpaceSignature pcsor,/* PCS override (0 = def) */
+    icmLookupOrder order        /* Conversion representation search Order */
+) {
+    icmLuBase *luobj;
+    icmLuCache *cp;
+    unsigned int i;
+
+    icc_mem_enter(p);
+
+    ICM_LOCK(icmMemLock);
+    for (i = 0; i < p->nlucache; i++) {
+        cp = &p->lucache[i];
+        if (cp->func == func && cp->intent == intent
+         && cp->pcsor == pcsor && cp->order == order) {
+            ICM_ATOMIC_ADD(cp->luo->refs, 1);
+            ICM_UNLOCK(icmMemLock);
+            icc_mem_leave(p, -1);
+            return cp->luo;
+        }
+    }
+    ICM_UNLOCK(icmMemLock);
+
+    if ((luobj = icc_get_luobj(p, func, intent, pcsor, order)) == NULL) {
+        icc_mem_leave(p, -1);
+        return NULL;
+    }
+
+    ICM_LOCK(icmMemLock);
+    if (p->nlucache >= p->_nlucache) {
+        unsigned int _n = p->_nlucache == 0 ? 4 : 2 * p->_nlucache;
+        if ((cp = (icmLuCache *) p->al->realloc(p->al, p->lucache,
+                                                _n * sizeof(icmLuCache))) == NULL) {
+            ICM_UNLOCK(icmMemLock);
+            icc_mem_leave(p, -1);
+            return luobj;            /* Just don't memoise it */
+        }
+        p->lucache = cp;
+        p->_nlucache = _n;
+    }
+    cp = &p->lucache[p->nlucache++];
+    cp->func = func;
+    cp->intent = intent;
+    cp->pcsor = pcsor;
+    cp->order = order;
+    cp->luo = luobj;
+
+    /* One reference for the cache, and one for the caller */
+    luobj->refs = 2;
+    luobj->rdel = luobj->del;
+    luobj->del = icmLu_release;
+    ICM_UNLOCK(icmMemLock);
+
+    icc_mem_leave(p, -1);
+    return luobj;
+}
+
+/* Make a lookup object for a specific cLUT, as a lookup object in use */
+static icmLuBase *icc_new_clutluobj(
+    icc *p,
+    icTagSignature        ttag,
+    icColorSpaceSignature inSpace,
+    icColorSpaceSignature outSpace,
+    icColorSpaceSignature pcs,
+    icColorSpaceSignature e_inSpace,
+    icColorSpaceSignature e_outSpace,
+    icColorSpaceSignature e_pcs,
+    icRenderingIntent     intent,
+    icmLookupFunc         func
+) {
+    icmLuBase *luobj;
+    icmMemCat ocat;
+
+    icc_mem_enter(p);
+    ocat = icc_memcat(p, icmMemLu);
+    luobj = icc_new_icmLuLut(p, ttag, inSpace, outSpace, pcs, e_inSpace, e_outSpace, e_pcs,
+                             intent, func);
+    icc_memcat(p, ocat);
+    icc_mem_leave(p, -1);
+
+    return luobj;
+}
+
+
+/* Returns total ink limit and channel maximums. */
+/* Returns -1.0 if not applicable for this type of profile. */
+/* Returns -1.0 for grey, additive, or any profiles < 4 channels. */
+/* This is a place holder that uses a heuristic, */
+/* until there is a private or standard tag for this information */
+static double 
+icm_get_tac(    
+    icc *p,
+    double *chmax,                    /* device return channel sums. May be NULL */
+    void (*calfunc)(void *cntx, double *out, double *in),    /* Optional calibration func. */
+    void *cntx
+) 
+{
+    icmHeader *rh = p->header;
+    icmLuBase *luo;
+    icmLuLut *ll;
+    icmLut *lut;
+    icColorSpaceSignature outs;        /* Type of output space */
+    int inn, outn;                    /* Number of components */
+    icmLuAlgType alg;                /* Type of lookup algorithm */
+    double tac = 0.0;
+    double max[MAX_CHAN];            /* Channel maximums */
+    int i, f;
+    unsigned int uf;
+    int size;                        /* Lut table size */
+    double *gp;                        /* Pointer to grid cube base */
+
+    /* If not something that can really have a TAC */
+    if (rh->deviceClass != icSigDisplayClass
+     && rh->deviceClass != icSigOutputClass
+     && rh->deviceClass != icSigLinkClass) {
+        return -1.0;
+    }
+
+    /* If not a suitable color space */
+    switch (rh->colorSpace) {
+        /* Not applicable */
+        case icSigXYZData:
+        case icSigLabData:
+        case icSigLuvData:
+        case icSigYCbCrData:
+        case icSigYxyData:
+        case icSigHsvData:
+        case icSigHlsData:
+            return -1.0;
+
+        /* Assume no limit */
+        case icSigGrayData:
+        case icSig2colorData:
+        case icSig3colorData:
+        case icSigRgbData:
+            return -1.0;
+
+        default:
+            break;
+    }
+
+    /* Get a PCS->device colorimetric lookup */
+    if ((luo = p->get_luobj(p, icmBwd, icRelativeColorimetric, icmSigDefaultData, icmLuOrdNorm)) == NULL) {
+        if ((luo = p->get_luobj(p, icmBwd, icmDefaultIntent, icmSigDefaultData, icmLuOrdNorm)) == NULL) {
+            return -1.0;
+        }
+    }
+
+    /* Get details of conversion (Arguments may be NULL if info not needed) */
+    luo->spaces(luo, NULL, &inn, &outs, &outn, &alg, NULL, NULL, NULL, NULL);
+
+    /* Assume any non-Lut type doesn't have a TAC */
+    if (alg != icmLutType && alg != icmLutABType) {
+        return -1.0;
+    }
+
+    /* The grid values of a V4 Lut go through the A curves */
+    if (alg == icmLutABType) {
+        icmLuLutAB *la = (icmLuLutAB *)luo;
+        icmLutAB *lab = la->lut;
+
+        if (!lab->aclut) {
+            luo->del(luo);
+            return -1.0;
+        }
+        for (f = 0; f < outn; f++)
+            max[f] = 0.0;
+
+        gp = lab->clutTable;
+        size = lab->clutTable_size / lab->outputChan;
+        for (i = 0; i < size; i++) {
+            double tot, vv[MAX_CHAN];
+
+            for (uf = 0; uf < lab->outputChan; uf++)
+                lab->aCurves[uf]->lookup_fwd(lab->aCurves[uf], &vv[uf], &gp[uf]);
+            la->out_denormf(vv,vv);
+
+            if (calfunc != NULL)
+                calfunc(cntx, vv, vv);            /* Apply device calibration */
+
+            for (tot = 0.0, uf = 0; uf < lab->outputChan; uf++) {
+                tot += vv[uf];
+                if (vv[uf] > max[uf])
+                    max[uf] = vv[uf];
+            }
+            if (tot > tac)
+                tac = tot;
+            gp += lab->outputChan;
+        }
+
+        if (chmax != NULL) {
+            for (f = 0; f < outn; f++)
+                chmax[f] = max[f];
+        }
+
+        luo->del(luo);
+
+        return tac;
+    }
+
+    ll = (icmLuLut *)luo;
+
+    /* We have a Lut type. Search the lut for the largest values */
+    for (f = 0; f < outn; f++)
+        max[f] = 0.0;
+
+    lut = ll->lut;
+    gp = lut->clutTable;        /* Base of grid array */
+    size = sat_pow(lut->clutPoints,lut->inputChan);
+    for (i = 0; i < size; i++) {
+        double tot, vv[MAX_CHAN];            
+        
+        lut->lookup_output(lut,vv,gp);        /* Lookup though output tables */
+        ll->out_denormf(vv,vv);                /* Normalize for output color space */
+
+        if (calfunc != NULL)
+            calfunc(cntx, vv, vv);            /* Apply device calibration */
+
+        for (tot = 0.0, uf = 0; uf < lut->outputChan; uf++) {
+            tot += vv[uf];
+            if (vv[uf] > max[uf])
+                max[uf] = vv[uf];
+        }
+        if (tot > tac)
+            tac = tot;
+        gp += lut->outputChan;
+    }
+
+    if (chmax != NULL) {
+        for (f = 0; f < outn; f++)
+            chmax[f] = max[f];
+    }
+
+    luo->del(luo);
+
+    return tac;
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Device link creation */
+
+#define LINK_SHPRES 256            /* Input shaper points, one per input table entry */
+#define LINK_SHPLINES 16        /* Lines per input axis the shapers are measured along */
+#define LINK_SHPLIN 0.5            /* Proportion of linear mixed into the shapers */
+#define LINK_FITPTS 8192        /* Test points used to measure a link's error */
+#define LINK_FITCHUNK 256        /* Test points per parallel job */
+#define LINK_HSKIP 17            /* Initial Halton sequence values skipped */
+#define LINK_CALRES 4096        /* Output table entries when calibrated */
+
+/* Context for sampling the source -> destination conversion */
+typedef struct {
+    icmLuBase *src;            /* Source device -> PCS */
+    icmLuBase *dst;            /* PCS -> destination device */
+    icmLuBase *chk;            /* Destination device -> Lab, when fitting */
+    int inn;                /* Number of input channels */
+    double (*shp)[LINK_SHPRES];    /* Input shaper curves, NULL if none */
+    void (*cal)(void *cntx, double *out, double *in);    /* Output calibration, NULL if none */
+    void *calcntx;            /* Context for cal() */
+} icmLinkCtx;
+
+/* Convert a source device value to a destination device value. */
+/* Once any reverse curve tables have been built, the lookups only */
+/* read their objects, so this may be called concurrently. */
+static void icmLink_clutfunc(void *cntx, double *out, double *in) {
+    icmLinkCtx *lc = (icmLinkCtx *)cntx;
+    double pcs[MAX_CHAN];
+
+    lc->src->lookup(lc->src, pcs, in);
+    lc->dst->lookup(lc->dst, out, pcs);
+}
+
+/* Input table function: apply the shaper curves. */
+/* The input table entries fall exactly on the curve points. */
+static void icmLink_infunc(void *cntx, double *out, double *in) {
+    icmLinkCtx *lc = (icmLinkCtx *)cntx;
+    int e, ix;
+    double t;
+
+    for (e = 0; e < lc->inn; e++) {
+        t = in[e] * (LINK_SHPRES - 1.0);
+        if (t <= 0.0) {
+            out[e] = lc->shp[e][0];
+            continue;
+        }
+        ix = (int)t;
+        if (ix > (LINK_SHPRES-2))
+            ix = LINK_SHPRES-2;
+        t -= (double)ix;
+        out[e] = (1.0 - t) * lc->shp[e][ix] + t * lc->shp[e][ix+1];
+    }
+}
+
+/* cLUT function when shaped: invert the (piecewise linear) */
+/* shaper curves, then convert source to destination. */
+static void icmLink_shclutfunc(void *cntx, double *out, double *in) {
+    icmLinkCtx *lc = (icmLinkCtx *)cntx;
+    double dev[MAX_CHAN];
+    int e, lo, hi, mid;
+
+    for (e = 0; e < lc->inn; e++) {
+        double *sp = lc->shp[e], v = in[e];
+
+        if (v <= sp[0]) {
+            dev[e] = 0.0;
+            continue;
+        }
+        if (v >= sp[LINK_SHPRES-1]) {
+            dev[e] = 1.0;
+            continue;
+        }
+        for (lo = 0, hi = LINK_SHPRES-1; (hi - lo) > 1;) {
+            mid = (lo + hi)/2;
+            if (sp[mid] <= v)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        dev[e] = (lo + (v - sp[lo])/(sp[hi] - sp[lo]))/(LINK_SHPRES - 1.0);
+    }
+    icmLink_clutfunc(cntx, out, dev);
+}
+
+/* Output table function: apply the device calibration */
+static void icmLink_outfunc(void *cntx, double *out, double *in) {
+    icmLinkCtx *lc = (icmLinkCtx *)cntx;
+
+    lc->cal(lc->calcntx, out, in);
+}
+
+/* Context for measuring a link against the conversion it samples */
+typedef struct {
+    icmLinkCtx *lc;
+    icmLuBase *luo;            /* Link being measured, NULL to compute the references */
+    unsigned int n;            /* Number of test points */
+    double *in;                /* n input values */
+    double *ref;            /* n reference Lab values */
+    double *de;                /* n Delta E 2000's to the references */
+    double *inmin, *inmax;    /* Input range */
+    double *arc;            /* Shaper arc lengths, inn * LINK_SHPLINES * LINK_SHPRES */
+} icmLinkFitCtx;
+
+/* Compute the reference Lab or the error of one chunk of test points */
+static int icmLink_fit_job(void *cntx, int thix, int jix) {
+    icmLinkFitCtx *fx = (icmLinkFitCtx *)cntx;
+    icmLinkCtx *lc = fx->lc;
+    double out[MAX_CHAN], lab[LINK_FITCHUNK * 3];
+    unsigned int i, s, e;
+
+    s = jix * LINK_FITCHUNK;
+    e = s + LINK_FITCHUNK;
+    if (e > fx->n)
+        e = fx->n;
+
+    for (i = s; i < e; i++) {
+        if (fx->luo == NULL) {
+            icmLink_clutfunc((void *)lc, out, fx->in + i * lc->inn);
+            lc->chk->lookup(lc->chk, fx->ref + i * 3, out);
+        } else {
+            fx->luo->lookup(fx->luo, out, fx->in + i * lc->inn);
+            lc->chk->lookup(lc->chk, lab + (i - s) * 3, out);
+        }
+    }
+    if (fx->luo != NULL)
+        icmCIE2K_n(fx->de + s, lab, fx->ref + s * 3, e - s);
+
+    return 0;
+}
+
+/* Measure the Lab arc length increments along one line parallel to an input axis */
+static int icmLink_shp_job(void *cntx, int thix, int jix) {
+    icmLinkFitCtx *fx = (icmLinkFitCtx *)cntx;
+    icmLinkCtx *lc = fx->lc;
+    int e = jix / LINK_SHPLINES, i;
+    double in[MAX_CHAN], out[MAX_CHAN], lab[3], plab[3];
+    double *arc = fx->arc + jix * LINK_SHPRES;
+
+    icmHaltonPoint(in, jix % LINK_SHPLINES + LINK_HSKIP, lc->inn, fx->inmin, fx->inmax);
+    for (i = 0; i < LINK_SHPRES; i++) {
+        in[e] = fx->inmin[e] + i/(LINK_SHPRES-1.0) * (fx->inmax[e] - fx->inmin[e]);
+        icmLink_clutfunc((void *)lc, out, in);
+        lc->chk->lookup(lc->chk, lab, out);
+        arc[i] = i == 0 ? 0.0 : icmLabDE(lab, plab);
+        icmCpy3(plab, lab);
+    }
+    return 0;
+}
 
-                case icmBwd:    /* PCS to Device */
-                    if (intent == icmDefaultIntent)
-                        intent = icPerceptual;    /* Make this the default */
+/* Copy the ASCII part of a text description tag of sp, if it has one */
+static int icmLink_copy_text(icmTextDescription *d, icc *sp, icTagSignature sig) {
+    icmTextDescription *s;
 
-                    switch (intent) {
-                        case icAbsoluteColorimetric:
-                            ttag = icSigBToA1Tag;
-                            fbtag = icSigBToA0Tag;
-                            fbintent = intent;
-                            break;
-                        case icRelativeColorimetric:
-                            ttag = icSigBToA1Tag;
-                            fbtag = icSigBToA0Tag;
-                            fbintent = icmDefaultIntent;
-                            break;
-                        case icPerceptual:
-                            ttag = icSigBToA0Tag;
-                            fbtag = icSigBToA0Tag;
-                            fbintent = icmDefaultIntent;
-                            break;
-                        case icSaturation:
-                            ttag = icSigBToA2Tag;
-                            fbtag = icSigBToA0Tag;
-                            fbintent = icmDefaultIntent;
-                            break;
-                        case icmAbsolutePerceptual:        /* Special icclib intent */
-                            ttag = icSigBToA0Tag;
-                            fbtag = icSigBToA0Tag;
-                            fbintent = intent;
-                            break;
-                        case icmAbsoluteSaturation:        /* Special icclib intent */
-                            ttag = icSigBToA2Tag;
-                            fbtag = icSigBToA0Tag;
-                            fbintent = intent;
-                            break;
-                        default:
-                            sprintf(p->err,"icc_get_luobj: Unknown intent");
-                            p->errc = 1;
-                            return NULL;
-                    }
+    if ((s = (icmTextDescription *)sp->read_tag(sp, sig)) == NULL
+     || s->ttype != icSigTextDescriptionType || s->size == 0)
+        return 0;
+    d->size = s->size;
+    if (d->allocate((icmBase *)d) != 0)
+        return d->icp->errc;
+    memcpy(d->desc, s->desc, s->size);
+    d->desc[d->size-1] = '\000';
+    return 0;
+}
 
+/* Describe a profile in a profile sequence */
+static int icmLink_set_desc(icmDescStruct *d, icc *sp) {
+    icmSignature *tp;
+    int rv;
 
-                    if (order != icmLuOrdRev) {
-                        /* Try Lut type lookup first */
-                        if ((luobj = icc_new_icmLuLut(p, ttag,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
+    d->deviceMfg   = sp->header->manufacturer;
+    d->deviceModel = sp->header->model;
+    d->attributes  = sp->header->attributes;
+    if ((tp = (icmSignature *)sp->read_tag(sp, icSigTechnologyTag)) != NULL
+     && tp->ttype == icSigSignatureType)
+        d->technology = tp->sig;
+    if ((rv = icmLink_copy_text(&d->device, sp, icSigDeviceMfgDescTag)) != 0
+     || (rv = icmLink_copy_text(&d->model, sp, icSigDeviceModelDescTag)) != 0)
+        return rv;
+    return 0;
+}
 
-                        /* Try the fallback Lut */
-                        if ((luobj = icc_new_icmLuLut(p, fbtag,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             fbintent, func)) != NULL)
-                            break;
-    
-                        /* See if it could be a matrix lookup */
-                        if ((luobj = new_icmLuMatrixBwd(p,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
-                        /* See if it could be a monochrome lookup */
-                        if ((luobj = new_icmLuMonoBwd(p,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-                    } else {
-                        /* See if it could be a monochrome lookup */
-                        if ((luobj = new_icmLuMonoBwd(p,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
-                        /* See if it could be a matrix lookup */
-                        if ((luobj = new_icmLuMatrixBwd(p,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
-                        /* Try Lut type lookup last */
-                        if ((luobj = icc_new_icmLuLut(p, ttag,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
+/* Delete the lookups of a link context */
+static void icmLink_end(icmLinkCtx *lc) {
+    if (lc->chk != NULL)
+        lc->chk->del(lc->chk);
+    lc->src->del(lc->src);
+    lc->dst->del(lc->dst);
+}
 
-                        /* Try the fallback Lut */
-                        if ((luobj = icc_new_icmLuLut(p, fbtag,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             fbintent, func)) != NULL)
-                            break;
-                    }
-                    break;
+/* Create the lookups, header and tags of a device link in an empty */
+/* icc, leaving the A2B0 Lut16 for the caller to size and fill. */
+/* On success the lookups must be deleted by the caller with icmLink_end(). */
+static int icmLink_begin(
+    icc *p,
+    icc *src,                    /* Source profile */
+    icc *dst,                    /* Destination profile */
+    icRenderingIntent intent,    /* Intent, icmDefaultIntent for the source default */
+    void (*calfunc)(void *cntx, double *out, double *in),    /* Calibration, NULL if none */
+    void *cntx,                    /* Context for calfunc */
+    icmLinkCtx *lc,                /* Return the lookups */
+    icColorSpaceSignature *ins,    /* Return the link spaces */
+    icColorSpaceSignature *outs,
+    icmLut **pwo                /* Return the A2B0 */
+) {
+    icColorSpaceSignature pcsor;
+    icmTextDescription *dp;
+    icmText *cp;
+    icmProfileSequenceDesc *sq;
+    icmLut *wo;
+    int outn;
+    int rv = 0;
 
-                default:
-                    sprintf(p->err,"icc_get_luobj: Inaproptiate function requested");
-                    p->errc = 1;
-                    return NULL;
-                }
-            break;
-            
-        case icSigOutputClass:
-            /* Expect BToA Lut and optional AToB Lut, All intents, expect gamut */
-            /* or momochrome table profile (reversable) */ 
-            /* Device <-> PCS */
-            /* Gamut Lut - no intent */
-            /* Optional preview links PCS <-> PCS */
-            
-            /* Determine the algorithm and set its parameters */
-            switch (func) {
-                icTagSignature ttag;
-                
-                case icmFwd:    /* Device to PCS */
+    lc->chk = NULL;
+    lc->shp = NULL;
+    lc->cal = calfunc;
+    lc->calcntx = cntx;
 
-                    if (intent == icmDefaultIntent)
-                        intent = icPerceptual;    /* Make this the default */
+    if (src->header->deviceClass == icSigLinkClass
+     || dst->header->deviceClass == icSigLinkClass) {
+        sprintf(p->err,"icc_create_link: Can't link device link profiles");
+        return p->errc = 1;
+    }
+    if (intent == icmDefaultIntent)
+        intent = src->header->renderingIntent;
 
-                    switch (intent) {
-                        case icRelativeColorimetric:
-                        case icAbsoluteColorimetric:
-                                ttag = icSigAToB1Tag;
-                            break;
-                        case icPerceptual:
-                        case icmAbsolutePerceptual:        /* Special icclib intent */
-                                ttag = icSigAToB0Tag;
-                            break;
-                        case icSaturation:
-                        case icmAbsoluteSaturation:        /* Special icclib intent */
-                                ttag = icSigAToB2Tag;
-                            break;
-                        default:
-                            sprintf(p->err,"icc_get_luobj: Unknown intent");
-                            p->errc = 1;
-                            return NULL;
-                    }
+    /* Connect the two in the source PCS */
+    pcsor = src->header->pcs;
+    if ((lc->src = src->get_luobj(src, icmFwd, intent, pcsor, icmLuOrdNorm)) == NULL) {
+        sprintf(p->err,"icc_create_link: Source lookup failed: %.400s",src->err);
+        return p->errc = src->errc != 0 ? src->errc : 1;
+    }
+    if ((lc->dst = dst->get_luobj(dst, icmBwd, intent, pcsor, icmLuOrdNorm)) == NULL) {
+        sprintf(p->err,"icc_create_link: Destination lookup failed: %.400s",dst->err);
+        lc->src->del(lc->src);
+        return p->errc = dst->errc != 0 ? dst->errc : 1;
+    }
+    lc->src->spaces(lc->src, ins, &lc->inn, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    lc->dst->spaces(lc->dst, NULL, NULL, outs, &outn, NULL, NULL, NULL, NULL, NULL);
+
+    /* Calibration applies to device values */
+    if (calfunc != NULL && (*outs == icSigLabData || *outs == icSigXYZData)) {
+        sprintf(p->err,"icc_create_link: Can't calibrate a link to %s",
+                string_ColorSpaceSignature(*outs));
+        icmLink_end(lc);
+        return p->errc = 1;
+    }
+
+    p->header->deviceClass = icSigLinkClass;
+    p->header->colorSpace  = *ins;
+    p->header->pcs         = *outs;
+    if (intent == icmAbsolutePerceptual)
+        p->header->renderingIntent = icPerceptual;
+    else if (intent == icmAbsoluteSaturation)
+        p->header->renderingIntent = icSaturation;
+    else
+        p->header->renderingIntent = intent;
+
+    /* Profile description */
+    if ((dp = (icmTextDescription *)p->add_tag(p, icSigProfileDescriptionTag,
+                                               icSigTextDescriptionType)) == NULL) {
+        icmLink_end(lc);
+        return p->errc;
+    }
+    dp->size = strlen("Device link") + 1;
+    if ((rv = dp->allocate((icmBase *)dp)) != 0) {
+        icmLink_end(lc);
+        return rv;
+    }
+    strcpy(dp->desc, "Device link");
+
+    /* Copyright */
+    if ((cp = (icmText *)p->add_tag(p, icSigCopyrightTag, icSigTextType)) == NULL) {
+        icmLink_end(lc);
+        return p->errc;
+    }
+    cp->size = strlen("Device link created by icclib") + 1;
+    if ((rv = cp->allocate((icmBase *)cp)) != 0) {
+        icmLink_end(lc);
+        return rv;
+    }
+    strcpy(cp->data, "Device link created by icclib");
+
+    /* The profiles the link was made from */
+    if ((sq = (icmProfileSequenceDesc *)p->add_tag(p, icSigProfileSequenceDescTag,
+                                                    icSigProfileSequenceDescType)) == NULL) {
+        icmLink_end(lc);
+        return p->errc;
+    }
+    sq->count = 2;
+    if ((rv = sq->allocate((icmBase *)sq)) != 0
+     || (rv = icmLink_set_desc(&sq->data[0], src)) != 0
+     || (rv = icmLink_set_desc(&sq->data[1], dst)) != 0) {
+        icmLink_end(lc);
+        return p->errc = rv;
+    }
+
+    /* The link conversion */
+    if ((wo = (icmLut *)p->add_tag(p, icSigAToB0Tag, icSigLut16Type)) == NULL) {
+        icmLink_end(lc);
+        return p->errc;
+    }
+    wo->inputChan = lc->inn;
+    wo->outputChan = outn;
+    wo->inputEnt = LINK_SHPRES;
+    wo->outputEnt = calfunc != NULL ? LINK_CALRES : 256;
+    *pwo = wo;
+
+    return 0;
+}
+
+/* Size the link A2B0 to res and fill it by sampling the conversion, */
+/* through the shaper curves if lc->shp is set, and with the */
+/* calibration in the output tables if lc->cal is set. */
+static int icmLink_fill(
+    icmLinkCtx *lc,
+    icmLut *wo,
+    icColorSpaceSignature ins,
+    icColorSpaceSignature outs,
+    int res,
+    int nthreads
+) {
+    int rv;
+
+    /* Don't re-use lookups of the previous contents */
+    icc_flush_lucache(wo->icp);
+
+    wo->clutPoints = res;
+    if ((rv = wo->allocate((icmBase *)wo)) != 0)
+        return rv;
+
+    return icmSetMultiLutTables_x(1, &wo, ICM_CLUT_SET_MT, (void *)lc, ins, outs,
+                                  lc->shp != NULL ? icmLink_infunc : NULL, NULL, NULL,
+                                  lc->shp != NULL ? icmLink_shclutfunc : icmLink_clutfunc,
+                                  NULL, NULL, lc->cal != NULL ? icmLink_outfunc : NULL,
+                                  nthreads, NULL);
+}
+
+/* Do one lookup, so that any reverse curve tables */
+/* are built before the conversion is sampled in parallel. */
+static void icmLink_warmup(icmLinkCtx *lc) {
+    double inmin[MAX_CHAN], inmax[MAX_CHAN], outmin[MAX_CHAN], outmax[MAX_CHAN];
+    double in[MAX_CHAN], out[MAX_CHAN], lab[3];
+    int i;
+
+    lc->src->get_ranges(lc->src, inmin, inmax, outmin, outmax);
+    for (i = 0; i < lc->inn; i++)
+        in[i] = 0.5 * (inmin[i] + inmax[i]);
+    icmLink_clutfunc((void *)lc, out, in);
+    if (lc->chk != NULL)
+        lc->chk->lookup(lc->chk, lab, out);
+}
+
+/* Default and maximum cLUT resolution for a number of inputs */
+static int icmLink_dres(int inn) {
+    static int dres[] = { 0, 255, 65, 33, 17, 9 };
+    return inn < 6 ? dres[inn] : 5;
+}
+
+/* Create a device link profile in an empty icc, by sampling the */
+/* device to PCS conversion of src followed by the PCS to device */
+/* conversion of dst onto a Lut16 grid of res points per dimension */
+/* (0 = default for the number of inputs). The grid is evaluated */
+/* using nthreads threads (0 = icmNumThreads()). If calfunc is not */
+/* NULL, it is a per channel device calibration that is applied to */
+/* the destination device values, and is folded into the output */
+/* tables, so that the link converts straight to calibrated values. */
+/* Return 0 on success, error code on failure. */
+static int icc_create_link_x(
+    icc *p,
+    icc *src,                    /* Source profile */
+    icc *dst,                    /* Destination profile */
+    icRenderingIntent intent,    /* Intent, icmDefaultIntent for the source default */
+    int res,                    /* Clut resolution, 0 for default */
+    void (*calfunc)(void *cntx, double *out, double *in),    /* Calibration, NULL if none */
+    void *cntx,                    /* Context for calfunc */
+    int nthreads                /* Number of threads, 0 for default */
+) {
+    icmLinkCtx lc;
+    icColorSpaceSignature ins, outs;
+    icmLut *wo;
+    int rv = 0;
+
+    if ((rv = icmLink_begin(p, src, dst, intent, calfunc, cntx, &lc, &ins, &outs, &wo)) != 0)
+        return rv;
+
+    if (res == 0)
+        res = icmLink_dres(lc.inn);
+    if (res < 2 || res > 255) {
+        sprintf(p->err,"icc_create_link: Clut resolution %d out of range",res);
+        icmLink_end(&lc);
+        return p->errc = 1;
+    }
+
+    icmLink_warmup(&lc);
+    rv = icmLink_fill(&lc, wo, ins, outs, res, nthreads);
+
+    icmLink_end(&lc);
+
+    return rv;
+}
+
+/* Create an uncalibrated device link profile. */
+/* (backwards compatible version) */
+static int icc_create_link(
+    icc *p,
+    icc *src,                    /* Source profile */
+    icc *dst,                    /* Destination profile */
+    icRenderingIntent intent,    /* Intent, icmDefaultIntent for the source default */
+    int res,                    /* Clut resolution, 0 for default */
+    int nthreads                /* Number of threads, 0 for default */
+) {
+    return icc_create_link_x(p, src, dst, intent, res, NULL, NULL, nthreads);
+}
+
+/* Measure the link in p against the conversion, */
+/* returning the statistics and 95th percentile. */
+static int icmLink_measure(icc *p, icmLinkFitCtx *fx, int nthreads, icmStats *st, double *p95) {
+    double pct = 95.0;
+    int rv;
+
+    if ((fx->luo = p->get_luobj(p, icmFwd, icmDefaultIntent, icmSigDefaultData,
+                                icmLuOrdNorm)) == NULL)
+        return p->errc;
+    rv = icmParallel(nthreads, (fx->n + LINK_FITCHUNK - 1)/LINK_FITCHUNK, (void *)fx,
+                     icmLink_fit_job);
+    fx->luo->del(fx->luo);
+    fx->luo = NULL;
+    if (rv != 0)
+        return p->errc = rv;
+
+    if (icmArrayStats(p->al, st, fx->de, fx->n, nthreads) != 0
+     || icmArrayPercentiles(p->al, p95, &pct, 1, fx->de, fx->n) != 0) {
+        sprintf(p->err,"icc_create_link_fit: malloc failed");
+        return p->errc = 2;
+    }
+    return 0;
+}
+
+/* Compute shaper curves for each input of the conversion, that place the */
+/* cLUT grid points evenly along the Lab arc length of the destination */
+/* output, averaged over lines parallel to that input axis. */
+static int icmLink_shapers(icc *p, icmLinkFitCtx *fx, double (*shp)[LINK_SHPRES],
+                           int nthreads) {
+    int inn = fx->lc->inn, e, l, i, rv;
+    double tot;
+
+    if ((fx->arc = (double *) p->al->malloc(p->al, sizeof(double)
+                                * inn * LINK_SHPLINES * LINK_SHPRES)) == NULL) {
+        sprintf(p->err,"icc_create_link_fit: malloc failed");
+        return p->errc = 2;
+    }
+    if ((rv = icmParallel(nthreads, inn * LINK_SHPLINES, (void *)fx, icmLink_shp_job)) != 0) {
+        p->al->free(p->al, fx->arc);
+        return p->errc = rv;
+    }
+
+    for (e = 0; e < inn; e++) {
+        shp[e][0] = 0.0;
+        for (i = 1; i < LINK_SHPRES; i++) {
+            shp[e][i] = shp[e][i-1];
+            for (l = 0; l < LINK_SHPLINES; l++)
+                shp[e][i] += fx->arc[(e * LINK_SHPLINES + l) * LINK_SHPRES + i];
+        }
+        tot = shp[e][LINK_SHPRES-1];
+        for (i = 0; i < LINK_SHPRES; i++) {
+            double t = i/(LINK_SHPRES-1.0);
+            if (tot > 1e-9)
+                shp[e][i] = LINK_SHPLIN * t + (1.0 - LINK_SHPLIN) * shp[e][i]/tot;
+            else
+                shp[e][i] = t;
+        }
+        shp[e][LINK_SHPRES-1] = 1.0;
+    }
+    p->al->free(p->al, fx->arc);
+    fx->arc = NULL;
+
+    return 0;
+}
+
+/* Search increasing resolutions for the smallest link that meets maxde. */
+/* The test points and their reference values are set up in fx. */
+static int icmLink_fit(
+    icc *p,
+    icmLinkFitCtx *fx,
+    icmLut *wo,
+    icColorSpaceSignature ins,
+    icColorSpaceSignature outs,
+    double (*shp)[LINK_SHPRES],    /* Shaper curves to try, NULL if none */
+    double maxde,
+    int maxres,
+    icmLinkFit *fit,
+    int nthreads
+) {
+    static int ladder[] = { 5, 9, 13, 17, 21, 25, 33, 41, 49, 65, 97, 129, 193, 255 };
+    icmLinkCtx *lc = fx->lc;
+    void (*cal)(void *cntx, double *out, double *in) = lc->cal;
+    icmStats st, bst;
+    double p95, bp95 = 0.0;
+    int li, sh, nsh = shp != NULL ? 2 : 1;
+    int res, bres = 0, bsh = 0, met = 0;
+    int rv;
+
+    /* The error is measured on the uncalibrated device values */
+    lc->cal = NULL;
+
+    for (li = 0, res = 0; res < maxres; li++) {
+        if (li >= (int)(sizeof(ladder)/sizeof(int)) || ladder[li] > maxres)
+            res = maxres;
+        else
+            res = ladder[li];
 
-                    if (order != icmLuOrdRev) {
-                        /* Try Lut type lookup first */
-                        if ((luobj = icc_new_icmLuLut(p, ttag,
-                             p->header->colorSpace, pcs, pcs,
-                             p->header->colorSpace, e_pcs, e_pcs,
-                             intent, func)) != NULL) {
-                            break;
-                        }
-    
-                        /* See if it could be a matrix lookup */
-                        if ((luobj = new_icmLuMatrixFwd(p,
-                             p->header->colorSpace, pcs, pcs,
-                             p->header->colorSpace, e_pcs, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
-                        /* See if it could be a monochrome lookup */
-                        if ((luobj = new_icmLuMonoFwd(p,
-                             p->header->colorSpace, pcs, pcs,
-                             p->header->colorSpace, e_pcs, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-                    } else {
-                        /* See if it could be a monochrome lookup */
-                        if ((luobj = new_icmLuMonoFwd(p,
-                             p->header->colorSpace, pcs, pcs,
-                             p->header->colorSpace, e_pcs, e_pcs,
-                             intent, func)) != NULL)
-                            break;
+        /* Try without and with the shapers, and keep the best */
+        for (sh = 0; sh < nsh; sh++) {
+            lc->shp = sh ? shp : NULL;
+            if ((rv = icmLink_fill(lc, wo, ins, outs, res, nthreads)) != 0
+             || (rv = icmLink_measure(p, fx, nthreads, &st, &p95)) != 0)
+                return rv;
+            if (sh == 0 || p95 < bp95) {
+                bres = res;
+                bsh = sh;
+                bst = st;
+                bp95 = p95;
+            }
+        }
+        if (bp95 <= maxde) {
+            met = 1;
+            break;
+        }
+    }
 
-                        /* See if it could be a matrix lookup */
-                        if ((luobj = new_icmLuMatrixFwd(p,
-                             p->header->colorSpace, pcs, pcs,
-                             p->header->colorSpace, e_pcs, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
-                        /* Try Lut type lookup last */
-                        if ((luobj = icc_new_icmLuLut(p, ttag,
-                             p->header->colorSpace, pcs, pcs,
-                             p->header->colorSpace, e_pcs, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-                    }
-                    break;
+    /* Re-make the best, if it wasn't the last one made, */
+    /* or it is to be calibrated */
+    lc->cal = cal;
+    if (bsh != (nsh - 1) || cal != NULL) {
+        lc->shp = bsh ? shp : NULL;
+        if ((rv = icmLink_fill(lc, wo, ins, outs, bres, nthreads)) != 0)
+            return rv;
+    }
 
-                case icmBwd:    /* PCS to Device */
+    if (fit != NULL) {
+        fit->res = bres;
+        fit->shaped = bsh;
+        fit->met = met;
+        fit->de = bst;
+        fit->p95 = bp95;
+    }
+    return 0;
+}
 
-                    if (intent == icmDefaultIntent)
-                        intent = icPerceptual;            /* Make this the default */
+/* Create a device link profile in an empty icc like create_link(), */
+/* but choose the smallest cLUT resolution, with or without per input */
+/* shaper curves, for which the 95th percentile CIEDE2000 error of the */
+/* link at stratified off-grid points, compared to the conversion it */
+/* samples, is no more than maxde. The error is measured in the Lab of */
+/* the destination relative colorimetric forward conversion. If the */
+/* target can't be met, the best link at maxres (0 = default) is made. */
+/* The achieved error is returned in *fit if it is not NULL. A calfunc */
+/* is folded into the output tables as for create_link_x(), after the */
+/* resolution is chosen, and isn't part of the error measured. */
+/* Return 0 on success, error code on failure. */
+static int icc_create_link_fit(
+    icc *p,
+    icc *src,                    /* Source profile */
+    icc *dst,                    /* Destination profile */
+    icRenderingIntent intent,    /* Intent, icmDefaultIntent for the source default */
+    double maxde,                /* 95th percentile Delta E 2000 target */
+    int maxres,                    /* Maximum clut resolution, 0 for default */
+    icmLinkFit *fit,            /* Return the achieved error, NULL if not needed */
+    void (*calfunc)(void *cntx, double *out, double *in),    /* Calibration, NULL if none */
+    void *cntx,                    /* Context for calfunc */
+    int nthreads                /* Number of threads, 0 for default */
+) {
+    icmLinkCtx lc;
+    icmLinkFitCtx fx;
+    icColorSpaceSignature ins, outs;
+    double inmin[MAX_CHAN], inmax[MAX_CHAN], outmin[MAX_CHAN], outmax[MAX_CHAN];
+    double (*shp)[LINK_SHPRES] = NULL;
+    icmLut *wo;
+    unsigned int i;
+    int rv = 0;
 
-                    switch (intent) {
-                        case icRelativeColorimetric:
-                        case icAbsoluteColorimetric:
-                                ttag = icSigBToA1Tag;
-                            break;
-                        case icPerceptual:
-                        case icmAbsolutePerceptual:        /* Special icclib intent */
-                                ttag = icSigBToA0Tag;
-                            break;
-                        case icSaturation:
-                        case icmAbsoluteSaturation:        /* Special icclib intent */
-                                ttag = icSigBToA2Tag;
-                            break;
-                        default:
-                            sprintf(p->err,"icc_get_luobj: Unknown intent");
-                            p->errc = 1;
-                            return NULL;
-                    }
+    if ((rv = icmLink_begin(p, src, dst, intent, calfunc, cntx, &lc, &ins, &outs, &wo)) != 0)
+        return rv;
 
-                    if (order != icmLuOrdRev) {
-                        /* Try Lut type lookup first */
-                        if ((luobj = icc_new_icmLuLut(p, ttag,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
-                        /* See if it could be a matrix lookup */
-                        if ((luobj = new_icmLuMatrixBwd(p,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
-                        /* See if it could be a monochrome lookup */
-                        if ((luobj = new_icmLuMonoBwd(p,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-                    } else {
-                        /* See if it could be a monochrome lookup */
-                        if ((luobj = new_icmLuMonoBwd(p,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
+    if (maxres == 0)
+        maxres = icmLink_dres(lc.inn);
+    if (maxres < 2 || maxres > 255) {
+        sprintf(p->err,"icc_create_link_fit: Clut resolution %d out of range",maxres);
+        icmLink_end(&lc);
+        return p->errc = 1;
+    }
+    if (nthreads <= 0)
+        nthreads = icmNumThreads();
+
+    if ((lc.chk = dst->get_luobj(dst, icmFwd, icRelativeColorimetric, icSigLabData,
+                                  icmLuOrdNorm)) == NULL) {
+        sprintf(p->err,"icc_create_link_fit: Destination check lookup failed: %.400s",dst->err);
+        icmLink_end(&lc);
+        return p->errc = dst->errc != 0 ? dst->errc : 1;
+    }
+    icmLink_warmup(&lc);
+
+    /* The stratified test points */
+    memset((void *)&fx, 0, sizeof(icmLinkFitCtx));
+    fx.lc = &lc;
+    lc.src->get_ranges(lc.src, inmin, inmax, outmin, outmax);
+    fx.inmin = inmin;
+    fx.inmax = inmax;
+    fx.n = LINK_FITPTS;
+    fx.in = (double *) p->al->malloc(p->al, sizeof(double) * fx.n * lc.inn);
+    fx.ref = (double *) p->al->malloc(p->al, sizeof(double) * fx.n * 3);
+    fx.de = (double *) p->al->malloc(p->al, sizeof(double) * fx.n);
+
+    /* Shapers only make sense for device spaces, where the */
+    /* input table represents 0.0 .. 1.0 device values */
+    if (ins != icSigLabData && ins != icSigXYZData)
+        shp = (double (*)[LINK_SHPRES]) p->al->malloc(p->al,
+                                        sizeof(double) * LINK_SHPRES * lc.inn);
+
+    if (fx.in == NULL || fx.ref == NULL || fx.de == NULL
+     || (shp == NULL && ins != icSigLabData && ins != icSigXYZData)) {
+        sprintf(p->err,"icc_create_link_fit: malloc failed");
+        rv = p->errc = 2;
+    } else {
+        /* The line points used by the shapers come first in the sequence */
+        for (i = 0; i < fx.n; i++)
+            icmHaltonPoint(fx.in + i * lc.inn, LINK_SHPLINES + i + LINK_HSKIP, lc.inn,
+                           inmin, inmax);
+
+        if ((rv = icmParallel(nthreads, (fx.n + LINK_FITCHUNK - 1)/LINK_FITCHUNK,
+                              (void *)&fx, icmLink_fit_job)) != 0)
+            p->errc = rv;
+        else if (shp == NULL || (rv = icmLink_shapers(p, &fx, shp, nthreads)) == 0)
+            rv = icmLink_fit(p, &fx, wo, ins, outs, shp, maxde, maxres, fit, nthreads);
+    }
+
+    if (shp != NULL)
+        p->al->free(p->al, shp);
+    if (fx.in != NULL)
+        p->al->free(p->al, fx.in);
+    if (fx.ref != NULL)
+        p->al->free(p->al, fx.ref);
+    if (fx.de != NULL)
+        p->al->free(p->al, fx.de);
+    icmLink_end(&lc);
 
-                        /* See if it could be a matrix lookup */
-                        if ((luobj = new_icmLuMatrixBwd(p,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-    
-                        /* Try Lut type lookup last */
-                        if ((luobj = icc_new_icmLuLut(p, ttag,
-                             pcs, p->header->colorSpace, pcs,
-                             e_pcs, p->header->colorSpace, e_pcs,
-                             intent, func)) != NULL)
-                            break;
-                    }
-                    break;
+    return rv;
+}
 
-                case icmGamut:    /* PCS to 1D */
+/* ---------------------------------------------------------- */
+/* Export of a transform as a sampled grid, for applications */
+/* that consume 3D LUT files rather than ICC profiles. */
+
+#define GRID_ROWS 256            /* Grid rows sampled per output buffer */
+#define GRID_FCHARS 24            /* Max chars of one formatted .cube value */
+
+/* Context for sampling one buffer of grid rows */
+typedef struct {
+    icmGridFormat fmt;
+    int res, inn, outn;
+    double *inmin, *inmax;
+    void *cntx;
+    void (*func)(void *cntx, double *out, double *in);
+    unsigned long row0;            /* Index of the first row in the buffer */
+    size_t rowcap;                /* Bytes allocated to each row */
+    unsigned char *buf;            /* GRID_ROWS formatted rows */
+    size_t *len;                /* Bytes used by each row */
+} icmGridCtx;
+
+/* Sample and format one row of the grid, with input channel 0 */
+/* varying fastest. Called by icmParallel() */
+static int icmWriteGrid_row(void *cntx, int thix, int jix) {
+    icmGridCtx *gx = (icmGridCtx *)cntx;
+    unsigned long row = gx->row0 + jix;
+    unsigned char *bp, *sbp;
+    double in[MAX_CHAN], out[MAX_CHAN];
+    int res = gx->res;
+    int e, f, i;
+
+    sbp = bp = gx->buf + jix * gx->rowcap;
+    for (e = 1; e < gx->inn; e++) {
+        in[e] = gx->inmin[e] + (gx->inmax[e] - gx->inmin[e]) * (double)(row % res)/(res - 1.0);
+        row /= res;
+    }
+    for (i = 0; i < res; i++) {
+        in[0] = gx->inmin[0] + (gx->inmax[0] - gx->inmin[0]) * (double)i/(res - 1.0);
+        gx->func(gx->cntx, out, in);
+
+        if (gx->fmt == icmGridCube) {
+            for (f = 0; f < gx->outn; f++) {
+                double vv = out[f];
+                if (vv > 1e9)            /* Keep within GRID_FCHARS */
+                    vv = 1e9;
+                else if (vv < -1e9)
+                    vv = -1e9;
+                bp += sprintf((char *)bp, f == 0 ? "%.6f" : " %.6f", vv);
+            }
+            *bp++ = '\n';
+        } else {
+            for (f = 0; f < gx->outn; f++) {
+                union { float f; ORD32 u; } fv;
+                fv.f = (float)out[f];
+                bp[0] = (unsigned char)(fv.u);
+                bp[1] = (unsigned char)(fv.u >> 8);
+                bp[2] = (unsigned char)(fv.u >> 16);
+                bp[3] = (unsigned char)(fv.u >> 24);
+                bp += 4;
+            }
+        }
+    }
+    gx->len[jix] = bp - sbp;
+    return 0;
+}
 
-#ifdef ICM_STRICT    /* Allow only default and absolute */
-                    if (intent != icmDefaultIntent
-                     && intent != icAbsoluteColorimetric) {
-                        sprintf(p->err,"icc_get_luobj: Intent is inappropriate for Gamut table");
-                        p->errc = 1;
-                        return NULL;
-                    }
-#else                /* Be more forgiving */
-                    switch (intent) {
-                        case icAbsoluteColorimetric:
-                        case icmAbsolutePerceptual:        /* Special icclib intent */
-                        case icmAbsoluteSaturation:        /* Special icclib intent */
-                            break;
-                        case icmDefaultIntent:
-                        case icRelativeColorimetric:
-                        case icPerceptual:
-                        case icSaturation:
-                            intent = icmDefaultIntent;    /* Make all other look like default */
-                            break;
-                        default:
-                            sprintf(p->err,"icc_get_luobj: Unknown intent (0x%x)",intent);
-                            p->errc = 1;
-                            return NULL;
-                    }
+/* Sample func() over a res^inn grid spanning inmin .. inmax, and write */
+/* it to fp. icmGridCube writes a .cube 3D LUT (inn and outn must be 3), */
+/* icmGridFloat writes the outn output values of each grid point as raw */
+/* little endian floats. Both have input channel 0 varying fastest. */
+/* The grid is sampled using up to nthreads threads (0 = icmNumThreads()) */
+/* GRID_ROWS rows at a time, and each buffer written out in order. */
+/* func() must be safe to call concurrently once it has been called once. */
+/* Return 0 on success, 1 on bad parameters, 2 on malloc failure, */
+/* 3 on a write failure. */
+int icmWriteGrid(
+    icmAlloc *al,                /* Allocator for the sample buffer */
+    icmFile *fp,                /* File to write to */
+    icmGridFormat fmt,            /* File format */
+    char *title,                /* .cube title, NULL for none */
+    int res,                    /* Grid resolution, 2 .. 256 */
+    int inn, int outn,            /* Number of input and output channels */
+    double *inmin, double *inmax,    /* Input range, NULL for 0.0 .. 1.0 */
+    void *cntx,                    /* Context for func() */
+    void (*func)(void *cntx, double *out, double *in),
+    int nthreads
+) {
+    icmGridCtx gx;
+    double dmin[MAX_CHAN], dmax[MAX_CHAN], in[MAX_CHAN], out[MAX_CHAN];
+    unsigned long nrows, row;
+    int e, j, nj, rv = 0;
+
+    if (res < 2 || res > 256 || inn < 1 || inn > MAX_CHAN || outn < 1 || outn > MAX_CHAN
+     || (fmt == icmGridCube && (inn != 3 || outn != 3))
+     || (fmt != icmGridCube && fmt != icmGridFloat))
+        return 1;
 
-#endif
-                    /* If the target tag exists, and it is a Lut */
-                    luobj = icc_new_icmLuLut(p, icSigGamutTag,
-                         pcs, icSigGrayData, pcs,
-                         e_pcs, icSigGrayData, e_pcs,
-                         intent, func);
-                    break;
+    for (nrows = 1, e = 1; e < inn; e++) {
+        if (nrows > (0xffffffffUL / res))
+            return 1;
+        nrows *= res;
+    }
 
-                case icmPreview:    /* PCS to PCS */
+    if (inmin == NULL || inmax == NULL) {
+        for (e = 0; e < inn; e++) {
+            dmin[e] = 0.0;
+            dmax[e] = 1.0;
+        }
+        inmin = dmin;
+        inmax = dmax;
+    }
 
-                    switch (intent)  {
-                        case icRelativeColorimetric:
-                                ttag = icSigPreview1Tag;
-                            break;
-                        case icPerceptual:
-                                ttag = icSigPreview0Tag;
-                            break;
-                        case icSaturation:
-                                ttag = icSigPreview2Tag;
-                            break;
-                        case icAbsoluteColorimetric:
-                        case icmAbsolutePerceptual:        /* Special icclib intent */
-                        case icmAbsoluteSaturation:        /* Special icclib intent */
-                            sprintf(p->err,"icc_get_luobj: Intent is inappropriate for preview table");
-                            p->errc = 1;
-                            return NULL;
-                        default:
-                            sprintf(p->err,"icc_get_luobj: Unknown intent");
-                            p->errc = 1;
-                            return NULL;
-                    }
+    gx.fmt = fmt;
+    gx.res = res;
+    gx.inn = inn;
+    gx.outn = outn;
+    gx.inmin = inmin;
+    gx.inmax = inmax;
+    gx.cntx = cntx;
+    gx.func = func;
+    if (fmt == icmGridCube)
+        gx.rowcap = res * (outn * GRID_FCHARS + 1);
+    else
+        gx.rowcap = res * outn * 4;
+    if ((gx.buf = (unsigned char *) al->malloc(al, gx.rowcap * GRID_ROWS)) == NULL)
+        return 2;
+    if ((gx.len = (size_t *) al->malloc(al, sizeof(size_t) * GRID_ROWS)) == NULL) {
+        al->free(al, gx.buf);
+        return 2;
+    }
 
-                    /* If the target tag exists, and it is a Lut */
-                    luobj = icc_new_icmLuLut(p, ttag,
-                         pcs, pcs, pcs,
-                         e_pcs, e_pcs, e_pcs,
-                         intent, func);
-                    break;
+    if (fmt == icmGridCube) {
+        if (title != NULL)
+            fp->gprintf(fp, "TITLE \"%s\"\n", title);
+        fp->gprintf(fp, "LUT_3D_SIZE %d\n", res);
+        fp->gprintf(fp, "DOMAIN_MIN %f %f %f\n", inmin[0], inmin[1], inmin[2]);
+        fp->gprintf(fp, "DOMAIN_MAX %f %f %f\n", inmax[0], inmax[1], inmax[2]);
+    }
 
-                default:
-                    sprintf(p->err,"icc_get_luobj: Inaproptiate function requested");
-                    p->errc = 1;
-                    return NULL;
+    /* Do one lookup, so that anything created lazily */
+    /* exists before the grid is sampled in parallel. */
+    for (e = 0; e < inn; e++)
+        in[e] = 0.5 * (inmin[e] + inmax[e]);
+    func(cntx, out, in);
+
+    for (row = 0; row < nrows; row += nj) {
+        nj = nrows - row < GRID_ROWS ? (int)(nrows - row) : GRID_ROWS;
+        gx.row0 = row;
+        icmParallel(nthreads, nj, (void *)&gx, icmWriteGrid_row);
+
+        for (j = 0; j < nj; j++) {
+            if (fp->write(fp, gx.buf + j * gx.rowcap, 1, gx.len[j]) != gx.len[j]) {
+                rv = 3;
+                break;
             }
+        }
+        if (rv != 0)
             break;
+    }
 
-        case icSigLinkClass:
-            /* Expect AToB0 Lut and optional BToA0 Lut, One intent in header */
-            /* Device <-> Device */
+    al->free(al, gx.len);
+    al->free(al, gx.buf);
 
-            if (intent != p->header->renderingIntent
-             && intent != icmDefaultIntent) {
-                sprintf(p->err,"icc_get_luobj: Intent is inappropriate for Link profile");
-                p->errc = 1;
-                return NULL;
-            }
-            intent = p->header->renderingIntent;
+    if (rv == 0 && fp->flush(fp) != 0)
+        rv = 3;
+    return rv;
+}
 
-            /* Determine the algorithm and set its parameters */
-            switch (func) {
-                case icmFwd:    /* Device to PCS (== Device) */
+/* Lookup callback for icmLuWriteGrid() */
+static void icmLuWriteGrid_func(void *cntx, double *out, double *in) {
+    icmLuBase *p = (icmLuBase *)cntx;
 
-                    luobj = icc_new_icmLuLut(p, icSigAToB0Tag,
-                         p->header->colorSpace, pcs, pcs,
-                         p->header->colorSpace, pcs, pcs,
-                         intent, func);
-                    break;
+    p->lookup(p, out, in);
+}
+
+/* Write the transform of an icmLuBase as a grid file, sampled over its */
+/* input range. Return an error code, with the message in p->icp->err */
+int icmLuWriteGrid(
+    icmLuBase *p,
+    icmFile *fp,
+    icmGridFormat fmt,
+    char *title,
+    int res,
+    int nthreads
+) {
+    icc *icp = p->icp;
+    double inmin[MAX_CHAN], inmax[MAX_CHAN], outmin[MAX_CHAN], outmax[MAX_CHAN];
+    int inn, outn, rv;
+
+    p->spaces(p, NULL, &inn, NULL, &outn, NULL, NULL, NULL, NULL, NULL);
+    p->get_ranges(p, inmin, inmax, outmin, outmax);
+
+    rv = icmWriteGrid(icp->al, fp, fmt, title, res, inn, outn, inmin, inmax,
+                      (void *)p, icmLuWriteGrid_func, nthreads);
+    if (rv == 1)
+        sprintf(icp->err,"icmLuWriteGrid: Can't write %d -> %d channels at res %d in format %d",
+                inn, outn, res, fmt);
+    else if (rv == 2)
+        sprintf(icp->err,"icmLuWriteGrid: malloc() failed");
+    else if (rv == 3)
+        sprintf(icp->err,"icmLuWriteGrid: Write failed");
+    return icp->errc = rv;
+}
+
+/* ---------------------------------------------------------- */
+/* Lookups directly on the caller's pixel buffers. Each pixel is */
+/* unpacked into a double vector, looked up and packed again, */
+/* so no double image copies are needed. */
+
+#define PIX_CHUNK 4096            /* Pixels per parallel job */
+
+/* A pixel format resolved against a color channel count */
+typedef struct {
+    icmPixDepth depth;
+    int packed;                    /* NZ if the channels are packed in a 32 bit word */
+    int ncol, nx;                /* Number of color and extra channels */
+    size_t pstep;                /* Bytes between pixels */
+    size_t rstride;                /* Bytes between rows */
+    size_t coff[MAX_CHAN];        /* Offset (bit shift if packed) of each color channel */
+    size_t xoff[ICM_PIX_MAXEXTRA];    /* Offset (bit shift if packed) of each extra channel */
+    double sc[MAX_CHAN], of[MAX_CHAN];    /* Color value = raw * sc + of */
+    double xmax;                /* Full scale of an extra channel */
+} icmPixLayout;
+
+/* Initialise a pixel format descriptor for a tightly packed buffer */
+/* of nchan channels in order, width pixels wide and height rows high. */
+void icmPixFmtInit(
+    icmPixFmt *f,
+    icmPixDepth depth,
+    int nchan,
+    int planar,
+    unsigned int width,
+    unsigned int height
+) {
+    int i;
+
+    f->depth = depth;
+    f->nchan = nchan;
+    f->planar = planar;
+    for (i = 0; i < MAX_CHAN; i++)
+        f->order[i] = i;
+    if (ICM_PIX_PACKED(depth)) {
+        f->planar = 0;
+        f->rowstride = (size_t)width * ICM_PIX_BYTES(depth);
+        f->planestride = 0;
+    } else if (planar) {
+        f->rowstride = (size_t)width * ICM_PIX_BYTES(depth);
+        f->planestride = f->rowstride * height;
+    } else {
+        f->rowstride = (size_t)width * nchan * ICM_PIX_BYTES(depth);
+        f->planestride = 0;
+    }
+}
+
+/* Resolve a pixel format for ncol color channels spanning min .. max. */
+/* Return nz if it isn't usable */
+static int icmPix_layout(icmPixLayout *l, icmPixFmt *f, int ncol, double *min, double *max) {
+    int i, j, used[MAX_CHAN + ICM_PIX_MAXEXTRA];
+    size_t cstep;
+    double full;
+
+    if ((f->depth != icmPix8 && f->depth != icmPix16 && f->depth != icmPixFloat
+      && f->depth != icmPixDouble && f->depth != icmPixHalf && f->depth != icmPix10)
+     || f->nchan < ncol || f->nchan > (ncol + ICM_PIX_MAXEXTRA))
+        return 1;
+
+    l->depth = f->depth;
+    l->packed = ICM_PIX_PACKED(f->depth) != 0;
+    l->ncol = ncol;
+    l->nx = f->nchan - ncol;
+    l->rstride = f->rowstride;
+    if (l->packed) {
+        /* Three 10 bit fields and an extra 2 bit one */
+        if (f->planar || f->nchan > 4)
+            return 1;
+        l->pstep = ICM_PIX_BYTES(f->depth);
+        cstep = 10;
+    } else if (f->planar) {
+        l->pstep = ICM_PIX_BYTES(f->depth);
+        cstep = f->planestride;
+    } else {
+        l->pstep = f->nchan * ICM_PIX_BYTES(f->depth);
+        cstep = ICM_PIX_BYTES(f->depth);
+    }
 
-                case icmBwd:    /* PCS (== Device) to Device */
+    for (i = 0; i < f->nchan; i++)
+        used[i] = 0;
+    for (i = 0; i < ncol; i++) {
+        if (f->order[i] < 0 || f->order[i] >= f->nchan || used[f->order[i]]
+         || (l->packed && f->order[i] > 2))
+            return 1;
+        used[f->order[i]] = 1;
+        l->coff[i] = f->order[i] * cstep;
+    }
+    for (i = j = 0; i < f->nchan; i++) {
+        if (!used[i])
+            l->xoff[j++] = i * cstep;
+    }
+
+    /* Integer values span the color space range, */
+    /* floating point values are used as they are */
+    full = f->depth == icmPix8 ? 255.0 : f->depth == icmPix16 ? 65535.0
+         : f->depth == icmPix10 ? 1023.0 : 1.0;
+    for (i = 0; i < ncol; i++) {
+        if (f->depth == icmPix8 || f->depth == icmPix16 || f->depth == icmPix10) {
+            if ((l->sc[i] = (max[i] - min[i])/full) == 0.0)
+                l->sc[i] = 1.0;
+            l->of[i] = min[i];
+        } else {
+            l->sc[i] = 1.0;
+            l->of[i] = 0.0;
+        }
+    }
+    l->xmax = l->packed ? 3.0 : full;
 
-                    luobj = icc_new_icmLuLut(p, icSigBToA0Tag,
-                         pcs, p->header->colorSpace, pcs,
-                         pcs, p->header->colorSpace, pcs,
-                         intent, func);
-                    break;
+    return 0;
+}
 
-                default:
-                    sprintf(p->err,"icc_get_luobj: Inaproptiate function requested");
-                    p->errc = 1;
-                    return NULL;
-            }
-            break;
+#ifndef ICM_F16C
+/* Tables for converting half floats to floats, after */
+/* "Fast Half Float Conversions", Jeroen van der Zijp, 2008 */
+static ORD32 icmHalf_mant[2048];    /* Mantissa and denormal normalisation */
+static ORD32 icmHalf_exp[64];        /* Sign and exponent */
+static unsigned short icmHalf_off[64];    /* Offset into icmHalf_mant[] */
+static int icmHalf_inited = 0;
+#ifdef ICM_THREADS
+static pthread_mutex_t icmHalfLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-        case icSigAbstractClass:
-            /* Expect AToB0 Lut and option BToA0 Lut, with either relative or absolute intent. */
-            /* PCS <-> PCS */
-            /* Determine the algorithm and set its parameters */
+/* Compute the half float tables once */
+static void icmHalf_init(void) {
+    unsigned int i;
 
-            if (intent != icmDefaultIntent
-             && intent != icRelativeColorimetric
-             && intent != icAbsoluteColorimetric) {
-                sprintf(p->err,"icc_get_luobj: Intent is inappropriate for Abstract profile");
-                p->errc = 1;
-                return NULL;
+    ICM_LOCK(icmHalfLock);
+    if (!icmHalf_inited) {
+        icmHalf_mant[0] = 0;
+        for (i = 1; i < 1024; i++) {        /* Denormals, normalised */
+            ORD32 m = i << 13, e = 0;
+            while (!(m & 0x00800000)) {
+                e -= 0x00800000;
+                m <<= 1;
             }
+            icmHalf_mant[i] = (m & ~0x00800000) | (e + 0x38800000);
+        }
+        for (i = 1024; i < 2048; i++)
+            icmHalf_mant[i] = 0x38000000 + ((i - 1024) << 13);
 
-            switch (func) {
-                case icmFwd:    /* PCS (== Device) to PCS */
+        icmHalf_exp[0] = 0;
+        icmHalf_exp[32] = 0x80000000;
+        for (i = 1; i < 31; i++) {
+            icmHalf_exp[i] = i << 23;
+            icmHalf_exp[32 + i] = 0x80000000 + (i << 23);
+        }
+        icmHalf_exp[31] = 0x47800000;        /* Inf and NaN */
+        icmHalf_exp[63] = 0xC7800000;
 
-                    luobj = icc_new_icmLuLut(p, icSigAToB0Tag,
-                         p->header->colorSpace, pcs, pcs,
-                         e_pcs, e_pcs, e_pcs,
-                         intent, func);
-                    break;
+        for (i = 0; i < 64; i++)
+            icmHalf_off[i] = (i == 0 || i == 32) ? 0 : 1024;
+        icmHalf_inited = 1;
+    }
+    ICM_UNLOCK(icmHalfLock);
+}
+#endif /* !ICM_F16C */
 
-                case icmBwd:    /* PCS to PCS (== Device) */
+/* Convert a half float to a float */
+static float icmHalf2f(unsigned short hv) {
+#ifdef ICM_F16C
+    return _cvtsh_ss(hv);
+#else
+    ORD32 x = icmHalf_mant[icmHalf_off[hv >> 10] + (hv & 0x3ff)] + icmHalf_exp[hv >> 10];
+    float fv;
+    memcpy(&fv, &x, sizeof(fv));
+    return fv;
+#endif
+}
 
-                    luobj = icc_new_icmLuLut(p, icSigBToA0Tag,
-                         pcs, p->header->colorSpace, pcs,
-                         e_pcs, e_pcs, e_pcs,
-                         intent, func);
-                    break;
+/* Convert a float to a half float, rounding to nearest even */
+static unsigned short icmF2half(float fv) {
+#ifdef ICM_F16C
+    return _cvtss_sh(fv, 0);
+#else
+    ORD32 x, ax, sign, m;
+    int sh;
+
+    memcpy(&x, &fv, sizeof(x));
+    sign = (x >> 16) & 0x8000;
+    ax = x & 0x7fffffff;
+
+    if (ax >= 0x7f800000)                /* Inf or NaN */
+        return (unsigned short)(sign | 0x7c00 | (ax > 0x7f800000 ? 0x200 : 0));
+    if (ax >= 0x477ff000)                /* Rounds to more than 65504 */
+        return (unsigned short)(sign | 0x7c00);
+    if (ax < 0x33000000)                /* Rounds to less than the smallest denormal */
+        return (unsigned short)sign;
+
+    /* Round by adding just under half, plus the bit that makes ties go */
+    /* to even, so that there is no data dependent branch. A carry out */
+    /* of the mantissa correctly bumps the exponent. */
+    if (ax < 0x38800000) {                /* Half denormal */
+        m = (ax & 0x7fffff) | 0x800000;
+        sh = 126 - (int)(ax >> 23);
+        return (unsigned short)(sign | ((m + (1u << (sh - 1)) - 1 + ((m >> sh) & 1)) >> sh));
+    }
+    ax -= 0x38000000;                    /* Half normal */
+    return (unsigned short)(sign | ((ax + 0xfff + ((ax >> 13) & 1)) >> 13));
+#endif
+}
 
-                default:
-                    sprintf(p->err,"icc_get_luobj: Inaproptiate function requested");
-                    p->errc = 1;
-                    return NULL;
-            }
+/* Read the raw value at bp */
+static double icmPix_get(unsigned char *bp, icmPixDepth depth) {
+    switch (depth) {
+        case icmPix8:
+            return (double)*bp;
+        case icmPix16: {
+            unsigned short vv;
+            memcpy(&vv, bp, sizeof(vv));
+            return (double)vv;
+        }
+        case icmPixFloat: {
+            float vv;
+            memcpy(&vv, bp, sizeof(vv));
+            return (double)vv;
+        }
+        case icmPixHalf: {
+            unsigned short vv;
+            memcpy(&vv, bp, sizeof(vv));
+            return (double)icmHalf2f(vv);
+        }
+        default: {
+            double vv;
+            memcpy(&vv, bp, sizeof(vv));
+            return vv;
+        }
+    }
+}
+
+/* Write the raw value vv at bp, rounding and clipping integers */
+static void icmPix_put(unsigned char *bp, icmPixDepth depth, double vv) {
+    switch (depth) {
+        case icmPix8:
+            vv = floor(vv + 0.5);
+            *bp = (unsigned char)(vv < 0.0 ? 0.0 : vv > 255.0 ? 255.0 : vv);
+            break;
+        case icmPix16: {
+            unsigned short sv;
+            vv = floor(vv + 0.5);
+            sv = (unsigned short)(vv < 0.0 ? 0.0 : vv > 65535.0 ? 65535.0 : vv);
+            memcpy(bp, &sv, sizeof(sv));
+            break;
+        }
+        case icmPixFloat: {
+            float fv = (float)vv;
+            memcpy(bp, &fv, sizeof(fv));
+            break;
+        }
+        case icmPixHalf: {
+            unsigned short hv = icmF2half((float)vv);
+            memcpy(bp, &hv, sizeof(hv));
+            break;
+        }
+        default:
+            memcpy(bp, &vv, sizeof(vv));
             break;
+    }
+}
 
-        case icSigNamedColorClass:
-            /* Expect Name -> Device, Optional PCS */
-            /* and a reverse lookup would be useful */
-            /* (ie. PCS or Device coords to closest named color) */
-            /* ~~ to be implemented ~~ */
+/* Round and clip vv to a packed field of maximum value max */
+static ORD32 icmPix_field(double vv, double max) {
+    vv = floor(vv + 0.5);
+    return (ORD32)(vv < 0.0 ? 0.0 : vv > max ? max : vv);
+}
 
-            /* ~~ Absolute intent is valid for processing of */
-            /* PCS from named Colors. Also allow for e_pcs */
-            if (intent != icmDefaultIntent
-             && intent != icRelativeColorimetric
-             && intent != icAbsoluteColorimetric) {
-                sprintf(p->err,"icc_get_luobj: Intent is inappropriate for Named Color profile");
-                p->errc = 1;
-                return NULL;
-            }
+/* Context for converting a buffer in parallel */
+typedef struct {
+    icmLuBase *lu;                /* Lookup used for each pixel */
+    icmPixLayout il, ol;
+    unsigned char *in, *out;
+    unsigned int width;
+    int cpr;                    /* Chunks per row */
+    int pcsconv;                /* 1 = XYZ to Lab after lu, -1 = Lab to XYZ before it, 0 = none */
+    icmXYZNumber pcswht;        /* White point of the PCS conversion */
+    double *pbuf;                /* PIX_CHUNK PCS values per thread for the PCS conversion */
+} icmPixCtx;
 
-            sprintf(p->err,"icc_get_luobj: Named Colors not handled yet");
-            p->errc = 1;
-            return NULL;
+/* Unpack the color values of the input pixel at ip */
+static void icmPix_unpack(icmPixLayout *il, double *iv, unsigned char *ip) {
+    ORD32 iw;
+    int i;
 
-        default:
-            sprintf(p->err,"icc_get_luobj: Unknown profile class");
-            p->errc = 1;
-            return NULL;
+    if (il->packed) {
+        memcpy(&iw, ip, sizeof(iw));
+        for (i = 0; i < il->ncol; i++)
+            iv[i] = (double)((iw >> il->coff[i]) & 0x3ff) * il->sc[i] + il->of[i];
+    } else {
+        for (i = 0; i < il->ncol; i++)
+            iv[i] = icmPix_get(ip + il->coff[i], il->depth) * il->sc[i] + il->of[i];
+    }
+}
+
+/* Pack the color values ov into the output pixel at op, */
+/* copying the extra channels from the input pixel at ip */
+static void icmPix_pack(icmPixLayout *ol, icmPixLayout *il, unsigned char *op,
+                        double *ov, unsigned char *ip) {
+    double xv[ICM_PIX_MAXEXTRA];
+    ORD32 iw, ow;
+    int i;
+
+    /* Extra channels pass through, rescaled to the output depth */
+    if (il->packed)
+        memcpy(&iw, ip, sizeof(iw));
+    for (i = 0; i < ol->nx; i++) {
+        xv[i] = ol->xmax;
+        if (i < il->nx) {
+            if (il->packed)
+                xv[i] = (double)((iw >> il->xoff[i]) & 0x3) * ol->xmax/il->xmax;
+            else
+                xv[i] = icmPix_get(ip + il->xoff[i], il->depth) * ol->xmax/il->xmax;
+        }
     }
 
-    if (luobj == NULL) {
-        sprintf(p->err,"icc_get_luobj: Unable to locate usable conversion");
-        p->errc = 1;
+    if (ol->packed) {
+        ow = 0;
+        for (i = 0; i < ol->ncol; i++)
+            ow |= icmPix_field((ov[i] - ol->of[i])/ol->sc[i], 1023.0) << ol->coff[i];
+        for (i = 0; i < ol->nx; i++)
+            ow |= icmPix_field(xv[i], 3.0) << ol->xoff[i];
+        memcpy(op, &ow, sizeof(ow));
     } else {
-        luobj->order = order;
+        for (i = 0; i < ol->ncol; i++)
+            icmPix_put(op + ol->coff[i], ol->depth, (ov[i] - ol->of[i])/ol->sc[i]);
+        for (i = 0; i < ol->nx; i++)
+            icmPix_put(op + ol->xoff[i], ol->depth, xv[i]);
     }
+}
 
-    return luobj;
+/* Convert one chunk of one row. Called by icmParallel() */
+static int icmLuLookupPix_chunk(void *cntx, int thix, int jix) {
+    icmPixCtx *cx = (icmPixCtx *)cntx;
+    icmPixLayout *il = &cx->il, *ol = &cx->ol;
+    unsigned int row = jix / cx->cpr;
+    unsigned int x = (jix % cx->cpr) * PIX_CHUNK, xe, k;
+    unsigned char *ip, *op;
+    double iv[MAX_CHAN], ov[MAX_CHAN], *pv;
+    int rv = 0;
+
+    if ((xe = x + PIX_CHUNK) > cx->width)
+        xe = cx->width;
+    ip = cx->in + row * il->rstride + x * il->pstep;
+    op = cx->out + row * ol->rstride + x * ol->pstep;
+
+    /* The common case is done a pixel at a time */
+    if (cx->pcsconv == 0) {
+        for (; x < xe; x++, ip += il->pstep, op += ol->pstep) {
+            icmPix_unpack(il, iv, ip);
+            if (cx->lu->lookup(cx->lu, ov, iv) > 1)
+                rv = 1;
+            icmPix_pack(ol, il, op, ov, ip);
+        }
+
+    /* Look up the chunk to XYZ, and convert it all to Lab */
+    } else if (cx->pcsconv > 0) {
+        pv = cx->pbuf + (size_t)thix * PIX_CHUNK * 3;
+        for (k = 0; k < (xe - x); k++) {
+            icmPix_unpack(il, iv, ip + k * il->pstep);
+            if (cx->lu->lookup(cx->lu, pv + 3 * k, iv) > 1)
+                rv = 1;
+        }
+        icmXYZ2Lab_n(&cx->pcswht, pv, pv, xe - x);
+        for (k = 0; k < (xe - x); k++)
+            icmPix_pack(ol, il, op + k * ol->pstep, pv + 3 * k, ip + k * il->pstep);
+
+    /* Convert the whole chunk from Lab to XYZ, and look it up */
+    } else {
+        pv = cx->pbuf + (size_t)thix * PIX_CHUNK * 3;
+        for (k = 0; k < (xe - x); k++)
+            icmPix_unpack(il, pv + 3 * k, ip + k * il->pstep);
+        icmLab2XYZ_n(&cx->pcswht, pv, pv, xe - x);
+        for (k = 0; k < (xe - x); k++) {
+            if (cx->lu->lookup(cx->lu, ov, pv + 3 * k) > 1)
+                rv = 1;
+            icmPix_pack(ol, il, op + k * ol->pstep, ov, ip + k * il->pstep);
+        }
+    }
+    return rv;
 }
 
+/* Convert a width x height image from the in buffer to the out buffer, */
+/* using up to nthreads threads (0 = icmNumThreads()). Integer and */
+/* packed pixel values span the Lu's input or output range, floating */
+/* point and half float values are native color space values. Extra */
+/* channels are copied through. */
+/* Return 0 on success, 1 on a bad format, 2 if a lookup failed. */
+int icmLuLookupPix(
+    icmLuBase *p,
+    void *out, icmPixFmt *ofmt,
+    void *in, icmPixFmt *ifmt,
+    unsigned int width,
+    unsigned int height,
+    int nthreads
+) {
+    icc *icp = p->icp;
+    icmPixCtx cx;
+    double inmin[MAX_CHAN], inmax[MAX_CHAN], outmin[MAX_CHAN], outmax[MAX_CHAN];
+    double iv[MAX_CHAN], ov[MAX_CHAN];
+    icmLuBase *xlu = NULL;
+    int inn, outn, i, njobs, rv;
+
+    p->spaces(p, NULL, &inn, NULL, &outn, NULL, NULL, NULL, NULL, NULL);
+    p->get_ranges(p, inmin, inmax, outmin, outmax);
+
+    if (icmPix_layout(&cx.il, ifmt, inn, inmin, inmax) != 0
+     || icmPix_layout(&cx.ol, ofmt, outn, outmin, outmax) != 0) {
+        sprintf(icp->err,"icmLuLookupPix: Pixel format doesn't suit %d -> %d channels",inn,outn);
+        return icp->errc = 1;
+    }
+    if (width == 0 || height == 0)
+        return 0;
 
-/* Returns total ink limit and channel maximums. */
-/* Returns -1.0 if not applicable for this type of profile. */
-/* Returns -1.0 for grey, additive, or any profiles < 4 channels. */
-/* This is a place holder that uses a heuristic, */
-/* until there is a private or standard tag for this information */
-static double 
-icm_get_tac(    
-    icc *p,
-    double *chmax,                    /* device return channel sums. May be NULL */
-    void (*calfunc)(void *cntx, double *out, double *in),    /* Optional calibration func. */
-    void *cntx
-) 
-{
-    icmHeader *rh = p->header;
-    icmLuBase *luo;
-    icmLuLut *ll;
-    icmLut *lut;
-    icColorSpaceSignature outs;        /* Type of output space */
-    int inn, outn;                    /* Number of components */
-    icmLuAlgType alg;                /* Type of lookup algorithm */
-    double tac = 0.0;
-    double max[MAX_CHAN];            /* Channel maximums */
-    int i, f;
-    unsigned int uf;
-    int size;                        /* Lut table size */
-    double *gp;                        /* Pointer to grid cube base */
+#ifndef ICM_F16C
+    if (ifmt->depth == icmPixHalf || ofmt->depth == icmPixHalf)
+        icmHalf_init();
+#endif
 
-    /* If not something that can really have a TAC */
-    if (rh->deviceClass != icSigDisplayClass
-     && rh->deviceClass != icSigOutputClass
-     && rh->deviceClass != icSigLinkClass) {
-        return -1.0;
+    cx.lu = p;
+    cx.in = (unsigned char *)in;
+    cx.out = (unsigned char *)out;
+    cx.width = width;
+    cx.cpr = (width + PIX_CHUNK - 1)/PIX_CHUNK;
+    cx.pcsconv = 0;
+    cx.pbuf = NULL;
+    njobs = height * cx.cpr;
+
+    if (nthreads <= 0)
+        nthreads = icmNumThreads();
+    if (nthreads > ICM_MAX_THREADS)
+        nthreads = ICM_MAX_THREADS;
+    if (nthreads > njobs)
+        nthreads = njobs;
+
+    /* The shaper/matrix and monochrome lookups are cheap enough that */
+    /* their XYZ <-> Lab conversion is a large part of the cost. If the */
+    /* Lab PCS was asked for, look up through the XYZ PCS equivalent, */
+    /* and convert each chunk of PCS values in one go. */
+    if ((p->ttype == icmMatrixFwdType || p->ttype == icmMatrixBwdType
+      || p->ttype == icmMonoFwdType || p->ttype == icmMonoBwdType)
+     && p->pcs == icSigXYZData && p->e_pcs == icSigLabData) {
+        if ((xlu = icp->get_luobj(icp, p->function, p->intent, icSigXYZData, p->order)) != NULL
+         && xlu->ttype == p->ttype
+         && (cx.pbuf = (double *)icp->al->malloc(icp->al,
+                        (size_t)nthreads * PIX_CHUNK * 3 * sizeof(double))) != NULL) {
+            cx.lu = xlu;
+            cx.pcsconv = (p->ttype == icmMatrixFwdType || p->ttype == icmMonoFwdType) ? 1 : -1;
+            cx.pcswht = p->pcswht;
+        } else if (xlu != NULL) {    /* Just do it a pixel at a time */
+            xlu->del(xlu);
+            xlu = NULL;
+        }
+    }
+
+    /* Do one lookup, so that anything created lazily */
+    /* exists before the lookups are done in parallel. */
+    for (i = 0; i < inn; i++)
+        iv[i] = 0.5 * (inmin[i] + inmax[i]);
+    p->lookup(p, ov, iv);
+    if (xlu != NULL) {
+        if (cx.pcsconv < 0)
+            icmLab2XYZ(&cx.pcswht, iv, iv);
+        xlu->lookup(xlu, ov, iv);
+    }
+
+    rv = icmParallel(nthreads, njobs, (void *)&cx, icmLuLookupPix_chunk);
+
+    if (cx.pbuf != NULL)
+        icp->al->free(icp->al, cx.pbuf);
+    if (xlu != NULL)
+        xlu->del(xlu);
+
+    if (rv != 0) {
+        sprintf(icp->err,"icmLuLookupPix: Lookup failed");
+        return icp->errc = 2;
     }
+    return 0;
+}
 
-    /* If not a suitable color space */
-    switch (rh->colorSpace) {
-        /* Not applicable */
-        case icSigXYZData:
-        case icSigLabData:
-        case icSigLuvData:
-        case icSigYCbCrData:
-        case icSigYxyData:
-        case icSigHsvData:
-        case icSigHlsData:
-            return -1.0;
+/* ---------------------------------------------------------- */
+/* Profile catalogue. This records the header summary and tag */
+/* signatures of many profiles in a compact index, so that they can */
+/* be searched without re-reading the profiles. The index is written */
+/* in host byte order so that it can be used in place once mapped. */
+
+/* Context for summarising the profiles in parallel */
+typedef struct {
+    icmAlloc *al;
+    char **paths;
+    icmCatEntry *e;                /* Entry for each path */
+    ORD32 **tags;                /* Sorted tag signatures of each path, NULL if unreadable */
+} icmCatCtx;
+
+/* Read the header and tag table of profile jix. Called by icmParallel() */
+static int icmCatalog_scan(void *cntx, int thix, int jix) {
+    icmCatCtx *cx = (icmCatCtx *)cntx;
+    icmCatEntry *e = cx->e + jix;
+    icmFile *fp;
+    char hbuf[132], *tbuf = NULL;
+    unsigned int i, j, count;
+    ORD32 *tags = NULL;
 
-        /* Assume no limit */
-        case icSigGrayData:
-        case icSig2colorData:
-        case icSig3colorData:
-        case icSigRgbData:
-            return -1.0;
+    cx->tags[jix] = NULL;
+    if ((fp = new_icmFileStd_name_a(cx->paths[jix], "r", cx->al)) == NULL)
+        return 0;
 
-        default:
-            break;
+    if (fp->read(fp, hbuf, 1, 132) != 132
+     || read_UInt32Number(hbuf + 36) != icMagicNumber
+     || read_UInt32Number(hbuf + 0) < 132
+     || (count = read_UInt32Number(hbuf + 128)) > 357913940    /* (2^32-5)/12 */
+     || count > ((read_UInt32Number(hbuf + 0) - 128 - 4) / 12)
+     || (tbuf = (char *) cx->al->malloc(cx->al, 12 * count + 1)) == NULL
+     || (tags = (ORD32 *) cx->al->malloc(cx->al, sizeof(ORD32) * count + 1)) == NULL
+     || fp->read(fp, tbuf, 12, count) != count) {
+        if (tbuf != NULL)
+            cx->al->free(cx->al, tbuf);
+        if (tags != NULL)
+            cx->al->free(cx->al, tags);
+        fp->del(fp);
+        return 0;
     }
+    fp->del(fp);
 
-    /* Get a PCS->device colorimetric lookup */
-    if ((luo = p->get_luobj(p, icmBwd, icRelativeColorimetric, icmSigDefaultData, icmLuOrdNorm)) == NULL) {
-        if ((luo = p->get_luobj(p, icmBwd, icmDefaultIntent, icmSigDefaultData, icmLuOrdNorm)) == NULL) {
-            return -1.0;
-        }
+    e->size        = read_UInt32Number(hbuf + 0);
+    e->version     = read_UInt32Number(hbuf + 8);
+    e->deviceClass = read_UInt32Number(hbuf + 12);
+    e->colorSpace  = read_UInt32Number(hbuf + 16);
+    e->pcs         = read_UInt32Number(hbuf + 20);
+    e->intent      = read_UInt32Number(hbuf + 64);
+    memcpy(e->id, hbuf + 84, 16);
+    e->ntags       = count;
+
+    /* Keep the signatures sorted, so that queries can bisect them */
+    for (i = 0; i < count; i++) {
+        ORD32 sig = read_UInt32Number(tbuf + 12 * i);
+        for (j = i; j > 0 && tags[j-1] > sig; j--)
+            tags[j] = tags[j-1];
+        tags[j] = sig;
     }
+    cx->al->free(cx->al, tbuf);
+    cx->tags[jix] = tags;
 
-    /* Get details of conversion (Arguments may be NULL if info not needed) */
-    luo->spaces(luo, NULL, &inn, &outs, &outn, &alg, NULL, NULL, NULL, NULL);
+    return 0;
+}
 
-    /* Assume any non-Lut type doesn't have a TAC */
-    if (alg != icmLutType) {
-        return -1.0;
-    }
+/* Write a catalogue index of the n profiles named in paths[] to fp. */
+/* Only the header and tag table of each profile are read, using up to */
+/* nthreads threads (0 = icmNumThreads()). Files that aren't readable */
+/* profiles are left out, and counted in *nbad if nbad != NULL. */
+/* Return 0 on success, 2 on malloc failure, 3 on write failure */
+int icmCatalogWrite(
+    icmAlloc *al,
+    icmFile *fp,
+    char **paths,
+    unsigned int n,
+    int nthreads,
+    unsigned int *nbad
+) {
+    icmCatCtx cx;
+    icmCatHeader h;
+    unsigned int i;
+    int rv = 0;
 
-    ll = (icmLuLut *)luo;
+    cx.al = al;
+    cx.paths = paths;
+    if ((cx.e = (icmCatEntry *) al->calloc(al, n + 1, sizeof(icmCatEntry))) == NULL)
+        return 2;
+    if ((cx.tags = (ORD32 **) al->calloc(al, n + 1, sizeof(ORD32 *))) == NULL) {
+        al->free(al, cx.e);
+        return 2;
+    }
 
-    /* We have a Lut type. Search the lut for the largest values */
-    for (f = 0; f < outn; f++)
-        max[f] = 0.0;
+    icmParallel(nthreads, n, (void *)&cx, icmCatalog_scan);
 
-    lut = ll->lut;
-    gp = lut->clutTable;        /* Base of grid array */
-    size = sat_pow(lut->clutPoints,lut->inputChan);
-    for (i = 0; i < size; i++) {
-        double tot, vv[MAX_CHAN];            
-        
-        lut->lookup_output(lut,vv,gp);        /* Lookup though output tables */
-        ll->out_denormf(vv,vv);                /* Normalize for output color space */
+    /* Fill in the offsets, and pack the readable entries together */
+    h.magic = ICM_CAT_MAGIC;
+    h.version = ICM_CAT_VERSION;
+    h.order = ICM_CAT_ORDER;
+    h.count = h.ntags = h.strsize = 0;
+    for (i = 0; i < n; i++) {
+        if (cx.tags[i] == NULL)
+            continue;
+        cx.e[i].tags = h.ntags;
+        cx.e[i].path = h.strsize;
+        h.ntags += cx.e[i].ntags;
+        h.strsize += strlen(paths[i]) + 1;
+        h.count++;
+    }
+    if (nbad != NULL)
+        *nbad = n - h.count;
 
-        if (calfunc != NULL)
-            calfunc(cntx, vv, vv);            /* Apply device calibration */
+    if (fp->write(fp, &h, sizeof(icmCatHeader), 1) != 1)
+        rv = 3;
+    for (i = 0; rv == 0 && i < n; i++) {
+        if (cx.tags[i] != NULL && fp->write(fp, &cx.e[i], sizeof(icmCatEntry), 1) != 1)
+            rv = 3;
+    }
+    for (i = 0; rv == 0 && i < n; i++) {
+        if (cx.tags[i] != NULL && cx.e[i].ntags > 0
+         && fp->write(fp, cx.tags[i], sizeof(ORD32), cx.e[i].ntags) != cx.e[i].ntags)
+            rv = 3;
+    }
+    for (i = 0; rv == 0 && i < n; i++) {
+        size_t len = strlen(paths[i]) + 1;
+        if (cx.tags[i] != NULL && fp->write(fp, paths[i], 1, len) != len)
+            rv = 3;
+    }
+    if (rv == 0 && fp->flush(fp) != 0)
+        rv = 3;
 
-        for (tot = 0.0, uf = 0; uf < lut->outputChan; uf++) {
-            tot += vv[uf];
-            if (vv[uf] > max[uf])
-                max[uf] = vv[uf];
-        }
-        if (tot > tac)
-            tac = tot;
-        gp += lut->outputChan;
+    for (i = 0; i < n; i++) {
+        if (cx.tags[i] != NULL)
+            al->free(al, cx.tags[i]);
     }
+    al->free(al, cx.tags);
+    al->free(al, cx.e);
 
-    if (chmax != NULL) {
-        for (f = 0; f < outn; f++)
-            chmax[f] = max[f];
+    return rv;
+}
+
+/* Set up a catalogue from an index image, such as a mapped index file. */
+/* The image must stay valid while the catalogue is used. */
+/* Return 0 on success, 1 if it isn't a usable index */
+int icmCatalogInit(
+    icmCatalog *c,
+    void *buf,
+    size_t len
+) {
+    icmCatHeader *h = (icmCatHeader *)buf;
+    unsigned int i;
+
+    if (len < sizeof(icmCatHeader)
+     || h->magic != ICM_CAT_MAGIC
+     || h->version != ICM_CAT_VERSION
+     || h->order != ICM_CAT_ORDER        /* Written on a host with the other byte order */
+     || h->count > (len / sizeof(icmCatEntry))
+     || h->ntags > (len / sizeof(ORD32))
+     || len != (sizeof(icmCatHeader) + h->count * sizeof(icmCatEntry)
+                + h->ntags * sizeof(ORD32) + h->strsize))
+        return 1;
+
+    c->h = h;
+    c->e = (icmCatEntry *)(h + 1);
+    c->tags = (ORD32 *)(c->e + h->count);
+    c->str = (char *)(c->tags + h->ntags);
+
+    for (i = 0; i < h->count; i++) {
+        if (c->e[i].path >= h->strsize
+         || c->e[i].tags > h->ntags || c->e[i].ntags > (h->ntags - c->e[i].tags))
+            return 1;
     }
+    if (h->strsize > 0 && c->str[h->strsize-1] != '\000')
+        return 1;
 
-    luo->del(luo);
+    return 0;
+}
 
-    return tac;
+/* Return nz if catalogue entry ix has the tag signature sig */
+static int icmCatalog_hastag(icmCatalog *c, unsigned int ix, ORD32 sig) {
+    ORD32 *tags = c->tags + c->e[ix].tags;
+    unsigned int lo = 0, hi = c->e[ix].ntags;
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi)/2;
+        if (tags[mid] < sig)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < c->e[ix].ntags && tags[lo] == sig;
 }
 
+/* Return nz if catalogue entry ix matches the query */
+int icmCatalogMatch(
+    icmCatalog *c,
+    unsigned int ix,
+    icmCatQuery *q
+) {
+    icmCatEntry *e = c->e + ix;
+    int i;
+
+    if ((q->deviceClass != 0 && e->deviceClass != q->deviceClass)
+     || (q->colorSpace != 0 && e->colorSpace != q->colorSpace)
+     || (q->pcs != 0 && e->pcs != q->pcs)
+     || (q->majv >= 0 && (int)(e->version >> 24) != q->majv)
+     || (q->intent >= 0 && (int)e->intent != q->intent))
+        return 0;
+
+    for (i = 0; i < q->ntags; i++) {
+        if (!icmCatalog_hastag(c, ix, q->tags[i]))
+            return 0;
+    }
+    return 1;
+}
 
 /* Create an empty object. Return NULL on error */
 icc *
@@ -17135,37 +24231,54 @@ new_icc_a(icmAlloc *al)
     }
     p->ver = 0;            /* default is V2 profile */
 
-    p->al = al;            /* Heap allocator */
+    /* Heap allocator, accounting for what we allocate */
+    if ((p->al = new_icmAllocAcct(al)) == NULL) {
+        al->free(al, p);
+        return NULL;
+    }
 
     p->get_rfp       = icc_get_rfp;
     p->set_version   = icc_set_version;
-    p->get_size      = icc_get_size;
+    p->get_size      = icc_get_size_busy;
     p->read          = icc_read;
-    p->read_x        = icc_read_x;
+    p->read_x        = icc_read_x_busy;
+    p->read_slurp    = icc_read_slurp_busy;
     p->write         = icc_write;
-    p->write_x       = icc_write_x;
-    p->dump          = icc_dump;
+    p->write_x       = icc_write_x_busy;
+    p->write_mem     = icc_write_mem_busy;
+    p->dump          = icc_dump_busy;
+    p->dump_json     = icc_dump_json_busy;
     p->del           = icc_delete;
-    p->add_tag       = icc_add_tag;
-    p->link_tag      = icc_link_tag;
+    p->add_tag       = icc_add_tag_busy;
+    p->link_tag      = icc_link_tag_busy;
     p->find_tag      = icc_find_tag;
     p->read_tag      = icc_read_tag;
-    p->rename_tag    = icc_rename_tag;
-    p->unread_tag    = icc_unread_tag;
-    p->read_all_tags = icc_read_all_tags;
-    p->delete_tag    = icc_delete_tag;
+    p->rename_tag    = icc_rename_tag_busy;
+    p->unread_tag    = icc_unread_tag_busy;
+    p->read_all_tags = icc_read_all_tags_busy;
+    p->delete_tag    = icc_delete_tag_busy;
     p->check_id      = icc_check_id;
     p->get_tac       = icm_get_tac;
+    p->create_link   = icc_create_link;
+    p->create_link_x = icc_create_link_x;
+    p->create_link_fit = icc_create_link_fit;
     p->get_luobj     = icc_get_luobj;
-    p->new_clutluobj = icc_new_icmLuLut;
+    p->get_luobj_shared = icc_get_luobj_shared;
+    p->new_clutluobj = icc_new_clutluobj;
+    p->get_memstats  = icc_get_memstats;
+    p->get_tagstats  = icc_get_tagstats;
 
 
     /* Allocate a header object */
     if ((p->header = new_icmHeader(p)) == NULL) {
+        p->al->del(p->al);
         al->free(al, p);
         return NULL;
     }
 
+    /* Make our tags visible to the memory budget */
+    icc_mem_register(p);
+
     /* Values that must be set before writing */
     p->header->deviceClass = icMaxEnumClass;/* Type of profile - must be set! */
     p->header->colorSpace = icMaxEnumData;    /* Clr space of data - must be set! */
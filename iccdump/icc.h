@@ -34,7 +34,13 @@
 #define ICCLIB_VERSION 0x020013
 #define ICCLIB_VERSION_STR "2.13"
 
-#undef ENABLE_V4		/* V4 is not fully implemented */
+#ifndef ENABLE_V4
+#define ENABLE_V4		/* Read V4 profiles */
+#endif
+
+/* Define ENABLE_V4_CREATE to let set_version() create V4 profiles. */
+/* This is incomplete, since V4 tag types such as mluc aren't */
+/* implemented, and created profiles would carry V2 only text types. */
 
 /*
  *  Note XYZ scaling to 1.0, not 100.0
@@ -497,7 +503,8 @@ typedef enum {
     icmCurveUndef           = -1, /* Undefined curve */
     icmCurveLin             = 0,  /* Linear transfer curve */
     icmCurveGamma           = 1,  /* Gamma power transfer curve */
-    icmCurveSpec            = 2   /* Specified curve */
+    icmCurveSpec            = 2,  /* Specified curve */
+    icmCurvePara            = 3   /* Parametric curve (icSigParametricCurveType) */
 } icmCurveStyle;
 
 /* Curve reverse lookup information */
@@ -512,6 +519,7 @@ typedef struct {
 							/* Offset 2 = first fwd index */
 	unsigned int size;		/* Copy of forward table size */
 	double       *data;		/* Copy of forward table data */
+	unsigned long nscan;	/* Number of lookups that fell back to a linear scan */
 } icmRevTable;
 
 struct _icmCurve {
@@ -523,9 +531,11 @@ struct _icmCurve {
 
 	/* Public: */
     icmCurveStyle   flag;		/* Style of curve */
+	icParametricCurveFunctionType ctype;	/* Function type if icmCurvePara */
 	unsigned int	size;		/* Allocated and used size of the array */
     double         *data;  		/* Curve data scaled to range 0.0 - 1.0 */
 								/* or data[0] = gamma value */
+								/* or data[] = g, a, b, c, d, e, f parameters */
 	/* Translate a value through the curve, return warning flags */
 	int (*lookup_fwd) (struct _icmCurve *p, double *out, double *in);	/* Forwards */
 	int (*lookup_bwd) (struct _icmCurve *p, double *out, double *in);	/* Backwards */
@@ -662,17 +672,10 @@ struct _icmDeviceSettings {
 
 #endif /* NEW */
 
-/* - - - - - - - - - - - - - - - - - - - - -  */
-/* optimised simplex Lut lookup axis flipping structure */
-typedef struct {
-	double fth;		/* Flip threshold */
-	char bthff;		/* Below threshold flip flag value */
-	char athff;		/* Above threshold flip flag value */
-} sx_flip_info;
- 
 /* Set method flags */
 #define ICM_CLUT_SET_EXACT 0x0000	/* Set clut node values exactly from callback */
 #define ICM_CLUT_SET_APXLS 0x0001	/* Set clut node values to aproximate least squares fit */
+#define ICM_CLUT_SET_MT    0x0002	/* clutfunc is thread safe, evaluate grid in parallel */
 
 /* lut */
 struct _icmLut {
@@ -684,21 +687,18 @@ struct _icmLut {
 	int dcube[1 << MAX_CHAN];		/* Hyper cube offsets (in doubles) */
 	icmRevTable rit[MAX_CHAN];		/* Reverse input table information */
 	icmRevTable rot[MAX_CHAN];		/* Reverse output table information */
-	sx_flip_info finfo[MAX_CHAN];	/* Optimised simplex flip information */
 
 	unsigned int inputTable_size;	/* size allocated to input table */
 	unsigned int clutTable_size;	/* size allocated to clut table */
 	unsigned int outputTable_size;	/* size allocated to output table */
 
-	/* Optimised simplex orientation information. oso_ffa is NZ if valid. */
-	/* Only valid if inputChan > 1 && clutPoints > 1 */
-									/* oso_ff[01] will be NULL if not valid */
-	unsigned short *oso_ffa;		/* Flip flags for inputChan-1 dimensions, organised */
-									/* [inputChan 0, 0..cp-2]..[inputChan ic-2, 0..cp-2] */
-	unsigned short *oso_ffb;		/* Flip flags for dimemension inputChan-1, organised */
-									/* [0..cp-2] */
+	/* Optimised simplex orientation information. oso_ffa is NULL if not valid, */
+	/* and is created on the first lookup_clut_osx(), or by build_osx(). */
+	/* It is discarded whenever the clut is re-allocated or set. */
+	unsigned short *oso_ffa;		/* Per cell axis flip flags, organised */
+									/* [inputChan 0, 0..cp-2]..[inputChan ic-1, 0..cp-2] */
 	int odinc[MAX_CHAN];			/* Dimensional increment through oso_ffa */
-	
+
 	/* return the minimum and maximum values of the given channel in the clut */
 	void (*min_max) (struct _icmLut *pp, double *minv, double *maxv, int chan);
 
@@ -708,8 +708,17 @@ struct _icmLut {
 	int (*lookup_input)   (struct _icmLut *pp, double *out, double *in);
 	int (*lookup_clut_nl) (struct _icmLut *pp, double *out, double *in);
 	int (*lookup_clut_sx) (struct _icmLut *pp, double *out, double *in);
+	int (*lookup_clut_osx)(struct _icmLut *pp, double *out, double *in);
 	int (*lookup_output)  (struct _icmLut *pp, double *out, double *in);
 
+	/* Create the optimised simplex orientation table if it doesn't exist. */
+	/* This should be done before lookup_clut_osx() is used from multiple threads. */
+	/* Return 0 on success, 2 on malloc failure */
+	int (*build_osx) (struct _icmLut *pp);
+
+	/* Multi-dimensional lut, multi-linear, for n vectors packed in in[] and out[] */
+	int (*lookup_clut_nl_n) (struct _icmLut *pp, double *out, double *in, unsigned int n);
+
 	/* Public: */
 
 	/* return non zero if matrix is non-unity */
@@ -777,7 +786,73 @@ int icmSetMultiLutTables(
 								/* Output transfer function, outspace'->outspace (NULL = deflt) */
 								/* Will be called ntables times on each output value */
 );
+
+/* Extended version of icmSetMultiLutTables(). The clut grid is evaluated */
+/* in parallel chunks of the pseudo-hilbert sequence if flags includes */
+/* ICM_CLUT_SET_MT, or if per thread callback contexts are supplied. */
+/* clutfunc may then be called concurrently, and the result is identical */
+/* to a serial evaluation. infunc and outfunc are always called serially */
+/* with cbctx. */
+int icmSetMultiLutTables_x(
+	int ntables,							/* Number of tables to be set, 1..n */
+	struct _icmLut **p,						/* Pointer to Lut object */
+	int     flags,							/* Setting flags */
+	void   *cbctx,							/* Opaque callback context pointer value */
+	icColorSpaceSignature insig, 			/* Input color space */
+	icColorSpaceSignature outsig, 			/* Output color space */
+	void (*infunc)(void *cbctx, double *out, double *in),
+	double *inmin, double *inmax,
+	void (*clutfunc)(void *cbntx, double *out, double *in),
+	double *clutmin, double *clutmax,
+	void (*outfunc)(void *cbntx, double *out, double *in),
+	int nthreads,							/* Number of threads, 0 = icmNumThreads() */
+	void **thcbctx							/* Per thread clutfunc contexts [nthreads], */
+											/* NULL = all threads use cbctx */
+);
 		
+/* - - - - - - - - - - - - - - - - - - - - -  */
+/* V4 lutAtoB and lutBtoA. */
+/* The processing elements are applied in the order A curves, clut, */
+/* M curves, matrix, B curves for a lutAtoB, and in the reverse order */
+/* B curves, matrix, M curves, clut, A curves for a lutBtoA. */
+/* The clut and A curves are optional, as are the M curves and matrix. */
+struct _icmLutAB {
+	ICM_BASE_MEMBERS
+
+	/* Private: */
+	int dinc[MAX_CHAN];				/* Dimensional increment through clut (in doubles) */
+	int dcube[1 << MAX_CHAN];		/* Hyper cube offsets (in doubles) */
+	unsigned int clutTable_size;	/* size allocated to clut table */
+
+	/* Translate normalized color values through the whole Lut, the matrix, */
+	/* or the multi-dimensional lut. */
+	int (*lookup_fwd)     (struct _icmLutAB *pp, double *out, double *in);
+	int (*lookup_matrix)  (struct _icmLutAB *pp, double *out, double *in);
+	int (*lookup_clut_nl) (struct _icmLutAB *pp, double *out, double *in);
+	int (*lookup_clut_sx) (struct _icmLutAB *pp, double *out, double *in);
+
+	/* Public: */
+    unsigned int	inputChan;      /* Num of input channels */
+    unsigned int	outputChan;     /* Num of output channels */
+	int             aclut;			/* NZ if A curves and clut are present */
+	int             mmatrix;		/* NZ if M curves and matrix are present (3 channels) */
+    unsigned int	clutPoints[MAX_CHAN];	/* Num of grid points for each input channel */
+	unsigned int    clutPrec;		/* Clut precision in bytes, 1 or 2 */
+    double			e[3][3];		/* 3 * 3 matrix */
+    double			off[3];			/* Matrix offsets */
+	icmCurve         *aCurves[MAX_CHAN];	/* A curves, [inputChan] for lutAtoB, */
+											/* [outputChan] for lutBtoA */
+	icmCurve         *mCurves[MAX_CHAN];	/* M curves, 3 */
+	icmCurve         *bCurves[MAX_CHAN];	/* B curves, [outputChan] for lutAtoB, */
+											/* [inputChan] for lutBtoA */
+	double	        *clutTable;		/* The clut: [product(clutPoints) * outputChan] */
+	/* clutTable   is organized [inputChan 0, 0..cp0-1]..[inputChan ic-1, 0..cpic-1]
+	                                                                [outputChan 0..oc-1] */
+	/* The curves are created by allocate(), as linear curves. A curve with */
+	/* flag icmCurvePara is written as a parametricCurveType. */
+
+}; typedef struct _icmLutAB icmLutAB;
+
 /* - - - - - - - - - - - - - - - - - - - - -  */
 /* Measurement Data */
 struct _icmMeasurement {
@@ -1038,8 +1113,25 @@ struct _icmVideoCardGamma {
 		icmVideoCardGammaFormula formula;
 	} u;
 
+	/* Private: */
+	int              rbits;			/* Bits per value of ramps, 0 if not built */
+	void            *ramps;			/* Per channel ramps [3][1 << rbits] */
+
+	/* Public: */
 	double (*lookup)(struct _icmVideoCardGamma *p, int chan, double iv); /* Read a value */
 
+	/* Build the 8, 10 or 16 bit per channel ramps used by apply(). */
+	/* Must be called again if the tag contents are changed. */
+	/* Return 0 on success, 1 if bits not supported, 2 on malloc failure. */
+	int (*build_ramps)(struct _icmVideoCardGamma *p, int bits);
+
+	/* Apply the calibration to a buffer of npix interleaved pixels of nchan */
+	/* channels each. The first 3 (or 1 if nchan == 1) channels are corrected, */
+	/* and any others (ie. alpha) are left untouched. 8 bit values are ORD8, */
+	/* 10 and 16 bit values are ORD16. Ramps are built as needed. */
+	/* Return 0 on success, 1 if arguments not supported, 2 on malloc failure. */
+	int (*apply)(struct _icmVideoCardGamma *p, void *buf, unsigned int npix, int nchan, int bits);
+
 }; typedef struct _icmVideoCardGamma icmVideoCardGamma;
 
 /* ------------------------------------------------- */
@@ -1116,9 +1208,18 @@ typedef enum {
     icmMatrixFwdType     = 2,	/* Matrix, Forward */
     icmMatrixBwdType     = 3,	/* Matrix, Backward */
     icmLutType           = 4,	/* Multi-dimensional Lookup Table */
-    icmNamedType         = 5	/* Named color data */
+    icmNamedType         = 5,	/* Named color data */
+    icmLutABType         = 6	/* V4 lutAtoB/lutBtoA Multi-dimensional Lookup Table */
 } icmLuAlgType;
 
+/* Public: Multi-dimensional table interpolation, for icmLuLut set_interp() */
+typedef enum {
+    icmInterpDefault     = 0,	/* Choose according to the input space */
+    icmInterpLinear      = 1,	/* Multi-linear */
+    icmInterpSimplex     = 2,	/* Simplex */
+    icmInterpOSimplex    = 3	/* Simplex oriented per grid cell to minimise error */
+} icmClutInterp;
+
 /* Lookup class members common to named and non-named color types */
 #define LU_ICM_BASE_MEMBERS																\
 	/* Private: */																		\
@@ -1137,6 +1238,8 @@ typedef enum {
     icColorSpaceSignature e_inSpace;	/* Effective Clr space of input */				\
     icColorSpaceSignature e_outSpace;	/* Effective Clr space of output */				\
 	icColorSpaceSignature e_pcs;		/* Effective PCS */								\
+	int refs;							/* References, when memoised by get_luobj_shared() */	\
+	void           (*rdel)(struct _icmLuBase *p);	/* Real delete, when memoised */	\
 																						\
 	/* Public: */																		\
 	void           (*del)(struct _icmLuBase *p);										\
@@ -1160,6 +1263,29 @@ typedef enum {
 	void           (*XYZ_Abs2Rel)(struct _icmLuBase *p, double *xyzout, double *xyzin);		\
 
 
+/* Runtime lookup instrumentation flags for set_trace() */
+#define ICM_LU_TRACE_COUNT 0x0001	/* Count lookups, clips and reverse curve scans */
+#define ICM_LU_TRACE_TIME  0x0002	/* Time a sample of lookups by stage */
+
+/* Lookup stages that can be timed. These are the stages of the */
+/* lookup_in(), lookup_core() and lookup_out() routines. */
+typedef enum {
+    icmLuStageIn       = 0,	/* Per channel input */
+    icmLuStageCore     = 1,	/* Intra channel conversion */
+    icmLuStageOut      = 2,	/* Per channel output */
+    icmLuStageN        = 3	/* Number of stages */
+} icmLuStage;
+
+/* Lookup statistics */
+typedef struct {
+	unsigned long lookups;			/* Number of lookup() calls */
+	unsigned long clips;			/* Number of lookups that returned a clip warning */
+	unsigned long revscans;			/* Reverse curve lookups on the curves used that fell back */
+									/* to a linear scan */
+	unsigned long tsamples;			/* Number of lookups timed */
+	double stime[icmLuStageN];		/* Total seconds spent in each stage by timed lookups */
+} icmLuStats;
+
 /* Non-algorithm specific lookup class. Used as base class of algorithm specific class. */
 #define LU_ICM_NN_BASE_MEMBERS															\
     LU_ICM_BASE_MEMBERS                                                                 \
@@ -1220,6 +1346,24 @@ typedef enum {
 	/* Inverse per channel input lookup (may be unity): */									\
 	int (*lookup_inv_in) (struct _icmLuBase *p, double *out, double *in);					\
 																							\
+	/* Runtime instrumentation. flags is a combination of the ICM_LU_TRACE_* flags, */		\
+	/* and every sample'th lookup is timed by stage if ICM_LU_TRACE_TIME is set. */			\
+	/* Changing the flags resets the statistics. */											\
+	void (*set_trace) (struct _icmLuBase *p, int flags, unsigned int sample);				\
+																							\
+	/* Return the statistics gathered since tracing was set or last reset */				\
+	void (*get_stats) (struct _icmLuBase *p, icmLuStats *st);								\
+																							\
+	/* Reset the statistics */																\
+	void (*reset_stats) (struct _icmLuBase *p);												\
+																							\
+	/* Private: */																			\
+	int trace;							/* ICM_LU_TRACE_* flags */							\
+	unsigned int tsample, tcount;		/* Timing sample interval and lookup count */		\
+	unsigned long nscan0;				/* Reverse scan count at reset */					\
+	icmLuStats stats;					/* Gathered statistics */							\
+	int (*ulookup) (struct _icmLuBase *p, double *out, double *in);	/* Untraced lookup */	\
+																							\
 
 
 /* Base lookup object */
@@ -1256,6 +1400,8 @@ struct _icmLuMatrix {
 	icmXYZArray *redColrnt, *greenColrnt, *blueColrnt;
     double		mx[3][3];	/* 3 * 3 conversion matrix */
     double		bmx[3][3];	/* 3 * 3 backwards conversion matrix */
+    double		amx[3][3];	/* mx with the forward absolute conversion folded in */
+    double		abmx[3][3];	/* bmx with the backward absolute conversion folded in */
 
 	/* Overall lookups */
 	int (*fwd_lookup) (struct _icmLuBase *p, double *out, double *in);
@@ -1286,8 +1432,13 @@ struct _icmLuLut {
 	void (*out_denormf)(double *out, double *in);/* Lut output de-normalizing function */
 	void (*e_in_denormf)(double *out, double *in);/* Effective input de-normalizing function */
 	void (*e_out_denormf)(double *out, double *in);/* Effecive output de-normalizing function */
-	/* function chosen out of lut->lookup_clut_sx and lut->lookup_clut_nl to imp. clut() */
+	/* function chosen out of lut->lookup_clut_sx, _osx and _nl to imp. clut() */
 	int (*lookup_clut) (struct _icmLut *pp, double *out, double *in);	/* clut function */
+	int (*dflt_lookup_clut) (struct _icmLut *pp, double *out, double *in);	/* Default choice */
+	int    inmxv;								/* NZ if in_abs, matrix and in_normf */
+	double inmx[3][3];							/* are composed into inmx */
+	int    outmxv;								/* NZ if out_denormf and out_abs */
+	double outmx[3][3];							/* are composed into outmx */
 
 	/* public: */
 
@@ -1318,23 +1469,98 @@ struct _icmLuLut {
 	/* Get the matrix contents */
 	void (*get_matrix) (struct _icmLuLut *p, double m[3][3]);
 
+	/* Choose the clut interpolation used by lookup(). */
+	/* Return 0 on success, 2 on malloc failure */
+	int (*set_interp) (struct _icmLuLut *p, icmClutInterp interp);
+
 }; typedef struct _icmLuLut icmLuLut;
 
+/* A stage of a compiled lutAtoB/lutBtoA lookup */
+typedef enum {
+    icmLuABCurves      = 0,	/* Per channel curves */
+    icmLuABMatrix      = 1,	/* 3x3 matrix and offsets */
+    icmLuABClut        = 2	/* Multi-dimensional lut */
+} icmLuABOp;
+
+typedef struct {
+	icmLuABOp op;						/* Operation */
+	unsigned int n;						/* Number of curves */
+	icmCurve *cv[MAX_CHAN];				/* Curves, NULL if unity */
+} icmLuABStage;
+
+/* V4 lutAtoB/lutBtoA Multi-D. Lut type object. The Lut's processing */
+/* elements are compiled into a pipeline that omits unity elements. */
+struct _icmLuLutAB {
+	LU_ICM_NN_BASE_MEMBERS
+
+	/* private: */
+	icmLutAB *lut;								/* Lut to use */
+	void (*in_normf)(double *out, double *in);	/* Lut input data normalizing function */
+	void (*in_denormf)(double *out, double *in);/* Lut input data de-normalizing function */
+	void (*out_normf)(double *out, double *in);	/* Lut output data normalizing function */
+	void (*out_denormf)(double *out, double *in);/* Lut output de-normalizing function */
+	/* function chosen out of lut->lookup_clut_sx and lut->lookup_clut_nl */
+	int (*lookup_clut) (struct _icmLutAB *pp, double *out, double *in);	/* clut function */
+	int nstages;								/* Number of stages */
+	int istages;								/* Leading stages done by lookup_in() */
+	int ostages;								/* Trailing stages done by lookup_out() */
+	icmLuABStage stage[5];						/* The stages */
+	int    inmxv;								/* NZ if in_abs and in_normf */
+	double inmx[3][3];							/* are composed into inmx */
+	int    outmxv;								/* NZ if out_denormf and out_abs */
+	double outmx[3][3];							/* are composed into outmx */
+
+	/* public: */
+
+	/* Components of lookup */
+	int (*in_abs)  (struct _icmLuLutAB *p, double *out, double *in);
+	int (*out_abs) (struct _icmLuLutAB *p, double *out, double *in);
+
+	/* Get various types of information about the LuLutAB */
+	void (*get_info) (struct _icmLuLutAB *p, icmLutAB **lutp,
+	                 icmXYZNumber *pcswhtp, icmXYZNumber *whitep,
+	                 icmXYZNumber *blackp);
+
+}; typedef struct _icmLuLutAB icmLuLutAB;
+
+/* Metric used by the named color closest color lookup */
+typedef enum {
+    icmNamedDE76       = 0,	/* CIE 1976 Delta E (default) */
+    icmNamedDE94       = 1,	/* CIE 1994 Delta E */
+    icmNamedDE2K       = 2	/* CIEDE2000 Delta E */
+} icmNamedMetric;
+
 /* Named colors lookup object */
 struct _icmLuNamed {
 	LU_ICM_BASE_MEMBERS
 
   /* Private: */
+	icmNamedColor *nc;				/* Named color tag */
+	unsigned int hsize;				/* Name hash table size, power of 2 */
+	int *hhead;						/* Hash chain heads [hsize], -1 = empty */
+	int *hnext;						/* Hash chain links [count] */
+	double *lab;					/* D50 relative Lab of each color [count * 3], NULL if none */
+	double cmax;					/* Maximum chroma in lab[] */
+	int *pix, *dix;					/* PCS and device k-d tree color order [count] */
+	char *pax, *dax;				/* PCS and device k-d tree split axis [count] */
+	double *dev;					/* Device values [count * nDeviceCoords] */
+	icmNamedMetric metric;			/* Closest color metric */
 
   /* Public: */
 
 	/* Get various types of information about the Named lookup */
-	void (*get_info) (struct _icmLuLut *p, 
+	/* Any pointer may be NULL if value is not to be returned */
+	void (*get_info) (struct _icmLuNamed *p, 
 	                 icmXYZNumber *pcswhtp, icmXYZNumber *whitep,
 	                 icmXYZNumber *blackp,
-	                 int *maxnamesize,
+	                 int *maxnamesize,		/* Including prefix, suffix and nul */
 	                 int *num_colors, char *prefix, char *suffix);
 
+	/* Set the metric used by pcs_lookup(). Default is icmNamedDE76 */
+	void (*set_metric) (struct _icmLuNamed *p, icmNamedMetric metric);
+
+	/* The lookups return 0 on success, 2 on error (name not found etc.) */
+	/* pcs is in the effective PCS, and either pcs or dev may be NULL. */
 
 	/* Lookup a name that includes prefix and suffix */
 	int (*fullname_lookup) (struct _icmLuNamed *p, double *pcs, double *dev, char *in);
@@ -1342,7 +1568,8 @@ struct _icmLuNamed {
 	/* Lookup a name that doesn't include prefix and suffix */
 	int (*name_lookup) (struct _icmLuNamed *p, double *pcs, double *dev, char *in);
 
-	/* Fill in a list with the nout closest named colors to the pcs target */
+	/* Fill in a list with the nout closest named colors to the pcs target. */
+	/* The root names are returned, closest first. Unused entries are set to NULL. */
 	int (*pcs_lookup) (struct _icmLuNamed *p, char **out, int nout, double *in);
 
 	/* Fill in a list with the nout closest named colors to the device target */
@@ -1359,8 +1586,41 @@ typedef struct {
     unsigned int        size;			/* Size in bytes (not including padding) */
     unsigned int        pad;			/* Padding in bytes */
 	icmBase            *objp;			/* In memory data structure */
+	unsigned long       rbytes;			/* Bytes decoded reading this tag */
+	size_t              mbytes;			/* Memory allocated decoding objp */
+	unsigned long       mused;			/* When objp was last read, for the memory budget */
+	int                 mfile;			/* NZ if objp was decoded from the file */
+	int                 mevicted;		/* NZ if objp was unloaded to meet the memory budget */
 } icmTag;
 
+/* Memory accounting categories */
+typedef enum {
+    icmMemTag     = 0,		/* Tag objects */
+    icmMemRev     = 1,		/* Reverse and other derived lookup tables */
+    icmMemLu      = 2,		/* Lookup objects */
+    icmMemOther   = 3,		/* Everything else */
+    icmMemN       = 4		/* Number of categories */
+} icmMemCat;
+
+/* Memory statistics of an icc, or of all of them */
+typedef struct {
+	size_t bytes[icmMemN];		/* Bytes allocated now, by category */
+	size_t budget;				/* Global memory budget, 0 if none */
+	unsigned int nicc;			/* Number of icc objects */
+	unsigned int ntags;			/* Number of tag objects decoded now */
+	unsigned long reads;		/* Number of tag objects decoded */
+	unsigned long rereads;		/* Number of those that had been unloaded */
+	unsigned long evictions;	/* Number of tag objects unloaded to meet the budget */
+} icmMemStats;
+
+/* Decoding statistics of a tag */
+typedef struct {
+	unsigned int size;			/* Size of the tag in the file */
+	unsigned long rbytes;		/* Bytes decoded reading it, including re-reads */
+	int loaded;					/* NZ if its tag object is in memory now */
+	size_t mbytes;				/* Memory allocated decoding it, if loaded from the file */
+} icmTagStats;
+
 /* Pseudo enumerations valid as parameter to get_luobj(): */
 
 /* Special purpose Perceptual intent */
@@ -1387,6 +1647,8 @@ typedef enum {
     icmVersion4_1           = 3,	/* Version 4.1.0 - General V4 features */
 } icmICCVersion;
 
+struct _icmLinkFit;		/* Defined below */
+
 /* The ICC object */
 struct _icc {
   /* Public: */
@@ -1396,9 +1658,14 @@ struct _icc {
 	unsigned int (*get_size)(struct _icc *p);				/* Return total size needed, 0 = err. */
 	int          (*read)(struct _icc *p, icmFile *fp, unsigned int of);	/* Returns error code */
 	int          (*read_x)(struct _icc *p, icmFile *fp, unsigned int of, int take_fp);
+	int          (*read_slurp)(struct _icc *p, icmFile *fp, unsigned int of, int take_fp);
+	                    /* As read_x, but reads the whole profile into memory in one I/O */
 	int          (*write)(struct _icc *p, icmFile *fp, unsigned int of);/* Returns error code */
 	int          (*write_x)(struct _icc *p, icmFile *fp, unsigned int of, int take_fp);
+	int          (*write_mem)(struct _icc *p, void **bufp, size_t *lenp);
+	                    /* Write into a single buffer, allocated if *bufp == NULL. Returns error code */
 	void         (*dump)(struct _icc *p, icmFile *op, int verb);	/* Dump whole icc */
+	int          (*dump_json)(struct _icc *p, icmFile *op, int verb);	/* Dump as JSON */
 	void         (*del)(struct _icc *p);						/* Free whole icc */
 	int          (*find_tag)(struct _icc *p, icTagSignature sig);
 							/* Returns 0 if found, 1 if found but not readable, 2 of not found */
@@ -1420,6 +1687,38 @@ struct _icc {
 	double       (*get_tac)(struct _icc *p, double *chmax, /* Returns total ink limit and channel maximums */
 	void (*calfunc)(void *cntx, double *out, double *in), void *cntx);	/* optional cal. lookup */
 
+	/* Create a device link profile in this empty icc, from the device -> PCS */
+	/* conversion of src followed by the PCS -> device conversion of dst. */
+	int          (*create_link)(struct _icc *p, struct _icc *src, struct _icc *dst,
+	                            icRenderingIntent intent,	/* icmDefaultIntent = src default */
+	                            int res,				/* Clut resolution, 0 = default */
+	                            int nthreads);			/* Threads, 0 = icmNumThreads() */
+	                           /* Returns error code */
+
+	/* Create a device link like create_link(), with the optional per channel */
+	/* destination device calibration calfunc folded into the output tables. */
+	int          (*create_link_x)(struct _icc *p, struct _icc *src, struct _icc *dst,
+	                            icRenderingIntent intent,	/* icmDefaultIntent = src default */
+	                            int res,				/* Clut resolution, 0 = default */
+	                            void (*calfunc)(void *cntx, double *out, double *in),
+	                            void *cntx,				/* Calibration, NULL = none */
+	                            int nthreads);			/* Threads, 0 = icmNumThreads() */
+	                           /* Returns error code */
+
+	/* Create a device link like create_link(), choosing the smallest clut */
+	/* resolution and input shaping that meets a 95th percentile CIEDE2000 */
+	/* error target, measured against the conversion at off-grid points. */
+	/* A calibration is folded in as for create_link_x(), after the fit. */
+	int          (*create_link_fit)(struct _icc *p, struct _icc *src, struct _icc *dst,
+	                            icRenderingIntent intent,	/* icmDefaultIntent = src default */
+	                            double maxde,			/* 95th percentile DE 2000 target */
+	                            int maxres,				/* Max. clut resolution, 0 = default */
+	                            struct _icmLinkFit *fit,	/* Return achieved error, may be NULL */
+	                            void (*calfunc)(void *cntx, double *out, double *in),
+	                            void *cntx,				/* Calibration, NULL = none */
+	                            int nthreads);			/* Threads, 0 = icmNumThreads() */
+	                           /* Returns error code */
+
 	/* Get a particular color conversion function */
 	icmLuBase *  (*get_luobj) (struct _icc *p,
                                icmLookupFunc func,			/* Functionality */
@@ -1429,6 +1728,20 @@ struct _icc {
 	                           /* Return appropriate lookup object */
 	                           /* NULL on error, check errc+err for reason */
 
+	/* Get a color conversion function that is memoised, and shared by */
+	/* every call with the same arguments until a tag is added, deleted, */
+	/* renamed or unread. Settings such as set_interp(), set_trace() and */
+	/* reset_stats() apply to all its holders, so use get_luobj() for an */
+	/* object of your own. Each holder calls del(). Like the other methods, */
+	/* this mustn't be called on one icc from several threads at once. */
+	icmLuBase *  (*get_luobj_shared) (struct _icc *p,
+	                           icmLookupFunc func,			/* Functionality */
+	                           icRenderingIntent intent,	/* Intent */
+	                           icColorSpaceSignature pcsor,	/* PCS override (0 = def) */
+	                           icmLookupOrder order);		/* Search Order */
+	                           /* Return appropriate lookup object */
+	                           /* NULL on error, check errc+err for reason */
+
 	/* Low level - load specific cLUT conversion */
 	icmLuBase *  (*new_clutluobj)(struct _icc *p,
 	                            icTagSignature        ttag,		  /* Target Lut tag */
@@ -1442,6 +1755,13 @@ struct _icc {
 	                            icmLookupFunc         func);	  /* For icmLuSpaces() */
 	                           /* Return appropriate lookup object */
 	                           /* NULL on error, check errc+err for reason */
+
+	/* Get the memory statistics of this icc */
+	void         (*get_memstats)(struct _icc *p, icmMemStats *st);
+
+	/* Get the decoding statistics of a tag */
+	int          (*get_tagstats)(struct _icc *p, icTagSignature sig, icmTagStats *st);
+	                           /* Return 0 on success, 2 if the tag isn't found */
 	
     icmHeader       *header;			/* The header */
 	char             err[512];			/* Error message */
@@ -1457,6 +1777,15 @@ struct _icc {
     unsigned int     count;				/* Num tags in the profile */
     icmTag          *data;    			/* The tagTable and tagData */
 	icmICCVersion    ver;				/* Version class, see icmICCVersion enum */
+	ORD8             cid[16];			/* Profile ID computed while reading */
+	int              cid_valid;			/* NZ if cid is valid */
+	char            *wbase;				/* Buffer being written by write_mem(), NULL if none */
+	unsigned int     wsize;				/* Size of wbase buffer */
+	struct _icmLuCache *lucache;		/* Memoised get_luobj_shared() objects */
+	unsigned int     nlucache, _nlucache;	/* Number used and allocated */
+	struct _icc     *mnext, *mprev;		/* List of all icc objects, for the memory budget */
+	int              mbusy;				/* NZ while tags mustn't be unloaded */
+	int              nlu;				/* Number of lookup objects not yet deleted */
 
 	}; typedef struct _icc icc;
 
@@ -1650,6 +1979,27 @@ extern ICCLIB_API void icmXYZ2Luv(icmXYZNumber *w, double *out, double *in);
 extern ICCLIB_API void icmLuv2XYZ(icmXYZNumber *w, double *out, double *in);
 
 
+/* Array versions of the above conversions. The _n versions convert n */
+/* interleaved triples, and the _p versions convert n values held in three */
+/* separate planes. out may be the same as in. These use a fast cube root */
+/* and fast trigonometric approximations, and map black to zero rather than NaN. */
+extern ICCLIB_API void icmXYZ2Lab_n(icmXYZNumber *w, double *out, double *in, unsigned int n);
+extern ICCLIB_API void icmXYZ2Lab_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n);
+extern ICCLIB_API void icmLab2XYZ_n(icmXYZNumber *w, double *out, double *in, unsigned int n);
+extern ICCLIB_API void icmLab2XYZ_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n);
+extern ICCLIB_API void icmLab2LCh_n(double *out, double *in, unsigned int n);
+extern ICCLIB_API void icmLab2LCh_p(double *out[3], double *in[3], unsigned int n);
+extern ICCLIB_API void icmLCh2Lab_n(double *out, double *in, unsigned int n);
+extern ICCLIB_API void icmLCh2Lab_p(double *out[3], double *in[3], unsigned int n);
+extern ICCLIB_API void icmXYZ2Yxy_n(double *out, double *in, unsigned int n);
+extern ICCLIB_API void icmXYZ2Yxy_p(double *out[3], double *in[3], unsigned int n);
+extern ICCLIB_API void icmYxy2XYZ_n(double *out, double *in, unsigned int n);
+extern ICCLIB_API void icmYxy2XYZ_p(double *out[3], double *in[3], unsigned int n);
+extern ICCLIB_API void icmXYZ2Luv_n(icmXYZNumber *w, double *out, double *in, unsigned int n);
+extern ICCLIB_API void icmXYZ2Luv_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n);
+extern ICCLIB_API void icmLuv2XYZ_n(icmXYZNumber *w, double *out, double *in, unsigned int n);
+extern ICCLIB_API void icmLuv2XYZ_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n);
+
 /* NOTE :- none of the following seven have been protected */
 /* against arithmmetic issues (ie. for black) */
 
@@ -1682,12 +2032,12 @@ extern ICCLIB_API void icm1960UCS21964WUV(icmXYZNumber *w, double *out, double *
 /* The standard D50 illuminant value */
 extern icmXYZNumber icmD50;
 extern icmXYZNumber icmD50_100;		/* Scaled to 100 */
-double icmD50_ary3[3];				/* As an array */
+extern double icmD50_ary3[3];		/* As an array */
 
 /* The standard D65 illuminant value */
 extern icmXYZNumber icmD65;
 extern icmXYZNumber icmD65_100;		/* Scaled to 100 */
-double icmD65_ary3[3];				/* As an array */
+extern double icmD65_ary3[3];		/* As an array */
 
 /* The default black value */
 extern icmXYZNumber icmBlack;
@@ -1704,6 +2054,165 @@ extern ICCLIB_API void psh_reset(psh *p);
 extern ICCLIB_API int psh_inc(psh *p, int co[]);
 
 
+/* Set a budget for the memory allocated by all the icc objects, 0 for */
+/* none (the default). When a read_tag() or get_luobj() on an icc takes */
+/* the total over the budget, the least recently read tag objects of */
+/* that icc that were decoded from a file are unloaded, and transparently */
+/* re-read when next asked for. The tags of an icc that has lookup objects */
+/* in use aren't unloaded, but with a budget set a tag object pointer */
+/* returned by read_tag() should only be used until the next read_tag() */
+/* or get_luobj() on the same icc, and changes to read tags may be lost. */
+extern ICCLIB_API void icmSetMemBudget(size_t bytes);
+
+/* Unload the least recently read tags of any of the icc objects, to */
+/* meet the budget. Only call this when no tag object pointers returned */
+/* by read_tag() on any icc are still in use. */
+extern ICCLIB_API void icmMemTrim(void);
+
+/* Get the memory statistics of all the icc objects */
+extern ICCLIB_API void icmGetMemStats(icmMemStats *st);
+
+/* Return the number of threads worth using on this machine */
+extern ICCLIB_API int icmNumThreads(void);
+
+/* Execute func(cntx, thix, jix) for jix = 0 .. njobs-1, using up to */
+/* nthreads threads (0 = icmNumThreads()). thix is the index of the */
+/* executing thread. Return the non-zero value returned by the lowest */
+/* failing job, or 0 if all jobs succeeded. */
+extern ICCLIB_API int icmParallel(int nthreads, int njobs, void *cntx,
+                                  int (*func)(void *cntx, int thix, int jix));
+
+/* Grid file formats written by icmWriteGrid() */
+typedef enum {
+	icmGridCube  = 0,		/* .cube text 3D LUT, 3 inputs and 3 outputs */
+	icmGridFloat = 1		/* Raw little endian 32 bit float output values */
+} icmGridFormat;
+
+/* Sample func() over a res^inn grid spanning inmin .. inmax (NULL = 0.0 .. 1.0) */
+/* using up to nthreads threads, and stream it to fp with input channel 0 */
+/* varying fastest. Return 0 on success, 1 on bad parameters, */
+/* 2 on malloc failure, 3 on write failure. */
+extern ICCLIB_API int icmWriteGrid(icmAlloc *al, icmFile *fp, icmGridFormat fmt, char *title,
+                                   int res, int inn, int outn, double *inmin, double *inmax,
+                                   void *cntx, void (*func)(void *cntx, double *out, double *in),
+                                   int nthreads);
+
+/* Write the transform of an icmLuBase as a grid file, sampled over */
+/* its input range. Return an error code, with the message in icp->err */
+extern ICCLIB_API int icmLuWriteGrid(icmLuBase *p, icmFile *fp, icmGridFormat fmt, char *title,
+                                     int res, int nthreads);
+
+/* A calibration function for get_tac(), create_link_x() and create_link_fit(), */
+/* that applies the icmVideoCardGamma passed as cntx to an RGB device value */
+extern ICCLIB_API void icmVideoCardGammaCal(void *cntx, double *out, double *in);
+
+/* Depth of pixel buffer values. The low 8 bits are the size in bytes */
+/* of a value, or of a whole pixel for the packed depths. */
+typedef enum {
+	icmPix8      = 1,		/* unsigned char, 0 .. 255 spans the color space range */
+	icmPix16     = 2,		/* unsigned short, 0 .. 65535 spans the color space range */
+	icmPixFloat  = 4,		/* float, native color space values */
+	icmPixDouble = 8,		/* double, native color space values */
+	icmPixHalf   = 0x102,	/* IEEE 754 half float, native color space values */
+	icmPix10     = 0x204	/* Packed 2:10:10:10, a 32 bit word per pixel holding channels */
+							/* at bits 0, 10 and 20, 0 .. 1023 spanning the color space */
+							/* range, and an optional 2 bit extra channel at bit 30. */
+} icmPixDepth;
+
+#define ICM_PIX_BYTES(depth) ((depth) & 0xff)	/* Size in bytes of a value or packed pixel */
+#define ICM_PIX_PACKED(depth) ((depth) & 0x200)	/* NZ if the channels are packed in one word */
+
+#define ICM_PIX_MAXEXTRA 4		/* Maximum extra (e.g. alpha) channels */
+
+/* Pixel buffer format. Channels not named in order[] are extra channels, */
+/* which are copied through in order, rescaled to the output depth. */
+/* Missing extra output channels are set to full scale. For icmPix10 the */
+/* positions are the fields of the word, 3 or 4 of them, and planar must be 0. */
+typedef struct {
+	icmPixDepth depth;
+	int nchan;				/* Channels per pixel, including extra channels */
+	int planar;				/* NZ if each channel has its own plane */
+	int order[MAX_CHAN];	/* Position of each color channel in the pixel */
+	size_t rowstride;		/* Bytes between rows */
+	size_t planestride;		/* Bytes between planes if planar */
+} icmPixFmt;
+
+/* Initialise a format for a tightly packed width x height buffer */
+/* with the channels in color space order */
+extern ICCLIB_API void icmPixFmtInit(icmPixFmt *f, icmPixDepth depth, int nchan, int planar,
+                                     unsigned int width, unsigned int height);
+
+/* Convert a width x height image directly between the callers buffers, */
+/* using up to nthreads threads. Return an error code, with the message */
+/* in icp->err */
+extern ICCLIB_API int icmLuLookupPix(icmLuBase *p, void *out, icmPixFmt *ofmt,
+                                     void *in, icmPixFmt *ifmt,
+                                     unsigned int width, unsigned int height, int nthreads);
+
+/* - - - - - - - - - - - - - - - - - - - - - - - */
+/* Profile catalogue index. The index file is an icmCatHeader, followed by */
+/* count icmCatEntry's, ntags tag signatures and strsize bytes of paths, */
+/* all in host byte order, so that a mapped index can be used in place. */
+
+#define ICM_CAT_MAGIC   0x69636174		/* 'icat' */
+#define ICM_CAT_VERSION 1
+#define ICM_CAT_ORDER   0x01020304		/* Detects an index from the other byte order */
+
+typedef struct {
+	ORD32 magic, version, order;
+	ORD32 count;					/* Number of catalogued profiles */
+	ORD32 ntags;					/* Total number of tag signatures */
+	ORD32 strsize;					/* Size of the path strings */
+} icmCatHeader;
+
+/* Summary of one profile */
+typedef struct {
+	ORD32 path;						/* Offset of the null terminated path */
+	ORD32 size;						/* Profile size from the header */
+	ORD32 deviceClass;				/* Header values */
+	ORD32 colorSpace;
+	ORD32 pcs;
+	ORD32 version;					/* Encoded as in the header, major version in the top byte */
+	ORD32 intent;
+	ORD32 tags;						/* Index of first of the sorted tag signatures */
+	ORD32 ntags;					/* Number of tag signatures */
+	unsigned char id[16];			/* Profile ID */
+} icmCatEntry;
+
+/* A catalogue set up from an index image */
+typedef struct {
+	icmCatHeader *h;
+	icmCatEntry  *e;				/* [h->count] entries */
+	ORD32        *tags;				/* [h->ntags] tag signatures */
+	char         *str;				/* Path strings */
+} icmCatalog;
+
+#define ICM_CAT_MAXQTAGS 16
+
+/* Catalogue query. Zero signatures and negative values match anything */
+typedef struct {
+	ORD32 deviceClass, colorSpace, pcs;
+	int majv;						/* Major version */
+	int intent;
+	int ntags;						/* Tag signatures that must all be present */
+	ORD32 tags[ICM_CAT_MAXQTAGS];
+} icmCatQuery;
+
+/* Write a catalogue index of the n profiles named in paths[] to fp, reading */
+/* only their headers and tag tables, using up to nthreads threads. Files that */
+/* aren't profiles are left out and counted in *nbad. Return 0 on success, */
+/* 2 on malloc failure, 3 on write failure. */
+extern ICCLIB_API int icmCatalogWrite(icmAlloc *al, icmFile *fp, char **paths, unsigned int n,
+                                      int nthreads, unsigned int *nbad);
+
+/* Set up a catalogue from an index image of len bytes. Return 0 on success, */
+/* 1 if it isn't a usable index. */
+extern ICCLIB_API int icmCatalogInit(icmCatalog *c, void *buf, size_t len);
+
+/* Return nz if catalogue entry ix matches the query */
+extern ICCLIB_API int icmCatalogMatch(icmCatalog *c, unsigned int ix, icmCatQuery *q);
+
+
 /* RGB primaries to device to RGB->XYZ transform matrix */
 /* Return non-zero if matrix would be singular */
 int icmRGBprim2matrix(
@@ -1902,6 +2411,53 @@ extern ICCLIB_API double icmCIE2Ksq(double *in0, double *in1);
 /* Return the CIEDE2000 Delta E color difference measure for two XYZ values */
 extern ICCLIB_API double icmXYZCIE2K(icmXYZNumber *w, double *in0, double *in1);
 
+/* - - - - - - - - - - - - - - - - - - - - - - - */
+/* Array versions of the Delta E functions. These set out[0..n-1] to the */
+/* Delta E between n pairs of interleaved Lab values in in0[] and in1[], */
+/* using fast polynomial approximations in place of the libm functions. */
+
+/* Normal Delta E */
+extern ICCLIB_API void icmLabDE_n(double *out, double *in0, double *in1, unsigned int n);
+
+/* CIE94 Delta E */
+extern ICCLIB_API void icmCIE94_n(double *out, double *in0, double *in1, unsigned int n);
+
+/* CIEDE2000 Delta E */
+extern ICCLIB_API void icmCIE2K_n(double *out, double *in0, double *in1, unsigned int n);
+
+/* Summary statistics of an array of values */
+typedef struct {
+	unsigned int n;			/* Number of values */
+	double min, max;		/* Range */
+	double mean;			/* Average */
+	double stddev;			/* Standard deviation */
+} icmStats;
+
+/* The error achieved by icc->create_link_fit() */
+struct _icmLinkFit {
+	int res;				/* Clut resolution chosen */
+	int shaped;				/* NZ if input shaper curves were used */
+	int met;				/* NZ if the error target was met */
+	icmStats de;			/* Delta E 2000 statistics of the test points */
+	double p95;				/* 95th percentile Delta E 2000 */
+}; typedef struct _icmLinkFit icmLinkFit;
+
+/* Compute the statistics of n values using up to nthreads threads */
+/* (0 = icmNumThreads()). Return 0 on success, 2 on malloc failure */
+extern ICCLIB_API int icmArrayStats(icmAlloc *al, icmStats *st, double *v, unsigned int n,
+                                    int nthreads);
+
+/* Compute npct percentiles (0.0 .. 100.0) of n values into out[] */
+/* Return 0 on success, 2 on malloc failure */
+extern ICCLIB_API int icmArrayPercentiles(icmAlloc *al, double *out, double *pct, int npct,
+                                          double *v, unsigned int n);
+
+/* Set out[inn] to point i of a Halton sequence spanning min[] .. max[]. */
+/* Successive points stratify the space evenly, so sampling with points */
+/* 0 .. n-1 covers it well for any n. */
+extern ICCLIB_API void icmHaltonPoint(double *out, unsigned int i, int inn, double *min,
+                                      double *max);
+
 /* - - - - - - - - - - - - - - - - - - - - - - - */
 /* Clip Lab, while maintaining hue angle. */
 /* Return nz if clipping occured */
@@ -0,0 +1,1310 @@
+
+/*
+ * icclib lookup and load benchmark.
+ *
+ * Synthesizes profiles of various kinds, grid resolutions and
+ * channel counts, and measures how long they take to set up,
+ * load, checksum and look colors up through. Results are
+ * written as JSON so that they can be compared between builds.
+ * The array and pixel buffer routines are also checked against
+ * the scalar routines, the half float and packed pixel buffers
+ * against double ones, and the exit status is non-zero if any
+ * of them are less accurate than they should be.
+ *
+ * This material is licensed with an "MIT" free use license:-
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+#include "icc.h"
+
+#define NPIX 4096            /* Pixels per lookup batch */
+#define DEF_MINTIME 0.25    /* Default minimum seconds per measurement */
+
+void
+error(char *fmt, ...)
+{
+    va_list args;
+
+    fprintf(stderr,"ERROR: ");
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+
+    exit(1);
+}
+
+void
+usage(void) {
+    fprintf(stderr,"usage: iccbench [-q] [-t secs] [-o outfile]\n");
+    fprintf(stderr," -q          Quick run, smaller set of configurations\n");
+    fprintf(stderr," -t secs     Minimum time per measurement (default %.2f)\n",DEF_MINTIME);
+    fprintf(stderr," -o outfile  Write JSON to outfile rather than stdout\n");
+    exit(1);
+}
+
+/* ---------------------------------------------------------- */
+/* Timing and reporting */
+
+/* Return a monotonic time in seconds */
+static double bench_time(void) {
+#if defined(_WIN32)
+    return (double)clock()/CLOCKS_PER_SEC;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static FILE *jfp;            /* JSON output */
+static int nresults = 0;    /* Number of results written */
+static double mintime = DEF_MINTIME;
+static int nfail = 0;        /* Number of failed accuracy checks */
+
+/* Write one result. ops is the number of operations (pixels, bytes, */
+/* profiles etc.) timed, and unit describes them. */
+static void report(
+    char *bench,            /* Benchmark name */
+    char *lu,                /* Lookup type or NULL */
+    char *interp,            /* Interpolation or NULL */
+    int inchan,                /* Input channels, 0 if not relevant */
+    int outchan,            /* Output channels, 0 if not relevant */
+    int res,                /* Grid or curve resolution, 0 if not relevant */
+    char *unit,                /* Operation unit */
+    double ops,                /* Number of operations */
+    double secs                /* Elapsed time */
+) {
+    fprintf(jfp, "%s\n    {\"bench\": \"%s\"", nresults > 0 ? "," : "", bench);
+    if (lu != NULL)
+        fprintf(jfp, ", \"lu\": \"%s\"", lu);
+    if (interp != NULL)
+        fprintf(jfp, ", \"interp\": \"%s\"", interp);
+    if (inchan > 0)
+        fprintf(jfp, ", \"inchan\": %d", inchan);
+    if (outchan > 0)
+        fprintf(jfp, ", \"outchan\": %d", outchan);
+    if (res > 0)
+        fprintf(jfp, ", \"res\": %d", res);
+    fprintf(jfp, ", \"unit\": \"%s\", \"ops\": %.0f, \"secs\": %.6f, \"ops_per_sec\": %.1f}",
+            unit, ops, secs, secs > 0.0 ? ops/secs : 0.0);
+    fflush(jfp);
+    nresults++;
+}
+
+/* Write one interpolation accuracy result, as Lab delta E */
+static void report_err(
+    char *bench,            /* Benchmark name */
+    char *lu,                /* Lookup type */
+    char *interp,            /* Interpolation */
+    int inchan,                /* Input channels */
+    int res,                /* Grid resolution */
+    double n,                /* Number of samples */
+    double mean,            /* Mean delta E */
+    double max                /* Maximum delta E */
+) {
+    fprintf(jfp, "%s\n    {\"bench\": \"%s\", \"lu\": \"%s\", \"interp\": \"%s\", \"inchan\": %d, \"res\": %d",
+            nresults > 0 ? "," : "", bench, lu, interp, inchan, res);
+    fprintf(jfp, ", \"unit\": \"sample\", \"ops\": %.0f, \"mean_de\": %.6f, \"max_de\": %.6f}",
+            n, mean, max);
+    fflush(jfp);
+    nresults++;
+}
+
+/* Write one accuracy check result, and count it as a failure */
+/* if the maximum error is more than the bound */
+static void report_check(
+    char *bench,            /* Benchmark name */
+    char *lu,                /* Lookup type or NULL */
+    int res,                /* Grid resolution, 0 if none */
+    char *func,                /* Function or format checked */
+    double n,                /* Number of samples */
+    double maxerr,            /* Maximum error */
+    double bound            /* Maximum error allowed */
+) {
+    int pass = maxerr <= bound;
+
+    fprintf(jfp, "%s\n    {\"bench\": \"%s\"", nresults > 0 ? "," : "", bench);
+    if (lu != NULL)
+        fprintf(jfp, ", \"lu\": \"%s\"", lu);
+    if (res != 0)
+        fprintf(jfp, ", \"res\": %d", res);
+    fprintf(jfp, ", \"func\": \"%s\", \"unit\": \"sample\", \"ops\": %.0f"
+            ", \"max_err\": %g, \"bound\": %g, \"pass\": %s}",
+            func, n, maxerr, bound, pass ? "true" : "false");
+    fflush(jfp);
+    nresults++;
+
+    if (!pass) {
+        fprintf(stderr,"FAIL: %s %s%s%s maximum error %g is more than %g\n",bench,
+                lu != NULL ? lu : "", lu != NULL ? " " : "", func, maxerr, bound);
+        nfail++;
+    }
+}
+
+/* Deterministic pseudo-random number 0.0 - 1.0 */
+static unsigned int seed = 0x12345678;
+static double rand01(void) {
+    seed = seed * 1664525 + 1013904223;
+    return (seed >> 8) / 16777215.0;
+}
+
+/* ---------------------------------------------------------- */
+/* Synthetic profile creation */
+
+/* Add the tags every profile needs */
+static void add_common(icc *p) {
+    icmTextDescription *dp;
+    icmText *cp;
+    icmXYZArray *wp;
+
+    if ((dp = (icmTextDescription *)p->add_tag(p, icSigProfileDescriptionTag,
+                                               icSigTextDescriptionType)) == NULL)
+        error("add_tag failed: %d, %s",p->errc,p->err);
+    dp->size = strlen("iccbench") + 1;
+    dp->allocate((icmBase *)dp);
+    strcpy(dp->desc, "iccbench");
+
+    if ((cp = (icmText *)p->add_tag(p, icSigCopyrightTag, icSigTextType)) == NULL)
+        error("add_tag failed: %d, %s",p->errc,p->err);
+    cp->size = strlen("Public domain") + 1;
+    cp->allocate((icmBase *)cp);
+    strcpy(cp->data, "Public domain");
+
+    if ((wp = (icmXYZArray *)p->add_tag(p, icSigMediaWhitePointTag, icSigXYZType)) == NULL)
+        error("add_tag failed: %d, %s",p->errc,p->err);
+    wp->size = 1;
+    wp->allocate((icmBase *)wp);
+    wp->data[0] = icmD50;
+}
+
+/* Add a curve tag with a table of res entries */
+static void add_curve(icc *p, icTagSignature sig, int res, double gam) {
+    icmCurve *wo;
+    int i;
+
+    if ((wo = (icmCurve *)p->add_tag(p, sig, icSigCurveType)) == NULL)
+        error("add_tag failed: %d, %s",p->errc,p->err);
+    wo->flag = icmCurveSpec;
+    wo->size = res;
+    wo->allocate((icmBase *)wo);
+    for (i = 0; i < res; i++)
+        wo->data[i] = pow(i/(res - 1.0), gam);
+}
+
+/* Synthetic device -> Lab function. out[] may be the same as in[] */
+static void clutfunc(void *cntx, double *out, double *in) {
+    int inchan = *((int *)cntx);
+    double k = inchan > 3 ? in[3] : 0.0;
+    double L, a, b;
+
+    L = 100.0 * (1.0 - k) * (0.3 * in[0] + 0.6 * in[1] + 0.1 * in[2]);
+    a = 80.0 * (1.0 - k) * sin(3.0 * (in[0] - in[1]));
+    b = 80.0 * (1.0 - k) * sin(3.0 * (in[1] - in[2]));
+    out[0] = L;
+    out[1] = a;
+    out[2] = b;
+}
+
+/* clutfunc() with the first device channel reversed, so that the */
+/* function is no longer smoothest along the main diagonal */
+static void flipfunc(void *cntx, double *out, double *in) {
+    double tt[MAX_CHAN];
+    int inchan = *((int *)cntx), e;
+
+    for (e = 0; e < inchan; e++)
+        tt[e] = in[e];
+    tt[0] = 1.0 - tt[0];
+    clutfunc(cntx, out, tt);
+}
+
+/* Create a device -> Lab cLUT profile of func */
+static icc *make_lut(int inchan, int res, void (*func)(void *cntx, double *out, double *in),
+                     double *settime) {
+    icc *p;
+    icmLut *wo;
+    double stime;
+
+    if ((p = new_icc()) == NULL)
+        error("Creation of ICC object failed");
+    p->header->deviceClass = icSigInputClass;
+    p->header->colorSpace  = inchan == 3 ? icSigRgbData : icSigCmykData;
+    p->header->pcs         = icSigLabData;
+    p->header->renderingIntent = icPerceptual;
+    add_common(p);
+
+    if ((wo = (icmLut *)p->add_tag(p, icSigAToB0Tag, icSigLut16Type)) == NULL)
+        error("add_tag failed: %d, %s",p->errc,p->err);
+    wo->inputChan = inchan;
+    wo->outputChan = 3;
+    wo->clutPoints = res;
+    wo->inputEnt = 256;
+    wo->outputEnt = 256;
+    if (wo->allocate((icmBase *)wo) != 0)
+        error("allocate failed: %d, %s",p->errc,p->err);
+
+    stime = bench_time();
+    if (wo->set_tables(wo, ICM_CLUT_SET_EXACT, (void *)&inchan,
+                       p->header->colorSpace, icSigLabData,
+                       NULL, NULL, NULL, func, NULL, NULL, NULL) != 0)
+        error("set_tables failed: %d, %s",p->errc,p->err);
+    *settime = bench_time() - stime;
+
+    return p;
+}
+
+/* Create a V4 device -> Lab lutAtoB profile with parametric input curves. */
+/* This needs icclib to be compiled with ENABLE_V4_CREATE. */
+static icc *make_lutab(int inchan, int res) {
+    icc *p;
+    icmLutAB *wo;
+    unsigned int ix[MAX_CHAN], e, k;
+    double in[MAX_CHAN], out[3];
+
+    if ((p = new_icc()) == NULL)
+        error("Creation of ICC object failed");
+    if (p->set_version(p, icmVersion4_1) != 0)
+        error("set_version failed: %d, %s",p->errc,p->err);
+    p->header->deviceClass = icSigInputClass;
+    p->header->colorSpace  = inchan == 3 ? icSigRgbData : icSigCmykData;
+    p->header->pcs         = icSigLabData;
+    p->header->renderingIntent = icPerceptual;
+    add_common(p);
+
+    if ((wo = (icmLutAB *)p->add_tag(p, icSigAToB0Tag, icSigLutAtoBType)) == NULL)
+        error("add_tag failed: %d, %s",p->errc,p->err);
+    wo->inputChan = inchan;
+    wo->outputChan = 3;
+    wo->aclut = 1;
+    for (e = 0; e < (unsigned int)inchan; e++)
+        wo->clutPoints[e] = res;
+    if (wo->allocate((icmBase *)wo) != 0)
+        error("allocate failed: %d, %s",p->errc,p->err);
+
+    for (e = 0; e < (unsigned int)inchan; e++) {
+        icmCurve *cv = wo->aCurves[e];
+
+        cv->flag = icmCurvePara;
+        cv->ctype = icCurveFunction5;
+        if (cv->allocate((icmBase *)cv) != 0)
+            error("allocate failed: %d, %s",p->errc,p->err);
+        cv->data[0] = 1.0/0.45;
+        cv->data[1] = 1.0/1.099;
+        cv->data[2] = 0.099/1.099;
+        cv->data[3] = 1.0/4.5;
+        cv->data[4] = 0.081;
+    }
+
+    /* Fill the clut with the V4 normalized Lab of clutfunc() */
+    for (e = 0; e < (unsigned int)inchan; e++)
+        ix[e] = 0;
+    for (k = 0; k < wo->clutTable_size; k += 3) {
+        for (e = 0; e < (unsigned int)inchan; e++)
+            in[e] = ix[e]/(res - 1.0);
+        clutfunc((void *)&inchan, out, in);
+        wo->clutTable[k + 0] = out[0]/100.0;
+        wo->clutTable[k + 1] = (out[1] + 128.0)/255.0;
+        wo->clutTable[k + 2] = (out[2] + 128.0)/255.0;
+        for (e = inchan-1; e < (unsigned int)inchan; e--) {
+            if (++ix[e] < (unsigned int)res)
+                break;
+            ix[e] = 0;
+        }
+    }
+
+    return p;
+}
+
+/* Create an RGB matrix/shaper display profile */
+static icc *make_matrix(int res) {
+    icc *p;
+    icmXYZArray *wo;
+    static icTagSignature csigs[3] = { icSigRedColorantTag, icSigGreenColorantTag,
+                                       icSigBlueColorantTag };
+    static icTagSignature tsigs[3] = { icSigRedTRCTag, icSigGreenTRCTag, icSigBlueTRCTag };
+    static double prims[3][3] = {
+        { 0.4361, 0.2225, 0.0139 },
+        { 0.3851, 0.7169, 0.0971 },
+        { 0.1431, 0.0606, 0.7141 }
+    };
+    int i;
+
+    if ((p = new_icc()) == NULL)
+        error("Creation of ICC object failed");
+    p->header->deviceClass = icSigDisplayClass;
+    p->header->colorSpace  = icSigRgbData;
+    p->header->pcs         = icSigXYZData;
+    p->header->renderingIntent = icPerceptual;
+    add_common(p);
+
+    for (i = 0; i < 3; i++) {
+        if ((wo = (icmXYZArray *)p->add_tag(p, csigs[i], icSigXYZType)) == NULL)
+            error("add_tag failed: %d, %s",p->errc,p->err);
+        wo->size = 1;
+        wo->allocate((icmBase *)wo);
+        wo->data[0].X = prims[i][0];
+        wo->data[0].Y = prims[i][1];
+        wo->data[0].Z = prims[i][2];
+        add_curve(p, tsigs[i], res, 2.2 + 0.05 * i);
+    }
+
+    return p;
+}
+
+/* Create a monochrome display profile */
+static icc *make_mono(int res) {
+    icc *p;
+
+    if ((p = new_icc()) == NULL)
+        error("Creation of ICC object failed");
+    p->header->deviceClass = icSigDisplayClass;
+    p->header->colorSpace  = icSigGrayData;
+    p->header->pcs         = icSigXYZData;
+    p->header->renderingIntent = icPerceptual;
+    add_common(p);
+    add_curve(p, icSigGrayTRCTag, res, 2.2);
+
+    return p;
+}
+
+/* Serialize a profile to a malloced buffer */
+static unsigned char *serialize(icc *p, size_t *len) {
+    icmFile *fp;
+    unsigned char *buf;
+    unsigned int size;
+
+    if ((size = p->get_size(p)) == 0)
+        error("get_size failed: %d, %s",p->errc,p->err);
+    if ((buf = (unsigned char *)malloc(size)) == NULL)
+        error("malloc failed");
+    if ((fp = new_icmFileMem(buf, size)) == NULL)
+        error("new_icmFileMem failed");
+    if (p->write(p, fp, 0) != 0)
+        error("write failed: %d, %s",p->errc,p->err);
+    fp->del(fp);
+    *len = size;
+    return buf;
+}
+
+/* Read a profile from a memory buffer, taking ownership of the file */
+static icc *load(unsigned char *buf, size_t len) {
+    icmFile *fp;
+    icc *p;
+
+    if ((fp = new_icmFileMem(buf, len)) == NULL)
+        error("new_icmFileMem failed");
+    if ((p = new_icc()) == NULL)
+        error("Creation of ICC object failed");
+    if (p->read_x(p, fp, 0, 1) != 0)
+        error("read failed: %d, %s",p->errc,p->err);
+    if (p->read_all_tags(p) != 0)
+        error("read_all_tags failed: %d, %s",p->errc,p->err);
+    return p;
+}
+
+/* ---------------------------------------------------------- */
+/* Measurements */
+
+/* Time loading the profile */
+static void bench_load(char *lu, int inchan, int res, unsigned char *buf, size_t len) {
+    double stime, secs;
+    unsigned long n = 0;
+
+    stime = bench_time();
+    do {
+        icc *p = load(buf, len);
+        p->del(p);
+        n++;
+    } while ((secs = bench_time() - stime) < mintime);
+    report("load", lu, NULL, inchan, 0, res, "profile", (double)n, secs);
+    report("load_bytes", lu, NULL, inchan, 0, res, "byte", (double)n * len, secs);
+}
+
+/* Time writing the profile to memory, through an icmFile and with write_mem() */
+static void bench_write(icc *p, char *lu, int inchan, int res, size_t len) {
+    unsigned char *buf;
+    double stime, secs;
+    unsigned long n = 0;
+
+    if ((buf = (unsigned char *)malloc(len)) == NULL)
+        error("malloc failed");
+
+    stime = bench_time();
+    do {
+        icmFile *fp;
+        if ((fp = new_icmFileMem(buf, len)) == NULL)
+            error("new_icmFileMem failed");
+        if (p->write(p, fp, 0) != 0)
+            error("write failed: %d, %s",p->errc,p->err);
+        fp->del(fp);
+        n++;
+    } while ((secs = bench_time() - stime) < mintime);
+    report("write", lu, NULL, inchan, 0, res, "profile", (double)n, secs);
+
+    n = 0;
+    stime = bench_time();
+    do {
+        void *bp = buf;
+        size_t blen = len;
+        if (p->write_mem(p, &bp, &blen) != 0)
+            error("write_mem failed: %d, %s",p->errc,p->err);
+        n++;
+    } while ((secs = bench_time() - stime) < mintime);
+    report("write_mem", lu, NULL, inchan, 0, res, "profile", (double)n, secs);
+
+    free(buf);
+}
+
+/* Time loading the profile from a file, with per-tag reads and slurped */
+static void bench_load_file(char *lu, int inchan, int res, unsigned char *buf, size_t len) {
+    FILE *tf;
+    double stime, secs;
+    unsigned long n;
+    int slurp;
+
+    if ((tf = tmpfile()) == NULL || fwrite(buf, 1, len, tf) != len || fflush(tf) != 0)
+        error("Can't write temporary file");
+
+    for (slurp = 0; slurp < 2; slurp++) {
+        n = 0;
+        stime = bench_time();
+        do {
+            icmFile *fp;
+            icc *p;
+            int rv;
+
+            if ((fp = new_icmFileStd_fp(tf)) == NULL)
+                error("new_icmFileStd_fp failed");
+            if ((p = new_icc()) == NULL)
+                error("Creation of ICC object failed");
+            if (slurp)
+                rv = p->read_slurp(p, fp, 0, 1);
+            else
+                rv = p->read_x(p, fp, 0, 1);
+            if (rv != 0 || p->read_all_tags(p) != 0)
+                error("read failed: %d, %s",p->errc,p->err);
+            p->del(p);
+            n++;
+        } while ((secs = bench_time() - stime) < mintime);
+        report(slurp ? "load_file_slurp" : "load_file", lu, NULL, inchan, 0, res,
+               "profile", (double)n, secs);
+    }
+    fclose(tf);
+}
+
+/* Time computing the profile MD5 checksum the way check_id() does */
+static void bench_md5(char *lu, int inchan, int res, unsigned char *buf, size_t len) {
+    icmAlloc *al;
+    icmMD5 *md5;
+    ORD8 id[16];
+    double stime, secs;
+    unsigned long n = 0;
+
+    if ((al = new_icmAllocStd()) == NULL)
+        error("new_icmAllocStd failed");
+    if ((md5 = new_icmMD5(al)) == NULL)
+        error("new_icmMD5 failed");
+    stime = bench_time();
+    do {
+        md5->reset(md5);
+        md5->add(md5, buf, len);
+        md5->get(md5, id);
+        n++;
+    } while ((secs = bench_time() - stime) < mintime);
+    md5->del(md5);
+    al->del(al);
+    report("md5", lu, NULL, inchan, 0, res, "byte", (double)n * len, secs);
+}
+
+/* Time looking up NPIX random pixels through a lookup object */
+static void bench_lookup(char *bench, char *lu, char *interp, int inchan, int outchan,
+                         int res, icmLuBase *luo, double *inmin, double *inmax) {
+    double *in, *out;
+    double stime, secs;
+    unsigned long n = 0;
+    int i, e;
+
+    if ((in = (double *)malloc(NPIX * inchan * sizeof(double))) == NULL
+     || (out = (double *)malloc(NPIX * MAX_CHAN * sizeof(double))) == NULL)
+        error("malloc failed");
+    for (i = 0; i < NPIX; i++) {
+        for (e = 0; e < inchan; e++)
+            in[i * inchan + e] = inmin[e] + rand01() * (inmax[e] - inmin[e]);
+    }
+
+    stime = bench_time();
+    do {
+        for (i = 0; i < NPIX; i++)
+            luo->lookup(luo, out + i * MAX_CHAN, in + i * inchan);
+        n += NPIX;
+    } while ((secs = bench_time() - stime) < mintime);
+    report(bench, lu, interp, inchan, outchan, res, "pixel", (double)n, secs);
+
+    free(out);
+    free(in);
+}
+
+/* Time getting the forward lookup object of a loaded profile, */
+/* both made afresh and memoised */
+static void bench_get_luobj(icc *p, char *lu, int inchan, int res) {
+    icmLuBase *(*get[2])(icc *p, icmLookupFunc func, icRenderingIntent intent,
+                         icColorSpaceSignature pcsor, icmLookupOrder order);
+    static char *name[2] = { "get_luobj", "get_luobj_shared" };
+    double stime, secs;
+    unsigned long n;
+    int j;
+
+    get[0] = p->get_luobj;
+    get[1] = p->get_luobj_shared;
+    for (j = 0; j < 2; j++) {
+        n = 0;
+        stime = bench_time();
+        do {
+            icmLuBase *luo;
+            if ((luo = get[j](p, icmFwd, icmDefaultIntent, icmSigDefaultData,
+                              icmLuOrdNorm)) == NULL)
+                error("%s failed: %d, %s",name[j],p->errc,p->err);
+            luo->del(luo);
+            n++;
+        } while ((secs = bench_time() - stime) < mintime);
+        report(name[j], lu, NULL, inchan, 0, res, "object", (double)n, secs);
+    }
+}
+
+/* Time the forward and backward lookups of a loaded profile */
+static void bench_lu(icc *p, char *lu, int res, int bwd) {
+    icmLuBase *luo;
+    int inn, outn;
+    double inmin[MAX_CHAN], inmax[MAX_CHAN];
+    double outmin[MAX_CHAN], outmax[MAX_CHAN];
+
+    if ((luo = p->get_luobj(p, icmFwd, icmDefaultIntent, icmSigDefaultData, icmLuOrdNorm)) == NULL)
+        error("get_luobj failed: %d, %s",p->errc,p->err);
+    luo->spaces(luo, NULL, &inn, NULL, &outn, NULL, NULL, NULL, NULL, NULL);
+    luo->get_ranges(luo, inmin, inmax, outmin, outmax);
+
+    if (luo->ttype == icmLutType) {
+        icmLuLut *lul = (icmLuLut *)luo;
+
+        lul->set_interp(lul, icmInterpLinear);
+        bench_lookup("lookup_fwd", lu, "nl", inn, outn, res, luo, inmin, inmax);
+        lul->set_interp(lul, icmInterpSimplex);
+        bench_lookup("lookup_fwd", lu, "sx", inn, outn, res, luo, inmin, inmax);
+        if (lul->set_interp(lul, icmInterpOSimplex) != 0)
+            error("set_interp failed: %d, %s",p->errc,p->err);
+        bench_lookup("lookup_fwd", lu, "osx", inn, outn, res, luo, inmin, inmax);
+    } else if (luo->ttype == icmLutABType) {
+        icmLuLutAB *lul = (icmLuLutAB *)luo;
+        icmLutAB *lut = lul->lut;
+
+        lul->lookup_clut = lut->lookup_clut_nl;
+        bench_lookup("lookup_fwd", lu, "nl", inn, outn, res, luo, inmin, inmax);
+        lul->lookup_clut = lut->lookup_clut_sx;
+        bench_lookup("lookup_fwd", lu, "sx", inn, outn, res, luo, inmin, inmax);
+    } else {
+        bench_lookup("lookup_fwd", lu, NULL, inn, outn, res, luo, inmin, inmax);
+    }
+    luo->del(luo);
+
+    if (!bwd)
+        return;
+
+    /* Backward lookup exercises the reverse curve lookup */
+    if ((luo = p->get_luobj(p, icmBwd, icmDefaultIntent, icmSigDefaultData, icmLuOrdNorm)) == NULL)
+        error("get_luobj failed: %d, %s",p->errc,p->err);
+    luo->spaces(luo, NULL, &inn, NULL, &outn, NULL, NULL, NULL, NULL, NULL);
+    luo->get_ranges(luo, inmin, inmax, outmin, outmax);
+    if (luo->ttype == icmMonoBwdType) {        /* Keep Y within the device gamut */
+        inmin[0] = inmin[2] = 0.0;
+        inmax[0] = inmax[2] = 0.0;
+        inmax[1] = 1.0;
+    } else if (luo->ttype == icmMatrixBwdType) {
+        int e;
+        for (e = 0; e < 3; e++) {
+            inmin[e] = 0.0;
+            inmax[e] = icmD50_ary3[e] * 0.9;
+        }
+    }
+    bench_lookup("lookup_bwd", lu, NULL, inn, outn, res, luo, inmin, inmax);
+    luo->del(luo);
+}
+
+/* Time icmLuLookupPix() on a single thread, for each pixel depth */
+/* of an RGB buffer with alpha, to show the cost of the unpacking */
+static void bench_pix(icc *p, char *lu, int res) {
+    static struct {
+        char *bench;
+        icmPixDepth depth;
+    } fmts[] = {
+        { "lookup_pix8",  icmPix8 },
+        { "lookup_pix16", icmPix16 },
+        { "lookup_pix10", icmPix10 },
+        { "lookup_pixhalf", icmPixHalf },
+        { "lookup_pixfloat", icmPixFloat },
+        { NULL, 0 }
+    };
+    icmLuBase *luo;
+    icmPixFmt fmt;
+    unsigned char *in, *out;
+    double stime, secs;
+    unsigned long n;
+    int f, inn, outn;
+    size_t i, len;
+
+    if ((luo = p->get_luobj(p, icmFwd, icmDefaultIntent, icmSigDefaultData, icmLuOrdNorm)) == NULL)
+        error("get_luobj failed: %d, %s",p->errc,p->err);
+    luo->spaces(luo, NULL, &inn, NULL, &outn, NULL, NULL, NULL, NULL, NULL);
+
+    len = NPIX * 4 * sizeof(float);
+    if ((in = (unsigned char *)malloc(len)) == NULL
+     || (out = (unsigned char *)malloc(len)) == NULL)
+        error("malloc failed");
+
+    for (f = 0; fmts[f].bench != NULL; f++) {
+        icmPixFmtInit(&fmt, fmts[f].depth, inn + 1, 0, NPIX, 1);
+
+        /* Values 0.0 .. 1.0 suit the integer and floating point formats */
+        if (fmts[f].depth == icmPixHalf) {
+            for (i = 0; i < len/2; i++)
+                ((unsigned short *)in)[i] = (unsigned short)(0x3000 + (rand01() * 0xc00));
+        } else if (fmts[f].depth == icmPixFloat) {
+            for (i = 0; i < len/4; i++)
+                ((float *)in)[i] = (float)rand01();
+        } else {
+            for (i = 0; i < len; i++)
+                in[i] = (unsigned char)(rand01() * 255.0);
+        }
+
+        n = 0;
+        stime = bench_time();
+        do {
+            if (icmLuLookupPix(luo, out, &fmt, in, &fmt, NPIX, 1, 1) != 0)
+                error("icmLuLookupPix failed: %d, %s",p->errc,p->err);
+            n += NPIX;
+        } while ((secs = bench_time() - stime) < mintime);
+        report(fmts[f].bench, lu, NULL, inn, outn, res, "pixel", (double)n, secs);
+    }
+    luo->del(luo);
+
+    /* To the Lab PCS, which is converted a chunk at a time */
+    /* if the profile's own PCS is XYZ */
+    if ((luo = p->get_luobj(p, icmFwd, icmDefaultIntent, icSigLabData, icmLuOrdNorm)) == NULL)
+        error("get_luobj failed: %d, %s",p->errc,p->err);
+    icmPixFmtInit(&fmt, icmPixFloat, inn + 1, 0, NPIX, 1);
+    for (i = 0; i < len/4; i++)
+        ((float *)in)[i] = (float)rand01();
+    n = 0;
+    stime = bench_time();
+    do {
+        if (icmLuLookupPix(luo, out, &fmt, in, &fmt, NPIX, 1, 1) != 0)
+            error("icmLuLookupPix failed: %d, %s",p->errc,p->err);
+        n += NPIX;
+    } while ((secs = bench_time() - stime) < mintime);
+    report("lookup_pixfloat_lab", lu, NULL, inn, outn, res, "pixel", (double)n, secs);
+    luo->del(luo);
+
+    free(out);
+    free(in);
+}
+
+/* Convert a value to a half float, truncating. Only */
+/* for values within the normal half float range. */
+static unsigned short d2half(double v) {
+    unsigned short sign = v < 0.0 ? 0x8000 : 0;
+    double m;
+    int e;
+
+    m = frexp(fabs(v), &e);            /* fabs(v) = m * 2^e, 0.5 <= m < 1.0 */
+    if (v == 0.0 || e < -13)        /* Less than the smallest normal */
+        return sign;
+    return (unsigned short)(sign | ((e + 14) << 10) | ((int)(m * 2048.0) - 1024));
+}
+
+/* Convert a half float to a double, exactly */
+static double half2d(unsigned short h) {
+    int e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    double v;
+
+    v = e == 0 ? ldexp((double)m, -24) : ldexp((double)(m + 1024), e - 25);
+    return (h & 0x8000) ? -v : v;
+}
+
+/* Check that icmLuLookupPix() gives the same results through half float */
+/* and packed 10 bit buffers as through double buffers, to within the */
+/* precision of the format, and that double buffers give the same */
+/* results as the scalar lookup. The inputs are chosen so that they */
+/* are exactly representable in each format. */
+static void check_pix(icc *p, char *lu, int res) {
+    static struct {
+        char *name;
+        icColorSpaceSignature pcs;
+    } pcss[] = {
+        { "",     icmSigDefaultData },
+        { "_lab", icSigLabData }
+    };
+    icmLuBase *luo;
+    icmPixFmt ifmt, ofmt;
+    double inmin[MAX_CHAN], inmax[MAX_CHAN], outmin[MAX_CHAN], outmax[MAX_CHAN];
+    double *din, *dout, ref[MAX_CHAN];
+    unsigned short *hin, *hout;
+    ORD32 *win, *wout;
+    char name[20];
+    int inn, outn, e;
+    unsigned int i, j;
+
+    if ((din = (double *)malloc(NPIX * 3 * sizeof(double))) == NULL
+     || (dout = (double *)malloc(NPIX * 3 * sizeof(double))) == NULL
+     || (hin = (unsigned short *)malloc(NPIX * 3 * sizeof(unsigned short))) == NULL
+     || (hout = (unsigned short *)malloc(NPIX * 3 * sizeof(unsigned short))) == NULL
+     || (win = (ORD32 *)malloc(NPIX * sizeof(ORD32))) == NULL
+     || (wout = (ORD32 *)malloc(NPIX * sizeof(ORD32))) == NULL)
+        error("malloc failed");
+
+    for (j = 0; j < sizeof(pcss)/sizeof(pcss[0]); j++) {
+        double max;
+
+        if ((luo = p->get_luobj(p, icmFwd, icmDefaultIntent, pcss[j].pcs, icmLuOrdNorm)) == NULL)
+            error("get_luobj failed: %d, %s",p->errc,p->err);
+        luo->spaces(luo, NULL, &inn, NULL, &outn, NULL, NULL, NULL, NULL, NULL);
+        if (inn != 3 || outn != 3) {
+            luo->del(luo);
+            continue;
+        }
+        luo->get_ranges(luo, inmin, inmax, outmin, outmax);
+
+        /* Double buffers against the scalar lookup, relative to the output range */
+        for (i = 0; i < NPIX; i++) {
+            for (e = 0; e < 3; e++)
+                din[i * 3 + e] = inmin[e] + rand01() * (inmax[e] - inmin[e]);
+        }
+        icmPixFmtInit(&ifmt, icmPixDouble, 3, 0, NPIX, 1);
+        icmPixFmtInit(&ofmt, icmPixDouble, 3, 0, NPIX, 1);
+        if (icmLuLookupPix(luo, dout, &ofmt, din, &ifmt, NPIX, 1, 0) != 0)
+            error("icmLuLookupPix failed: %d, %s",p->errc,p->err);
+        for (max = 0.0, i = 0; i < NPIX; i++) {
+            luo->lookup(luo, ref, din + i * 3);
+            for (e = 0; e < 3; e++) {
+                double err = fabs(dout[i * 3 + e] - ref[e])/(outmax[e] - outmin[e]);
+                if (!(err <= max))        /* Catch NaN */
+                    max = err;
+            }
+        }
+        sprintf(name, "double%s", pcss[j].name);
+        report_check("pix_err", lu, res, name, (double)NPIX, max, 1e-9);
+
+        /* Half floats against doubles, relative to the value. The output */
+        /* is rounded to float and then to half, and the relative precision */
+        /* falls off below the smallest normal, 2^-14. */
+        for (i = 0; i < NPIX * 3; i++) {
+            e = i % 3;
+            hin[i] = d2half(inmin[e] + rand01() * (inmax[e] - inmin[e]));
+            din[i] = half2d(hin[i]);
+        }
+        if (icmLuLookupPix(luo, dout, &ofmt, din, &ifmt, NPIX, 1, 0) != 0)
+            error("icmLuLookupPix failed: %d, %s",p->errc,p->err);
+        icmPixFmtInit(&ifmt, icmPixHalf, 3, 0, NPIX, 1);
+        icmPixFmtInit(&ofmt, icmPixHalf, 3, 0, NPIX, 1);
+        if (icmLuLookupPix(luo, hout, &ofmt, hin, &ifmt, NPIX, 1, 0) != 0)
+            error("icmLuLookupPix failed: %d, %s",p->errc,p->err);
+        for (max = 0.0, i = 0; i < NPIX * 3; i++) {
+            double err = fabs(half2d(hout[i]) - dout[i])/(fabs(dout[i]) + ldexp(1.0, -14));
+            if (!(err <= max))
+                max = err;
+        }
+        sprintf(name, "half%s", pcss[j].name);
+        report_check("pix_err", lu, res, name, (double)NPIX, max,
+                     ldexp(1.0, -11) + ldexp(1.0, -23));
+
+        /* Packed 10 bit against doubles, in output code values */
+        for (i = 0; i < NPIX; i++) {
+            for (win[i] = 0, e = 0; e < 3; e++) {
+                ORD32 k = (ORD32)(rand01() * 1023.0 + 0.5);
+                win[i] |= k << (10 * e);
+                din[i * 3 + e] = (double)k * ((inmax[e] - inmin[e])/1023.0) + inmin[e];
+            }
+        }
+        icmPixFmtInit(&ifmt, icmPixDouble, 3, 0, NPIX, 1);
+        icmPixFmtInit(&ofmt, icmPixDouble, 3, 0, NPIX, 1);
+        if (icmLuLookupPix(luo, dout, &ofmt, din, &ifmt, NPIX, 1, 0) != 0)
+            error("icmLuLookupPix failed: %d, %s",p->errc,p->err);
+        icmPixFmtInit(&ifmt, icmPix10, 3, 0, NPIX, 1);
+        icmPixFmtInit(&ofmt, icmPix10, 3, 0, NPIX, 1);
+        if (icmLuLookupPix(luo, wout, &ofmt, win, &ifmt, NPIX, 1, 0) != 0)
+            error("icmLuLookupPix failed: %d, %s",p->errc,p->err);
+        for (max = 0.0, i = 0; i < NPIX; i++) {
+            for (e = 0; e < 3; e++) {
+                double ex = (dout[i * 3 + e] - outmin[e])/((outmax[e] - outmin[e])/1023.0);
+                double err;
+                ex = ex < 0.0 ? 0.0 : ex > 1023.0 ? 1023.0 : ex;
+                err = fabs((double)((wout[i] >> (10 * e)) & 0x3ff) - ex);
+                if (!(err <= max))
+                    max = err;
+            }
+        }
+        sprintf(name, "pix10%s", pcss[j].name);
+        report_check("pix_err", lu, res, name, (double)NPIX, max, 0.5 + 1e-6);
+
+        luo->del(luo);
+    }
+
+    free(wout);
+    free(win);
+    free(hout);
+    free(hin);
+    free(dout);
+    free(din);
+}
+
+/* Measure the error of each clut interpolation against the */
+/* function the clut was created from */
+static void bench_interp_err(char *lu, int inchan, int res,
+                             void (*func)(void *cntx, double *out, double *in)) {
+    static struct {
+        char *name;
+        icmClutInterp interp;
+    } interps[] = {
+        { "nl",  icmInterpLinear },
+        { "sx",  icmInterpSimplex },
+        { "osx", icmInterpOSimplex }
+    };
+    icc *p;
+    icmLuLut *luo;
+    double *in, out[MAX_CHAN], ref[MAX_CHAN];
+    double stime;
+    int i, j, e;
+
+    p = make_lut(inchan, res, func, &stime);
+    if ((luo = (icmLuLut *)p->get_luobj(p, icmFwd, icmDefaultIntent, icmSigDefaultData,
+                                        icmLuOrdNorm)) == NULL)
+        error("get_luobj failed: %d, %s",p->errc,p->err);
+
+    if ((in = (double *)malloc(NPIX * inchan * sizeof(double))) == NULL)
+        error("malloc failed");
+    for (i = 0; i < NPIX * inchan; i++)
+        in[i] = rand01();
+
+    for (j = 0; j < sizeof(interps)/sizeof(interps[0]); j++) {
+        double de, sum = 0.0, max = 0.0;
+
+        if (luo->set_interp(luo, interps[j].interp) != 0)
+            error("set_interp failed: %d, %s",p->errc,p->err);
+        for (i = 0; i < NPIX; i++) {
+            luo->lookup((icmLuBase *)luo, out, in + i * inchan);
+            func((void *)&inchan, ref, in + i * inchan);
+            for (de = 0.0, e = 0; e < 3; e++)
+                de += (out[e] - ref[e]) * (out[e] - ref[e]);
+            de = sqrt(de);
+            sum += de;
+            if (de > max)
+                max = de;
+        }
+        report_err("interp_err", lu, interps[j].name, inchan, res,
+                   (double)NPIX, sum/NPIX, max);
+    }
+
+    free(in);
+    luo->del((icmLuBase *)luo);
+    p->del(p);
+}
+
+/* Time the reverse curve lookup on its own */
+static void bench_curve_bwd(int res) {
+    icc *p;
+    icmCurve *cv;
+    double vals[NPIX], out;
+    double stime, secs;
+    unsigned long n = 0;
+    int i;
+
+    p = make_mono(res);
+    cv = (icmCurve *)p->read_tag(p, icSigGrayTRCTag);
+    for (i = 0; i < NPIX; i++)
+        vals[i] = rand01();
+    cv->lookup_bwd(cv, &out, &vals[0]);        /* Build the reverse table */
+
+    stime = bench_time();
+    do {
+        for (i = 0; i < NPIX; i++)
+            cv->lookup_bwd(cv, &out, &vals[i]);
+        n += NPIX;
+    } while ((secs = bench_time() - stime) < mintime);
+    report("curve_bwd", NULL, NULL, 1, 1, res, "value", (double)n, secs);
+
+    p->del(p);
+}
+
+/* Check the array Delta E functions against the scalar ones, on random */
+/* Lab pairs that exercise the hue angle approximations, and time them */
+static void bench_de(void) {
+    static struct {
+        char *name;
+        double (*de)(double *in0, double *in1);
+        void (*de_n)(double *out, double *in0, double *in1, unsigned int n);
+    } funcs[] = {
+        { "de76", icmLabDE,  icmLabDE_n },
+        { "de94", icmCIE94,  icmCIE94_n },
+        { "de2k", icmCIE2K,  icmCIE2K_n }
+    };
+    unsigned int n = NPIX * 16;
+    double *lab0, *lab1, *out;
+    double stime, secs;
+    unsigned long k;
+    unsigned int i, j;
+    int e;
+
+    if ((lab0 = (double *)malloc(n * 3 * sizeof(double))) == NULL
+     || (lab1 = (double *)malloc(n * 3 * sizeof(double))) == NULL
+     || (out = (double *)malloc(n * sizeof(double))) == NULL)
+        error("malloc failed");
+
+    for (i = 0; i < n; i++) {
+        double *v0 = lab0 + i * 3, *v1 = lab1 + i * 3;
+
+        v0[0] = 100.0 * rand01();
+        v0[1] = 256.0 * rand01() - 128.0;
+        v0[2] = 256.0 * rand01() - 128.0;
+        switch (i % 4) {
+            case 0:            /* Unrelated colors */
+                v1[0] = 100.0 * rand01();
+                v1[1] = 256.0 * rand01() - 128.0;
+                v1[2] = 256.0 * rand01() - 128.0;
+                break;
+            case 1:            /* Nearby colors */
+                for (e = 0; e < 3; e++)
+                    v1[e] = v0[e] + 4.0 * rand01() - 2.0;
+                break;
+            case 2:            /* Near neutral, including exact neutrals */
+                for (e = 1; e < 3; e++) {
+                    v0[e] = (i & 8) ? 0.0 : 0.02 * rand01() - 0.01;
+                    v1[e] = 0.02 * rand01() - 0.01;
+                }
+                v1[0] = v0[0] + rand01();
+                break;
+            case 3:            /* Opposite hues, where the mean hue wraps */
+                v1[0] = v0[0];
+                v1[1] = -v0[1] * (0.9 + 0.2 * rand01());
+                v1[2] = -v0[2] * (0.9 + 0.2 * rand01());
+                break;
+        }
+    }
+
+    for (j = 0; j < sizeof(funcs)/sizeof(funcs[0]); j++) {
+        char name[20];
+        double max = 0.0;
+
+        funcs[j].de_n(out, lab0, lab1, n);
+        for (i = 0; i < n; i++) {
+            double err = fabs(out[i] - funcs[j].de(lab0 + i * 3, lab1 + i * 3));
+            if (!(err <= max))        /* Catch NaN */
+                max = err;
+        }
+        report_check("de_err", NULL, 0, funcs[j].name, (double)n, max, 1e-8);
+
+        k = 0;
+        stime = bench_time();
+        do {
+            for (i = 0; i < n; i++)
+                out[i] = funcs[j].de(lab0 + i * 3, lab1 + i * 3);
+            k += n;
+        } while ((secs = bench_time() - stime) < mintime);
+        report(funcs[j].name, NULL, NULL, 0, 0, 0, "pair", (double)k, secs);
+
+        k = 0;
+        stime = bench_time();
+        do {
+            funcs[j].de_n(out, lab0, lab1, n);
+            k += n;
+        } while ((secs = bench_time() - stime) < mintime);
+        sprintf(name, "%s_n", funcs[j].name);
+        report(name, NULL, NULL, 0, 0, 0, "pair", (double)k, secs);
+    }
+
+    free(out);
+    free(lab1);
+    free(lab0);
+}
+
+/* Wrappers giving the conversions that don't use a white point */
+/* the same form as those that do */
+static void lab2lch(icmXYZNumber *w, double *out, double *in) { icmLab2LCh(out, in); }
+static void lch2lab(icmXYZNumber *w, double *out, double *in) { icmLCh2Lab(out, in); }
+static void xyz2yxy(icmXYZNumber *w, double *out, double *in) { icmXYZ2Yxy(out, in); }
+static void yxy2xyz(icmXYZNumber *w, double *out, double *in) { icmYxy2XYZ(out, in); }
+static void lab2lch_n(icmXYZNumber *w, double *out, double *in, unsigned int n) {
+    icmLab2LCh_n(out, in, n);
+}
+static void lch2lab_n(icmXYZNumber *w, double *out, double *in, unsigned int n) {
+    icmLCh2Lab_n(out, in, n);
+}
+static void xyz2yxy_n(icmXYZNumber *w, double *out, double *in, unsigned int n) {
+    icmXYZ2Yxy_n(out, in, n);
+}
+static void yxy2xyz_n(icmXYZNumber *w, double *out, double *in, unsigned int n) {
+    icmYxy2XYZ_n(out, in, n);
+}
+static void lab2lch_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n) {
+    icmLab2LCh_p(out, in, n);
+}
+static void lch2lab_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n) {
+    icmLCh2Lab_p(out, in, n);
+}
+static void xyz2yxy_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n) {
+    icmXYZ2Yxy_p(out, in, n);
+}
+static void yxy2xyz_p(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n) {
+    icmYxy2XYZ_p(out, in, n);
+}
+
+/* Check the interleaved and planar array color conversions against */
+/* the scalar ones, converting the _n versions in place */
+static void check_conv(void) {
+    static struct {
+        char *name;
+        int src;            /* Input values, 0 = XYZ, 1 = Lab, 2 = LCh, 3 = Yxy, 4 = Luv */
+        int hue;            /* Output channel that is a hue angle, -1 if none */
+        void (*cv)(icmXYZNumber *w, double *out, double *in);
+        void (*cv_n)(icmXYZNumber *w, double *out, double *in, unsigned int n);
+        void (*cv_p)(icmXYZNumber *w, double *out[3], double *in[3], unsigned int n);
+    } funcs[] = {
+        { "xyz2lab", 0, -1, icmXYZ2Lab, icmXYZ2Lab_n, icmXYZ2Lab_p },
+        { "lab2xyz", 1, -1, icmLab2XYZ, icmLab2XYZ_n, icmLab2XYZ_p },
+        { "lab2lch", 1,  2, lab2lch,    lab2lch_n,    lab2lch_p },
+        { "lch2lab", 2, -1, lch2lab,    lch2lab_n,    lch2lab_p },
+        { "xyz2yxy", 0, -1, xyz2yxy,    xyz2yxy_n,    xyz2yxy_p },
+        { "yxy2xyz", 3, -1, yxy2xyz,    yxy2xyz_n,    yxy2xyz_p },
+        { "xyz2luv", 0, -1, icmXYZ2Luv, icmXYZ2Luv_n, icmXYZ2Luv_p },
+        { "luv2xyz", 4, -1, icmLuv2XYZ, icmLuv2XYZ_n, icmLuv2XYZ_p }
+    };
+    unsigned int n = NPIX * 4;
+    double wht[3], *src[5], *out, *pin[3], *pout[3];
+    unsigned int i, j;
+    int e;
+
+    for (j = 0; j < 5; j++) {
+        if ((src[j] = (double *)malloc(n * 3 * sizeof(double))) == NULL)
+            error("malloc failed");
+    }
+    if ((out = (double *)malloc(n * 9 * sizeof(double))) == NULL)
+        error("malloc failed");
+    for (e = 0; e < 3; e++) {
+        pin[e] = out + (3 + e) * n;
+        pout[e] = out + (6 + e) * n;
+    }
+
+    /* Cubing the XYZ values puts some below the Lab linear segment */
+    wht[0] = icmD50.X;
+    wht[1] = icmD50.Y;
+    wht[2] = icmD50.Z;
+    for (i = 0; i < n; i++) {
+        double *xyz = src[0] + i * 3, *lab = src[1] + i * 3, s;
+
+        s = (i & 1) ? rand01() : rand01() * rand01() * rand01();
+        for (e = 0; e < 3; e++)
+            xyz[e] = 1e-6 + s * wht[e] * (0.5 + rand01());
+        lab[0] = 100.0 * rand01();
+        lab[1] = 256.0 * rand01() - 128.0;
+        lab[2] = 256.0 * rand01() - 128.0;
+        icmLab2LCh(src[2] + i * 3, lab);
+        icmXYZ2Yxy(src[3] + i * 3, xyz);
+        icmXYZ2Luv(&icmD50, src[4] + i * 3, xyz);
+    }
+
+    for (j = 0; j < sizeof(funcs)/sizeof(funcs[0]); j++) {
+        double *in = src[funcs[j].src];
+        char name[20];
+        double max_n = 0.0, max_p = 0.0;
+
+        memcpy(out, in, n * 3 * sizeof(double));
+        funcs[j].cv_n(&icmD50, out, out, n);
+        for (i = 0; i < n; i++) {
+            for (e = 0; e < 3; e++)
+                pin[e][i] = in[i * 3 + e];
+        }
+        funcs[j].cv_p(&icmD50, pout, pin, n);
+
+        for (i = 0; i < n; i++) {
+            double ref[3];
+
+            funcs[j].cv(&icmD50, ref, in + i * 3);
+            for (e = 0; e < 3; e++) {
+                double en = fabs(out[i * 3 + e] - ref[e]);
+                double ep = fabs(pout[e][i] - ref[e]);
+
+                if (e == funcs[j].hue) {
+                    en = en > 180.0 ? 360.0 - en : en;
+                    ep = ep > 180.0 ? 360.0 - ep : ep;
+                }
+                if (!(en <= max_n))        /* Catch NaN */
+                    max_n = en;
+                if (!(ep <= max_p))
+                    max_p = ep;
+            }
+        }
+        sprintf(name, "%s_n", funcs[j].name);
+        report_check("conv_err", NULL, 0, name, (double)n, max_n, 1e-8);
+        sprintf(name, "%s_p", funcs[j].name);
+        report_check("conv_err", NULL, 0, name, (double)n, max_p, 1e-8);
+    }
+
+    free(out);
+    for (j = 0; j < 5; j++)
+        free(src[j]);
+}
+
+/* Check icmArrayStats() against a two pass reference, on values */
+/* with a small spread about a large mean, that span several chunks */
+static void check_stats(void) {
+    unsigned int n = NPIX * 40;
+    icmAlloc *al;
+    icmStats st;
+    double *v, mean = 0.0, var = 0.0, max;
+    unsigned int i;
+
+    if ((al = new_icmAllocStd()) == NULL
+     || (v = (double *)malloc(n * sizeof(double))) == NULL)
+        error("malloc failed");
+    for (i = 0; i < n; i++) {
+        v[i] = 1e8 + rand01();
+        mean += v[i] - v[0];
+    }
+    mean = v[0] + mean/n;
+    for (i = 0; i < n; i++)
+        var += (v[i] - mean) * (v[i] - mean);
+    var /= n;
+
+    if (icmArrayStats(al, &st, v, n, 0) != 0)
+        error("icmArrayStats failed");
+    max = fabs(st.mean - mean)/mean;
+    report_check("stats_err", NULL, 0, "mean", (double)n, max, 1e-14);
+    max = fabs(st.stddev - sqrt(var))/sqrt(var);
+    if (!(max <= 1.0))        /* Catch NaN */
+        max = 1.0;
+    report_check("stats_err", NULL, 0, "stddev", (double)n, max, 1e-10);
+
+    free(v);
+    al->del(al);
+}
+
+/* Run all the measurements for one profile */
+static void bench_profile(icc *p, char *lu, int inchan, int res, int bwd) {
+    unsigned char *buf;
+    size_t len;
+    icc *rp;
+
+    buf = serialize(p, &len);
+    bench_write(p, lu, inchan, res, len);
+    bench_load(lu, inchan, res, buf, len);
+    bench_load_file(lu, inchan, res, buf, len);
+    bench_md5(lu, inchan, res, buf, len);
+
+    rp = load(buf, len);
+    bench_get_luobj(rp, lu, inchan, res);
+    bench_lu(rp, lu, res, bwd);
+    if (inchan == 3) {
+        bench_pix(rp, lu, res);
+        check_pix(rp, lu, res);
+    }
+    rp->del(rp);
+    free(buf);
+}
+
+/* ---------------------------------------------------------- */
+
+int
+main(int argc, char *argv[]) {
+    int fa;
+    int quick = 0;
+    char *outname = NULL;
+    int i, j;
+    static int lres3[] = { 9, 17, 33, 65, 0 };
+    static int lres4[] = { 9, 17, 33, 0 };
+    static int cres[] = { 256, 1024, 4096, 0 };
+
+    for (fa = 1; fa < argc; fa++) {
+        if (argv[fa][0] != '-')
+            usage();
+        if (argv[fa][1] == 'q') {
+            quick = 1;
+        } else if (argv[fa][1] == 't' && (fa+1) < argc) {
+            mintime = atof(argv[++fa]);
+        } else if (argv[fa][1] == 'o' && (fa+1) < argc) {
+            outname = argv[++fa];
+        } else {
+            usage();
+        }
+    }
+    if (quick) {
+        lres3[2] = lres4[1] = cres[1] = 0;
+    }
+
+    if (outname != NULL) {
+        if ((jfp = fopen(outname, "w")) == NULL)
+            error("Can't open output file '%s'",outname);
+    } else {
+        jfp = stdout;
+    }
+
+    fprintf(jfp, "{\n  \"iccbench\": 1,\n  \"npix\": %d,\n  \"mintime\": %f,\n  \"results\": [", NPIX, mintime);
+
+    /* cLUT profiles */
+    for (j = 3; j <= 4; j++) {
+        int *lres = j == 3 ? lres3 : lres4;
+        for (i = 0; lres[i] != 0; i++) {
+            icc *p;
+            double stime;
+
+            p = make_lut(j, lres[i], clutfunc, &stime);
+            report("set_tables", "lut", NULL, j, 3, lres[i], "table", 1.0, stime);
+            bench_profile(p, "lut", j, lres[i], 0);
+            p->del(p);
+
+            p = make_lutab(j, lres[i]);
+            bench_profile(p, "lutab", j, lres[i], 0);
+            p->del(p);
+
+            bench_interp_err("lut", j, lres[i], clutfunc);
+            bench_interp_err("lutflip", j, lres[i], flipfunc);
+        }
+    }
+
+    /* Shaper/matrix and monochrome profiles */
+    for (i = 0; cres[i] != 0; i++) {
+        icc *p;
+
+        p = make_matrix(cres[i]);
+        bench_profile(p, "matrix", 3, cres[i], 1);
+        p->del(p);
+
+        p = make_mono(cres[i]);
+        bench_profile(p, "mono", 1, cres[i], 1);
+        p->del(p);
+
+        bench_curve_bwd(cres[i]);
+    }
+
+    bench_de();
+    check_conv();
+    check_stats();
+
+    fprintf(jfp, "\n  ]\n}\n");
+    if (jfp != stdout)
+        fclose(jfp);
+
+    if (nfail > 0)
+        fprintf(stderr,"%d accuracy checks failed\n",nfail);
+
+    return nfail > 0 ? 1 : 0;
+}
+
@@ -0,0 +1,220 @@
+
+/*
+ * icclib profile catalogue.
+ *
+ * Builds an index of the headers and tag signatures of all the
+ * profiles found in a set of directory trees, and answers
+ * queries against it without re-reading the profiles.
+ *
+ * This material is licensed with an "MIT" free use license:-
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "icc.h"
+
+void
+error(char *fmt, ...)
+{
+    va_list args;
+
+    fprintf(stderr,"ERROR: ");
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+
+    exit(1);
+}
+
+void
+usage(void) {
+    fprintf(stderr,"usage: icccat -b index [-t threads] dir|file ...\n");
+    fprintf(stderr,"       icccat -q index [-c class] [-s space] [-p pcs] [-v major] [-i intent] [-g tag] ...\n");
+    fprintf(stderr," -b index    Build the index from the profiles in the given trees\n");
+    fprintf(stderr," -t threads  Number of threads to scan with (default all)\n");
+    fprintf(stderr," -q index    List the profiles in the index that match all of:\n");
+    fprintf(stderr," -c class    Device class signature, eg. prtr\n");
+    fprintf(stderr," -s space    Color space signature, eg. CMYK\n");
+    fprintf(stderr," -p pcs      PCS signature, eg. Lab\n");
+    fprintf(stderr," -v major    Major version, eg. 4\n");
+    fprintf(stderr," -i intent   Header rendering intent, 0 - 3\n");
+    fprintf(stderr," -g tag      Has tag signature, eg. A2B2 (up to %d)\n",ICM_CAT_MAXQTAGS);
+    exit(1);
+}
+
+/* Return a signature from a string, padding it with spaces */
+static ORD32 sig(char *s) {
+    char buf[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+        buf[i] = *s != '\000' ? *s++ : ' ';
+    if (*s != '\000')
+        error("Signature '%s' is more than 4 characters",s);
+    return str2tag(buf);
+}
+
+/* List of file paths */
+typedef struct {
+    char **paths;
+    unsigned int n, _n;
+} plist;
+
+static void add_path(plist *pl, char *path) {
+    if (pl->n >= pl->_n) {
+        pl->_n = pl->_n == 0 ? 1024 : 2 * pl->_n;
+        if ((pl->paths = (char **) realloc(pl->paths, pl->_n * sizeof(char *))) == NULL)
+            error("Malloc of path list failed");
+    }
+    if ((pl->paths[pl->n++] = strdup(path)) == NULL)
+        error("Malloc of path failed");
+}
+
+/* Add all the regular files in a directory tree. A symbolic link */
+/* named on the command line is followed, but within the tree only */
+/* links to files are, so that a link cycle can't recurse forever. */
+static void add_tree(plist *pl, char *path, int top) {
+    struct stat st;
+    DIR *dp;
+    struct dirent *de;
+    char *sub;
+
+    if ((top ? stat(path, &st) : lstat(path, &st)) != 0)
+        return;
+    if (S_ISLNK(st.st_mode) && (stat(path, &st) != 0 || !S_ISREG(st.st_mode)))
+        return;
+    if (S_ISREG(st.st_mode)) {
+        add_path(pl, path);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode) || (dp = opendir(path)) == NULL)
+        return;
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if ((sub = malloc(strlen(path) + strlen(de->d_name) + 2)) == NULL)
+            error("Malloc of path failed");
+        sprintf(sub, "%s/%s", path, de->d_name);
+        add_tree(pl, sub, 0);
+        free(sub);
+    }
+    closedir(dp);
+}
+
+int
+main(int argc, char *argv[]) {
+    int fa;
+    char *build = NULL, *query = NULL;
+    int nthreads = 0;
+    icmCatQuery q;
+    int rv;
+
+    memset(&q, 0, sizeof(icmCatQuery));
+    q.majv = q.intent = -1;
+
+    for (fa = 1; fa < argc; fa++) {
+        if (argv[fa][0] != '-')
+            break;
+        if ((fa+1) >= argc)
+            usage();
+        switch (argv[fa][1]) {
+            case 'b':
+                build = argv[++fa];
+                break;
+            case 'q':
+                query = argv[++fa];
+                break;
+            case 't':
+                nthreads = atoi(argv[++fa]);
+                break;
+            case 'c':
+                q.deviceClass = sig(argv[++fa]);
+                break;
+            case 's':
+                q.colorSpace = sig(argv[++fa]);
+                break;
+            case 'p':
+                q.pcs = sig(argv[++fa]);
+                break;
+            case 'v':
+                q.majv = atoi(argv[++fa]);
+                break;
+            case 'i':
+                q.intent = atoi(argv[++fa]);
+                break;
+            case 'g':
+                if (q.ntags >= ICM_CAT_MAXQTAGS)
+                    usage();
+                q.tags[q.ntags++] = sig(argv[++fa]);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (build != NULL && query == NULL) {
+        plist pl = { NULL, 0, 0 };
+        icmAlloc *al;
+        icmFile *op;
+        unsigned int i, nbad;
+
+        if (fa >= argc)
+            usage();
+        for (; fa < argc; fa++)
+            add_tree(&pl, argv[fa], 1);
+
+        if ((al = new_icmAllocStd()) == NULL)
+            error("Creation of allocator failed");
+        if ((op = new_icmFileStd_name(build,"w")) == NULL)
+            error("Cannot open file '%s'",build);
+        if ((rv = icmCatalogWrite(al, op, pl.paths, pl.n, nthreads, &nbad)) != 0)
+            error("Writing index '%s' failed: %d",build,rv);
+        op->del(op);
+        al->del(al);
+        for (i = 0; i < pl.n; i++)
+            free(pl.paths[i]);
+        free(pl.paths);
+
+        fprintf(stderr,"Indexed %u profiles, skipped %u other files\n",pl.n - nbad,nbad);
+
+    } else if (query != NULL && build == NULL) {
+        icmCatalog cat;
+        struct stat st;
+        void *buf;
+        unsigned int i;
+        int fd;
+
+        if (fa != argc)
+            usage();
+
+        /* Map the index, and query it in place */
+        if ((fd = open(query, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+            error("Cannot open file '%s'",query);
+        if ((buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+            error("Cannot map file '%s'",query);
+        if (icmCatalogInit(&cat, buf, st.st_size) != 0)
+            error("'%s' isn't a usable index",query);
+
+        for (i = 0; i < cat.h->count; i++) {
+            if (icmCatalogMatch(&cat, i, &q))
+                printf("%s\n", cat.str + cat.e[i].path);
+        }
+
+        munmap(buf, st.st_size);
+        close(fd);
+
+    } else {
+        usage();
+    }
+
+    return 0;
+}
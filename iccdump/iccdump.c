@@ -32,7 +32,9 @@ error(char *fmt, ...)
 
 void 
 usage(void) {
-    fprintf(stderr,"usage: iccdump infile\n");
+    fprintf(stderr,"usage: iccdump [-j] [-v level] infile\n");
+    fprintf(stderr," -j          Dump as JSON\n");
+    fprintf(stderr," -v level    Verbosity level 1 - 3 (default 3)\n");
     exit(1);
 }
 
@@ -41,16 +43,28 @@ int
 main(int argc, char *argv[]) {
     int offset = 0;        /* Offset to read profile from */
     int found;
+    int fa, json = 0, verb = 3;
     icmFile *fp, *op;
     icc *icco;
     int rv = 0;
     
-    if (argc < 2)
+    for (fa = 1; fa < argc; fa++) {
+        if (argv[fa][0] != '-')
+            break;
+        if (argv[fa][1] == 'j') {
+            json = 1;
+        } else if (argv[fa][1] == 'v' && (fa+1) < argc) {
+            verb = atoi(argv[++fa]);
+        } else {
+            usage();
+        }
+    }
+    if ((fa + 1) != argc)
         usage();
 
     /* Open up the file for reading */
-    if ((fp = new_icmFileStd_name(argv[1],"r")) == NULL)
-        error("Cannot open file '%s'", argv[1]);
+    if ((fp = new_icmFileStd_name(argv[fa],"r")) == NULL)
+        error("Cannot open file '%s'", argv[fa]);
 
     if ((icco = new_icc()) == NULL)
         error("Creation of ICC object failed");
@@ -105,11 +119,16 @@ main(int argc, char *argv[]) {
         }
 
         if (found) {
-            printf("Embedded ICC profile found at file offset %d (0x%x)\n",offset,offset);
             if ((rv = icco->read(icco,fp,offset)) != 0)
                 error("%d, %s", rv, icco->err);
-            else 
-                icco->dump(icco, op, 3);
+            else if (json) {
+                /* One JSON document per line for each embedded profile */
+                if ((rv = icco->dump_json(icco, op, verb)) != 0)
+                    error("%d, %s", rv, icco->err);
+            } else {
+                printf("Embedded ICC profile found at file offset %d (0x%x)\n",offset,offset);
+                icco->dump(icco, op, verb);
+            }
             offset += 128;
         }
     } while (found != 0);
@@ -0,0 +1,230 @@
+
+/*
+ * icclib device link creation.
+ *
+ * Links a source profile to a destination profile, sampling the
+ * source device -> PCS -> destination device conversion onto
+ * a cLUT, and writes the result as a device link profile.
+ * A display's vcgt calibration can be folded into the output.
+ * Alternatively the conversion can be written as a .cube 3D LUT
+ * or a raw float grid.
+ *
+ * This material is licensed with an "MIT" free use license:-
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "icc.h"
+
+void
+error(char *fmt, ...)
+{
+    va_list args;
+
+    fprintf(stderr,"ERROR: ");
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+
+    exit(1);
+}
+
+void
+usage(void) {
+    fprintf(stderr,"usage: icclink [-i intent] [-r res] [-e de] [-g] [-t threads] [-x c|f] src.icc dst.icc out\n");
+    fprintf(stderr," -i intent   p = perceptual, r = relative colorimetric,\n");
+    fprintf(stderr,"             s = saturation, a = absolute colorimetric\n");
+    fprintf(stderr,"             (default is the source profile intent)\n");
+    fprintf(stderr," -r res      cLUT grid resolution (default depends on inputs)\n");
+    fprintf(stderr," -e de       Use the smallest grid up to res with a 95%% DE2000 error <= de\n");
+    fprintf(stderr," -g          Apply the destination profile's vcgt calibration\n");
+    fprintf(stderr," -t threads  Number of threads to sample with (default all)\n");
+    fprintf(stderr," -x c        Write a .cube 3D LUT rather than a link profile\n");
+    fprintf(stderr," -x f        Write a raw little endian float grid rather than a link profile\n");
+    exit(1);
+}
+
+/* Read a profile */
+static icc *load(char *name) {
+    icmFile *fp;
+    icc *p;
+    int rv;
+
+    if ((fp = new_icmFileStd_name(name,"r")) == NULL)
+        error("Cannot open file '%s'",name);
+    if ((p = new_icc()) == NULL)
+        error("Creation of ICC object failed");
+    if ((rv = p->read_x(p, fp, 0, 1)) != 0)
+        error("Reading '%s' failed: %d, %s",name,rv,p->err);
+    return p;
+}
+
+/* Return the vcgt calibration of a display profile */
+static icmVideoCardGamma *get_vcgt(icc *p, char *name) {
+    icmVideoCardGamma *vg;
+
+    if ((vg = (icmVideoCardGamma *)p->read_tag(p, icSigVideoCardGammaTag)) == NULL
+     || vg->ttype != icSigVideoCardGammaType)
+        error("'%s' has no vcgt calibration",name);
+    if (p->header->colorSpace != icSigRgbData)
+        error("'%s' isn't an RGB profile",name);
+    return vg;
+}
+
+/* The source -> destination conversion being exported */
+typedef struct {
+    icmLuBase *src, *dst;
+    icmVideoCardGamma *cal;        /* Calibration, NULL if none */
+} chain;
+
+static void chain_func(void *cntx, double *out, double *in) {
+    chain *cp = (chain *)cntx;
+    double pcs[MAX_CHAN];
+
+    cp->src->lookup(cp->src, pcs, in);
+    cp->dst->lookup(cp->dst, out, pcs);
+    if (cp->cal != NULL)
+        icmVideoCardGammaCal((void *)cp->cal, out, out);
+}
+
+/* Sample the conversion straight from the two profiles, */
+/* rather than from a link cLUT, and write it as a grid file. */
+static void export(icc *src, icc *dst, icRenderingIntent intent, int res, int nthreads,
+                   icmVideoCardGamma *cal, icmGridFormat fmt, char *name) {
+    chain ch;
+    icmFile *op;
+    double inmin[MAX_CHAN], inmax[MAX_CHAN], outmin[MAX_CHAN], outmax[MAX_CHAN];
+    int inn, outn, rv;
+
+    ch.cal = cal;
+    if (intent == icmDefaultIntent)
+        intent = src->header->renderingIntent;
+    if ((ch.src = src->get_luobj(src, icmFwd, intent, src->header->pcs, icmLuOrdNorm)) == NULL)
+        error("Source lookup failed: %d, %s",src->errc,src->err);
+    if ((ch.dst = dst->get_luobj(dst, icmBwd, intent, src->header->pcs, icmLuOrdNorm)) == NULL)
+        error("Destination lookup failed: %d, %s",dst->errc,dst->err);
+    ch.src->spaces(ch.src, NULL, &inn, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    ch.dst->spaces(ch.dst, NULL, NULL, NULL, &outn, NULL, NULL, NULL, NULL, NULL);
+    ch.src->get_ranges(ch.src, inmin, inmax, outmin, outmax);
+
+    if (res == 0)
+        res = 33;
+    if ((op = new_icmFileStd_name(name,"w")) == NULL)
+        error("Cannot open file '%s'",name);
+    rv = icmWriteGrid(src->al, op, fmt, "icclink", res, inn, outn, inmin, inmax,
+                      (void *)&ch, chain_func, nthreads);
+    if (rv == 1)
+        error("Can't write %d -> %d channels at resolution %d in that format",inn,outn,res);
+    else if (rv != 0)
+        error("Writing '%s' failed: %d",name,rv);
+
+    op->del(op);
+    ch.src->del(ch.src);
+    ch.dst->del(ch.dst);
+}
+
+int
+main(int argc, char *argv[]) {
+    int fa;
+    icRenderingIntent intent = icmDefaultIntent;
+    int res = 0, nthreads = 0;
+    double maxde = -1.0;
+    int xport = 0, calib = 0;
+    icmGridFormat fmt = icmGridCube;
+    icmVideoCardGamma *cal = NULL;
+    icc *src, *dst, *lp;
+    icmFile *op;
+    int rv;
+
+    for (fa = 1; fa < argc; fa++) {
+        if (argv[fa][0] != '-')
+            break;
+        if (argv[fa][1] == 'i' && (fa+1) < argc) {
+            switch (argv[++fa][0]) {
+                case 'p':
+                    intent = icPerceptual;
+                    break;
+                case 'r':
+                    intent = icRelativeColorimetric;
+                    break;
+                case 's':
+                    intent = icSaturation;
+                    break;
+                case 'a':
+                    intent = icAbsoluteColorimetric;
+                    break;
+                default:
+                    usage();
+            }
+        } else if (argv[fa][1] == 'r' && (fa+1) < argc) {
+            res = atoi(argv[++fa]);
+        } else if (argv[fa][1] == 'e' && (fa+1) < argc) {
+            maxde = atof(argv[++fa]);
+        } else if (argv[fa][1] == 'g') {
+            calib = 1;
+        } else if (argv[fa][1] == 't' && (fa+1) < argc) {
+            nthreads = atoi(argv[++fa]);
+        } else if (argv[fa][1] == 'x' && (fa+1) < argc) {
+            xport = 1;
+            switch (argv[++fa][0]) {
+                case 'c':
+                    fmt = icmGridCube;
+                    break;
+                case 'f':
+                    fmt = icmGridFloat;
+                    break;
+                default:
+                    usage();
+            }
+        } else {
+            usage();
+        }
+    }
+    if ((fa + 3) != argc)
+        usage();
+
+    src = load(argv[fa]);
+    dst = load(argv[fa+1]);
+    if (calib)
+        cal = get_vcgt(dst, argv[fa+1]);
+
+    if (xport) {
+        export(src, dst, intent, res, nthreads, cal, fmt, argv[fa+2]);
+        src->del(src);
+        dst->del(dst);
+        return 0;
+    }
+
+    if ((lp = new_icc()) == NULL)
+        error("Creation of ICC object failed");
+    if (maxde >= 0.0) {
+        icmLinkFit fit;
+
+        if ((rv = lp->create_link_fit(lp, src, dst, intent, maxde, res, &fit,
+                                      cal != NULL ? icmVideoCardGammaCal : NULL, (void *)cal,
+                                      nthreads)) != 0)
+            error("Creating link failed: %d, %s",rv,lp->err);
+        fprintf(stderr,"Resolution %d%s, DE2000 mean %f, 95%% %f, max %f over %u points%s\n",
+                fit.res, fit.shaped ? " shaped" : "", fit.de.mean, fit.p95, fit.de.max,
+                fit.de.n, fit.met ? "" : " (target not met)");
+    } else if ((rv = lp->create_link_x(lp, src, dst, intent, res,
+                                       cal != NULL ? icmVideoCardGammaCal : NULL, (void *)cal,
+                                       nthreads)) != 0) {
+        error("Creating link failed: %d, %s",rv,lp->err);
+    }
+
+    if ((op = new_icmFileStd_name(argv[fa+2],"w")) == NULL)
+        error("Cannot open file '%s'",argv[fa+2]);
+    if ((rv = lp->write(lp, op, 0)) != 0)
+        error("Writing '%s' failed: %d, %s",argv[fa+2],rv,lp->err);
+
+    op->del(op);
+    lp->del(lp);
+    src->del(src);
+    dst->del(dst);
+
+    return 0;
+}
@@ -0,0 +1,268 @@
+
+/*
+ * icclib profile round trip check.
+ *
+ * Samples the device space of each profile, converts the samples
+ * to Lab with the forward (AToB) lookup, back to device values with
+ * the backward (BToA) lookup and to Lab again, and reports the Delta E
+ * between the two Lab values for each intent, along with the lookup
+ * throughput. The lookups are done in batches using several threads,
+ * so that every profile can be checked quickly. The exit status is
+ * non-zero if a profile fails, so the check can gate a build.
+ *
+ * This material is licensed with an "MIT" free use license:-
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+#include "icc.h"
+
+#define DEF_NSAMP 65536        /* Default number of device samples */
+#define HSKIP 17            /* Initial Halton sequence values skipped */
+
+void
+error(char *fmt, ...)
+{
+    va_list args;
+
+    fprintf(stderr,"ERROR: ");
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+
+    exit(1);
+}
+
+void
+usage(void) {
+    fprintf(stderr,"usage: iccqa [-n samples] [-i intents] [-l de] [-t threads] profile.icc ...\n");
+    fprintf(stderr," -n samples  Number of device space samples (default %d)\n",DEF_NSAMP);
+    fprintf(stderr," -i intents  Intents to check, any of p = perceptual, r = relative colorimetric,\n");
+    fprintf(stderr,"             s = saturation, a = absolute colorimetric (default prsa)\n");
+    fprintf(stderr," -l de       Fail if an intent's 95%% DE2000 is more than de\n");
+    fprintf(stderr," -t threads  Number of threads to look up with (default all)\n");
+    exit(1);
+}
+
+/* Return a monotonic time in seconds */
+static double qa_time(void) {
+#if defined(_WIN32)
+    return (double)clock()/CLOCKS_PER_SEC;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+/* Fill dev[] with n stratified samples of the inn channel device space: */
+/* the corners of the space, then a Halton sequence. */
+static void sample(double *dev, unsigned int n, int inn, double *min, double *max) {
+    unsigned int i, ncorn = inn <= 8 ? 1 << inn : 0;
+    int e;
+
+    for (i = 0; i < n; i++, dev += inn) {
+        if (i < ncorn) {
+            for (e = 0; e < inn; e++)
+                dev[e] = (i >> e) & 1 ? max[e] : min[e];
+        } else {
+            icmHaltonPoint(dev, i - ncorn + HSKIP, inn, min, max);
+        }
+    }
+}
+
+/* Look up n values between two buffers of doubles, and */
+/* return the rate in pixels per second. The first value is */
+/* looked up before the timing starts, so that anything the */
+/* lookup creates lazily, such as reverse tables, isn't timed. */
+static double lookup(icmLuBase *lu, double *out, int outn, double *in, int inn,
+                     unsigned int n, int nthreads) {
+    icmPixFmt ifmt, ofmt;
+    double stime, secs;
+
+    icmPixFmtInit(&ifmt, icmPixDouble, inn, 0, n, 1);
+    icmPixFmtInit(&ofmt, icmPixDouble, outn, 0, n, 1);
+    if (icmLuLookupPix(lu, out, &ofmt, in, &ifmt, 1, 1, 1) != 0)
+        error("Lookup failed: %d, %s",lu->icp->errc,lu->icp->err);
+    stime = qa_time();
+    if (icmLuLookupPix(lu, out, &ofmt, in, &ifmt, n, 1, nthreads) != 0)
+        error("Lookup failed: %d, %s",lu->icp->errc,lu->icp->err);
+    secs = qa_time() - stime;
+    return secs > 0.0 ? n/secs : 0.0;
+}
+
+/* Round trip the samples through one intent. Print the results */
+/* and return nz if the 95th percentile DE2000 is over the limit. */
+static int check_intent(icc *p, icRenderingIntent intent, char *iname, double *dev,
+                        unsigned int n, int inn, double limit, int nthreads) {
+    icmLuBase *fwd, *bwd;
+    double *dev1, *lab0, *lab1, *de;
+    double fwdrate, bwdrate, p95[3];
+    double pct = 95.0;
+    icmStats st[3];
+    int m, fail = 0;
+    static char *mname[3] = { "DE76", "DE94", "DE2000" };
+
+    if ((fwd = p->get_luobj(p, icmFwd, intent, icSigLabData, icmLuOrdNorm)) == NULL) {
+        printf("  %-10s no forward lookup\n",iname);
+        return 0;
+    }
+    if ((bwd = p->get_luobj(p, icmBwd, intent, icSigLabData, icmLuOrdNorm)) == NULL) {
+        printf("  %-10s no backward lookup\n",iname);
+        fwd->del(fwd);
+        return 0;
+    }
+
+    if ((dev1 = (double *)malloc(sizeof(double) * n * inn)) == NULL
+     || (lab0 = (double *)malloc(sizeof(double) * n * 3)) == NULL
+     || (lab1 = (double *)malloc(sizeof(double) * n * 3)) == NULL
+     || (de = (double *)malloc(sizeof(double) * n)) == NULL)
+        error("Malloc of %u samples failed",n);
+
+    lookup(fwd, lab0, 3, dev, inn, n, nthreads);
+    bwdrate = lookup(bwd, dev1, inn, lab0, 3, n, nthreads);
+    fwdrate = lookup(fwd, lab1, 3, dev1, inn, n, nthreads);
+
+    printf("  %-10s",iname);
+    for (m = 0; m < 3; m++) {
+        if (m == 0)
+            icmLabDE_n(de, lab0, lab1, n);
+        else if (m == 1)
+            icmCIE94_n(de, lab0, lab1, n);
+        else
+            icmCIE2K_n(de, lab0, lab1, n);
+        if (icmArrayStats(p->al, &st[m], de, n, nthreads) != 0
+         || icmArrayPercentiles(p->al, &p95[m], &pct, 1, de, n) != 0)
+            error("Malloc of statistics failed");
+        printf(" %s %.3f/%.3f/%.3f ",mname[m],st[m].mean,p95[m],st[m].max);
+    }
+    if (limit >= 0.0 && p95[2] > limit)
+        fail = 1;
+    printf(" fwd %.2f bwd %.2f Mpix/s%s\n",fwdrate/1e6,bwdrate/1e6,fail ? " FAIL" : "");
+
+    free(de);
+    free(lab1);
+    free(lab0);
+    free(dev1);
+    bwd->del(bwd);
+    fwd->del(fwd);
+
+    return fail;
+}
+
+/* Check one profile, returning nz if it fails */
+static int check(char *name, char *intents, unsigned int n, double limit, int nthreads) {
+    static struct {
+        char c;
+        icRenderingIntent intent;
+        char *name;
+    } itab[] = {
+        { 'p', icPerceptual,           "perceptual" },
+        { 'r', icRelativeColorimetric, "relative" },
+        { 's', icSaturation,           "saturation" },
+        { 'a', icAbsoluteColorimetric, "absolute" },
+        { 0, 0, NULL }
+    };
+    icmFile *fp;
+    icc *p;
+    icmLuBase *lu;
+    double *dev, min[MAX_CHAN], max[MAX_CHAN], outmin[MAX_CHAN], outmax[MAX_CHAN];
+    int inn, i, fail = 0;
+
+    if ((fp = new_icmFileStd_name(name,"r")) == NULL)
+        error("Cannot open file '%s'",name);
+    if ((p = new_icc()) == NULL)
+        error("Creation of ICC object failed");
+    if (p->read_x(p, fp, 0, 1) != 0) {
+        printf("%s: can't read: %s\n",name,p->err);
+        p->del(p);
+        return 1;
+    }
+
+    if (p->header->deviceClass == icSigLinkClass
+     || p->header->deviceClass == icSigAbstractClass
+     || p->header->deviceClass == icSigNamedColorClass) {
+        printf("%s: %s profile, nothing to round trip\n",name,
+               icm2str(icmProfileClassSignature, p->header->deviceClass));
+        p->del(p);
+        return 0;
+    }
+
+    /* The device space range */
+    if ((lu = p->get_luobj(p, icmFwd, icmDefaultIntent, icSigLabData, icmLuOrdNorm)) == NULL) {
+        printf("%s: no forward lookup: %s\n",name,p->err);
+        p->del(p);
+        return 1;
+    }
+    lu->spaces(lu, NULL, &inn, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    lu->get_ranges(lu, min, max, outmin, outmax);
+    lu->del(lu);
+
+    if ((dev = (double *)malloc(sizeof(double) * n * inn)) == NULL)
+        error("Malloc of %u samples failed",n);
+    sample(dev, n, inn, min, max);
+
+    printf("%s: %s %s, %u samples, DE mean/95%%/max\n",name,
+           icm2str(icmColorSpaceSignature, p->header->colorSpace),
+           icm2str(icmProfileClassSignature, p->header->deviceClass), n);
+    for (i = 0; itab[i].name != NULL; i++) {
+        if (strchr(intents, itab[i].c) != NULL)
+            fail |= check_intent(p, itab[i].intent, itab[i].name, dev, n, inn, limit, nthreads);
+    }
+
+    free(dev);
+    p->del(p);
+
+    return fail;
+}
+
+int
+main(int argc, char *argv[]) {
+    int fa;
+    unsigned int n = DEF_NSAMP;
+    char *intents = "prsa";
+    double limit = -1.0;
+    int nthreads = 0;
+    int fail = 0;
+
+    for (fa = 1; fa < argc; fa++) {
+        if (argv[fa][0] != '-')
+            break;
+        if ((fa+1) >= argc)
+            usage();
+        switch (argv[fa][1]) {
+            case 'n':
+                n = atoi(argv[++fa]);
+                break;
+            case 'i':
+                intents = argv[++fa];
+                break;
+            case 'l':
+                limit = atof(argv[++fa]);
+                break;
+            case 't':
+                nthreads = atoi(argv[++fa]);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (fa >= argc || n < 1)
+        usage();
+
+    for (; fa < argc; fa++)
+        fail |= check(argv[fa], intents, n, limit, nthreads);
+
+    return fail;
+}